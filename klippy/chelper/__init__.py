@@ -1,9 +1,9 @@
 # Wrapper around C helper code
 #
-# Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging
+import sys, os, re, logging, tempfile, shutil
 import cffi
 
 
@@ -18,29 +18,62 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pollreactor.c', 'msgblock.c', 'trdispatch.c', 'stepgen.c', 'bulkdecode.c',
+    'lookahead.c', 'gcodeparse.c', 'gcodearc.c', 'bedmesh.c', 'eddyscan.c',
+    'movetransform.c', 'canbus_sched.c', 'msgdump.c', 'histstore.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
     'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c',
 ]
 DEST_LIB = "c_helper.so"
+API_MODULE = "_chelper_api"
+API_COMPILE_ARGS = ["-Wall", "-Wno-sign-compare", "-g", "-O2"]
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'gcodeparse.h',
+    'canbus_sched.h', 'histstore.h'
 ]
 
 defs_stepcompress = """
     struct pull_history_steps {
         uint64_t first_clock, last_clock;
         int64_t start_position;
-        int step_count, interval, add;
+        int step_count, interval, add, add2;
+    };
+    struct stepcompress_stats {
+        uint64_t msg_count, msg_bytes, adaptive_bytes, history_bytes;
+        uint64_t history_peak_bytes, queue_bytes;
+    };
+
+    #define STEP_STATS_BUCKETS 32
+    struct stepcompress_rate_stats {
+        uint64_t step_count, move_count, msg_bytes;
+        uint32_t min_interval, max_window_bytes;
+        uint32_t interval_hist[STEP_STATS_BUCKETS];
+        uint32_t count_hist[STEP_STATS_BUCKETS];
+        uint32_t bytes_hist[STEP_STATS_BUCKETS];
     };
 
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+    void stepcompress_set_queue_step2(struct stepcompress *sc
+        , int32_t queue_step2_msgtag);
+    void stepcompress_set_queue_step_dir(struct stepcompress *sc
+        , int32_t queue_step_dir_msgtag);
+    void stepcompress_set_queue_step_batch(struct stepcompress *sc
+        , int32_t queue_step_batch_msgtag);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
+    void stepcompress_set_adaptive_error(struct stepcompress *sc
+        , double ratio, uint32_t adaptive_max_error);
+    void stepcompress_get_stats(struct stepcompress *sc
+        , struct stepcompress_stats *stats);
+    void stepcompress_set_history_limit(struct stepcompress *sc
+        , size_t max_bytes);
+    void stepcompress_get_rate_stats(struct stepcompress *sc
+        , struct stepcompress_rate_stats *stats);
+    void stepcompress_reset_rate_stats(struct stepcompress *sc);
     void stepcompress_free(struct stepcompress *sc);
     int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
     int stepcompress_set_last_position(struct stepcompress *sc
@@ -51,6 +84,9 @@ defs_stepcompress = """
         , uint32_t *data, int len);
     int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
         , uint32_t *data, int len);
+    int stepcompress_queue_mq_buffer(struct stepcompress *sc
+        , uint64_t req_clock, uint64_t done_clock, int move_count
+        , uint32_t *data, int len, uint8_t *buf, int buf_len);
     int stepcompress_extract_old(struct stepcompress *sc
         , struct pull_history_steps *p, int max
         , uint64_t start_clock, uint64_t end_clock);
@@ -78,6 +114,19 @@ defs_itersolve = """
     void itersolve_set_position(struct stepper_kinematics *sk
         , double x, double y, double z);
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+    void itersolve_sample_positions(struct stepper_kinematics *sk
+        , double start_time, double sample_time, int count
+        , double *positions);
+    void itersolve_set_gang(struct stepper_kinematics *sk
+        , struct stepper_kinematics **followers, int count);
+"""
+
+defs_stepgen = """
+    struct stepgen_pool *stepgen_pool_alloc(int num_threads
+        , int sched_priority, uint64_t sched_cpu_mask);
+    void stepgen_pool_free(struct stepgen_pool *sp);
+    int32_t stepgen_pool_generate(struct stepgen_pool *sp
+        , struct stepper_kinematics **sk_list, int sk_num, double flush_time);
 """
 
 defs_trapq = """
@@ -99,10 +148,83 @@ defs_trapq = """
         , double clear_history_time);
     void trapq_set_position(struct trapq *tq, double print_time
         , double pos_x, double pos_y, double pos_z);
+    void trapq_set_history_limit(struct trapq *tq, size_t max_bytes);
+    size_t trapq_get_history_bytes(struct trapq *tq);
+    size_t trapq_get_history_peak_bytes(struct trapq *tq);
     int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         , double start_time, double end_time);
 """
 
+defs_lookahead = """
+    struct lookahead *lookahead_alloc(void);
+    void lookahead_free(struct lookahead *la);
+    void lookahead_reset(struct lookahead *la);
+    double lookahead_add_move(struct lookahead *la, double *start_pos
+        , double *end_pos, double *axes_r, double move_d, double accel
+        , double junction_deviation, double max_cruise_v2, double delta_v2
+        , double smooth_delta_v2, double extruder_v2, int is_kinematic
+        , struct trapq *extruder_tq);
+    void lookahead_set_kin_limits(struct lookahead *la, double *limits_min
+        , double *limits_max, double max_z_velocity, double max_z_accel);
+    void lookahead_limit_next_junction(struct lookahead *la, double speed_v2);
+    void lookahead_note_callback(struct lookahead *la);
+    int lookahead_flush(struct lookahead *la, int lazy);
+    int lookahead_queue_moves(struct lookahead *la, struct trapq *tq, int pos
+        , int count, double print_time, double *pnext_time);
+"""
+
+defs_gcodeparse = """
+    struct gcode_move_line {
+        int cmd, params;
+        double values[5];
+    };
+
+    int gcode_parse_moves(struct gcode_move_line *lines, int max
+        , const char *data, int len);
+    int gcode_pack_moves(struct gcode_move_line *lines, int count
+        , uint8_t *buf);
+    int gcode_unpack_moves(struct gcode_move_line *lines, int count
+        , const uint8_t *buf, int len);
+
+    struct gcode_arc {
+        double start_pos[4], target_pos[3], offset[2];
+        int clockwise, alpha_axis, beta_axis, helical_axis;
+        double mm_per_arc_segment;
+        int has_e, absolute_extrude, has_f;
+        double e, f;
+        double center_p, center_q, theta_per_segment, linear_per_segment;
+        double e_base, e_per_move;
+        int64_t segments, pos;
+    };
+
+    int64_t gcode_arc_plan(struct gcode_arc *a);
+    int gcode_arc_fill(struct gcode_arc *a, struct gcode_move_line *lines
+        , int max);
+"""
+
+defs_bedmesh = """
+    struct bed_mesh *bed_mesh_alloc(void);
+    void bed_mesh_free(struct bed_mesh *bm);
+    void bed_mesh_set_matrix(struct bed_mesh *bm, double *matrix
+        , int x_count, int y_count, double x_min, double y_min
+        , double x_dist, double y_dist);
+    void bed_mesh_set_offsets(struct bed_mesh *bm, double x_offset
+        , double y_offset);
+    double bed_mesh_calc_z(struct bed_mesh *bm, double x, double y);
+    void bed_mesh_calc_z_batch(struct bed_mesh *bm, double *positions
+        , double *z_values, int count);
+    struct mesh_splitter *mesh_splitter_alloc(void);
+    void mesh_splitter_free(struct mesh_splitter *ms);
+    void mesh_splitter_set_params(struct mesh_splitter *ms
+        , double split_delta_z, double move_check_distance
+        , double fade_offset);
+    void mesh_splitter_build_move(struct mesh_splitter *ms
+        , struct bed_mesh *bm, double *prev_pos, double *next_pos
+        , double factor);
+    int mesh_splitter_split(struct mesh_splitter *ms, double *positions
+        , int max);
+"""
+
 defs_kin_cartesian = """
     struct stepper_kinematics *cartesian_stepper_alloc(char axis);
 """
@@ -152,6 +274,9 @@ defs_kin_shaper = """
         struct stepper_kinematics *sk);
     int input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
         , int n, double a[], double t[]);
+    int input_shaper_queue_shaper_params(struct stepper_kinematics *sk
+        , char axis, int n, double a[], double t[], double print_time
+        , double expire_time);
     int input_shaper_set_sk(struct stepper_kinematics *sk
         , struct stepper_kinematics *orig_sk);
     struct stepper_kinematics * input_shaper_alloc(void);
@@ -162,36 +287,93 @@ defs_kin_idex = """
         , struct stepper_kinematics *orig_sk);
     int dual_carriage_set_transform(struct stepper_kinematics *sk
         , char axis, double scale, double offs);
+    int dual_carriage_queue_transform(struct stepper_kinematics *sk
+        , char axis, double scale, double offs
+        , double print_time, double expire_time);
     struct stepper_kinematics * dual_carriage_alloc(void);
 """
 
 defs_serialqueue = """
     #define MESSAGE_MAX 64
+    #define DISPATCH_MAX_PARAMS 16
+    struct clock_sync_state {
+        uint64_t last_clock;
+        int sample_count;
+        double mcu_freq, est_freq;
+        double min_half_rtt, min_rtt_time;
+        double time_avg, time_variance, clock_avg, clock_covariance;
+        double prediction_variance, last_prediction_time;
+    };
     struct pull_queue_message {
         uint8_t msg[MESSAGE_MAX];
         int len;
         double sent_time, receive_time;
         uint64_t notify_id;
+        int dispatch_id;
+        int64_t params[DISPATCH_MAX_PARAMS];
+    };
+    struct serialqueue_msgid_stats {
+        int msgid;
+        uint32_t send_msgs, send_bytes, receive_msgs, receive_bytes;
     };
 
+    struct command_encoder *command_encoder_alloc(uint8_t *msgid
+        , int msgid_len, uint8_t *param_types, int num_params);
+    void command_encoder_free(struct command_encoder *ce);
+
     struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
-        , int client_id);
+        , int client_id, int sched_priority, uint64_t sched_cpu_mask);
+    struct serialqueue_thread *serialqueue_thread_alloc(int sched_priority
+        , uint64_t sched_cpu_mask);
+    void serialqueue_thread_free(struct serialqueue_thread *st);
+    struct serialqueue *serialqueue_alloc_shared(int serial_fd
+        , char serial_fd_type, int client_id, struct serialqueue_thread *st);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
     void serialqueue_free_commandqueue(struct command_queue *cq);
+    void serialqueue_set_commandqueue_priority(struct command_queue *cq
+        , int priority);
+    void serialqueue_set_commandqueue_coalesce(struct command_queue *cq
+        , int key_params);
+    void serialqueue_set_canbus_sched(struct serialqueue *sq
+        , struct canbus_sched *cs);
     void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
         , uint8_t *msg, int len, uint64_t min_clock, uint64_t req_clock
         , uint64_t notify_id);
+    int serialqueue_send_encoded(struct serialqueue *sq
+        , struct command_queue *cq, struct command_encoder *ce, int64_t *args
+        , uint8_t *buf, int buf_len, uint64_t min_clock, uint64_t req_clock
+        , uint64_t notify_id);
+    int serialqueue_add_response(struct serialqueue *sq, uint8_t *prefix
+        , int prefix_len, int msgid_len, int num_params
+        , uint32_t unsigned_mask, int coalesce);
+    void serialqueue_rm_response(struct serialqueue *sq, int dispatch_id);
+    int serialqueue_pull_many(struct serialqueue *sq
+        , struct pull_queue_message *pqm, int max);
     void serialqueue_pull(struct serialqueue *sq
         , struct pull_queue_message *pqm);
+    int serialqueue_pull_nowait(struct serialqueue *sq
+        , struct pull_queue_message *pqm, int max);
+    void serialqueue_set_wake_fd(struct serialqueue *sq, int fd);
     void serialqueue_set_wire_frequency(struct serialqueue *sq
         , double frequency);
+    void serialqueue_set_data_frequency(struct serialqueue *sq
+        , double frequency);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_adaptive_window(struct serialqueue *sq, int enable);
+    void serialqueue_set_selective_ack(struct serialqueue *sq, uint8_t *prefix
+        , int prefix_len, int blocks);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double conv_time, uint64_t conv_clock, uint64_t last_clock);
+    void serialqueue_set_clock_sync(struct serialqueue *sq, int clock_msgid
+        , double mcu_freq, double sent_time, uint64_t clock);
+    void serialqueue_get_clock_sync(struct serialqueue *sq
+        , struct clock_sync_state *cs);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+    int serialqueue_get_msgid_stats(struct serialqueue *sq
+        , struct serialqueue_msgid_stats *stats, int max);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
 """
@@ -209,9 +391,79 @@ defs_trdispatch = """
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
 """
 
+defs_bulkdecode = """
+    struct bulk_decoder *bulk_decoder_alloc(struct serialqueue *sq
+        , uint32_t data_msgtag, uint32_t oid, const char *sample_fmt);
+    void bulk_decoder_free(struct bulk_decoder *bd);
+    void bulk_decoder_start(struct bulk_decoder *bd);
+    void bulk_decoder_stop(struct bulk_decoder *bd);
+    uint32_t bulk_decoder_get_invalid_count(struct bulk_decoder *bd);
+    int bulk_decoder_collect(struct bulk_decoder *bd);
+    int bulk_decoder_decode(struct bulk_decoder *bd, int64_t last_sequence
+        , int samples_per_block, double time_base, double chip_base
+        , double inv_freq, double *times, int64_t *values
+        , int64_t *last_chip_clock);
+"""
+
+defs_msgdump = """
+    struct msgdump *msgdump_alloc(int bytes_prefix);
+    void msgdump_free(struct msgdump *md);
+    int msgdump_add_format(struct msgdump *md, int msgid
+        , const char *template, const char *param_types);
+    int msgdump_add_enum(struct msgdump *md, int msgid, int param
+        , int64_t value, const char *name);
+    int msgdump_format_blocks(struct msgdump *md, uint8_t *data, int len
+        , char *out, int out_len, int *out_pos);
+"""
+
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
+    int set_thread_scheduling(int priority, uint64_t cpu_mask);
+"""
+
+defs_eddyscan = """
+    struct eddy_scan *eddy_scan_alloc(void);
+    void eddy_scan_free(struct eddy_scan *es);
+    int eddy_scan_set_table(struct eddy_scan *es, double *freqs
+        , double *heights, int count);
+    void eddy_scan_capture(struct eddy_scan *es, int enable);
+    int eddy_scan_decode_ldc1612(struct eddy_scan *es, double *times
+        , int64_t *values, int count, double freq_conv
+        , double *freqs, double *heights);
+    double eddy_scan_last_time(struct eddy_scan *es);
+    double eddy_scan_average(struct eddy_scan *es, double start_time
+        , double end_time);
+"""
+
+defs_movetransform = """
+    struct move_transform *move_transform_alloc(void);
+    void move_transform_free(struct move_transform *mt);
+    int move_transform_add_skew(struct move_transform *mt);
+    void move_transform_set_skew(struct move_transform *mt, int index
+        , double xy, double xz, double yz);
+    int move_transform_add_z_adjust(struct move_transform *mt
+        , double max_adjust, double step_dist, double off_above_z);
+    void move_transform_set_z_adjust(struct move_transform *mt, int index
+        , int enabled, double adjust);
+    void move_transform_reset_z_adjust(struct move_transform *mt, int index);
+    double move_transform_get_z_adjust(struct move_transform *mt, int index);
+    void move_transform_move(struct move_transform *mt, double *coords
+        , int count);
+    void move_transform_get_position(struct move_transform *mt
+        , double *pos);
+"""
+
+defs_canbus_sched = """
+    struct canbus_sched_stats {
+        uint32_t bytes, deferrals, node_count;
+        double busy_time;
+    };
+
+    struct canbus_sched *canbus_sched_alloc(void);
+    void canbus_sched_free(struct canbus_sched *cs);
+    void canbus_sched_get_stats(struct canbus_sched *cs
+        , struct canbus_sched_stats *stats);
 """
 
 defs_std = """
@@ -220,7 +472,9 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_stepgen, defs_trapq, defs_trdispatch, defs_bulkdecode,
+    defs_lookahead, defs_gcodeparse, defs_bedmesh, defs_eddyscan,
+    defs_movetransform, defs_canbus_sched, defs_msgdump,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
     defs_kin_extruder, defs_kin_shaper, defs_kin_idex,
@@ -262,6 +516,49 @@ def do_build_code(cmd):
         logging.error(msg)
         raise Exception(msg)
 
+# Build the optional python extension module (cffi "API mode").  Calls
+# through an extension module are made directly from compiled code
+# instead of through the generic libffi argument marshalling used by
+# the c_helper.so library.  This requires the python development
+# headers (and setuptools), so it is only built on request.
+def build_api_module():
+    srcdir = os.path.dirname(os.path.realpath(__file__))
+    srcfiles = get_abs_files(srcdir, SOURCE_FILES)
+    compile_args = list(API_COMPILE_ARGS)
+    if check_gcc_option(SSE_FLAGS):
+        compile_args += SSE_FLAGS.split()
+    ffibuilder = cffi.FFI()
+    for d in defs_all:
+        ffibuilder.cdef(d)
+    # The cdef declarations are also valid C prototypes (once all the
+    # struct names are declared)
+    cdefs = "".join(defs_all)
+    structs = sorted(set(re.findall(r"struct\s+(\w+)", cdefs)))
+    c_source = "#include <stdint.h>\n%s\n%s" % (
+        "".join(["struct %s;\n" % (n,) for n in structs]), cdefs)
+    ffibuilder.set_source(API_MODULE, c_source, sources=srcfiles,
+                          include_dirs=[srcdir],
+                          extra_compile_args=compile_args)
+    logging.info("Building C code extension module %s", API_MODULE)
+    tmpdir = tempfile.mkdtemp()
+    try:
+        target = ffibuilder.compile(tmpdir=tmpdir)
+        shutil.copy(target, srcdir)
+    finally:
+        shutil.rmtree(tmpdir)
+
+# Return the extension module if it is built and up to date
+def load_api_module(sources):
+    try:
+        from . import _chelper_api
+    except (ImportError, ValueError):
+        return None
+    if check_build_code(sources, _chelper_api.__file__):
+        logging.info("Ignoring out of date C code extension module %s",
+                     API_MODULE)
+        return None
+    return _chelper_api
+
 FFI_main = None
 FFI_lib = None
 pyhelper_logging_callback = None
@@ -278,17 +575,21 @@ def get_ffi():
         srcfiles = get_abs_files(srcdir, SOURCE_FILES)
         ofiles = get_abs_files(srcdir, OTHER_FILES)
         destlib = get_abs_files(srcdir, [DEST_LIB])[0]
-        if check_build_code(srcfiles+ofiles+[__file__], destlib):
-            if check_gcc_option(SSE_FLAGS):
-                cmd = "%s %s %s" % (GCC_CMD, SSE_FLAGS, COMPILE_ARGS)
-            else:
-                cmd = "%s %s" % (GCC_CMD, COMPILE_ARGS)
-            logging.info("Building C code module %s", DEST_LIB)
-            do_build_code(cmd % (destlib, ' '.join(srcfiles)))
-        FFI_main = cffi.FFI()
-        for d in defs_all:
-            FFI_main.cdef(d)
-        FFI_lib = FFI_main.dlopen(destlib)
+        api_module = load_api_module(srcfiles+ofiles+[__file__])
+        if api_module is not None:
+            FFI_main, FFI_lib = api_module.ffi, api_module.lib
+        else:
+            if check_build_code(srcfiles+ofiles+[__file__], destlib):
+                if check_gcc_option(SSE_FLAGS):
+                    cmd = "%s %s %s" % (GCC_CMD, SSE_FLAGS, COMPILE_ARGS)
+                else:
+                    cmd = "%s %s" % (GCC_CMD, COMPILE_ARGS)
+                logging.info("Building C code module %s", DEST_LIB)
+                do_build_code(cmd % (destlib, ' '.join(srcfiles)))
+            FFI_main = cffi.FFI()
+            for d in defs_all:
+                FFI_main.cdef(d)
+            FFI_lib = FFI_main.dlopen(destlib)
         # Setup error logging
         pyhelper_logging_callback = FFI_main.callback("void func(const char *)",
                                                       logging_callback)
@@ -318,4 +619,8 @@ def run_hub_ctrl(enable_power):
 
 
 if __name__ == '__main__':
-    get_ffi()
+    if '--api' in sys.argv[1:]:
+        logging.basicConfig(level=logging.INFO)
+        build_api_module()
+    else:
+        get_ffi()
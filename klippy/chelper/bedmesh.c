@@ -0,0 +1,280 @@
+// Bed mesh z adjustment and move splitting
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code implements ZMesh.calc_z() and the MoveSplitter class of
+// klippy/extras/bed_mesh.py.  The (interpolated) mesh matrix is
+// stored as a contiguous array of bilinear coefficients for each mesh
+// cell, so that a lookup only needs the cell index and four
+// coefficients.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+
+struct bed_mesh {
+    // Coefficients (z00, z10-z00, z01-z00, z11-z10-z01+z00) of each cell
+    double *cells;
+    int x_count, y_count;
+    double x_min, y_min, x_dist, y_dist;
+    double offsets[2];
+};
+
+struct mesh_splitter {
+    double split_delta_z, move_check_distance, fade_offset;
+    // Current move state
+    struct bed_mesh *mesh;
+    double prev_pos[4], next_pos[4], current_pos[4];
+    double z_factor, z_offset, total_move_length, distance_checked;
+    int axis_move[4], traverse_complete;
+};
+
+// Helpers that match the semantics of python's min() and max()
+static inline double
+pymin(double a, double b)
+{
+    return b < a ? b : a;
+}
+
+static inline double
+pymax(double a, double b)
+{
+    return b > a ? b : a;
+}
+
+static inline double
+lerp(double t, double v0, double v1)
+{
+    return (1. - t) * v0 + t * v1;
+}
+
+
+/****************************************************************
+ * Mesh z lookup
+ ****************************************************************/
+
+// Find the mesh index and interpolation factor for a coordinate
+static double
+get_linear_index(double coord, double mesh_min, int mesh_cnt, double mesh_dist
+                 , int *pidx)
+{
+    double fidx = floor((coord - mesh_min) / mesh_dist);
+    int idx = 0;
+    if (fidx > mesh_cnt - 2)
+        idx = mesh_cnt - 2;
+    else if (fidx > 0.)
+        idx = fidx;
+    *pidx = idx;
+    double t = (coord - (mesh_min + mesh_dist * idx)) / mesh_dist;
+    return pymin(1., pymax(0., t));
+}
+
+// Return the z adjustment of the mesh at a given position
+double __visible
+bed_mesh_calc_z(struct bed_mesh *bm, double x, double y)
+{
+    if (!bm->cells)
+        return 0.;
+    int xidx, yidx;
+    double tx = get_linear_index(x + bm->offsets[0], bm->x_min
+                                 , bm->x_count, bm->x_dist, &xidx);
+    double ty = get_linear_index(y + bm->offsets[1], bm->y_min
+                                 , bm->y_count, bm->y_dist, &yidx);
+    double *c = &bm->cells[(yidx * (bm->x_count - 1) + xidx) * 4];
+    return c[0] + tx * c[1] + ty * (c[2] + tx * c[3]);
+}
+
+// Return the z adjustment of 'count' positions (x, y pairs)
+void __visible
+bed_mesh_calc_z_batch(struct bed_mesh *bm, double *positions
+                      , double *z_values, int count)
+{
+    int i;
+    for (i=0; i<count; i++)
+        z_values[i] = bed_mesh_calc_z(bm, positions[i*2], positions[i*2+1]);
+}
+
+// Store the mesh matrix (x_count*y_count values in row major order)
+void __visible
+bed_mesh_set_matrix(struct bed_mesh *bm, double *matrix
+                    , int x_count, int y_count, double x_min, double y_min
+                    , double x_dist, double y_dist)
+{
+    free(bm->cells);
+    bm->cells = NULL;
+    if (!matrix || x_count < 2 || y_count < 2)
+        return;
+    double *cells = malloc(sizeof(*cells) * 4 * (x_count-1) * (y_count-1));
+    if (!cells)
+        return;
+    int x, y;
+    for (y=0; y<y_count-1; y++) {
+        double *row0 = &matrix[y * x_count], *row1 = row0 + x_count;
+        for (x=0; x<x_count-1; x++) {
+            double *c = &cells[(y * (x_count - 1) + x) * 4];
+            c[0] = row0[x];
+            c[1] = row0[x+1] - row0[x];
+            c[2] = row1[x] - row0[x];
+            c[3] = row1[x+1] - row0[x+1] - row1[x] + row0[x];
+        }
+    }
+    bm->cells = cells;
+    bm->x_count = x_count;
+    bm->y_count = y_count;
+    bm->x_min = x_min;
+    bm->y_min = y_min;
+    bm->x_dist = x_dist;
+    bm->y_dist = y_dist;
+}
+
+// Set the xy offsets applied to positions prior to lookup
+void __visible
+bed_mesh_set_offsets(struct bed_mesh *bm, double x_offset, double y_offset)
+{
+    bm->offsets[0] = x_offset;
+    bm->offsets[1] = y_offset;
+}
+
+// Create a new 'struct bed_mesh' object
+struct bed_mesh * __visible
+bed_mesh_alloc(void)
+{
+    struct bed_mesh *bm = malloc(sizeof(*bm));
+    memset(bm, 0, sizeof(*bm));
+    return bm;
+}
+
+// Free memory associated with a 'struct bed_mesh' object
+void __visible
+bed_mesh_free(struct bed_mesh *bm)
+{
+    if (!bm)
+        return;
+    free(bm->cells);
+    free(bm);
+}
+
+
+/****************************************************************
+ * Move splitting
+ ****************************************************************/
+
+static double
+calc_z_offset(struct mesh_splitter *ms, double *pos)
+{
+    double z = bed_mesh_calc_z(ms->mesh, pos[0], pos[1]);
+    double offset = ms->fade_offset;
+    return ms->z_factor * (z - offset) + offset;
+}
+
+// Setup a new move to be split
+void __visible
+mesh_splitter_build_move(struct mesh_splitter *ms, struct bed_mesh *bm
+                         , double *prev_pos, double *next_pos, double factor)
+{
+    ms->mesh = bm;
+    memcpy(ms->prev_pos, prev_pos, sizeof(ms->prev_pos));
+    memcpy(ms->next_pos, next_pos, sizeof(ms->next_pos));
+    memcpy(ms->current_pos, prev_pos, sizeof(ms->current_pos));
+    ms->z_factor = factor;
+    ms->z_offset = calc_z_offset(ms, prev_pos);
+    ms->traverse_complete = 0;
+    ms->distance_checked = 0.;
+    double sum = 0.;
+    int i;
+    for (i=0; i<4; i++) {
+        double d = next_pos[i] - prev_pos[i];
+        if (i < 3)
+            sum += d*d;
+        // Equivalent of "not isclose(d, 0., abs_tol=1e-10)"
+        double ad = fabs(d);
+        ms->axis_move[i] = !(ad <= pymax(1e-09 * pymax(ad, 0.), 1e-10));
+    }
+    ms->total_move_length = sqrt(sum);
+}
+
+// Find the next split position.  Returns 1 if a position was stored
+// in 'pos', 0 if the move is complete, or -1 on error.
+static int
+split_next(struct mesh_splitter *ms, double *pos)
+{
+    if (ms->traverse_complete)
+        return 0;
+    double *cur = ms->current_pos;
+    if (ms->axis_move[0] || ms->axis_move[1]) {
+        // X and/or Y axis move, traverse if necessary
+        while (ms->distance_checked + ms->move_check_distance
+               < ms->total_move_length) {
+            ms->distance_checked += ms->move_check_distance;
+            double t = ms->distance_checked / ms->total_move_length;
+            if (t > 1. || t < 0.)
+                return -1;
+            int i;
+            for (i=0; i<4; i++)
+                if (ms->axis_move[i])
+                    cur[i] = lerp(t, ms->prev_pos[i], ms->next_pos[i]);
+            double next_z = calc_z_offset(ms, cur);
+            if (fabs(next_z - ms->z_offset) >= ms->split_delta_z) {
+                ms->z_offset = next_z;
+                pos[0] = cur[0];
+                pos[1] = cur[1];
+                pos[2] = cur[2] + ms->z_offset;
+                pos[3] = cur[3];
+                return 1;
+            }
+        }
+    }
+    // end of move reached
+    memcpy(cur, ms->next_pos, sizeof(ms->current_pos));
+    ms->z_offset = calc_z_offset(ms, cur);
+    cur[2] += ms->z_offset;
+    ms->traverse_complete = 1;
+    memcpy(pos, cur, sizeof(ms->current_pos));
+    return 1;
+}
+
+// Generate up to 'max' upcoming split positions (4 values each) in
+// 'positions'.  Returns the number of positions stored or -1 on error.
+int __visible
+mesh_splitter_split(struct mesh_splitter *ms, double *positions, int max)
+{
+    int count = 0;
+    while (count < max) {
+        int ret = split_next(ms, &positions[count * 4]);
+        if (ret < 0)
+            return -1;
+        if (!ret)
+            break;
+        count++;
+    }
+    return count;
+}
+
+// Set the splitting parameters
+void __visible
+mesh_splitter_set_params(struct mesh_splitter *ms, double split_delta_z
+                         , double move_check_distance, double fade_offset)
+{
+    ms->split_delta_z = split_delta_z;
+    ms->move_check_distance = move_check_distance;
+    ms->fade_offset = fade_offset;
+}
+
+// Create a new 'struct mesh_splitter' object
+struct mesh_splitter * __visible
+mesh_splitter_alloc(void)
+{
+    struct mesh_splitter *ms = malloc(sizeof(*ms));
+    memset(ms, 0, sizeof(*ms));
+    return ms;
+}
+
+// Free memory associated with a 'struct mesh_splitter' object
+void __visible
+mesh_splitter_free(struct mesh_splitter *ms)
+{
+    free(ms);
+}
@@ -0,0 +1,415 @@
+// Decoding of "sensor_bulk_data" messages from bulk sensors
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The bulk_decoder registers a serialqueue fastreader that stores
+// sensor_bulk_data messages for a single sensor (without forwarding
+// them to the python serialqueue_pull() thread).  The host code then
+// periodically decodes all stored messages into caller provided
+// arrays of sample times and sample values.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "pyhelper.h" // errorf
+#include "serialqueue.h" // serialqueue_add_fastreader
+
+#define MAX_FIELDS 16
+#define PACKED_MSG_SIZE 51 // SENSOR_BULK_DATA_SIZE in the mcu code
+
+struct bulk_field {
+    uint8_t size, is_signed;
+};
+
+struct bulk_msg {
+    uint16_t sequence;
+    uint8_t len;
+    uint8_t data[MESSAGE_PAYLOAD_MAX];
+};
+
+struct bulk_decoder {
+    struct fastreader fr;
+    struct serialqueue *sq;
+    int is_active;
+    // Sample format
+    struct bulk_field fields[MAX_FIELDS];
+    int field_count, bytes_per_sample, is_big_endian, is_compressed;
+    // Packed mode state (a sample may span two messages)
+    int is_packed, carry_len;
+    int64_t stream_pos;
+    uint8_t carry[MAX_FIELDS * 4];
+    // Messages collected by bulk_decoder_collect()
+    struct bulk_msg *pulled;
+    int pulled_count, pulled_size;
+
+    pthread_mutex_t lock; // protects variables below
+    struct bulk_msg *msgs;
+    int msg_count, msg_size;
+    uint32_t invalid_count;
+};
+
+
+/****************************************************************
+ * Message storage
+ ****************************************************************/
+
+// Handle a sensor_bulk_data message (callback from serialqueue fastreader)
+static void
+handle_bulk_data(struct fastreader *fr, uint8_t *data, int len)
+{
+    struct bulk_decoder *bd = container_of(fr, struct bulk_decoder, fr);
+
+    // Parse: sensor_bulk_data oid=%c sequence=%hu data=%*s
+    uint32_t fields[3];
+    uint8_t *buf;
+    int buf_len = msgblock_decode_buffer(fields, ARRAY_SIZE(fields), &buf
+                                         , data, len);
+
+    pthread_mutex_lock(&bd->lock);
+    if (buf_len < 0 || buf_len > MESSAGE_PAYLOAD_MAX) {
+        bd->invalid_count++;
+        pthread_mutex_unlock(&bd->lock);
+        return;
+    }
+    if (bd->msg_count >= bd->msg_size) {
+        int new_size = bd->msg_size ? bd->msg_size * 2 : 64;
+        bd->msgs = realloc(bd->msgs, sizeof(*bd->msgs) * new_size);
+        bd->msg_size = new_size;
+    }
+    struct bulk_msg *m = &bd->msgs[bd->msg_count++];
+    m->sequence = fields[2];
+    m->len = buf_len;
+    memcpy(m->data, buf, buf_len);
+    pthread_mutex_unlock(&bd->lock);
+}
+
+// Swap the queue of received messages with the (now unused) pulled list
+static void
+swap_msgs(struct bulk_decoder *bd)
+{
+    struct bulk_msg *pulled = bd->pulled;
+    int pulled_size = bd->pulled_size;
+    pthread_mutex_lock(&bd->lock);
+    bd->pulled = bd->msgs;
+    bd->pulled_count = bd->msg_count;
+    bd->pulled_size = bd->msg_size;
+    bd->msgs = pulled;
+    bd->msg_count = 0;
+    bd->msg_size = pulled_size;
+    pthread_mutex_unlock(&bd->lock);
+}
+
+// Discard all stored messages
+static void
+clear_msgs(struct bulk_decoder *bd)
+{
+    pthread_mutex_lock(&bd->lock);
+    bd->msg_count = 0;
+    pthread_mutex_unlock(&bd->lock);
+    bd->pulled_count = 0;
+    bd->carry_len = 0;
+    bd->stream_pos = 0;
+}
+
+
+/****************************************************************
+ * Decoding
+ ****************************************************************/
+
+// Parse a python "struct" style format string (eg, "<hhh").  A
+// leading 'z' indicates the mcu sends compressed samples (see
+// sensor_bulk_add_sample() in the mcu code) and a leading 'p'
+// indicates packed samples (see sensor_bulk_add_data()).
+static int
+parse_format(struct bulk_decoder *bd, const char *fmt)
+{
+    if (*fmt == 'z') {
+        bd->is_compressed = 1;
+        fmt++;
+    } else if (*fmt == 'p') {
+        bd->is_packed = 1;
+        fmt++;
+    }
+    if (*fmt == '<' || *fmt == '>') {
+        bd->is_big_endian = *fmt == '>';
+        fmt++;
+    }
+    for (; *fmt; fmt++) {
+        if (bd->field_count >= MAX_FIELDS)
+            return -1;
+        struct bulk_field *f = &bd->fields[bd->field_count++];
+        switch (*fmt) {
+        case 'b': f->size = 1; f->is_signed = 1; break;
+        case 'B': f->size = 1; f->is_signed = 0; break;
+        case 'h': f->size = 2; f->is_signed = 1; break;
+        case 'H': f->size = 2; f->is_signed = 0; break;
+        case 'i': f->size = 4; f->is_signed = 1; break;
+        case 'I': f->size = 4; f->is_signed = 0; break;
+        default: return -1;
+        }
+        bd->bytes_per_sample += f->size;
+    }
+    return bd->field_count ? 0 : -1;
+}
+
+// Extract a single sample field from a data buffer
+static int64_t
+decode_field(struct bulk_decoder *bd, struct bulk_field *f, uint8_t *p)
+{
+    uint32_t v = 0;
+    int i;
+    if (bd->is_big_endian)
+        for (i=0; i<f->size; i++)
+            v = (v << 8) | p[i];
+    else
+        for (i=f->size-1; i>=0; i--)
+            v = (v << 8) | p[i];
+    if (!f->is_signed)
+        return v;
+    int shift = 32 - f->size * 8;
+    return (int32_t)(v << shift) >> shift;
+}
+
+// Return the number of samples in a message
+static int
+msg_sample_count(struct bulk_decoder *bd, struct bulk_msg *m)
+{
+    if (!bd->is_compressed)
+        return m->len / bd->bytes_per_sample;
+    // Each value ends with a byte that does not have the high bit set
+    int i, values = 0;
+    for (i=0; i<m->len; i++)
+        values += !(m->data[i] & 0x80);
+    return values / bd->field_count;
+}
+
+// Extract a compressed sample value (a zigzag varint)
+static int64_t
+decode_varint(uint8_t **pp)
+{
+    uint8_t *p = *pp;
+    uint32_t v = 0;
+    int shift = 0;
+    for (;;) {
+        uint8_t c = *p++;
+        v |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80) || shift >= 28)
+            break;
+        shift += 7;
+    }
+    *pp = p;
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Move received messages to the decode list and return their sample
+// count (in packed mode this is an upper bound)
+int __visible
+bulk_decoder_collect(struct bulk_decoder *bd)
+{
+    swap_msgs(bd);
+    int i, count = 0;
+    if (bd->is_packed) {
+        int total = bd->carry_len;
+        for (i=0; i<bd->pulled_count; i++)
+            total += bd->pulled[i].len;
+        return total / bd->bytes_per_sample;
+    }
+    for (i=0; i<bd->pulled_count; i++)
+        count += msg_sample_count(bd, &bd->pulled[i]);
+    return count;
+}
+
+// Extract the fields of an uncompressed sample
+static void
+decode_sample(struct bulk_decoder *bd, uint8_t *p, int64_t *values)
+{
+    int k;
+    for (k=0; k<bd->field_count; k++) {
+        struct bulk_field *f = &bd->fields[k];
+        values[k] = decode_field(bd, f, p);
+        p += f->size;
+    }
+}
+
+// Decode a packed message - returns the number of samples decoded
+static int
+decode_packed(struct bulk_decoder *bd, struct bulk_msg *m, int64_t sequence
+              , double time_base, double chip_base, double inv_freq
+              , double *times, int64_t *values, int64_t *last_chip_clock)
+{
+    int bps = bd->bytes_per_sample, count = 0, pos = 0;
+    int64_t stream_pos = sequence * PACKED_MSG_SIZE;
+    if (stream_pos != bd->stream_pos) {
+        // Missing data - resync at the next sample boundary
+        bd->carry_len = 0;
+        pos = (bps - stream_pos % bps) % bps;
+    }
+    bd->stream_pos = stream_pos + m->len;
+    if (bd->carry_len) {
+        // Complete the sample started in the previous message
+        pos = bps - bd->carry_len;
+        if (pos > m->len) {
+            memcpy(&bd->carry[bd->carry_len], m->data, m->len);
+            bd->carry_len += m->len;
+            return 0;
+        }
+        memcpy(&bd->carry[bd->carry_len], m->data, pos);
+        int64_t chip_clock = (stream_pos - bd->carry_len) / bps;
+        times[count] = time_base + (chip_clock - chip_base) * inv_freq;
+        decode_sample(bd, bd->carry, &values[count * bd->field_count]);
+        *last_chip_clock = chip_clock;
+        count++;
+        bd->carry_len = 0;
+    }
+    for (; pos + bps <= m->len; pos += bps) {
+        int64_t chip_clock = (stream_pos + pos) / bps;
+        times[count] = time_base + (chip_clock - chip_base) * inv_freq;
+        decode_sample(bd, &m->data[pos], &values[count * bd->field_count]);
+        *last_chip_clock = chip_clock;
+        count++;
+    }
+    if (pos < m->len) {
+        // Save the start of a sample that continues in the next message
+        bd->carry_len = m->len - pos;
+        memcpy(bd->carry, &m->data[pos], bd->carry_len);
+    }
+    return count;
+}
+
+// Decode the messages taken by bulk_decoder_collect().  Each sample
+// time is "time_base + (chip_clock - chip_base) * inv_freq" where the
+// chip_clock of a sample is its position in the sensor sample stream.
+// The caller must provide space for the number of samples reported by
+// bulk_decoder_collect().  The samples_per_block is not used in packed
+// mode.
+int __visible
+bulk_decoder_decode(struct bulk_decoder *bd, int64_t last_sequence
+                    , int samples_per_block, double time_base
+                    , double chip_base, double inv_freq
+                    , double *times, int64_t *values
+                    , int64_t *last_chip_clock)
+{
+    int count = 0, i, j, k;
+    for (i=0; i<bd->pulled_count; i++) {
+        struct bulk_msg *m = &bd->pulled[i];
+        int seq_diff = (m->sequence - last_sequence) & 0xffff;
+        seq_diff -= (seq_diff & 0x8000) << 1;
+        if (bd->is_packed) {
+            count += decode_packed(
+                bd, m, last_sequence + seq_diff, time_base, chip_base
+                , inv_freq, &times[count], &values[count * bd->field_count]
+                , last_chip_clock);
+            continue;
+        }
+        int64_t chip_clock = (last_sequence + seq_diff) * samples_per_block;
+        double msg_cdiff = chip_clock - chip_base;
+        int msg_samples = msg_sample_count(bd, m);
+        uint8_t *p = m->data;
+        int64_t last[MAX_FIELDS] = { 0 };
+        for (j=0; j<msg_samples; j++) {
+            times[count++] = time_base + (msg_cdiff + j) * inv_freq;
+            for (k=0; k<bd->field_count; k++) {
+                struct bulk_field *f = &bd->fields[k];
+                if (bd->is_compressed) {
+                    // Values are deltas from the previous sample
+                    last[k] += decode_varint(&p);
+                    *values++ = last[k];
+                    continue;
+                }
+                *values++ = decode_field(bd, f, p);
+                p += f->size;
+            }
+        }
+        *last_chip_clock = (msg_samples ? chip_clock + msg_samples - 1
+                            : chip_clock);
+    }
+    bd->pulled_count = 0;
+    return count;
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// Start storing sensor_bulk_data messages (discarding any old messages)
+void __visible
+bulk_decoder_start(struct bulk_decoder *bd)
+{
+    clear_msgs(bd);
+    if (bd->is_active)
+        return;
+    bd->is_active = 1;
+    serialqueue_add_fastreader(bd->sq, &bd->fr);
+}
+
+// Stop storing sensor_bulk_data messages
+void __visible
+bulk_decoder_stop(struct bulk_decoder *bd)
+{
+    if (bd->is_active) {
+        bd->is_active = 0;
+        serialqueue_rm_fastreader(bd->sq, &bd->fr);
+    }
+    clear_msgs(bd);
+}
+
+// Return the number of messages that could not be decoded
+uint32_t __visible
+bulk_decoder_get_invalid_count(struct bulk_decoder *bd)
+{
+    pthread_mutex_lock(&bd->lock);
+    uint32_t invalid_count = bd->invalid_count;
+    pthread_mutex_unlock(&bd->lock);
+    return invalid_count;
+}
+
+// Create a new 'struct bulk_decoder' object
+struct bulk_decoder * __visible
+bulk_decoder_alloc(struct serialqueue *sq, uint32_t data_msgtag
+                   , uint32_t oid, const char *sample_fmt)
+{
+    struct bulk_decoder *bd = malloc(sizeof(*bd));
+    memset(bd, 0, sizeof(*bd));
+    if (parse_format(bd, sample_fmt)) {
+        errorf("bulk_decoder invalid format '%s'", sample_fmt);
+        free(bd);
+        return NULL;
+    }
+    int ret = pthread_mutex_init(&bd->lock, NULL);
+    if (ret) {
+        report_errno("bulk_decoder_alloc pthread_mutex_init", ret);
+        free(bd);
+        return NULL;
+    }
+    bd->sq = sq;
+
+    // Setup fastreader to match (and consume) sensor_bulk_data messages
+    uint32_t data_prefix[] = {data_msgtag, oid};
+    struct queue_message *dummy = message_alloc_and_encode(
+        data_prefix, ARRAY_SIZE(data_prefix));
+    memcpy(bd->fr.prefix, dummy->msg, dummy->len);
+    bd->fr.prefix_len = dummy->len;
+    message_free(dummy);
+    bd->fr.func = handle_bulk_data;
+    bd->fr.consume = 1;
+
+    return bd;
+}
+
+// Free memory associated with a 'struct bulk_decoder' object
+void __visible
+bulk_decoder_free(struct bulk_decoder *bd)
+{
+    if (!bd)
+        return;
+    bulk_decoder_stop(bd);
+    pthread_mutex_destroy(&bd->lock);
+    free(bd->msgs);
+    free(bd->pulled);
+    free(bd);
+}
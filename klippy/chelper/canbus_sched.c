@@ -0,0 +1,153 @@
+// Sharing of a CAN bus between the serialqueues of several mcus
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each serialqueue estimates the time its messages are transmitted
+// from the bus bit rate.  When several mcus share one CAN interface
+// each serialqueue would assume it owned the full bus.  This code
+// tracks the combined bus usage of all attached serialqueues (the
+// "nodes") and, while the bus is busy, lets the node with the
+// earliest deadline transmit first.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "canbus_sched.h" // struct canbus_node
+#include "compiler.h" // __visible
+#include "pollreactor.h" // PR_NEVER
+
+struct canbus_sched {
+    pthread_mutex_t lock; // protects variables below
+    struct list_head nodes;
+    double idle_time;
+    // Stats
+    uint32_t bytes, deferrals;
+    double busy_time;
+};
+
+// Allocate a new 'canbus_sched' object
+struct canbus_sched * __visible
+canbus_sched_alloc(void)
+{
+    struct canbus_sched *cs = malloc(sizeof(*cs));
+    memset(cs, 0, sizeof(*cs));
+    pthread_mutex_init(&cs->lock, NULL);
+    list_init(&cs->nodes);
+    return cs;
+}
+
+// Free memory associated with a 'canbus_sched' object
+void __visible
+canbus_sched_free(struct canbus_sched *cs)
+{
+    if (!cs)
+        return;
+    pthread_mutex_lock(&cs->lock);
+    while (!list_empty(&cs->nodes)) {
+        struct canbus_node *cn = list_first_entry(
+            &cs->nodes, struct canbus_node, node);
+        list_del(&cn->node);
+        cn->cs = NULL;
+    }
+    pthread_mutex_unlock(&cs->lock);
+    pthread_mutex_destroy(&cs->lock);
+    free(cs);
+}
+
+// Report the bus usage statistics
+void __visible
+canbus_sched_get_stats(struct canbus_sched *cs
+                       , struct canbus_sched_stats *stats)
+{
+    pthread_mutex_lock(&cs->lock);
+    stats->bytes = cs->bytes;
+    stats->deferrals = cs->deferrals;
+    stats->busy_time = cs->busy_time;
+    stats->node_count = 0;
+    struct canbus_node *cn;
+    list_for_each_entry(cn, &cs->nodes, node) {
+        stats->node_count++;
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Attach a node to the bus
+void
+canbus_sched_add_node(struct canbus_sched *cs, struct canbus_node *cn)
+{
+    pthread_mutex_lock(&cs->lock);
+    cn->cs = cs;
+    cn->deadline = PR_NEVER;
+    list_add_tail(&cn->node, &cs->nodes);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Detach a node from its bus
+void
+canbus_sched_remove_node(struct canbus_node *cn)
+{
+    struct canbus_sched *cs = cn->cs;
+    if (!cs)
+        return;
+    pthread_mutex_lock(&cs->lock);
+    list_del(&cn->node);
+    cn->cs = NULL;
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Return the time the bus is expected to finish its queued traffic
+double
+canbus_sched_idle_time(struct canbus_node *cn)
+{
+    struct canbus_sched *cs = cn->cs;
+    pthread_mutex_lock(&cs->lock);
+    double idle_time = cs->idle_time;
+    pthread_mutex_unlock(&cs->lock);
+    return idle_time;
+}
+
+// Note that a node wishes to transmit data needed by 'deadline' (or
+// that it has nothing to send if 'deadline' is PR_NEVER).  Returns
+// zero if the node may transmit now, or the time to check again if
+// it should leave the busy bus to a node with an earlier deadline.
+double
+canbus_sched_check(struct canbus_node *cn, double eventtime, double deadline)
+{
+    struct canbus_sched *cs = cn->cs;
+    pthread_mutex_lock(&cs->lock);
+    cn->deadline = deadline;
+    double waketime = 0.;
+    if (deadline != PR_NEVER && cs->idle_time > eventtime) {
+        struct canbus_node *o;
+        list_for_each_entry(o, &cs->nodes, node) {
+            if (o != cn && o->deadline < deadline) {
+                waketime = cs->idle_time;
+                cs->deferrals++;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return waketime;
+}
+
+// Reserve bus time for a transmission that can start no earlier than
+// 'start'.  Returns the time the transmission is expected to finish.
+double
+canbus_sched_reserve(struct canbus_node *cn, double start, double duration
+                     , int bytes)
+{
+    struct canbus_sched *cs = cn->cs;
+    pthread_mutex_lock(&cs->lock);
+    if (start < cs->idle_time)
+        start = cs->idle_time;
+    cs->idle_time = start + duration;
+    cs->busy_time += duration;
+    cs->bytes += bytes;
+    cn->deadline = PR_NEVER;
+    pthread_mutex_unlock(&cs->lock);
+    return start + duration;
+}
@@ -0,0 +1,32 @@
+#ifndef CANBUS_SCHED_H
+#define CANBUS_SCHED_H
+
+#include <stdint.h> // uint32_t
+#include "list.h" // struct list_node
+
+struct canbus_sched;
+
+struct canbus_node {
+    struct list_node node;
+    struct canbus_sched *cs;
+    double deadline;
+};
+
+struct canbus_sched_stats {
+    uint32_t bytes, deferrals, node_count;
+    double busy_time;
+};
+
+struct canbus_sched *canbus_sched_alloc(void);
+void canbus_sched_free(struct canbus_sched *cs);
+void canbus_sched_get_stats(struct canbus_sched *cs
+                            , struct canbus_sched_stats *stats);
+void canbus_sched_add_node(struct canbus_sched *cs, struct canbus_node *cn);
+void canbus_sched_remove_node(struct canbus_node *cn);
+double canbus_sched_idle_time(struct canbus_node *cn);
+double canbus_sched_check(struct canbus_node *cn, double eventtime
+                          , double deadline);
+double canbus_sched_reserve(struct canbus_node *cn, double start
+                            , double duration, int bytes);
+
+#endif // canbus_sched.h
@@ -0,0 +1,207 @@
+// Eddy current probe sample conversion and probe window averaging
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code converts the ldc1612 samples produced by the bulk_decoder
+// to frequencies and heights (using a table prepared by
+// klippy/extras/probe_eddy_current.py) and stores the frequencies so
+// that the average frequency of each probe window can be obtained
+// without processing each sample in python.
+
+#include <math.h> // round
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+
+#define OUT_OF_RANGE 99.9
+#define NO_CALIBRATION 999.9
+#define LDC1612_DATA_MASK 0x0fffffff
+
+struct eddy_scan {
+    // Frequency to height table (segment i is between freqs[i-1..i])
+    double *freqs, *gains, *offsets;
+    int table_count, has_table;
+    // Stored samples for probe window averaging
+    double *times, *sample_freqs;
+    int sample_start, sample_end, sample_alloc, is_capturing;
+};
+
+// Allocate a new 'eddy_scan' object
+struct eddy_scan * __visible
+eddy_scan_alloc(void)
+{
+    struct eddy_scan *es = malloc(sizeof(*es));
+    memset(es, 0, sizeof(*es));
+    return es;
+}
+
+// Free memory associated with an 'eddy_scan' object
+void __visible
+eddy_scan_free(struct eddy_scan *es)
+{
+    free(es->freqs);
+    free(es->gains);
+    free(es->offsets);
+    free(es->times);
+    free(es->sample_freqs);
+    free(es);
+}
+
+// Set the frequency to height table (freqs must be in ascending order)
+int __visible
+eddy_scan_set_table(struct eddy_scan *es, double *freqs, double *heights
+                    , int count)
+{
+    double *nfreqs = malloc((count + 1) * sizeof(*nfreqs));
+    double *gains = malloc((count + 1) * sizeof(*gains));
+    double *offsets = malloc((count + 1) * sizeof(*offsets));
+    if (!nfreqs || !gains || !offsets) {
+        free(nfreqs);
+        free(gains);
+        free(offsets);
+        return -1;
+    }
+    int i;
+    for (i=0; i<count; i++) {
+        nfreqs[i] = freqs[i];
+        gains[i] = offsets[i] = 0.;
+        if (!i)
+            continue;
+        double freq_diff = freqs[i] - freqs[i-1];
+        if (freq_diff > 0.)
+            gains[i] = (heights[i] - heights[i-1]) / freq_diff;
+        offsets[i] = heights[i-1] - freqs[i-1] * gains[i];
+    }
+    free(es->freqs);
+    free(es->gains);
+    free(es->offsets);
+    es->freqs = nfreqs;
+    es->gains = gains;
+    es->offsets = offsets;
+    es->table_count = count;
+    es->has_table = 1;
+    return 0;
+}
+
+// Lookup the height of a frequency (same as EddyCalibration in python)
+static double
+eddy_scan_height(struct eddy_scan *es, double freq)
+{
+    if (!es->has_table)
+        return NO_CALIBRATION;
+    // Find the number of table entries less than or equal to freq
+    int lo = 0, hi = es->table_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (es->freqs[mid] <= freq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo >= es->table_count)
+        return -OUT_OF_RANGE;
+    if (!lo)
+        return OUT_OF_RANGE;
+    double z = freq * es->gains[lo] + es->offsets[lo];
+    return round(z * 1000000.) / 1000000.;
+}
+
+// Enable (or disable) the storage of samples for probe windows
+void __visible
+eddy_scan_capture(struct eddy_scan *es, int enable)
+{
+    es->is_capturing = enable;
+    es->sample_start = es->sample_end = 0;
+}
+
+// Append a sample to the probe window storage
+static int
+store_sample(struct eddy_scan *es, double time, double freq)
+{
+    if (es->sample_end >= es->sample_alloc) {
+        // Discard already consumed samples and grow storage if needed
+        int count = es->sample_end - es->sample_start;
+        if (es->sample_start) {
+            memmove(es->times, &es->times[es->sample_start]
+                    , count * sizeof(*es->times));
+            memmove(es->sample_freqs, &es->sample_freqs[es->sample_start]
+                    , count * sizeof(*es->sample_freqs));
+            es->sample_start = 0;
+            es->sample_end = count;
+        }
+        if (count >= es->sample_alloc / 2) {
+            int alloc = es->sample_alloc ? es->sample_alloc * 2 : 1024;
+            double *times = realloc(es->times, alloc * sizeof(*times));
+            if (!times)
+                return -1;
+            es->times = times;
+            double *sfreqs = realloc(es->sample_freqs
+                                     , alloc * sizeof(*sfreqs));
+            if (!sfreqs)
+                return -1;
+            es->sample_freqs = sfreqs;
+            es->sample_alloc = alloc;
+        }
+    }
+    es->times[es->sample_end] = time;
+    es->sample_freqs[es->sample_end] = freq;
+    es->sample_end++;
+    return 0;
+}
+
+// Convert raw ldc1612 sample values to frequencies and heights.  The
+// times are rounded in place.  Returns the number of samples that
+// reported an error.
+int __visible
+eddy_scan_decode_ldc1612(struct eddy_scan *es, double *times
+                         , int64_t *values, int count, double freq_conv
+                         , double *freqs, double *heights)
+{
+    int i, errors = 0;
+    for (i=0; i<count; i++) {
+        int64_t val = values[i], mv = val & LDC1612_DATA_MASK;
+        if (mv != val)
+            errors++;
+        double time = round(times[i] * 1000000.) / 1000000.;
+        double freq = round(freq_conv * mv * 1000.) / 1000.;
+        times[i] = time;
+        freqs[i] = freq;
+        heights[i] = eddy_scan_height(es, freq);
+        if (es->is_capturing && store_sample(es, time, freq))
+            es->is_capturing = 0;
+    }
+    return errors;
+}
+
+// Return the time of the last stored sample
+double __visible
+eddy_scan_last_time(struct eddy_scan *es)
+{
+    if (es->sample_end <= es->sample_start)
+        return 0.;
+    return es->times[es->sample_end - 1];
+}
+
+// Return the average frequency of the samples between start_time and
+// end_time (or zero if there are no samples) and discard the samples
+// prior to start_time.
+double __visible
+eddy_scan_average(struct eddy_scan *es, double start_time, double end_time)
+{
+    int pos = es->sample_start;
+    while (pos < es->sample_end && es->times[pos] < start_time)
+        pos++;
+    es->sample_start = pos;
+    double samp_sum = 0.;
+    int samp_count = 0;
+    while (pos < es->sample_end && es->times[pos] <= end_time) {
+        samp_sum += es->sample_freqs[pos];
+        samp_count++;
+        pos++;
+    }
+    if (!samp_count)
+        return 0.;
+    return samp_sum / samp_count;
+}
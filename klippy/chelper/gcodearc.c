@@ -0,0 +1,120 @@
+// G2/G3 arc segmentation
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code implements the segment generation of planArc() in
+// klippy/extras/gcode_arcs.py (which originates from Marlin's
+// plan_arc()).  The generated segments are reported as G1 moves in
+// 'struct gcode_move_line' format.
+
+#include <math.h> // atan2
+#include <stdint.h> // int64_t
+#include "compiler.h" // __visible
+#include "gcodeparse.h" // struct gcode_move_line
+
+struct gcode_arc {
+    // Arc parameters (filled by caller)
+    double start_pos[4], target_pos[3], offset[2];
+    int clockwise, alpha_axis, beta_axis, helical_axis;
+    double mm_per_arc_segment;
+    int has_e, absolute_extrude, has_f;
+    double e, f;
+    // Segment generation state
+    double center_p, center_q, theta_per_segment, linear_per_segment;
+    double e_base, e_per_move;
+    int64_t segments, pos;
+};
+
+// Determine the number of segments of an arc.  Returns the number of
+// segments or -1 if the arc is not valid.
+int64_t __visible
+gcode_arc_plan(struct gcode_arc *a)
+{
+    int alpha = a->alpha_axis, beta = a->beta_axis, helical = a->helical_axis;
+    double *cur = a->start_pos, *target = a->target_pos;
+    // Radius vector from center to current location
+    double r_p = -a->offset[0], r_q = -a->offset[1];
+    // Determine angular travel
+    double center_p = a->center_p = cur[alpha] - r_p;
+    double center_q = a->center_q = cur[beta] - r_q;
+    double rt_alpha = target[alpha] - center_p;
+    double rt_beta = target[beta] - center_q;
+    double angular_travel = atan2(r_p * rt_beta - r_q * rt_alpha
+                                  , r_p * rt_alpha + r_q * rt_beta);
+    if (angular_travel < 0.)
+        angular_travel += 2. * M_PI;
+    if (a->clockwise)
+        angular_travel -= 2. * M_PI;
+    if (angular_travel == 0.
+        && cur[alpha] == target[alpha] && cur[beta] == target[beta])
+        // Make a circle if the angular rotation is 0 and the target
+        // is current position
+        angular_travel = 2. * M_PI;
+    // Determine number of segments
+    double linear_travel = target[helical] - cur[helical];
+    double radius = hypot(r_p, r_q);
+    double flat_mm = radius * angular_travel;
+    double mm_of_travel;
+    if (linear_travel)
+        mm_of_travel = hypot(flat_mm, linear_travel);
+    else
+        mm_of_travel = fabs(flat_mm);
+    double segments = floor(mm_of_travel / a->mm_per_arc_segment);
+    if (!(segments > 1.))
+        segments = 1.;
+    if (!(segments < (double)INT32_MAX * INT32_MAX))
+        return -1;
+    a->theta_per_segment = angular_travel / segments;
+    a->linear_per_segment = linear_travel / segments;
+    a->e_per_move = a->e_base = 0.;
+    if (a->has_e) {
+        if (a->absolute_extrude)
+            a->e_base = cur[3];
+        a->e_per_move = (a->e - a->e_base) / segments;
+    }
+    a->pos = 0;
+    a->segments = segments;
+    return a->segments;
+}
+
+// Generate up to 'max' upcoming arc segments.  Returns the number of
+// segments stored in 'lines'.
+int __visible
+gcode_arc_fill(struct gcode_arc *a, struct gcode_move_line *lines, int max)
+{
+    int alpha = a->alpha_axis, beta = a->beta_axis, helical = a->helical_axis;
+    int count = 0;
+    while (count < max && a->pos < a->segments) {
+        int64_t i = ++a->pos;
+        struct gcode_move_line *ml = &lines[count++];
+        ml->cmd = 1;
+        ml->params = GP_X | GP_Y | GP_Z;
+        if (i == a->segments) {
+            ml->values[0] = a->target_pos[0];
+            ml->values[1] = a->target_pos[1];
+            ml->values[2] = a->target_pos[2];
+        } else {
+            double dist_helical = i * a->linear_per_segment;
+            double c_theta = i * a->theta_per_segment;
+            double cos_ti = cos(c_theta), sin_ti = sin(c_theta);
+            double r_p = -a->offset[0] * cos_ti + a->offset[1] * sin_ti;
+            double r_q = -a->offset[0] * sin_ti - a->offset[1] * cos_ti;
+            ml->values[alpha] = a->center_p + r_p;
+            ml->values[beta] = a->center_q + r_q;
+            ml->values[helical] = a->start_pos[helical] + dist_helical;
+        }
+        if (a->e_per_move) {
+            ml->params |= GP_E;
+            ml->values[3] = a->e_base + a->e_per_move;
+            if (a->absolute_extrude)
+                a->e_base += a->e_per_move;
+        }
+        if (a->has_f) {
+            ml->params |= GP_F;
+            ml->values[4] = a->f;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,222 @@
+// Fast G-Code line tokenizer
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code scans a batch of newline separated g-code lines and
+// reports the parameters of "plain" G0/G1 move commands in a compact
+// array.  A line is only reported as a move if the python parser in
+// gcode.py would produce the same command and parameters for it - any
+// line that can not be handled here (line numbers, checksums, unknown
+// parameters, extended syntax, etc.) is flagged so that the caller
+// falls back to the regular python parser.
+
+#include <stdint.h> // uint8_t
+#include <stdlib.h> // strtod
+#include <string.h> // memcpy
+#include "compiler.h" // __visible
+#include "gcodeparse.h" // struct gcode_move_line
+
+#define MAX_NUMBER_LEN 48
+
+static inline int
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline int
+is_alpha(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+static inline int
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Return the parameter index for a move parameter name (or -1)
+static int
+param_index(char c)
+{
+    switch (c) {
+    case 'X': case 'x': return 0;
+    case 'Y': case 'y': return 1;
+    case 'Z': case 'z': return 2;
+    case 'E': case 'e': return 3;
+    case 'F': case 'f': return 4;
+    }
+    return -1;
+}
+
+// Parse a number of the form "[+-]digits[.digits]".  Returns the
+// number of characters consumed or 0 if not a simple number.
+static int
+parse_number(const char *p, const char *end, double *value)
+{
+    const char *s = p;
+    int digits = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+    while (p < end && is_digit(*p))
+        p++, digits++;
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && is_digit(*p))
+            p++, digits++;
+    }
+    int len = p - s;
+    if (!digits || len >= MAX_NUMBER_LEN)
+        return 0;
+    // Copy to a local buffer so strtod() can't consume following
+    // characters (eg, "X1E2" is the parameters X=1 and E=2)
+    char buf[MAX_NUMBER_LEN];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    *value = strtod(buf, NULL);
+    return len;
+}
+
+// Parse a single line - returns the move command (0 or 1) or -1
+static int
+parse_line(struct gcode_move_line *ml, const char *p, const char *end)
+{
+    // Trailing comments are ignored
+    const char *c = memchr(p, ';', end - p);
+    if (c)
+        end = c;
+    while (p < end && is_space(*p))
+        p++;
+    // Check for "G0" or "G1" command
+    if (end - p < 2 || (p[0] != 'G' && p[0] != 'g')
+        || (p[1] != '0' && p[1] != '1'))
+        return -1;
+    int cmd = p[1] - '0';
+    p += 2;
+    if (p < end && !is_space(*p) && !is_alpha(*p))
+        return -1;
+    // Parse parameters
+    int params = 0;
+    for (;;) {
+        while (p < end && is_space(*p))
+            p++;
+        if (p >= end)
+            break;
+        int idx = param_index(*p);
+        if (idx < 0 || params & (1 << idx))
+            return -1;
+        p++;
+        if (p < end && is_alpha(*p))
+            return -1;
+        while (p < end && is_space(*p))
+            p++;
+        int len = parse_number(p, end, &ml->values[idx]);
+        if (!len)
+            return -1;
+        p += len;
+        if (p < end && !is_space(*p) && !is_alpha(*p))
+            return -1;
+        params |= 1 << idx;
+    }
+    // Invalid speeds are reported by the python code
+    if (params & GP_F && !(ml->values[4] > 0.))
+        return -1;
+    ml->params = params;
+    return cmd;
+}
+
+// Tokenize the newline separated lines in 'data'.  Returns the number
+// of lines processed, or -1 if 'data' contains more than 'max' lines.
+int __visible
+gcode_parse_moves(struct gcode_move_line *lines, int max
+                  , const char *data, int len)
+{
+    const char *p = data, *end = data + len;
+    int count = 0;
+    for (;;) {
+        if (count >= max)
+            return -1;
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        struct gcode_move_line *ml = &lines[count++];
+        ml->cmd = parse_line(ml, p, eol);
+        if (eol >= end)
+            break;
+        p = eol + 1;
+    }
+    return count;
+}
+
+
+/****************************************************************
+ * Tokenized line storage
+ ****************************************************************/
+
+// The tokenized lines may be stored in a compact form - each line is
+// a single byte (with the cmd and params of move lines) followed by
+// the values of the parameters that are present.
+
+#define PACK_MOVE 0x80
+#define PACK_G1 0x40
+#define PACK_PARAMS 0x1f
+
+// Store 'count' lines in 'buf' (which must have space for
+// count*(1+5*sizeof(double)) bytes).  Returns the bytes written.
+int __visible
+gcode_pack_moves(struct gcode_move_line *lines, int count, uint8_t *buf)
+{
+    uint8_t *p = buf;
+    int i, j;
+    for (i=0; i<count; i++) {
+        struct gcode_move_line *ml = &lines[i];
+        if (ml->cmd < 0) {
+            *p++ = 0;
+            continue;
+        }
+        *p++ = PACK_MOVE | (ml->cmd ? PACK_G1 : 0) | ml->params;
+        for (j=0; j<5; j++) {
+            if (!(ml->params & (1 << j)))
+                continue;
+            memcpy(p, &ml->values[j], sizeof(ml->values[j]));
+            p += sizeof(ml->values[j]);
+        }
+    }
+    return p - buf;
+}
+
+// Restore 'count' lines from 'buf'.  Returns 0 on success or -1 if
+// 'buf' is not valid.
+int __visible
+gcode_unpack_moves(struct gcode_move_line *lines, int count
+                   , const uint8_t *buf, int len)
+{
+    const uint8_t *p = buf, *end = buf + len;
+    int i, j;
+    for (i=0; i<count; i++) {
+        struct gcode_move_line *ml = &lines[i];
+        if (p >= end)
+            return -1;
+        uint8_t v = *p++;
+        if (!(v & PACK_MOVE)) {
+            if (v)
+                return -1;
+            ml->cmd = -1;
+            continue;
+        }
+        ml->cmd = v & PACK_G1 ? 1 : 0;
+        ml->params = v & PACK_PARAMS;
+        for (j=0; j<5; j++) {
+            if (!(ml->params & (1 << j)))
+                continue;
+            if (end - p < (int)sizeof(ml->values[j]))
+                return -1;
+            memcpy(&ml->values[j], p, sizeof(ml->values[j]));
+            p += sizeof(ml->values[j]);
+        }
+    }
+    return p == end ? 0 : -1;
+}
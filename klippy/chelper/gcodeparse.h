@@ -0,0 +1,13 @@
+#ifndef GCODEPARSE_H
+#define GCODEPARSE_H
+
+enum {
+    GP_X = 1 << 0, GP_Y = 1 << 1, GP_Z = 1 << 2, GP_E = 1 << 3, GP_F = 1 << 4,
+};
+
+struct gcode_move_line {
+    int cmd, params;
+    double values[5];
+};
+
+#endif // gcodeparse.h
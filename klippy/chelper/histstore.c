@@ -0,0 +1,130 @@
+// Compact storage of movement history
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// History entries are stored as variable length records in fixed size
+// blocks of bytes.  The owner encodes each entry relative to the
+// previous entry in the same block (so that common values take only a
+// few bytes) and records the time range of each block.  The first
+// entry of every block is encoded without reference to an earlier
+// block so that blocks may be decoded (and discarded) independently.
+
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "histstore.h" // struct histstore
+
+#define HISTSTORE_DEFAULT_MAX (4 * 1024 * 1024)
+#define HISTSTORE_START_SIZE 16
+
+// Initialize an empty history store
+void
+histstore_init(struct histstore *hs)
+{
+    memset(hs, 0, sizeof(*hs));
+    hs->max_bytes = HISTSTORE_DEFAULT_MAX;
+}
+
+// Free all memory associated with a history store
+void
+histstore_free(struct histstore *hs)
+{
+    while (hs->count)
+        histstore_expire_newest(hs);
+    free(hs->spare);
+    free(hs->blocks);
+    memset(hs, 0, sizeof(*hs));
+}
+
+// Set the maximum amount of memory to use for history blocks
+void
+histstore_set_limit(struct histstore *hs, size_t max_bytes)
+{
+    hs->max_bytes = max_bytes;
+}
+
+// Return the amount of memory currently allocated for the history
+size_t
+histstore_get_bytes(struct histstore *hs)
+{
+    return ((hs->count + !!hs->spare) * sizeof(struct hist_block)
+            + hs->size * sizeof(*hs->blocks));
+}
+
+// Return the most memory that has been allocated for the history
+size_t
+histstore_get_peak_bytes(struct histstore *hs)
+{
+    return hs->peak_bytes;
+}
+
+// Return a block (the newest block) with at least 'len' bytes of
+// space available.  A new block is started if needed, which may
+// discard the oldest blocks in order to remain within the memory limit.
+struct hist_block *
+histstore_reserve(struct histstore *hs, uint32_t len)
+{
+    if (hs->count) {
+        struct hist_block *b = histstore_get(hs, hs->count - 1);
+        if (b->len + len <= sizeof(b->data))
+            return b;
+    }
+    while (hs->count
+           && (hs->count + 1) * sizeof(struct hist_block) > hs->max_bytes)
+        histstore_expire_oldest(hs);
+    if (hs->count >= hs->size) {
+        // Grow the ring buffer (and move blocks to start of buffer)
+        uint32_t new_size = (hs->size ? hs->size * 2 : HISTSTORE_START_SIZE);
+        struct hist_block **blocks = malloc(sizeof(*blocks) * new_size);
+        uint32_t i;
+        for (i=0; i<hs->count; i++)
+            blocks[i] = histstore_get(hs, i);
+        free(hs->blocks);
+        hs->blocks = blocks;
+        hs->start = 0;
+        hs->size = new_size;
+    }
+    struct hist_block *b = hs->spare;
+    if (b)
+        hs->spare = NULL;
+    else
+        b = malloc(sizeof(*b));
+    memset(b, 0, offsetof(struct hist_block, data));
+    hs->blocks[(hs->start + hs->count++) & (hs->size - 1)] = b;
+    size_t bytes = histstore_get_bytes(hs);
+    if (bytes > hs->peak_bytes)
+        hs->peak_bytes = bytes;
+    return b;
+}
+
+// Release a block (keeping one block for reuse)
+static void
+release_block(struct histstore *hs, struct hist_block *b)
+{
+    if (hs->spare)
+        free(b);
+    else
+        hs->spare = b;
+}
+
+// Discard the oldest block
+void
+histstore_expire_oldest(struct histstore *hs)
+{
+    if (!hs->count)
+        return;
+    release_block(hs, histstore_get(hs, 0));
+    hs->start = (hs->start + 1) & (hs->size - 1);
+    hs->count--;
+}
+
+// Discard the newest block
+void
+histstore_expire_newest(struct histstore *hs)
+{
+    if (!hs->count)
+        return;
+    release_block(hs, histstore_get(hs, hs->count - 1));
+    hs->count--;
+}
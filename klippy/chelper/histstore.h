@@ -0,0 +1,104 @@
+#ifndef HISTSTORE_H
+#define HISTSTORE_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+#include <string.h> // memcpy
+
+#define HIST_BLOCK_SIZE 1024
+
+// Time (or clock) range of the entries stored in a block
+union hist_key {
+    double time;
+    uint64_t clock;
+};
+
+struct hist_block {
+    union hist_key start, end;
+    uint32_t count, len;
+    uint8_t data[HIST_BLOCK_SIZE];
+};
+
+struct histstore {
+    struct hist_block **blocks;
+    uint32_t start, count, size;
+    struct hist_block *spare;
+    size_t max_bytes, peak_bytes;
+};
+
+void histstore_init(struct histstore *hs);
+void histstore_free(struct histstore *hs);
+void histstore_set_limit(struct histstore *hs, size_t max_bytes);
+size_t histstore_get_bytes(struct histstore *hs);
+size_t histstore_get_peak_bytes(struct histstore *hs);
+struct hist_block *histstore_reserve(struct histstore *hs, uint32_t len);
+void histstore_expire_oldest(struct histstore *hs);
+void histstore_expire_newest(struct histstore *hs);
+
+// Return the block at the given position (0 is the oldest)
+static inline struct hist_block *
+histstore_get(struct histstore *hs, uint32_t pos)
+{
+    return hs->blocks[(hs->start + pos) & (hs->size - 1)];
+}
+
+// Entries are encoded with variable length integers (with "zig-zag"
+// encoding of signed values) and raw doubles
+static inline uint8_t *
+hist_put_uint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline uint8_t *
+hist_put_int(uint8_t *p, int64_t v)
+{
+    return hist_put_uint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static inline uint8_t *
+hist_put_double(uint8_t *p, double v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline uint64_t
+hist_get_uint(uint8_t **pp)
+{
+    uint8_t *p = *pp;
+    uint64_t v = 0;
+    int shift = 0;
+    for (;;) {
+        uint8_t c = *p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    *pp = p;
+    return v;
+}
+
+static inline int64_t
+hist_get_int(uint8_t **pp)
+{
+    uint64_t v = hist_get_uint(pp);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline double
+hist_get_double(uint8_t **pp)
+{
+    double v;
+    memcpy(&v, *pp, sizeof(v));
+    *pp += sizeof(v);
+    return v;
+}
+
+#endif // histstore.h
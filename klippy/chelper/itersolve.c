@@ -1,6 +1,6 @@
 // Iterative solver for kinematic moves
 //
-// Copyright (C) 2018-2020  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -14,6 +14,98 @@
 #include "trapq.h" // struct move
 
 
+/****************************************************************
+ * Ganged steppers
+ ****************************************************************/
+
+// Steppers with identical kinematics (eg, multiple z steppers on the
+// same rail) produce identical step times.  The steps found for the
+// "gang leader" are also added to the stepcompress of any follower
+// that currently has the same state as the leader.
+
+// Add a step time to the stepper and its mirrored gang followers
+static int32_t
+gang_append(struct stepper_kinematics *sk, int sdir
+            , double print_time, double step_time)
+{
+    int32_t ret = stepcompress_append(sk->sc, sdir, print_time, step_time);
+    struct stepper_kinematics *f;
+    for (f = sk->gang_list; f && !ret; f = f->gang_next)
+        if (f->gang_mirror)
+            ret = stepcompress_append(f->sc, sdir, print_time, step_time);
+    return ret;
+}
+
+// Add a batch of step times to the stepper and its gang followers
+static int32_t
+gang_append_batch(struct stepper_kinematics *sk, int sdir, double print_time
+                  , const double *step_times, int count)
+{
+    int32_t ret = stepcompress_append_batch(sk->sc, sdir, print_time
+                                            , step_times, count);
+    struct stepper_kinematics *f;
+    for (f = sk->gang_list; f && !ret; f = f->gang_next)
+        if (f->gang_mirror)
+            ret = stepcompress_append_batch(f->sc, sdir, print_time
+                                            , step_times, count);
+    return ret;
+}
+
+// Commit the pending step of the stepper and its gang followers
+static int32_t
+gang_commit(struct stepper_kinematics *sk)
+{
+    int32_t ret = stepcompress_commit(sk->sc);
+    struct stepper_kinematics *f;
+    for (f = sk->gang_list; f && !ret; f = f->gang_next)
+        if (f->gang_mirror)
+            ret = stepcompress_commit(f->sc);
+    return ret;
+}
+
+// Check if a gang follower is in the same state as its leader
+static int
+gang_check_state(struct stepper_kinematics *sk, struct stepper_kinematics *f)
+{
+    return (f->tq == sk->tq && f->step_dist == sk->step_dist
+            && f->commanded_pos == sk->commanded_pos
+            && f->last_flush_time == sk->last_flush_time
+            && f->last_move_time == sk->last_move_time
+            && f->active_flags == sk->active_flags
+            && f->gen_steps_pre_active == sk->gen_steps_pre_active
+            && f->gen_steps_post_active == sk->gen_steps_post_active
+            && f->calc_position_cb == sk->calc_position_cb
+            && f->calc_linear_cb == sk->calc_linear_cb
+            && f->calc_radical_cb == sk->calc_radical_cb
+            && f->post_cb == sk->post_cb
+            && (stepcompress_get_step_dir(f->sc)
+                == stepcompress_get_step_dir(sk->sc)));
+}
+
+// Determine which gang followers can use the steps of the leader
+void
+itersolve_gang_prepare(struct stepper_kinematics *sk)
+{
+    struct stepper_kinematics *f;
+    for (f = sk->gang_list; f; f = f->gang_next)
+        f->gang_mirror = f->sc && gang_check_state(sk, f);
+}
+
+// Update the state of mirrored gang followers after generating steps
+static void
+gang_update_state(struct stepper_kinematics *sk)
+{
+    struct stepper_kinematics *f;
+    for (f = sk->gang_list; f; f = f->gang_next) {
+        if (!f->gang_mirror)
+            continue;
+        f->commanded_pos = sk->commanded_pos;
+        f->last_flush_time = sk->last_flush_time;
+        f->last_move_time = sk->last_move_time;
+    }
+}
+
+
 /****************************************************************
  * Main iterative solver
  ****************************************************************/
@@ -24,18 +116,13 @@ struct timepos {
 
 #define SEEK_TIME_RESET 0.000100
 
-// Generate step times for a portion of a move
+// Generate step times for a portion of a move using iterative search
 static int32_t
-itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
-                          , double abs_start, double abs_end)
+itersolve_gen_steps_search(struct stepper_kinematics *sk, struct move *m
+                           , double start, double end)
 {
     sk_calc_callback calc_position_cb = sk->calc_position_cb;
     double half_step = .5 * sk->step_dist;
-    double start = abs_start - m->print_time, end = abs_end - m->print_time;
-    if (start < 0.)
-        start = 0.;
-    if (end > m->move_t)
-        end = m->move_t;
     struct timepos old_guess = {start, sk->commanded_pos}, guess = old_guess;
     int sdir = stepcompress_get_step_dir(sk->sc);
     int is_dir_change = 0, have_bracket = 0, check_oscillate = 0;
@@ -99,13 +186,13 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
             if (!have_bracket || high_time - low_time > .000000001) {
                 if (!is_dir_change && rel_dist >= -half_step)
                     // Avoid rollback if stepper fully reaches step position
-                    stepcompress_commit(sk->sc);
+                    gang_commit(sk);
                 // Guess is not close enough - guess again with new time
                 continue;
             }
         }
         // Found next step - submit it
-        int ret = stepcompress_append(sk->sc, sdir, m->print_time, guess.time);
+        int ret = gang_append(sk, sdir, m->print_time, guess.time);
         if (ret)
             return ret;
         target = sdir ? target+half_step+half_step : target-half_step-half_step;
@@ -122,8 +209,288 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         is_dir_change = have_bracket = check_oscillate = 0;
     }
     sk->commanded_pos = target - (sdir ? half_step : -half_step);
-    if (sk->post_cb)
+    return 0;
+}
+
+
+/****************************************************************
+ * Closed-form solver
+ ****************************************************************/
+
+// Generate step times for a portion of a move on a stepper with a
+// position of "base + scale * move_distance".  The caller must ensure
+// the move does not change direction within the requested range.
+static int32_t
+itersolve_gen_steps_linear(struct stepper_kinematics *sk, struct move *m
+                           , double start, double end
+                           , double base, double scale)
+{
+    double step_dist = sk->step_dist, half_step = .5 * step_dist;
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double dist_dir = (2. * start_v + 2. * half_accel * (start + end) >= 0.
+                       ? 1. : -1.);
+    double pos_start = base + scale * move_get_distance(m, start);
+    double pos_end = base + scale * move_get_distance(m, end);
+    double commanded_pos = sk->commanded_pos;
+    // Determine the number of step positions crossed in the range
+    int sdir = scale * dist_dir > 0.;
+    double reach = (sdir ? pos_end - commanded_pos : commanded_pos - pos_end);
+    reach += .000000001 - half_step;
+    int count = reach >= 0. ? (int)(reach / step_dist) + 1 : 0;
+    // Solve "half_accel*t^2 + start_v*t - dist = 0" for each step
+    double inv_scale = scale ? 1. / scale : 0., last_time = start;
+    double step_delta = sdir ? step_dist : -step_dist;
+    double target = commanded_pos + (sdir ? half_step : -half_step);
+    double step_times[256];
+    int i = 0;
+    while (i < count) {
+        int batch = count - i, j;
+        if (batch > ARRAY_SIZE(step_times))
+            batch = ARRAY_SIZE(step_times);
+        for (j=0; j<batch; j++) {
+            double dist = (target - base) * inv_scale;
+            double disc = start_v * start_v + 4. * half_accel * dist;
+            double denom = start_v + dist_dir * sqrt(disc > 0. ? disc : 0.);
+            double step_time = denom ? 2. * dist / denom : last_time;
+            if (!(step_time >= last_time)) // or NaN
+                step_time = last_time;
+            if (step_time > end)
+                step_time = end;
+            step_times[j] = last_time = step_time;
+            target += step_delta;
+        }
+        int ret = gang_append_batch(sk, sdir, m->print_time
+                                    , step_times, batch);
+        if (ret)
+            return ret;
+        i += batch;
+    }
+    if (count)
+        commanded_pos = target - (sdir ? half_step : -half_step);
+    else
+        sdir = stepcompress_get_step_dir(sk->sc);
+    // Avoid rollback if stepper fully reaches step position
+    double rel_start = pos_start - commanded_pos;
+    double rel_end = pos_end - commanded_pos;
+    if (sdir ? (rel_start >= 0. || rel_end >= 0.)
+        : (rel_start <= 0. || rel_end <= 0.))
+        gang_commit(sk);
+    sk->commanded_pos = commanded_pos;
+    return 0;
+}
+
+
+// Determine the move time of a given move distance (the caller must
+// provide the direction of travel)
+static inline double
+radical_dist_to_time(struct move *m, double dist, double dist_dir
+                     , double last_time)
+{
+    double start_v = m->start_v;
+    double disc = start_v * start_v + 4. * m->half_accel * dist;
+    double denom = start_v + dist_dir * sqrt(disc > 0. ? disc : 0.);
+    return denom ? 2. * dist / denom : last_time;
+}
+
+// Find the move distance (in the range 'low_d' to 'high_d') where a
+// stepper with a "radical" position formula reaches 'rel_target'
+// (target position minus base)
+static inline double
+radical_solve(double rel_target, double scale, const double *coefs
+              , double low_d, double high_d)
+{
+    // Solve: (rel_target - scale*d)^2 = coefs[0] + coefs[1]*d + coefs[2]*d^2
+    double a = coefs[2] - scale * scale;
+    double b = coefs[1] + 2. * scale * rel_target;
+    double c = coefs[0] - rel_target * rel_target;
+    double r1, r2;
+    if (!a) {
+        r1 = r2 = b ? -c / b : low_d;
+    } else {
+        double disc = b * b - 4. * a * c;
+        double q = -.5 * (b + copysign(sqrt(disc > 0. ? disc : 0.), b));
+        r1 = q / a;
+        r2 = q ? c / q : r1;
+    }
+    // Select the root that is in range (and not from the negative sqrt)
+    double e1 = (r1 < low_d ? low_d - r1 : (r1 > high_d ? r1 - high_d : 0.));
+    double e2 = (r2 < low_d ? low_d - r2 : (r2 > high_d ? r2 - high_d : 0.));
+    if (rel_target - scale * r1 < 0.)
+        e1 += high_d - low_d + 1.;
+    if (rel_target - scale * r2 < 0.)
+        e2 += high_d - low_d + 1.;
+    double d = e2 < e1 ? r2 : r1;
+    if (d < low_d)
+        d = low_d;
+    if (d > high_d)
+        d = high_d;
+    return d;
+}
+
+// Calculate the derivative (relative to move distance) of a stepper
+// with a "radical" position formula
+static inline double
+radical_deriv(double scale, const double *coefs, double dist)
+{
+    double quad = coefs[0] + (coefs[1] + coefs[2] * dist) * dist;
+    double dquad = coefs[1] + 2. * coefs[2] * dist;
+    return scale + .5 * dquad / sqrt(quad > 0. ? quad : 0.);
+}
+
+// Generate step times for a portion of a move where a "radical"
+// stepper position formula does not change direction
+static int32_t
+itersolve_gen_steps_radical_range(struct stepper_kinematics *sk
+                                  , struct move *m, double start, double end
+                                  , double start_d, double end_d
+                                  , double dist_dir, double base
+                                  , double scale, const double *coefs)
+{
+    double step_dist = sk->step_dist, half_step = .5 * step_dist;
+    double pos_start = (base + scale * start_d
+                        + sqrt(coefs[0] + (coefs[1] + coefs[2]*start_d)
+                               * start_d));
+    double pos_end = (base + scale * end_d
+                      + sqrt(coefs[0] + (coefs[1] + coefs[2]*end_d) * end_d));
+    double commanded_pos = sk->commanded_pos;
+    // Determine the number of step positions crossed in the range
+    int sdir = (pos_end != pos_start ? pos_end > pos_start
+                : stepcompress_get_step_dir(sk->sc));
+    double reach = (sdir ? pos_end - commanded_pos : commanded_pos - pos_end);
+    reach += .000000001 - half_step;
+    int count = reach >= 0. ? (int)(reach / step_dist) + 1 : 0;
+    // Solve for the move distance and then move time of each step
+    double low_d = start_d < end_d ? start_d : end_d;
+    double high_d = start_d < end_d ? end_d : start_d, last_time = start;
+    double step_delta = sdir ? step_dist : -step_dist;
+    double target = commanded_pos + (sdir ? half_step : -half_step);
+    double step_times[256];
+    int i = 0;
+    while (i < count) {
+        int batch = count - i, j;
+        if (batch > ARRAY_SIZE(step_times))
+            batch = ARRAY_SIZE(step_times);
+        for (j=0; j<batch; j++) {
+            double dist = radical_solve(target - base, scale, coefs
+                                        , low_d, high_d);
+            double step_time = radical_dist_to_time(m, dist, dist_dir
+                                                    , last_time);
+            if (!(step_time >= last_time)) // or NaN
+                step_time = last_time;
+            if (step_time > end)
+                step_time = end;
+            step_times[j] = last_time = step_time;
+            target += step_delta;
+        }
+        int ret = gang_append_batch(sk, sdir, m->print_time
+                                    , step_times, batch);
+        if (ret)
+            return ret;
+        i += batch;
+    }
+    if (count)
+        commanded_pos = target - (sdir ? half_step : -half_step);
+    else
+        sdir = stepcompress_get_step_dir(sk->sc);
+    // Avoid rollback if stepper fully reaches step position
+    double rel_start = pos_start - commanded_pos;
+    double rel_end = pos_end - commanded_pos;
+    if (sdir ? (rel_start >= 0. || rel_end >= 0.)
+        : (rel_start <= 0. || rel_end <= 0.))
+        gang_commit(sk);
+    sk->commanded_pos = commanded_pos;
+    return 0;
+}
+
+// Generate step times for a portion of a move on a stepper with a
+// position of "base + scale * move_distance + sqrt(quadratic)" (eg,
+// the towers of a linear delta).  The caller must ensure the move
+// does not change direction within the requested range.
+static int32_t
+itersolve_gen_steps_radical(struct stepper_kinematics *sk, struct move *m
+                            , double start, double end
+                            , double base, double scale, const double *coefs)
+{
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double dist_dir = (2. * start_v + 2. * half_accel * (start + end) >= 0.
+                       ? 1. : -1.);
+    double start_d = move_get_distance(m, start);
+    double end_d = move_get_distance(m, end);
+    // The stepper position is a concave function of the move distance
+    // - check if it reaches a peak within the range
+    double start_deriv = radical_deriv(scale, coefs, start_d) * dist_dir;
+    double end_deriv = radical_deriv(scale, coefs, end_d) * dist_dir;
+    if (!(start_deriv > 0. && end_deriv < 0.) || coefs[2] >= 0.)
+        return itersolve_gen_steps_radical_range(
+            sk, m, start, end, start_d, end_d, dist_dir, base, scale, coefs);
+    // Find peak: coefs[1] + 2*coefs[2]*d = -2*scale*sqrt(quadratic)
+    double q0 = coefs[0], q1 = coefs[1], q2 = coefs[2], s2 = scale * scale;
+    double peak_d = -.5 * q1 / q2;
+    if (scale) {
+        double a = 4. * q2 * (q2 - s2), b = 4. * q1 * (q2 - s2);
+        double c = q1 * q1 - 4. * s2 * q0;
+        double disc = b * b - 4. * a * c;
+        double sq = sqrt(disc > 0. ? disc : 0.);
+        double r1 = (-b + sq) / (2. * a), r2 = (-b - sq) / (2. * a);
+        // Pick root where (coefs[1] + 2*coefs[2]*d) has sign opposite scale
+        double g1 = (q1 + 2. * q2 * r1) * scale;
+        double g2 = (q1 + 2. * q2 * r2) * scale;
+        peak_d = (g1 <= 0. && (g2 > 0. || fabs(g1) <= fabs(g2))) ? r1 : r2;
+    }
+    double low_d = start_d < end_d ? start_d : end_d;
+    double high_d = start_d < end_d ? end_d : start_d;
+    if (!(peak_d > low_d && peak_d < high_d))
+        return itersolve_gen_steps_radical_range(
+            sk, m, start, end, start_d, end_d, dist_dir, base, scale, coefs);
+    double peak_t = radical_dist_to_time(m, peak_d, dist_dir, start);
+    if (!(peak_t > start && peak_t < end))
+        return itersolve_gen_steps_radical_range(
+            sk, m, start, end, start_d, end_d, dist_dir, base, scale, coefs);
+    int32_t ret = itersolve_gen_steps_radical_range(
+        sk, m, start, peak_t, start_d, peak_d, dist_dir, base, scale, coefs);
+    if (ret)
+        return ret;
+    return itersolve_gen_steps_radical_range(
+        sk, m, peak_t, end, peak_d, end_d, dist_dir, base, scale, coefs);
+}
+
+
+/****************************************************************
+ * Step generation dispatch
+ ****************************************************************/
+
+// Generate step times for a portion of a move
+static int32_t
+itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
+                          , double abs_start, double abs_end)
+{
+    double start = abs_start - m->print_time, end = abs_end - m->print_time;
+    if (start < 0.)
+        start = 0.;
+    if (end > m->move_t)
+        end = m->move_t;
+    int32_t ret;
+    double base, scale, coefs[3];
+    double start_dv = m->start_v + 2. * m->half_accel * start;
+    double end_dv = m->start_v + 2. * m->half_accel * end;
+    if (sk->calc_linear_cb && start_dv * end_dv >= 0.
+        && !sk->calc_linear_cb(sk, m, &base, &scale))
+        ret = itersolve_gen_steps_linear(sk, m, start, end, base, scale);
+    else if (sk->calc_radical_cb && start_dv * end_dv >= 0.
+             && !sk->calc_radical_cb(sk, m, &base, &scale, coefs))
+        ret = itersolve_gen_steps_radical(sk, m, start, end
+                                          , base, scale, coefs);
+    else
+        ret = itersolve_gen_steps_search(sk, m, start, end);
+    if (ret)
+        return ret;
+    if (sk->post_cb) {
         sk->post_cb(sk);
+        struct stepper_kinematics *f;
+        for (f = sk->gang_list; f; f = f->gang_next)
+            if (f->gang_mirror)
+                f->post_cb(f);
+    }
     return 0;
 }
 
@@ -143,19 +510,31 @@ check_active(struct stepper_kinematics *sk, struct move *m)
 }
 
 // Generate step times for a range of moves on the trapq
-int32_t __visible
-itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+static int32_t
+generate_steps(struct stepper_kinematics *sk, double flush_time)
 {
     double last_flush_time = sk->last_flush_time;
     sk->last_flush_time = flush_time;
     if (!sk->tq)
         return 0;
     trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
+    struct move *m = trapq_first_move(sk->tq);
     while (last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+        m = move_next(m);
     double force_steps_time = sk->last_move_time + sk->gen_steps_post_active;
     int skip_count = 0;
+    if (force_steps_time <= m->print_time) {
+        // Skip directly to the next move with activity on this stepper
+        double active_time = trapq_next_active(sk->tq, sk->active_flags
+                                               , last_flush_time);
+        if (active_time > m->print_time) {
+            if (flush_time + sk->gen_steps_pre_active <= active_time)
+                return 0;
+            struct move *am = trapq_find_move(sk->tq, m, active_time);
+            skip_count = am - m;
+            m = am;
+        }
+    }
     for (;;) {
         double move_start = m->print_time, move_end = move_start + m->move_t;
         if (check_active(sk, m)) {
@@ -166,15 +545,15 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
                     abs_start = last_flush_time;
                 if (abs_start < force_steps_time)
                     abs_start = force_steps_time;
-                struct move *pm = list_prev_entry(m, node);
+                struct move *pm = move_prev(m);
                 while (--skip_count && pm->print_time > abs_start)
-                    pm = list_prev_entry(pm, node);
+                    pm = move_prev(pm);
                 do {
                     int32_t ret = itersolve_gen_steps_range(sk, pm, abs_start
                                                             , flush_time);
                     if (ret)
                         return ret;
-                    pm = list_next_entry(pm, node);
+                    pm = move_next(pm);
                 } while (pm != m);
             }
             // Generate steps for this move
@@ -207,26 +586,52 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
             if (flush_time + sk->gen_steps_pre_active <= move_end)
                 return 0;
         }
-        m = list_next_entry(m, node);
+        m = move_next(m);
     }
 }
 
+// Generate step times for a stepper and its prepared gang followers
+int32_t
+itersolve_gang_generate(struct stepper_kinematics *sk, double flush_time)
+{
+    int32_t ret = generate_steps(sk, flush_time);
+    gang_update_state(sk);
+    return ret;
+}
+
+// Generate step times for a range of moves on the trapq
+int32_t __visible
+itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+{
+    if (sk->gang_mirror) {
+        // Steps already generated by the gang leader
+        sk->gang_mirror = 0;
+        return 0;
+    }
+    itersolve_gang_prepare(sk);
+    return itersolve_gang_generate(sk, flush_time);
+}
+
 // Check if the given stepper is likely to be active in the given time range
 double __visible
 itersolve_check_active(struct stepper_kinematics *sk, double flush_time)
 {
     if (!sk->tq)
         return 0.;
+    double active_time = trapq_next_active(sk->tq, sk->active_flags
+                                           , sk->last_flush_time);
+    if (active_time > sk->last_flush_time)
+        return active_time < flush_time ? active_time : 0.;
     trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
+    struct move *m = trapq_first_move(sk->tq);
     while (sk->last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+        m = move_next(m);
     for (;;) {
         if (check_active(sk, m))
             return m->print_time;
         if (flush_time <= m->print_time + m->move_t)
             return 0.;
-        m = list_next_entry(m, node);
+        m = move_next(m);
     }
 }
 
@@ -278,3 +683,41 @@ itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
     return sk->commanded_pos;
 }
+
+// Report the stepper position at regular intervals of the queued
+// moves (for use by analysis tools)
+void __visible
+itersolve_sample_positions(struct stepper_kinematics *sk, double start_time
+                           , double sample_time, int count, double *positions)
+{
+    trapq_check_sentinels(sk->tq);
+    struct move *m = trapq_first_move(sk->tq);
+    int i;
+    for (i=0; i<count; i++) {
+        double t = start_time + i * sample_time;
+        m = trapq_find_move(sk->tq, m, t);
+        positions[i] = sk->calc_position_cb(sk, m, t - m->print_time);
+    }
+}
+
+// Set the steppers that share the kinematics of 'sk'.  The caller
+// must ensure the followers are configured with identical kinematics.
+void __visible
+itersolve_set_gang(struct stepper_kinematics *sk
+                   , struct stepper_kinematics **followers, int count)
+{
+    struct stepper_kinematics **pnext = &sk->gang_list;
+    sk->gang_next = NULL;
+    sk->gang_mirror = 0;
+    int i;
+    for (i=0; i<count; i++) {
+        struct stepper_kinematics *f = followers[i];
+        if (f == sk)
+            continue;
+        f->gang_list = NULL;
+        f->gang_mirror = 0;
+        *pnext = f;
+        pnext = &f->gang_next;
+    }
+    *pnext = NULL;
+}
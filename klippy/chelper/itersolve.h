@@ -12,6 +12,11 @@ struct move;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
+typedef int (*sk_linear_callback)(struct stepper_kinematics *sk, struct move *m
+                                  , double *base, double *scale);
+typedef int (*sk_radical_callback)(struct stepper_kinematics *sk
+                                   , struct move *m, double *base
+                                   , double *scale, double *coefs);
 struct stepper_kinematics {
     double step_dist, commanded_pos;
     struct stepcompress *sc;
@@ -23,10 +28,23 @@ struct stepper_kinematics {
 
     sk_calc_callback calc_position_cb;
     sk_post_callback post_cb;
+    // Optional - report "base + scale * move_distance" form of stepper position
+    sk_linear_callback calc_linear_cb;
+    // Optional - report "base + scale * move_distance
+    //   + sqrt(coefs[0] + coefs[1]*move_distance + coefs[2]*move_distance^2)"
+    // form of stepper position (coefs[2] must not be positive)
+    sk_radical_callback calc_radical_cb;
+
+    // Steppers sharing these kinematics (eg, multiple z steppers)
+    struct stepper_kinematics *gang_list, *gang_next;
+    int gang_mirror;
 };
 
 int32_t itersolve_generate_steps(struct stepper_kinematics *sk
                                  , double flush_time);
+void itersolve_gang_prepare(struct stepper_kinematics *sk);
+int32_t itersolve_gang_generate(struct stepper_kinematics *sk
+                                , double flush_time);
 double itersolve_check_active(struct stepper_kinematics *sk, double flush_time);
 int32_t itersolve_is_active_axis(struct stepper_kinematics *sk, char axis);
 void itersolve_set_trapq(struct stepper_kinematics *sk, struct trapq *tq);
@@ -37,5 +55,10 @@ double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
 void itersolve_set_position(struct stepper_kinematics *sk
                             , double x, double y, double z);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+void itersolve_sample_positions(struct stepper_kinematics *sk
+                                , double start_time, double sample_time
+                                , int count, double *positions);
+void itersolve_set_gang(struct stepper_kinematics *sk
+                        , struct stepper_kinematics **followers, int count);
 
 #endif // itersolve.h
@@ -27,6 +27,23 @@ delta_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(ds->arm2 - dx*dx - dy*dy) + c.z;
 }
 
+// Report the tower position as "z + sqrt(arm2 - dx^2 - dy^2)" where
+// dx and dy are linear in the move distance
+static int
+delta_stepper_calc_radical(struct stepper_kinematics *sk, struct move *m
+                           , double *base, double *scale, double *coefs)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    double dx = ds->tower_x - m->start_pos.x, dy = ds->tower_y - m->start_pos.y;
+    double rx = m->axes_r.x, ry = m->axes_r.y;
+    *base = m->start_pos.z;
+    *scale = m->axes_r.z;
+    coefs[0] = ds->arm2 - dx*dx - dy*dy;
+    coefs[1] = 2. * (rx*dx + ry*dy);
+    coefs[2] = -(rx*rx + ry*ry);
+    return 0;
+}
+
 struct stepper_kinematics * __visible
 delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
@@ -36,6 +53,7 @@ delta_stepper_alloc(double arm2, double tower_x, double tower_y)
     ds->tower_x = tower_x;
     ds->tower_y = tower_y;
     ds->sk.calc_position_cb = delta_stepper_calc_position;
+    ds->sk.calc_radical_cb = delta_stepper_calc_radical;
     ds->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &ds->sk;
 }
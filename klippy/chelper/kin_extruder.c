@@ -1,6 +1,6 @@
 // Extruder stepper pulse time generation
 //
-// Copyright (C) 2018-2019  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -15,9 +15,22 @@
 
 struct pa_params {
     double pressure_advance, active_print_time;
+    double half_smooth_time, inv_half_smooth_time2;
     struct list_node node;
 };
 
+// Find the pressure advance parameters active at the given print_time
+static inline struct pa_params *
+pa_params_lookup(struct list_head *pa_list, double print_time)
+{
+    struct pa_params *pa = list_last_entry(pa_list, struct pa_params, node);
+    while (unlikely(pa->active_print_time > print_time) &&
+            !list_is_first(&pa->node, pa_list)) {
+        pa = list_prev_entry(pa, node);
+    }
+    return pa;
+}
+
 // Without pressure advance, the extruder stepper position is:
 //     extruder_position(t) = nominal_position(t)
 // When pressure advance is enabled, additional filament is pushed
@@ -56,10 +69,10 @@ extruder_integrate_time(double base, double start_v, double half_accel
     return ei - si;
 }
 
-// Calculate the definitive integral of extruder for a given move
-static double
-pa_move_integrate(struct move *m, struct list_head *pa_list
-                  , double base, double start, double end, double time_offset)
+// Calculate the definitive integrals of extruder for a given move
+static void
+pa_move_integrals(struct move *m, struct list_head *pa_list, double base
+                  , double start, double end, double *piext, double *pwgt_ext)
 {
     if (start < 0.)
         start = 0.;
@@ -68,108 +81,226 @@ pa_move_integrate(struct move *m, struct list_head *pa_list
     // Determine pressure_advance value
     int can_pressure_advance = m->axes_r.y != 0.;
     double pressure_advance = 0.;
-    if (can_pressure_advance) {
-        struct pa_params *pa = list_last_entry(pa_list, struct pa_params, node);
-        while (unlikely(pa->active_print_time > m->print_time) &&
-                !list_is_first(&pa->node, pa_list)) {
-            pa = list_prev_entry(pa, node);
-        }
-        pressure_advance = pa->pressure_advance;
-    }
+    if (can_pressure_advance)
+        pressure_advance = pa_params_lookup(
+            pa_list, m->print_time)->pressure_advance;
     // Calculate base position and velocity with pressure advance
     base += pressure_advance * m->start_v;
     double start_v = m->start_v + pressure_advance * 2. * m->half_accel;
     // Calculate definitive integral
     double ha = m->half_accel;
-    double iext = extruder_integrate(base, start_v, ha, start, end);
-    double wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+    *piext = extruder_integrate(base, start_v, ha, start, end);
+    *pwgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+}
+
+// Calculate the definitive integral of extruder for a given move
+static double
+pa_move_integrate(struct move *m, struct list_head *pa_list
+                  , double base, double start, double end, double time_offset)
+{
+    double iext, wgt_ext;
+    pa_move_integrals(m, pa_list, base, start, end, &iext, &wgt_ext);
     return wgt_ext - time_offset * iext;
 }
 
-// Calculate the definitive integral of the extruder over a range of moves
+// Cached integrals of the moves fully contained in a smoothing window.
+// The cache is valid while the window start is in 'start_m' and the
+// window end is in 'end_m' (times are relative to the start of 'm').
+struct pa_range_cache {
+    struct move *m, *start_m, *end_m;
+    uint32_t reloc_count;
+    double half_smooth_time;
+    double start_lo, start_hi, end_lo, end_hi;
+    double prev_a, prev_b, next_a, next_b;
+};
+
+struct extruder_stepper {
+    struct stepper_kinematics sk;
+    struct list_head pa_list;
+    struct pa_range_cache prc;
+};
+
+// Calculate the definitive integral of the extruder over a range of
+// moves using the cached integrals of the inner moves
 static double
-pa_range_integrate(struct move *m, double move_time
-                   , struct list_head *pa_list, double hst)
+pa_range_integrate_cached(struct extruder_stepper *es, struct move *m
+                          , double move_time, double hst)
 {
-    // Calculate integral for the current move
+    struct pa_range_cache *prc = &es->prc;
+    struct list_head *pa_list = &es->pa_list;
     double res = 0., start = move_time - hst, end = move_time + hst;
     double start_base = m->start_pos.x;
     res += pa_move_integrate(m, pa_list, 0., start, move_time, start);
     res -= pa_move_integrate(m, pa_list, 0., move_time, end, end);
     // Integrate over previous moves
+    struct move *sm = prc->start_m;
+    if (sm != m) {
+        double sm_start = start + (m->print_time - sm->print_time);
+        double base = sm->start_pos.x - start_base;
+        res += pa_move_integrate(sm, pa_list, base, sm_start
+                                 , sm->move_t, sm_start);
+        res += prc->prev_a - start * prc->prev_b;
+    }
+    // Integrate over future moves
+    struct move *em = prc->end_m;
+    if (em != m) {
+        double em_end = end + (m->print_time - em->print_time);
+        double base = em->start_pos.x - start_base;
+        res -= pa_move_integrate(em, pa_list, base, 0., em_end, em_end);
+        res -= prc->next_a - end * prc->next_b;
+    }
+    return res;
+}
+
+// Calculate the definitive integral of the extruder over a range of moves
+static double
+pa_range_integrate(struct extruder_stepper *es, struct move *m
+                   , double move_time, double hst)
+{
+    struct pa_range_cache *prc = &es->prc;
+    struct trapq *tq = es->sk.tq;
+    double start = move_time - hst, end = move_time + hst;
+    if (prc->m == m && prc->reloc_count == tq->moves.reloc_count
+        && prc->half_smooth_time == hst
+        && start >= prc->start_lo && start <= prc->start_hi
+        && end >= prc->end_lo && end <= prc->end_hi)
+        return pa_range_integrate_cached(es, m, move_time, hst);
+    // Calculate integral for the current move
+    struct list_head *pa_list = &es->pa_list;
+    double res = 0., start_base = m->start_pos.x;
+    res += pa_move_integrate(m, pa_list, 0., start, move_time, start);
+    res -= pa_move_integrate(m, pa_list, 0., move_time, end, end);
+    int can_cache = tq && trapq_is_pending_move(tq, m);
+    // Integrate over previous moves
+    double prev_a = 0., prev_b = 0., start_lo = 0., start_hi = m->move_t;
     struct move *prev = m;
     while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
+        prev = move_prev(prev);
         start += prev->move_t;
-        double base = prev->start_pos.x - start_base;
-        res += pa_move_integrate(prev, pa_list, base, start
-                                 , prev->move_t, start);
+        double base = prev->start_pos.x - start_base, iext, wgt_ext;
+        pa_move_integrals(prev, pa_list, base, start, prev->move_t
+                          , &iext, &wgt_ext);
+        res += wgt_ext - start * iext;
+        double time_diff = m->print_time - prev->print_time;
+        if (start < 0.) {
+            // Entire move is in the window
+            prev_a += wgt_ext - time_diff * iext;
+            prev_b += iext;
+        } else {
+            start_lo = -time_diff;
+            start_hi = start_lo + prev->move_t;
+        }
+        if (can_cache)
+            can_cache = trapq_is_pending_move(tq, prev);
     }
     // Integrate over future moves
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        m = list_next_entry(m, node);
-        double base = m->start_pos.x - start_base;
-        res -= pa_move_integrate(m, pa_list, base, 0., end, end);
+    double next_a = 0., next_b = 0., end_lo = 0., end_hi = m->move_t;
+    struct move *next = m;
+    while (unlikely(end > next->move_t)) {
+        end -= next->move_t;
+        next = move_next(next);
+        double base = next->start_pos.x - start_base, iext, wgt_ext;
+        pa_move_integrals(next, pa_list, base, 0., end, &iext, &wgt_ext);
+        res -= wgt_ext - end * iext;
+        double time_diff = m->print_time - next->print_time;
+        if (end > next->move_t) {
+            // Entire move is in the window
+            next_a += wgt_ext - time_diff * iext;
+            next_b += iext;
+        } else {
+            end_lo = -time_diff;
+            end_hi = end_lo + next->move_t;
+        }
+        if (can_cache)
+            can_cache = trapq_is_pending_move(tq, next);
+    }
+    // Store integrals of moves fully contained in the window
+    if (can_cache) {
+        prc->m = m;
+        prc->start_m = prev;
+        prc->end_m = next;
+        prc->reloc_count = tq->moves.reloc_count;
+        prc->half_smooth_time = hst;
+        prc->start_lo = start_lo;
+        prc->start_hi = start_hi;
+        prc->end_lo = end_lo;
+        prc->end_hi = end_hi;
+        prc->prev_a = prev_a;
+        prc->prev_b = prev_b;
+        prc->next_a = next_a;
+        prc->next_b = next_b;
+    } else {
+        prc->m = NULL;
     }
     return res;
 }
 
-struct extruder_stepper {
-    struct stepper_kinematics sk;
-    struct list_head pa_list;
-    double half_smooth_time, inv_half_smooth_time2;
-};
-
 static double
 extruder_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
-    double hst = es->half_smooth_time;
+    struct pa_params *pa = pa_params_lookup(&es->pa_list
+                                            , m->print_time + move_time);
+    double hst = pa->half_smooth_time;
     if (!hst)
         // Pressure advance not enabled
         return m->start_pos.x + move_get_distance(m, move_time);
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, &es->pa_list, hst);
-    return m->start_pos.x + area * es->inv_half_smooth_time2;
+    double area = pa_range_integrate(es, m, move_time, hst);
+    return m->start_pos.x + area * pa->inv_half_smooth_time2;
+}
+
+static double
+pa_max_half_smooth_time(struct list_head *pa_list)
+{
+    double max_hst = 0.;
+    struct pa_params *pa;
+    list_for_each_entry(pa, pa_list, node) {
+        if (pa->half_smooth_time > max_hst)
+            max_hst = pa->half_smooth_time;
+    }
+    return max_hst;
 }
 
+// Schedule new pressure advance parameters (both the pressure_advance
+// and smooth_time take effect at print_time)
 void __visible
 extruder_set_pressure_advance(struct stepper_kinematics *sk, double print_time
                               , double pressure_advance, double smooth_time)
 {
     struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
-    double hst = smooth_time * .5, old_hst = es->half_smooth_time;
-    es->half_smooth_time = hst;
-    es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    double hst = smooth_time * .5;
+    double max_hst = pa_max_half_smooth_time(&es->pa_list);
 
     // Cleanup old pressure advance parameters
-    double cleanup_time = sk->last_flush_time - (old_hst > hst ? old_hst : hst);
+    double cleanup_time = sk->last_flush_time - (max_hst > hst ? max_hst : hst);
     struct pa_params *first_pa = list_first_entry(
             &es->pa_list, struct pa_params, node);
     while (!list_is_last(&first_pa->node, &es->pa_list)) {
         struct pa_params *next_pa = list_next_entry(first_pa, node);
         if (next_pa->active_print_time >= cleanup_time) break;
         list_del(&first_pa->node);
+        free(first_pa);
         first_pa = next_pa;
     }
 
-    if (! hst)
-        return;
-    es->inv_half_smooth_time2 = 1. / (hst * hst);
-
-    if (list_last_entry(&es->pa_list, struct pa_params, node)->pressure_advance
-            == pressure_advance) {
-        // Retain old pa_params
-        return;
+    struct pa_params *last_pa = list_last_entry(
+            &es->pa_list, struct pa_params, node);
+    if (last_pa->pressure_advance != pressure_advance
+        || last_pa->half_smooth_time != hst) {
+        // Add new pressure advance parameters
+        struct pa_params *pa = malloc(sizeof(*pa));
+        memset(pa, 0, sizeof(*pa));
+        pa->pressure_advance = pressure_advance;
+        pa->active_print_time = print_time;
+        pa->half_smooth_time = hst;
+        if (hst)
+            pa->inv_half_smooth_time2 = 1. / (hst * hst);
+        list_add_tail(&pa->node, &es->pa_list);
     }
-    // Add new pressure advance parameters
-    struct pa_params *pa = malloc(sizeof(*pa));
-    memset(pa, 0, sizeof(*pa));
-    pa->pressure_advance = pressure_advance;
-    pa->active_print_time = print_time;
-    list_add_tail(&pa->node, &es->pa_list);
+    max_hst = pa_max_half_smooth_time(&es->pa_list);
+    es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = max_hst;
 }
 
 struct stepper_kinematics * __visible
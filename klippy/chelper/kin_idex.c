@@ -12,27 +12,83 @@
 #include "trapq.h" // struct move
 
 #define DUMMY_T 500.0
+#define MAX_TRANSFORMS 8
+
+struct dc_transform {
+    double print_time;
+    double x_scale, x_offs, y_scale, y_offs;
+};
 
 struct dual_carriage_stepper {
     struct stepper_kinematics sk;
     struct stepper_kinematics *orig_sk;
     struct move m;
-    double x_scale, x_offs, y_scale, y_offs;
+    // The active transform followed by any time-stamped pending ones
+    struct dc_transform transforms[MAX_TRANSFORMS];
+    int transform_count;
 };
 
+// Find the transform in effect at the given print_time
+static struct dc_transform *
+find_transform(struct dual_carriage_stepper *dc, double print_time)
+{
+    int i = dc->transform_count - 1;
+    while (i > 0 && dc->transforms[i].print_time > print_time)
+        i--;
+    return &dc->transforms[i];
+}
+
 double
 dual_carriage_calc_position(struct stepper_kinematics *sk, struct move *m
                             , double move_time)
 {
     struct dual_carriage_stepper *dc = container_of(
             sk, struct dual_carriage_stepper, sk);
+    // Positions not associated with a queued move (eg, from
+    // itersolve_calc_position_from_coord()) use the latest transform
+    struct dc_transform *t = &dc->transforms[dc->transform_count - 1];
+    if (m->print_time)
+        t = find_transform(dc, m->print_time + move_time);
     struct coord pos = move_get_coord(m, move_time);
-    dc->m.start_pos.x = pos.x * dc->x_scale + dc->x_offs;
-    dc->m.start_pos.y = pos.y * dc->y_scale + dc->y_offs;
+    dc->m.start_pos.x = pos.x * t->x_scale + t->x_offs;
+    dc->m.start_pos.y = pos.y * t->y_scale + t->y_offs;
     dc->m.start_pos.z = pos.z;
     return dc->orig_sk->calc_position_cb(dc->orig_sk, &dc->m, DUMMY_T);
 }
 
+// The carriage may move if the axis scale of any transform is non-zero
+static void
+update_active_flags(struct dual_carriage_stepper *dc)
+{
+    int orig_flags = dc->orig_sk->active_flags;
+    int flags = orig_flags & ~(AF_X | AF_Y), i;
+    for (i=0; i<dc->transform_count; i++) {
+        struct dc_transform *t = &dc->transforms[i];
+        if (t->x_scale)
+            flags |= orig_flags & AF_X;
+        if (t->y_scale)
+            flags |= orig_flags & AF_Y;
+    }
+    dc->sk.active_flags = flags;
+}
+
+static int
+set_transform_axis(struct dc_transform *t, char axis, double scale
+                   , double offs)
+{
+    if (axis == 'x') {
+        t->x_scale = scale;
+        t->x_offs = offs;
+        return 0;
+    }
+    if (axis == 'y') {
+        t->y_scale = scale;
+        t->y_offs = offs;
+        return 0;
+    }
+    return -1;
+}
+
 void __visible
 dual_carriage_set_sk(struct stepper_kinematics *sk
                      , struct stepper_kinematics *orig_sk)
@@ -40,35 +96,55 @@ dual_carriage_set_sk(struct stepper_kinematics *sk
     struct dual_carriage_stepper *dc = container_of(
             sk, struct dual_carriage_stepper, sk);
     dc->sk.calc_position_cb = dual_carriage_calc_position;
-    dc->sk.active_flags = orig_sk->active_flags;
     dc->orig_sk = orig_sk;
+    update_active_flags(dc);
 }
 
+// Set the transform of an axis immediately (discarding any pending
+// transforms) - all queued moves must have been flushed
 int __visible
 dual_carriage_set_transform(struct stepper_kinematics *sk, char axis
                             , double scale, double offs)
 {
     struct dual_carriage_stepper *dc = container_of(
             sk, struct dual_carriage_stepper, sk);
-    if (axis == 'x') {
-        dc->x_scale = scale;
-        dc->x_offs = offs;
-        if (!scale)
-            dc->sk.active_flags &= ~AF_X;
-        else if (scale && dc->orig_sk->active_flags & AF_X)
-            dc->sk.active_flags |= AF_X;
-        return 0;
+    dc->transforms[0] = dc->transforms[dc->transform_count - 1];
+    dc->transform_count = 1;
+    int ret = set_transform_axis(&dc->transforms[0], axis, scale, offs);
+    if (dc->orig_sk)
+        update_active_flags(dc);
+    return ret;
+}
+
+// Set the transform of an axis starting at the given print_time.
+// Pending transforms that took effect prior to expire_time (the time
+// up to which step generation is complete) are released.  Returns
+// non-zero if the transform could not be queued.
+int __visible
+dual_carriage_queue_transform(struct stepper_kinematics *sk, char axis
+                              , double scale, double offs
+                              , double print_time, double expire_time)
+{
+    struct dual_carriage_stepper *dc = container_of(
+            sk, struct dual_carriage_stepper, sk);
+    struct dc_transform *ts = dc->transforms;
+    while (dc->transform_count > 1 && ts[1].print_time <= expire_time) {
+        dc->transform_count--;
+        memmove(&ts[0], &ts[1], dc->transform_count * sizeof(ts[0]));
     }
-    if (axis == 'y') {
-        dc->y_scale = scale;
-        dc->y_offs = offs;
-        if (!scale)
-            dc->sk.active_flags &= ~AF_Y;
-        else if (scale && dc->orig_sk->active_flags & AF_Y)
-            dc->sk.active_flags |= AF_Y;
-        return 0;
+    struct dc_transform *last = &ts[dc->transform_count - 1];
+    if (dc->transform_count > 1 && print_time < last->print_time)
+        return -1;
+    if (dc->transform_count == 1 || print_time > last->print_time) {
+        if (dc->transform_count >= MAX_TRANSFORMS)
+            return -1;
+        ts[dc->transform_count] = *last;
+        last = &ts[dc->transform_count++];
+        last->print_time = print_time;
     }
-    return -1;
+    int ret = set_transform_axis(last, axis, scale, offs);
+    update_active_flags(dc);
+    return ret;
 }
 
 struct stepper_kinematics * __visible
@@ -77,5 +153,7 @@ dual_carriage_alloc(void)
     struct dual_carriage_stepper *dc = malloc(sizeof(*dc));
     memset(dc, 0, sizeof(*dc));
     dc->m.move_t = 2. * DUMMY_T;
+    dc->transform_count = 1;
+    dc->transforms[0].x_scale = dc->transforms[0].y_scale = 1.;
     return &dc->sk;
 }
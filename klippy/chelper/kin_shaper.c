@@ -23,6 +23,15 @@ struct shaper_pulses {
     struct {
         double t, a;
     } pulses[5];
+    // Last move found for each pulse (see calc_position())
+    struct move_cursor cursors[5];
+    // Cached quadratic form of the shaped position (see calc_position())
+    struct shaped_segment {
+        struct move *m;
+        uint32_t reloc_count;
+        double start_t, end_t, base_t;
+        double c0, c1, c2;
+    } seg;
 };
 
 // Shift pulses around 'mid-point' t=0 so that the input shaper is an identity
@@ -56,6 +65,7 @@ init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
         sp->pulses[n-i-1].t = -t[i];
     }
     sp->num_pulses = n;
+    sp->seg.m = NULL;
     shift_pulses(sp);
     return 0;
 }
@@ -78,26 +88,99 @@ static inline double
 get_axis_position_across_moves(struct move *m, int axis, double time)
 {
     while (likely(time < 0.)) {
-        m = list_prev_entry(m, node);
+        m = move_prev(m);
         time += m->move_t;
     }
     while (likely(time > m->move_t)) {
         time -= m->move_t;
-        m = list_next_entry(m, node);
+        m = move_next(m);
     }
     return get_axis_position(m, axis, time);
 }
 
+// Find the move (and time within that move) of a pulse starting from
+// the move found on the previous lookup of that pulse (calls are
+// typically made with increasing time, so the search is then
+// amortized constant time)
+static inline struct move *
+find_pulse_move(struct trapq *tq, struct move_cursor *mc
+                , struct move *m, double *ptime)
+{
+    double time = *ptime;
+    struct move *cm = move_cursor_get(tq, mc);
+    if (cm && cm != m) {
+        time += m->print_time - cm->print_time;
+        m = cm;
+    }
+    while (likely(time < 0.)) {
+        m = move_prev(m);
+        time += m->move_t;
+    }
+    while (likely(time > m->move_t)) {
+        time -= m->move_t;
+        m = move_next(m);
+    }
+    move_cursor_set(tq, mc, m);
+    *ptime = time;
+    return m;
+}
+
 // Calculate the position from the convolution of the shaper with input signal
+//
+// Each move is a quadratic function of time, and so the shaped
+// position is also a quadratic function of time until one of the
+// pulses crosses a move boundary.  The coefficients of that "shaped
+// segment" are cached so that subsequent calls in the same time range
+// only need to evaluate a single polynomial.
 static inline double
-calc_position(struct move *m, int axis, double move_time
+calc_position(struct trapq *tq, struct move *m, int axis, double move_time
               , struct shaper_pulses *sp)
 {
     double res = 0.;
     int num_pulses = sp->num_pulses, i;
+    if (!tq || !trapq_is_pending_move(tq, m)) {
+        // Not a move on the trapq - don't use (or update) the cursors
+        for (i = 0; i < num_pulses; ++i) {
+            double t = sp->pulses[i].t, a = sp->pulses[i].a;
+            res += a * get_axis_position_across_moves(m, axis, move_time + t);
+        }
+        return res;
+    }
+    struct shaped_segment *seg = &sp->seg;
+    if (seg->m == m && seg->reloc_count == tq->moves.reloc_count
+        && move_time >= seg->start_t && move_time <= seg->end_t) {
+        double t = move_time - seg->base_t;
+        return seg->c0 + (seg->c1 + seg->c2 * t) * t;
+    }
+    // Evaluate each pulse (and determine the coefficients of the segment)
+    double c1 = 0., c2 = 0., start_t = 0., end_t = m->move_t;
+    int can_cache = 1;
     for (i = 0; i < num_pulses; ++i) {
         double t = sp->pulses[i].t, a = sp->pulses[i].a;
-        res += a * get_axis_position_across_moves(m, axis, move_time + t);
+        double pm_time = move_time + t;
+        struct move *pm = find_pulse_move(tq, &sp->cursors[i], m, &pm_time);
+        res += a * get_axis_position(pm, axis, pm_time);
+        double axis_r = pm->axes_r.axis[axis - 'x'];
+        c1 += a * axis_r * (pm->start_v + 2. * pm->half_accel * pm_time);
+        c2 += a * axis_r * pm->half_accel;
+        if (start_t < move_time - pm_time)
+            start_t = move_time - pm_time;
+        if (end_t > move_time + pm->move_t - pm_time)
+            end_t = move_time + pm->move_t - pm_time;
+        // The tail sentinel (and head sentinel) may be updated
+        can_cache &= trapq_is_pending_move(tq, pm);
+    }
+    if (can_cache) {
+        seg->m = m;
+        seg->reloc_count = tq->moves.reloc_count;
+        seg->start_t = start_t;
+        seg->end_t = end_t;
+        seg->base_t = move_time;
+        seg->c0 = res;
+        seg->c1 = c1;
+        seg->c2 = c2;
+    } else {
+        seg->m = NULL;
     }
     return res;
 }
@@ -108,23 +191,83 @@ calc_position(struct move *m, int axis, double move_time
  ****************************************************************/
 
 #define DUMMY_T 500.0
+#define MAX_SHAPER_CHANGES 4
+
+// Shaper parameters of an axis scheduled to take effect at a print_time
+struct shaper_changes {
+    int count;
+    struct {
+        double start_time, end_time;
+        struct shaper_pulses sp;
+    } changes[MAX_SHAPER_CHANGES];
+};
 
 struct input_shaper {
     struct stepper_kinematics sk;
     struct stepper_kinematics *orig_sk;
     struct move m;
     struct shaper_pulses sx, sy;
+    struct shaper_changes cx, cy;
 };
 
+static inline double
+calc_pulses_position(struct trapq *tq, struct move *m, int axis
+                     , double move_time, struct shaper_pulses *sp)
+{
+    if (!sp->num_pulses)
+        return get_axis_position(m, axis, move_time);
+    return calc_position(tq, m, axis, move_time, sp);
+}
+
+// Calculate the shaped position of an axis while shaper changes are
+// pending.  The position is crossfaded from the previous pulses to
+// the new pulses between the start and end time of each change.
+static double
+calc_changes_position(struct trapq *tq, struct move *m, int axis
+                      , double move_time, struct shaper_pulses *sp
+                      , struct shaper_changes *sc)
+{
+    double time = m->print_time + move_time;
+    int i;
+    for (i = 0; i < sc->count; i++) {
+        if (time < sc->changes[i].start_time)
+            break;
+        struct shaper_pulses *next_sp = &sc->changes[i].sp;
+        double end_time = sc->changes[i].end_time;
+        if (time < end_time) {
+            double start_time = sc->changes[i].start_time;
+            double ratio = (time - start_time) / (end_time - start_time);
+            double pos = calc_pulses_position(tq, m, axis, move_time, sp);
+            double next_pos = calc_pulses_position(tq, m, axis, move_time
+                                                   , next_sp);
+            return pos + (next_pos - pos) * ratio;
+        }
+        sp = next_sp;
+    }
+    return calc_pulses_position(tq, m, axis, move_time, sp);
+}
+
+static inline double
+calc_axis_position(struct trapq *tq, struct move *m, int axis
+                   , double move_time, struct shaper_pulses *sp
+                   , struct shaper_changes *sc)
+{
+    if (likely(!sc->count))
+        return calc_position(tq, m, axis, move_time, sp);
+    return calc_changes_position(tq, m, axis, move_time, sp, sc);
+}
+
 // Optimized calc_position when only x axis is needed
 static double
 shaper_x_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses)
+    if (!is->sx.num_pulses && !is->cx.count)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+    is->m.start_pos.x = calc_axis_position(sk->tq, m, 'x', move_time
+                                           , &is->sx, &is->cx);
+    is->m.print_time = m->print_time + move_time - DUMMY_T;
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -134,9 +277,11 @@ shaper_y_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sy.num_pulses)
+    if (!is->sy.num_pulses && !is->cy.count)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    is->m.start_pos.y = calc_axis_position(sk->tq, m, 'y', move_time
+                                           , &is->sy, &is->cy);
+    is->m.print_time = m->print_time + move_time - DUMMY_T;
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -146,13 +291,18 @@ shaper_xy_calc_position(struct stepper_kinematics *sk, struct move *m
                         , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses && !is->sy.num_pulses)
+    int shape_x = is->sx.num_pulses || is->cx.count;
+    int shape_y = is->sy.num_pulses || is->cy.count;
+    if (!shape_x && !shape_y)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
     is->m.start_pos = move_get_coord(m, move_time);
-    if (is->sx.num_pulses)
-        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
-    if (is->sy.num_pulses)
-        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    if (shape_x)
+        is->m.start_pos.x = calc_axis_position(sk->tq, m, 'x', move_time
+                                               , &is->sx, &is->cx);
+    if (shape_y)
+        is->m.start_pos.y = calc_axis_position(sk->tq, m, 'y', move_time
+                                               , &is->sy, &is->cy);
+    is->m.print_time = m->print_time + move_time - DUMMY_T;
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -177,20 +327,36 @@ input_shaper_set_sk(struct stepper_kinematics *sk
     return 0;
 }
 
+static void
+note_pulses_time(struct shaper_pulses *sp, double *pre_active
+                 , double *post_active)
+{
+    if (!sp->num_pulses)
+        return;
+    if (sp->pulses[sp->num_pulses-1].t > *pre_active)
+        *pre_active = sp->pulses[sp->num_pulses-1].t;
+    if (-sp->pulses[0].t > *post_active)
+        *post_active = -sp->pulses[0].t;
+}
+
+static void
+note_axis_time(struct shaper_pulses *sp, struct shaper_changes *sc
+               , double *pre_active, double *post_active)
+{
+    note_pulses_time(sp, pre_active, post_active);
+    int i;
+    for (i = 0; i < sc->count; i++)
+        note_pulses_time(&sc->changes[i].sp, pre_active, post_active);
+}
+
 static void
 shaper_note_generation_time(struct input_shaper *is)
 {
     double pre_active = 0., post_active = 0.;
-    if ((is->sk.active_flags & AF_X) && is->sx.num_pulses) {
-        pre_active = is->sx.pulses[is->sx.num_pulses-1].t;
-        post_active = -is->sx.pulses[0].t;
-    }
-    if ((is->sk.active_flags & AF_Y) && is->sy.num_pulses) {
-        pre_active = is->sy.pulses[is->sy.num_pulses-1].t > pre_active
-            ? is->sy.pulses[is->sy.num_pulses-1].t : pre_active;
-        post_active = -is->sy.pulses[0].t > post_active
-            ? -is->sy.pulses[0].t : post_active;
-    }
+    if (is->sk.active_flags & AF_X)
+        note_axis_time(&is->sx, &is->cx, &pre_active, &post_active);
+    if (is->sk.active_flags & AF_Y)
+        note_axis_time(&is->sy, &is->cy, &pre_active, &post_active);
     is->sk.gen_steps_pre_active = pre_active;
     is->sk.gen_steps_post_active = post_active;
 }
@@ -203,15 +369,86 @@ input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
         return -1;
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     struct shaper_pulses *sp = axis == 'x' ? &is->sx : &is->sy;
+    struct shaper_changes *sc = axis == 'x' ? &is->cx : &is->cy;
     int status = 0;
     // Ignore input shaper update if the axis is not active
     if (is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y)) {
         status = init_shaper(n, a, t, sp);
+        sc->count = 0;
         shaper_note_generation_time(is);
     }
     return status;
 }
 
+// Discard the shaper changes that completed prior to expire_time
+static void
+expire_changes(struct shaper_pulses *sp, struct shaper_changes *sc
+               , double expire_time)
+{
+    int count = 0;
+    while (count < sc->count && sc->changes[count].end_time <= expire_time)
+        count++;
+    if (!count)
+        return;
+    *sp = sc->changes[count-1].sp;
+    sc->count -= count;
+    memmove(sc->changes, &sc->changes[count]
+            , sc->count * sizeof(sc->changes[0]));
+}
+
+static double
+pulses_duration(struct shaper_pulses *sp)
+{
+    if (!sp->num_pulses)
+        return 0.;
+    return sp->pulses[sp->num_pulses-1].t - sp->pulses[0].t;
+}
+
+// Schedule new shaper parameters of an axis to take effect at
+// print_time (without the need to flush step generation).  The
+// position is crossfaded from the previous shaper to the new shaper
+// over the duration of the longer of the two shapers.  Changes that
+// completed prior to expire_time (no step generation will be requested
+// prior to that time) are merged into the active shaper.
+int __visible
+input_shaper_queue_shaper_params(struct stepper_kinematics *sk, char axis
+                                 , int n, double a[], double t[]
+                                 , double print_time, double expire_time)
+{
+    if (axis != 'x' && axis != 'y')
+        return -1;
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    // Ignore input shaper update if the axis is not active
+    if (!(is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y)))
+        return 0;
+    struct shaper_pulses *sp = axis == 'x' ? &is->sx : &is->sy;
+    struct shaper_changes *sc = axis == 'x' ? &is->cx : &is->cy;
+    struct shaper_pulses new_sp;
+    memset(&new_sp, 0, sizeof(new_sp));
+    if (init_shaper(n, a, t, &new_sp))
+        return -1;
+    expire_changes(sp, sc, expire_time);
+    int pos = sc->count;
+    if (pos >= MAX_SHAPER_CHANGES) {
+        // Replace the last scheduled change with the new parameters
+        pos--;
+        print_time = sc->changes[pos].start_time;
+    }
+    struct shaper_pulses *prev_sp = pos ? &sc->changes[pos-1].sp : sp;
+    if (pos && print_time < sc->changes[pos-1].end_time)
+        print_time = sc->changes[pos-1].end_time;
+    double prev_duration = pulses_duration(prev_sp);
+    double duration = pulses_duration(&new_sp);
+    if (duration < prev_duration)
+        duration = prev_duration;
+    sc->changes[pos].start_time = print_time;
+    sc->changes[pos].end_time = print_time + duration;
+    sc->changes[pos].sp = new_sp;
+    sc->count = pos + 1;
+    shaper_note_generation_time(is);
+    return 0;
+}
+
 double __visible
 input_shaper_get_step_generation_window(struct stepper_kinematics *sk)
 {
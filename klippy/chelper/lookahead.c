@@ -0,0 +1,353 @@
+// Toolhead move "look-ahead" velocity planning
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code implements the junction and velocity calculations of the
+// host toolhead "look-ahead" queue on a contiguous array of move
+// records.  Once moves are finalized they are added directly to the
+// toolhead (and extruder) trapq.  See toolhead.py for the python
+// wrapper that manages the queue.
+
+#include <math.h> // sqrt, fabs
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "trapq.h" // trapq_append
+
+struct lookahead_move {
+    double start_pos[4], axes_r[4];
+    double move_d, accel, junction_deviation;
+    // Junction speeds are tracked in velocity squared.  The delta_v2
+    // is the maximum amount of this squared-velocity that can change
+    // in this move.
+    double max_start_v2, max_cruise_v2, delta_v2;
+    double max_smoothed_v2, smooth_delta_v2, next_junction_v2;
+    int is_kinematic, has_callback;
+    struct trapq *extruder_tq;
+    // Temporary storage used while delaying velocity calculations
+    double delayed_start_v2, delayed_end_v2;
+    // Final move velocities and timing
+    double start_v, cruise_v, end_v;
+    double accel_t, cruise_t, decel_t;
+};
+
+struct lookahead {
+    struct lookahead_move *moves;
+    int move_count, move_alloc;
+    // Optional kinematic limits checked when moves are added
+    int check_limits;
+    double limits_min[3], limits_max[3];
+    double max_z_velocity, max_z_accel;
+};
+
+// Helpers that match the semantics of python's min() and max()
+static inline double
+pymin(double a, double b)
+{
+    return b < a ? b : a;
+}
+
+static inline double
+pymax(double a, double b)
+{
+    return b > a ? b : a;
+}
+
+
+/****************************************************************
+ * Junction calculations
+ ****************************************************************/
+
+// Determine the maximum velocity at the junction of two moves
+static void
+calc_junction(struct lookahead_move *m, struct lookahead_move *prev
+              , double extruder_v2)
+{
+    if (!m->is_kinematic || !prev->is_kinematic)
+        return;
+    double max_start_v2 = pymin(pymin(pymin(pymin(
+        extruder_v2, m->max_cruise_v2), prev->max_cruise_v2)
+                                      , prev->next_junction_v2)
+                                , prev->max_start_v2 + prev->delta_v2);
+    // Find max velocity using "approximated centripetal velocity"
+    double junction_cos_theta = -(m->axes_r[0] * prev->axes_r[0]
+                                  + m->axes_r[1] * prev->axes_r[1]
+                                  + m->axes_r[2] * prev->axes_r[2]);
+    double sin_theta_d2 = sqrt(pymax(0.5*(1.0-junction_cos_theta), 0.));
+    double cos_theta_d2 = sqrt(pymax(0.5*(1.0+junction_cos_theta), 0.));
+    double one_minus_sin_theta_d2 = 1. - sin_theta_d2;
+    if (one_minus_sin_theta_d2 > 0. && cos_theta_d2 > 0.) {
+        double R_jd = sin_theta_d2 / one_minus_sin_theta_d2;
+        double move_jd_v2 = R_jd * m->junction_deviation * m->accel;
+        double pmove_jd_v2 = R_jd * prev->junction_deviation * prev->accel;
+        // Approximated circle must contact moves no further than mid-move
+        //   centripetal_v2 = .5 * move_d * accel * tan_theta_d2
+        double quarter_tan_theta_d2 = .25 * sin_theta_d2 / cos_theta_d2;
+        double move_centripetal_v2 = m->delta_v2 * quarter_tan_theta_d2;
+        double pmove_centripetal_v2 = prev->delta_v2 * quarter_tan_theta_d2;
+        max_start_v2 = pymin(pymin(pymin(pymin(pymin(
+            max_start_v2, move_jd_v2), pmove_jd_v2), move_centripetal_v2)
+                                   , pmove_centripetal_v2), max_start_v2);
+    }
+    // Apply limits
+    m->max_start_v2 = max_start_v2;
+    m->max_smoothed_v2 = pymin(
+        max_start_v2, prev->max_smoothed_v2 + prev->smooth_delta_v2);
+}
+
+// Determine accel, cruise, and decel portions of a move
+static void
+set_junction(struct lookahead_move *m, double start_v2, double cruise_v2
+             , double end_v2)
+{
+    double half_inv_accel = .5 / m->accel;
+    double accel_d = (cruise_v2 - start_v2) * half_inv_accel;
+    double decel_d = (cruise_v2 - end_v2) * half_inv_accel;
+    double cruise_d = m->move_d - accel_d - decel_d;
+    // Determine move velocities
+    double start_v = m->start_v = sqrt(start_v2);
+    double cruise_v = m->cruise_v = sqrt(cruise_v2);
+    double end_v = m->end_v = sqrt(end_v2);
+    // Determine time spent in each portion of move (time is the
+    // distance divided by average velocity)
+    m->accel_t = accel_d / ((start_v + cruise_v) * 0.5);
+    m->cruise_t = cruise_d / cruise_v;
+    m->decel_t = decel_d / ((end_v + cruise_v) * 0.5);
+}
+
+
+/****************************************************************
+ * Look-ahead queue
+ ****************************************************************/
+
+// Check a kinematic move against the configured axis limits and
+// apply the z axis velocity and acceleration limits.  Returns -1 if
+// the move is out of range.
+static int
+check_kin_limits(struct lookahead *la, struct lookahead_move *m
+                 , double *end_pos)
+{
+    int i;
+    for (i=0; i<3; i++)
+        if (m->axes_r[i] && (end_pos[i] < la->limits_min[i]
+                             || end_pos[i] > la->limits_max[i]))
+            return -1;
+    if (!m->axes_r[2])
+        return 0;
+    // Move with Z - update velocity and accel for slower Z axis
+    double z_ratio = 1. / fabs(m->axes_r[2]);
+    double speed = la->max_z_velocity * z_ratio, speed2 = speed * speed;
+    if (speed2 < m->max_cruise_v2)
+        m->max_cruise_v2 = speed2;
+    m->accel = pymin(m->accel, la->max_z_accel * z_ratio);
+    m->delta_v2 = 2.0 * m->move_d * m->accel;
+    m->smooth_delta_v2 = pymin(m->smooth_delta_v2, m->delta_v2);
+    return 0;
+}
+
+// Add a move to the look-ahead queue.  Returns the minimum duration
+// of the move, or a negative number if the move is outside the
+// kinematic limits (in which case the move is not queued).
+double __visible
+lookahead_add_move(struct lookahead *la, double *start_pos, double *end_pos
+                   , double *axes_r, double move_d, double accel
+                   , double junction_deviation, double max_cruise_v2
+                   , double delta_v2, double smooth_delta_v2
+                   , double extruder_v2, int is_kinematic
+                   , struct trapq *extruder_tq)
+{
+    if (la->move_count >= la->move_alloc) {
+        int new_alloc = la->move_alloc ? la->move_alloc * 2 : 256;
+        la->moves = realloc(la->moves, sizeof(*la->moves) * new_alloc);
+        la->move_alloc = new_alloc;
+    }
+    struct lookahead_move *m = &la->moves[la->move_count];
+    memset(m, 0, sizeof(*m));
+    memcpy(m->start_pos, start_pos, sizeof(m->start_pos));
+    memcpy(m->axes_r, axes_r, sizeof(m->axes_r));
+    m->move_d = move_d;
+    m->accel = accel;
+    m->junction_deviation = junction_deviation;
+    m->max_cruise_v2 = max_cruise_v2;
+    m->delta_v2 = delta_v2;
+    m->smooth_delta_v2 = smooth_delta_v2;
+    m->next_junction_v2 = 999999999.9;
+    m->is_kinematic = is_kinematic;
+    m->extruder_tq = extruder_tq;
+    if (is_kinematic && la->check_limits
+        && check_kin_limits(la, m, end_pos))
+        return -1.;
+    la->move_count++;
+    if (la->move_count > 1)
+        calc_junction(m, m - 1, extruder_v2);
+    return move_d / sqrt(m->max_cruise_v2);
+}
+
+// Set the axis limits used to check kinematic moves along with the
+// maximum velocity and acceleration of z axis movement
+void __visible
+lookahead_set_kin_limits(struct lookahead *la, double *limits_min
+                         , double *limits_max, double max_z_velocity
+                         , double max_z_accel)
+{
+    la->check_limits = 1;
+    memcpy(la->limits_min, limits_min, sizeof(la->limits_min));
+    memcpy(la->limits_max, limits_max, sizeof(la->limits_max));
+    la->max_z_velocity = max_z_velocity;
+    la->max_z_accel = max_z_accel;
+}
+
+// Limit the junction speed at the end of the last queued move
+void __visible
+lookahead_limit_next_junction(struct lookahead *la, double speed_v2)
+{
+    if (!la->move_count)
+        return;
+    struct lookahead_move *m = &la->moves[la->move_count - 1];
+    m->next_junction_v2 = pymin(m->next_junction_v2, speed_v2);
+}
+
+// Note that the last queued move has python timing callbacks
+void __visible
+lookahead_note_callback(struct lookahead *la)
+{
+    if (la->move_count)
+        la->moves[la->move_count - 1].has_callback = 1;
+}
+
+// Determine the velocities of queued moves.  Returns the number of
+// moves at the start of the queue that are ready to be flushed.
+int __visible
+lookahead_flush(struct lookahead *la, int lazy)
+{
+    int update_flush_count = lazy, flush_count = la->move_count;
+    // Traverse queue from last to first move and determine maximum
+    // junction speed assuming the robot comes to a complete stop
+    // after the last move.
+    int delayed = 0, i, j;
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    for (i=flush_count-1; i>=0; i--) {
+        struct lookahead_move *m = &la->moves[i];
+        double reachable_start_v2 = next_end_v2 + m->delta_v2;
+        double start_v2 = pymin(m->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = next_smoothed_v2 + m->smooth_delta_v2;
+        double smoothed_v2 = pymin(m->max_smoothed_v2, reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + m->smooth_delta_v2 > next_smoothed_v2
+                || delayed) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = pymin(m->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (delayed) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (!update_flush_count && i < flush_count) {
+                        double mc_v2 = peak_cruise_v2;
+                        for (j=i+1; j<=i+delayed; j++) {
+                            struct lookahead_move *dm = &la->moves[j];
+                            double ms_v2 = dm->delayed_start_v2;
+                            double me_v2 = dm->delayed_end_v2;
+                            mc_v2 = pymin(mc_v2, ms_v2);
+                            set_junction(dm, pymin(ms_v2, mc_v2), mc_v2
+                                         , pymin(me_v2, mc_v2));
+                        }
+                    }
+                    delayed = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = pymin(pymin(
+                    (start_v2 + reachable_start_v2) * .5, m->max_cruise_v2)
+                                         , peak_cruise_v2);
+                set_junction(m, pymin(start_v2, cruise_v2), cruise_v2
+                             , pymin(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            m->delayed_start_v2 = start_v2;
+            m->delayed_end_v2 = next_end_v2;
+            delayed++;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        return 0;
+    return flush_count;
+}
+
+// Add flushed moves to the trapq (starting from move 'pos').  Stops
+// after processing a move with python timing callbacks.  Returns the
+// position of the next move to process and stores its start time in
+// 'pnext_time'.  Moves are removed from the queue once 'count' moves
+// have been processed.
+int __visible
+lookahead_queue_moves(struct lookahead *la, struct trapq *tq, int pos
+                      , int count, double print_time, double *pnext_time)
+{
+    while (pos < count) {
+        struct lookahead_move *m = &la->moves[pos++];
+        if (m->is_kinematic)
+            trapq_append(tq, print_time, m->accel_t, m->cruise_t, m->decel_t
+                         , m->start_pos[0], m->start_pos[1], m->start_pos[2]
+                         , m->axes_r[0], m->axes_r[1], m->axes_r[2]
+                         , m->start_v, m->cruise_v, m->accel);
+        if (m->extruder_tq) {
+            // Extruder movement (x is extruder movement, y is pressure
+            // advance flag)
+            double axis_r = m->axes_r[3];
+            int can_pressure_advance = (axis_r > 0.
+                                        && (m->axes_r[0] || m->axes_r[1]));
+            trapq_append(m->extruder_tq, print_time
+                         , m->accel_t, m->cruise_t, m->decel_t
+                         , m->start_pos[3], 0., 0.
+                         , 1., can_pressure_advance, 0.
+                         , m->start_v * axis_r, m->cruise_v * axis_r
+                         , m->accel * axis_r);
+        }
+        print_time = print_time + m->accel_t + m->cruise_t + m->decel_t;
+        if (m->has_callback)
+            break;
+    }
+    *pnext_time = print_time;
+    if (pos >= count) {
+        // Remove processed moves from the queue
+        la->move_count -= count;
+        memmove(la->moves, &la->moves[count]
+                , sizeof(*la->moves) * la->move_count);
+    }
+    return pos;
+}
+
+// Remove all moves from the look-ahead queue
+void __visible
+lookahead_reset(struct lookahead *la)
+{
+    la->move_count = 0;
+}
+
+// Create a new 'struct lookahead' object
+struct lookahead * __visible
+lookahead_alloc(void)
+{
+    struct lookahead *la = malloc(sizeof(*la));
+    memset(la, 0, sizeof(*la));
+    return la;
+}
+
+// Free memory associated with a 'struct lookahead' object
+void __visible
+lookahead_free(struct lookahead *la)
+{
+    if (!la)
+        return;
+    free(la->moves);
+    free(la);
+}
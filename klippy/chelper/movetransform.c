@@ -0,0 +1,236 @@
+// G-Code move transforms (skew correction and thermal z adjustment)
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code implements a chain of "move transforms" (see
+// klippy/extras/gcode_move.py) so that the coordinates of each g-code
+// move can be altered without a python call for each stage.  Stage 0
+// is the stage closest to the toolhead - moves are processed starting
+// with the last stage and positions are queried starting with the
+// first stage.
+
+#include <math.h> // fabs
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+
+enum { MT_SKEW, MT_Z_ADJUST };
+
+#define MT_MAX_STAGES 8
+
+struct mt_stage {
+    int type;
+    // Skew correction factors
+    double xy, xz, yz;
+    // Thermal z adjustment
+    int enabled;
+    double adjust, max_adjust, step_dist, off_above_z;
+    double cur_adjust, last_adjust, last_x, last_y;
+};
+
+struct move_transform {
+    int stage_count;
+    struct mt_stage stages[MT_MAX_STAGES];
+};
+
+// Allocate a new 'move_transform' object
+struct move_transform * __visible
+move_transform_alloc(void)
+{
+    struct move_transform *mt = malloc(sizeof(*mt));
+    memset(mt, 0, sizeof(*mt));
+    return mt;
+}
+
+// Free memory associated with a 'move_transform' object
+void __visible
+move_transform_free(struct move_transform *mt)
+{
+    free(mt);
+}
+
+static int
+add_stage(struct move_transform *mt, int type)
+{
+    if (mt->stage_count >= MT_MAX_STAGES)
+        return -1;
+    int index = mt->stage_count++;
+    struct mt_stage *s = &mt->stages[index];
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    return index;
+}
+
+static struct mt_stage *
+lookup_stage(struct move_transform *mt, int index, int type)
+{
+    if (index < 0 || index >= mt->stage_count)
+        return NULL;
+    struct mt_stage *s = &mt->stages[index];
+    if (s->type != type)
+        return NULL;
+    return s;
+}
+
+/****************************************************************
+ * Skew correction
+ ****************************************************************/
+
+// Add a skew correction stage (returns the stage index)
+int __visible
+move_transform_add_skew(struct move_transform *mt)
+{
+    return add_stage(mt, MT_SKEW);
+}
+
+// Set the skew correction factors of a stage
+void __visible
+move_transform_set_skew(struct move_transform *mt, int index
+                        , double xy, double xz, double yz)
+{
+    struct mt_stage *s = lookup_stage(mt, index, MT_SKEW);
+    if (!s)
+        return;
+    s->xy = xy;
+    s->xz = xz;
+    s->yz = yz;
+}
+
+static void
+skew_move(struct mt_stage *s, double *pos)
+{
+    pos[0] = pos[0] - pos[1] * s->xy - pos[2] * (s->xz - s->xy * s->yz);
+    pos[1] = pos[1] - pos[2] * s->yz;
+}
+
+static void
+skew_position(struct mt_stage *s, double *pos)
+{
+    pos[0] = pos[0] + pos[1] * s->xy + pos[2] * s->xz;
+    pos[1] = pos[1] + pos[2] * s->yz;
+}
+
+/****************************************************************
+ * Thermal z adjustment
+ ****************************************************************/
+
+// Add a thermal z adjustment stage (returns the stage index)
+int __visible
+move_transform_add_z_adjust(struct move_transform *mt, double max_adjust
+                            , double step_dist, double off_above_z)
+{
+    int index = add_stage(mt, MT_Z_ADJUST);
+    if (index < 0)
+        return index;
+    struct mt_stage *s = &mt->stages[index];
+    s->enabled = 1;
+    s->max_adjust = max_adjust;
+    s->step_dist = step_dist;
+    s->off_above_z = off_above_z;
+    return index;
+}
+
+// Set the wanted z adjustment of a stage (applied on the next move)
+void __visible
+move_transform_set_z_adjust(struct move_transform *mt, int index
+                            , int enabled, double adjust)
+{
+    struct mt_stage *s = lookup_stage(mt, index, MT_Z_ADJUST);
+    if (!s)
+        return;
+    s->enabled = enabled;
+    s->adjust = adjust;
+}
+
+// Clear the currently applied z adjustment of a stage
+void __visible
+move_transform_reset_z_adjust(struct move_transform *mt, int index)
+{
+    struct mt_stage *s = lookup_stage(mt, index, MT_Z_ADJUST);
+    if (s)
+        s->cur_adjust = 0.;
+}
+
+// Return the currently applied z adjustment of a stage
+double __visible
+move_transform_get_z_adjust(struct move_transform *mt, int index)
+{
+    struct mt_stage *s = lookup_stage(mt, index, MT_Z_ADJUST);
+    if (!s)
+        return 0.;
+    return s->cur_adjust;
+}
+
+static void
+z_adjust_update(struct mt_stage *s, double *pos)
+{
+    if (pos[2] < s->off_above_z) {
+        // Don't apply adjustments smaller than step distance
+        double adjust = s->adjust;
+        if (fabs(adjust - s->cur_adjust) > s->step_dist)
+            s->cur_adjust = (fabs(adjust) < s->max_adjust ? adjust
+                             : (adjust > 0. ? s->max_adjust : -s->max_adjust));
+    }
+    pos[2] += s->cur_adjust;
+    s->last_adjust = s->cur_adjust;
+}
+
+static void
+z_adjust_move(struct mt_stage *s, double *pos)
+{
+    double x = pos[0], y = pos[1];
+    // Don't update the adjustment on extrude only moves or when disabled
+    if (!s->enabled || (x == s->last_x && y == s->last_y))
+        pos[2] += s->last_adjust;
+    else
+        z_adjust_update(s, pos);
+    s->last_x = x;
+    s->last_y = y;
+}
+
+static void
+z_adjust_position(struct mt_stage *s, double *pos)
+{
+    pos[2] -= s->cur_adjust;
+    double adj_pos[3] = { pos[0], pos[1], pos[2] };
+    z_adjust_update(s, adj_pos);
+    s->last_x = pos[0];
+    s->last_y = pos[1];
+}
+
+/****************************************************************
+ * Move processing
+ ****************************************************************/
+
+// Transform 'count' moves (four coordinates each) in place
+void __visible
+move_transform_move(struct move_transform *mt, double *coords, int count)
+{
+    int i, j;
+    for (i=0; i<count; i++) {
+        double *pos = &coords[i * 4];
+        for (j=mt->stage_count-1; j>=0; j--) {
+            struct mt_stage *s = &mt->stages[j];
+            if (s->type == MT_SKEW)
+                skew_move(s, pos);
+            else
+                z_adjust_move(s, pos);
+        }
+    }
+}
+
+// Convert a toolhead position (four coordinates) to g-code coordinates
+void __visible
+move_transform_get_position(struct move_transform *mt, double *pos)
+{
+    int i;
+    for (i=0; i<mt->stage_count; i++) {
+        struct mt_stage *s = &mt->stages[i];
+        if (s->type == MT_SKEW)
+            skew_position(s, pos);
+        else
+            z_adjust_position(s, pos);
+    }
+}
@@ -7,6 +7,7 @@
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include "compiler.h" // __visible
 #include "msgblock.h" // message_alloc
 #include "pyhelper.h" // errorf
 
@@ -15,18 +16,50 @@
  * Serial protocol helpers
  ****************************************************************/
 
+// Lookup table of the crc "ccitt" algorithm (reflected polynomial
+// 0x1021) for each byte value
+static const uint16_t crc16_ccitt_table[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
+};
+
 // Implement the standard crc "ccitt" algorithm on the given buffer
 uint16_t
 msgblock_crc16_ccitt(uint8_t *buf, uint8_t len)
 {
     uint16_t crc = 0xffff;
-    while (len--) {
-        uint8_t data = *buf++;
-        data ^= crc & 0xff;
-        data ^= data << 4;
-        crc = ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
-               ^ ((uint16_t)data << 3));
-    }
+    while (len--)
+        crc = (crc >> 8) ^ crc16_ccitt_table[(crc ^ *buf++) & 0xff];
     return crc;
 }
 
@@ -118,6 +151,44 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
     return 0;
 }
 
+// Parse a message containing VLQ integers followed by a buffer field
+int
+msgblock_decode_buffer(uint32_t *data, int data_len, uint8_t **buf
+                       , uint8_t *msg, int msg_len)
+{
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE];
+    uint8_t *end = &msg[msg_len - MESSAGE_TRAILER_SIZE];
+    while (data_len--) {
+        if (p >= end)
+            return -1;
+        *data++ = parse_int(&p);
+    }
+    if (p >= end)
+        return -1;
+    int buf_len = *p++;
+    if (p + buf_len != end)
+        // Invalid message
+        return -1;
+    *buf = p;
+    return buf_len;
+}
+
+// Encode a series of integers as VLQs into a buffer (returns the
+// encoded length or -1 if they do not fit in 'buf_len' bytes)
+int
+msgblock_encode_ints(uint8_t *buf, int buf_len, uint32_t *data, int data_len)
+{
+    uint8_t *p = buf, *end = &buf[buf_len];
+    while (data_len--) {
+        uint8_t tmp[5];
+        int len = encode_int(tmp, *data++) - tmp;
+        if (len > end - p)
+            return -1;
+        memcpy(p, tmp, len);
+        p += len;
+    }
+    return p - buf;
+}
 
 /****************************************************************
  * Command queues
@@ -142,11 +213,10 @@ message_fill(uint8_t *data, int len)
     return qm;
 }
 
-// Allocate a queue_message and fill it with a series of encoded vlq integers
-struct queue_message *
-message_alloc_and_encode(uint32_t *data, int len)
+// Fill a queue_message with a series of encoded vlq integers
+static struct queue_message *
+message_encode(struct queue_message *qm, uint32_t *data, int len)
 {
-    struct queue_message *qm = message_alloc();
     int i;
     uint8_t *p = qm->msg;
     for (i=0; i<len; i++) {
@@ -163,6 +233,13 @@ fail:
     return qm;
 }
 
+// Allocate a queue_message and fill it with a series of encoded vlq integers
+struct queue_message *
+message_alloc_and_encode(uint32_t *data, int len)
+{
+    return message_encode(message_alloc(), data, len);
+}
+
 // Free the storage from a previous message_alloc() call
 void
 message_free(struct queue_message *qm)
@@ -183,6 +260,177 @@ message_queue_free(struct list_head *root)
 }
 
 
+/****************************************************************
+ * Message pools
+ ****************************************************************/
+
+// A message_pool caches freed queue_message objects so that they can
+// be reused without calling malloc/free.  Messages in the pool are
+// regular message_alloc() allocations, so a message allocated from a
+// pool may be released with message_free() and vice-versa.
+
+#define MESSAGE_POOL_MAX 4096
+
+// Initialize a message pool
+void
+message_pool_init(struct message_pool *mp)
+{
+    memset(mp, 0, sizeof(*mp));
+    pthread_mutex_init(&mp->lock, NULL);
+    list_init(&mp->free_list);
+}
+
+// Release all cached messages in a message pool
+void
+message_pool_destroy(struct message_pool *mp)
+{
+    message_queue_free(&mp->free_list);
+    pthread_mutex_destroy(&mp->lock);
+}
+
+// Allocate a 'struct queue_message' object from a pool
+struct queue_message *
+message_pool_alloc(struct message_pool *mp)
+{
+    if (!mp)
+        return message_alloc();
+    pthread_mutex_lock(&mp->lock);
+    if (list_empty(&mp->free_list)) {
+        mp->alloc_miss++;
+        pthread_mutex_unlock(&mp->lock);
+        return message_alloc();
+    }
+    struct queue_message *qm = list_first_entry(
+        &mp->free_list, struct queue_message, node);
+    list_del(&qm->node);
+    mp->free_count--;
+    mp->alloc_hit++;
+    pthread_mutex_unlock(&mp->lock);
+    memset(qm, 0, sizeof(*qm));
+    return qm;
+}
+
+// Allocate a message from a pool and fill it with the specified data
+struct queue_message *
+message_pool_fill(struct message_pool *mp, uint8_t *data, int len)
+{
+    struct queue_message *qm = message_pool_alloc(mp);
+    memcpy(qm->msg, data, len);
+    qm->len = len;
+    return qm;
+}
+
+// Allocate a message from a pool and fill it with encoded vlq integers
+struct queue_message *
+message_pool_alloc_and_encode(struct message_pool *mp, uint32_t *data, int len)
+{
+    return message_encode(message_pool_alloc(mp), data, len);
+}
+
+// Return a message to a pool (or free it if the pool is full)
+void
+message_pool_free(struct message_pool *mp, struct queue_message *qm)
+{
+    if (!mp) {
+        message_free(qm);
+        return;
+    }
+    pthread_mutex_lock(&mp->lock);
+    if (mp->free_count >= MESSAGE_POOL_MAX) {
+        pthread_mutex_unlock(&mp->lock);
+        message_free(qm);
+        return;
+    }
+    list_add_head(&qm->node, &mp->free_list);
+    mp->free_count++;
+    pthread_mutex_unlock(&mp->lock);
+}
+
+// Return all the messages on a queue to a pool
+void
+message_pool_queue_free(struct message_pool *mp, struct list_head *root)
+{
+    while (!list_empty(root)) {
+        struct queue_message *qm = list_first_entry(
+            root, struct queue_message, node);
+        list_del(&qm->node);
+        message_pool_free(mp, qm);
+    }
+}
+
+// Report the number of allocations satisfied (and not satisfied) by a pool
+void
+message_pool_get_stats(struct message_pool *mp, uint32_t *hit, uint32_t *miss)
+{
+    pthread_mutex_lock(&mp->lock);
+    *hit = mp->alloc_hit;
+    *miss = mp->alloc_miss;
+    pthread_mutex_unlock(&mp->lock);
+}
+
+
+/****************************************************************
+ * Command encoders
+ ****************************************************************/
+
+// A command_encoder holds the message id and parameter types of a
+// command so that the command may be encoded directly from its
+// arguments (without building the message bytes in python).  Integer
+// parameters are read from 'args' and the (at most one) buffer
+// parameter is read from 'buf'.
+
+// Encode a command into a queue_message.  Returns 0 on success or -1
+// if the arguments would not fit in a single message.
+int
+command_encoder_encode(struct command_encoder *ce, struct queue_message *qm
+                       , int64_t *args, uint8_t *buf, int buf_len)
+{
+    uint8_t *p = qm->msg, *end = &qm->msg[MESSAGE_PAYLOAD_MAX];
+    memcpy(p, ce->msgid, ce->msgid_len);
+    p += ce->msgid_len;
+    int i;
+    for (i=0; i<ce->num_params; i++) {
+        if (ce->param_types[i] == CE_BUFFER) {
+            if (buf_len < 0 || buf_len > end - p - 1)
+                return -1;
+            *p++ = buf_len;
+            memcpy(p, buf, buf_len);
+            p += buf_len;
+            continue;
+        }
+        if (p + 5 > end)
+            return -1;
+        p = encode_int(p, args[i]);
+    }
+    qm->len = p - qm->msg;
+    return 0;
+}
+
+// Create a new 'struct command_encoder' object
+struct command_encoder * __visible
+command_encoder_alloc(uint8_t *msgid, int msgid_len, uint8_t *param_types
+                      , int num_params)
+{
+    if (msgid_len < 0 || msgid_len > MESSAGE_PAYLOAD_MAX
+        || num_params < 0 || num_params > MESSAGE_PAYLOAD_MAX)
+        return NULL;
+    struct command_encoder *ce = malloc(sizeof(*ce));
+    memset(ce, 0, sizeof(*ce));
+    memcpy(ce->msgid, msgid, msgid_len);
+    ce->msgid_len = msgid_len;
+    memcpy(ce->param_types, param_types, num_params);
+    ce->num_params = num_params;
+    return ce;
+}
+
+// Free memory associated with a 'struct command_encoder' object
+void __visible
+command_encoder_free(struct command_encoder *ce)
+{
+    free(ce);
+}
+
+
 /****************************************************************
  * Clock estimation
  ****************************************************************/
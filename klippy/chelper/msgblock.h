@@ -1,6 +1,7 @@
 #ifndef MSGBLOCK_H
 #define MSGBLOCK_H
 
+#include <pthread.h> // pthread_mutex_t
 #include <stdint.h> // uint8_t
 #include "list.h" // struct list_node
 
@@ -15,6 +16,7 @@
 #define MESSAGE_PAYLOAD_MAX (MESSAGE_MAX - MESSAGE_MIN)
 #define MESSAGE_SEQ_MASK 0x0f
 #define MESSAGE_DEST 0x10
+#define MESSAGE_SEQ_SACK 0x20
 #define MESSAGE_SYNC 0x7E
 
 struct queue_message {
@@ -24,6 +26,9 @@ struct queue_message {
         // Filled when on a command queue
         struct {
             uint64_t min_clock, req_clock;
+            double ready_time;
+            // Number of mcu 'move queue' entries used (stepper commands)
+            int move_count;
         };
         // Filled when in sent/receive queues
         struct {
@@ -34,6 +39,21 @@ struct queue_message {
     struct list_node node;
 };
 
+struct message_pool {
+    pthread_mutex_t lock;
+    struct list_head free_list;
+    int free_count;
+    uint32_t alloc_hit, alloc_miss;
+};
+
+enum { CE_INT, CE_BUFFER };
+
+struct command_encoder {
+    uint8_t msgid[MESSAGE_PAYLOAD_MAX];
+    int msgid_len, num_params;
+    uint8_t param_types[MESSAGE_PAYLOAD_MAX];
+};
+
 struct clock_estimate {
     uint64_t last_clock, conv_clock;
     double conv_time, est_freq;
@@ -42,11 +62,28 @@ struct clock_estimate {
 uint16_t msgblock_crc16_ccitt(uint8_t *buf, uint8_t len);
 int msgblock_check(uint8_t *need_sync, uint8_t *buf, int buf_len);
 int msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len);
+int msgblock_decode_buffer(uint32_t *data, int data_len, uint8_t **buf
+                           , uint8_t *msg, int msg_len);
+int msgblock_encode_ints(uint8_t *buf, int buf_len, uint32_t *data
+                         , int data_len);
 struct queue_message *message_alloc(void);
 struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
 void message_free(struct queue_message *qm);
 void message_queue_free(struct list_head *root);
+void message_pool_init(struct message_pool *mp);
+void message_pool_destroy(struct message_pool *mp);
+struct queue_message *message_pool_alloc(struct message_pool *mp);
+struct queue_message *message_pool_fill(struct message_pool *mp
+                                        , uint8_t *data, int len);
+struct queue_message *message_pool_alloc_and_encode(struct message_pool *mp
+                                                    , uint32_t *data, int len);
+void message_pool_free(struct message_pool *mp, struct queue_message *qm);
+void message_pool_queue_free(struct message_pool *mp, struct list_head *root);
+void message_pool_get_stats(struct message_pool *mp, uint32_t *hit
+                            , uint32_t *miss);
+int command_encoder_encode(struct command_encoder *ce, struct queue_message *qm
+                           , int64_t *args, uint8_t *buf, int buf_len);
 uint64_t clock_from_clock32(struct clock_estimate *ce, uint32_t clock32);
 double clock_to_time(struct clock_estimate *ce, uint64_t clock);
 uint64_t clock_from_time(struct clock_estimate *ce, double time);
@@ -0,0 +1,351 @@
+// Fast text formatting of message blocks (for debugging tools)
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The msgdump code produces the same text as the python
+// msgproto.MessageParser.dump() code.  The host code registers a
+// template for each message id of the data dictionary - the
+// template text contains a 0x01 byte at the location of each
+// parameter.  Blocks containing messages that can not be formatted
+// here (unknown message ids or malformed messages) are reported back
+// to the caller so that they may be handled by the python code.
+
+#include <stdio.h> // snprintf
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "msgblock.h" // msgblock_crc16_ccitt
+
+#define TEMPLATE_PARAM 0x01
+#define MAX_BLOCK_TEXT 8192
+
+struct msgdump_enum {
+    int64_t value;
+    char *name;
+};
+
+struct msgdump_param {
+    uint8_t type; // 'u', 'i', or 's' ('U' and 'I' for enumerations)
+    struct msgdump_enum *enums;
+    int enum_count;
+};
+
+struct msgdump_format {
+    char *template;
+    int num_params;
+    struct msgdump_param *params;
+};
+
+struct msgdump {
+    int bytes_prefix;
+    struct msgdump_format **formats;
+    int format_count;
+};
+
+
+/****************************************************************
+ * Formatting
+ ****************************************************************/
+
+struct dump_output {
+    char *buf, *end;
+};
+
+// Append text to the output (returns -1 if there is no space)
+static int
+output_add(struct dump_output *o, const char *s, int len)
+{
+    if (len > o->end - o->buf)
+        return -1;
+    memcpy(o->buf, s, len);
+    o->buf += len;
+    return 0;
+}
+
+// Parse an integer using the same semantics as msgproto.PT_uint32
+static int
+parse_int(uint8_t **pp, uint8_t *end, int is_signed, int64_t *pv)
+{
+    uint8_t *p = *pp;
+    if (p >= end)
+        return -1;
+    uint8_t c = *p++;
+    uint64_t v = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        v |= -0x20;
+    while (c & 0x80) {
+        if (p >= end)
+            return -1;
+        c = *p++;
+        v = (v << 7) | (c & 0x7f);
+    }
+    if (!is_signed)
+        v &= 0xffffffff;
+    *pp = p;
+    *pv = v;
+    return 0;
+}
+
+// Append a buffer using the same text as python's repr() of a string
+static int
+output_repr(struct msgdump *md, struct dump_output *o, uint8_t *s, int len)
+{
+    int i, has_single = 0, has_double = 0;
+    for (i=0; i<len; i++) {
+        has_single |= s[i] == '\'';
+        has_double |= s[i] == '"';
+    }
+    char quote = has_single && !has_double ? '"' : '\'';
+    char buf[4*MESSAGE_MAX + 4], *p = buf;
+    if (md->bytes_prefix)
+        *p++ = 'b';
+    *p++ = quote;
+    for (i=0; i<len; i++) {
+        uint8_t c = s[i];
+        if (c == quote || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c == '\t') {
+            *p++ = '\\';
+            *p++ = 't';
+        } else if (c == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
+        } else if (c == '\r') {
+            *p++ = '\\';
+            *p++ = 'r';
+        } else if (c < ' ' || c >= 0x7f) {
+            p += snprintf(p, 5, "\\x%02x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = quote;
+    return output_add(o, buf, p - buf);
+}
+
+// Append the text of an integer (or enumeration) parameter
+static int
+output_int(struct dump_output *o, struct msgdump_param *mp, int64_t v)
+{
+    char buf[32];
+    if (mp->type == 'U' || mp->type == 'I') {
+        int i;
+        for (i=0; i<mp->enum_count; i++)
+            if (mp->enums[i].value == v)
+                return output_add(o, mp->enums[i].name
+                                  , strlen(mp->enums[i].name));
+        return output_add(o, buf, snprintf(buf, sizeof(buf), "?%lld"
+                                           , (long long)v));
+    }
+    return output_add(o, buf, snprintf(buf, sizeof(buf), "%lld"
+                                       , (long long)v));
+}
+
+// Find the registered format of a message id
+static struct msgdump_format *
+lookup_format(struct msgdump *md, int64_t msgid)
+{
+    // Message ids may be negative - store them interleaved
+    if (msgid >= md->format_count || -msgid >= md->format_count)
+        return NULL;
+    int index = msgid >= 0 ? msgid * 2 : -msgid * 2 - 1;
+    if (index >= md->format_count)
+        return NULL;
+    return md->formats[index];
+}
+
+// Format a single message - returns -1 if it can not be handled here
+static int
+format_message(struct msgdump *md, struct dump_output *o
+               , uint8_t **pp, uint8_t *end)
+{
+    int64_t msgid;
+    uint8_t *p = *pp;
+    if (parse_int(&p, end, 1, &msgid))
+        return -1;
+    struct msgdump_format *mf = lookup_format(md, msgid);
+    if (!mf)
+        return -1;
+    struct msgdump_param *mp = mf->params;
+    char *t = mf->template;
+    for (;;) {
+        char *next = strchr(t, TEMPLATE_PARAM);
+        if (!next)
+            break;
+        if (output_add(o, t, next - t))
+            return -1;
+        t = next + 1;
+        if (mp->type == 's') {
+            if (p >= end || p + 1 + *p > end)
+                return -1;
+            int len = *p++;
+            if (output_repr(md, o, p, len))
+                return -1;
+            p += len;
+        } else {
+            int64_t v;
+            int is_signed = mp->type == 'i' || mp->type == 'I';
+            if (parse_int(&p, end, is_signed, &v) || output_int(o, mp, v))
+                return -1;
+        }
+        mp++;
+    }
+    if (output_add(o, t, strlen(t)))
+        return -1;
+    *pp = p;
+    return 0;
+}
+
+// Format all the messages in a block (each on a separate line)
+static int
+format_block(struct msgdump *md, struct dump_output *o, uint8_t *msg, int len)
+{
+    char buf[16];
+    if (output_add(o, buf, snprintf(buf, sizeof(buf), "seq: %02x"
+                                    , msg[MESSAGE_POS_SEQ])))
+        return -1;
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE];
+    uint8_t *end = &msg[len - MESSAGE_TRAILER_SIZE];
+    do {
+        if (output_add(o, "\n", 1) || format_message(md, o, &p, end))
+            return -1;
+    } while (p < end);
+    return 0;
+}
+
+// Check for a complete message block using the same semantics as
+// msgproto.MessageParser.check_packet()
+static int
+check_block(uint8_t *data, int len)
+{
+    if (len < MESSAGE_MIN)
+        return 0;
+    int msglen = data[MESSAGE_POS_LEN];
+    if (msglen < MESSAGE_MIN || msglen > MESSAGE_MAX)
+        return -1;
+    if ((data[MESSAGE_POS_SEQ] & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST)
+        return -1;
+    if (len < msglen)
+        return 0;
+    if (data[msglen - MESSAGE_TRAILER_SYNC] != MESSAGE_SYNC)
+        return -1;
+    uint16_t crc = msgblock_crc16_ccitt(data, msglen - MESSAGE_TRAILER_SIZE);
+    if (data[msglen - MESSAGE_TRAILER_CRC] != (crc >> 8)
+        || data[msglen - MESSAGE_TRAILER_CRC + 1] != (crc & 0xff))
+        return -1;
+    return msglen;
+}
+
+// Format the consecutive valid message blocks at the start of 'data'.
+// The text of each block is terminated with a zero byte.  Returns the
+// number of bytes of 'data' consumed - processing stops at the first
+// block that is incomplete, invalid, or can not be formatted here
+// (the caller should then handle it with the python code).
+int __visible
+msgdump_format_blocks(struct msgdump *md, uint8_t *data, int len
+                      , char *out, int out_len, int *out_pos)
+{
+    struct dump_output o = { out, out + out_len };
+    int pos = 0;
+    while (o.end - o.buf >= MAX_BLOCK_TEXT) {
+        int msglen = check_block(&data[pos], len - pos);
+        if (msglen <= 0)
+            break;
+        char *start = o.buf;
+        if (format_block(md, &o, &data[pos], msglen)
+            || output_add(&o, "", 1)) {
+            o.buf = start;
+            break;
+        }
+        pos += msglen;
+    }
+    *out_pos = o.buf - out;
+    return pos;
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// Register the template of a message id
+int __visible
+msgdump_add_format(struct msgdump *md, int msgid, const char *template
+                   , const char *param_types)
+{
+    if (lookup_format(md, msgid))
+        return -1;
+    int index = msgid >= 0 ? msgid * 2 : -msgid * 2 - 1;
+    if (index >= md->format_count) {
+        int new_count = index + 1;
+        md->formats = realloc(md->formats, sizeof(*md->formats) * new_count);
+        memset(&md->formats[md->format_count], 0
+               , sizeof(*md->formats) * (new_count - md->format_count));
+        md->format_count = new_count;
+    }
+    int i, num_params = strlen(param_types);
+    struct msgdump_format *mf = malloc(sizeof(*mf));
+    memset(mf, 0, sizeof(*mf));
+    mf->template = strdup(template);
+    mf->num_params = num_params;
+    mf->params = malloc(sizeof(*mf->params) * (num_params + 1));
+    memset(mf->params, 0, sizeof(*mf->params) * (num_params + 1));
+    for (i=0; i<num_params; i++)
+        mf->params[i].type = param_types[i];
+    md->formats[index] = mf;
+    return 0;
+}
+
+// Add a value name to an enumerated parameter of a message id
+int __visible
+msgdump_add_enum(struct msgdump *md, int msgid, int param, int64_t value
+                 , const char *name)
+{
+    struct msgdump_format *mf = lookup_format(md, msgid);
+    if (!mf || param < 0 || param >= mf->num_params)
+        return -1;
+    struct msgdump_param *mp = &mf->params[param];
+    mp->enums = realloc(mp->enums, sizeof(*mp->enums) * (mp->enum_count + 1));
+    struct msgdump_enum *me = &mp->enums[mp->enum_count++];
+    me->value = value;
+    me->name = strdup(name);
+    return 0;
+}
+
+// Create a new 'struct msgdump' object
+struct msgdump * __visible
+msgdump_alloc(int bytes_prefix)
+{
+    struct msgdump *md = malloc(sizeof(*md));
+    memset(md, 0, sizeof(*md));
+    md->bytes_prefix = bytes_prefix;
+    return md;
+}
+
+// Free memory associated with a 'struct msgdump' object
+void __visible
+msgdump_free(struct msgdump *md)
+{
+    if (!md)
+        return;
+    int i, j, k;
+    for (i=0; i<md->format_count; i++) {
+        struct msgdump_format *mf = md->formats[i];
+        if (!mf)
+            continue;
+        for (j=0; j<mf->num_params; j++) {
+            struct msgdump_param *mp = &mf->params[j];
+            for (k=0; k<mp->enum_count; k++)
+                free(mp->enums[k].name);
+            free(mp->enums);
+        }
+        free(mf->params);
+        free(mf->template);
+        free(mf);
+    }
+    free(md->formats);
+    free(md);
+}
@@ -1,9 +1,10 @@
 // Code for dispatching timer and file descriptor events
 //
-// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <errno.h> // errno
 #include <fcntl.h> // fcntl
 #include <math.h> // ceil
 #include <poll.h> // poll
@@ -12,40 +13,75 @@
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // report_errno
 
+#if defined(__linux__)
+#define PR_USE_EPOLL 1
+#include <sys/epoll.h> // epoll_wait
+#include <sys/timerfd.h> // timerfd_settime
+#include <unistd.h> // read
+#endif
+
 struct pollreactor_timer {
     double waketime;
     double (*callback)(void *data, double eventtime);
+    void *data;
+};
+
+struct pollreactor_fd {
+    void (*callback)(void *data, double eventtime);
+    void *data;
 };
 
 struct pollreactor {
     int num_fds, num_timers, must_exit;
-    void *callback_data;
     double next_timer;
     struct pollfd *fds;
-    void (**fd_callbacks)(void *data, double eventtime);
+    struct pollreactor_fd *fd_callbacks;
     struct pollreactor_timer *timers;
+    // Statistics
+    uint32_t wakeups, timer_dispatch, timer_max_delay_us;
+    double timer_delay;
+#if PR_USE_EPOLL
+    int epoll_fd, timer_fd;
+    double timer_armed;
+    struct epoll_event *events;
+#endif
 };
 
 // Allocate a new 'struct pollreactor' object
 struct pollreactor *
-pollreactor_alloc(int num_fds, int num_timers, void *callback_data)
+pollreactor_alloc(int num_fds, int num_timers)
 {
     struct pollreactor *pr = malloc(sizeof(*pr));
     memset(pr, 0, sizeof(*pr));
     pr->num_fds = num_fds;
     pr->num_timers = num_timers;
     pr->must_exit = 0;
-    pr->callback_data = callback_data;
     pr->next_timer = PR_NEVER;
     pr->fds = malloc(num_fds * sizeof(*pr->fds));
     memset(pr->fds, 0, num_fds * sizeof(*pr->fds));
+    int i;
+    for (i=0; i<num_fds; i++)
+        pr->fds[i].fd = -1;
     pr->fd_callbacks = malloc(num_fds * sizeof(*pr->fd_callbacks));
     memset(pr->fd_callbacks, 0, num_fds * sizeof(*pr->fd_callbacks));
     pr->timers = malloc(num_timers * sizeof(*pr->timers));
     memset(pr->timers, 0, num_timers * sizeof(*pr->timers));
-    int i;
     for (i=0; i<num_timers; i++)
         pr->timers[i].waketime = PR_NEVER;
+#if PR_USE_EPOLL
+    pr->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pr->epoll_fd < 0)
+        report_errno("epoll_create1", pr->epoll_fd);
+    pr->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (pr->timer_fd < 0)
+        report_errno("timerfd_create", pr->timer_fd);
+    pr->timer_armed = PR_NEVER;
+    pr->events = malloc((num_fds + 1) * sizeof(*pr->events));
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = num_fds };
+    int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, pr->timer_fd, &ev);
+    if (ret < 0)
+        report_errno("epoll_ctl", ret);
+#endif
     return pr;
 }
 
@@ -59,25 +95,70 @@ pollreactor_free(struct pollreactor *pr)
     pr->fd_callbacks = NULL;
     free(pr->timers);
     pr->timers = NULL;
+#if PR_USE_EPOLL
+    close(pr->epoll_fd);
+    close(pr->timer_fd);
+    free(pr->events);
+    pr->events = NULL;
+#endif
     free(pr);
 }
 
 // Add a callback for when a file descriptor (fd) becomes readable
 void
 pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
-                   , int write_only)
+                   , void *data, int write_only)
 {
     pr->fds[pos].fd = fd;
     pr->fds[pos].events = POLLHUP | (write_only ? 0 : POLLIN);
     pr->fds[pos].revents = 0;
-    pr->fd_callbacks[pos] = callback;
+    pr->fd_callbacks[pos].callback = callback;
+    pr->fd_callbacks[pos].data = data;
+#if PR_USE_EPOLL
+    struct epoll_event ev = {
+        .events = EPOLLHUP | (write_only ? 0 : EPOLLIN), .data.u32 = pos };
+    int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    // Regular files (debug output) can't be added to an epoll set -
+    // they never report a hangup, so it is safe to not watch them
+    if (ret < 0 && !(write_only && errno == EPERM))
+        report_errno("epoll_ctl", ret);
+#endif
+}
+
+// Remove the callback of a file descriptor (fd) - this may be called
+// from an fd or timer callback of the running pollreactor_run() loop
+void
+pollreactor_remove_fd(struct pollreactor *pr, int pos)
+{
+#if PR_USE_EPOLL
+    int ret = epoll_ctl(pr->epoll_fd, EPOLL_CTL_DEL, pr->fds[pos].fd, NULL);
+    // Regular files were never added to the epoll set
+    if (ret < 0 && errno != EPERM && errno != ENOENT)
+        report_errno("epoll_ctl", ret);
+#endif
+    pr->fds[pos].fd = -1;
+    pr->fds[pos].revents = 0;
+    pr->fd_callbacks[pos].callback = NULL;
+    pr->fd_callbacks[pos].data = NULL;
 }
 
 // Add a timer callback
 void
-pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback)
+pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback
+                      , void *data)
 {
     pr->timers[pos].callback = callback;
+    pr->timers[pos].data = data;
+    pr->timers[pos].waketime = PR_NEVER;
+}
+
+// Remove a timer callback - this may be called from an fd or timer
+// callback of the running pollreactor_run() loop
+void
+pollreactor_remove_timer(struct pollreactor *pr, int pos)
+{
+    pr->timers[pos].callback = NULL;
+    pr->timers[pos].data = NULL;
     pr->timers[pos].waketime = PR_NEVER;
 }
 
@@ -110,20 +191,111 @@ pollreactor_check_timers(struct pollreactor *pr, double eventtime, int busy)
             double t = timer->waketime;
             if (eventtime >= t) {
                 busy = 1;
-                t = timer->callback(pr->callback_data, eventtime);
+                if (t > PR_NOW) {
+                    // Track how late scheduled timers are dispatched
+                    double delay = eventtime - t;
+                    uint32_t delay_us = delay * 1000000.;
+                    pr->timer_dispatch++;
+                    pr->timer_delay += delay;
+                    if (delay_us > pr->timer_max_delay_us)
+                        pr->timer_max_delay_us = delay_us;
+                }
+                t = timer->callback(timer->data, eventtime);
+                if (!timer->callback)
+                    // Timer was removed by its callback
+                    t = PR_NEVER;
                 timer->waketime = t;
             }
             if (t < pr->next_timer)
                 pr->next_timer = t;
         }
     }
-    if (busy)
-        return 0;
-    // Calculate sleep duration
-    double timeout = ceil((pr->next_timer - eventtime) * 1000.);
-    return timeout < 1. ? 1 : (timeout > 1000. ? 1000 : (int)timeout);
+    return busy;
+}
+
+#if PR_USE_EPOLL
+
+// Wait for fd events (or the next timer) using epoll and a timerfd
+static int
+pollreactor_wait(struct pollreactor *pr, double eventtime, int busy)
+{
+    int timeout = 0;
+    double next_timer = pr->next_timer;
+    if (!busy && next_timer > eventtime) {
+        timeout = -1;
+        if (next_timer != pr->timer_armed) {
+            // Program the timerfd with the time until the next timer
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            if (next_timer < PR_NEVER) {
+                double delay = next_timer - eventtime;
+                its.it_value.tv_sec = delay;
+                its.it_value.tv_nsec = (delay - its.it_value.tv_sec) * 1e9;
+                if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+                    its.it_value.tv_nsec = 1;
+            }
+            int ret = timerfd_settime(pr->timer_fd, 0, &its, NULL);
+            if (ret < 0)
+                report_errno("timerfd_settime", ret);
+            pr->timer_armed = next_timer;
+        }
+        pr->wakeups++;
+    }
+    return epoll_wait(pr->epoll_fd, pr->events, pr->num_fds + 1, timeout);
 }
 
+// Invoke the callbacks of the fds reported by pollreactor_wait()
+static void
+pollreactor_dispatch(struct pollreactor *pr, int count, double eventtime)
+{
+    int i;
+    for (i=0; i<count; i++) {
+        uint32_t pos = pr->events[i].data.u32;
+        if (pos >= pr->num_fds) {
+            // Timer expired - clear the timerfd
+            uint64_t expirations;
+            int ret = read(pr->timer_fd, &expirations, sizeof(expirations));
+            (void)ret;
+            pr->timer_armed = PR_NEVER;
+            continue;
+        }
+        // The fd may have been removed by an earlier callback
+        struct pollreactor_fd *pfd = &pr->fd_callbacks[pos];
+        if (pfd->callback)
+            pfd->callback(pfd->data, eventtime);
+    }
+}
+
+#else
+
+// Wait for fd events (or the next timer) using poll
+static int
+pollreactor_wait(struct pollreactor *pr, double eventtime, int busy)
+{
+    int timeout = 0;
+    if (!busy) {
+        // Calculate sleep duration
+        double t = ceil((pr->next_timer - eventtime) * 1000.);
+        timeout = t < 1. ? 1 : (t > 1000. ? 1000 : (int)t);
+        pr->wakeups++;
+    }
+    return poll(pr->fds, pr->num_fds, timeout);
+}
+
+// Invoke the callbacks of the fds reported by pollreactor_wait()
+static void
+pollreactor_dispatch(struct pollreactor *pr, int count, double eventtime)
+{
+    int i;
+    for (i=0; i<pr->num_fds; i++) {
+        struct pollreactor_fd *pfd = &pr->fd_callbacks[i];
+        if (pr->fds[i].revents && pfd->callback)
+            pfd->callback(pfd->data, eventtime);
+    }
+}
+
+#endif
+
 // Repeatedly check for timer and fd events and invoke their callbacks
 void
 pollreactor_run(struct pollreactor *pr)
@@ -131,16 +303,13 @@ pollreactor_run(struct pollreactor *pr)
     double eventtime = get_monotonic();
     int busy = 1;
     while (! pr->must_exit) {
-        int timeout = pollreactor_check_timers(pr, eventtime, busy);
+        busy = pollreactor_check_timers(pr, eventtime, busy);
+        int ret = pollreactor_wait(pr, eventtime, busy);
         busy = 0;
-        int ret = poll(pr->fds, pr->num_fds, timeout);
         eventtime = get_monotonic();
         if (ret > 0) {
             busy = 1;
-            int i;
-            for (i=0; i<pr->num_fds; i++)
-                if (pr->fds[i].revents)
-                    pr->fd_callbacks[i](pr->callback_data, eventtime);
+            pollreactor_dispatch(pr, ret, eventtime);
         } else if (ret < 0) {
             report_errno("poll", ret);
             pr->must_exit = 1;
@@ -148,6 +317,18 @@ pollreactor_run(struct pollreactor *pr)
     }
 }
 
+// Return statistics on the pollreactor_run() loop (and reset the
+// maximum timer delay)
+void
+pollreactor_get_stats(struct pollreactor *pr, struct pollreactor_stats *stats)
+{
+    stats->wakeups = pr->wakeups;
+    stats->timer_dispatch = pr->timer_dispatch;
+    stats->timer_delay = pr->timer_delay;
+    stats->timer_max_delay = pr->timer_max_delay_us / 1000000.;
+    pr->timer_max_delay_us = 0;
+}
+
 // Request that a currently running pollreactor_run() loop exit
 void
 pollreactor_do_exit(struct pollreactor *pr)
@@ -4,17 +4,28 @@
 #define PR_NOW   0.
 #define PR_NEVER 9999999999999999.
 
-struct pollreactor *pollreactor_alloc(int num_fds, int num_timers
-                                      , void *callback_data);
+#include <stdint.h> // uint32_t
+
+struct pollreactor_stats {
+    uint32_t wakeups, timer_dispatch;
+    double timer_delay, timer_max_delay;
+};
+
+struct pollreactor *pollreactor_alloc(int num_fds, int num_timers);
 void pollreactor_free(struct pollreactor *pr);
 void pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
-                        , int write_only);
-void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback);
+                        , void *data, int write_only);
+void pollreactor_remove_fd(struct pollreactor *pr, int pos);
+void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback
+                           , void *data);
+void pollreactor_remove_timer(struct pollreactor *pr, int pos);
 double pollreactor_get_timer(struct pollreactor *pr, int pos);
 void pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime);
 void pollreactor_run(struct pollreactor *pr);
 void pollreactor_do_exit(struct pollreactor *pr);
 int pollreactor_is_exit(struct pollreactor *pr);
+void pollreactor_get_stats(struct pollreactor *pr
+                           , struct pollreactor_stats *stats);
 int fd_set_non_blocking(int fd);
 
 #endif // pollreactor.h
@@ -1,10 +1,13 @@
 // Helper functions for C / Python interface
 //
-// Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <errno.h> // errno
+#include <pthread.h> // pthread_setschedparam
+#include <sched.h> // SCHED_FIFO
 #include <stdarg.h> // va_start
 #include <stdint.h> // uint8_t
 #include <stdio.h> // fprintf
@@ -69,6 +72,43 @@ report_errno(char *where, int rc)
     errorf("Got error %d in %s: (%d)%s", rc, where, e, strerror(e));
 }
 
+// Set the realtime priority (SCHED_FIFO) and the allowed cpus of the
+// calling thread.  A zero 'priority' or 'cpu_mask' leaves that setting
+// unchanged.
+int __visible
+set_thread_scheduling(int priority, uint64_t cpu_mask)
+{
+    int res = 0;
+    if (priority) {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = priority;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (ret) {
+            errno = ret;
+            report_errno("pthread_setschedparam", ret);
+            res = -1;
+        }
+    }
+#if defined(__linux__)
+    if (cpu_mask) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        int cpu;
+        for (cpu=0; cpu<64; cpu++)
+            if (cpu_mask & (1ULL << cpu))
+                CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret) {
+            errno = ret;
+            report_errno("pthread_setaffinity_np", ret);
+            res = -1;
+        }
+    }
+#endif
+    return res;
+}
+
 // Return a hex character for a given number
 #define GETHEX(x) ((x) < 10 ? '0' + (x) : 'a' + (x) - 10)
 
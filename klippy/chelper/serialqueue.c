@@ -1,6 +1,6 @@
 // Serial port command queuing
 //
-// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -11,7 +11,10 @@
 // transmitted, schedules transmission of commands at specified mcu
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
+// Several serialqueues may optionally share a single background
+// thread (see serialqueue_thread_alloc()).
 
+#include <errno.h> // ECONNREFUSED
 #include <linux/can.h> // // struct can_frame
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
@@ -22,6 +25,7 @@
 #include <string.h> // memset
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
+#include "canbus_sched.h" // canbus_sched_reserve
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
 #include "msgblock.h" // message_alloc
@@ -32,46 +36,85 @@
 struct command_queue {
     struct list_head upcoming_queue, ready_queue;
     struct list_node node;
+    int priority;
+    // Number of parameters (after the message id) that identify a
+    // "latest-value" message - zero if messages are never coalesced
+    int coalesce_params;
 };
 
 struct serialqueue {
     // Input reading
     struct pollreactor *pr;
+    int pr_fd_base, pr_timer_base;
     int serial_fd, serial_fd_type, client_id;
+    int sched_priority;
+    uint64_t sched_cpu_mask;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
+    // Input from the canbus bulk data id
+    uint8_t bulk_input_buf[MESSAGE_MAX + CANFD_MAX_DLEN];
+    uint8_t bulk_need_sync;
+    int bulk_input_pos;
     // Threading
     pthread_t tid;
+    struct serialqueue_thread *st;
+    int st_slot, st_state, must_exit;
     pthread_mutex_t lock; // protects variables below
     pthread_cond_t cond;
-    int receive_waiting;
+    int receive_waiting, wake_fd;
     // Baud / clock tracking
     int receive_window;
-    double bittime_adjust, idle_time;
+    double bittime_adjust, data_bittime_adjust, idle_time;
     struct clock_estimate ce;
+    struct canbus_node bus_node;
     double last_receive_sent_time;
+    // Clock synchronization
+    uint8_t clock_msgid[5];
+    int clock_msgid_len;
+    struct clock_sync_state cs;
     // Retransmit support
     uint64_t send_seq, receive_seq;
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
     struct list_head sent_queue;
     double srtt, rttvar, rto;
+    // Adaptive window support
+    int adaptive_window;
+    double window_blocks, min_rtt;
+    // Selective ack support
+    uint8_t sack_prefix[MESSAGE_PAYLOAD_MAX];
+    int sack_prefix_len, sack_blocks, sack_mask;
+    uint64_t sack_seq;
     // Pending transmission message queues
     struct list_head pending_queues;
     int ready_bytes, upcoming_bytes, need_ack_bytes, last_ack_bytes;
     uint64_t need_kick_clock;
     struct list_head notify_queue;
     double last_write_fail_time;
-    // Received messages
-    struct list_head receive_queue;
+    // Received messages (ring is written by the background thread and
+    // read by serialqueue_pull_many() without taking the lock)
+    struct pull_queue_message *receive_ring;
+    uint32_t receive_head, receive_tail;
+    struct list_head receive_queue; // overflow when ring is full
     // Fastreader support
     pthread_mutex_t fast_reader_dispatch_lock;
     struct list_head fast_readers;
+    // Response dispatch support
+    struct list_head response_handlers;
+    int last_dispatch_id;
     // Debugging
     struct list_head old_sent, old_receive;
+    // Message allocation
+    struct message_pool msg_pool;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t coalesce_msgs;
+    int queued_msgs, queued_msgs_peak;
+    uint64_t send_blocks, send_payload_bytes;
+    uint32_t class_msgs[SQ_PRIORITY_NUM];
+    double class_delay[SQ_PRIORITY_NUM], class_max_delay[SQ_PRIORITY_NUM];
+    struct serialqueue_msgid_stats *msgid_stats; // indexed by msgid
 };
 
 #define SQPF_SERIAL 0
@@ -82,40 +125,170 @@ struct serialqueue {
 #define SQPT_COMMAND    1
 #define SQPT_NUM        2
 
+#define SQTHREAD_MAX 16 // Maximum serialqueues using a shared thread
+
+// A background thread shared by several serialqueues
+struct serialqueue_thread {
+    struct pollreactor *pr;
+    int sched_priority;
+    uint64_t sched_cpu_mask;
+    int pipe_fds[2];
+    pthread_t tid;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond;
+    int refcount;
+    struct serialqueue *slots[SQTHREAD_MAX];
+};
+
+// The fd and timer positions of a shared thread's pollreactor - the
+// events of each serialqueue follow those of the thread itself
+#define SQTF_PIPE    0
+#define SQTF_NUM     1
+#define SQTT_CONTROL 0
+#define SQTT_NUM     1
+
+// Attachment state of a serialqueue using a shared thread
+#define SQTS_ATTACH 1
+#define SQTS_ACTIVE 2
+#define SQTS_DONE   3
+
 #define SQT_UART 'u'
 #define SQT_CAN 'c'
+#define SQT_CANFD 'd'
+// Offset of the CAN id used by the mcu to send bulk data
+#define CANBUS_ID_BULK_OFFSET 0x400
 #define SQT_DEBUGFILE 'f'
+#define SQT_SOCKET 's' // Local (unix) stream socket - no tty handling
+#define SQT_UDP 'n' // UDP socket - each datagram holds whole message blocks
 
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
 #define MAX_PENDING_BLOCKS 12
+#define MIN_WINDOW_BLOCKS 2
+#define MAX_WINDOW_BLOCKS 15 // Limited by the 4-bit sequence number
+#define WINDOW_ALPHA 1.0
+#define WINDOW_BETA 3.0
+#define MIN_RTT_SAMPLE 0.0005
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
 #define IDLE_QUERY_TIME 1.0
+#define PACK_HORIZON 0.010
 
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
 
+#define RECEIVE_RING_SIZE 512 // Must be a power of 2
+#define MSGID_STATS_MIN -32 // Lowest message id with a single byte encoding
+#define MSGID_STATS_MAX 1024
+
+#define CLOCK_RTT_AGE (.000010 / (60. * 60.))
+#define CLOCK_DECAY (1. / 30.)
+#define CLOCK_TRANSMIT_EXTRA .001
+#define CLOCK_WARMUP_SAMPLES 8
+
+// A registered response handler (see serialqueue_add_response())
+struct response_handler {
+    struct list_node node;
+    int dispatch_id, msgid_len, num_params, coalesce, pending;
+    uint32_t unsigned_mask;
+    int prefix_len;
+    uint8_t prefix[MESSAGE_MAX];
+    // Most recent message (when in coalesce mode)
+    struct pull_queue_message latest;
+};
+
+// The debug queues hold the most recent sent and received blocks (for
+// serialqueue_extract_old()).  Acknowledged sent blocks are moved to
+// the queue (not copied) and received blocks are decoded directly
+// into the oldest queue entry, so the history has no extra cost.
+
 // Create a series of empty messages and add them to a list
 static void
-debug_queue_alloc(struct list_head *root, int count)
+debug_queue_alloc(struct message_pool *mp, struct list_head *root, int count)
 {
     int i;
     for (i=0; i<count; i++) {
-        struct queue_message *qm = message_alloc();
+        struct queue_message *qm = message_pool_alloc(mp);
         list_add_head(&qm->node, root);
     }
 }
 
-// Copy a message to a debug queue and free old debug messages
+// Move a sent message to a debug queue and release the oldest entry
 static void
-debug_queue_add(struct list_head *root, struct queue_message *qm)
+debug_queue_add(struct serialqueue *sq, struct list_head *root
+                , struct queue_message *qm)
 {
     list_add_tail(&qm->node, root);
     struct queue_message *old = list_first_entry(
         root, struct queue_message, node);
     list_del(&old->node);
-    message_free(old);
+    message_pool_free(&sq->msg_pool, old);
+}
+
+// Reuse the oldest message in a debug queue as its newest entry
+static struct queue_message *
+debug_queue_next(struct list_head *root)
+{
+    struct queue_message *qm = list_first_entry(
+        root, struct queue_message, node);
+    list_del(&qm->node);
+    list_add_tail(&qm->node, root);
+    return qm;
+}
+
+// Track the number of messages held in the pending, notify, sent,
+// and receive overflow queues (and the high-water mark of that count)
+static void
+note_queued_msgs(struct serialqueue *sq, int change)
+{
+    sq->queued_msgs += change;
+    if (sq->queued_msgs > sq->queued_msgs_peak)
+        sq->queued_msgs_peak = sq->queued_msgs;
+}
+
+// Copy a queue_message to a pull_queue_message
+static void
+copy_pull_message(struct pull_queue_message *pqm, struct queue_message *qm)
+{
+    memcpy(pqm->msg, qm->msg, qm->len);
+    pqm->len = qm->len;
+    pqm->sent_time = qm->sent_time;
+    pqm->receive_time = qm->receive_time;
+    pqm->notify_id = qm->notify_id;
+}
+
+// Queue a copy of a received message for the receiver thread
+static void
+receive_queue_add(struct serialqueue *sq, struct queue_message *qm)
+{
+    if (list_empty(&sq->receive_queue)) {
+        uint32_t head = sq->receive_head;
+        uint32_t tail = __atomic_load_n(&sq->receive_tail, __ATOMIC_ACQUIRE);
+        if (head - tail < RECEIVE_RING_SIZE) {
+            copy_pull_message(&sq->receive_ring[head % RECEIVE_RING_SIZE], qm);
+            __atomic_store_n(&sq->receive_head, head + 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    // Ring is full - store message on overflow queue (preserving order)
+    struct queue_message *oqm = message_pool_alloc(&sq->msg_pool);
+    memcpy(oqm->msg, qm->msg, qm->len);
+    oqm->len = qm->len;
+    oqm->sent_time = qm->sent_time;
+    oqm->receive_time = qm->receive_time;
+    oqm->notify_id = qm->notify_id;
+    list_add_tail(&oqm->node, &sq->receive_queue);
+    note_queued_msgs(sq, 1);
+}
+
+// Signal the receiver's event fd
+static void
+signal_wake_fd(struct serialqueue *sq)
+{
+    uint64_t val = 1;
+    int ret = write(sq->wake_fd, &val, sizeof(val));
+    if (ret < 0 && errno != EAGAIN)
+        report_errno("wake fd write", ret);
 }
 
 // Wake up the receiver thread if it is waiting
@@ -124,7 +297,10 @@ check_wake_receive(struct serialqueue *sq)
 {
     if (sq->receive_waiting) {
         sq->receive_waiting = 0;
-        pthread_cond_signal(&sq->cond);
+        if (sq->wake_fd >= 0)
+            signal_wake_fd(sq);
+        else
+            pthread_cond_signal(&sq->cond);
     }
 }
 
@@ -137,23 +313,158 @@ kick_bg_thread(struct serialqueue *sq)
         report_errno("pipe write", ret);
 }
 
+// Set the wake-up time of one of the serialqueue's timers
+static void
+sq_update_timer(struct serialqueue *sq, int pos, double waketime)
+{
+    pollreactor_update_timer(sq->pr, sq->pr_timer_base + pos, waketime);
+}
+
+// Return the last scheduled wake-up time of a serialqueue timer
+static double
+sq_get_timer(struct serialqueue *sq, int pos)
+{
+    return pollreactor_get_timer(sq->pr, sq->pr_timer_base + pos);
+}
+
+// Stop processing the serialqueue (called from the background thread)
+static void
+sq_do_exit(struct serialqueue *sq)
+{
+    sq->must_exit = 1;
+    if (sq->st)
+        // The thread's control timer removes the serialqueue's events
+        pollreactor_update_timer(sq->pr, SQTT_CONTROL, PR_NOW);
+    else
+        pollreactor_do_exit(sq->pr);
+}
+
 // Minimum number of bits in a canbus message
 #define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
 #define CANBUS_IFS_BITS 4
 
+// Per datagram overhead (in bytes) of UDP over ethernet (preamble,
+// ethernet header, crc, inter-frame gap, ip header, udp header)
+#define UDP_PACKET_BYTES (8 + 14 + 4 + 12 + 20 + 8)
+// Minimum size of an ethernet frame (including preamble and gap)
+#define UDP_MIN_PACKET_BYTES (8 + 64 + 12)
+// Largest block of data placed in a single datagram
+#define UDP_MAX_PAYLOAD (MESSAGE_MAX * MAX_WINDOW_BLOCKS + 1)
+
+// Minimum number of bits in a CAN FD message (sent at the arbitration
+// rate and at the data rate, not including the data itself)
+#define CANFD_ARB_BITS ((1 + 11 + 1 + 1 + 1 + 1 + 1) + (1 + 2 + 7 + 3))
+#define CANFD_DATA_BITS(len) (1 + 4 + 4 + ((len) > 16 ? 21 + 6 : 17 + 5))
+
+static int
+is_canbus(struct serialqueue *sq)
+{
+    return sq->serial_fd_type == SQT_CAN || sq->serial_fd_type == SQT_CANFD;
+}
+
+// Valid CAN FD frame sizes (for lengths 9 to 64 in four byte units)
+static const uint8_t canfd_frame_sizes[] = {
+    12, 16, 20, 24, 32, 32, 48, 48, 48, 48, 64, 64, 64, 64
+};
+
+// Return the smallest CAN FD frame size that can hold 'len' bytes
+static int
+canfd_frame_len(int len)
+{
+    if (len <= 8)
+        return len;
+    if (len >= 64)
+        return 64;
+    return canfd_frame_sizes[(len + 3) / 4 - 3];
+}
+
 // Determine minimum time needed to transmit a given number of bytes
 static double
 calculate_bittime(struct serialqueue *sq, uint32_t bytes)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
+    if (sq->serial_fd_type == SQT_CANFD) {
+        uint32_t arb_bits = 0, data_bits = 0;
+        while (bytes) {
+            uint32_t size = canfd_frame_len(bytes);
+            arb_bits += CANFD_ARB_BITS;
+            data_bits += size * 8 + CANFD_DATA_BITS(size);
+            bytes -= size < bytes ? size : bytes;
+        }
+        if (arb_bits)
+            arb_bits -= CANBUS_IFS_BITS;
+        return (sq->bittime_adjust * arb_bits
+                + sq->data_bittime_adjust * data_bits);
+    } else if (sq->serial_fd_type == SQT_CAN) {
         uint32_t pkts = DIV_ROUND_UP(bytes, 8);
         uint32_t bits = bytes * 8 + pkts * CANBUS_PACKET_BITS - CANBUS_IFS_BITS;
         return sq->bittime_adjust * bits;
+    } else if (sq->serial_fd_type == SQT_UDP) {
+        uint32_t pkts = DIV_ROUND_UP(bytes, UDP_MAX_PAYLOAD);
+        uint32_t wire_bytes = bytes + pkts * UDP_PACKET_BYTES;
+        if (wire_bytes < pkts * UDP_MIN_PACKET_BYTES)
+            wire_bytes = pkts * UDP_MIN_PACKET_BYTES;
+        return sq->bittime_adjust * wire_bytes * 8;
     } else {
         return sq->bittime_adjust * bytes;
     }
 }
 
+// Note that 'bytes' were written no earlier than 'start'
+static void
+update_idle_time(struct serialqueue *sq, double start, int bytes)
+{
+    double duration = calculate_bittime(sq, bytes);
+    if (sq->bus_node.cs)
+        sq->idle_time = canbus_sched_reserve(&sq->bus_node, start, duration
+                                             , bytes);
+    else
+        sq->idle_time = start + duration;
+}
+
+// Return the maximum number of message blocks awaiting an ack
+static int
+get_window_blocks(struct serialqueue *sq)
+{
+    int window_blocks = MAX_PENDING_BLOCKS;
+    if (sq->adaptive_window)
+        window_blocks = sq->window_blocks;
+    // With selective acks, a retransmitted block must not be mistaken
+    // for one the mcu could store
+    int max_blocks = MAX_WINDOW_BLOCKS - sq->sack_blocks;
+    if (window_blocks > max_blocks)
+        window_blocks = max_blocks;
+    return window_blocks;
+}
+
+// Set the adaptive window size (in message blocks)
+static void
+set_window_blocks(struct serialqueue *sq, double window_blocks)
+{
+    if (window_blocks < MIN_WINDOW_BLOCKS)
+        window_blocks = MIN_WINDOW_BLOCKS;
+    else if (window_blocks > MAX_WINDOW_BLOCKS)
+        window_blocks = MAX_WINDOW_BLOCKS;
+    sq->window_blocks = window_blocks;
+}
+
+// Grow or shrink the adaptive window from an rtt sample.  This
+// follows the "TCP Vegas" approach - the number of blocks queued in
+// the transport (and mcu) is estimated from the increase of the rtt
+// over the minimum observed rtt.
+static void
+update_window(struct serialqueue *sq, double rtt)
+{
+    if (rtt < MIN_RTT_SAMPLE)
+        rtt = MIN_RTT_SAMPLE;
+    if (!sq->min_rtt || rtt < sq->min_rtt)
+        sq->min_rtt = rtt;
+    double queued = sq->window_blocks * (1. - sq->min_rtt / rtt);
+    if (queued < WINDOW_ALPHA)
+        set_window_blocks(sq, sq->window_blocks + 1.);
+    else if (queued > WINDOW_BETA)
+        set_window_blocks(sq, sq->window_blocks - 1.);
+}
+
 // Update internal state when the receive sequence increases
 static void
 update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
@@ -171,7 +482,8 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         }
         sq->need_ack_bytes -= sent->len;
         list_del(&sent->node);
-        debug_queue_add(&sq->old_sent, sent);
+        debug_queue_add(sq, &sq->old_sent, sent);
+        note_queued_msgs(sq, -1);
         sent_seq++;
         if (rseq == sent_seq) {
             // Found sent message corresponding with the received sequence
@@ -181,7 +493,7 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         }
     }
     sq->receive_seq = rseq;
-    pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
+    sq_update_timer(sq, SQPT_COMMAND, PR_NOW);
 
     // Update retransmit info
     if (sq->rtt_sample_seq && rseq > sq->rtt_sample_seq
@@ -204,27 +516,209 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         else if (sq->rto > MAX_RTO)
             sq->rto = MAX_RTO;
         sq->rtt_sample_seq = 0;
+        if (sq->adaptive_window)
+            update_window(sq, delta);
     }
     if (list_empty(&sq->sent_queue)) {
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NEVER);
+        sq_update_timer(sq, SQPT_RETRANSMIT, PR_NEVER);
     } else {
         struct queue_message *sent = list_first_entry(
             &sq->sent_queue, struct queue_message, node);
         double nr = eventtime + sq->rto + calculate_bittime(sq, sent->len);
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, nr);
+        sq_update_timer(sq, SQPT_RETRANSMIT, nr);
+    }
+}
+
+// Find a registered fastreader matching the current input message.
+// Only the first match is returned - each fastreader prefix is a
+// message id followed by an oid (and an oid has only one owner), so
+// no two fastreaders match the same message.
+static struct fastreader *
+find_fastreader(struct serialqueue *sq, uint8_t *buf, int len)
+{
+    struct fastreader *fr;
+    list_for_each_entry(fr, &sq->fast_readers, node) {
+        if (len >= fr->prefix_len + MESSAGE_MIN
+            && memcmp(&buf[MESSAGE_HEADER_SIZE]
+                      , fr->prefix, fr->prefix_len) == 0)
+            return fr;
     }
+    return NULL;
+}
+
+// Find a registered response handler matching a message
+static struct response_handler *
+find_response_handler(struct serialqueue *sq, uint8_t *msg, int len)
+{
+    struct response_handler *rh;
+    list_for_each_entry(rh, &sq->response_handlers, node) {
+        if (len >= rh->prefix_len + MESSAGE_MIN
+            && memcmp(&msg[MESSAGE_HEADER_SIZE], rh->prefix
+                      , rh->prefix_len) == 0)
+            return rh;
+    }
+    return NULL;
+}
+
+// Check if a received message should be merged into a previously
+// queued (and not yet pulled) message of a coalescing handler
+static int
+check_coalesce(struct serialqueue *sq, struct queue_message *qm)
+{
+    struct response_handler *rh = find_response_handler(sq, qm->msg, qm->len);
+    if (!rh || !rh->coalesce)
+        return 0;
+    copy_pull_message(&rh->latest, qm);
+    if (rh->pending)
+        return 1;
+    rh->pending = 1;
+    return 0;
 }
 
-// Process a well formed input message
+
+
+/****************************************************************
+ * Clock synchronization
+ ****************************************************************/
+
+// Add a sample of the mcu clock to the regression of mcu clock
+// against host send time (sq->lock must be held)
 static void
-handle_message(struct serialqueue *sq, double eventtime, int len)
+clock_sync_sample(struct serialqueue *sq, struct queue_message *qm)
+{
+    struct clock_sync_state *cs = &sq->cs;
+    // Check the encoded message id before decoding the message
+    int idlen = sq->clock_msgid_len;
+    if (qm->len <= MESSAGE_MIN + idlen
+        || memcmp(&qm->msg[MESSAGE_HEADER_SIZE], sq->clock_msgid, idlen))
+        return;
+    uint32_t data[2];
+    int ret = msgblock_decode(data, ARRAY_SIZE(data), qm->msg, qm->len);
+    if (ret)
+        return;
+    // Extend clock to 64bit
+    cs->last_clock += (uint32_t)(data[1] - cs->last_clock);
+    double clock = cs->last_clock, sent_time = qm->sent_time;
+    if (!sent_time)
+        return;
+    // Check if this is the best round-trip-time seen so far
+    double half_rtt = .5 * (qm->receive_time - sent_time);
+    double aged_rtt = (sent_time - cs->min_rtt_time) * CLOCK_RTT_AGE;
+    if (half_rtt < cs->min_half_rtt + aged_rtt) {
+        cs->min_half_rtt = half_rtt;
+        cs->min_rtt_time = sent_time;
+    }
+    // Filter out samples that are extreme outliers
+    double exp_clock = ((sent_time - cs->time_avg) * cs->est_freq
+                        + cs->clock_avg);
+    double clock_diff2 = (clock - exp_clock) * (clock - exp_clock);
+    double max_diff = .000500 * cs->mcu_freq;
+    if (clock_diff2 > 25. * cs->prediction_variance
+        && clock_diff2 > max_diff * max_diff) {
+        if (clock > exp_clock && sent_time < cs->last_prediction_time + 10.
+            && cs->sample_count >= CLOCK_WARMUP_SAMPLES)
+            return;
+        errorf("Resetting prediction variance %.3f: freq=%.0f diff=%.0f"
+               " stddev=%.3f", sent_time, cs->est_freq, clock - exp_clock
+               , sqrt(cs->prediction_variance));
+        double reset_diff = .001 * cs->mcu_freq;
+        cs->prediction_variance = reset_diff * reset_diff;
+    } else {
+        cs->last_prediction_time = sent_time;
+        cs->prediction_variance = ((1. - CLOCK_DECAY)
+                                   * (cs->prediction_variance
+                                      + clock_diff2 * CLOCK_DECAY));
+    }
+    // Add clock and sent_time to linear regression (the first samples
+    // are weighted equally so that the estimate converges quickly)
+    cs->sample_count++;
+    double decay = 1. / (cs->sample_count + 1);
+    if (decay < CLOCK_DECAY)
+        decay = CLOCK_DECAY;
+    double diff_sent_time = sent_time - cs->time_avg;
+    cs->time_avg += decay * diff_sent_time;
+    cs->time_variance = (1. - decay) * (
+        cs->time_variance + diff_sent_time * diff_sent_time * decay);
+    double diff_clock = clock - cs->clock_avg;
+    cs->clock_avg += decay * diff_clock;
+    cs->clock_covariance = (1. - decay) * (
+        cs->clock_covariance + diff_sent_time * diff_clock * decay);
+    // Update prediction from linear regression
+    cs->est_freq = cs->clock_covariance / cs->time_variance;
+    double pred_stddev = sqrt(cs->prediction_variance);
+    sq->ce.est_freq = cs->est_freq;
+    sq->ce.conv_time = cs->time_avg + CLOCK_TRANSMIT_EXTRA;
+    sq->ce.conv_clock = (uint64_t)(cs->clock_avg - 3. * pred_stddev);
+    sq->ce.last_clock = cs->last_clock;
+}
+
+// Return the stats index of the message id at the start of an
+// encoded message (or -1)
+static int
+parse_msgid_index(uint8_t *p, int len)
+{
+    if (len <= 0)
+        return -1;
+    int msgid = p[0] & 0x7f;
+    if ((p[0] & 0x60) == 0x60)
+        msgid |= -0x20;
+    if (p[0] & 0x80) {
+        if (len < 2 || p[1] & 0x80)
+            return -1;
+        msgid = (msgid << 7) | p[1];
+    }
+    int index = msgid - MSGID_STATS_MIN;
+    if (index < 0 || index >= MSGID_STATS_MAX)
+        return -1;
+    return index;
+}
+
+// Account for the bytes of a message sent or received (sq->lock
+// must be held)
+static void
+note_msgid_stats(struct serialqueue *sq, uint8_t *msg, int len, int is_send)
+{
+    int index = parse_msgid_index(msg, len);
+    if (index < 0)
+        return;
+    struct serialqueue_msgid_stats *ms = &sq->msgid_stats[index];
+    if (is_send) {
+        ms->send_msgs++;
+        ms->send_bytes += len;
+    } else {
+        ms->receive_msgs++;
+        ms->receive_bytes += len;
+    }
+}
+
+// Check if an input message is a "selective_ack" response
+static int
+is_selective_ack(struct serialqueue *sq, uint8_t *buf, int len)
+{
+    int plen = sq->sack_prefix_len;
+    if (!plen || len != MESSAGE_MIN + plen + 1)
+        return 0;
+    uint8_t *p = &buf[MESSAGE_HEADER_SIZE];
+    // Only the single byte encoding of the mask is expected
+    return !memcmp(p, sq->sack_prefix, plen) && p[plen] < 0x60;
+}
+
+// Process a well formed input message.  Message blocks received on
+// the canbus bulk data id may arrive out of order with the other
+// blocks, so their sequence number (acknowledgment) is ignored.
+static void
+handle_message(struct serialqueue *sq, double eventtime, uint8_t *buf
+               , int len, int is_bulk)
 {
     pthread_mutex_lock(&sq->lock);
 
     // Calculate receive sequence number
-    uint32_t rseq_delta = ((sq->input_buf[MESSAGE_POS_SEQ] - sq->receive_seq)
-                           & MESSAGE_SEQ_MASK);
-    uint64_t rseq = sq->receive_seq + rseq_delta;
+    uint64_t rseq = sq->receive_seq;
+    if (!is_bulk) {
+        uint32_t rseq_delta = ((buf[MESSAGE_POS_SEQ] - sq->receive_seq)
+                               & MESSAGE_SEQ_MASK);
+        rseq += rseq_delta;
+    }
     if (rseq != sq->receive_seq) {
         // New sequence number
         if (rseq > sq->send_seq && sq->receive_seq != 1) {
@@ -239,7 +733,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
 
     // Check for pending messages on notify_queue
     int must_wake = 0;
-    while (!list_empty(&sq->notify_queue)) {
+    while (!is_bulk && !list_empty(&sq->notify_queue)) {
         struct queue_message *qm = list_first_entry(
             &sq->notify_queue, struct queue_message, node);
         uint64_t wake_seq = rseq - 1 - (len > MESSAGE_MIN ? 1 : 0);
@@ -250,42 +744,54 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_queue_add(sq, qm);
+        message_pool_free(&sq->msg_pool, qm);
+        note_queued_msgs(sq, -1);
         must_wake = 1;
     }
 
     // Process message
-    if (len == MESSAGE_MIN) {
+    struct fastreader *fr = find_fastreader(sq, buf, len);
+    if (!is_bulk && is_selective_ack(sq, buf, len)) {
+        // Report of blocks stored by the mcu - retransmit the others
+        sq->sack_seq = rseq;
+        sq->sack_mask = buf[MESSAGE_HEADER_SIZE + sq->sack_prefix_len];
+        if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
+            sq_update_timer(sq, SQPT_RETRANSMIT, PR_NOW);
+    } else if (!is_bulk && len == MESSAGE_MIN) {
         // Ack/nak message
         if (sq->last_ack_seq < rseq)
             sq->last_ack_seq = rseq;
         else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
             // Duplicate Ack is a Nak - do fast retransmit
-            pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
+            sq_update_timer(sq, SQPT_RETRANSMIT, PR_NOW);
     } else {
-        // Data message - add to receive queue
-        struct queue_message *qm = message_fill(sq->input_buf, len);
+        // Data message - store in debug queue and add to receive queue
+        note_msgid_stats(sq, &buf[MESSAGE_HEADER_SIZE], len - MESSAGE_MIN, 0);
+        struct queue_message *qm = debug_queue_next(&sq->old_receive);
+        memcpy(qm->msg, buf, len);
+        qm->len = len;
         qm->sent_time = (rseq > sq->retransmit_seq
                          ? sq->last_receive_sent_time : 0.);
         qm->receive_time = get_monotonic(); // must be time post read()
         qm->receive_time -= calculate_bittime(sq, len);
-        list_add_tail(&qm->node, &sq->receive_queue);
-        must_wake = 1;
+        qm->notify_id = 0;
+        if (sq->cs.mcu_freq)
+            clock_sync_sample(sq, qm);
+        if ((!fr || !fr->consume) && !check_coalesce(sq, qm)) {
+            receive_queue_add(sq, qm);
+            must_wake = 1;
+        }
     }
 
-    // Check fast readers
-    struct fastreader *fr;
-    list_for_each_entry(fr, &sq->fast_readers, node) {
-        if (len < fr->prefix_len + MESSAGE_MIN
-            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
-                      , fr->prefix, fr->prefix_len) != 0)
-            continue;
+    // Invoke fast reader
+    if (fr) {
         // Release main lock and invoke callback
         pthread_mutex_lock(&sq->fast_reader_dispatch_lock);
         if (must_wake)
             check_wake_receive(sq);
         pthread_mutex_unlock(&sq->lock);
-        fr->func(fr, sq->input_buf, len);
+        fr->func(fr, buf, len);
         pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
         return;
     }
@@ -295,22 +801,78 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Process the message blocks in an input buffer
+static void
+process_input(struct serialqueue *sq, double eventtime, uint8_t *buf
+              , int *pinput_pos, uint8_t *pneed_sync, int is_bulk)
+{
+    for (;;) {
+        int len = msgblock_check(pneed_sync, buf, *pinput_pos);
+        if (!len) {
+            if (sq->serial_fd_type == SQT_UDP) {
+                // Message blocks never span datagrams - discard the rest
+                pthread_mutex_lock(&sq->lock);
+                sq->bytes_invalid += *pinput_pos;
+                pthread_mutex_unlock(&sq->lock);
+                *pinput_pos = *pneed_sync = 0;
+            }
+            // Need more data
+            return;
+        }
+        if (len > 0) {
+            // Received a valid message
+            handle_message(sq, eventtime, buf, len, is_bulk);
+        } else {
+            // Skip bad data at beginning of input
+            len = -len;
+            if (len > 1 || buf[0] != MESSAGE_SYNC) {
+                pthread_mutex_lock(&sq->lock);
+                sq->bytes_invalid += len;
+                pthread_mutex_unlock(&sq->lock);
+            }
+        }
+        *pinput_pos -= len;
+        if (*pinput_pos)
+            memmove(buf, &buf[len], *pinput_pos);
+    }
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
-        struct can_frame cf;
+    if (is_canbus(sq)) {
+        // A canfd_frame also holds classic frames (can_dlc is at 'len')
+        struct canfd_frame cf;
         int ret = read(sq->serial_fd, &cf, sizeof(cf));
         if (ret <= 0) {
             report_errno("can read", ret);
-            pollreactor_do_exit(sq->pr);
+            sq_do_exit(sq);
+            return;
+        }
+        if (cf.len > CANFD_MAX_DLEN)
+            return;
+        if (cf.can_id == sq->client_id + 1 + CANBUS_ID_BULK_OFFSET) {
+            // Bulk data is reassembled separately from other messages
+            memcpy(&sq->bulk_input_buf[sq->bulk_input_pos], cf.data, cf.len);
+            sq->bulk_input_pos += cf.len;
+            process_input(sq, eventtime, sq->bulk_input_buf
+                          , &sq->bulk_input_pos, &sq->bulk_need_sync, 1);
             return;
         }
         if (cf.can_id != sq->client_id + 1)
             return;
-        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.can_dlc);
-        sq->input_pos += cf.can_dlc;
+        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.len);
+        sq->input_pos += cf.len;
+    } else if (sq->serial_fd_type == SQT_UDP) {
+        int ret = read(sq->serial_fd, sq->input_buf, sizeof(sq->input_buf));
+        if (ret < 0) {
+            // A refused connection is reported if the mcu isn't running
+            if (errno != ECONNREFUSED && errno != EAGAIN)
+                report_errno("udp read", ret);
+            return;
+        }
+        sq->input_pos = ret;
     } else {
         int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
                        , sizeof(sq->input_buf) - sq->input_pos);
@@ -319,30 +881,13 @@ input_event(struct serialqueue *sq, double eventtime)
                 report_errno("read", ret);
             else
                 errorf("Got EOF when reading from device");
-            pollreactor_do_exit(sq->pr);
+            sq_do_exit(sq);
             return;
         }
         sq->input_pos += ret;
     }
-    for (;;) {
-        int len = msgblock_check(&sq->need_sync, sq->input_buf, sq->input_pos);
-        if (!len)
-            // Need more data
-            return;
-        if (len > 0) {
-            // Received a valid message
-            handle_message(sq, eventtime, len);
-        } else {
-            // Skip bad data at beginning of input
-            len = -len;
-            pthread_mutex_lock(&sq->lock);
-            sq->bytes_invalid += len;
-            pthread_mutex_unlock(&sq->lock);
-        }
-        sq->input_pos -= len;
-        if (sq->input_pos)
-            memmove(sq->input_buf, &sq->input_buf[len], sq->input_pos);
-    }
+    process_input(sq, eventtime, sq->input_buf, &sq->input_pos
+                  , &sq->need_sync, 0);
 }
 
 // Callback for input activity on the pipe fd (wakes command_event)
@@ -353,27 +898,38 @@ kick_event(struct serialqueue *sq, double eventtime)
     int ret = read(sq->pipe_fds[0], dummy, sizeof(dummy));
     if (ret < 0)
         report_errno("pipe read", ret);
-    pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
+    sq_update_timer(sq, SQPT_COMMAND, PR_NOW);
 }
 
 // OS write of data to be sent to the mcu
 static void
 do_write(struct serialqueue *sq, void *buf, int buflen)
 {
-    if (sq->serial_fd_type != SQT_CAN) {
+    if (!is_canbus(sq)) {
+        // Each write to a udp socket is sent as a single datagram
         int ret = write(sq->serial_fd, buf, buflen);
-        if (ret < 0)
+        if (ret < 0 && !(sq->serial_fd_type == SQT_UDP
+                         && errno == ECONNREFUSED))
             report_errno("write", ret);
         return;
     }
     // Write to CAN fd
-    struct can_frame cf;
+    int is_fd = sq->serial_fd_type == SQT_CANFD;
+    struct canfd_frame cf;
+    memset(&cf, 0, sizeof(cf));
     while (buflen) {
-        int size = buflen > 8 ? 8 : buflen;
+        int size = buflen > 8 ? 8 : buflen, frame_size = size;
+        if (is_fd) {
+            // Pad the frame to a valid size (leading syncs are ignored)
+            frame_size = canfd_frame_len(buflen);
+            size = buflen < frame_size ? buflen : frame_size;
+            memset(&cf.data[size], MESSAGE_SYNC, frame_size - size);
+        }
         cf.can_id = sq->client_id;
-        cf.can_dlc = size;
+        cf.len = frame_size;
+        cf.flags = is_fd ? CANFD_BRS : 0;
         memcpy(cf.data, buf, size);
-        int ret = write(sq->serial_fd, &cf, sizeof(cf));
+        int ret = write(sq->serial_fd, &cf, is_fd ? CANFD_MTU : CAN_MTU);
         if (ret < 0) {
             report_errno("can write", ret);
             double curtime = get_monotonic();
@@ -381,7 +937,7 @@ do_write(struct serialqueue *sq, void *buf, int buflen)
                 sq->last_write_fail_time = curtime;
             } else if (curtime > sq->last_write_fail_time + 10.0) {
                 errorf("Halting reads due to CAN write errors.");
-                pollreactor_do_exit(sq->pr);
+                sq_do_exit(sq);
             }
             return;
         }
@@ -403,12 +959,19 @@ retransmit_event(struct serialqueue *sq, double eventtime)
 
     pthread_mutex_lock(&sq->lock);
 
-    // Retransmit all pending messages
-    uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS + 1];
-    int buflen = 0, first_buflen = 0;
+    // Retransmit all pending messages (except those that the mcu
+    // reported as stored when this is a retransmit due to a nak)
+    int is_nak = sq_get_timer(sq, SQPT_RETRANSMIT) == PR_NOW;
+    int sack_mask = 0;
+    if (is_nak && sq->sack_prefix_len && sq->sack_seq == sq->receive_seq)
+        sack_mask = sq->sack_mask;
+    uint8_t buf[MESSAGE_MAX * MAX_WINDOW_BLOCKS + 1];
+    int buflen = 0, first_buflen = 0, pos = 0;
     buf[buflen++] = MESSAGE_SYNC;
     struct queue_message *qm;
     list_for_each_entry(qm, &sq->sent_queue, node) {
+        if (pos < 8 * (int)sizeof(sack_mask) && sack_mask & (1 << pos++))
+            continue;
         memcpy(&buf[buflen], qm->msg, qm->len);
         buflen += qm->len;
         if (!first_buflen)
@@ -418,72 +981,119 @@ retransmit_event(struct serialqueue *sq, double eventtime)
     sq->bytes_retransmit += buflen;
 
     // Update rto
-    if (pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW) {
+    if (is_nak) {
         // Retransmit due to nak
         sq->ignore_nak_seq = sq->receive_seq;
         if (sq->receive_seq < sq->retransmit_seq)
             // Second nak for this retransmit - don't allow third
             sq->ignore_nak_seq = sq->retransmit_seq;
+        set_window_blocks(sq, sq->window_blocks / 2.);
     } else {
         // Retransmit due to timeout
         sq->rto *= 2.0;
         if (sq->rto > MAX_RTO)
             sq->rto = MAX_RTO;
         sq->ignore_nak_seq = sq->send_seq;
+        set_window_blocks(sq, MIN_WINDOW_BLOCKS);
+        sq->min_rtt = 0.;
     }
     sq->retransmit_seq = sq->send_seq;
     sq->rtt_sample_seq = 0;
-    sq->idle_time = eventtime + calculate_bittime(sq, buflen);
+    update_idle_time(sq, eventtime, buflen);
     double waketime = eventtime + sq->rto + calculate_bittime(sq, first_buflen);
 
     pthread_mutex_unlock(&sq->lock);
     return waketime;
 }
 
+// Find the next message to transmit - the first message in the
+// highest priority queue with the lowest req_clock.  When 'max_clock'
+// is set, only messages that fit in 'avail' bytes and are needed by
+// 'max_clock' (or are background messages) are considered.
+static struct queue_message *
+find_next_message(struct serialqueue *sq, uint64_t max_clock, int avail
+                  , struct command_queue **pcq)
+{
+    uint64_t min_clock = MAX_CLOCK;
+    int max_priority = -1;
+    struct command_queue *q;
+    struct queue_message *qm = NULL;
+    list_for_each_entry(q, &sq->pending_queues, node) {
+        if (list_empty(&q->ready_queue))
+            continue;
+        struct queue_message *m = list_first_entry(
+            &q->ready_queue, struct queue_message, node);
+        if (max_clock != MAX_CLOCK) {
+            if (m->len > avail)
+                continue;
+            if (m->req_clock > max_clock
+                && m->req_clock != BACKGROUND_PRIORITY_CLOCK)
+                continue;
+        }
+        if (q->priority > max_priority
+            || (q->priority == max_priority && m->req_clock < min_clock)) {
+            max_priority = q->priority;
+            min_clock = m->req_clock;
+            *pcq = q;
+            qm = m;
+        }
+    }
+    return qm;
+}
+
 // Construct a block of data to be sent to the serial port
 static int
 build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
                        , double eventtime)
 {
     int len = MESSAGE_HEADER_SIZE;
+    uint64_t max_clock = MAX_CLOCK;
     while (sq->ready_bytes) {
-        // Find highest priority message (message with lowest req_clock)
-        uint64_t min_clock = MAX_CLOCK;
-        struct command_queue *q, *cq = NULL;
-        struct queue_message *qm = NULL;
-        list_for_each_entry(q, &sq->pending_queues, node) {
-            if (!list_empty(&q->ready_queue)) {
-                struct queue_message *m = list_first_entry(
-                    &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
-                    min_clock = m->req_clock;
-                    cq = q;
-                    qm = m;
-                }
-            }
-        }
-        // Append message to outgoing command
-        if (len + qm->len > MESSAGE_MAX - MESSAGE_TRAILER_SIZE)
+        struct command_queue *cq;
+        struct queue_message *qm = find_next_message(
+            sq, max_clock, MESSAGE_MAX - MESSAGE_TRAILER_SIZE - len, &cq);
+        if (!qm)
             break;
+        if (len + qm->len > MESSAGE_MAX - MESSAGE_TRAILER_SIZE) {
+            // Fill the rest of the block with messages needed soon
+            if (max_clock != MAX_CLOCK || !sq->ce.est_freq)
+                break;
+            max_clock = qm->req_clock + PACK_HORIZON * sq->ce.est_freq;
+            continue;
+        }
         list_del(&qm->node);
         if (list_empty(&cq->ready_queue) && list_empty(&cq->upcoming_queue))
             list_del(&cq->node);
         memcpy(&buf[len], qm->msg, qm->len);
         len += qm->len;
         sq->ready_bytes -= qm->len;
+        note_msgid_stats(sq, qm->msg, qm->len, 1);
+        // Track the time messages of each priority class were ready
+        // but not yet sent
+        double delay = eventtime - qm->ready_time;
+        sq->class_msgs[cq->priority]++;
+        sq->class_delay[cq->priority] += delay;
+        if (delay > sq->class_max_delay[cq->priority])
+            sq->class_max_delay[cq->priority] = delay;
         if (qm->notify_id) {
             // Message requires notification - add to notify list
             qm->req_clock = sq->send_seq;
             list_add_tail(&qm->node, &sq->notify_queue);
         } else {
-            message_free(qm);
+            message_pool_free(&sq->msg_pool, qm);
+            note_queued_msgs(sq, -1);
         }
     }
 
+    sq->send_blocks++;
+    sq->send_payload_bytes += len - MESSAGE_HEADER_SIZE;
+
     // Fill header / trailer
     len += MESSAGE_TRAILER_SIZE;
     buf[MESSAGE_POS_LEN] = len;
     buf[MESSAGE_POS_SEQ] = MESSAGE_DEST | (sq->send_seq & MESSAGE_SEQ_MASK);
+    if (sq->sack_prefix_len)
+        buf[MESSAGE_POS_SEQ] |= MESSAGE_SEQ_SACK;
     uint16_t crc = msgblock_crc16_ccitt(buf, len - MESSAGE_TRAILER_SIZE);
     buf[len - MESSAGE_TRAILER_CRC] = crc >> 8;
     buf[len - MESSAGE_TRAILER_CRC+1] = crc & 0xff;
@@ -492,26 +1102,29 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     // Store message block
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
     idletime += calculate_bittime(sq, pending + len);
-    struct queue_message *out = message_alloc();
+    struct queue_message *out = message_pool_alloc(&sq->msg_pool);
     memcpy(out->msg, buf, len);
     out->len = len;
     out->sent_time = eventtime;
     out->receive_time = idletime;
     if (list_empty(&sq->sent_queue))
-        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, idletime + sq->rto);
+        sq_update_timer(sq, SQPT_RETRANSMIT, idletime + sq->rto);
     if (!sq->rtt_sample_seq)
         sq->rtt_sample_seq = sq->send_seq;
     sq->send_seq++;
     sq->need_ack_bytes += len;
     list_add_tail(&out->node, &sq->sent_queue);
+    note_queued_msgs(sq, 1);
     return len;
 }
 
-// Determine the time the next serial data should be sent
+// Determine the time the next serial data should be sent (and the
+// time by which ready data is needed if it should be sent now)
 static double
-check_send_command(struct serialqueue *sq, int pending, double eventtime)
+check_send_ready(struct serialqueue *sq, int pending, double eventtime
+                 , double *pdeadline)
 {
-    if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS
+    if (sq->send_seq - sq->receive_seq >= get_window_blocks(sq)
         && sq->receive_seq != (uint64_t)-1)
         // Need an ack before more messages can be sent
         return PR_NEVER;
@@ -529,6 +1142,7 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     idletime += calculate_bittime(sq, pending + MESSAGE_MIN);
     uint64_t ack_clock = clock_from_time(&sq->ce, idletime);
     uint64_t min_stalled_clock = MAX_CLOCK, min_ready_clock = MAX_CLOCK;
+    int have_urgent = 0;
     struct command_queue *cq;
     list_for_each_entry(cq, &sq->pending_queues, node) {
         // Move messages from the upcoming_queue to the ready_queue
@@ -541,12 +1155,17 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
                 break;
             }
             list_del(&qm->node);
+            qm->ready_time = eventtime;
             list_add_tail(&qm->node, &cq->ready_queue);
             sq->upcoming_bytes -= qm->len;
             sq->ready_bytes += qm->len;
         }
         // Update min_ready_clock
         if (!list_empty(&cq->ready_queue)) {
+            if (cq->priority > SQ_PRIORITY_NORMAL) {
+                have_urgent = 1;
+                continue;
+            }
             struct queue_message *qm = list_first_entry(
                 &cq->ready_queue, struct queue_message, node);
             uint64_t req_clock = qm->req_clock;
@@ -560,17 +1179,24 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     }
 
     // Check for messages to send
-    if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX)
+    if (have_urgent) {
+        *pdeadline = 0.;
         return PR_NOW;
+    }
     if (! sq->ce.est_freq) {
-        if (sq->ready_bytes)
+        if (sq->ready_bytes) {
+            *pdeadline = eventtime;
             return PR_NOW;
+        }
         sq->need_kick_clock = MAX_CLOCK;
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->ce.est_freq;
-    if (min_ready_clock <= ack_clock + reqclock_delta)
+    if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX
+        || min_ready_clock <= ack_clock + reqclock_delta) {
+        *pdeadline = clock_to_time(&sq->ce, min_ready_clock);
         return PR_NOW;
+    }
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
@@ -578,12 +1204,38 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
     return idletime + (wantclock - ack_clock) / sq->ce.est_freq;
 }
 
+// Determine the time the next serial data should be sent, taking
+// other users of a shared CAN bus into account
+static double
+check_send_command(struct serialqueue *sq, int pending, double eventtime)
+{
+    double deadline = PR_NEVER;
+    double waketime = check_send_ready(sq, pending, eventtime, &deadline);
+    if (!sq->bus_node.cs)
+        return waketime;
+    if (waketime != PR_NOW)
+        deadline = PR_NEVER;
+    double buswait = canbus_sched_check(&sq->bus_node, eventtime, deadline);
+    if (waketime == PR_NOW && buswait) {
+        // Recheck immediately if new messages are queued
+        sq->need_kick_clock = 0;
+        return buswait;
+    }
+    return waketime;
+}
+
 // Callback timer to send data to the serial port
 static double
 command_event(struct serialqueue *sq, double eventtime)
 {
     pthread_mutex_lock(&sq->lock);
-    uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS];
+    if (sq->bus_node.cs) {
+        // Account for data sent by other users of a shared bus
+        double bus_idle_time = canbus_sched_idle_time(&sq->bus_node);
+        if (bus_idle_time > sq->idle_time)
+            sq->idle_time = bus_idle_time;
+    }
+    uint8_t buf[MESSAGE_MAX * MAX_WINDOW_BLOCKS];
     int buflen = 0;
     double waketime;
     for (;;) {
@@ -595,7 +1247,7 @@ command_event(struct serialqueue *sq, double eventtime)
                 sq->bytes_write += buflen;
                 double idletime = (eventtime > sq->idle_time
                                    ? eventtime : sq->idle_time);
-                sq->idle_time = idletime + calculate_bittime(sq, buflen);
+                update_idle_time(sq, idletime, buflen);
                 buflen = 0;
             }
             if (waketime != PR_NOW)
@@ -607,11 +1259,39 @@ command_event(struct serialqueue *sq, double eventtime)
     return waketime;
 }
 
+// Register the serial fd, pipe fd, and timers with the pollreactor
+static void
+sq_add_events(struct serialqueue *sq)
+{
+    struct pollreactor *pr = sq->pr;
+    pollreactor_add_fd(pr, sq->pr_fd_base + SQPF_SERIAL, sq->serial_fd
+                       , input_event, sq, sq->serial_fd_type==SQT_DEBUGFILE);
+    pollreactor_add_fd(pr, sq->pr_fd_base + SQPF_PIPE, sq->pipe_fds[0]
+                       , kick_event, sq, 0);
+    pollreactor_add_timer(pr, sq->pr_timer_base + SQPT_RETRANSMIT
+                          , retransmit_event, sq);
+    pollreactor_add_timer(pr, sq->pr_timer_base + SQPT_COMMAND
+                          , command_event, sq);
+}
+
+// Remove the fds and timers of a serialqueue from its pollreactor
+static void
+sq_remove_events(struct serialqueue *sq)
+{
+    struct pollreactor *pr = sq->pr;
+    pollreactor_remove_fd(pr, sq->pr_fd_base + SQPF_SERIAL);
+    pollreactor_remove_fd(pr, sq->pr_fd_base + SQPF_PIPE);
+    pollreactor_remove_timer(pr, sq->pr_timer_base + SQPT_RETRANSMIT);
+    pollreactor_remove_timer(pr, sq->pr_timer_base + SQPT_COMMAND);
+}
+
 // Main background thread for reading/writing to serial port
 static void *
 background_thread(void *data)
 {
     struct serialqueue *sq = data;
+    if (sq->sched_priority || sq->sched_cpu_mask)
+        set_thread_scheduling(sq->sched_priority, sq->sched_cpu_mask);
     pollreactor_run(sq->pr);
 
     pthread_mutex_lock(&sq->lock);
@@ -621,27 +1301,212 @@ background_thread(void *data)
     return NULL;
 }
 
-// Create a new 'struct serialqueue' object
-struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+
+/****************************************************************
+ * Shared background thread
+ ****************************************************************/
+
+// Wake the shared thread to process attach and detach requests
+static void
+sqthread_kick(struct serialqueue_thread *st)
+{
+    int ret = write(st->pipe_fds[1], ".", 1);
+    if (ret < 0)
+        report_errno("pipe write", ret);
+}
+
+// Callback for input activity on the shared thread's pipe fd
+static void
+sqthread_kick_event(struct serialqueue_thread *st, double eventtime)
+{
+    char dummy[4096];
+    int ret = read(st->pipe_fds[0], dummy, sizeof(dummy));
+    if (ret < 0)
+        report_errno("pipe read", ret);
+    pollreactor_update_timer(st->pr, SQTT_CONTROL, PR_NOW);
+}
+
+// Mark a serialqueue as detached from the shared thread (caller must
+// hold st->lock)
+static void
+sqthread_detach(struct serialqueue_thread *st, struct serialqueue *sq)
+{
+    st->slots[sq->st_slot] = NULL;
+    sq->st_state = SQTS_DONE;
+    sq->must_exit = 1;
+    pthread_mutex_lock(&sq->lock);
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Timer callback that adds and removes the events of serialqueues.
+// The pollreactor is only modified from the shared thread itself.
+static double
+sqthread_control_event(struct serialqueue_thread *st, double eventtime)
+{
+    pthread_mutex_lock(&st->lock);
+    int i;
+    for (i=0; i<SQTHREAD_MAX; i++) {
+        struct serialqueue *sq = st->slots[i];
+        if (!sq)
+            continue;
+        if (sq->st_state == SQTS_ATTACH) {
+            sq_add_events(sq);
+            sq->st_state = SQTS_ACTIVE;
+            sq_update_timer(sq, SQPT_COMMAND, PR_NOW);
+        } else if (sq->must_exit) {
+            sq_remove_events(sq);
+            sqthread_detach(st, sq);
+        }
+    }
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    return PR_NEVER;
+}
+
+// Main loop of a shared background thread
+static void *
+sqthread_background(void *data)
+{
+    struct serialqueue_thread *st = data;
+    if (st->sched_priority || st->sched_cpu_mask)
+        set_thread_scheduling(st->sched_priority, st->sched_cpu_mask);
+    pollreactor_run(st->pr);
+
+    // Stop any serialqueues still using the thread
+    pthread_mutex_lock(&st->lock);
+    int i;
+    for (i=0; i<SQTHREAD_MAX; i++)
+        if (st->slots[i])
+            sqthread_detach(st, st->slots[i]);
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+// Add a serialqueue to a shared thread
+static int
+sqthread_attach(struct serialqueue_thread *st, struct serialqueue *sq)
+{
+    pthread_mutex_lock(&st->lock);
+    int slot;
+    for (slot=0; slot<SQTHREAD_MAX; slot++)
+        if (!st->slots[slot])
+            break;
+    if (slot >= SQTHREAD_MAX || pollreactor_is_exit(st->pr)) {
+        pthread_mutex_unlock(&st->lock);
+        errorf("No space for serialqueue on shared thread");
+        return -1;
+    }
+    st->slots[slot] = sq;
+    st->refcount++;
+    sq->st = st;
+    sq->st_slot = slot;
+    sq->st_state = SQTS_ATTACH;
+    sq->pr = st->pr;
+    sq->pr_fd_base = SQTF_NUM + slot * SQPF_NUM;
+    sq->pr_timer_base = SQTT_NUM + slot * SQPT_NUM;
+    pthread_mutex_unlock(&st->lock);
+    sqthread_kick(st);
+    return 0;
+}
+
+// Release a reference to a shared thread (stopping it on last use)
+static void
+sqthread_put(struct serialqueue_thread *st)
+{
+    pthread_mutex_lock(&st->lock);
+    int refcount = --st->refcount;
+    pthread_mutex_unlock(&st->lock);
+    if (refcount)
+        return;
+    pollreactor_do_exit(st->pr);
+    sqthread_kick(st);
+    int ret = pthread_join(st->tid, NULL);
+    if (ret)
+        report_errno("pthread_join", ret);
+    pollreactor_free(st->pr);
+    close(st->pipe_fds[0]);
+    close(st->pipe_fds[1]);
+    free(st);
+}
+
+// Create a background thread that may be shared by several
+// serialqueues (see serialqueue_alloc_shared())
+struct serialqueue_thread * __visible
+serialqueue_thread_alloc(int sched_priority, uint64_t sched_cpu_mask)
+{
+    struct serialqueue_thread *st = malloc(sizeof(*st));
+    memset(st, 0, sizeof(*st));
+    st->sched_priority = sched_priority;
+    st->sched_cpu_mask = sched_cpu_mask;
+    st->refcount = 1;
+
+    int ret = pipe(st->pipe_fds);
+    if (ret)
+        goto fail;
+    fd_set_non_blocking(st->pipe_fds[0]);
+    fd_set_non_blocking(st->pipe_fds[1]);
+    st->pr = pollreactor_alloc(SQTF_NUM + SQTHREAD_MAX * SQPF_NUM
+                               , SQTT_NUM + SQTHREAD_MAX * SQPT_NUM);
+    pollreactor_add_fd(st->pr, SQTF_PIPE, st->pipe_fds[0]
+                       , sqthread_kick_event, st, 0);
+    pollreactor_add_timer(st->pr, SQTT_CONTROL, sqthread_control_event, st);
+
+    ret = pthread_mutex_init(&st->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&st->cond, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_create(&st->tid, NULL, sqthread_background, st);
+    if (ret)
+        goto fail;
+
+    return st;
+
+fail:
+    report_errno("init", ret);
+    return NULL;
+}
+
+// Release the caller's reference to a shared thread.  The thread
+// exits once all its serialqueues have also been freed.
+void __visible
+serialqueue_thread_free(struct serialqueue_thread *st)
+{
+    if (!st)
+        return;
+    sqthread_put(st);
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// Allocate a new 'struct serialqueue' (using a shared thread if 'st'
+// is not NULL)
+static struct serialqueue *
+sq_alloc(int serial_fd, char serial_fd_type, int client_id
+         , int sched_priority, uint64_t sched_cpu_mask
+         , struct serialqueue_thread *st)
 {
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
     sq->serial_fd = serial_fd;
     sq->serial_fd_type = serial_fd_type;
     sq->client_id = client_id;
+    sq->sched_priority = sched_priority;
+    sq->sched_cpu_mask = sched_cpu_mask;
+    sq->wake_fd = -1;
 
     int ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
 
     // Reactor setup
-    sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
-    pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
-                       , serial_fd_type==SQT_DEBUGFILE);
-    pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
-    pollreactor_add_timer(sq->pr, SQPT_RETRANSMIT, retransmit_event);
-    pollreactor_add_timer(sq->pr, SQPT_COMMAND, command_event);
     fd_set_non_blocking(serial_fd);
     fd_set_non_blocking(sq->pipe_fds[0]);
     fd_set_non_blocking(sq->pipe_fds[1]);
@@ -656,20 +1521,25 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
         sq->receive_seq = 1;
         sq->rto = MIN_RTO;
     }
+    sq->window_blocks = MAX_PENDING_BLOCKS;
 
     // Queues
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
     list_init(&sq->sent_queue);
+    sq->receive_ring = malloc(sizeof(*sq->receive_ring) * RECEIVE_RING_SIZE);
+    sq->msgid_stats = calloc(MSGID_STATS_MAX, sizeof(*sq->msgid_stats));
     list_init(&sq->receive_queue);
     list_init(&sq->notify_queue);
     list_init(&sq->fast_readers);
+    list_init(&sq->response_handlers);
 
     // Debugging
     list_init(&sq->old_sent);
     list_init(&sq->old_receive);
-    debug_queue_alloc(&sq->old_sent, DEBUG_QUEUE_SENT);
-    debug_queue_alloc(&sq->old_receive, DEBUG_QUEUE_RECEIVE);
+    debug_queue_alloc(NULL, &sq->old_sent, DEBUG_QUEUE_SENT);
+    debug_queue_alloc(NULL, &sq->old_receive, DEBUG_QUEUE_RECEIVE);
+    message_pool_init(&sq->msg_pool);
 
     // Thread setup
     ret = pthread_mutex_init(&sq->lock, NULL);
@@ -681,6 +1551,13 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     ret = pthread_mutex_init(&sq->fast_reader_dispatch_lock, NULL);
     if (ret)
         goto fail;
+    if (st) {
+        if (sqthread_attach(st, sq))
+            return NULL;
+        return sq;
+    }
+    sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM);
+    sq_add_events(sq);
     ret = pthread_create(&sq->tid, NULL, background_thread, sq);
     if (ret)
         goto fail;
@@ -692,15 +1569,65 @@ fail:
     return NULL;
 }
 
+// Create a new 'struct serialqueue' object
+struct serialqueue * __visible
+serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id
+                  , int sched_priority, uint64_t sched_cpu_mask)
+{
+    return sq_alloc(serial_fd, serial_fd_type, client_id
+                    , sched_priority, sched_cpu_mask, NULL);
+}
+
+// Create a new 'struct serialqueue' object that is serviced by the
+// given shared background thread
+struct serialqueue * __visible
+serialqueue_alloc_shared(int serial_fd, char serial_fd_type, int client_id
+                         , struct serialqueue_thread *st)
+{
+    return sq_alloc(serial_fd, serial_fd_type, client_id, 0, 0, st);
+}
+
 // Request that the background thread exit
 void __visible
 serialqueue_exit(struct serialqueue *sq)
 {
-    pollreactor_do_exit(sq->pr);
-    kick_bg_thread(sq);
-    int ret = pthread_join(sq->tid, NULL);
-    if (ret)
-        report_errno("pthread_join", ret);
+    struct serialqueue_thread *st = sq->st;
+    if (st) {
+        // Wait for the shared thread to remove this serialqueue
+        pthread_mutex_lock(&st->lock);
+        sq->must_exit = 1;
+        if (sq->st_state == SQTS_ATTACH)
+            sqthread_detach(st, sq);
+        else if (sq->st_state == SQTS_ACTIVE)
+            sqthread_kick(st);
+        while (sq->st_state != SQTS_DONE) {
+            int ret = pthread_cond_wait(&st->cond, &st->lock);
+            if (ret)
+                report_errno("pthread_cond_wait", ret);
+        }
+        pthread_mutex_unlock(&st->lock);
+    } else {
+        sq->must_exit = 1;
+        pollreactor_do_exit(sq->pr);
+        kick_bg_thread(sq);
+        int ret = pthread_join(sq->tid, NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    pthread_mutex_lock(&sq->lock);
+    canbus_sched_remove_node(&sq->bus_node);
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Share the bandwidth of a CAN bus with other serialqueues
+void __visible
+serialqueue_set_canbus_sched(struct serialqueue *sq, struct canbus_sched *cs)
+{
+    pthread_mutex_lock(&sq->lock);
+    canbus_sched_remove_node(&sq->bus_node);
+    if (cs)
+        canbus_sched_add_node(cs, &sq->bus_node);
+    pthread_mutex_unlock(&sq->lock);
 }
 
 // Free all resources associated with a serialqueue
@@ -709,7 +1636,7 @@ serialqueue_free(struct serialqueue *sq)
 {
     if (!sq)
         return;
-    if (!pollreactor_is_exit(sq->pr))
+    if (sq->st || !pollreactor_is_exit(sq->pr))
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
     message_queue_free(&sq->sent_queue);
@@ -717,6 +1644,12 @@ serialqueue_free(struct serialqueue *sq)
     message_queue_free(&sq->notify_queue);
     message_queue_free(&sq->old_sent);
     message_queue_free(&sq->old_receive);
+    while (!list_empty(&sq->response_handlers)) {
+        struct response_handler *rh = list_first_entry(
+            &sq->response_handlers, struct response_handler, node);
+        list_del(&rh->node);
+        free(rh);
+    }
     while (!list_empty(&sq->pending_queues)) {
         struct command_queue *cq = list_first_entry(
             &sq->pending_queues, struct command_queue, node);
@@ -725,7 +1658,13 @@ serialqueue_free(struct serialqueue *sq)
         message_queue_free(&cq->upcoming_queue);
     }
     pthread_mutex_unlock(&sq->lock);
-    pollreactor_free(sq->pr);
+    message_pool_destroy(&sq->msg_pool);
+    if (sq->st)
+        sqthread_put(sq->st);
+    else
+        pollreactor_free(sq->pr);
+    free(sq->receive_ring);
+    free(sq->msgid_stats);
     free(sq);
 }
 
@@ -753,6 +1692,78 @@ serialqueue_free_commandqueue(struct command_queue *cq)
     free(cq);
 }
 
+// Set the priority class of a 'struct command_queue'.  Ready messages
+// in a higher priority class are sent before all messages in lower
+// classes and are not delayed to build larger message blocks.  This
+// must be called before any messages are sent on the queue.
+void __visible
+serialqueue_set_commandqueue_priority(struct command_queue *cq, int priority)
+{
+    if (priority < SQ_PRIORITY_NORMAL)
+        priority = SQ_PRIORITY_NORMAL;
+    if (priority >= SQ_PRIORITY_NUM)
+        priority = SQ_PRIORITY_NUM - 1;
+    cq->priority = priority;
+}
+
+// Configure a 'struct command_queue' to hold only the latest value of
+// a command.  A message that has the same message id and first
+// 'key_params' parameters as the last message still waiting on the
+// queue replaces that message (keeping its position and min_clock).
+// A waiting message is only replaced if the new message is scheduled
+// at or before it (so that the waiting value would never take effect).
+// This must be called before any messages are sent on the queue.
+void __visible
+serialqueue_set_commandqueue_coalesce(struct command_queue *cq
+                                      , int key_params)
+{
+    cq->coalesce_params = key_params > 0 ? key_params : 0;
+}
+
+// Return the length of the message id and first 'count' parameters
+static int
+coalesce_key_len(struct queue_message *qm, int count)
+{
+    int pos = 0;
+    while (pos < qm->len) {
+        if (!(qm->msg[pos++] & 0x80) && !count--)
+            break;
+    }
+    return pos;
+}
+
+// Try to replace the last waiting message of a queue with 'qm'
+static int
+coalesce_message(struct serialqueue *sq, struct command_queue *cq
+                 , struct queue_message *qm)
+{
+    struct list_head *root = &cq->upcoming_queue;
+    int *pbytes = &sq->upcoming_bytes;
+    if (list_empty(root)) {
+        root = &cq->ready_queue;
+        pbytes = &sq->ready_bytes;
+        if (list_empty(root))
+            return 0;
+    }
+    struct queue_message *last = list_last_entry(
+        root, struct queue_message, node);
+    if (qm->notify_id || last->notify_id || qm->req_clock > last->req_clock)
+        return 0;
+    int key_len = coalesce_key_len(qm, cq->coalesce_params);
+    if (key_len != coalesce_key_len(last, cq->coalesce_params)
+        || memcmp(qm->msg, last->msg, key_len) != 0)
+        return 0;
+    *pbytes += qm->len - last->len;
+    memcpy(last->msg, qm->msg, qm->len);
+    last->len = qm->len;
+    last->req_clock = qm->req_clock;
+    if (last->min_clock + (1LL<<31) < last->req_clock
+        && last->req_clock != BACKGROUND_PRIORITY_CLOCK)
+        last->min_clock = last->req_clock - (1LL<<31);
+    sq->coalesce_msgs++;
+    return 1;
+}
+
 // Add a low-latency message handler
 void
 serialqueue_add_fastreader(struct serialqueue *sq, struct fastreader *fr)
@@ -774,32 +1785,98 @@ serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr)
     pthread_mutex_unlock(&sq->fast_reader_dispatch_lock);
 }
 
+// Register a handler for received messages starting with the given
+// prefix (a message id optionally followed by an encoded oid).  The
+// integer parameters of matching messages are decoded prior to
+// reporting them from serialqueue_pull_many().  If 'coalesce' is set
+// then only the most recent matching message is kept while a previous
+// one is still waiting to be pulled.  Returns the handler's dispatch
+// id (or -1 on error).
+int __visible
+serialqueue_add_response(struct serialqueue *sq, uint8_t *prefix
+                         , int prefix_len, int msgid_len, int num_params
+                         , uint32_t unsigned_mask, int coalesce)
+{
+    if (prefix_len <= 0 || prefix_len > MESSAGE_PAYLOAD_MAX
+        || msgid_len <= 0 || msgid_len > prefix_len
+        || num_params < 0 || num_params > DISPATCH_MAX_PARAMS)
+        return -1;
+    struct response_handler *rh = malloc(sizeof(*rh));
+    memset(rh, 0, sizeof(*rh));
+    memcpy(rh->prefix, prefix, prefix_len);
+    rh->prefix_len = prefix_len;
+    rh->msgid_len = msgid_len;
+    rh->num_params = num_params;
+    rh->unsigned_mask = unsigned_mask;
+    rh->coalesce = coalesce;
+
+    pthread_mutex_lock(&sq->lock);
+    rh->dispatch_id = ++sq->last_dispatch_id;
+    list_add_tail(&rh->node, &sq->response_handlers);
+    pthread_mutex_unlock(&sq->lock);
+    return rh->dispatch_id;
+}
+
+// Remove a previously registered response handler
+void __visible
+serialqueue_rm_response(struct serialqueue *sq, int dispatch_id)
+{
+    pthread_mutex_lock(&sq->lock);
+    struct response_handler *rh;
+    list_for_each_entry(rh, &sq->response_handlers, node) {
+        if (rh->dispatch_id == dispatch_id) {
+            list_del(&rh->node);
+            free(rh);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Add a batch of messages to the given command_queue
 void
 serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
                        , struct list_head *msgs)
 {
     // Make sure min_clock is set in list and calculate total bytes
-    int len = 0;
+    int len = 0, count = 0;
     struct queue_message *qm;
     list_for_each_entry(qm, msgs, node) {
         if (qm->min_clock + (1LL<<31) < qm->req_clock
             && qm->req_clock != BACKGROUND_PRIORITY_CLOCK)
             qm->min_clock = qm->req_clock - (1LL<<31);
         len += qm->len;
+        count++;
     }
     if (! len)
         return;
     qm = list_first_entry(msgs, struct queue_message, node);
+    uint64_t min_clock = qm->min_clock;
 
     // Add list to cq->upcoming_queue
     pthread_mutex_lock(&sq->lock);
     if (list_empty(&cq->ready_queue) && list_empty(&cq->upcoming_queue))
         list_add_tail(&cq->node, &sq->pending_queues);
-    list_join_tail(msgs, &cq->upcoming_queue);
-    sq->upcoming_bytes += len;
+    if (cq->coalesce_params) {
+        while (!list_empty(msgs)) {
+            struct queue_message *m = list_first_entry(
+                msgs, struct queue_message, node);
+            list_del(&m->node);
+            if (coalesce_message(sq, cq, m)) {
+                message_pool_free(&sq->msg_pool, m);
+                count--;
+                continue;
+            }
+            list_add_tail(&m->node, &cq->upcoming_queue);
+            sq->upcoming_bytes += m->len;
+        }
+    } else {
+        list_join_tail(msgs, &cq->upcoming_queue);
+        sq->upcoming_bytes += len;
+    }
+    note_queued_msgs(sq, count);
     int mustwake = 0;
-    if (qm->min_clock < sq->need_kick_clock) {
+    if (min_clock < sq->need_kick_clock) {
         sq->need_kick_clock = 0;
         mustwake = 1;
     }
@@ -828,59 +1905,215 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
                  , int len, uint64_t min_clock, uint64_t req_clock
                  , uint64_t notify_id)
 {
-    struct queue_message *qm = message_fill(msg, len);
+    struct queue_message *qm = message_pool_fill(&sq->msg_pool, msg, len);
     qm->min_clock = min_clock;
     qm->req_clock = req_clock;
     qm->notify_id = notify_id;
     serialqueue_send_one(sq, cq, qm);
 }
 
-// Return a message read from the serial port (or wait for one if none
-// available)
-void __visible
-serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+// Encode a command from its arguments and schedule its transmission.
+// Returns 0 on success or -1 if the command could not be encoded.
+int __visible
+serialqueue_send_encoded(struct serialqueue *sq, struct command_queue *cq
+                         , struct command_encoder *ce, int64_t *args
+                         , uint8_t *buf, int buf_len, uint64_t min_clock
+                         , uint64_t req_clock, uint64_t notify_id)
 {
-    pthread_mutex_lock(&sq->lock);
-    // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(sq->pr))
-            goto exit;
+    struct queue_message *qm = message_pool_alloc(&sq->msg_pool);
+    if (command_encoder_encode(ce, qm, args, buf, buf_len)) {
+        message_pool_free(&sq->msg_pool, qm);
+        return -1;
+    }
+    qm->min_clock = min_clock;
+    qm->req_clock = req_clock;
+    qm->notify_id = notify_id;
+    serialqueue_send_one(sq, cq, qm);
+    return 0;
+}
+
+// Copy messages from the receive ring (does not take the lock)
+static int
+receive_ring_pull(struct serialqueue *sq, struct pull_queue_message *pqm
+                  , int max)
+{
+    uint32_t tail = sq->receive_tail;
+    uint32_t head = __atomic_load_n(&sq->receive_head, __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (tail != head && count < max) {
+        struct pull_queue_message *rm = &sq->receive_ring[
+            tail % RECEIVE_RING_SIZE];
+        memcpy(pqm->msg, rm->msg, rm->len);
+        pqm->len = rm->len;
+        pqm->sent_time = rm->sent_time;
+        pqm->receive_time = rm->receive_time;
+        pqm->notify_id = rm->notify_id;
+        pqm++;
+        tail++;
+        count++;
+    }
+    if (count)
+        __atomic_store_n(&sq->receive_tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Decode the integer parameters of a message (using the same
+// semantics as the python msgproto code)
+static int
+decode_params(struct response_handler *rh, struct pull_queue_message *pqm)
+{
+    uint8_t *p = &pqm->msg[MESSAGE_HEADER_SIZE + rh->msgid_len];
+    uint8_t *end = &pqm->msg[pqm->len - MESSAGE_TRAILER_SIZE];
+    int i;
+    for (i=0; i<rh->num_params; i++) {
+        if (p >= end)
+            return -1;
+        uint8_t c = *p++;
+        uint64_t v = c & 0x7f;
+        if ((c & 0x60) == 0x60)
+            v |= -0x20;
+        while (c & 0x80) {
+            if (p >= end)
+                return -1;
+            c = *p++;
+            v = (v<<7) | (c & 0x7f);
+        }
+        if (rh->unsigned_mask & (1 << i))
+            v &= 0xffffffff;
+        pqm->params[i] = v;
+    }
+    return p == end ? 0 : -1;
+}
+
+// Fill in the dispatch information of pulled messages (sq->lock
+// must be held)
+static void
+dispatch_pulled(struct serialqueue *sq, struct pull_queue_message *pqm
+                , int count)
+{
+    int i;
+    for (i=0; i<count; i++, pqm++) {
+        pqm->dispatch_id = 0;
+        if (pqm->notify_id || pqm->len < MESSAGE_MIN)
+            continue;
+        struct response_handler *rh = find_response_handler(
+            sq, pqm->msg, pqm->len);
+        if (!rh)
+            continue;
+        if (rh->pending) {
+            // Report the latest message of a coalescing handler
+            struct pull_queue_message *lm = &rh->latest;
+            memcpy(pqm->msg, lm->msg, lm->len);
+            pqm->len = lm->len;
+            pqm->sent_time = lm->sent_time;
+            pqm->receive_time = lm->receive_time;
+            rh->pending = 0;
+        }
+        if (!decode_params(rh, pqm))
+            pqm->dispatch_id = rh->dispatch_id;
+    }
+}
+
+// Return up to 'max' messages read from the serial port.  If none are
+// available then either wait for one or (if 'nowait' is set) arrange
+// for the wake fd to be signaled when one arrives.  Returns 0 if no
+// message is available and -1 if the background thread exited.
+static int
+pull_messages(struct serialqueue *sq, struct pull_queue_message *pqm
+              , int max, int nowait)
+{
+    for (;;) {
+        int count = receive_ring_pull(sq, pqm, max);
+        if (count) {
+            pthread_mutex_lock(&sq->lock);
+            dispatch_pulled(sq, pqm, count);
+            pthread_mutex_unlock(&sq->lock);
+            return count;
+        }
+
+        pthread_mutex_lock(&sq->lock);
+        if (sq->receive_head != sq->receive_tail) {
+            // Raced with background thread - retry from ring
+            pthread_mutex_unlock(&sq->lock);
+            continue;
+        }
+        // Ring is empty - check overflow queue
+        while (count < max && !list_empty(&sq->receive_queue)) {
+            struct queue_message *qm = list_first_entry(
+                &sq->receive_queue, struct queue_message, node);
+            list_del(&qm->node);
+            copy_pull_message(&pqm[count++], qm);
+            message_pool_free(&sq->msg_pool, qm);
+            note_queued_msgs(sq, -1);
+        }
+        dispatch_pulled(sq, pqm, count);
+        if (count || sq->must_exit) {
+            pthread_mutex_unlock(&sq->lock);
+            return count ? count : -1;
+        }
+        // Wait for message to be available
         sq->receive_waiting = 1;
+        if (nowait) {
+            pthread_mutex_unlock(&sq->lock);
+            return 0;
+        }
         int ret = pthread_cond_wait(&sq->cond, &sq->lock);
         if (ret)
             report_errno("pthread_cond_wait", ret);
+        pthread_mutex_unlock(&sq->lock);
     }
+}
 
-    // Remove message from queue
-    struct queue_message *qm = list_first_entry(
-        &sq->receive_queue, struct queue_message, node);
-    list_del(&qm->node);
+// Return up to 'max' messages read from the serial port (or wait for
+// one if none available).  Returns 0 if the background thread exited.
+int __visible
+serialqueue_pull_many(struct serialqueue *sq, struct pull_queue_message *pqm
+                      , int max)
+{
+    int count = pull_messages(sq, pqm, max, 0);
+    return count < 0 ? 0 : count;
+}
 
-    // Copy message
-    memcpy(pqm->msg, qm->msg, qm->len);
-    pqm->len = qm->len;
-    pqm->sent_time = qm->sent_time;
-    pqm->receive_time = qm->receive_time;
-    pqm->notify_id = qm->notify_id;
-    if (qm->len)
-        debug_queue_add(&sq->old_receive, qm);
-    else
-        message_free(qm);
+// Return up to 'max' messages without waiting.  When no messages are
+// available the fd registered with serialqueue_set_wake_fd() is
+// signaled on the next message arrival.  Returns -1 if the
+// background thread exited.
+int __visible
+serialqueue_pull_nowait(struct serialqueue *sq, struct pull_queue_message *pqm
+                        , int max)
+{
+    return pull_messages(sq, pqm, max, 1);
+}
 
+// Deliver received messages by signaling an eventfd (or pipe) instead
+// of waking a thread blocked in serialqueue_pull_many()
+void __visible
+serialqueue_set_wake_fd(struct serialqueue *sq, int fd)
+{
+    pthread_mutex_lock(&sq->lock);
+    sq->wake_fd = fd;
+    sq->receive_waiting = 0;
+    if (fd >= 0)
+        // Check for messages that arrived before the fd was set
+        signal_wake_fd(sq);
     pthread_mutex_unlock(&sq->lock);
-    return;
+}
 
-exit:
-    pqm->len = -1;
-    pthread_mutex_unlock(&sq->lock);
+// Return a message read from the serial port (or wait for one if none
+// available)
+void __visible
+serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    if (!serialqueue_pull_many(sq, pqm, 1))
+        pqm->len = -1;
 }
 
 void __visible
 serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency)
 {
     pthread_mutex_lock(&sq->lock);
-    if (sq->serial_fd_type == SQT_CAN) {
-        sq->bittime_adjust = 1. / frequency;
+    if (is_canbus(sq) || sq->serial_fd_type == SQT_UDP) {
+        sq->bittime_adjust = sq->data_bittime_adjust = 1. / frequency;
     } else {
         // An 8N1 serial line is 10 bits per byte (1 start, 8 data, 1 stop)
         sq->bittime_adjust = 10. / frequency;
@@ -888,6 +2121,15 @@ serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Set the data phase bit rate of a CAN FD bus
+void __visible
+serialqueue_set_data_frequency(struct serialqueue *sq, double frequency)
+{
+    pthread_mutex_lock(&sq->lock);
+    sq->data_bittime_adjust = 1. / frequency;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 void __visible
 serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
 {
@@ -896,6 +2138,36 @@ serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Enable (or disable) adjusting the number of message blocks that
+// may be awaiting an ack from the measured round trip times
+void __visible
+serialqueue_set_adaptive_window(struct serialqueue *sq, int enable)
+{
+    pthread_mutex_lock(&sq->lock);
+    sq->adaptive_window = enable;
+    sq->min_rtt = 0.;
+    sq->window_blocks = MAX_PENDING_BLOCKS;
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Enable selective retransmits - 'prefix' is the msgid of the mcu's
+// "selective_ack mask=%c" response and 'blocks' is the number of out
+// of order blocks the mcu may store
+void __visible
+serialqueue_set_selective_ack(struct serialqueue *sq, uint8_t *prefix
+                              , int prefix_len, int blocks)
+{
+    if (prefix_len > (int)sizeof(sq->sack_prefix)
+        || blocks < 1 || blocks > MAX_WINDOW_BLOCKS - MIN_WINDOW_BLOCKS)
+        return;
+    pthread_mutex_lock(&sq->lock);
+    memcpy(sq->sack_prefix, prefix, prefix_len);
+    sq->sack_prefix_len = prefix_len;
+    sq->sack_blocks = blocks;
+    sq->sack_mask = 0;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Set the estimated clock rate of the mcu on the other end of the
 // serial port
 void __visible
@@ -920,6 +2192,46 @@ serialqueue_get_clock_est(struct serialqueue *sq, struct clock_estimate *ce)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Start updating the clock estimate from received responses with the
+// given message id (the mcu "clock" response).  The regression is
+// seeded with an initial sample of the mcu clock.
+void __visible
+serialqueue_set_clock_sync(struct serialqueue *sq, int clock_msgid
+                           , double mcu_freq, double sent_time
+                           , uint64_t clock)
+{
+    pthread_mutex_lock(&sq->lock);
+    struct clock_sync_state *cs = &sq->cs;
+    memset(cs, 0, sizeof(*cs));
+    cs->last_clock = clock;
+    cs->mcu_freq = cs->est_freq = mcu_freq;
+    cs->min_half_rtt = 999999999.9;
+    cs->time_avg = sent_time;
+    cs->clock_avg = clock;
+    cs->prediction_variance = (.001 * mcu_freq) * (.001 * mcu_freq);
+    cs->last_prediction_time = -9999.;
+    uint32_t msgid = clock_msgid;
+    sq->clock_msgid_len = msgblock_encode_ints(
+        sq->clock_msgid, sizeof(sq->clock_msgid), &msgid, 1);
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Return the current state of the clock regression
+void __visible
+serialqueue_get_clock_sync(struct serialqueue *sq, struct clock_sync_state *cs)
+{
+    pthread_mutex_lock(&sq->lock);
+    memcpy(cs, &sq->cs, sizeof(sq->cs));
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Return the message pool used for messages sent on this serial port
+struct message_pool *
+serialqueue_get_message_pool(struct serialqueue *sq)
+{
+    return &sq->msg_pool;
+}
+
 // Return a string buffer containing statistics for the serial port
 void __visible
 serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
@@ -927,19 +2239,64 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
     struct serialqueue stats;
     pthread_mutex_lock(&sq->lock);
     memcpy(&stats, sq, sizeof(stats));
+    memset(sq->class_max_delay, 0, sizeof(sq->class_max_delay));
     pthread_mutex_unlock(&sq->lock);
+    uint32_t pool_hit, pool_miss;
+    message_pool_get_stats(&sq->msg_pool, &pool_hit, &pool_miss);
+    struct pollreactor_stats pr_stats;
+    pollreactor_get_stats(sq->pr, &pr_stats);
 
     snprintf(buf, len, "bytes_write=%u bytes_read=%u"
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
-             " ready_bytes=%u upcoming_bytes=%u"
+             " ready_bytes=%u upcoming_bytes=%u window=%d"
+             " msg_pool_hit=%u msg_pool_miss=%u coalesce_msgs=%u"
+             " block_fill=%.3f msg_bytes=%u msg_peak_bytes=%u"
+             " queue_msgs=%u queue_delay=%.3f queue_max_delay=%.6f"
+             " urgent_msgs=%u urgent_delay=%.3f urgent_max_delay=%.6f"
+             " reactor_wakeups=%u reactor_timers=%u"
+             " reactor_delay=%.3f reactor_max_delay=%.6f"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.upcoming_bytes);
+             , stats.ready_bytes, stats.upcoming_bytes
+             , get_window_blocks(&stats), pool_hit, pool_miss
+             , stats.coalesce_msgs
+             , (stats.send_blocks ? (double)stats.send_payload_bytes
+                / (stats.send_blocks * MESSAGE_PAYLOAD_MAX) : 0.)
+             , (int)(stats.queued_msgs * sizeof(struct queue_message))
+             , (int)(stats.queued_msgs_peak * sizeof(struct queue_message))
+             , stats.class_msgs[SQ_PRIORITY_NORMAL]
+             , stats.class_delay[SQ_PRIORITY_NORMAL]
+             , stats.class_max_delay[SQ_PRIORITY_NORMAL]
+             , stats.class_msgs[SQ_PRIORITY_HIGH]
+             , stats.class_delay[SQ_PRIORITY_HIGH]
+             , stats.class_max_delay[SQ_PRIORITY_HIGH]
+             , pr_stats.wakeups, pr_stats.timer_dispatch
+             , pr_stats.timer_delay, pr_stats.timer_max_delay);
+}
+
+// Fill 'stats' with the traffic of each message id that has been
+// sent or received and return the number of entries filled
+int __visible
+serialqueue_get_msgid_stats(struct serialqueue *sq
+                            , struct serialqueue_msgid_stats *stats, int max)
+{
+    int index, count = 0;
+    pthread_mutex_lock(&sq->lock);
+    for (index=0; index<MSGID_STATS_MAX && count<max; index++) {
+        struct serialqueue_msgid_stats *ms = &sq->msgid_stats[index];
+        if (!ms->send_msgs && !ms->receive_msgs)
+            continue;
+        stats[count] = *ms;
+        stats[count].msgid = index + MSGID_STATS_MIN;
+        count++;
+    }
+    pthread_mutex_unlock(&sq->lock);
+    return count;
 }
 
 // Extract old messages stored in the debug queues
@@ -951,7 +2308,7 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
     struct list_head *rootp = sentq ? &sq->old_sent : &sq->old_receive;
     struct list_head replacement, current;
     list_init(&replacement);
-    debug_queue_alloc(&replacement, count);
+    debug_queue_alloc(&sq->msg_pool, &replacement, count);
     list_init(&current);
 
     // Atomically replace existing debug list with new zero'd list
@@ -975,7 +2332,7 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
             pqm->receive_time = qm->receive_time;
         }
         list_del(&qm->node);
-        message_free(qm);
+        message_pool_free(&sq->msg_pool, qm);
     }
     return pos;
 }
@@ -8,30 +8,70 @@
 #define MAX_CLOCK 0x7fffffffffffffffLL
 #define BACKGROUND_PRIORITY_CLOCK 0x7fffffff00000000LL
 
+// Command queue priority classes
+enum { SQ_PRIORITY_NORMAL, SQ_PRIORITY_HIGH, SQ_PRIORITY_NUM };
+
 struct fastreader;
 typedef void (*fastreader_cb)(struct fastreader *fr, uint8_t *data, int len);
 
 struct fastreader {
     struct list_node node;
     fastreader_cb func;
+    int consume; // Don't also report matching messages via serialqueue_pull
     int prefix_len;
     uint8_t prefix[MESSAGE_MAX];
 };
 
+#define DISPATCH_MAX_PARAMS 16
+
+// Regression of mcu clock against host send time (see clock_sync_sample())
+struct clock_sync_state {
+    uint64_t last_clock;
+    int sample_count;
+    double mcu_freq, est_freq;
+    double min_half_rtt, min_rtt_time;
+    double time_avg, time_variance, clock_avg, clock_covariance;
+    double prediction_variance, last_prediction_time;
+};
+
 struct pull_queue_message {
     uint8_t msg[MESSAGE_MAX];
     int len;
     double sent_time, receive_time;
     uint64_t notify_id;
+    // Filled for messages matching a registered response handler
+    int dispatch_id;
+    int64_t params[DISPATCH_MAX_PARAMS];
+};
+
+// Traffic of a single message id (see serialqueue_get_msgid_stats())
+struct serialqueue_msgid_stats {
+    int msgid;
+    uint32_t send_msgs, send_bytes, receive_msgs, receive_bytes;
 };
 
 struct serialqueue;
+struct serialqueue_thread;
+struct canbus_sched;
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
-                                      , int client_id);
+                                      , int client_id, int sched_priority
+                                      , uint64_t sched_cpu_mask);
+struct serialqueue_thread *serialqueue_thread_alloc(int sched_priority
+                                                    , uint64_t sched_cpu_mask);
+void serialqueue_thread_free(struct serialqueue_thread *st);
+struct serialqueue *serialqueue_alloc_shared(int serial_fd, char serial_fd_type
+                                             , int client_id
+                                             , struct serialqueue_thread *st);
 void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
+void serialqueue_set_canbus_sched(struct serialqueue *sq
+                                  , struct canbus_sched *cs);
 struct command_queue *serialqueue_alloc_commandqueue(void);
 void serialqueue_free_commandqueue(struct command_queue *cq);
+void serialqueue_set_commandqueue_priority(struct command_queue *cq
+                                           , int priority);
+void serialqueue_set_commandqueue_coalesce(struct command_queue *cq
+                                           , int key_params);
 void serialqueue_add_fastreader(struct serialqueue *sq, struct fastreader *fr);
 void serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr);
 void serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
@@ -41,15 +81,41 @@ void serialqueue_send_one(struct serialqueue *sq, struct command_queue *cq
 void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
                       , uint8_t *msg, int len, uint64_t min_clock
                       , uint64_t req_clock, uint64_t notify_id);
+int serialqueue_send_encoded(struct serialqueue *sq, struct command_queue *cq
+                             , struct command_encoder *ce, int64_t *args
+                             , uint8_t *buf, int buf_len, uint64_t min_clock
+                             , uint64_t req_clock, uint64_t notify_id);
+int serialqueue_add_response(struct serialqueue *sq, uint8_t *prefix
+                             , int prefix_len, int msgid_len, int num_params
+                             , uint32_t unsigned_mask, int coalesce);
+void serialqueue_rm_response(struct serialqueue *sq, int dispatch_id);
+int serialqueue_pull_many(struct serialqueue *sq
+                          , struct pull_queue_message *pqm, int max);
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
+int serialqueue_pull_nowait(struct serialqueue *sq
+                            , struct pull_queue_message *pqm, int max);
+void serialqueue_set_wake_fd(struct serialqueue *sq, int fd);
 void serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency);
+void serialqueue_set_data_frequency(struct serialqueue *sq, double frequency);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
+void serialqueue_set_adaptive_window(struct serialqueue *sq, int enable);
+void serialqueue_set_selective_ack(struct serialqueue *sq, uint8_t *prefix
+                                   , int prefix_len, int blocks);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double conv_time, uint64_t conv_clock
                                , uint64_t last_clock);
 void serialqueue_get_clock_est(struct serialqueue *sq
                                , struct clock_estimate *ce);
+void serialqueue_set_clock_sync(struct serialqueue *sq, int clock_msgid
+                                , double mcu_freq, double sent_time
+                                , uint64_t clock);
+void serialqueue_get_clock_sync(struct serialqueue *sq
+                                , struct clock_sync_state *cs);
+struct message_pool *serialqueue_get_message_pool(struct serialqueue *sq);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+int serialqueue_get_msgid_stats(struct serialqueue *sq
+                                , struct serialqueue_msgid_stats *stats
+                                , int max);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
 
@@ -1,6 +1,6 @@
 // Stepper pulse schedule compression
 //
-// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -21,45 +21,185 @@
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // DIV_ROUND_UP
+#include "histstore.h" // histstore_reserve
 #include "pyhelper.h" // errorf
 #include "serialqueue.h" // struct queue_message
 #include "stepcompress.h" // stepcompress_alloc
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
+// Maximum number of moves sent in a single queue_step_batch command
+#define BATCH_MAX_MOVES 8
+
+struct step_move {
+    uint32_t interval;
+    uint16_t count;
+    int16_t add, add2;
+};
+
+struct history_steps {
+    uint64_t first_clock, last_clock;
+    // Minimum first_clock of this and all newer history entries
+    uint64_t search_clock;
+    int64_t start_position;
+    int step_count, interval, add, add2;
+};
 
 struct stepcompress {
     // Buffer management
     uint32_t *queue, *queue_end, *queue_pos, *queue_next;
     // Internal tracking
-    uint32_t max_error;
+    uint32_t max_error, adaptive_ratio, adaptive_max_error, search_error;
     double mcu_time_offset, mcu_freq, last_step_print_time;
     // Message generation
     uint64_t last_step_clock;
     struct list_head msg_queue;
+    struct message_pool *msg_pool;
     uint32_t oid;
-    int32_t queue_step_msgtag, set_next_step_dir_msgtag;
-    int sdir, invert_sdir;
+    int32_t queue_step_msgtag, set_next_step_dir_msgtag, queue_step2_msgtag;
+    int32_t queue_step_batch_msgtag, queue_step_dir_msgtag;
+    int sdir, invert_sdir, pending_dir;
+    // Pending queue_step command that later moves may be combined with
+    struct queue_message *batch_qm;
+    struct step_move batch_moves[BATCH_MAX_MOVES];
+    int batch_count, batch_max;
     // Step+dir+step filter
     uint64_t next_step_clock;
     int next_step_dir;
     // History tracking
     int64_t last_position;
-    struct list_head history_list;
+    struct histstore history;
+    struct history_steps history_last;
+    // Statistics
+    struct stepcompress_stats stats;
+    struct stepcompress_rate_stats rate_stats;
+    uint64_t rate_window_end;
+    uint32_t rate_window_bytes;
 };
 
-struct step_move {
-    uint32_t interval;
-    uint16_t count;
-    int16_t add;
-};
 
-struct history_steps {
-    struct list_node node;
-    uint64_t first_clock, last_clock;
-    int64_t start_position;
-    int step_count, interval, add;
-};
+/****************************************************************
+ * History tracking
+ ****************************************************************/
+
+// The history of queue_step commands is stored in compact blocks
+// (see histstore.c) that are ordered from oldest to newest.  Each
+// entry is encoded relative to the previous entry in its block.  The
+// start of each block tracks the minimum first_clock of the entries
+// in that block and all newer blocks (its "search clock") and the
+// end of each block tracks the maximum last_clock of its entries.
+
+#define HIST_STEPS_MAX_SIZE (3 * 10 + 4 * 5)
+#define HIST_STEPS_MIN_SIZE 7
+#define HIST_BLOCK_STEPS (HIST_BLOCK_SIZE / HIST_STEPS_MIN_SIZE)
+
+// Decode a history entry that follows 'prev'
+static uint8_t *
+history_decode(uint8_t *p, struct history_steps *prev
+               , struct history_steps *hs)
+{
+    hs->first_clock = prev->last_clock + hist_get_int(&p);
+    hs->last_clock = hs->first_clock + hist_get_uint(&p);
+    hs->search_clock = hs->first_clock;
+    hs->start_position = (prev->start_position + prev->step_count
+                          + hist_get_int(&p));
+    hs->step_count = hist_get_int(&p);
+    hs->interval = hist_get_int(&p);
+    hs->add = hist_get_int(&p);
+    hs->add2 = hist_get_int(&p);
+    return p;
+}
+
+// Decode all the entries of the history block at the given position
+// (0 is the oldest) along with their search_clock
+static int
+history_decode_block(struct stepcompress *sc, uint32_t pos
+                     , struct history_steps *entries)
+{
+    struct histstore *hist = &sc->history;
+    struct hist_block *b = histstore_get(hist, pos);
+    struct history_steps prev;
+    memset(&prev, 0, sizeof(prev));
+    uint8_t *p = b->data;
+    int i;
+    for (i=0; i<b->count; i++) {
+        p = history_decode(p, &prev, &entries[i]);
+        prev = entries[i];
+    }
+    uint64_t search_clock = UINT64_MAX;
+    if (pos + 1 < hist->count)
+        search_clock = histstore_get(hist, pos + 1)->start.clock;
+    while (i--) {
+        if (entries[i].search_clock > search_clock)
+            entries[i].search_clock = search_clock;
+        search_clock = entries[i].search_clock;
+    }
+    return b->count;
+}
+
+// Add an entry to the end of the history
+static void
+history_add(struct stepcompress *sc, struct history_steps *hs)
+{
+    struct histstore *hist = &sc->history;
+    // Update search_clock of older blocks (only needed if entries
+    // are added out of order, such as a position marker after homing)
+    uint32_t pos = hist->count;
+    while (pos--) {
+        struct hist_block *b = histstore_get(hist, pos);
+        if (b->start.clock <= hs->first_clock)
+            break;
+        b->start.clock = hs->first_clock;
+    }
+    struct hist_block *b = histstore_reserve(hist, HIST_STEPS_MAX_SIZE);
+    struct history_steps *prev = &sc->history_last;
+    if (!b->count) {
+        memset(prev, 0, sizeof(*prev));
+        b->start.clock = hs->first_clock;
+        b->end.clock = hs->last_clock;
+    }
+    uint8_t *p = &b->data[b->len];
+    p = hist_put_int(p, hs->first_clock - prev->last_clock);
+    p = hist_put_uint(p, hs->last_clock - hs->first_clock);
+    p = hist_put_int(p, hs->start_position - (prev->start_position
+                                              + prev->step_count));
+    p = hist_put_int(p, hs->step_count);
+    p = hist_put_int(p, hs->interval);
+    p = hist_put_int(p, hs->add);
+    p = hist_put_int(p, hs->add2);
+    b->len = p - b->data;
+    b->count++;
+    if (hs->last_clock > b->end.clock)
+        b->end.clock = hs->last_clock;
+    *prev = *hs;
+}
+
+// Find the number of history blocks with a search_clock at or before
+// the given clock.  The newest of those blocks contains the newest
+// entry with a first_clock at or before the given clock.
+static uint32_t
+history_find(struct stepcompress *sc, uint64_t clock)
+{
+    struct histstore *hist = &sc->history;
+    uint32_t low = 0, high = hist->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (histstore_get(hist, mid)->start.clock <= clock)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Remove history blocks that are completed at or before end_clock
+static void
+free_history(struct stepcompress *sc, uint64_t end_clock)
+{
+    struct histstore *hist = &sc->history;
+    while (hist->count && histstore_get(hist, 0)->end.clock <= end_clock)
+        histstore_expire_oldest(hist);
+}
 
 
 /****************************************************************
@@ -82,6 +222,26 @@ struct points {
     int32_t minp, maxp;
 };
 
+// Return the maximum error of a step time that is 'interval' ticks
+// after the previous step time.  In the adaptive mode the allowed
+// error is a fraction of the interval (but at least max_error).
+static inline uint32_t
+step_max_error(struct stepcompress *sc, uint32_t interval)
+{
+    uint32_t max_error = sc->max_error;
+    if (unlikely(sc->adaptive_ratio)) {
+        uint64_t adaptive_error = ((uint64_t)interval
+                                   * sc->adaptive_ratio) >> 16;
+        if (adaptive_error > sc->adaptive_max_error)
+            adaptive_error = sc->adaptive_max_error;
+        if (adaptive_error > max_error)
+            max_error = adaptive_error;
+    }
+    if (max_error > interval / 2)
+        max_error = interval / 2;
+    return max_error;
+}
+
 // Given a requested step time, return the minimum and maximum
 // acceptable times
 static inline struct points
@@ -89,25 +249,33 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
 {
     uint32_t lsc = sc->last_step_clock, point = *pos - lsc;
     uint32_t prevpoint = pos > sc->queue_pos ? *(pos-1) - lsc : 0;
-    uint32_t max_error = (point - prevpoint) / 2;
-    if (max_error > sc->max_error)
-        max_error = sc->max_error;
+    uint32_t max_error = step_max_error(sc, point - prevpoint);
     return (struct points){ point - max_error, point };
 }
 
+// Maximum magnitude of the 'add2' contribution to a step time
+#define ADD2_MAX_TICKS (1<<29)
+
 // The maximum add delta between two valid quadratic sequences of the
 // form "add*count*(count-1)/2 + interval*count" is "(6 + 4*sqrt(2)) *
 // maxerror / (count*count)".  The "6 + 4*sqrt(2)" is 11.65685, but
 // using 11 works well in practice.
 #define QUADRATIC_DEV 11
 
-// Find a 'step_move' that covers a series of step times
+// Find a 'step_move' that covers a series of step times.  A non-zero
+// 'add2' searches for sequences with that fixed second order term.
 static struct step_move
-compress_bisect_add(struct stepcompress *sc)
+compress_bisect_add(struct stepcompress *sc, int32_t add2)
 {
     uint32_t *qlast = sc->queue_next;
     if (qlast > sc->queue_pos + 65535)
         qlast = sc->queue_pos + 65535;
+    if (add2) {
+        // Limit count so that "add2*count*(count-1)*(count-2)/6" fits
+        int maxcount = cbrt(ADD2_MAX_TICKS * 6. / abs(add2));
+        if (qlast > sc->queue_pos + maxcount)
+            qlast = sc->queue_pos + maxcount;
+    }
     struct points point = minmax_point(sc, sc->queue_pos);
     int32_t outer_mininterval = point.minp, outer_maxinterval = point.maxp;
     int32_t add = 0, minadd = -0x8000, maxadd = 0x7fff;
@@ -124,9 +292,15 @@ compress_bisect_add(struct stepcompress *sc)
             nextcount++;
             if (&sc->queue_pos[nextcount-1] >= qlast) {
                 int32_t count = nextcount - 1;
-                return (struct step_move){ interval, count, add };
+                return (struct step_move){ interval, count, add, add2 };
             }
             nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
+            if (add2) {
+                int32_t c3 = ((int64_t)nextcount * (nextcount-1)
+                              * (nextcount-2) / 6) * add2;
+                nextpoint.minp -= c3;
+                nextpoint.maxp -= c3;
+            }
             int32_t nextaddfactor = nextcount*(nextcount-1)/2;
             int32_t c = add*nextaddfactor;
             if (nextmininterval*nextcount < nextpoint.minp - c)
@@ -170,7 +344,7 @@ compress_bisect_add(struct stepcompress *sc)
         // The maximum valid deviation between two quadratic sequences
         // can be calculated and used to further limit the add range.
         if (count > 1) {
-            int32_t errdelta = sc->max_error*QUADRATIC_DEV / (count*count);
+            int32_t errdelta = sc->search_error*QUADRATIC_DEV / (count*count);
             if (minadd < add - errdelta)
                 minadd = add - errdelta;
             if (maxadd > add + errdelta)
@@ -192,8 +366,69 @@ compress_bisect_add(struct stepcompress *sc)
     }
     if (zerocount + zerocount/16 >= bestcount)
         // Prefer add=0 if it's similar to the best found sequence
-        return (struct step_move){ zerointerval, zerocount, 0 };
-    return (struct step_move){ bestinterval, bestcount, bestadd };
+        return (struct step_move){ zerointerval, zerocount, 0, add2 };
+    return (struct step_move){ bestinterval, bestcount, bestadd, add2 };
+}
+
+// Return the time of step 'pos' (relative to last_step_clock)
+static inline int32_t
+step_point(struct stepcompress *sc, int pos)
+{
+    return pos ? sc->queue_pos[pos-1] - (uint32_t)sc->last_step_clock : 0;
+}
+
+// Check if a sequence with a second order term fits the mcu's int16 'add'
+static int
+check_add2_range(struct step_move *move)
+{
+    int32_t last_add = move->add + move->add2 * (move->count - 1);
+    int32_t first_add = move->add + move->add2;
+    return (first_add >= -0x8000 && first_add <= 0x7fff
+            && last_add >= -0x8000 && last_add <= 0x7fff);
+}
+
+// Number of 'add2' values to try around the estimated value
+#define ADD2_SEARCH 1
+
+// Try to extend a sequence by using the mcu's queue_step2 command
+static struct step_move
+compress_add2(struct stepcompress *sc, struct step_move move)
+{
+    int avail = sc->queue_next - sc->queue_pos;
+    if (avail > 65535)
+        avail = 65535;
+    if (move.count < 3 || move.count >= avail)
+        return move;
+    // Estimate add2 from the third difference of the step times
+    int window = move.count * 2 < avail ? move.count * 2 : avail;
+    int m = window / 3;
+    double d3 = ((double)step_point(sc, 3*m) - 3. * step_point(sc, 2*m)
+                 + 3. * step_point(sc, m));
+    int32_t estadd2 = lround(d3 / ((double)m * m * m));
+    // Search for a longer sequence near the estimated add2
+    struct step_move best = move;
+    int count_needed = move.count + move.count / 8;
+    int32_t add2;
+    for (add2 = estadd2 - ADD2_SEARCH; add2 <= estadd2 + ADD2_SEARCH; add2++) {
+        if (!add2 || add2 < -0x8000 || add2 > 0x7fff)
+            continue;
+        struct step_move mv = compress_bisect_add(sc, add2);
+        if (mv.count < count_needed || !mv.add2 || !check_add2_range(&mv))
+            continue;
+        best = mv;
+        count_needed = mv.count + 1;
+    }
+    return best;
+}
+
+// Find a 'step_move' for the pending step times
+static struct step_move
+compress_step_move(struct stepcompress *sc)
+{
+    struct step_move move = compress_bisect_add(sc, 0);
+    if (sc->queue_step2_msgtag)
+        move = compress_add2(sc, move);
+    return move;
 }
 
 
@@ -213,7 +448,13 @@ check_line(struct stepcompress *sc, struct step_move move)
                , sc->oid, move.interval, move.count, move.add);
         return ERROR_RET;
     }
+    if (move.add2 && !check_add2_range(&move)) {
+        errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d: Invalid add2"
+               , sc->oid, move.interval, move.count, move.add, move.add2);
+        return ERROR_RET;
+    }
     uint32_t interval = move.interval, p = 0;
+    int32_t add = move.add;
     uint16_t i;
     for (i=0; i<move.count; i++) {
         struct points point = minmax_point(sc, sc->queue_pos + i);
@@ -231,7 +472,33 @@ check_line(struct stepcompress *sc, struct step_move move)
                    , i+1, interval);
             return ERROR_RET;
         }
-        interval += move.add;
+        interval += add;
+        add += move.add2;
+    }
+    return 0;
+}
+
+
+// Check if a 'step_move' only matches the step times because of the
+// additional error permitted by the adaptive mode
+static int
+check_adaptive_line(struct stepcompress *sc, struct step_move move)
+{
+    uint32_t lsc = sc->last_step_clock, interval = move.interval, p = 0;
+    uint32_t prevpoint = 0;
+    int32_t add = move.add;
+    uint16_t i;
+    for (i=0; i<move.count; i++) {
+        uint32_t point = sc->queue_pos[i] - lsc;
+        uint32_t max_error = (point - prevpoint) / 2;
+        if (max_error > sc->max_error)
+            max_error = sc->max_error;
+        p += interval;
+        if (p < point - max_error)
+            return 1;
+        prevpoint = point;
+        interval += add;
+        add += move.add2;
     }
     return 0;
 }
@@ -248,9 +515,10 @@ stepcompress_alloc(uint32_t oid)
     struct stepcompress *sc = malloc(sizeof(*sc));
     memset(sc, 0, sizeof(*sc));
     list_init(&sc->msg_queue);
-    list_init(&sc->history_list);
+    histstore_init(&sc->history);
     sc->oid = oid;
     sc->sdir = -1;
+    stepcompress_reset_rate_stats(sc);
     return sc;
 }
 
@@ -260,10 +528,94 @@ stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                   , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag)
 {
     sc->max_error = max_error;
+    if (sc->search_error < max_error)
+        sc->search_error = max_error;
     sc->queue_step_msgtag = queue_step_msgtag;
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
 }
 
+// Enable use of the mcu's queue_step2 command
+void __visible
+stepcompress_set_queue_step2(struct stepcompress *sc
+                             , int32_t queue_step2_msgtag)
+{
+    sc->queue_step2_msgtag = queue_step2_msgtag;
+}
+
+// Enable use of the mcu's queue_step_dir command
+void __visible
+stepcompress_set_queue_step_dir(struct stepcompress *sc
+                                , int32_t queue_step_dir_msgtag)
+{
+    sc->queue_step_dir_msgtag = queue_step_dir_msgtag;
+}
+
+// Enable use of the mcu's queue_step_batch command
+void __visible
+stepcompress_set_queue_step_batch(struct stepcompress *sc
+                                  , int32_t queue_step_batch_msgtag)
+{
+    sc->queue_step_batch_msgtag = queue_step_batch_msgtag;
+}
+
+// Enable the adaptive step time error mode - the allowed error is
+// 'ratio' times the step interval (bounded by max_error and
+// adaptive_max_error)
+void __visible
+stepcompress_set_adaptive_error(struct stepcompress *sc, double ratio
+                                , uint32_t adaptive_max_error)
+{
+    sc->adaptive_ratio = ratio > 0. ? (uint32_t)(ratio * 65536. + .5) : 0;
+    sc->adaptive_max_error = adaptive_max_error;
+    sc->search_error = sc->max_error;
+    if (sc->adaptive_ratio && adaptive_max_error > sc->search_error)
+        sc->search_error = adaptive_max_error;
+}
+
+// Report the number of queue_step messages and their encoded size.
+// The 'adaptive_bytes' is the encoded size of the messages that only
+// cover their steps because of the additional adaptive mode error.
+// The step time queue is never shrunk, so 'queue_bytes' is also its
+// high-water mark.
+void __visible
+stepcompress_get_stats(struct stepcompress *sc
+                       , struct stepcompress_stats *stats)
+{
+    *stats = sc->stats;
+    stats->history_bytes = histstore_get_bytes(&sc->history);
+    stats->history_peak_bytes = histstore_get_peak_bytes(&sc->history);
+    stats->queue_bytes = (sc->queue_end - sc->queue) * sizeof(*sc->queue);
+}
+
+// Report the step interval, steps per move, and bytes per second
+// statistics of the steps generated since the last reset
+void __visible
+stepcompress_get_rate_stats(struct stepcompress *sc
+                            , struct stepcompress_rate_stats *stats)
+{
+    *stats = sc->rate_stats;
+    if (sc->rate_window_bytes > stats->max_window_bytes)
+        // Include the current (partial) window
+        stats->max_window_bytes = sc->rate_window_bytes;
+}
+
+// Clear the step rate statistics
+void __visible
+stepcompress_reset_rate_stats(struct stepcompress *sc)
+{
+    memset(&sc->rate_stats, 0, sizeof(sc->rate_stats));
+    sc->rate_stats.min_interval = UINT32_MAX;
+    sc->rate_window_end = 0;
+    sc->rate_window_bytes = 0;
+}
+
+// Set the maximum memory used to store the history of step commands
+void __visible
+stepcompress_set_history_limit(struct stepcompress *sc, size_t max_bytes)
+{
+    histstore_set_limit(&sc->history, max_bytes);
+}
+
 // Set the inverted stepper direction flag
 void __visible
 stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
@@ -276,20 +628,6 @@ stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
     }
 }
 
-// Helper to free items from the history_list
-static void
-free_history(struct stepcompress *sc, uint64_t end_clock)
-{
-    while (!list_empty(&sc->history_list)) {
-        struct history_steps *hs = list_last_entry(
-            &sc->history_list, struct history_steps, node);
-        if (hs->last_clock > end_clock)
-            break;
-        list_del(&hs->node);
-        free(hs);
-    }
-}
-
 // Expire the stepcompress history older than the given clock
 static void
 stepcompress_history_expire(struct stepcompress *sc, uint64_t end_clock)
@@ -305,7 +643,7 @@ stepcompress_free(struct stepcompress *sc)
         return;
     free(sc->queue);
     message_queue_free(&sc->msg_queue);
-    free_history(sc, UINT64_MAX);
+    histstore_free(&sc->history);
     free(sc);
 }
 
@@ -342,35 +680,191 @@ stepcompress_set_time(struct stepcompress *sc
 // Maximium clock delta between messages in the queue
 #define CLOCK_DIFF_MAX (3<<28)
 
-// Helper to create a queue_step command from a 'struct step_move'
+// Encode the pending batch moves as a queue_step_batch command.  The
+// interval of each move is sent as the difference from the interval
+// that would follow the steps of the previous move.  Returns the
+// encoded length (or -1 if the moves do not fit in a message).
+static int
+batch_encode(struct stepcompress *sc, uint8_t *msg)
+{
+    uint32_t hdr[2] = { sc->queue_step_batch_msgtag, sc->oid };
+    int hdr_len = msgblock_encode_ints(msg, MESSAGE_PAYLOAD_MAX, hdr, 2);
+    if (hdr_len < 0)
+        return -1;
+    uint8_t *p = &msg[hdr_len + 1], *end = &msg[MESSAGE_PAYLOAD_MAX];
+    uint32_t interval = 0;
+    int i;
+    for (i=0; i<sc->batch_count; i++) {
+        struct step_move *m = &sc->batch_moves[i];
+        uint32_t data[3] = { m->interval - interval, m->count, m->add };
+        int len = msgblock_encode_ints(p, end - p, data, 3);
+        if (len < 0)
+            return -1;
+        p += len;
+        interval = m->interval + (int32_t)m->add * m->count;
+    }
+    msg[hdr_len] = p - &msg[hdr_len + 1];
+    return p - msg;
+}
+
+// Try to combine a move with the stepper's pending queue_step command
+// (returns the number of bytes added or -1 if it can not be combined)
+static int
+batch_append(struct stepcompress *sc, struct step_move *move)
+{
+    struct queue_message *qm = sc->batch_qm;
+    if (!qm || sc->batch_count >= sc->batch_max)
+        return -1;
+    sc->batch_moves[sc->batch_count++] = *move;
+    uint8_t msg[MESSAGE_PAYLOAD_MAX];
+    int len = batch_encode(sc, msg);
+    if (len < 0) {
+        sc->batch_count--;
+        sc->batch_qm = NULL;
+        return -1;
+    }
+    int added = len - qm->len;
+    memcpy(qm->msg, msg, len);
+    qm->len = len;
+    qm->move_count = sc->batch_count;
+    // All the move queue entries of the batch are tracked as becoming
+    // available when the entry of the newest move does
+    qm->min_clock = sc->last_step_clock;
+    return added;
+}
+
+// Queue a set_next_step_dir command for the current direction
 static void
+queue_dir_msg(struct stepcompress *sc)
+{
+    uint32_t msg[3] = {
+        sc->set_next_step_dir_msgtag, sc->oid, sc->sdir ^ sc->invert_sdir
+    };
+    struct queue_message *qm = message_pool_alloc_and_encode(sc->msg_pool
+                                                             , msg, 3);
+    qm->req_clock = sc->last_step_clock;
+    list_add_tail(&qm->node, &sc->msg_queue);
+    sc->batch_qm = NULL;
+}
+
+// Return the histogram bucket (the floor of log2) of a value
+static int
+rate_stats_bucket(uint64_t val)
+{
+    int bucket = val ? 63 - __builtin_clzll(val) : 0;
+    return bucket < STEP_STATS_BUCKETS ? bucket : STEP_STATS_BUCKETS - 1;
+}
+
+// Note the bytes sent in one second windows of step activity
+static void
+rate_stats_window(struct stepcompress *sc, uint64_t clock, int len)
+{
+    struct stepcompress_rate_stats *rs = &sc->rate_stats;
+    if (clock >= sc->rate_window_end) {
+        if (sc->rate_window_bytes) {
+            rs->bytes_hist[rate_stats_bucket(sc->rate_window_bytes)]++;
+            if (sc->rate_window_bytes > rs->max_window_bytes)
+                rs->max_window_bytes = sc->rate_window_bytes;
+        }
+        sc->rate_window_end = clock + (uint64_t)sc->mcu_freq;
+        sc->rate_window_bytes = 0;
+    }
+    sc->rate_window_bytes += len;
+}
+
+// Update the step interval and steps per move statistics
+static void
+rate_stats_add(struct stepcompress *sc, uint64_t first_clock
+               , uint64_t last_clock, struct step_move *move, int len)
+{
+    struct stepcompress_rate_stats *rs = &sc->rate_stats;
+    int count = move->count;
+    rs->step_count += count;
+    rs->move_count++;
+    rs->msg_bytes += len;
+    // The histogram uses the average step interval of the move
+    uint64_t avg_interval = move->interval;
+    if (count > 1)
+        avg_interval = (last_clock - first_clock) / (count - 1);
+    rs->interval_hist[rate_stats_bucket(avg_interval)] += count;
+    rs->count_hist[rate_stats_bucket(count)]++;
+    // The shortest interval is at the start or end of the move
+    int64_t n = count - 1;
+    int64_t last_interval = (move->interval + move->add * n
+                             + move->add2 * n * (n - 1) / 2);
+    if (move->interval < rs->min_interval)
+        rs->min_interval = move->interval;
+    if (last_interval > 0 && last_interval < rs->min_interval)
+        rs->min_interval = last_interval;
+    rate_stats_window(sc, first_clock, len);
+}
+
+// Helper to create a queue_step command from a 'struct step_move'
+// (returns the encoded length of the message)
+static int
 add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
 {
     int32_t addfactor = move->count*(move->count-1)/2;
     uint32_t ticks = move->add*addfactor + move->interval*(move->count-1);
+    if (move->add2)
+        ticks += ((int64_t)addfactor * (move->count-2) / 3) * move->add2;
     uint64_t last_clock = first_clock + ticks;
 
-    // Create and queue a queue_step command
-    uint32_t msg[5] = {
-        sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
-    };
-    struct queue_message *qm = message_alloc_and_encode(msg, 5);
-    qm->min_clock = qm->req_clock = sc->last_step_clock;
-    if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
-        qm->req_clock = first_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
+    // A pending direction change is sent with the queue_step_dir
+    // command (queue_step2 needs a separate set_next_step_dir)
+    int send_dir = sc->pending_dir;
+    sc->pending_dir = 0;
+    if (send_dir && move->add2) {
+        queue_dir_msg(sc);
+        send_dir = 0;
+    }
+
+    // Moves are combined into a queue_step_batch command while the
+    // stepper's previous queue_step command has not been transmitted
+    int is_far = (move->count == 1
+                  && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX);
+    int can_batch = (sc->queue_step_batch_msgtag && !move->add2 && !is_far
+                     && !send_dir);
+    int len = can_batch ? batch_append(sc, move) : -1;
+    if (len < 0) {
+        // Create and queue a queue_step command
+        uint32_t msg[6] = {
+            sc->queue_step_msgtag, sc->oid, move->interval, move->count
+            , move->add, move->add2
+        };
+        if (move->add2) {
+            msg[0] = sc->queue_step2_msgtag;
+        } else if (send_dir) {
+            msg[0] = sc->queue_step_dir_msgtag;
+            msg[5] = sc->sdir ^ sc->invert_sdir;
+        }
+        struct queue_message *qm = message_pool_alloc_and_encode(
+            sc->msg_pool, msg, move->add2 || send_dir ? 6 : 5);
+        qm->min_clock = qm->req_clock = sc->last_step_clock;
+        qm->move_count = 1;
+        if (is_far)
+            qm->req_clock = first_clock;
+        list_add_tail(&qm->node, &sc->msg_queue);
+        sc->batch_qm = can_batch ? qm : NULL;
+        sc->batch_moves[0] = *move;
+        sc->batch_count = 1;
+        sc->stats.msg_count++;
+        len = qm->len;
+    }
     sc->last_step_clock = last_clock;
+    sc->stats.msg_bytes += len;
+    rate_stats_add(sc, first_clock, last_clock, move, len);
 
     // Create and store move in history tracking
-    struct history_steps *hs = malloc(sizeof(*hs));
-    hs->first_clock = first_clock;
-    hs->last_clock = last_clock;
-    hs->start_position = sc->last_position;
-    hs->interval = move->interval;
-    hs->add = move->add;
-    hs->step_count = sc->sdir ? move->count : -move->count;
-    sc->last_position += hs->step_count;
-    list_add_head(&hs->node, &sc->history_list);
+    struct history_steps hs = {
+        .first_clock = first_clock, .last_clock = last_clock,
+        .start_position = sc->last_position, .interval = move->interval,
+        .add = move->add, .add2 = move->add2,
+        .step_count = sc->sdir ? move->count : -move->count,
+    };
+    history_add(sc, &hs);
+    sc->last_position += hs.step_count;
+    return len;
 }
 
 // Convert previously scheduled steps into commands for the mcu
@@ -380,12 +874,15 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
     if (sc->queue_pos >= sc->queue_next)
         return 0;
     while (sc->last_step_clock < move_clock) {
-        struct step_move move = compress_bisect_add(sc);
+        struct step_move move = compress_step_move(sc);
         int ret = check_line(sc, move);
         if (ret)
             return ret;
 
-        add_move(sc, sc->last_step_clock + move.interval, &move);
+        int adaptive = sc->adaptive_ratio && check_adaptive_line(sc, move);
+        int len = add_move(sc, sc->last_step_clock + move.interval, &move);
+        if (adaptive)
+            sc->stats.adaptive_bytes += len;
 
         if (sc->queue_pos + move.count >= sc->queue_next) {
             sc->queue_pos = sc->queue_next = sc->queue;
@@ -401,7 +898,7 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
 static int
 stepcompress_flush_far(struct stepcompress *sc, uint64_t abs_step_clock)
 {
-    struct step_move move = { abs_step_clock - sc->last_step_clock, 1, 0 };
+    struct step_move move = { abs_step_clock - sc->last_step_clock, 1, 0, 0 };
     add_move(sc, abs_step_clock, &move);
     calc_last_step_print_time(sc);
     return 0;
@@ -417,12 +914,11 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
     if (ret)
         return ret;
     sc->sdir = sdir;
-    uint32_t msg[3] = {
-        sc->set_next_step_dir_msgtag, sc->oid, sdir ^ sc->invert_sdir
-    };
-    struct queue_message *qm = message_alloc_and_encode(msg, 3);
-    qm->req_clock = sc->last_step_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
+    if (sc->queue_step_dir_msgtag)
+        // Send the direction with the next queue_step command
+        sc->pending_dir = 1;
+    else
+        queue_dir_msg(sc);
     return 0;
 }
 
@@ -529,6 +1025,50 @@ stepcompress_append(struct stepcompress *sc, int sdir
     return 0;
 }
 
+// Add a series of step times that all move in the same direction.
+// The step times must be in increasing order.
+int
+stepcompress_append_batch(struct stepcompress *sc, int sdir
+                          , double print_time, const double *step_times
+                          , int count)
+{
+    // Direction changes and step rollback use the standard path
+    int i = 0;
+    while (i < count) {
+        int ret = stepcompress_append(sc, sdir, print_time, step_times[i++]);
+        if (ret)
+            return ret;
+        if (sc->next_step_clock)
+            break;
+    }
+    while (i < count) {
+        // Pending step can no longer be rolled back - add it to the queue
+        int ret = queue_append(sc);
+        if (ret)
+            return ret;
+        // Convert step times to clocks (the last step is kept pending)
+        uint32_t *qn = sc->queue_next;
+        int n = count - 1 - i, room = sc->queue_end - qn;
+        if (n > room)
+            n = room;
+        double offset = print_time - sc->last_step_print_time;
+        double mcu_freq = sc->mcu_freq;
+        uint64_t lsc = sc->last_step_clock;
+        if (n > 0 && (step_times[i+n-1] + offset) * mcu_freq >= CLOCK_DIFF_MAX)
+            // Steps far in the future must be added one at a time
+            n = 0;
+        int j;
+        for (j=0; j<n; j++)
+            qn[j] = lsc + (uint64_t)((step_times[i+j] + offset) * mcu_freq);
+        sc->queue_next = qn + n;
+        i += n;
+        sc->next_step_clock = lsc + (uint64_t)((step_times[i++] + offset)
+                                               * mcu_freq);
+        sc->next_step_dir = sdir;
+    }
+    return 0;
+}
+
 // Commit next pending step (ie, do not allow a rollback)
 int
 stepcompress_commit(struct stepcompress *sc)
@@ -573,12 +1113,12 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
         return ret;
     sc->last_position = last_position;
 
-    // Add a marker to the history list
-    struct history_steps *hs = malloc(sizeof(*hs));
-    memset(hs, 0, sizeof(*hs));
-    hs->first_clock = hs->last_clock = clock;
-    hs->start_position = last_position;
-    list_add_head(&hs->node, &sc->history_list);
+    // Add a marker to the history
+    struct history_steps hs = {
+        .first_clock = clock, .last_clock = clock,
+        .start_position = last_position,
+    };
+    history_add(sc, &hs);
     return 0;
 }
 
@@ -586,29 +1126,48 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
 int64_t __visible
 stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
 {
-    int64_t last_position = sc->last_position;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (clock < hs->first_clock) {
-            last_position = hs->start_position;
-            continue;
-        }
-        if (clock >= hs->last_clock)
-            return hs->start_position + hs->step_count;
-        int32_t interval = hs->interval, add = hs->add;
-        int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
-        if (!add) {
-            offset = ticks / interval;
-        } else {
-            // Solve for "count" using quadratic formula
-            double a = .5 * add, b = interval - .5 * add, c = -ticks;
-            offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
+    struct history_steps entries[HIST_BLOCK_STEPS];
+    uint32_t pos = history_find(sc, clock);
+    if (!pos) {
+        // Clock is before all entries in the history
+        if (!sc->history.count)
+            return sc->last_position;
+        history_decode_block(sc, 0, entries);
+        return entries[0].start_position;
+    }
+    // Newest entry that starts at or before the requested clock
+    int count = history_decode_block(sc, pos - 1, entries);
+    while (entries[count - 1].search_clock > clock)
+        count--;
+    struct history_steps *hs = &entries[count - 1];
+    if (clock >= hs->last_clock)
+        return hs->start_position + hs->step_count;
+    int32_t interval = hs->interval, add = hs->add;
+    int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
+    if (hs->add2) {
+        // Binary search for "count"
+        double add2 = hs->add2;
+        int32_t low = 0, high = abs(hs->step_count);
+        while (low < high) {
+            int32_t c = (low + high + 1) / 2;
+            double t = (interval * (double)c + add * .5 * c * (c - 1)
+                        + add2 / 6. * c * (c - 1) * (c - 2));
+            if (t <= ticks)
+                low = c;
+            else
+                high = c - 1;
         }
-        if (hs->step_count < 0)
-            return hs->start_position - offset;
-        return hs->start_position + offset;
+        offset = low;
+    } else if (!add) {
+        offset = ticks / interval;
+    } else {
+        // Solve for "count" using quadratic formula
+        double a = .5 * add, b = interval - .5 * add, c = -ticks;
+        offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
     }
-    return last_position;
+    if (hs->step_count < 0)
+        return hs->start_position - offset;
+    return hs->start_position + offset;
 }
 
 // Queue an mcu command to go out in order with stepper commands
@@ -619,9 +1178,11 @@ stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
     if (ret)
         return ret;
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
+    struct queue_message *qm = message_pool_alloc_and_encode(sc->msg_pool
+                                                             , data, len);
     qm->req_clock = sc->last_step_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
+    sc->batch_qm = NULL;
     return 0;
 }
 
@@ -634,9 +1195,45 @@ stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
     if (ret)
         return ret;
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
+    struct queue_message *qm = message_pool_alloc_and_encode(sc->msg_pool
+                                                             , data, len);
     qm->min_clock = qm->req_clock = req_clock;
+    qm->move_count = 1;
+    list_add_tail(&qm->node, &sc->msg_queue);
+    sc->batch_qm = NULL;
+    return 0;
+}
+
+// Queue an mcu command ending in a buffer parameter that will consume
+// 'move_count' entries in the mcu move queue (all of which become
+// available again at 'done_clock')
+int __visible
+stepcompress_queue_mq_buffer(struct stepcompress *sc, uint64_t req_clock
+                             , uint64_t done_clock, int move_count
+                             , uint32_t *data, int len
+                             , uint8_t *buf, int buf_len)
+{
+    int ret = stepcompress_flush(sc, UINT64_MAX);
+    if (ret)
+        return ret;
+
+    uint8_t msg[MESSAGE_PAYLOAD_MAX];
+    int hdr_len = msgblock_encode_ints(msg, sizeof(msg), data, len);
+    if (hdr_len < 0 || buf_len < 0 || hdr_len + 1 + buf_len > sizeof(msg)
+        || move_count < 1 || done_clock < req_clock) {
+        errorf("stepcompress o=%d invalid mq buffer msg", sc->oid);
+        return ERROR_RET;
+    }
+    msg[hdr_len] = buf_len;
+    memcpy(&msg[hdr_len + 1], buf, buf_len);
+    struct queue_message *qm = message_pool_alloc(sc->msg_pool);
+    memcpy(qm->msg, msg, hdr_len + 1 + buf_len);
+    qm->len = hdr_len + 1 + buf_len;
+    qm->req_clock = req_clock;
+    qm->min_clock = done_clock;
+    qm->move_count = move_count;
     list_add_tail(&qm->node, &sc->msg_queue);
+    sc->batch_qm = NULL;
     return 0;
 }
 
@@ -645,21 +1242,35 @@ int __visible
 stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
                          , int max, uint64_t start_clock, uint64_t end_clock)
 {
-    int res = 0;
-    struct history_steps *hs;
-    list_for_each_entry(hs, &sc->history_list, node) {
-        if (start_clock >= hs->last_clock || res >= max)
-            break;
-        if (end_clock <= hs->first_clock)
-            continue;
-        p->first_clock = hs->first_clock;
-        p->last_clock = hs->last_clock;
-        p->start_position = hs->start_position;
-        p->step_count = hs->step_count;
-        p->interval = hs->interval;
-        p->add = hs->add;
-        p++;
-        res++;
+    int res = 0, skip = start_clock < end_clock;
+    struct history_steps entries[HIST_BLOCK_STEPS];
+    // Skip newer entries that all start at or after end_clock
+    uint32_t pos = sc->history.count;
+    if (skip)
+        pos = history_find(sc, end_clock - 1);
+    while (pos--) {
+        int i = history_decode_block(sc, pos, entries);
+        if (skip) {
+            while (entries[i - 1].search_clock > end_clock - 1)
+                i--;
+            skip = 0;
+        }
+        while (i--) {
+            struct history_steps *hs = &entries[i];
+            if (start_clock >= hs->last_clock || res >= max)
+                return res;
+            if (end_clock <= hs->first_clock)
+                continue;
+            p->first_clock = hs->first_clock;
+            p->last_clock = hs->last_clock;
+            p->start_position = hs->start_position;
+            p->step_count = hs->step_count;
+            p->interval = hs->interval;
+            p->add = hs->add;
+            p->add2 = hs->add2;
+            p++;
+            res++;
+        }
     }
     return res;
 }
@@ -701,6 +1312,13 @@ steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
     ss->sc_list = malloc(sizeof(*sc_list)*sc_num);
     memcpy(ss->sc_list, sc_list, sizeof(*sc_list)*sc_num);
     ss->sc_num = sc_num;
+    struct message_pool *mp = serialqueue_get_message_pool(sq);
+    int i;
+    for (i=0; i<sc_num; i++) {
+        sc_list[i]->msg_pool = mp;
+        sc_list[i]->batch_max = (move_num < BATCH_MAX_MOVES
+                                 ? move_num : BATCH_MAX_MOVES);
+    }
 
     ss->move_clocks = malloc(sizeof(*ss->move_clocks)*move_num);
     memset(ss->move_clocks, 0, sizeof(*ss->move_clocks)*move_num);
@@ -748,10 +1366,9 @@ steppersync_history_expire(struct steppersync *ss, uint64_t end_clock)
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
-heap_replace(struct steppersync *ss, uint64_t req_clock)
+heap_sift_down(uint64_t *mc, int nmc, uint64_t req_clock)
 {
-    uint64_t *mc = ss->move_clocks;
-    int nmc = ss->num_move_clocks, pos = 0;
+    int pos = 0;
     for (;;) {
         int child1_pos = 2*pos+1, child2_pos = 2*pos+2;
         uint64_t child2_clock = child2_pos < nmc ? mc[child2_pos] : UINT64_MAX;
@@ -770,6 +1387,38 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+// Replace the next available 'struct move' with one that becomes
+// available at 'req_clock'
+static void
+heap_replace(struct steppersync *ss, uint64_t req_clock)
+{
+    heap_sift_down(ss->move_clocks, ss->num_move_clocks, req_clock);
+}
+
+// Replace the next 'count' available 'struct move' entries with ones
+// that become available at 'req_clock'.  Returns the time the last of
+// the replaced entries becomes available.
+static uint64_t
+heap_replace_multi(struct steppersync *ss, uint64_t req_clock, int count)
+{
+    uint64_t *mc = ss->move_clocks, last_clock = 0;
+    int nmc = ss->num_move_clocks, i;
+    for (i=0; i<count; i++) {
+        last_clock = mc[0];
+        nmc--;
+        heap_sift_down(mc, nmc, mc[nmc]);
+    }
+    for (i=0; i<count; i++) {
+        int pos = nmc++;
+        while (pos && mc[(pos-1)/2] > req_clock) {
+            mc[pos] = mc[(pos-1)/2];
+            pos = (pos-1)/2;
+        }
+        mc[pos] = req_clock;
+    }
+    return last_clock;
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
 int __visible
 steppersync_flush(struct steppersync *ss, uint64_t move_clock
@@ -790,6 +1439,7 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
         // Find message with lowest reqclock
         uint64_t req_clock = MAX_CLOCK;
         struct queue_message *qm = NULL;
+        struct stepcompress *qsc = NULL;
         for (i=0; i<ss->sc_num; i++) {
             struct stepcompress *sc = ss->sc_list[i];
             if (!list_empty(&sc->msg_queue)) {
@@ -797,6 +1447,7 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
                     &sc->msg_queue, struct queue_message, node);
                 if (m->req_clock < req_clock) {
                     qm = m;
+                    qsc = sc;
                     req_clock = m->req_clock;
                 }
             }
@@ -805,15 +1456,22 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
             break;
 
         uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
-            heap_replace(ss, qm->min_clock);
+            if (qm->move_count > 1)
+                next_avail = heap_replace_multi(ss, qm->min_clock
+                                                , qm->move_count);
+            else
+                heap_replace(ss, qm->min_clock);
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
         // Batch this command
+        if (qsc->batch_qm == qm)
+            qsc->batch_qm = NULL;
         list_del(&qm->node);
         list_add_tail(&qm->node, &msgs);
     }
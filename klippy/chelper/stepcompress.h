@@ -1,27 +1,61 @@
 #ifndef STEPCOMPRESS_H
 #define STEPCOMPRESS_H
 
+#include <stddef.h> // size_t
 #include <stdint.h> // uint32_t
 
 #define ERROR_RET -989898989
 
+struct stepcompress_stats {
+    uint64_t msg_count, msg_bytes, adaptive_bytes, history_bytes;
+    uint64_t history_peak_bytes, queue_bytes;
+};
+
+#define STEP_STATS_BUCKETS 32
+
+struct stepcompress_rate_stats {
+    uint64_t step_count, move_count, msg_bytes;
+    uint32_t min_interval, max_window_bytes;
+    // Histograms - bucket N counts values from 2^N to 2^(N+1)-1
+    uint32_t interval_hist[STEP_STATS_BUCKETS];
+    uint32_t count_hist[STEP_STATS_BUCKETS];
+    uint32_t bytes_hist[STEP_STATS_BUCKETS];
+};
+
 struct pull_history_steps {
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
 };
 
 struct stepcompress *stepcompress_alloc(uint32_t oid);
 void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                        , int32_t queue_step_msgtag
                        , int32_t set_next_step_dir_msgtag);
+void stepcompress_set_queue_step2(struct stepcompress *sc
+                                  , int32_t queue_step2_msgtag);
+void stepcompress_set_queue_step_dir(struct stepcompress *sc
+                                     , int32_t queue_step_dir_msgtag);
+void stepcompress_set_queue_step_batch(struct stepcompress *sc
+                                       , int32_t queue_step_batch_msgtag);
 void stepcompress_set_invert_sdir(struct stepcompress *sc
                                   , uint32_t invert_sdir);
+void stepcompress_set_adaptive_error(struct stepcompress *sc, double ratio
+                                     , uint32_t adaptive_max_error);
+void stepcompress_get_stats(struct stepcompress *sc
+                            , struct stepcompress_stats *stats);
+void stepcompress_set_history_limit(struct stepcompress *sc, size_t max_bytes);
+void stepcompress_get_rate_stats(struct stepcompress *sc
+                                 , struct stepcompress_rate_stats *stats);
+void stepcompress_reset_rate_stats(struct stepcompress *sc);
 void stepcompress_free(struct stepcompress *sc);
 uint32_t stepcompress_get_oid(struct stepcompress *sc);
 int stepcompress_get_step_dir(struct stepcompress *sc);
 int stepcompress_append(struct stepcompress *sc, int sdir
                         , double print_time, double step_time);
+int stepcompress_append_batch(struct stepcompress *sc, int sdir
+                              , double print_time, const double *step_times
+                              , int count);
 int stepcompress_commit(struct stepcompress *sc);
 int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
 int stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
@@ -31,6 +65,10 @@ int64_t stepcompress_find_past_position(struct stepcompress *sc
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
 int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
                               , uint32_t *data, int len);
+int stepcompress_queue_mq_buffer(struct stepcompress *sc, uint64_t req_clock
+                                 , uint64_t done_clock, int move_count
+                                 , uint32_t *data, int len
+                                 , uint8_t *buf, int buf_len);
 int stepcompress_extract_old(struct stepcompress *sc
                              , struct pull_history_steps *p, int max
                              , uint64_t start_clock, uint64_t end_clock);
@@ -0,0 +1,185 @@
+// Parallel step generation using a pool of worker threads
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The step times of each stepper only depend on that stepper's
+// stepper_kinematics, its stepcompress, and the (read-only) trapq
+// data.  This code distributes the steppers of a flush window across
+// a set of worker threads and waits for all of them to complete.
+// Gang followers that mirror their leader are generated by the
+// thread processing the leader.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // itersolve_gang_generate
+#include "pyhelper.h" // set_thread_scheduling
+#include "trapq.h" // trapq_check_sentinels
+
+struct stepgen_pool {
+    pthread_t *threads;
+    int num_threads, sched_priority;
+    uint64_t sched_cpu_mask;
+
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int must_exit, active_workers;
+    uint32_t job_seq;
+    int32_t result;
+    // Current job (only modified while no workers are active)
+    struct stepper_kinematics **sk_list;
+    int sk_num, sk_size, next_sk;
+    double flush_time;
+};
+
+// Generate steps for steppers from the current job until none remain
+static int32_t
+stepgen_run_jobs(struct stepgen_pool *sp)
+{
+    int32_t res = 0;
+    for (;;) {
+        int pos = __atomic_fetch_add(&sp->next_sk, 1, __ATOMIC_RELAXED);
+        if (pos >= sp->sk_num)
+            return res;
+        int32_t ret = itersolve_gang_generate(sp->sk_list[pos]
+                                              , sp->flush_time);
+        if (ret && !res)
+            res = ret;
+    }
+}
+
+// Main code for each worker thread
+static void *
+stepgen_worker(void *data)
+{
+    struct stepgen_pool *sp = data;
+    if (sp->sched_priority || sp->sched_cpu_mask)
+        set_thread_scheduling(sp->sched_priority, sp->sched_cpu_mask);
+    pthread_mutex_lock(&sp->lock);
+    uint32_t job_seq = 0;
+    for (;;) {
+        while (!sp->must_exit && sp->job_seq == job_seq)
+            pthread_cond_wait(&sp->cond, &sp->lock);
+        if (sp->must_exit)
+            break;
+        job_seq = sp->job_seq;
+        pthread_mutex_unlock(&sp->lock);
+
+        int32_t ret = stepgen_run_jobs(sp);
+
+        pthread_mutex_lock(&sp->lock);
+        if (ret && !sp->result)
+            sp->result = ret;
+        if (!--sp->active_workers)
+            pthread_cond_signal(&sp->done_cond);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+// Free memory associated with a 'stepgen_pool' object
+void __visible
+stepgen_pool_free(struct stepgen_pool *sp)
+{
+    if (!sp)
+        return;
+    pthread_mutex_lock(&sp->lock);
+    sp->must_exit = 1;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    int i;
+    for (i=0; i<sp->num_threads; i++)
+        pthread_join(sp->threads[i], NULL);
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->cond);
+    pthread_cond_destroy(&sp->done_cond);
+    free(sp->threads);
+    free(sp->sk_list);
+    free(sp);
+}
+
+// Allocate a new 'stepgen_pool' object with the given number of workers
+struct stepgen_pool * __visible
+stepgen_pool_alloc(int num_threads, int sched_priority
+                   , uint64_t sched_cpu_mask)
+{
+    struct stepgen_pool *sp = malloc(sizeof(*sp));
+    memset(sp, 0, sizeof(*sp));
+    sp->sched_priority = sched_priority;
+    sp->sched_cpu_mask = sched_cpu_mask;
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+    pthread_cond_init(&sp->done_cond, NULL);
+    sp->threads = malloc(sizeof(*sp->threads) * num_threads);
+    int i;
+    for (i=0; i<num_threads; i++) {
+        int ret = pthread_create(&sp->threads[i], NULL, stepgen_worker, sp);
+        if (ret) {
+            report_errno("pthread_create", ret);
+            break;
+        }
+        sp->num_threads++;
+    }
+    return sp;
+}
+
+// Generate steps for a list of steppers (run in parallel when possible)
+int32_t __visible
+stepgen_pool_generate(struct stepgen_pool *sp
+                      , struct stepper_kinematics **sk_list, int sk_num
+                      , double flush_time)
+{
+    // Update trapq sentinels so that worker threads only read trapq data
+    int i;
+    for (i=0; i<sk_num; i++) {
+        if (sk_list[i]->tq)
+            trapq_check_sentinels(sk_list[i]->tq);
+        itersolve_gang_prepare(sk_list[i]);
+    }
+
+    // Build list of steppers that are not handled by a gang leader
+    if (sk_num > sp->sk_size) {
+        sp->sk_list = realloc(sp->sk_list, sizeof(*sp->sk_list) * sk_num);
+        sp->sk_size = sk_num;
+    }
+    sp->sk_num = 0;
+    for (i=0; i<sk_num; i++)
+        if (!sk_list[i]->gang_mirror)
+            sp->sk_list[sp->sk_num++] = sk_list[i];
+    sp->next_sk = 0;
+    sp->flush_time = flush_time;
+    int32_t ret;
+    if (!sp->num_threads || sp->sk_num <= 1) {
+        ret = stepgen_run_jobs(sp);
+        goto done;
+    }
+
+    // Wake worker threads
+    pthread_mutex_lock(&sp->lock);
+    sp->result = 0;
+    sp->active_workers = sp->num_threads;
+    sp->job_seq++;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+
+    // Process steppers from this thread as well
+    ret = stepgen_run_jobs(sp);
+
+    // Wait for all workers to complete
+    pthread_mutex_lock(&sp->lock);
+    while (sp->active_workers)
+        pthread_cond_wait(&sp->done_cond, &sp->lock);
+    if (!ret)
+        ret = sp->result;
+    pthread_mutex_unlock(&sp->lock);
+
+done:
+    // Gang followers were generated along with their leader
+    for (i=0; i<sk_num; i++)
+        sk_list[i]->gang_mirror = 0;
+    return ret;
+}
@@ -1,25 +1,16 @@
 // Trapezoidal velocity movement queue
 //
-// Copyright (C) 2018-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <math.h> // sqrt
-#include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // unlikely
+#include "histstore.h" // histstore_reserve
 #include "trapq.h" // move_get_coord
 
-// Allocate a new 'move' object
-struct move *
-move_alloc(void)
-{
-    struct move *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
-}
-
 // Return the distance moved given a time in a move
 inline double
 move_get_distance(struct move *m, double move_time)
@@ -40,18 +31,327 @@ move_get_coord(struct move *m, double move_time)
 
 #define NEVER_TIME 9999999999999999.9
 
+
+/****************************************************************
+ * Move storage
+ ****************************************************************/
+
+#define MOVE_ARRAY_MIN 256
+
+// Add an empty move to the end of a move_array.  Note that this may
+// relocate the moves in the array.
+static struct move *
+move_array_push(struct move_array *ma)
+{
+    if (ma->last >= ma->alloc) {
+        int count = ma->last - ma->first;
+        if (count >= ma->alloc / 2) {
+            // Grow array
+            int new_alloc = ma->alloc ? ma->alloc * 2 : MOVE_ARRAY_MIN;
+            ma->moves = realloc(ma->moves, sizeof(*ma->moves) * new_alloc);
+            ma->alloc = new_alloc;
+        }
+        // Shift moves to the start of the array
+        memmove(ma->moves, &ma->moves[ma->first], sizeof(*ma->moves) * count);
+        ma->first = 0;
+        ma->last = count;
+        ma->reloc_count++;
+    }
+    struct move *m = &ma->moves[ma->last++];
+    memset(m, 0, sizeof(*m));
+    return m;
+}
+
+// Add a move to the end of the pending moves (just before the tail sentinel)
+static void
+add_before_tail(struct trapq *tq, struct move *m)
+{
+    struct move *tail_sentinel = move_array_push(&tq->moves);
+    struct move *pos = move_prev(tail_sentinel);
+    *tail_sentinel = *pos;
+    *pos = *m;
+}
+
+
+
+/****************************************************************
+ * Axis activity tracking
+ ****************************************************************/
+
+#define RANGE_ARRAY_MIN 16
+
+// Note movement on an axis between the given start and end times
+static void
+range_array_note(struct range_array *ra, double start, double end)
+{
+    if (ra->last > ra->first) {
+        struct active_range *r = &ra->ranges[ra->last - 1];
+        if (r->end >= start) {
+            // Extend the last range
+            if (end > r->end)
+                r->end = end;
+            return;
+        }
+    }
+    if (ra->last >= ra->alloc) {
+        int count = ra->last - ra->first;
+        if (count >= ra->alloc / 2) {
+            int new_alloc = ra->alloc ? ra->alloc * 2 : RANGE_ARRAY_MIN;
+            ra->ranges = realloc(ra->ranges, sizeof(*ra->ranges) * new_alloc);
+            ra->alloc = new_alloc;
+        }
+        memmove(ra->ranges, &ra->ranges[ra->first]
+                , sizeof(*ra->ranges) * count);
+        ra->first = 0;
+        ra->last = count;
+    }
+    struct active_range *r = &ra->ranges[ra->last++];
+    r->start = start;
+    r->end = end;
+}
+
+// Release the ranges that end before the given time
+static void
+range_array_expire(struct range_array *ra, double time)
+{
+    while (ra->last > ra->first && ra->ranges[ra->first].end <= time)
+        ra->first++;
+}
+
+// Return the start time of the first movement of the given axes
+// (bit 0 for x, bit 1 for y, bit 2 for z) that ends after 'time'
+double
+trapq_next_active(struct trapq *tq, int axis_flags, double time)
+{
+    double res = NEVER_TIME;
+    int axis;
+    for (axis=0; axis<3; axis++) {
+        if (!(axis_flags & (1 << axis)))
+            continue;
+        struct range_array *ra = &tq->active[axis];
+        int i;
+        for (i=ra->first; i<ra->last; i++) {
+            struct active_range *r = &ra->ranges[i];
+            if (r->end <= time)
+                continue;
+            if (r->start < res)
+                res = r->start;
+            break;
+        }
+    }
+    return res;
+}
+
+// Return the first pending move (starting from 'm') that ends after 'time'
+struct move *
+trapq_find_move(struct trapq *tq, struct move *m, double time)
+{
+    struct move *hi = &tq->moves.moves[tq->moves.last - 1];
+    while (m < hi) {
+        struct move *mid = m + (hi - m) / 2;
+        if (mid->print_time + mid->move_t > time)
+            hi = mid;
+        else
+            m = mid + 1;
+    }
+    return m;
+}
+
+
+/****************************************************************
+ * Move history
+ ****************************************************************/
+
+// Expired moves are stored in a compact form.  Each move is encoded
+// relative to the previous move in its block - a start time, start
+// position, direction, or velocity that follows from the previous
+// move is not stored.
+
+enum {
+    HF_TIME = 1<<0, HF_POS = 1<<1, HF_AXES = 1<<2,
+    HF_SV_ZERO = 1<<3, HF_SV_PREV = 1<<4,
+    HF_HA_ZERO = 1<<5, HF_HA_PREV = 1<<6, HF_HA_NEG = 1<<7,
+};
+
+#define HIST_MOVE_MAX_SIZE (1 + 10 * sizeof(double))
+#define HIST_MOVE_MIN_SIZE (1 + sizeof(double))
+#define HIST_BLOCK_MOVES (HIST_BLOCK_SIZE / HIST_MOVE_MIN_SIZE)
+
+// Predict the start time and position of the move following 'prev'.
+// The same (non-inlined) code is used when encoding and decoding so
+// that the results are identical.
+static noinline void
+history_predict(struct move *prev, struct move *pred)
+{
+    pred->print_time = prev->print_time + prev->move_t;
+    pred->start_pos = move_get_coord(prev, prev->move_t);
+}
+
+static inline int
+coord_equal(struct coord *a, struct coord *b)
+{
+    return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+// Decode a move that follows 'prev'
+static uint8_t *
+history_decode(uint8_t *p, struct move *prev, struct move *m)
+{
+    struct move pred;
+    history_predict(prev, &pred);
+    uint8_t flags = *p++;
+    m->move_t = hist_get_double(&p);
+    m->print_time = flags & HF_TIME ? pred.print_time : hist_get_double(&p);
+    if (flags & HF_POS) {
+        m->start_pos = pred.start_pos;
+    } else {
+        m->start_pos.x = hist_get_double(&p);
+        m->start_pos.y = hist_get_double(&p);
+        m->start_pos.z = hist_get_double(&p);
+    }
+    if (flags & HF_AXES) {
+        m->axes_r = prev->axes_r;
+    } else {
+        m->axes_r.x = hist_get_double(&p);
+        m->axes_r.y = hist_get_double(&p);
+        m->axes_r.z = hist_get_double(&p);
+    }
+    if (flags & HF_SV_ZERO)
+        m->start_v = 0.;
+    else if (flags & HF_SV_PREV)
+        m->start_v = prev->start_v;
+    else
+        m->start_v = hist_get_double(&p);
+    if (flags & HF_HA_ZERO)
+        m->half_accel = 0.;
+    else if (flags & HF_HA_PREV)
+        m->half_accel = prev->half_accel;
+    else if (flags & HF_HA_NEG)
+        m->half_accel = -prev->half_accel;
+    else
+        m->half_accel = hist_get_double(&p);
+    return p;
+}
+
+// Decode all the moves in a history block
+static int
+history_decode_block(struct hist_block *b, struct move *moves)
+{
+    struct move prev;
+    memset(&prev, 0, sizeof(prev));
+    uint8_t *p = b->data;
+    int i;
+    for (i=0; i<b->count; i++) {
+        p = history_decode(p, &prev, &moves[i]);
+        prev = moves[i];
+    }
+    return b->count;
+}
+
+// Add a move to the end of the history
+static void
+history_add(struct trapq *tq, struct move *m)
+{
+    struct hist_block *b = histstore_reserve(&tq->history
+                                             , HIST_MOVE_MAX_SIZE);
+    struct move *prev = &tq->history_last, pred;
+    if (!b->count) {
+        memset(prev, 0, sizeof(*prev));
+        b->start.time = b->end.time = m->print_time;
+    }
+    history_predict(prev, &pred);
+    uint8_t *start = &b->data[b->len], *p = start + 1, flags = 0;
+    p = hist_put_double(p, m->move_t);
+    if (m->print_time == pred.print_time)
+        flags |= HF_TIME;
+    else
+        p = hist_put_double(p, m->print_time);
+    if (coord_equal(&m->start_pos, &pred.start_pos)) {
+        flags |= HF_POS;
+    } else {
+        p = hist_put_double(p, m->start_pos.x);
+        p = hist_put_double(p, m->start_pos.y);
+        p = hist_put_double(p, m->start_pos.z);
+    }
+    if (coord_equal(&m->axes_r, &prev->axes_r)) {
+        flags |= HF_AXES;
+    } else {
+        p = hist_put_double(p, m->axes_r.x);
+        p = hist_put_double(p, m->axes_r.y);
+        p = hist_put_double(p, m->axes_r.z);
+    }
+    if (!m->start_v)
+        flags |= HF_SV_ZERO;
+    else if (m->start_v == prev->start_v)
+        flags |= HF_SV_PREV;
+    else
+        p = hist_put_double(p, m->start_v);
+    if (!m->half_accel)
+        flags |= HF_HA_ZERO;
+    else if (m->half_accel == prev->half_accel)
+        flags |= HF_HA_PREV;
+    else if (m->half_accel == -prev->half_accel)
+        flags |= HF_HA_NEG;
+    else
+        p = hist_put_double(p, m->half_accel);
+    *start = flags;
+    b->len = p - b->data;
+    b->count++;
+    double end_time = m->print_time + m->move_t;
+    if (end_time > b->end.time)
+        b->end.time = end_time;
+    // Track the move exactly as it will be decoded
+    struct move last;
+    history_decode(start, prev, &last);
+    *prev = last;
+}
+
+// Remove history moves that start at or after the given time
+static void
+history_prune(struct trapq *tq, double print_time)
+{
+    struct histstore *hist = &tq->history;
+    struct move moves[HIST_BLOCK_MOVES];
+    while (hist->count) {
+        struct hist_block *b = histstore_get(hist, hist->count - 1);
+        if (b->start.time >= print_time) {
+            histstore_expire_newest(hist);
+            continue;
+        }
+        int count = history_decode_block(b, moves);
+        while (count) {
+            struct move *m = &moves[count - 1];
+            if (m->print_time < print_time) {
+                if (m->print_time + m->move_t > print_time)
+                    m->move_t = print_time - m->print_time;
+                break;
+            }
+            count--;
+        }
+        // Encode the remaining moves of the block again
+        b->count = b->len = 0;
+        int i;
+        for (i=0; i<count; i++)
+            history_add(tq, &moves[i]);
+        break;
+    }
+}
+
+
+/****************************************************************
+ * Trapezoid queue
+ ****************************************************************/
+
 // Allocate a new 'trapq' object
 struct trapq * __visible
 trapq_alloc(void)
 {
     struct trapq *tq = malloc(sizeof(*tq));
     memset(tq, 0, sizeof(*tq));
-    list_init(&tq->moves);
-    list_init(&tq->history);
-    struct move *head_sentinel = move_alloc(), *tail_sentinel = move_alloc();
+    histstore_init(&tq->history);
+    move_array_push(&tq->moves);
+    struct move *tail_sentinel = move_array_push(&tq->moves);
     tail_sentinel->print_time = tail_sentinel->move_t = NEVER_TIME;
-    list_add_head(&head_sentinel->node, &tq->moves);
-    list_add_tail(&tail_sentinel->node, &tq->moves);
     return tq;
 }
 
@@ -59,16 +359,11 @@ trapq_alloc(void)
 void __visible
 trapq_free(struct trapq *tq)
 {
-    while (!list_empty(&tq->moves)) {
-        struct move *m = list_first_entry(&tq->moves, struct move, node);
-        list_del(&m->node);
-        free(m);
-    }
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
-        list_del(&m->node);
-        free(m);
-    }
+    free(tq->moves.moves);
+    histstore_free(&tq->history);
+    int axis;
+    for (axis=0; axis<3; axis++)
+        free(tq->active[axis].ranges);
     free(tq);
 }
 
@@ -76,12 +371,12 @@ trapq_free(struct trapq *tq)
 void
 trapq_check_sentinels(struct trapq *tq)
 {
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
+    struct move *tail_sentinel = &tq->moves.moves[tq->moves.last - 1];
     if (tail_sentinel->print_time)
         // Already up to date
         return;
-    struct move *m = list_prev_entry(tail_sentinel, node);
-    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
+    struct move *m = move_prev(tail_sentinel);
+    struct move *head_sentinel = trapq_first_move(tq);
     if (m == head_sentinel) {
         // No moves at all on this list
         tail_sentinel->print_time = NEVER_TIME;
@@ -94,25 +389,30 @@ trapq_check_sentinels(struct trapq *tq)
 #define MAX_NULL_MOVE 1.0
 
 // Add a move to the trapezoid velocity queue
-void
+static void
 trapq_add_move(struct trapq *tq, struct move *m)
 {
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
-    struct move *prev = list_prev_entry(tail_sentinel, node);
+    struct move *prev = &tq->moves.moves[tq->moves.last - 2];
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
-        struct move *null_move = move_alloc();
-        null_move->start_pos = m->start_pos;
+        struct move null_move;
+        memset(&null_move, 0, sizeof(null_move));
+        null_move.start_pos = m->start_pos;
         if (!prev->print_time && m->print_time > MAX_NULL_MOVE)
             // Limit the first null move to improve numerical stability
-            null_move->print_time = m->print_time - MAX_NULL_MOVE;
+            null_move.print_time = m->print_time - MAX_NULL_MOVE;
         else
-            null_move->print_time = prev->print_time + prev->move_t;
-        null_move->move_t = m->print_time - null_move->print_time;
-        list_add_before(&null_move->node, &tail_sentinel->node);
+            null_move.print_time = prev->print_time + prev->move_t;
+        null_move.move_t = m->print_time - null_move.print_time;
+        add_before_tail(tq, &null_move);
     }
-    list_add_before(&m->node, &tail_sentinel->node);
-    tail_sentinel->print_time = 0.;
+    add_before_tail(tq, m);
+    tq->moves.moves[tq->moves.last - 1].print_time = 0.;
+    int axis;
+    for (axis=0; axis<3; axis++)
+        if (m->axes_r.axis[axis])
+            range_array_note(&tq->active[axis], m->print_time
+                             , m->print_time + m->move_t);
 }
 
 // Fill and add a move to the trapezoid velocity queue
@@ -125,41 +425,38 @@ trapq_append(struct trapq *tq, double print_time
 {
     struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
     struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    struct move m;
+    memset(&m, 0, sizeof(m));
+    m.axes_r = axes_r;
     if (accel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = accel_t;
-        m->start_v = start_v;
-        m->half_accel = .5 * accel;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.print_time = print_time;
+        m.move_t = accel_t;
+        m.start_v = start_v;
+        m.half_accel = .5 * accel;
+        m.start_pos = start_pos;
+        trapq_add_move(tq, &m);
 
         print_time += accel_t;
-        start_pos = move_get_coord(m, accel_t);
+        start_pos = move_get_coord(&m, accel_t);
     }
     if (cruise_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = cruise_t;
-        m->start_v = cruise_v;
-        m->half_accel = 0.;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.print_time = print_time;
+        m.move_t = cruise_t;
+        m.start_v = cruise_v;
+        m.half_accel = 0.;
+        m.start_pos = start_pos;
+        trapq_add_move(tq, &m);
 
         print_time += cruise_t;
-        start_pos = move_get_coord(m, cruise_t);
+        start_pos = move_get_coord(&m, cruise_t);
     }
     if (decel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = decel_t;
-        m->start_v = cruise_v;
-        m->half_accel = -.5 * accel;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.print_time = print_time;
+        m.move_t = decel_t;
+        m.start_v = cruise_v;
+        m.half_accel = -.5 * accel;
+        m.start_pos = start_pos;
+        trapq_add_move(tq, &m);
     }
 }
 
@@ -168,34 +465,35 @@ void __visible
 trapq_finalize_moves(struct trapq *tq, double print_time
                      , double clear_history_time)
 {
-    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
+    struct move_array *ma = &tq->moves;
+    struct move *tail_sentinel = &ma->moves[ma->last - 1];
     // Move expired moves from main "moves" list to "history" list
+    int first = ma->first;
     for (;;) {
-        struct move *m = list_next_entry(head_sentinel, node);
+        struct move *m = &ma->moves[first + 1];
         if (m == tail_sentinel) {
             tail_sentinel->print_time = NEVER_TIME;
             break;
         }
         if (m->print_time + m->move_t > print_time)
             break;
-        list_del(&m->node);
         if (m->start_v || m->half_accel)
-            list_add_head(&m->node, &tq->history);
-        else
-            free(m);
+            history_add(tq, m);
+        first++;
     }
-    // Free old moves from history list
-    if (list_empty(&tq->history))
-        return;
-    struct move *latest = list_first_entry(&tq->history, struct move, node);
-    for (;;) {
-        struct move *m = list_last_entry(&tq->history, struct move, node);
-        if (m == latest || m->print_time + m->move_t > clear_history_time)
-            break;
-        list_del(&m->node);
-        free(m);
+    if (first != ma->first) {
+        // Reinitialize the head sentinel
+        ma->first = first;
+        memset(&ma->moves[first], 0, sizeof(ma->moves[first]));
     }
+    int axis;
+    for (axis=0; axis<3; axis++)
+        range_array_expire(&tq->active[axis], print_time);
+    // Free old moves from history list
+    struct histstore *hist = &tq->history;
+    while (hist->count > 1
+           && histstore_get(hist, 0)->end.time <= clear_history_time)
+        histstore_expire_oldest(hist);
 }
 
 // Note a position change in the trapq history
@@ -207,24 +505,16 @@ trapq_set_position(struct trapq *tq, double print_time
     trapq_finalize_moves(tq, NEVER_TIME, 0);
 
     // Prune any moves in the trapq history that were interrupted
-    while (!list_empty(&tq->history)) {
-        struct move *m = list_first_entry(&tq->history, struct move, node);
-        if (m->print_time < print_time) {
-            if (m->print_time + m->move_t > print_time)
-                m->move_t = print_time - m->print_time;
-            break;
-        }
-        list_del(&m->node);
-        free(m);
-    }
+    history_prune(tq, print_time);
 
     // Add a marker to the trapq history
-    struct move *m = move_alloc();
-    m->print_time = print_time;
-    m->start_pos.x = pos_x;
-    m->start_pos.y = pos_y;
-    m->start_pos.z = pos_z;
-    list_add_head(&m->node, &tq->history);
+    struct move m;
+    memset(&m, 0, sizeof(m));
+    m.print_time = print_time;
+    m.start_pos.x = pos_x;
+    m.start_pos.y = pos_y;
+    m.start_pos.z = pos_z;
+    history_add(tq, &m);
 }
 
 // Return history of movement queue
@@ -233,24 +523,54 @@ trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                   , double start_time, double end_time)
 {
     int res = 0;
-    struct move *m;
-    list_for_each_entry(m, &tq->history, node) {
-        if (start_time >= m->print_time + m->move_t || res >= max)
-            break;
-        if (end_time <= m->print_time)
+    struct histstore *hist = &tq->history;
+    struct move moves[HIST_BLOCK_MOVES];
+    uint32_t pos = hist->count;
+    while (pos--) {
+        struct hist_block *b = histstore_get(hist, pos);
+        if (end_time <= b->start.time)
             continue;
-        p->print_time = m->print_time;
-        p->move_t = m->move_t;
-        p->start_v = m->start_v;
-        p->accel = 2. * m->half_accel;
-        p->start_x = m->start_pos.x;
-        p->start_y = m->start_pos.y;
-        p->start_z = m->start_pos.z;
-        p->x_r = m->axes_r.x;
-        p->y_r = m->axes_r.y;
-        p->z_r = m->axes_r.z;
-        p++;
-        res++;
+        int i = history_decode_block(b, moves);
+        while (i--) {
+            struct move *m = &moves[i];
+            if (start_time >= m->print_time + m->move_t || res >= max)
+                return res;
+            if (end_time <= m->print_time)
+                continue;
+            p->print_time = m->print_time;
+            p->move_t = m->move_t;
+            p->start_v = m->start_v;
+            p->accel = 2. * m->half_accel;
+            p->start_x = m->start_pos.x;
+            p->start_y = m->start_pos.y;
+            p->start_z = m->start_pos.z;
+            p->x_r = m->axes_r.x;
+            p->y_r = m->axes_r.y;
+            p->z_r = m->axes_r.z;
+            p++;
+            res++;
+        }
     }
     return res;
 }
+
+// Set the maximum memory used to store the history of expired moves
+void __visible
+trapq_set_history_limit(struct trapq *tq, size_t max_bytes)
+{
+    histstore_set_limit(&tq->history, max_bytes);
+}
+
+// Return the memory used to store the history of expired moves
+size_t __visible
+trapq_get_history_bytes(struct trapq *tq)
+{
+    return histstore_get_bytes(&tq->history);
+}
+
+// Return the most memory that has been used to store the move history
+size_t __visible
+trapq_get_history_peak_bytes(struct trapq *tq)
+{
+    return histstore_get_peak_bytes(&tq->history);
+}
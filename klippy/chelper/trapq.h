@@ -1,7 +1,8 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
-#include "list.h" // list_node
+#include <stdint.h> // uint32_t
+#include "histstore.h" // struct histstore
 
 struct coord {
     union {
@@ -16,12 +17,34 @@ struct move {
     double print_time, move_t;
     double start_v, half_accel;
     struct coord start_pos, axes_r;
+};
+
+// Contiguous array of moves (valid moves are from 'first' to 'last-1')
+struct move_array {
+    struct move *moves;
+    int first, last, alloc;
+    uint32_t reloc_count;
+};
 
-    struct list_node node;
+// Time ranges of pending moves with movement on an axis
+struct active_range {
+    double start, end;
+};
+
+struct range_array {
+    struct active_range *ranges;
+    int first, last, alloc;
 };
 
 struct trapq {
-    struct list_head moves, history;
+    // Pending moves - the first entry is a head sentinel and the
+    // last entry is a tail sentinel
+    struct move_array moves;
+    // Expired moves (ordered from oldest to newest)
+    struct histstore history;
+    struct move history_last;
+    // Activity ranges of the pending moves for each of the x, y, z axes
+    struct range_array active[3];
 };
 
 struct pull_move {
@@ -31,13 +54,11 @@ struct pull_move {
     double x_r, y_r, z_r;
 };
 
-struct move *move_alloc(void);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
 void trapq_free(struct trapq *tq);
 void trapq_check_sentinels(struct trapq *tq);
-void trapq_add_move(struct trapq *tq, struct move *m);
 void trapq_append(struct trapq *tq, double print_time
                   , double accel_t, double cruise_t, double decel_t
                   , double start_pos_x, double start_pos_y, double start_pos_z
@@ -47,7 +68,63 @@ void trapq_finalize_moves(struct trapq *tq, double print_time
                           , double clear_history_time);
 void trapq_set_position(struct trapq *tq, double print_time
                         , double pos_x, double pos_y, double pos_z);
+void trapq_set_history_limit(struct trapq *tq, size_t max_bytes);
+size_t trapq_get_history_bytes(struct trapq *tq);
+size_t trapq_get_history_peak_bytes(struct trapq *tq);
 int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                       , double start_time, double end_time);
+double trapq_next_active(struct trapq *tq, int axis_flags, double time);
+struct move *trapq_find_move(struct trapq *tq, struct move *m, double time);
+
+// Return the head sentinel of the pending moves
+static inline struct move *
+trapq_first_move(struct trapq *tq)
+{
+    return &tq->moves.moves[tq->moves.first];
+}
+
+// Neighboring pending moves are stored next to each other
+static inline struct move *
+move_next(struct move *m)
+{
+    return m + 1;
+}
+
+static inline struct move *
+move_prev(struct move *m)
+{
+    return m - 1;
+}
+
+// Reference to a pending move that remains valid across trapq updates
+struct move_cursor {
+    struct move *m;
+    uint32_t reloc_count;
+};
+
+// Check if a move is a (non-sentinel) pending move on a trapq
+static inline int
+trapq_is_pending_move(struct trapq *tq, struct move *m)
+{
+    struct move_array *ma = &tq->moves;
+    return m > &ma->moves[ma->first] && m < &ma->moves[ma->last - 1];
+}
+
+// Return the move stored in a cursor (or NULL if no longer valid)
+static inline struct move *
+move_cursor_get(struct trapq *tq, struct move_cursor *mc)
+{
+    if (mc->reloc_count != tq->moves.reloc_count
+        || !trapq_is_pending_move(tq, mc->m))
+        return NULL;
+    return mc->m;
+}
+
+static inline void
+move_cursor_set(struct trapq *tq, struct move_cursor *mc, struct move *m)
+{
+    mc->m = m;
+    mc->reloc_count = tq->moves.reloc_count;
+}
 
 #endif // trapq.h
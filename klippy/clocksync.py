@@ -1,13 +1,14 @@
 # Micro-controller clock synchronization
 #
-# Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, math
+import logging
 
-RTT_AGE = .000010 / (60. * 60.)
-DECAY = 1. / 30.
-TRANSMIT_EXTRA = .001
+MIN_QUERY_TIME = .100
+# Use an unusual time between queries so clock messages don't
+# resonate with other periodic events.
+MAX_QUERY_TIME = .9839
 
 class ClockSync:
     def __init__(self, reactor):
@@ -16,31 +17,29 @@ class ClockSync:
         self.get_clock_timer = reactor.register_timer(self._get_clock_event)
         self.get_clock_cmd = self.cmd_queue = None
         self.queries_pending = 0
+        self.query_time = MIN_QUERY_TIME
         self.mcu_freq = 1.
         self.last_clock = 0
         self.clock_est = (0., 0., 0.)
-        # Minimum round-trip-time tracking
-        self.min_half_rtt = 999999999.9
-        self.min_rtt_time = 0.
-        # Linear regression of mcu clock and system sent_time
-        self.time_avg = self.time_variance = 0.
-        self.clock_avg = self.clock_covariance = 0.
-        self.prediction_variance = 0.
-        self.last_prediction_time = 0.
     def connect(self, serial):
         self.serial = serial
-        self.mcu_freq = serial.msgparser.get_constant_float('CLOCK_FREQ')
+        msgparser = serial.get_msgparser()
+        self.mcu_freq = msgparser.get_constant_float('CLOCK_FREQ')
         # Load initial clock and frequency
         params = serial.send_with_response('get_uptime', 'uptime')
         self.last_clock = (params['high'] << 32) | params['clock']
-        self.clock_avg = self.last_clock
-        self.time_avg = params['#sent_time']
-        self.clock_est = (self.time_avg, self.clock_avg, self.mcu_freq)
-        self.prediction_variance = (.001 * self.mcu_freq)**2
+        sent_time = params['#sent_time']
+        self.clock_est = (sent_time, self.last_clock, self.mcu_freq)
+        # The serialqueue code updates the clock estimate from each
+        # received "clock" response
+        clock_msgid = msgparser.msgid_by_format.get("clock clock=%u")
+        if clock_msgid is None:
+            raise msgparser.error("mcu does not support clock sync")
+        serial.set_clock_sync(clock_msgid, self.mcu_freq, sent_time,
+                              self.last_clock)
         # Enable periodic get_clock timer
         for i in range(8):
             self.reactor.pause(self.reactor.monotonic() + 0.050)
-            self.last_prediction_time = -9999.
             params = serial.send_with_response('get_clock', 'clock')
             self._handle_clock(params)
         self.get_clock_cmd = serial.get_msgparser().create_command('get_clock')
@@ -59,66 +58,21 @@ class ClockSync:
     def _get_clock_event(self, eventtime):
         self.serial.raw_send(self.get_clock_cmd, 0, 0, self.cmd_queue)
         self.queries_pending += 1
-        # Use an unusual time for the next event so clock messages
-        # don't resonate with other periodic events.
-        return eventtime + .9839
+        # Query frequently after connect so the estimate converges quickly
+        query_time = self.query_time
+        self.query_time = min(query_time * 2., MAX_QUERY_TIME)
+        return eventtime + query_time
     def _handle_clock(self, params):
         self.queries_pending = 0
         # Extend clock to 64bit
         last_clock = self.last_clock
         clock_delta = (params['clock'] - last_clock) & 0xffffffff
-        self.last_clock = clock = last_clock + clock_delta
-        # Check if this is the best round-trip-time seen so far
-        sent_time = params['#sent_time']
-        if not sent_time:
-            return
-        receive_time = params['#receive_time']
-        half_rtt = .5 * (receive_time - sent_time)
-        aged_rtt = (sent_time - self.min_rtt_time) * RTT_AGE
-        if half_rtt < self.min_half_rtt + aged_rtt:
-            self.min_half_rtt = half_rtt
-            self.min_rtt_time = sent_time
-            logging.debug("new minimum rtt %.3f: hrtt=%.6f freq=%d",
-                          sent_time, half_rtt, self.clock_est[2])
-        # Filter out samples that are extreme outliers
-        exp_clock = ((sent_time - self.time_avg) * self.clock_est[2]
-                     + self.clock_avg)
-        clock_diff2 = (clock - exp_clock)**2
-        if (clock_diff2 > 25. * self.prediction_variance
-            and clock_diff2 > (.000500 * self.mcu_freq)**2):
-            if clock > exp_clock and sent_time < self.last_prediction_time+10.:
-                logging.debug("Ignoring clock sample %.3f:"
-                              " freq=%d diff=%d stddev=%.3f",
-                              sent_time, self.clock_est[2], clock - exp_clock,
-                              math.sqrt(self.prediction_variance))
-                return
-            logging.info("Resetting prediction variance %.3f:"
-                         " freq=%d diff=%d stddev=%.3f",
-                         sent_time, self.clock_est[2], clock - exp_clock,
-                         math.sqrt(self.prediction_variance))
-            self.prediction_variance = (.001 * self.mcu_freq)**2
-        else:
-            self.last_prediction_time = sent_time
-            self.prediction_variance = (
-                (1. - DECAY) * (self.prediction_variance + clock_diff2 * DECAY))
-        # Add clock and sent_time to linear regression
-        diff_sent_time = sent_time - self.time_avg
-        self.time_avg += DECAY * diff_sent_time
-        self.time_variance = (1. - DECAY) * (
-            self.time_variance + diff_sent_time**2 * DECAY)
-        diff_clock = clock - self.clock_avg
-        self.clock_avg += DECAY * diff_clock
-        self.clock_covariance = (1. - DECAY) * (
-            self.clock_covariance + diff_sent_time * diff_clock * DECAY)
-        # Update prediction from linear regression
-        new_freq = self.clock_covariance / self.time_variance
-        pred_stddev = math.sqrt(self.prediction_variance)
-        self.serial.set_clock_est(new_freq, self.time_avg + TRANSMIT_EXTRA,
-                                  int(self.clock_avg - 3. * pred_stddev), clock)
-        self.clock_est = (self.time_avg + self.min_half_rtt,
-                          self.clock_avg, new_freq)
-        #logging.debug("regr %.3f: freq=%.3f d=%d(%.3f)",
-        #              sent_time, new_freq, clock - exp_clock, pred_stddev)
+        self.last_clock = last_clock + clock_delta
+        # Load the updated estimate from the regression in serialqueue.c
+        cs = self.serial.get_clock_sync()
+        if cs.sample_count:
+            self.clock_est = (cs.time_avg + cs.min_half_rtt,
+                              cs.clock_avg, cs.est_freq)
     # clock frequency conversions
     def print_time_to_clock(self, print_time):
         return int(print_time * self.mcu_freq)
@@ -143,20 +97,23 @@ class ClockSync:
         return self.queries_pending <= 4
     def dump_debug(self):
         sample_time, clock, freq = self.clock_est
+        cs = self.serial.get_clock_sync()
         return ("clocksync state: mcu_freq=%d last_clock=%d"
                 " clock_est=(%.3f %d %.3f) min_half_rtt=%.6f min_rtt_time=%.3f"
                 " time_avg=%.3f(%.3f) clock_avg=%.3f(%.3f)"
                 " pred_variance=%.3f" % (
                     self.mcu_freq, self.last_clock, sample_time, clock, freq,
-                    self.min_half_rtt, self.min_rtt_time,
-                    self.time_avg, self.time_variance,
-                    self.clock_avg, self.clock_covariance,
-                    self.prediction_variance))
+                    cs.min_half_rtt, cs.min_rtt_time,
+                    cs.time_avg, cs.time_variance,
+                    cs.clock_avg, cs.clock_covariance,
+                    cs.prediction_variance))
     def stats(self, eventtime):
         sample_time, clock, freq = self.clock_est
         return "freq=%d" % (freq,)
     def calibrate_clock(self, print_time, eventtime):
         return (0., self.mcu_freq)
+    def sync_main(self):
+        pass
 
 # Clock syncing code for secondary MCUs (whose clocks are sync'ed to a
 # primary MCU)
@@ -169,6 +126,8 @@ class SecondarySync(ClockSync):
     def connect(self, serial):
         ClockSync.connect(self, serial)
         self.clock_adj = (0., self.mcu_freq)
+    def sync_main(self):
+        # Align print_time with the main mcu (once both are connected)
         curtime = self.reactor.monotonic()
         main_print_time = self.main_sync.estimated_print_time(curtime)
         local_print_time = self.estimated_print_time(curtime)
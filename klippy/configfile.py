@@ -472,6 +472,9 @@ class PrinterConfig:
         self.deprecate_warnings = []
         self.status_raw_config = {}
         self.status_warnings = []
+        webhooks = printer.lookup_object('webhooks')
+        self.note_status_change = webhooks.register_status_notify(
+            'configfile')
     def get_printer(self):
         return self.printer
     def read_config(self, filename):
@@ -486,6 +489,7 @@ class PrinterConfig:
         config = ConfigWrapper(self.printer, fileconfig,
                                access_tracking, 'printer')
         self._build_status_config(config)
+        self.note_status_change()
         return config
     def log_config(self, config):
         cfgrdr = ConfigFileReader()
@@ -495,12 +499,14 @@ class PrinterConfig:
         self.printer.set_rollover_info("config", "\n".join(lines))
     def check_unused_options(self, config):
         self.validate.check_unused(config.fileconfig)
+        self.note_status_change()
     # Deprecation warnings
     def runtime_warning(self, msg):
         logging.warning(msg)
         res = {'type': 'runtime_warning', 'message': msg}
         self.runtime_warnings.append(res)
         self.status_warnings = self.runtime_warnings + self.deprecate_warnings
+        self.note_status_change()
     def deprecate(self, section, option, value=None, msg=None):
         key = (section, option, value)
         if key in self.deprecated and self.deprecated[key] == msg:
@@ -517,6 +523,7 @@ class PrinterConfig:
             res['option'] = option
             self.deprecate_warnings.append(res)
         self.status_warnings = self.runtime_warnings + self.deprecate_warnings
+        self.note_status_change()
     # Status reporting
     def _build_status_config(self, config):
         self.status_raw_config = {}
@@ -533,5 +540,7 @@ class PrinterConfig:
     # Autosave functions
     def set(self, section, option, value):
         self.autosave.set(section, option, value)
+        self.note_status_change()
     def remove_section(self, section):
         self.autosave.remove_section(section)
+        self.note_status_change()
@@ -19,6 +19,7 @@ RANGE_CHECK_COUNT = 4
 class PrinterADCtoTemperature:
     def __init__(self, config, adc_convert):
         self.adc_convert = adc_convert
+        self.calc_temp = adc_convert.calc_temp
         ppins = config.get_printer().lookup_object('pins')
         self.mcu_adc = ppins.setup_pin('adc', config.get('sensor_pin'))
         self.mcu_adc.setup_adc_callback(REPORT_TIME, self.adc_callback)
@@ -28,8 +29,12 @@ class PrinterADCtoTemperature:
         self.temperature_callback = temperature_callback
     def get_report_time_delta(self):
         return REPORT_TIME
+    def get_mcu_adc(self):
+        return self.mcu_adc
+    def get_adc_convert(self):
+        return self.adc_convert
     def adc_callback(self, read_time, read_value):
-        temp = self.adc_convert.calc_temp(read_value)
+        temp = self.calc_temp(read_value)
         self.temperature_callback(read_time + SAMPLE_COUNT * SAMPLE_TIME, temp)
     def setup_minmax(self, min_temp, max_temp):
         arange = [self.adc_convert.calc_adc(t) for t in [min_temp, max_temp]]
@@ -38,6 +43,11 @@ class PrinterADCtoTemperature:
                                       minval=min_adc, maxval=max_adc,
                                       range_check_count=RANGE_CHECK_COUNT)
         self.diag_helper.setup_diag_minmax(min_temp, max_temp, min_adc, max_adc)
+        # Use a precomputed table for readings in the valid range
+        lookup = build_lookup_table(self.adc_convert.calc_temp,
+                                    min_adc, max_adc)
+        if lookup is not None:
+            self.calc_temp = lookup.calc_temp
 
 # Tool to register with query_adc and report extra info on ADC range errors
 class HelperTemperatureDiagnostics:
@@ -72,6 +82,56 @@ class HelperTemperatureDiagnostics:
                 % (self.name, tempstr, self.min_temp, self.max_temp))
 
 
+######################################################################
+# Precomputed conversion tables
+######################################################################
+
+LOOKUP_MIN_SIZE = 64
+LOOKUP_MAX_SIZE = 4096
+LOOKUP_MAX_ERROR = 0.01
+
+# Convert adc readings using linear interpolation between evenly spaced
+# samples of an adc to temperature function
+class ADCLookupTable:
+    def __init__(self, calc_temp_cb, min_adc, max_adc, slopes):
+        self.calc_temp_cb = calc_temp_cb
+        self.min_adc, self.max_adc = min_adc, max_adc
+        self.inv_step = len(slopes) / (max_adc - min_adc)
+        self.slopes = slopes
+    def calc_temp(self, adc):
+        if adc < self.min_adc or adc >= self.max_adc:
+            return self.calc_temp_cb(adc)
+        gain, offset = self.slopes[int((adc - self.min_adc) * self.inv_step)]
+        return adc * gain + offset
+
+# Build a lookup table for the given adc range (the table size is
+# increased until the interpolation error is below LOOKUP_MAX_ERROR)
+def build_lookup_table(calc_temp_cb, min_adc, max_adc):
+    if not max_adc > min_adc:
+        return None
+    size = LOOKUP_MIN_SIZE
+    try:
+        while size <= LOOKUP_MAX_SIZE:
+            step = (max_adc - min_adc) / size
+            adcs = [min_adc + i * step for i in range(size + 1)]
+            temps = [calc_temp_cb(adc) for adc in adcs]
+            slopes = []
+            max_error = 0.
+            for i in range(size):
+                gain = (temps[i+1] - temps[i]) / step
+                offset = temps[i] - adcs[i] * gain
+                slopes.append((gain, offset))
+                mid_adc = adcs[i] + .5 * step
+                error = abs(mid_adc * gain + offset - calc_temp_cb(mid_adc))
+                max_error = max(max_error, error)
+            if max_error <= LOOKUP_MAX_ERROR:
+                return ADCLookupTable(calc_temp_cb, min_adc, max_adc, slopes)
+            size *= 2
+    except (ValueError, ZeroDivisionError, OverflowError):
+        pass
+    return None
+
+
 ######################################################################
 # Linear interpolation
 ######################################################################
@@ -118,6 +118,11 @@ class ADS1220:
     def get_mcu(self):
         return self.mcu
 
+    def attach_load_cell_probe(self, load_cell_probe_oid):
+        self.mcu.add_config_cmd(
+            "ads1220_attach_load_cell_probe oid=%d load_cell_probe_oid=%d"
+            % (self.oid, load_cell_probe_oid))
+
     def get_samples_per_second(self):
         return self.sps
 
@@ -1,15 +1,17 @@
 # Support for reading acceleration data from an adxl345 chip
 #
-# Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2020-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, time, collections, multiprocessing, os
-from . import bus, bulk_sensor
+from . import bus, bulk_sensor, shaper_calibrate
 
 # ADXL345 registers
 REG_DEVID = 0x00
 REG_BW_RATE = 0x2C
 REG_POWER_CTL = 0x2D
+REG_INT_ENABLE = 0x2E
+REG_INT_MAP = 0x2F
 REG_DATA_FORMAT = 0x31
 REG_FIFO_CTL = 0x38
 REG_MOD_READ = 0x80
@@ -22,6 +24,8 @@ QUERY_RATES = {
 
 ADXL345_DEV_ID = 0xe5
 SET_FIFO_CTL = 0x90
+FIFO_WATERMARK = SET_FIFO_CTL & 0x1f
+INT_WATERMARK = 0x02
 
 FREEFALL_ACCEL = 9.80665 * 1000.
 SCALE_XY = 0.003774 * FREEFALL_ACCEL # 1 / 265 (at 3.3V) mg/LSB
@@ -32,27 +36,47 @@ Accel_Measurement = collections.namedtuple(
 
 # Helper class to obtain measurements
 class AccelQueryHelper:
-    def __init__(self, printer):
+    def __init__(self, printer, chip=None):
         self.printer = printer
+        self.chip = chip
         self.is_finished = False
         print_time = printer.lookup_object('toolhead').get_last_move_time()
         self.request_start_time = self.request_end_time = print_time
         self.msgs = []
         self.samples = []
+        self.consumer = None
+        self.keep_msgs = True
+        self.have_end_time = False
+    def stream_to(self, consumer, keep_msgs=False):
+        # Pass each batch of samples to consumer.add_samples() as it
+        # arrives (the samples are only stored if keep_msgs is set)
+        self.consumer = consumer
+        self.keep_msgs = keep_msgs
     def finish_measurements(self):
         toolhead = self.printer.lookup_object('toolhead')
         self.request_end_time = toolhead.get_last_move_time()
+        self.have_end_time = True
         toolhead.wait_moves()
         self.is_finished = True
     def handle_batch(self, msg):
         if self.is_finished:
             return False
+        if self.consumer is not None:
+            end_time = None
+            if self.have_end_time:
+                end_time = self.request_end_time
+            self.consumer.add_samples(msg['data'], self.request_start_time,
+                                      end_time)
+            if not self.keep_msgs:
+                return True
         if len(self.msgs) >= 10000:
             # Avoid filling up memory with too many samples
             return False
         self.msgs.append(msg)
         return True
     def has_valid_samples(self):
+        if self.consumer is not None and not self.keep_msgs:
+            return self.consumer.has_samples()
         for msg in self.msgs:
             data = msg['data']
             first_sample_time = data[0][0]
@@ -85,13 +109,45 @@ class AccelQueryHelper:
                 count += 1
         del samples[count:]
         return self.samples
-    def write_to_file(self, filename):
+    def get_chip_info(self):
+        chip = self.chip
+        if chip is None:
+            return {}
+        info = {'chip': chip.name, 'chip_type': type(chip).__name__.lower(),
+                'rate': chip.data_rate, 'axes_map': chip.axes_map}
+        try:
+            time_base, chip_base, inv_freq = (
+                chip.ffreader.clock_sync.get_time_translation())
+            info['clock_translation'] = {
+                'time_base': time_base, 'chip_base': chip_base,
+                'inv_freq': inv_freq}
+        except ZeroDivisionError:
+            pass
+        return info
+    def _write_binary(self, f):
+        start_time = self.request_start_time
+        end_time = self.request_end_time
+        shaper_calibrate.write_raw_data_header(f, self.get_chip_info())
+        if not self.msgs:
+            f.write(shaper_calibrate.pack_raw_samples(self.samples))
+            return
+        # Write the samples directly from the received batches
+        for msg in self.msgs:
+            data = msg['data']
+            if data[0][0] < start_time or data[-1][0] > end_time:
+                data = [s for s in data if start_time <= s[0] <= end_time]
+            f.write(shaper_calibrate.pack_raw_samples(data))
+    def write_to_file(self, filename, data_format='csv'):
         def write_impl():
             try:
                 # Try to re-nice writing process
                 os.nice(20)
             except:
                 pass
+            if data_format == 'binary':
+                with open(filename, "wb") as f:
+                    self._write_binary(f)
+                return
             f = open(filename, "w")
             f.write("#time,accel_x,accel_y,accel_z\n")
             samples = self.samples or self.get_samples()
@@ -142,15 +198,20 @@ class AccelCommandHelper:
         name = gcmd.get("NAME", time.strftime("%Y%m%d_%H%M%S"))
         if not name.replace('-', '').replace('_', '').isalnum():
             raise gcmd.error("Invalid NAME parameter")
+        data_format = gcmd.get("FORMAT", "csv").lower()
+        if data_format not in shaper_calibrate.RAW_DATA_FORMATS:
+            raise gcmd.error("Invalid FORMAT parameter")
+        ext = shaper_calibrate.RAW_DATA_FORMATS[data_format]
         bg_client = self.bg_client
         self.bg_client = None
         bg_client.finish_measurements()
         # Write data to file
         if self.base_name == self.name:
-            filename = "/tmp/%s-%s.csv" % (self.base_name, name)
+            filename = "/tmp/%s-%s%s" % (self.base_name, name, ext)
         else:
-            filename = "/tmp/%s-%s-%s.csv" % (self.base_name, self.name, name)
-        bg_client.write_to_file(filename)
+            filename = "/tmp/%s-%s-%s%s" % (self.base_name, self.name,
+                                            name, ext)
+        bg_client.write_to_file(filename, data_format)
         gcmd.respond_info("Writing raw accelerometer data to %s file"
                           % (filename,))
     cmd_ACCELEROMETER_QUERY_help = "Query accelerometer for the current values"
@@ -185,6 +246,7 @@ def read_axes_map(config, scale_x, scale_y, scale_z):
     return [am[a.strip()] for a in axes_map]
 
 BATCH_UPDATES = 0.100
+COMPRESS_ERROR_VALUE = 0x7fff
 
 # Printer class that controls ADXL345 chip
 class ADXL345:
@@ -199,15 +261,32 @@ class ADXL345:
         self.spi = bus.MCU_SPI_from_config(config, 3, default_speed=5000000)
         self.mcu = mcu = self.spi.get_mcu()
         self.oid = oid = mcu.create_oid()
-        self.query_adxl345_cmd = None
-        mcu.add_config_cmd("config_adxl345 oid=%d spi_oid=%d"
-                           % (oid, self.spi.get_oid()))
+        self.query_adxl345_cmd = self.query_spectrum_cmd = None
+        self.spectrum_oid = None
+        self.spectrum_enabled = self.spectrum_running = False
+        self.compress = config.getboolean('compress', False)
+        int_pin = config.get('int_pin', None)
+        self.have_int = int_pin is not None
+        if self.have_int:
+            ppins = self.printer.lookup_object("pins")
+            pin_params = ppins.lookup_pin(int_pin)
+            if pin_params['chip'] != mcu:
+                raise config.error("adxl345 int_pin must be on same mcu")
+            mcu.add_config_cmd(
+                "config_adxl345_with_int oid=%d spi_oid=%d compress=%d"
+                " int_pin=%s" % (oid, self.spi.get_oid(), self.compress,
+                                 pin_params['pin']))
+        else:
+            mcu.add_config_cmd("config_adxl345 oid=%d spi_oid=%d compress=%d"
+                               % (oid, self.spi.get_oid(), self.compress))
         mcu.add_config_cmd("query_adxl345 oid=%d rest_ticks=0"
                            % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
         # Bulk sample message reading
         chip_smooth = self.data_rate * BATCH_UPDATES * 2
-        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, "BBBBB")
+        compress_fields = 3 if self.compress else 0
+        self.ffreader = bulk_sensor.FixedFreqReader(
+            mcu, chip_smooth, "BBBBB", compress_fields=compress_fields)
         self.last_error_count = 0
         # Process messages in batches
         self.batch_bulk = bulk_sensor.BatchBulkHelper(
@@ -223,6 +302,10 @@ class ADXL345:
             "query_adxl345 oid=%c rest_ticks=%u", cq=cmdqueue)
         self.ffreader.setup_query_command("query_adxl345_status oid=%c",
                                           oid=self.oid, cq=cmdqueue)
+        if self.spectrum_oid is not None:
+            self.query_spectrum_cmd = self.mcu.lookup_command(
+                "query_adxl345_spectrum oid=%c rest_ticks=%u spectrum_oid=%c",
+                cq=cmdqueue)
     def read_reg(self, reg):
         params = self.spi.spi_transfer([reg | REG_MOD_READ, 0x00])
         response = bytearray(params['response'])
@@ -237,11 +320,28 @@ class ADXL345:
                     "(e.g. faulty wiring) or a faulty adxl345 chip." % (
                         reg, val, stored_val))
     def start_internal_client(self):
-        aqh = AccelQueryHelper(self.printer)
+        aqh = AccelQueryHelper(self.printer, self)
         self.batch_bulk.add_client(aqh.handle_batch)
         return aqh
     # Measurement decoding
+    def _convert_compressed_samples(self, samples):
+        (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
+        count = 0
+        for ptime, rx, ry, rz in samples:
+            if rx == COMPRESS_ERROR_VALUE:
+                self.last_error_count += 1
+                continue
+            raw_xyz = (rx, ry, rz)
+            x = round(raw_xyz[x_pos] * x_scale, 6)
+            y = round(raw_xyz[y_pos] * y_scale, 6)
+            z = round(raw_xyz[z_pos] * z_scale, 6)
+            samples[count] = (round(ptime, 6), x, y, z)
+            count += 1
+        del samples[count:]
     def _convert_samples(self, samples):
+        if self.compress:
+            self._convert_compressed_samples(samples)
+            return
         (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
         count = 0
         for ptime, xlow, ylow, zlow, xzhigh, yzhigh in samples:
@@ -259,8 +359,8 @@ class ADXL345:
             samples[count] = (round(ptime, 6), x, y, z)
             count += 1
         del samples[count:]
-    # Start, stop, and process message batches
-    def _start_measurements(self):
+    # Chip setup
+    def _start_reading(self, spectrum=False):
         # In case of miswiring, testing ADXL345 device ID prevents treating
         # noise or wrong signal as a correctly initialized device
         dev_id = self.read_reg(REG_DEVID)
@@ -276,20 +376,57 @@ class ADXL345:
         self.set_reg(REG_FIFO_CTL, 0x00)
         self.set_reg(REG_BW_RATE, QUERY_RATES[self.data_rate])
         self.set_reg(REG_FIFO_CTL, SET_FIFO_CTL)
-        # Start bulk reading
         rest_ticks = self.mcu.seconds_to_clock(4. / self.data_rate)
-        self.query_adxl345_cmd.send([self.oid, rest_ticks])
+        if self.have_int:
+            # Signal the fifo watermark on the INT1 pin (the mcu then
+            # only needs to check the pin until the watermark is reached)
+            self.set_reg(REG_INT_MAP, 0x00)
+            self.set_reg(REG_INT_ENABLE, INT_WATERMARK)
+            rest_ticks = self.mcu.seconds_to_clock(
+                .5 * FIFO_WATERMARK / self.data_rate)
+        # Start bulk reading (or on-mcu vibration summaries)
+        if spectrum:
+            self.query_spectrum_cmd.send([self.oid, rest_ticks,
+                                          self.spectrum_oid])
+        else:
+            self.query_adxl345_cmd.send([self.oid, rest_ticks])
+        self.spectrum_running = spectrum
         self.set_reg(REG_POWER_CTL, 0x08)
+    def _stop_reading(self):
+        self.set_reg(REG_POWER_CTL, 0x00)
+        if self.have_int:
+            self.set_reg(REG_INT_ENABLE, 0x00)
+        self.query_adxl345_cmd.send_wait_ack([self.oid, 0])
+        self.spectrum_running = False
+    # Vibration summaries (see vibration_monitor.py)
+    def setup_spectrum(self, spectrum_oid):
+        self.spectrum_oid = spectrum_oid
+        return self.data_rate, self.axes_map
+    def start_spectrum(self):
+        self.spectrum_enabled = True
+        if not self.batch_bulk.is_started and not self.spectrum_running:
+            self._start_reading(spectrum=True)
+    def stop_spectrum(self):
+        self.spectrum_enabled = False
+        if self.spectrum_running:
+            self._stop_reading()
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        # Bulk clients take precedence over vibration summaries
+        if self.spectrum_running:
+            self._stop_reading()
+        self._start_reading()
         logging.info("ADXL345 starting '%s' measurements", self.name)
         # Initialize clock tracking
         self.ffreader.note_start()
         self.last_error_count = 0
     def _finish_measurements(self):
         # Halt bulk reading
-        self.set_reg(REG_POWER_CTL, 0x00)
-        self.query_adxl345_cmd.send_wait_ack([self.oid, 0])
+        self._stop_reading()
         self.ffreader.note_end()
         logging.info("ADXL345 finished '%s' measurements", self.name)
+        if self.spectrum_enabled:
+            self._start_reading(spectrum=True)
     def _process_batch(self, eventtime):
         samples = self.ffreader.pull_samples()
         self._convert_samples(samples)
@@ -1,6 +1,6 @@
 # Support for reading SPI magnetic angle sensors
 #
-# Copyright (C) 2021,2022  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math
@@ -9,6 +9,21 @@ from . import bus, bulk_sensor
 MIN_MSG_TIME = 0.100
 TCODE_ERROR = 0xff
 
+# Check if a module is available without importing it (numpy is only
+# imported when a calibration is actually run)
+def have_module(name):
+    try:
+        import importlib.util
+        return importlib.util.find_spec(name) is not None
+    except ImportError:
+        # Python2
+        import imp
+        try:
+            imp.find_module(name)
+        except ImportError:
+            return False
+        return True
+
 TRINAMIC_DRIVERS = ["tmc2130", "tmc2208", "tmc2209", "tmc2240", "tmc2660",
     "tmc5160"]
 
@@ -23,9 +38,7 @@ class AngleCalibration:
         if self.stepper_name is None:
             # No calibration
             return
-        try:
-            import numpy
-        except:
+        if not have_module('numpy'):
             raise config.error("Angle calibration requires numpy module")
         sconfig = config.getsection(self.stepper_name)
         sconfig.getint('microsteps', note_valid=False)
@@ -264,6 +277,139 @@ class AngleCalibration:
         configfile.remove_section(self.name)
         configfile.set(self.name, 'calibrate', ''.join(cal_contents))
 
+# Stepper position error monitoring (performed by the micro-controller)
+class AngleMonitor:
+    def __init__(self, config, angle):
+        self.printer = config.get_printer()
+        self.angle = angle
+        self.calibration = angle.calibration
+        self.mcu = angle.mcu
+        self.oid = angle.oid
+        self.spi_angle_monitor_cmd = None
+        self.is_active = self.is_pending = False
+        self.threshold = 1.
+        self.do_shutdown = False
+        self.step_angle = self.angle_offset = 0
+        self.last_error = self.max_error = 0.
+        self.exceed_count = self.error_count = 0
+        self.mcu.register_config_callback(self._build_config)
+        self.mcu.register_response(self._handle_monitor_status,
+                                   "spi_angle_monitor_status", self.oid)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_mux_command("ANGLE_MONITOR", "CHIP", angle.name,
+                                   self.cmd_ANGLE_MONITOR,
+                                   desc=self.cmd_ANGLE_MONITOR_help)
+    def _build_config(self):
+        self.spi_angle_monitor_cmd = self.mcu.try_lookup_command(
+            "spi_angle_monitor oid=%c stepper_oid=%c angle_offset=%hu"
+            " step_angle=%u threshold=%hu report_count=%hu")
+    def get_status(self, eventtime=None):
+        return {'enabled': self.is_active or self.is_pending,
+                'last_error': self.last_error, 'max_error': self.max_error,
+                'exceed_count': self.exceed_count}
+    def _angle_to_steps(self, angle):
+        microsteps, full_steps = self.calibration.get_microsteps()
+        return angle * full_steps / float(1 << ANGLE_BITS)
+    def _handle_batch(self, msg):
+        return self.is_active or self.is_pending
+    def note_raw_samples(self, samples):
+        # Determine angle offset from uncalibrated samples and start
+        # monitoring on the mcu
+        if not self.is_pending:
+            return
+        self.is_pending = False
+        mcu_stepper = self.calibration.mcu_stepper
+        invert_dir = mcu_stepper.get_dir_inverted()[0]
+        step_angle = self.step_angle
+        ref_diff = diff_total = 0
+        for i, (samp_time, angle) in enumerate(samples):
+            mcu_pos = mcu_stepper.get_past_mcu_position(samp_time)
+            if invert_dir:
+                mcu_pos = -mcu_pos
+            expected = ((mcu_pos * step_angle) & 0xffffffff) >> 16
+            diff = (angle - expected) & 0xffff
+            if not i:
+                ref_diff = diff
+            diff = (diff - ref_diff) & 0xffff
+            diff_total += diff - ((diff & 0x8000) << 1)
+        angle_offset = int(ref_diff + float(diff_total) / len(samples) + .5)
+        self.angle_offset = angle_offset & 0xffff
+        self.last_error = self.max_error = 0.
+        self.exceed_count = self.error_count = 0
+        microsteps, full_steps = self.calibration.get_microsteps()
+        threshold = int(self.threshold * (1 << ANGLE_BITS) / full_steps + .5)
+        report_count = int(BATCH_UPDATES / self.angle.sample_period + .5)
+        self.spi_angle_monitor_cmd.send(
+            [self.oid, mcu_stepper.get_oid(), self.angle_offset,
+             step_angle & 0xffffffff, min(threshold, 0x7fff),
+             max(1, min(report_count, 0xffff))])
+        self.is_active = True
+        logging.info("Started angle '%s' monitor (offset=%d step_angle=%d)",
+                     self.angle.name, self.angle_offset, step_angle)
+    def note_stop(self):
+        self.is_active = self.is_pending = False
+    def _handle_monitor_status(self, params):
+        if not self.is_active:
+            return
+        max_err = max(-params['min_err'], params['max_err'])
+        self.last_error = last_error = self._angle_to_steps(max_err)
+        self.max_error = max(self.max_error, last_error)
+        self.error_count += params['errors']
+        if not params['exceed']:
+            return
+        self.exceed_count += params['exceed']
+        msg = ("Angle sensor '%s' position error of %.3f full steps"
+               % (self.angle.name, last_error))
+        logging.warning(msg)
+        reactor = self.printer.get_reactor()
+        if self.do_shutdown:
+            reactor.register_async_callback(
+                (lambda e: self.printer.invoke_shutdown(msg)))
+            return
+        gcode = self.printer.lookup_object('gcode')
+        reactor.register_async_callback((lambda e: gcode.respond_info(msg)))
+    cmd_ANGLE_MONITOR_help = "Monitor angle sensor for stepper position errors"
+    def cmd_ANGLE_MONITOR(self, gcmd):
+        enable = gcmd.get_int('ENABLE', 1, minval=0, maxval=1)
+        if not enable:
+            if self.is_active:
+                self.spi_angle_monitor_cmd.send([self.oid, 0, 0, 0, 0, 0])
+            self.note_stop()
+            gcmd.respond_info("Angle '%s' monitor disabled (max error %.3f"
+                              " full steps, %d exceeded, %d sensor errors)"
+                              % (self.angle.name, self.max_error,
+                                 self.exceed_count, self.error_count))
+            return
+        cal = self.calibration
+        if cal.stepper_name is None or not cal.calibration:
+            raise gcmd.error("Angle monitor requires a completed"
+                             " ANGLE_CALIBRATE")
+        if self.spi_angle_monitor_cmd is None:
+            raise gcmd.error("MCU does not support angle monitoring")
+        if cal.mcu_stepper.get_mcu() is not self.mcu:
+            raise gcmd.error("Angle monitor requires the sensor and stepper"
+                             " on the same mcu")
+        self.threshold = gcmd.get_float('THRESHOLD', 1., above=0.)
+        self.do_shutdown = gcmd.get_int('SHUTDOWN', 0, minval=0, maxval=1)
+        was_enabled = self.is_active or self.is_pending
+        if self.is_active:
+            # Restart with new settings (redetermines the angle offset)
+            self.spi_angle_monitor_cmd.send([self.oid, 0, 0, 0, 0, 0])
+            self.is_active = False
+        # Convert stepper position to sensor angle (16.16 fixed point)
+        microsteps, full_steps = cal.get_microsteps()
+        step_angle = int(float(1 << 32) / (full_steps * microsteps) + .5)
+        if cal.calibration_reversed:
+            step_angle = -step_angle
+        if cal.mcu_stepper.get_dir_inverted()[0]:
+            step_angle = -step_angle
+        self.step_angle = step_angle
+        self.is_pending = True
+        if not was_enabled:
+            self.angle.add_client(self._handle_batch)
+        gcmd.respond_info("Angle '%s' monitor enabled (threshold %.3f full"
+                          " steps)" % (self.angle.name, self.threshold))
+
 class HelperA1333:
     SPI_MODE = 3
     SPI_SPEED = 10000000
@@ -647,6 +793,7 @@ class Angle:
         api_resp = {'header': ('time', 'angle')}
         self.batch_bulk.add_mux_endpoint("angle/dump_angle",
                                          "sensor", self.name, api_resp)
+        self.monitor = AngleMonitor(config, self)
     def _build_config(self):
         freq = self.mcu.seconds_to_clock(1.)
         while float(TCODE_ERROR << self.time_shift) / freq < 0.002:
@@ -656,7 +803,8 @@ class Angle:
             "query_spi_angle oid=%c clock=%u rest_ticks=%u time_shift=%c",
             cq=cmdqueue)
     def get_status(self, eventtime=None):
-        return {'temperature': self.sensor_helper.last_temperature}
+        return {'temperature': self.sensor_helper.last_temperature,
+                'monitor': self.monitor.get_status(eventtime)}
     def add_client(self, client_cb):
         self.batch_bulk.add_client(client_cb)
     # Measurement decoding
@@ -734,6 +882,7 @@ class Angle:
     def _finish_measurements(self):
         # Halt bulk reading
         self.query_spi_angle_cmd.send_wait_ack([self.oid, 0, 0, 0])
+        self.monitor.note_stop()
         self.bulk_queue.clear_queue()
         self.sensor_helper.last_temperature = None
         logging.info("Stopped angle '%s' measurements", self.name)
@@ -746,6 +895,7 @@ class Angle:
         samples, error_count = self._extract_samples(raw_samples)
         if not samples:
             return {}
+        self.monitor.note_raw_samples(samples)
         offset = self.calibration.apply_calibration(samples)
         return {'data': samples, 'errors': error_count,
                 'position_offset': offset}
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, json, collections
+import chelper
 from . import probe
 
 PROFILE_VERSION = 1
@@ -30,9 +31,55 @@ def within(coord, min_c, max_c, tol=0.0):
 def constrain(val, min_val, max_val):
     return min(max_val, max(min_val, val))
 
-# Linear interpolation between two values
-def lerp(t, v0, v1):
-    return (1. - t) * v0 + t * v1
+# Length of the travel along a path of points
+def calc_path_length(points, order):
+    return sum([math.hypot(points[b][0] - points[a][0],
+                           points[b][1] - points[a][1])
+                for a, b in zip(order[:-1], order[1:])])
+
+# Maximum number of points to refine with 2-opt
+TWO_OPT_MAX_POINTS = 400
+
+# Reorder a path of points to reduce the total travel distance.  The
+# path starts at the first point.  Returns a list of indices into the
+# original list of points.
+def optimize_path(points):
+    count = len(points)
+    if count < 3:
+        return list(range(count))
+    def dist(a, b):
+        return math.hypot(points[b][0] - points[a][0],
+                          points[b][1] - points[a][1])
+    # Nearest neighbor ordering
+    remaining = list(range(1, count))
+    nn_order = [0]
+    while remaining:
+        last = nn_order[-1]
+        nxt = min(remaining, key=lambda i: dist(last, i))
+        remaining.remove(nxt)
+        nn_order.append(nxt)
+    candidates = [list(range(count)), nn_order]
+    if count <= TWO_OPT_MAX_POINTS:
+        # Refine each candidate by reversing sections of the path
+        for order in candidates:
+            improved = True
+            while improved:
+                improved = False
+                for i in range(1, count - 1):
+                    a, b = order[i-1], order[i]
+                    d_ab = dist(a, b)
+                    for j in range(i + 1, count):
+                        c = order[j]
+                        delta = dist(a, c) - d_ab
+                        if j + 1 < count:
+                            d = order[j+1]
+                            delta += dist(b, d) - dist(c, d)
+                        if delta < -.000001:
+                            order[i:j+1] = order[i:j+1][::-1]
+                            b = order[i]
+                            d_ab = dist(a, b)
+                            improved = True
+    return min(candidates, key=lambda o: calc_path_length(points, o))
 
 # retreive commma separated pair from config
 def parse_config_pair(config, option, default, minval=None, maxval=None):
@@ -217,13 +264,12 @@ class BedMesh:
             self.toolhead.move([x, y, z + self.fade_target, e], speed)
         else:
             self.splitter.build_move(self.last_position, newpos, factor)
-            while not self.splitter.traverse_complete:
-                split_move = self.splitter.split()
-                if split_move:
+            while 1:
+                split_moves = self.splitter.split()
+                if not split_moves:
+                    break
+                for split_move in split_moves:
                     self.toolhead.move(split_move, speed)
-                else:
-                    raise self.gcode.error(
-                        "Mesh Leveling: Error splitting move ")
         self.last_position[:] = newpos
     def get_status(self, eventtime=None):
         return self.status
@@ -299,6 +345,14 @@ class BedMesh:
                 "mesh_matrix": self.z_mesh.get_mesh_matrix(),
                 "mesh_params": self.z_mesh.get_mesh_params()
             }
+            positions = web_request.get("positions", None, types=(list,))
+            if positions is not None:
+                try:
+                    positions = [(float(p[0]), float(p[1])) for p in positions]
+                except (TypeError, ValueError, IndexError):
+                    raise web_request.error("Invalid Argument [positions]")
+                result["current_mesh"]["z_adjustments"] = \
+                    self.z_mesh.calc_z_batch(positions)
         mesh_args = web_request.get_dict("mesh_args", {})
         gcmd = None
         if mesh_args:
@@ -817,7 +871,11 @@ class ProbeManager:
         self.base_points = []
         self.substitutes = collections.OrderedDict()
         self.is_round = orig_config["radius"] is not None
-        self.probe_helper = probe.ProbePointsHelper(config, finalize_cb, [])
+        self.optimize_path = config.getboolean("optimize_probe_path", False)
+        self.probe_order = None
+        self.finalize_cb = finalize_cb
+        self.probe_helper = probe.ProbePointsHelper(
+            config, self._probe_finalize, [])
         self.probe_helper.use_xy_offsets(True)
         self.rapid_scan_helper = RapidScanHelper(config, self, finalize_cb)
         self._init_faulty_regions(config)
@@ -944,7 +1002,28 @@ class ProbeManager:
         self.overshoot = self.cfg_overshoot + math.floor(add_ovs)
         min_pt, max_pt = (min_x, min_y), (max_x, max_y)
         self._process_faulty_regions(min_pt, max_pt, radius)
-        self.probe_helper.update_probe_points(self.get_std_path(), 3)
+        path = self.get_std_path()
+        self.probe_order = None
+        if self.optimize_path:
+            # The probe offsets shift every point equally, so the travel
+            # of the toolhead matches the travel along the probe path
+            self.probe_order = optimize_path(path)
+            logging.info(
+                "bed_mesh: optimized probe path length %.1fmm (was %.1fmm)"
+                % (calc_path_length(path, self.probe_order),
+                   calc_path_length(path, list(range(len(path))))))
+            path = [path[i] for i in self.probe_order]
+        self.probe_helper.update_probe_points(path, 3)
+
+    def _probe_finalize(self, offsets, positions):
+        # Return the results in the order of the standard path
+        order = self.probe_order
+        if order is not None and len(positions) == len(order):
+            std_positions = [None] * len(order)
+            for idx, pos in zip(order, positions):
+                std_positions[idx] = pos
+            positions = std_positions
+        return self.finalize_cb(offsets, positions)
 
     def _process_faulty_regions(self, min_pt, max_pt, radius):
         if not self.faulty_regions:
@@ -1251,6 +1330,10 @@ class RapidScanHelper:
         return [(pos - ofs) for pos, ofs in zip(point, offsets)]
 
 
+# Number of split positions generated per call to mesh_splitter_split()
+SPLIT_BATCH = 32
+
+# The move splitting is implemented in klippy/chelper/bedmesh.c
 class MoveSplitter:
     def __init__(self, config, gcode):
         self.split_delta_z = config.getfloat(
@@ -1260,59 +1343,34 @@ class MoveSplitter:
         self.z_mesh = None
         self.fade_offset = 0.
         self.gcode = gcode
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.splitter = ffi_main.gc(ffi_lib.mesh_splitter_alloc(),
+                                    ffi_lib.mesh_splitter_free)
+        self.positions = ffi_main.new('double[]', 4 * SPLIT_BATCH)
+        self.ffi_unpack = ffi_main.unpack
+        self.mesh_splitter_build_move = ffi_lib.mesh_splitter_build_move
+        self.mesh_splitter_split = ffi_lib.mesh_splitter_split
+        self.mesh_splitter_set_params = ffi_lib.mesh_splitter_set_params
+        self.mesh_splitter_set_params(self.splitter, self.split_delta_z,
+                                      self.move_check_distance, 0.)
     def initialize(self, mesh, fade_offset):
         self.z_mesh = mesh
         self.fade_offset = fade_offset
+        self.mesh_splitter_set_params(self.splitter, self.split_delta_z,
+                                      self.move_check_distance, fade_offset)
     def build_move(self, prev_pos, next_pos, factor):
-        self.prev_pos = tuple(prev_pos)
-        self.next_pos = tuple(next_pos)
-        self.current_pos = list(prev_pos)
-        self.z_factor = factor
-        self.z_offset = self._calc_z_offset(prev_pos)
-        self.traverse_complete = False
-        self.distance_checked = 0.
-        axes_d = [self.next_pos[i] - self.prev_pos[i] for i in range(4)]
-        self.total_move_length = math.sqrt(sum([d*d for d in axes_d[:3]]))
-        self.axis_move = [not isclose(d, 0., abs_tol=1e-10) for d in axes_d]
-    def _calc_z_offset(self, pos):
-        z = self.z_mesh.calc_z(pos[0], pos[1])
-        offset = self.fade_offset
-        return self.z_factor * (z - offset) + offset
-    def _set_next_move(self, distance_from_prev):
-        t = distance_from_prev / self.total_move_length
-        if t > 1. or t < 0.:
+        self.mesh_splitter_build_move(self.splitter, self.z_mesh.get_c_mesh(),
+                                      prev_pos, next_pos, factor)
+    def split(self):
+        # Return a list of upcoming positions (empty list if complete)
+        count = self.mesh_splitter_split(self.splitter, self.positions,
+                                         SPLIT_BATCH)
+        if count < 0:
             raise self.gcode.error(
                 "bed_mesh: Slice distance is negative "
                 "or greater than entire move length")
-        for i in range(4):
-            if self.axis_move[i]:
-                self.current_pos[i] = lerp(
-                    t, self.prev_pos[i], self.next_pos[i])
-    def split(self):
-        if not self.traverse_complete:
-            if self.axis_move[0] or self.axis_move[1]:
-                # X and/or Y axis move, traverse if necessary
-                while self.distance_checked + self.move_check_distance \
-                        < self.total_move_length:
-                    self.distance_checked += self.move_check_distance
-                    self._set_next_move(self.distance_checked)
-                    next_z = self._calc_z_offset(self.current_pos)
-                    if abs(next_z - self.z_offset) >= self.split_delta_z:
-                        self.z_offset = next_z
-                        return self.current_pos[0], self.current_pos[1], \
-                            self.current_pos[2] + self.z_offset, \
-                            self.current_pos[3]
-            # end of move reached
-            self.current_pos[:] = self.next_pos
-            self.z_offset = self._calc_z_offset(self.current_pos)
-            # Its okay to add Z-Offset to the final move, since it will not be
-            # used again.
-            self.current_pos[2] += self.z_offset
-            self.traverse_complete = True
-            return self.current_pos
-        else:
-            # Traverse complete
-            return None
+        p = self.ffi_unpack(self.positions, count * 4)
+        return [p[i:i+4] for i in range(0, count * 4, 4)]
 
 
 class ZMesh:
@@ -1321,6 +1379,9 @@ class ZMesh:
         self.probed_matrix = self.mesh_matrix = None
         self.mesh_params = params
         self.mesh_offsets = [0., 0.]
+        self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.c_mesh = self.ffi_main.gc(self.ffi_lib.bed_mesh_alloc(),
+                                       self.ffi_lib.bed_mesh_free)
         logging.debug('bed_mesh: probe/mesh parameters:')
         for key, value in self.mesh_params.items():
             logging.debug("%s :  %s" % (key, value))
@@ -1402,6 +1463,7 @@ class ZMesh:
     def build_mesh(self, z_matrix):
         self.probed_matrix = z_matrix
         self._sample(z_matrix)
+        self._update_c_mesh()
         self.print_mesh(logging.debug)
     def set_zero_reference(self, xpos, ypos):
         offset = self.calc_z(xpos, ypos)
@@ -1413,25 +1475,43 @@ class ZMesh:
             for yidx in range(len(matrix)):
                 for xidx in range(len(matrix[yidx])):
                     matrix[yidx][xidx] -= offset
+        self._update_c_mesh()
     def set_mesh_offsets(self, offsets):
         for i, o in enumerate(offsets):
             if o is not None:
                 self.mesh_offsets[i] = o
+        self.ffi_lib.bed_mesh_set_offsets(self.c_mesh, *self.mesh_offsets)
+    def _update_c_mesh(self):
+        # Store a copy of the mesh matrix in the C bed_mesh object
+        matrix = self.mesh_matrix
+        if matrix is None:
+            self.ffi_lib.bed_mesh_set_matrix(self.c_mesh, self.ffi_main.NULL,
+                                             0, 0, 0., 0., 0., 0.)
+            return
+        values = [z for line in matrix for z in line]
+        self.ffi_lib.bed_mesh_set_matrix(
+            self.c_mesh, values, self.mesh_x_count, self.mesh_y_count,
+            self.mesh_x_min, self.mesh_y_min,
+            self.mesh_x_dist, self.mesh_y_dist)
+    def get_c_mesh(self):
+        return self.c_mesh
     def get_x_coordinate(self, index):
         return self.mesh_x_min + self.mesh_x_dist * index
     def get_y_coordinate(self, index):
         return self.mesh_y_min + self.mesh_y_dist * index
     def calc_z(self, x, y):
-        if self.mesh_matrix is not None:
-            tbl = self.mesh_matrix
-            tx, xidx = self._get_linear_index(x + self.mesh_offsets[0], 0)
-            ty, yidx = self._get_linear_index(y + self.mesh_offsets[1], 1)
-            z0 = lerp(tx, tbl[yidx][xidx], tbl[yidx][xidx+1])
-            z1 = lerp(tx, tbl[yidx+1][xidx], tbl[yidx+1][xidx+1])
-            return lerp(ty, z0, z1)
-        else:
-            # No mesh table generated, no z-adjustment
-            return 0.
+        # See bed_mesh_calc_z() in klippy/chelper/bedmesh.c
+        return self.ffi_lib.bed_mesh_calc_z(self.c_mesh, x, y)
+    def calc_z_batch(self, positions):
+        # Return the z adjustment of a list of (x, y) positions
+        count = len(positions)
+        if not count:
+            return []
+        xy = self.ffi_main.new('double[]', [c for x, y in positions
+                                            for c in (x, y)])
+        z_values = self.ffi_main.new('double[]', count)
+        self.ffi_lib.bed_mesh_calc_z_batch(self.c_mesh, xy, z_values, count)
+        return self.ffi_main.unpack(z_values, count)
     def get_z_range(self):
         if self.mesh_matrix is not None:
             mesh_min = min([min(x) for x in self.mesh_matrix])
@@ -1449,24 +1529,6 @@ class ZMesh:
             return round(avg_z, 2)
         else:
             return 0.
-    def _get_linear_index(self, coord, axis):
-        if axis == 0:
-            # X-axis
-            mesh_min = self.mesh_x_min
-            mesh_cnt = self.mesh_x_count
-            mesh_dist = self.mesh_x_dist
-            cfunc = self.get_x_coordinate
-        else:
-            # Y-axis
-            mesh_min = self.mesh_y_min
-            mesh_cnt = self.mesh_y_count
-            mesh_dist = self.mesh_y_dist
-            cfunc = self.get_y_coordinate
-        t = 0.
-        idx = int(math.floor((coord - mesh_min) / mesh_dist))
-        idx = constrain(idx, 0, mesh_cnt - 2)
-        t = (coord - cfunc(idx)) / mesh_dist
-        return constrain(t, 0., 1.), idx
     def _sample_direct(self, z_matrix):
         self.mesh_matrix = z_matrix
     def _sample_lagrange(self, z_matrix):
@@ -1,9 +1,10 @@
 # Tools for reading bulk sensor data from the mcu
 #
-# Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2020-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading, struct
+import logging, threading, struct, json
+import chelper
 
 # This "bulk sensor" module facilitates the processing of sensor chip
 # measurements that do not require the host to respond with low
@@ -36,6 +37,7 @@ class BatchBulkHelper:
         self.batch_timer = None
         self.client_cbs = []
         self.webhooks_start_resp = {}
+        self.encode_cache = BatchEncodeCache()
     # Periodic batch processing
     def _start(self):
         if self.is_started:
@@ -76,6 +78,7 @@ class BatchBulkHelper:
             return self.printer.get_reactor().NEVER
         if not msg:
             return eventtime + self.batch_interval
+        self.encode_cache.reset()
         for client_cb in list(self.client_cbs):
             res = client_cb(msg)
             if not res:
@@ -91,7 +94,7 @@ class BatchBulkHelper:
         self._start()
     # Webhooks registration
     def _add_api_client(self, web_request):
-        whbatch = BatchWebhooksClient(web_request)
+        whbatch = BatchWebhooksClient(web_request, self.encode_cache)
         self.add_client(whbatch.handle_batch)
         web_request.send(self.webhooks_start_resp)
     def add_mux_endpoint(self, path, key, value, webhooks_start_resp):
@@ -99,17 +102,71 @@ class BatchBulkHelper:
         wh = self.printer.lookup_object('webhooks')
         wh.register_mux_endpoint(path, key, value, self._add_api_client)
 
+# Helper to encode each batch only once for all webhooks clients that
+# use the same response format
+class BatchEncodeCache:
+    def __init__(self):
+        self.encoded = {}
+    def reset(self):
+        self.encoded.clear()
+    def lookup(self, key, msg, encode_cb):
+        if key not in self.encoded:
+            self.encoded[key] = encode_cb(msg)
+        return self.encoded[key]
+
 # A webhooks wrapper for use by BatchBulkHelper
 class BatchWebhooksClient:
-    def __init__(self, web_request):
+    def __init__(self, web_request, encode_cache=None):
         self.cconn = web_request.get_client_connection()
         self.template = web_request.get_dict('response_template', {})
+        self.binary_data = web_request.get_boolean('binary_data', False)
+        if encode_cache is None:
+            encode_cache = BatchEncodeCache()
+        self.encode_cache = encode_cache
+        self.cache_key = (self.binary_data,
+                          json.dumps(self.template, sort_keys=True))
+    def _encode_binary(self, msg):
+        # Encode the "data" rows as packed little-endian doubles
+        data = msg.get('data')
+        if not isinstance(data, list):
+            return None
+        if data and any([isinstance(v, (tuple, list)) for v in data[0]]):
+            # Flatten nested values (eg, trapq positions) into the row
+            try:
+                data = [[f for v in row for f in v] for row in
+                        [[v if isinstance(v, (tuple, list)) else (v,)
+                          for v in row] for row in data]]
+            except TypeError:
+                return None
+        fields = len(data[0]) if data else 0
+        if any([len(row) != fields for row in data]):
+            return None
+        flat = [v for row in data for v in row]
+        try:
+            payload = struct.pack("<%dd" % (len(flat),), *flat)
+        except struct.error:
+            return None
+        params = dict(msg)
+        del params['data']
+        params['data_format'] = {'count': len(data), 'fields': fields,
+                                 'type': 'float64'}
+        tmp = dict(self.template)
+        tmp['params'] = params
+        return self.cconn.encode_message(tmp, binary_payload=payload)
+    def _encode(self, msg):
+        if self.binary_data:
+            jmsg = self._encode_binary(msg)
+            if jmsg is not None:
+                return jmsg
+        tmp = dict(self.template)
+        tmp['params'] = msg
+        return self.cconn.encode_message(tmp)
     def handle_batch(self, msg):
         if self.cconn.is_closed():
             return False
-        tmp = dict(self.template)
-        tmp['params'] = msg
-        self.cconn.send(tmp)
+        jmsg = self.encode_cache.lookup(self.cache_key, msg, self._encode)
+        if jmsg is not None:
+            self.cconn.send_encoded(jmsg)
         return True
 
 # Helper class to store incoming messages in a queue
@@ -202,26 +259,69 @@ MAX_BULK_MSG_SIZE = 51
 
 # Read sensor_bulk_data and calculate timestamps for devices that take
 # samples at a fixed frequency (and produce fixed data size samples).
+# If compress_fields is set then the mcu sends that many delta encoded
+# values per sample (see sensor_bulk_add_sample() in the mcu code).
+# If packed is set then the mcu code may send samples that span two
+# messages (see sensor_bulk_add_data() in the mcu code).
 class FixedFreqReader:
-    def __init__(self, mcu, chip_clock_smooth, unpack_fmt):
+    def __init__(self, mcu, chip_clock_smooth, unpack_fmt, compress_fields=0,
+                 packed=False):
         self.mcu = mcu
         self.clock_sync = ClockSyncRegression(mcu, chip_clock_smooth)
+        self.unpack_fmt = unpack_fmt
         unpack = struct.Struct(unpack_fmt)
         self.unpack_from = unpack.unpack_from
         self.bytes_per_sample = unpack.size
+        self.fields_per_sample = len(unpack.unpack_from(b"\0" * unpack.size))
         self.samples_per_block = MAX_BULK_MSG_SIZE // self.bytes_per_sample
+        self.compress_fields = compress_fields
+        if compress_fields:
+            # Compressed messages have a variable number of samples and
+            # their sequence is the index of the first sample
+            self.fields_per_sample = compress_fields
+            self.samples_per_block = 1
+        self.packed = packed
+        self.is_packed = False
+        self.packed_pos = 0
+        self.packed_carry = b""
         self.last_sequence = self.max_query_duration = 0
         self.last_overflows = 0
         self.bulk_queue = self.oid = self.query_status_cmd = None
+        # C based message decoding
+        self.bulk_decoder = None
+        self.decode_size = 0
+        self.decode_times = self.decode_values = None
+        self.decode_last_chip_clock = None
     def setup_query_command(self, msgformat, oid, cq):
         # Lookup sensor query command (that responds with sensor_bulk_status)
         self.oid = oid
+        # Older mcu code does not send packed messages
+        if self.packed and 'SENSOR_BULK_PACKED' in self.mcu.get_constants():
+            self.is_packed = True
         self.query_status_cmd = self.mcu.lookup_query_command(
             msgformat, "sensor_bulk_status oid=%c clock=%u query_ticks=%u"
             " next_sequence=%hu buffered=%u possible_overflows=%hu",
             oid=oid, cq=cq)
         # Read sensor_bulk_data messages and store in a queue
         self.bulk_queue = BulkDataQueue(self.mcu, oid=oid)
+        # Decode sensor_bulk_data messages in C code (if possible)
+        serialqueue = self.mcu.get_serialqueue()
+        if serialqueue is None:
+            return
+        data_tag = self.mcu.lookup_command(
+            "sensor_bulk_data oid=%c sequence=%hu data=%*s").get_command_tag()
+        ffi_main, ffi_lib = chelper.get_ffi()
+        decode_fmt = self.unpack_fmt
+        if self.compress_fields:
+            decode_fmt = "z" + "h" * self.compress_fields
+        elif self.is_packed:
+            decode_fmt = "p" + decode_fmt
+        bulk_decoder = ffi_lib.bulk_decoder_alloc(
+            serialqueue, data_tag, oid, decode_fmt.encode())
+        if bulk_decoder == ffi_main.NULL:
+            return
+        self.bulk_decoder = ffi_main.gc(bulk_decoder, ffi_lib.bulk_decoder_free)
+        self.decode_last_chip_clock = ffi_main.new('int64_t *')
     def get_last_overflows(self):
         return self.last_overflows
     def _clear_duration_filter(self):
@@ -229,8 +329,13 @@ class FixedFreqReader:
     def note_start(self):
         self.last_sequence = 0
         self.last_overflows = 0
+        self.packed_pos = 0
+        self.packed_carry = b""
         # Clear local queue (clear any stale samples from previous session)
         self.bulk_queue.clear_queue()
+        if self.bulk_decoder is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.bulk_decoder_start(self.bulk_decoder)
         # Set initial clock
         self._clear_duration_filter()
         self._update_clock(is_reset=True)
@@ -238,6 +343,9 @@ class FixedFreqReader:
     def note_end(self):
         # Clear local queue (free no longer needed memory)
         self.bulk_queue.clear_queue()
+        if self.bulk_decoder is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.bulk_decoder_stop(self.bulk_decoder)
     def _update_clock(self, is_reset=False):
         params = self.query_status_cmd.send([self.oid])
         mcu_clock = self.mcu.clock32_to_clock64(params['clock'])
@@ -253,8 +361,12 @@ class FixedFreqReader:
                                           self.mcu.seconds_to_clock(.000005))
             return
         self.max_query_duration = 2 * duration
-        msg_count = (self.last_sequence * self.samples_per_block
-                     + buffered // self.bytes_per_sample)
+        if self.is_packed:
+            msg_count = ((self.last_sequence * MAX_BULK_MSG_SIZE + buffered)
+                         // self.bytes_per_sample)
+        else:
+            msg_count = (self.last_sequence * self.samples_per_block
+                         + buffered // self.bytes_per_sample)
         # The "chip clock" is the message counter plus .5 for average
         # inaccuracy of query responses and plus .5 for assumed offset
         # of hardware processing time.
@@ -264,14 +376,119 @@ class FixedFreqReader:
             self.clock_sync.reset(avg_mcu_clock, chip_clock)
         else:
             self.clock_sync.update(avg_mcu_clock, chip_clock)
+    # Decode sensor_bulk_data messages stored by the C bulk_decoder
+    def has_sample_arrays(self):
+        return self.bulk_decoder is not None
+    def pull_sample_arrays(self):
+        # Like pull_samples(), but return the C decoded arrays
+        self._update_clock()
+        return self._decode_sample_arrays()
+    def _decode_sample_arrays(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        count = ffi_lib.bulk_decoder_collect(self.bulk_decoder)
+        if not count:
+            return 0, self.decode_times, self.decode_values
+        if count > self.decode_size:
+            self.decode_size = count
+            self.decode_times = ffi_main.new('double[]', count)
+            self.decode_values = ffi_main.new(
+                'int64_t[]', count * self.fields_per_sample)
+        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
+        count = ffi_lib.bulk_decoder_decode(
+            self.bulk_decoder, self.last_sequence, self.samples_per_block,
+            time_base, chip_base, inv_freq, self.decode_times,
+            self.decode_values, self.decode_last_chip_clock)
+        self.clock_sync.set_last_chip_clock(self.decode_last_chip_clock[0])
+        return count, self.decode_times, self.decode_values
+    def _pull_decoded_samples(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        count, times, values = self._decode_sample_arrays()
+        if not count:
+            return []
+        fcount = self.fields_per_sample
+        times = ffi_main.unpack(times, count)
+        values = ffi_main.unpack(values, count * fcount)
+        return list(zip(times, *[values[i::fcount] for i in range(fcount)]))
+    # Decode a compressed sensor_bulk_data message into a list of samples
+    def _decode_compressed(self, data):
+        values = []
+        v = shift = 0
+        for c in bytearray(data):
+            v |= (c & 0x7f) << shift
+            shift += 7
+            if not c & 0x80:
+                values.append((v >> 1) ^ -(v & 1))
+                v = shift = 0
+        fcount = self.compress_fields
+        last = [0] * fcount
+        samples = []
+        for i in range(len(values) // fcount):
+            for j in range(fcount):
+                last[j] += values[i * fcount + j]
+            samples.append(tuple(last))
+        return samples
+    def _pull_compressed_samples(self, raw_samples):
+        last_sequence = self.last_sequence
+        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
+        chip_clock = 0
+        samples = []
+        for params in raw_samples:
+            seq_diff = (params['sequence'] - last_sequence) & 0xffff
+            seq_diff -= (seq_diff & 0x8000) << 1
+            chip_clock = last_sequence + seq_diff
+            for udata in self._decode_compressed(params['data']):
+                ptime = time_base + (chip_clock - chip_base) * inv_freq
+                samples.append((ptime,) + udata)
+                chip_clock += 1
+        self.clock_sync.set_last_chip_clock(chip_clock - 1)
+        return samples
+    def _pull_packed_samples(self, raw_samples):
+        last_sequence = self.last_sequence
+        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
+        unpack_from = self.unpack_from
+        bytes_per_sample = self.bytes_per_sample
+        chip_clock = 0
+        samples = []
+        for params in raw_samples:
+            seq_diff = (params['sequence'] - last_sequence) & 0xffff
+            seq_diff -= (seq_diff & 0x8000) << 1
+            stream_pos = (last_sequence + seq_diff) * MAX_BULK_MSG_SIZE
+            data = params['data']
+            if stream_pos == self.packed_pos:
+                # Add the start of a sample from the previous message
+                carry = self.packed_carry
+                data = carry + data
+                stream_pos -= len(carry)
+            else:
+                # Missing data - resync at the next sample boundary
+                skip = -stream_pos % bytes_per_sample
+                data = data[skip:]
+                stream_pos += skip
+            self.packed_pos = stream_pos + len(data)
+            count = len(data) // bytes_per_sample
+            for i in range(count):
+                chip_clock = stream_pos // bytes_per_sample + i
+                ptime = time_base + (chip_clock - chip_base) * inv_freq
+                udata = unpack_from(data, i * bytes_per_sample)
+                samples.append((ptime,) + udata)
+            self.packed_carry = data[count * bytes_per_sample:]
+        if samples:
+            self.clock_sync.set_last_chip_clock(chip_clock)
+        return samples
     # Convert sensor_bulk_data responses into list of samples
     def pull_samples(self):
         # Query MCU for sample timing and update clock synchronization
         self._update_clock()
+        if self.bulk_decoder is not None:
+            return self._pull_decoded_samples()
         # Pull sensor_bulk_data messages from local queue
         raw_samples = self.bulk_queue.pull_queue()
         if not raw_samples:
             return []
+        if self.compress_fields:
+            return self._pull_compressed_samples(raw_samples)
+        if self.is_packed:
+            return self._pull_packed_samples(raw_samples)
         # Load variables to optimize inner loop below
         last_sequence = self.last_sequence
         time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
@@ -1,26 +1,233 @@
 # Support for tracking canbus node ids
 #
-# Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
+import os, json, logging
+import chelper
 
 NODEID_FIRST = 4
+NODEID_LAST = 255
+NODEID_CACHE_FILE = "~/.cache/klipper/canbus_nodeids.json"
+
+CANBUS_ID_ADMIN = 0x3f0
+CMD_QUERY_UNASSIGNED = 0x00
+CMD_SET_KLIPPER_NODEID = 0x01
+RESP_NEED_NODEID = 0x20
+
+ASSIGN_POLL_TIME = 0.100
+ASSIGN_TIMEOUT = 90.
+
+# Tracking of the bandwidth shared by all mcus on one canbus interface
+class CANBusScheduler:
+    def __init__(self, iface):
+        self.iface = iface
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.sched = ffi_main.gc(ffi_lib.canbus_sched_alloc(),
+                                 ffi_lib.canbus_sched_free)
+        self.stats_struct = ffi_main.new('struct canbus_sched_stats *')
+        self.get_stats = ffi_lib.canbus_sched_get_stats
+        self.last_stats_time = self.last_busy_time = 0.
+        self.utilization = 0.
+    def get_sched(self):
+        return self.sched
+    def stats(self, eventtime):
+        st = self.stats_struct
+        self.get_stats(self.sched, st)
+        if not st.node_count:
+            return ""
+        if self.last_stats_time and eventtime > self.last_stats_time:
+            self.utilization = ((st.busy_time - self.last_busy_time)
+                                / (eventtime - self.last_stats_time))
+        self.last_stats_time = eventtime
+        self.last_busy_time = st.busy_time
+        return ("canbus_%s: bus_nodes=%d bus_bytes=%d bus_busy_time=%.3f"
+                " bus_utilization=%.3f bus_deferrals=%d" % (
+                    self.iface, st.node_count, st.bytes, st.busy_time,
+                    self.utilization, st.deferrals))
+
+# Assign node ids to all the mcus on one canbus interface.  The
+# assignments are broadcast once and then the bus is polled for nodes
+# that are still unassigned (for example, nodes that are slower to
+# boot after a power cycle) until all the mcus have connected.
+class CANBusAssigner:
+    def __init__(self, printer, iface, canbus_fd, ids):
+        self.printer = printer
+        self.reactor = printer.get_reactor()
+        self.iface = iface
+        self.canbus_fd = canbus_fd
+        self.ids = ids
+        self.pending = set(ids.keys())
+        self.bus = None
+        self.end_time = self.reactor.monotonic() + ASSIGN_TIMEOUT
+        self.assign_timer = self.reactor.register_timer(self._assign_event)
+    def _set_id_msg(self, uuid):
+        import can
+        data = [CMD_SET_KLIPPER_NODEID] + list(uuid) + [self.ids[uuid]]
+        return can.Message(arbitration_id=CANBUS_ID_ADMIN, data=data,
+                           is_extended_id=False)
+    def start(self):
+        import can
+        filters = [{"can_id": CANBUS_ID_ADMIN + 1, "can_mask": 0x7ff,
+                    "extended": False}]
+        try:
+            self.bus = can.interface.Bus(channel=self.iface,
+                                         can_filters=filters,
+                                         bustype='socketcan', fd=self.canbus_fd)
+            for uuid in sorted(self.pending):
+                self.bus.send(self._set_id_msg(uuid))
+        except (can.CanError, os.error, IOError) as e:
+            logging.warning("canbus %s: Unable to assign node ids: %s",
+                            self.iface, e)
+            self.stop()
+            return
+        self.reactor.update_timer(self.assign_timer,
+                                  self.reactor.monotonic() + ASSIGN_POLL_TIME)
+    def stop(self):
+        self.reactor.update_timer(self.assign_timer, self.reactor.NEVER)
+        if self.bus is not None:
+            self.bus.shutdown()
+            self.bus = None
+    def note_connected(self, uuid):
+        self.pending.discard(uuid)
+        if not self.pending:
+            self.stop()
+    def _assign_event(self, eventtime):
+        import can
+        if eventtime > self.end_time:
+            self.stop()
+            return self.reactor.NEVER
+        try:
+            # Assign an id to any known node that reported it needs one
+            while 1:
+                msg = self.bus.recv(timeout=0.)
+                if msg is None:
+                    break
+                if msg.dlc < 7 or msg.data[0] != RESP_NEED_NODEID:
+                    continue
+                uuid = tuple(bytearray(msg.data[1:7]))
+                if uuid in self.pending:
+                    self.bus.send(self._set_id_msg(uuid))
+            self.bus.send(can.Message(arbitration_id=CANBUS_ID_ADMIN,
+                                      data=[CMD_QUERY_UNASSIGNED],
+                                      is_extended_id=False))
+        except (can.CanError, os.error, IOError) as e:
+            logging.warning("canbus %s: Error during node id assignment: %s",
+                            self.iface, e)
+            self.stop()
+            return self.reactor.NEVER
+        return eventtime + ASSIGN_POLL_TIME
+
+def decode_uuid(canbus_uuid):
+    try:
+        uuid = int(canbus_uuid, 16)
+    except ValueError:
+        return None
+    if uuid < 0 or uuid > 0xffffffffffff:
+        return None
+    return tuple([(uuid >> (40 - i*8)) & 0xff for i in range(6)])
 
 class PrinterCANBus:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.ids = {}
+        self.uuids = []
+        self.ifaces = {}
+        self.assigners = {}
+        self.schedulers = {}
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+    def _handle_disconnect(self):
+        for assigner in self.assigners.values():
+            assigner.stop()
     def add_uuid(self, config, canbus_uuid, canbus_iface):
-        if canbus_uuid in self.ids:
+        if canbus_uuid in self.ifaces:
             raise config.error("Duplicate canbus_uuid")
-        new_id = len(self.ids) + NODEID_FIRST
-        self.ids[canbus_uuid] = new_id
-        return new_id
+        self.uuids.append(canbus_uuid)
+        self.ifaces[canbus_uuid] = canbus_iface
+    # Node id cache (so that a node keeps its id across restarts)
+    def _read_cache(self):
+        filename = os.path.expanduser(NODEID_CACHE_FILE)
+        try:
+            f = open(filename, 'r')
+            cache = json.load(f)
+            f.close()
+        except (IOError, OSError, ValueError) as e:
+            return {}
+        if not isinstance(cache, dict):
+            return {}
+        return cache
+    def _write_cache(self, cache):
+        filename = os.path.expanduser(NODEID_CACHE_FILE)
+        tmpname = "%s.%d.tmp" % (filename, os.getpid())
+        try:
+            dirname = os.path.dirname(filename)
+            if not os.path.isdir(dirname):
+                os.makedirs(dirname)
+            f = open(tmpname, 'w')
+            json.dump(cache, f, sort_keys=True)
+            f.close()
+            os.rename(tmpname, filename)
+        except (IOError, OSError) as e:
+            logging.exception("Unable to write canbus node id cache %s",
+                              filename)
+    def _assign_ids(self):
+        # Reuse the node id from a previous run where possible, as the
+        # node may still hold that id
+        cache = self._read_cache()
+        used = set()
+        for canbus_uuid in self.uuids:
+            nodeid = cache.get(canbus_uuid)
+            if (type(nodeid) is int and nodeid not in used
+                and nodeid >= NODEID_FIRST and nodeid <= NODEID_LAST):
+                self.ids[canbus_uuid] = nodeid
+                used.add(nodeid)
+        free_ids = [i for i in range(NODEID_FIRST, NODEID_LAST + 1)
+                    if i not in used]
+        free_ids.reverse()
+        for canbus_uuid in self.uuids:
+            if canbus_uuid not in self.ids:
+                self.ids[canbus_uuid] = free_ids.pop()
+        # Keep the ids of other nodes that do not conflict
+        new_cache = {u: i for u, i in cache.items()
+                     if u not in self.ids and i not in self.ids.values()}
+        new_cache.update(self.ids)
+        if new_cache != cache:
+            self._write_cache(new_cache)
     def get_nodeid(self, canbus_uuid):
-        if canbus_uuid not in self.ids:
+        if canbus_uuid not in self.ifaces:
             raise self.printer.config_error("Unknown canbus_uuid %s"
                                             % (canbus_uuid,))
+        if not self.ids:
+            self._assign_ids()
         return self.ids[canbus_uuid]
+    def start_assignment(self, canbus_iface, canbus_fd):
+        # Broadcast the node ids of all mcus on an interface (once)
+        if canbus_iface in self.assigners:
+            return
+        ids = {}
+        for canbus_uuid, iface in self.ifaces.items():
+            uuid = decode_uuid(canbus_uuid)
+            if iface == canbus_iface and uuid is not None:
+                ids[uuid] = self.get_nodeid(canbus_uuid)
+        assigner = CANBusAssigner(self.printer, canbus_iface, canbus_fd, ids)
+        self.assigners[canbus_iface] = assigner
+        assigner.start()
+    def note_connected(self, canbus_uuid):
+        assigner = self.assigners.get(self.ifaces.get(canbus_uuid))
+        uuid = decode_uuid(canbus_uuid)
+        if assigner is not None and uuid is not None:
+            assigner.note_connected(uuid)
+    def get_scheduler(self, canbus_iface):
+        if canbus_iface not in self.schedulers:
+            self.schedulers[canbus_iface] = CANBusScheduler(canbus_iface)
+        return self.schedulers[canbus_iface].get_sched()
+    def stats(self, eventtime):
+        msgs = [s.stats(eventtime) for i, s in sorted(self.schedulers.items())]
+        return False, " ".join([m for m in msgs if m])
+    def get_status(self, eventtime):
+        return {iface: {'utilization': round(s.utilization, 3)}
+                for iface, s in self.schedulers.items()}
 
 def load_config(config):
     return PrinterCANBus(config)
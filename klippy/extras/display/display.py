@@ -1,6 +1,6 @@
 # Basic LCD display support
 #
-# Copyright (C) 2018-2022  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 # Copyright (C) 2018  Aleph Objects, Inc <marcio@alephobjects.com>
 # Copyright (C) 2018  Eric Callahan <arksine.code@gmail.com>
 #
@@ -23,7 +23,7 @@ LCD_chips = {
 
 # Storage of [display_template my_template] config sections
 class DisplayTemplate:
-    def __init__(self, config):
+    def __init__(self, config, defer=False):
         self.printer = config.get_printer()
         name_parts = config.get_name().split()
         if len(name_parts) != 2:
@@ -39,7 +39,7 @@ class DisplayTemplate:
                     "Option '%s' in section '%s' is not a valid literal" % (
                         option, config.get_name()))
         gcode_macro = self.printer.load_object(config, 'gcode_macro')
-        self.template = gcode_macro.load_template(config, 'text')
+        self.template = gcode_macro.load_template(config, 'text', defer=defer)
     def get_params(self):
         return self.params
     def render(self, context, **kwargs):
@@ -54,7 +54,7 @@ class DisplayTemplate:
 
 # Store [display_data my_group my_item] sections (one instance per group name)
 class DisplayGroup:
-    def __init__(self, config, name, data_configs):
+    def __init__(self, config, name, data_configs, defer_names={}):
         # Load and parse the position of display_data items
         items = []
         for c in data_configs:
@@ -73,10 +73,23 @@ class DisplayGroup:
         for row, col, name in sorted(items):
             c = configs_by_name[name]
             if c.get('text'):
-                template = gcode_macro.load_template(c, 'text')
+                template = gcode_macro.load_template(
+                    c, 'text', defer=(name in defer_names))
                 self.data_items.append((row, col, template))
-    def show(self, display, templates, eventtime):
+    def show(self, display, templates, eventtime, prev_status=None):
         context = self.data_items[0][2].create_template_context(eventtime)
+        printer = context['printer']
+        if prev_status is not None:
+            # Skip rendering if the status used by the templates is unchanged
+            try:
+                unchanged = all([printer[name] == status
+                                 for name, status in prev_status.items()])
+            except KeyError:
+                unchanged = False
+            if unchanged:
+                context.clear()
+                return prev_status
+        display.clear_screen()
         context['draw_progress_bar'] = display.draw_progress_bar
         def render(name, **kwargs):
             return templates[name].render(context, **kwargs)
@@ -85,6 +98,8 @@ class DisplayGroup:
             text = template.render(context)
             display.draw_text(row, col, text.replace('\n', ''), eventtime)
         context.clear() # Remove circular references for better gc
+        # Return the printer status accessed by the templates
+        return printer.cache
 
 # Global cache of DisplayTemplate, DisplayGroup, and glyphs
 class PrinterDisplayTemplate:
@@ -126,14 +141,18 @@ class PrinterDisplayTemplate:
         dt_main_names = { c.get_name(): 1 for c in dt_main }
         dt_def = [c for c in dconfig.get_prefix_sections('display_template ')
                   if c.get_name() not in dt_main_names]
-        for c in dt_main + dt_def:
+        for c in dt_main:
             dt = DisplayTemplate(c)
             self.display_templates[dt.name] = dt
+        for c in dt_def:
+            dt = DisplayTemplate(c, defer=True)
+            self.display_templates[dt.name] = dt
         # Load display_data sections
         dd_main = config.get_prefix_sections('display_data ')
         dd_main_names = { c.get_name(): 1 for c in dd_main }
         dd_def = [c for c in dconfig.get_prefix_sections('display_data ')
                   if c.get_name() not in dd_main_names]
+        dd_def_names = { c.get_name(): 1 for c in dd_def }
         groups = {}
         for c in dd_main + dd_def:
             name_parts = c.get_name().split()
@@ -142,7 +161,7 @@ class PrinterDisplayTemplate:
                                    % (c.get_name(),))
             groups.setdefault(name_parts[1], []).append(c)
         for group_name, data_configs in groups.items():
-            dg = DisplayGroup(config, group_name, data_configs)
+            dg = DisplayGroup(config, group_name, data_configs, dd_def_names)
             self.display_data_groups[group_name] = dg
         # Load display glyphs
         dg_prefix = 'display_glyph '
@@ -204,14 +223,17 @@ class PrinterLCD:
             self.screen_update_event)
         self.redraw_request_pending = False
         self.redraw_time = 0.
+        self.render_status = None
         # Register g-code commands
         gcode = self.printer.lookup_object("gcode")
         gcode.register_mux_command('SET_DISPLAY_GROUP', 'DISPLAY', name,
                                    self.cmd_SET_DISPLAY_GROUP,
-                                   desc=self.cmd_SET_DISPLAY_GROUP_help)
+                                   desc=self.cmd_SET_DISPLAY_GROUP_help,
+                                   auxiliary=True)
         if name == 'display':
             gcode.register_mux_command('SET_DISPLAY_GROUP', 'DISPLAY', None,
-                                       self.cmd_SET_DISPLAY_GROUP)
+                                       self.cmd_SET_DISPLAY_GROUP,
+                                       auxiliary=True)
     def get_dimensions(self):
         return self.lcd_chip.get_dimensions()
     def handle_ready(self):
@@ -223,20 +245,24 @@ class PrinterLCD:
         if self.redraw_request_pending:
             self.redraw_request_pending = False
             self.redraw_time = eventtime + REDRAW_MIN_TIME
-        self.lcd_chip.clear()
         # update menu component
-        if self.menu is not None:
-            ret = self.menu.screen_update_event(eventtime)
-            if ret:
-                self.lcd_chip.flush()
-                return eventtime + REDRAW_TIME
+        if self.menu is not None and self.menu.is_running():
+            self.lcd_chip.clear()
+            self.menu.screen_update_event(eventtime)
+            self.lcd_chip.flush()
+            self.render_status = None
+            return eventtime + REDRAW_TIME
         # Update normal display
         try:
-            self.show_data_group.show(self, self.display_templates, eventtime)
+            self.render_status = self.show_data_group.show(
+                self, self.display_templates, eventtime, self.render_status)
         except:
             logging.exception("Error during display screen update")
+            self.render_status = None
         self.lcd_chip.flush()
         return eventtime + REDRAW_TIME
+    def clear_screen(self):
+        self.lcd_chip.clear()
     def request_redraw(self):
         if self.redraw_request_pending:
             return
@@ -267,6 +293,7 @@ class PrinterLCD:
         if new_dg is None:
             raise gcmd.error("Unknown display_data group '%s'" % (group,))
         self.show_data_group = new_dg
+        self.render_status = None
 
 def load_config(config):
     return PrinterLCD(config)
@@ -35,6 +35,8 @@ class HD44780:
         self.oid = self.mcu.create_oid()
         self.mcu.register_config_callback(self.build_config)
         self.send_data_cmd = self.send_cmds_cmd = None
+        self.queue_size = None
+        self.queue_clock = 0
         self.icons = {}
         # framebuffers
         self.text_framebuffers = [bytearray(b' '*2*self.line_length),
@@ -60,11 +62,26 @@ class HD44780:
             "hd44780_send_cmds oid=%c cmds=%*s", cq=cmd_queue)
         self.send_data_cmd = self.mcu.lookup_command(
             "hd44780_send_data oid=%c data=%*s", cq=cmd_queue)
+        self.queue_size = self.mcu.get_constants().get("HD44780_QUEUE_SIZE")
+    def calc_minclock(self, count):
+        # Delay messages so that they don't overflow the mcu transmit queue
+        if self.queue_size is None:
+            return 0
+        byte_ticks = self.mcu.seconds_to_clock(HD44780_DELAY)
+        curtime = self.printer.get_reactor().monotonic()
+        clock = self.mcu.print_time_to_clock(
+            self.mcu.estimated_print_time(curtime))
+        start_clock = max(self.queue_clock, clock)
+        self.queue_clock = start_clock + count * byte_ticks
+        room = max(0, self.queue_size - count)
+        return max(0, start_clock - room * byte_ticks)
     def send(self, cmds, is_data=False):
         cmd_type = self.send_cmds_cmd
         if is_data:
             cmd_type = self.send_data_cmd
-        cmd_type.send([self.oid, cmds], reqclock=BACKGROUND_PRIORITY_CLOCK)
+        minclock = self.calc_minclock(len(cmds))
+        cmd_type.send([self.oid, cmds], minclock=minclock,
+                      reqclock=BACKGROUND_PRIORITY_CLOCK)
         #logging.debug("hd44780 %d %s", is_data, repr(cmds))
     def flush(self):
         # Find all differences in the framebuffers and send them to the chip
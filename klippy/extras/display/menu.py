@@ -33,12 +33,12 @@ class MenuElement(object):
         if config is not None:
             # overwrite class attributes from config
             self._index = config.getint('index', self._index)
-            self._name_tpl = manager.gcode_macro.load_template(
+            self._name_tpl = manager.load_template(
                 config, 'name', self._name)
             try:
                 self._enable = config.getboolean('enable', self._enable)
             except config.error:
-                self._enable_tpl = manager.gcode_macro.load_template(
+                self._enable_tpl = manager.load_template(
                     config, 'enable')
             # item namespace - used in relative paths
             self._ns = str(" ".join(config.get_name().split(' ')[1:])).strip()
@@ -77,7 +77,7 @@ class MenuElement(object):
         if isinstance(config, dict):
             self._scripts[name] = config.get(option, None)
         else:
-            self._scripts[name] = self.manager.gcode_macro.load_template(
+            self._scripts[name] = self.manager.load_template(
                 config, option, '')
 
     # override
@@ -441,11 +441,11 @@ class MenuInput(MenuCommand):
         if config is not None:
             # overwrite class attributes from config
             self._realtime = config.getboolean('realtime', self._realtime)
-            self._input_tpl = manager.gcode_macro.load_template(
+            self._input_tpl = manager.load_template(
                 config, 'input')
-            self._input_min_tpl = manager.gcode_macro.load_template(
+            self._input_min_tpl = manager.load_template(
                 config, 'input_min', str(self._input_min))
-            self._input_max_tpl = manager.gcode_macro.load_template(
+            self._input_max_tpl = manager.load_template(
                 config, 'input_max', str(self._input_max))
             self._input_step = config.getfloat(
                 'input_step', self._input_step, above=0.)
@@ -691,6 +691,7 @@ class MenuManager:
         self.menuitems = {}
         self.menustack = []
         self.children = {}
+        self.defer_templates = False
         self.display = display
         self.printer = config.get_printer()
         self.pconfig = self.printer.lookup_object('configfile')
@@ -997,6 +998,10 @@ class MenuManager:
             return list(self.children[ns])
         return list()
 
+    def load_template(self, config, option, default=None):
+        return self.gcode_macro.load_template(config, option, default,
+                                              defer=self.defer_templates)
+
     def load_config(self, *args):
         cfg = None
         filename = os.path.join(*args)
@@ -1006,7 +1011,12 @@ class MenuManager:
             raise self.printer.config_error(
                 "Cannot load config '%s'" % (filename,))
         if cfg:
-            self.load_menuitems(cfg)
+            # Items from the default menu are compiled on first use
+            self.defer_templates = True
+            try:
+                self.load_menuitems(cfg)
+            finally:
+                self.defer_templates = False
         return cfg
 
     def load_menuitems(self, config):
@@ -155,6 +155,8 @@ class ST7920(DisplayBase):
         self.oid = self.mcu.create_oid()
         self.mcu.register_config_callback(self.build_config)
         self.send_data_cmd = self.send_cmds_cmd = None
+        self.queue_size = None
+        self.queue_clock = 0
         self.is_extended = False
         # init display base
         DisplayBase.__init__(self)
@@ -171,6 +173,20 @@ class ST7920(DisplayBase):
             "st7920_send_cmds oid=%c cmds=%*s", cq=cmd_queue)
         self.send_data_cmd = self.mcu.lookup_command(
             "st7920_send_data oid=%c data=%*s", cq=cmd_queue)
+        self.queue_size = self.mcu.get_constants().get("ST7920_QUEUE_SIZE")
+    def calc_minclock(self, count):
+        # Delay messages so that they don't overflow the mcu transmit queue
+        if self.queue_size is None:
+            return 0
+        cmd_ticks = self.mcu.seconds_to_clock(ST7920_CMD_DELAY)
+        sync_ticks = self.mcu.seconds_to_clock(ST7920_SYNC_DELAY)
+        reactor = self.mcu.get_printer().get_reactor()
+        clock = self.mcu.print_time_to_clock(
+            self.mcu.estimated_print_time(reactor.monotonic()))
+        start_clock = max(self.queue_clock, clock)
+        self.queue_clock = start_clock + sync_ticks + (count - 1) * cmd_ticks
+        room = max(0, self.queue_size - count)
+        return max(0, start_clock - room * cmd_ticks)
     def send(self, cmds, is_data=False, is_extended=False):
         cmd_type = self.send_cmds_cmd
         if is_data:
@@ -181,7 +197,9 @@ class ST7920(DisplayBase):
                 add_cmd = 0x26
             cmds = [add_cmd] + cmds
             self.is_extended = is_extended
-        cmd_type.send([self.oid, cmds], reqclock=BACKGROUND_PRIORITY_CLOCK)
+        minclock = self.calc_minclock(len(cmds))
+        cmd_type.send([self.oid, cmds], minclock=minclock,
+                      reqclock=BACKGROUND_PRIORITY_CLOCK)
         #logging.debug("st7920 %d %s", is_data, repr(cmds))
 
 # Helper code for toggling the en pin on startup
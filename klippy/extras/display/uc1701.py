@@ -1,6 +1,6 @@
 # Support for UC1701 (and similar) 128x64 graphics LCD displays
 #
-# Copyright (C) 2018-2019  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 # Copyright (C) 2018  Eric Callahan  <arksine.code@gmail.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
@@ -21,9 +21,8 @@ class DisplayBase:
         self.vram = [bytearray(self.columns) for i in range(8)]
         self.all_framebuffers = [(self.vram[i], bytearray(b'~'*self.columns), i)
                                  for i in range(8)]
-        # Cache fonts and icons in display byte order
-        self.font = [self._swizzle_bits(bytearray(c))
-                     for c in font8x14.VGA_FONT]
+        # Cache fonts (as characters are used) and icons in display byte order
+        self.font = {}
         self.icons = {}
     def flush(self):
         # Find all differences in the framebuffers and send them to the chip
@@ -76,7 +75,11 @@ class DisplayBase:
         page_top = self.vram[y * 2]
         page_bot = self.vram[y * 2 + 1]
         for c in bytearray(data):
-            bits_top, bits_bot = self.font[c]
+            bits = self.font.get(c)
+            if bits is None:
+                bits = self._swizzle_bits(bytearray(font8x14.VGA_FONT[c]))
+                self.font[c] = bits
+            bits_top, bits_bot = bits
             page_top[pix_x:pix_x+8] = bits_top
             page_bot[pix_x:pix_x+8] = bits_bot
             pix_x += 8
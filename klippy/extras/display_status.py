@@ -14,11 +14,11 @@ class DisplayStatus:
         self.progress = self.message = None
         # Register commands
         gcode = self.printer.lookup_object('gcode')
-        gcode.register_command('M73', self.cmd_M73)
-        gcode.register_command('M117', self.cmd_M117)
+        gcode.register_command('M73', self.cmd_M73, auxiliary=True)
+        gcode.register_command('M117', self.cmd_M117, auxiliary=True)
         gcode.register_command(
             'SET_DISPLAY_TEXT', self.cmd_SET_DISPLAY_TEXT,
-            desc=self.cmd_SET_DISPLAY_TEXT_help)
+            desc=self.cmd_SET_DISPLAY_TEXT_help, auxiliary=True)
     def get_status(self, eventtime):
         progress = self.progress
         if progress is not None and eventtime > self.expire_progress:
@@ -17,6 +17,11 @@ class ExcludeObject:
                                         self._handle_connect)
         self.printer.register_event_handler("virtual_sdcard:reset_file",
                                             self._reset_file)
+        self.exclude_by_position = config.getboolean('exclude_by_position',
+                                                     False)
+        webhooks = self.printer.lookup_object('webhooks')
+        self.note_status_change = webhooks.register_status_notify(
+            config.get_name())
         self.next_transform = None
         self.last_position_extruded = [0., 0., 0., 0.]
         self.last_position_excluded = [0., 0., 0., 0.]
@@ -77,6 +82,32 @@ class ExcludeObject:
         self.excluded_objects = []
         self.current_object = None
         self.in_excluded_region = False
+        self.object_bounds = {}
+        self.excluded_bounds = []
+        self.note_status_change()
+
+    def _update_excluded_bounds(self):
+        # Bounding box index of the excluded objects with a polygon
+        self.excluded_bounds = [self.object_bounds[name]
+                                for name in self.excluded_objects
+                                if name in self.object_bounds]
+        self.note_status_change()
+
+    def _find_excluded_object(self, x, y):
+        for min_x, min_y, max_x, max_y, polygon in self.excluded_bounds:
+            if x < min_x or x > max_x or y < min_y or y > max_y:
+                continue
+            # Ray casting point in polygon test
+            inside = False
+            px, py = polygon[-1]
+            for cx, cy in polygon:
+                if (cy > y) != (py > y):
+                    if x < (px - cx) * (y - cy) / (py - cy) + cx:
+                        inside = not inside
+                px, py = cx, cy
+            if inside:
+                return True
+        return False
 
     def _reset_file(self):
         self._reset_state()
@@ -164,10 +195,16 @@ class ExcludeObject:
             - (self.max_position_extruded - self.last_position_extruded[3])
         self._normal_move(newpos, speed)
 
-    def _test_in_excluded_region(self):
-        # Inside cancelled object
-        return self.current_object in self.excluded_objects \
-            and self.initial_extrusion_moves == 0
+    def _test_in_excluded_region(self, newpos=None):
+        if self.initial_extrusion_moves:
+            return False
+        if self.current_object is not None or not self.exclude_by_position:
+            # Inside cancelled object
+            return self.current_object in self.excluded_objects
+        # No object markers - check if the move ends in an excluded object
+        if newpos is None or not self.excluded_bounds:
+            return False
+        return self._find_excluded_object(newpos[0], newpos[1])
 
     def get_status(self, eventtime=None):
         status = {
@@ -178,7 +215,7 @@ class ExcludeObject:
         return status
 
     def move(self, newpos, speed):
-        move_in_excluded_region = self._test_in_excluded_region()
+        move_in_excluded_region = self._test_in_excluded_region(newpos)
         self.last_speed = speed
 
         if move_in_excluded_region:
@@ -199,6 +236,7 @@ class ExcludeObject:
         if not any(obj["name"] == name for obj in self.objects):
             self._add_object_definition({"name": name})
         self.current_object = name
+        self.note_status_change()
         self.was_excluded_at_start = self._test_in_excluded_region()
 
     cmd_EXCLUDE_OBJECT_END_help = "Marks the end the current object"
@@ -214,6 +252,7 @@ class ExcludeObject:
                               (name.upper(), self.current_object))
 
         self.current_object = None
+        self.note_status_change()
 
     cmd_EXCLUDE_OBJECT_help = "Cancel moves inside a specified objects"
     def cmd_EXCLUDE_OBJECT(self, gcmd):
@@ -227,6 +266,7 @@ class ExcludeObject:
 
             else:
                 self.excluded_objects = []
+                self._update_excluded_bounds()
 
         elif name:
             if name.upper() not in self.excluded_objects:
@@ -273,12 +313,24 @@ class ExcludeObject:
     def _add_object_definition(self, definition):
         self.objects = sorted(self.objects + [definition],
                               key=lambda o: o["name"])
+        polygon = definition.get('polygon')
+        try:
+            polygon = [(float(p[0]), float(p[1])) for p in polygon]
+        except (TypeError, ValueError, IndexError):
+            polygon = None
+        if polygon:
+            xs = [p[0] for p in polygon]
+            ys = [p[1] for p in polygon]
+            self.object_bounds[definition["name"]] = (
+                min(xs), min(ys), max(xs), max(ys), polygon)
+        self._update_excluded_bounds()
 
     def _exclude_object(self, name):
         self._register_transform()
         self.gcode.respond_info('Excluding object {}'.format(name.upper()))
         if name not in self.excluded_objects:
             self.excluded_objects = sorted(self.excluded_objects + [name])
+            self._update_excluded_bounds()
 
     def _unexclude_object(self, name):
         self.gcode.respond_info('Unexcluding object {}'.format(name.upper()))
@@ -286,6 +338,7 @@ class ExcludeObject:
             excluded_objects = list(self.excluded_objects)
             excluded_objects.remove(name)
             self.excluded_objects = sorted(excluded_objects)
+            self._update_excluded_bounds()
 
     def _list_objects(self, gcmd):
         if gcmd.get('JSON', None) is not None:
@@ -6,7 +6,7 @@
 # Copyright (C) 2011 Camiel Gubbels / Erik van der Zalm
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import math
+import chelper
 
 # Coordinates created by this are converted into G1 commands.
 #
@@ -23,12 +23,18 @@ Y_AXIS = 1
 Z_AXIS = 2
 E_AXIS = 3
 
+# Number of segments generated per call to gcode_arc_fill()
+ARC_BATCH = 64
+
 
 class ArcSupport:
 
     def __init__(self, config):
         self.printer = config.get_printer()
         self.mm_per_arc_segment = config.getfloat('resolution', 1., above=0.0)
+        self.ffi_main, ffi_lib = chelper.get_ffi()
+        self.gcode_arc_plan = ffi_lib.gcode_arc_plan
+        self.gcode_arc_fill = ffi_lib.gcode_arc_fill
 
         self.gcode_move = self.printer.load_object(config, 'gcode_move')
         self.gcode = self.printer.lookup_object('gcode')
@@ -101,83 +107,44 @@ class ArcSupport:
     # Arcs smaller then this value, will be a Line only
     #
     # alpha and beta axes are the current plane, helical axis is linear travel
+    #
+    # The segments are generated by gcode_arc_plan() and gcode_arc_fill()
+    # in klippy/chelper/gcodearc.c
     def planArc(self, currentPos, targetPos, offset, clockwise,
                 gcmd, absolut_extrude,
                 alpha_axis, beta_axis, helical_axis):
         # todo: sometimes produces full circles
-
-        # Radius vector from center to current location
-        r_P = -offset[0]
-        r_Q = -offset[1]
-
-        # Determine angular travel
-        center_P = currentPos[alpha_axis] - r_P
-        center_Q = currentPos[beta_axis] - r_Q
-        rt_Alpha = targetPos[alpha_axis] - center_P
-        rt_Beta = targetPos[beta_axis] - center_Q
-        angular_travel = math.atan2(r_P * rt_Beta - r_Q * rt_Alpha,
-                                    r_P * rt_Alpha + r_Q * rt_Beta)
-        if angular_travel < 0.:
-            angular_travel += 2. * math.pi
-        if clockwise:
-            angular_travel -= 2. * math.pi
-
-        if (angular_travel == 0.
-            and currentPos[alpha_axis] == targetPos[alpha_axis]
-            and currentPos[beta_axis] == targetPos[beta_axis]):
-            # Make a circle if the angular rotation is 0 and the
-            # target is current position
-            angular_travel = 2. * math.pi
-
-        # Determine number of segments
-        linear_travel = targetPos[helical_axis] - currentPos[helical_axis]
-        radius = math.hypot(r_P, r_Q)
-        flat_mm = radius * angular_travel
-        if linear_travel:
-            mm_of_travel = math.hypot(flat_mm, linear_travel)
-        else:
-            mm_of_travel = math.fabs(flat_mm)
-        segments = max(1., math.floor(mm_of_travel / self.mm_per_arc_segment))
-
-        # Generate coordinates
-        theta_per_segment = angular_travel / segments
-        linear_per_segment = linear_travel / segments
-
         asE = gcmd.get_float("E", None)
         asF = gcmd.get_float("F", None)
-
-        e_per_move = e_base = 0.
+        if asF is not None and asF <= 0.:
+            raise gcmd.error("Invalid speed in 'G1'")
+
+        arc = self.ffi_main.new('struct gcode_arc *')
+        arc.start_pos = list(currentPos)
+        arc.target_pos = list(targetPos)
+        arc.offset = list(offset)
+        arc.clockwise = clockwise
+        arc.alpha_axis = alpha_axis
+        arc.beta_axis = beta_axis
+        arc.helical_axis = helical_axis
+        arc.mm_per_arc_segment = self.mm_per_arc_segment
+        arc.absolute_extrude = absolut_extrude
         if asE is not None:
-            if absolut_extrude:
-                e_base = currentPos[3]
-            e_per_move = (asE - e_base) / segments
-
-        for i in range(1, int(segments) + 1):
-            dist_Helical = i * linear_per_segment
-            c_theta = i * theta_per_segment
-            cos_Ti = math.cos(c_theta)
-            sin_Ti = math.sin(c_theta)
-            r_P = -offset[0] * cos_Ti + offset[1] * sin_Ti
-            r_Q = -offset[0] * sin_Ti - offset[1] * cos_Ti
-
-            c = [None, None, None]
-            c[alpha_axis] = center_P + r_P
-            c[beta_axis] = center_Q + r_Q
-            c[helical_axis] = currentPos[helical_axis] + dist_Helical
-
-
-            if i == segments:
-                c = targetPos
-            # Convert coords into G1 commands
-            g1_params = {'X': c[0], 'Y': c[1], 'Z': c[2]}
-            if e_per_move:
-                g1_params['E'] = e_base + e_per_move
-                if absolut_extrude:
-                    e_base += e_per_move
-            if asF is not None:
-                g1_params['F'] = asF
-            g1_gcmd = self.gcode.create_gcode_command("G1", "G1", g1_params)
-            self.gcode_move.cmd_G1(g1_gcmd)
+            arc.has_e = True
+            arc.e = asE
+        if asF is not None:
+            arc.has_f = True
+            arc.f = asF
+        if self.gcode_arc_plan(arc) < 0:
+            raise gcmd.error("G2/G3 arc is too large")
+
+        # Convert coords into G1 moves
+        move_lines = self.ffi_main.new('struct gcode_move_line[]', ARC_BATCH)
+        while 1:
+            count = self.gcode_arc_fill(arc, move_lines, ARC_BATCH)
+            if not count:
+                break
+            self.gcode_move.run_move_lines(move_lines, count)
 
 def load_config(config):
     return ArcSupport(config)
@@ -1,10 +1,10 @@
 # Add ability to define custom g-code macros
 #
-# Copyright (C) 2018-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import traceback, logging, ast, copy, json
-import jinja2
+import jinja2, jinja2.meta
 
 
 ######################################################################
@@ -13,9 +13,10 @@ import jinja2
 
 # Wrapper for access to printer object get_status() methods
 class GetStatusWrapper:
-    def __init__(self, printer, eventtime=None):
+    def __init__(self, printer, eventtime=None, status_cache=None):
         self.printer = printer
         self.eventtime = eventtime
+        self.status_cache = status_cache
         self.cache = {}
     def __getitem__(self, val):
         sval = str(val).strip()
@@ -24,9 +25,13 @@ class GetStatusWrapper:
         po = self.printer.lookup_object(sval, None)
         if po is None or not hasattr(po, 'get_status'):
             raise KeyError(val)
-        if self.eventtime is None:
-            self.eventtime = self.printer.get_reactor().monotonic()
-        self.cache[sval] = res = copy.deepcopy(po.get_status(self.eventtime))
+        if self.status_cache is not None:
+            status = self.status_cache(sval, po, self.eventtime)
+        else:
+            if self.eventtime is None:
+                self.eventtime = self.printer.get_reactor().monotonic()
+            status = po.get_status(self.eventtime)
+        self.cache[sval] = res = copy.deepcopy(status)
         return res
     def __contains__(self, val):
         try:
@@ -41,22 +46,55 @@ class GetStatusWrapper:
 
 # Wrapper around a Jinja2 template
 class TemplateWrapper:
-    def __init__(self, printer, env, name, script):
+    def __init__(self, printer, env, name, script, defer=False):
         self.printer = printer
+        self.env = env
         self.name = name
+        self.script = script
         self.gcode = self.printer.lookup_object('gcode')
+        self.reactor = self.printer.get_reactor()
         gcode_macro = self.printer.lookup_object('gcode_macro')
         self.create_template_context = gcode_macro.create_template_context
+        self.create_action_context = gcode_macro.create_action_context
+        self.render_count = 0
+        self.render_time = self.render_max = 0.
+        self.static_result = None
+        self.template = None
+        self.uses_printer = True
+        if not defer:
+            self._load_template(printer.config_error)
+    def _load_template(self, error):
+        env, script = self.env, self.script
         try:
-            self.template = env.from_string(script)
+            template = env.from_string(script)
+            variables = jinja2.meta.find_undeclared_variables(env.parse(script))
+            self.uses_printer = 'printer' in variables
+            if '{' not in script:
+                # No template constructs - render it only once
+                self.static_result = str(template.render({}))
         except Exception as e:
             msg = "Error loading template '%s': %s" % (
-                 name, traceback.format_exception_only(type(e), e)[-1])
+                 self.name, traceback.format_exception_only(type(e), e)[-1])
             logging.exception(msg)
-            raise printer.config_error(msg)
+            raise error(msg)
+        self.template = template
+    def create_render_context(self):
+        # Context for use only by this template
+        if self.template is None:
+            self._load_template(self.gcode.error)
+        if self.uses_printer:
+            return self.create_template_context()
+        return self.create_action_context()
     def render(self, context=None):
+        if self.template is None:
+            # Deferred template - compile it on first use
+            self._load_template(self.gcode.error)
+        if self.static_result is not None:
+            self.render_count += 1
+            return self.static_result
         if context is None:
-            context = self.create_template_context()
+            context = self.create_render_context()
+        starttime = self.reactor.monotonic()
         try:
             return str(self.template.render(context))
         except Exception as e:
@@ -64,6 +102,16 @@ class TemplateWrapper:
                 self.name, traceback.format_exception_only(type(e), e)[-1])
             logging.exception(msg)
             raise self.gcode.error(msg)
+        finally:
+            rtime = self.reactor.monotonic() - starttime
+            self.render_count += 1
+            self.render_time += rtime
+            self.render_max = max(self.render_max, rtime)
+    def get_render_stats(self):
+        return self.render_count, self.render_time, self.render_max
+    def reset_render_stats(self):
+        self.render_count = 0
+        self.render_time = self.render_max = 0.
     def run_gcode_from_command(self, context=None):
         self.gcode.run_script_from_command(self.render(context))
 
@@ -72,13 +120,33 @@ class PrinterGCodeMacro:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.env = jinja2.Environment('{%', '%}', '{', '}')
-    def load_template(self, config, option, default=None):
+        self.templates = []
+        self.status_cache = {}
+        self.status_cache_time = None
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("GCODE_MACRO_STATS", self.cmd_GCODE_MACRO_STATS,
+                               desc=self.cmd_GCODE_MACRO_STATS_help)
+    def load_template(self, config, option, default=None, defer=False):
+        # Templates from the default config files distributed with
+        # Klipper may be loaded with defer=True - they are known to
+        # be valid and are only compiled when first rendered
         name = "%s:%s" % (config.get_name(), option)
         if default is None:
             script = config.get(option)
         else:
             script = config.get(option, default)
-        return TemplateWrapper(self.printer, self.env, name, script)
+        template = TemplateWrapper(self.printer, self.env, name, script, defer)
+        self.templates.append(template)
+        return template
+    def _get_cached_status(self, name, po, eventtime):
+        # Share get_status() results between all renders at an eventtime
+        if eventtime != self.status_cache_time:
+            self.status_cache.clear()
+            self.status_cache_time = eventtime
+        status = self.status_cache.get(name)
+        if status is None:
+            self.status_cache[name] = status = po.get_status(eventtime)
+        return status
     def _action_emergency_stop(self, msg="action_emergency_stop"):
         self.printer.invoke_shutdown("Shutdown due to %s" % (msg,))
         return ""
@@ -94,14 +162,41 @@ class PrinterGCodeMacro:
         except self.printer.command_error:
             logging.exception("Remote Call Error")
         return ""
-    def create_template_context(self, eventtime=None):
+    def create_action_context(self):
         return {
-            'printer': GetStatusWrapper(self.printer, eventtime),
             'action_emergency_stop': self._action_emergency_stop,
             'action_respond_info': self._action_respond_info,
             'action_raise_error': self._action_raise_error,
             'action_call_remote_method': self._action_call_remote_method,
         }
+    def create_template_context(self, eventtime=None):
+        context = self.create_action_context()
+        if eventtime is None:
+            # Printer state may change between renders of commands
+            context['printer'] = GetStatusWrapper(self.printer)
+        else:
+            context['printer'] = GetStatusWrapper(self.printer, eventtime,
+                                                  self._get_cached_status)
+        return context
+    cmd_GCODE_MACRO_STATS_help = "Report template render times"
+    def cmd_GCODE_MACRO_STATS(self, gcmd):
+        if gcmd.get_int('RESET', 0):
+            for template in self.templates:
+                template.reset_render_stats()
+            gcmd.respond_info("Template render statistics reset")
+            return
+        stats = [(t.get_render_stats(), t.name) for t in self.templates]
+        stats = [(rtime, rmax, count, name)
+                 for (count, rtime, rmax), name in stats if count]
+        if not stats:
+            gcmd.respond_info("No templates rendered")
+            return
+        stats.sort(reverse=True)
+        limit = gcmd.get_int('COUNT', 10, minval=1)
+        lines = ["%s: renders=%d total=%.3fms avg=%.3fms max=%.3fms" % (
+            name, count, rtime * 1000., rtime * 1000. / count, rmax * 1000.)
+                 for rtime, rmax, count, name in stats[:limit]]
+        gcmd.respond_info("\n".join(lines))
 
 def load_config(config):
     return PrinterGCodeMacro(config)
@@ -138,7 +233,8 @@ class GCodeMacro:
                                         desc=self.cmd_desc)
         self.gcode.register_mux_command("SET_GCODE_VARIABLE", "MACRO",
                                         name, self.cmd_SET_GCODE_VARIABLE,
-                                        desc=self.cmd_SET_GCODE_VARIABLE_help)
+                                        desc=self.cmd_SET_GCODE_VARIABLE_help,
+                                        auxiliary=True)
         self.in_script = False
         self.variables = {}
         prefix = 'variable_'
@@ -181,7 +277,7 @@ class GCodeMacro:
         if self.in_script:
             raise gcmd.error("Macro %s called recursively" % (self.alias,))
         kwparams = dict(self.variables)
-        kwparams.update(self.template.create_template_context())
+        kwparams.update(self.template.create_render_context())
         kwparams['params'] = gcmd.get_command_parameters()
         kwparams['rawparams'] = gcmd.get_raw_command_parameters()
         self.in_script = True
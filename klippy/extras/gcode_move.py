@@ -1,9 +1,46 @@
 # G-Code G1 movement commands (and associated coordinate manipulation)
 #
-# Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+import chelper
+
+# Chain of move transforms implemented in klippy/chelper/movetransform.c
+class NativeTransforms:
+    def __init__(self):
+        self.next_transform = None
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.mt = ffi_main.gc(ffi_lib.move_transform_alloc(),
+                              ffi_lib.move_transform_free)
+        self.coords = ffi_main.new('double[4]')
+        self.move_transform_move = ffi_lib.move_transform_move
+        self.move_transform_get_position = ffi_lib.move_transform_get_position
+    def set_next_transform(self, next_transform):
+        self.next_transform = next_transform
+    def get_c_transform(self):
+        return self.mt
+    def get_position(self):
+        coords = self.coords
+        coords[0:4] = self.next_transform.get_position()[:4]
+        self.move_transform_get_position(self.mt, coords)
+        return list(coords)
+    def move(self, newpos, speed):
+        coords = self.coords
+        coords[0:4] = newpos[:4]
+        self.move_transform_move(self.mt, coords, 1)
+        self.next_transform.move(list(coords), speed)
+    def move_batch(self, moves):
+        # Transform a list of (newpos, speed) moves with a single C call
+        count = len(moves)
+        coords = self.ffi_main.new('double[]', count * 4)
+        for i, (newpos, speed) in enumerate(moves):
+            coords[i*4:i*4+4] = newpos[:4]
+        self.move_transform_move(self.mt, coords, count)
+        next_move = self.next_transform.move
+        for i, (newpos, speed) in enumerate(moves):
+            next_move(list(coords[i*4:i*4+4]), speed)
 
 class GCodeMove:
     def __init__(self, config):
@@ -33,6 +70,7 @@ class GCodeMove:
             desc = getattr(self, 'cmd_' + cmd + '_help', None)
             gcode.register_command(cmd, func, False, desc)
         gcode.register_command('G0', self.cmd_G1)
+        gcode.register_fast_move_handler(self.cmd_G1, self._fast_G1)
         gcode.register_command('M114', self.cmd_M114, True)
         gcode.register_command('GET_POSITION', self.cmd_GET_POSITION, True,
                                desc=self.cmd_GET_POSITION_help)
@@ -86,6 +124,14 @@ class GCodeMove:
         self.move_with_transform = transform.move
         self.position_with_transform = transform.get_position
         return old_transform
+    def get_native_transforms(self):
+        # Return the outermost chain of C move transforms (built-in
+        # transforms add their stages to it instead of registering a
+        # python move transform)
+        if not isinstance(self.move_transform, NativeTransforms):
+            nt = NativeTransforms()
+            nt.set_next_transform(self.set_move_transform(nt, force=True))
+        return self.move_transform
     def _get_gcode_position(self):
         p = [lp - bp for lp, bp in zip(self.last_position, self.base_position)]
         p[3] /= self.extrude_factor
@@ -141,6 +187,40 @@ class GCodeMove:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
         self.move_with_transform(self.last_position, self.speed)
+    def _fast_G1(self, move_line):
+        # Equivalent of cmd_G1() for a pre-parsed 'struct gcode_move_line'
+        self._update_move_line(move_line)
+        self.move_with_transform(self.last_position, self.speed)
+    def _update_move_line(self, move_line):
+        params = move_line.params
+        values = move_line.values
+        for pos in range(3):
+            if params & (1 << pos):
+                v = values[pos]
+                if not self.absolute_coord:
+                    self.last_position[pos] += v
+                else:
+                    self.last_position[pos] = v + self.base_position[pos]
+        if params & (1 << 3):
+            v = values[3] * self.extrude_factor
+            if not self.absolute_coord or not self.absolute_extrude:
+                self.last_position[3] += v
+            else:
+                self.last_position[3] = v + self.base_position[3]
+        if params & (1 << 4):
+            self.speed = values[4] * self.speed_factor
+    def run_move_lines(self, move_lines, count):
+        # Run 'count' pre-parsed G1 moves (eg, from gcode_arc_fill())
+        move_batch = getattr(self.move_transform, 'move_batch', None)
+        if move_batch is None:
+            for i in range(count):
+                self._fast_G1(move_lines[i])
+            return
+        moves = []
+        for i in range(count):
+            self._update_move_line(move_lines[i])
+            moves.append((list(self.last_position), self.speed))
+        move_batch(moves)
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, threading
+import os, math, logging, threading
 
 
 ######################################################################
@@ -45,10 +45,6 @@ class Heater:
         # pwm caching
         self.next_pwm_time = 0.
         self.last_pwm_value = 0.
-        # Setup control algorithm sub-class
-        algos = {'watermark': ControlBangBang, 'pid': ControlPID}
-        algo = config.getchoice('control', algos)
-        self.control = algo(self, config)
         # Setup output heater pin
         heater_pin = config.get('heater_pin')
         ppins = self.printer.lookup_object('pins')
@@ -57,6 +53,14 @@ class Heater:
                                          maxval=self.pwm_delay)
         self.mcu_pwm.setup_cycle_time(pwm_cycle_time)
         self.mcu_pwm.setup_max_duration(MAX_HEAT_TIME)
+        # Setup control algorithm sub-class
+        algos = {'watermark': ControlBangBang, 'pid': ControlPID,
+                 'mcu_pid': ControlMCUPID}
+        algo = config.getchoice('control', algos)
+        self.control = algo(self, config)
+        self.mcu_control = None
+        if algo is ControlMCUPID:
+            self.mcu_control = self.control
         # Load additional modules
         self.printer.load_object(config, "verify_heater %s" % (short_name,))
         self.printer.load_object(config, "pid_calibrate")
@@ -93,6 +97,19 @@ class Heater:
         #logging.debug("temp: %.3f %f = %f", read_time, temp)
     def _handle_shutdown(self):
         self.verify_mainthread_time = -999.
+    def _update_mcu_target(self):
+        # Forward target changes to the mcu (if it runs the control loop)
+        if self.mcu_control is None:
+            return
+        target = 0.
+        if self.control is self.mcu_control:
+            target = self.target_temp
+        self.mcu_control.set_target(target)
+    def note_mcu_pwm(self, value):
+        with self.lock:
+            self.last_pwm_value = value
+    def is_mcu_control(self):
+        return self.mcu_control is not None and self.control is self.mcu_control
     # External commands
     def get_name(self):
         return self.name
@@ -109,6 +126,7 @@ class Heater:
                 % (degrees, self.min_temp, self.max_temp))
         with self.lock:
             self.target_temp = degrees
+            self._update_mcu_target()
     def get_temp(self, eventtime):
         print_time = self.mcu_pwm.get_mcu().estimated_print_time(eventtime) - 5.
         with self.lock:
@@ -124,11 +142,13 @@ class Heater:
             old_control = self.control
             self.control = control
             self.target_temp = 0.
+            self._update_mcu_target()
         return old_control
     def alter_target(self, target_temp):
         if target_temp:
             target_temp = max(self.min_temp, min(self.max_temp, target_temp))
         self.target_temp = target_temp
+        self._update_mcu_target()
     def stats(self, eventtime):
         est_print_time = self.mcu_pwm.get_mcu().estimated_print_time(eventtime)
         if not self.printer.is_shutdown():
@@ -230,6 +250,176 @@ class ControlPID:
                 or abs(self.prev_temp_deriv) > PID_SETTLE_SLOPE)
 
 
+######################################################################
+# PID control algo running on the micro-controller
+######################################################################
+
+# Temperatures sent to the mcu are in units of 1/32nd of a degree
+MCU_TEMP_SCALE = 32.
+MCU_TARGET_REFRESH_TIME = 5.
+MCU_TARGET_EXPIRE_TIME = 30.
+
+class ControlMCUPID:
+    def __init__(self, heater, config):
+        self.printer = config.get_printer()
+        self.heater = heater
+        self.heater_max_power = heater.get_max_power()
+        self.Kp = config.getfloat('pid_Kp') / PID_PARAM_BASE
+        self.Ki = config.getfloat('pid_Ki') / PID_PARAM_BASE
+        self.Kd = config.getfloat('pid_Kd') / PID_PARAM_BASE
+        self.min_deriv_time = heater.get_smooth_time()
+        self.report_time = config.getfloat('mcu_report_time', 1.2,
+                                           above=0., maxval=3.)
+        self.min_temp = heater.min_temp
+        self.max_temp = heater.max_temp
+        # Lookup sensor adc and heater pin
+        sensor = heater.sensor
+        if not hasattr(sensor, 'get_mcu_adc'):
+            raise config.error("Heater %s: control mcu_pid requires an adc"
+                               " based temperature sensor" % (heater.name,))
+        self.mcu_adc = sensor.get_mcu_adc()
+        # The mcu heater code decimates the adc reports itself
+        self.mcu_adc.disable_group_report()
+        self.adc_convert = sensor.get_adc_convert()
+        self.sample_time = sensor.get_report_time_delta()
+        self.mcu_pwm = heater.mcu_pwm
+        self.mcu = self.mcu_adc.get_mcu()
+        if (not hasattr(self.mcu_pwm, 'get_pwm_params')
+            or self.mcu_pwm.get_mcu() is not self.mcu):
+            raise config.error("Heater %s: control mcu_pid requires the"
+                               " heater_pin and sensor_pin to be on the"
+                               " same mcu" % (heater.name,))
+        self.oid = self.set_target_cmd = None
+        self.table = []
+        self.last_target = 0
+        self.mcu.register_config_callback(self._build_config)
+        self.printer.register_event_handler("klippy:ready", self._handle_ready)
+        # Host side state (for check_busy)
+        self.prev_temp = AMBIENT_TEMP
+        self.prev_temp_time = 0.
+        self.prev_temp_deriv = 0.
+    def _build_table(self, max_adc):
+        # Piecewise linear adc to temperature conversion table
+        size = int(self.mcu.get_constant_float('PID_HEATER_TABLE_SIZE'))
+        max_abs_temp = max(abs(self.min_temp), abs(self.max_temp))
+        if max_abs_temp * MCU_TEMP_SCALE > 0x7fff:
+            raise self.printer.config_error(
+                "Heater %s: temperature range too large for mcu_pid"
+                % (self.heater.name,))
+        table = {}
+        for i in range(size):
+            temp = self.min_temp + (self.max_temp - self.min_temp) * i / (
+                size - 1.)
+            adc = int(self.adc_convert.calc_adc(temp) * max_adc + .5)
+            adc = max(0, min(0xffff, adc))
+            table[adc] = int(temp * MCU_TEMP_SCALE + .5)
+        self.table = sorted(table.items())
+        if len(self.table) < 2:
+            raise self.printer.config_error(
+                "Heater %s: unable to build mcu_pid temperature table"
+                % (self.heater.name,))
+    def _table_temp(self, temp):
+        # Map a temperature through the mcu table (so that the mcu
+        # regulates at the exact adc value of the requested target)
+        adc = self.adc_convert.calc_adc(temp) * self.mcu_adc.get_max_adc()
+        table = self.table
+        for i in range(1, len(table) - 1):
+            if adc < table[i][0]:
+                break
+        (a0, t0), (a1, t1) = table[i-1], table[i]
+        return int(t0 + (t1 - t0) * (adc - a0) / (a1 - a0) + .5)
+    def _build_config(self):
+        mcu = self.mcu
+        self.oid = mcu.create_oid()
+        dt = self.sample_time
+        report_div = max(1, min(0xffff, int(self.report_time / dt + .5)))
+        hard_pwm, pwm_max, invert = self.mcu_pwm.get_pwm_params()
+        mcu.add_config_cmd(
+            "config_pid_heater oid=%d adc_oid=%d pwm_oid=%d hard_pwm=%d"
+            " invert=%d pwm_max=%d report_div=%d"
+            % (self.oid, self.mcu_adc.get_oid(), self.mcu_pwm.get_oid(),
+               hard_pwm, invert, pwm_max, report_div))
+        self._build_table(self.mcu_adc.get_max_adc())
+        for i, (adc, temp) in enumerate(self.table):
+            mcu.add_config_cmd(
+                "pid_heater_set_table oid=%d index=%d adc=%d temp=%d"
+                % (self.oid, i, adc, temp))
+        # PID gains (the mcu output is Q15 power after a 16 bit shift)
+        power_bits = mcu.get_constant_float('PID_HEATER_POWER_FRAC_BITS')
+        scale = float(1 << (int(power_bits) + 16)) / MCU_TEMP_SCALE
+        kp = self.Kp * scale
+        ki = self.Ki * dt * scale
+        kd = self.Kd / (dt * 256.) * scale
+        integ_max = 0.
+        if self.Ki:
+            integ_max = self.heater_max_power / (self.Ki*dt) * MCU_TEMP_SCALE
+        max_power = self.heater_max_power * (1 << int(power_bits))
+        deriv_alpha = min(1., dt / self.min_deriv_time) * (1 << 15)
+        if max(kp, ki, kd, integ_max) >= 1<<31:
+            raise self.printer.config_error(
+                "Heater %s: pid parameters too large for mcu_pid"
+                % (self.heater.name,))
+        mcu.add_config_cmd(
+            "pid_heater_set_pid oid=%d kp=%d ki=%d kd=%d integ_max=%d"
+            " max_power=%d deriv_alpha=%d"
+            % (self.oid, kp, ki, kd, integ_max, max_power, deriv_alpha))
+        # Runaway checks (using the verify_heater parameters)
+        vh = self.printer.lookup_object("verify_heater %s"
+                                        % (self.heater.short_name,))
+        hysteresis, max_error, heating_gain, check_gain_time = vh.get_params()
+        mcu.add_config_cmd(
+            "pid_heater_set_verify oid=%d hysteresis=%d heating_gain=%d"
+            " max_error=%d gain_reports=%d"
+            % (self.oid, hysteresis * MCU_TEMP_SCALE,
+               heating_gain * MCU_TEMP_SCALE,
+               min(max_error * MCU_TEMP_SCALE / dt, 0x7fffffff),
+               min(math.ceil(check_gain_time / dt), 0xffff)))
+        self.set_target_cmd = mcu.lookup_command(
+            "pid_heater_set_target oid=%c target=%hi expire_reports=%hu")
+        mcu.register_response(self._handle_state, "pid_heater_state", self.oid)
+    def _handle_ready(self):
+        reactor = self.printer.get_reactor()
+        reactor.register_timer(self._refresh_event, reactor.NOW)
+    def _refresh_event(self, eventtime):
+        # Periodically resend the target so the mcu disables the heater
+        # if the host stops responding
+        if self.printer.is_shutdown():
+            return self.printer.get_reactor().NEVER
+        if self.last_target > 0:
+            self._send_target(self.last_target)
+        return eventtime + MCU_TARGET_REFRESH_TIME
+    def _send_target(self, target):
+        expire = int(MCU_TARGET_EXPIRE_TIME / self.sample_time + .5)
+        self.set_target_cmd.send([self.oid, target, min(expire, 0xffff)])
+    def _handle_state(self, params):
+        power_bits = self.mcu.get_constant_float('PID_HEATER_POWER_FRAC_BITS')
+        self.heater.note_mcu_pwm(params['power'] / float(1 << int(power_bits)))
+    def set_target(self, target_temp):
+        target = 0
+        if target_temp > 0.:
+            target = max(1, self._table_temp(target_temp))
+        if target == self.last_target or self.set_target_cmd is None:
+            self.last_target = target
+            return
+        self.last_target = target
+        self._send_target(target)
+    def temperature_update(self, read_time, temp, target_temp):
+        time_diff = read_time - self.prev_temp_time
+        temp_diff = temp - self.prev_temp
+        if time_diff >= self.min_deriv_time:
+            temp_deriv = temp_diff / time_diff
+        else:
+            temp_deriv = (self.prev_temp_deriv * (self.min_deriv_time-time_diff)
+                          + temp_diff) / self.min_deriv_time
+        self.prev_temp = temp
+        self.prev_temp_time = read_time
+        self.prev_temp_deriv = temp_deriv
+    def check_busy(self, eventtime, smoothed_temp, target_temp):
+        temp_diff = target_temp - smoothed_temp
+        return (abs(temp_diff) > PID_SETTLE_DELTA
+                or abs(self.prev_temp_deriv) > PID_SETTLE_SLOPE)
+
+
 ######################################################################
 # Sensor and heater lookup
 ######################################################################
@@ -251,7 +441,8 @@ class PrinterHeaters:
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("TURN_OFF_HEATERS", self.cmd_TURN_OFF_HEATERS,
                                desc=self.cmd_TURN_OFF_HEATERS_help)
-        gcode.register_command("M105", self.cmd_M105, when_not_ready=True)
+        gcode.register_command("M105", self.cmd_M105, when_not_ready=True,
+                               auxiliary=True)
         gcode.register_command("TEMPERATURE_WAIT", self.cmd_TEMPERATURE_WAIT,
                                desc=self.cmd_TEMPERATURE_WAIT_help)
     def load_config(self, config):
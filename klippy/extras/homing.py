@@ -1,6 +1,6 @@
 # Helper code for implementing homing operations
 #
-# Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math
@@ -221,6 +221,8 @@ class Homing:
         self.toolhead.flush_step_generation()
         self.trigger_mcu_pos = {sp.stepper_name: sp.trig_pos
                                 for sp in hmove.stepper_positions}
+        self._note_home_end(rails, homing_axes)
+    def _note_home_end(self, rails, homing_axes):
         self.adjust_pos = {}
         self.printer.send_event("homing:home_rails_end", self, rails)
         if any(self.adjust_pos.values()):
@@ -234,6 +236,68 @@ class Homing:
             for axis in homing_axes:
                 homepos[axis] = newpos[axis]
             self.toolhead.set_position(homepos)
+    def _calc_concurrent_move(self, homepos, axis_moves):
+        # Extend the start of each axis so that every axis moves at its
+        # own speed (axis_moves is a list of (axis, dist, speed) tuples)
+        move_t = max([abs(dist) / speed for axis, dist, speed in axis_moves])
+        startpos = list(homepos)
+        for axis, dist, speed in axis_moves:
+            startpos[axis] -= math.copysign(speed * move_t, dist)
+        speed = math.sqrt(sum([speed**2 for axis, dist, speed in axis_moves]))
+        return startpos, speed
+    def home_rails_concurrent(self, axis_rails, forcepos, movepos):
+        # Home several independent axes (axis_rails is a list of
+        # (axis, rail) tuples) with the same homing moves
+        rails = [rail for axis, rail in axis_rails]
+        self.printer.send_event("homing:home_rails_begin", self, rails)
+        homing_axes = [axis for axis in range(3) if forcepos[axis] is not None]
+        homepos = self._fill_coord(movepos)
+        his = [rail.get_homing_info() for rail in rails]
+        dirs = [math.copysign(1., movepos[axis] - forcepos[axis])
+                for axis, rail in axis_rails]
+        # Perform first home of all axes together
+        startpos, speed = self._calc_concurrent_move(
+            homepos, [(axis, movepos[axis] - forcepos[axis], hi.speed)
+                      for (axis, rail), hi in zip(axis_rails, his)])
+        self.toolhead.set_position(startpos, homing_axes=homing_axes)
+        endstops = [es for rail in rails for es in rail.get_endstops()]
+        hmove = HomingMove(self.printer, endstops)
+        hmove.homing_move(homepos, speed)
+        stepper_positions = list(hmove.stepper_positions)
+        # Perform second home of the axes that have a retract distance
+        second = [(axis, rail, hi, d)
+                  for (axis, rail), hi, d in zip(axis_rails, his, dirs)
+                  if hi.retract_dist]
+        if second:
+            # Retract
+            retractpos = list(homepos)
+            for axis, rail, hi, d in second:
+                retractpos[axis] -= d * hi.retract_dist
+            retract_t = max([hi.retract_dist / hi.retract_speed
+                             for axis, rail, hi, d in second])
+            retract_d = math.sqrt(sum([hi.retract_dist**2
+                                       for axis, rail, hi, d in second]))
+            self.toolhead.move(retractpos, retract_d / retract_t)
+            # Home again
+            startpos, speed = self._calc_concurrent_move(
+                homepos, [(axis, 2. * d * hi.retract_dist,
+                           hi.second_homing_speed)
+                          for axis, rail, hi, d in second])
+            self.toolhead.set_position(startpos)
+            endstops = [es for axis, rail, hi, d in second
+                        for es in rail.get_endstops()]
+            hmove = HomingMove(self.printer, endstops)
+            hmove.homing_move(homepos, speed)
+            if hmove.check_no_movement() is not None:
+                raise self.printer.command_error(
+                    "Endstop %s still triggered after retract"
+                    % (hmove.check_no_movement(),))
+            stepper_positions.extend(hmove.stepper_positions)
+        # Signal home operation complete
+        self.toolhead.flush_step_generation()
+        self.trigger_mcu_pos = {sp.stepper_name: sp.trig_pos
+                                for sp in stepper_positions}
+        self._note_home_end(rails, homing_axes)
 
 class PrinterHoming:
     def __init__(self, config):
@@ -75,6 +75,11 @@ class HX71xBase:
     def get_mcu(self):
         return self.mcu
 
+    def attach_load_cell_probe(self, load_cell_probe_oid):
+        self.mcu.add_config_cmd(
+            "hx71x_attach_load_cell_probe oid=%d load_cell_probe_oid=%d"
+            % (self.oid, load_cell_probe_oid))
+
     def get_samples_per_second(self):
         return self.sps
 
@@ -1,10 +1,10 @@
 # Kinematic input shaper to minimize motion vibrations in XY plane
 #
-# Copyright (C) 2019-2020  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2019-2026  Kevin O'Connor <kevin@koconnor.net>
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import collections
+import collections, logging
 import chelper
 from . import shaper_defs
 
@@ -57,6 +57,12 @@ class AxisInputShaper:
         return 'shaper_' + self.axis
     def get_shaper(self):
         return self.n, self.A, self.T
+    def get_step_generation_window(self):
+        # Same as input_shaper_get_step_generation_window() in kin_shaper.c
+        if not self.n:
+            return 0.
+        ts = sum([a * t for a, t in zip(self.A, self.T)]) / sum(self.A)
+        return max(ts - min(self.T), max(self.T) - ts)
     def update(self, gcmd):
         self.params.update(gcmd)
         self.n, self.A, self.T = self.params.get_shaper()
@@ -69,6 +75,11 @@ class AxisInputShaper:
             ffi_lib.input_shaper_set_shaper_params(
                     sk, self.axis.encode(), self.n, self.A, self.T)
         return success
+    def queue_shaper_kinematics(self, sk, shaper, print_time, expire_time):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        n, A, T = shaper
+        return ffi_lib.input_shaper_queue_shaper_params(
+                sk, self.axis.encode(), n, A, T, print_time, expire_time) == 0
     def disable_shaping(self):
         if self.saved is None and self.n:
             self.saved = (self.n, self.A, self.T)
@@ -94,6 +105,7 @@ class InputShaper:
                         AxisInputShaper('y', config)]
         self.input_shaper_stepper_kinematics = []
         self.orig_stepper_kinematics = []
+        self.scan_windows = {}
         # Register gcode commands
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("SET_INPUT_SHAPER",
@@ -134,7 +146,7 @@ class InputShaper:
             is_sk = self._get_input_shaper_stepper_kinematics(s)
             if is_sk is None:
                 continue
-            old_delay = ffi_lib.input_shaper_get_step_generation_window(is_sk)
+            old_delay = self.scan_windows.get(is_sk, 0.)
             for shaper in self.shapers:
                 if shaper in failed_shapers:
                     continue
@@ -144,24 +156,56 @@ class InputShaper:
             if old_delay != new_delay:
                 self.toolhead.note_step_generation_scan_time(new_delay,
                                                              old_delay)
+                self.scan_windows[is_sk] = new_delay
         if failed_shapers:
             error = error or self.printer.command_error
             raise error("Failed to configure shaper(s) %s with given parameters"
                         % (', '.join([s.get_name() for s in failed_shapers])))
+    def _queue_input_shaping(self):
+        # Schedule the new shapers at the end of the queued moves so that
+        # the pending step generation does not need to be flushed.  This
+        # is only possible if the toolhead step generation scan window
+        # does not need to grow.
+        kin = self.toolhead.get_kinematics()
+        is_sks = []
+        for s in kin.get_steppers():
+            if s.get_trapq() is None:
+                continue
+            is_sk = self._get_input_shaper_stepper_kinematics(s)
+            if is_sk is None:
+                continue
+            windows = [shaper.get_step_generation_window()
+                       for shaper in self.shapers
+                       if s.is_active_axis(shaper.axis)]
+            if max([0.] + windows) > self.scan_windows.get(is_sk, 0.) + 1e-9:
+                self._update_input_shaping()
+                return
+            is_sks.append(is_sk)
+        shapers = [(shaper, shaper.get_shaper()) for shaper in self.shapers]
+        def queue_shapers(print_time):
+            toolhead = self.toolhead
+            expire_time = toolhead.last_flush_time - toolhead.kin_flush_delay
+            for shaper, params in shapers:
+                for is_sk in is_sks:
+                    if not shaper.queue_shaper_kinematics(
+                            is_sk, params, print_time, expire_time):
+                        logging.error("Failed to queue shaper %s",
+                                      shaper.get_name())
+        self.toolhead.register_lookahead_callback(queue_shapers)
     def disable_shaping(self):
         for shaper in self.shapers:
             shaper.disable_shaping()
-        self._update_input_shaping()
+        self._queue_input_shaping()
     def enable_shaping(self):
         for shaper in self.shapers:
             shaper.enable_shaping()
-        self._update_input_shaping()
+        self._queue_input_shaping()
     cmd_SET_INPUT_SHAPER_help = "Set cartesian parameters for input shaper"
     def cmd_SET_INPUT_SHAPER(self, gcmd):
         if gcmd.get_command_parameters():
             for shaper in self.shapers:
                 shaper.update(gcmd)
-            self._update_input_shaping()
+            self._queue_input_shaping()
         for shaper in self.shapers:
             shaper.report(gcmd)
 
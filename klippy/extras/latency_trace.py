@@ -0,0 +1,243 @@
+# Trace the host latency of G-Code commands until their steps reach the mcu
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import json, logging
+
+# Host stages of a trace (name, start event, end event)
+HOST_STAGES = [
+    ("gcode handler", 'dispatch', 'handled'),
+    ("lookahead", 'handled', 'trapq'),
+    ("step generation", 'trapq', 'step_gen'),
+]
+# Stages of each mcu in a trace
+MCU_STAGES = [
+    ("stepcompress flush", 'step_gen', 'flush'),
+    ("serial queue", 'flush', 'transmit'),
+    ("mcu ack", 'transmit', 'ack'),
+    ("mcu move queue", 'ack', 'move_start'),
+    ("motion", 'move_start', 'move_end'),
+]
+
+# Timestamps of a single traced command
+class LatencyTrace:
+    def __init__(self, trace_id, line, dispatch_time):
+        self.trace_id = trace_id
+        self.line = line
+        self.times = {'dispatch': dispatch_time}
+        self.mcu_times = {}
+        self.start_time = self.end_time = None
+        self.pending_acks = 0
+        self.is_done = False
+    def note_start(self, print_time):
+        if self.end_time is None:
+            self.start_time = print_time
+
+class PrinterLatencyTrace:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.commands = config.getlist('commands', ('G0', 'G1'))
+        self.default_filename = config.get('filename',
+                                           '/tmp/klippy_latency.json')
+        self.toolhead = self.mcu = None
+        self.mcus = []
+        self.markers = {}
+        # Trace state
+        self.filename = None
+        self.remaining = 0
+        self.traces = []
+        self.pending_steps = []
+        self.pending_flush = []
+        self.prev_handlers = {}
+        # Register handlers
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        self.printer.register_event_handler("klippy:shutdown",
+                                            self._handle_shutdown)
+        self.printer.register_event_handler("toolhead:sync_print_time",
+                                            self._handle_sync_print_time)
+        self.gcode = self.printer.lookup_object('gcode')
+        self.gcode.register_command("LATENCY_TRACE", self.cmd_LATENCY_TRACE,
+                                    desc=self.cmd_LATENCY_TRACE_help)
+    def _handle_connect(self):
+        self.toolhead = self.printer.lookup_object('toolhead')
+        self.toolhead.register_step_generator(self._handle_step_gen)
+        self.mcu = self.printer.lookup_object('mcu')
+        for name, mcu in self.printer.lookup_objects(module='mcu'):
+            mcu_name = mcu.get_name()
+            self.mcus.append(mcu_name)
+            mcu.register_flush_callback(
+                (lambda pt, clock, m=mcu: self._handle_flush(m, pt)))
+            if not mcu.is_fileoutput():
+                # A command sent after the traced steps to time their
+                # transmission and acknowledgment
+                self.markers[mcu_name] = mcu.lookup_command(
+                    "debug_nop", cq=mcu.alloc_command_queue())
+    # Command wrapping
+    def _wrap_commands(self):
+        for cmd in self.commands:
+            prev = self.gcode.register_command(cmd, None)
+            if prev is None:
+                continue
+            self.prev_handlers[cmd] = prev
+            self.gcode.register_command(
+                cmd, (lambda gcmd, prev=prev: self._trace_command(gcmd, prev)))
+    def _unwrap_commands(self):
+        for cmd, prev in self.prev_handlers.items():
+            self.gcode.register_command(cmd, None)
+            self.gcode.register_command(cmd, prev)
+        self.prev_handlers.clear()
+    def _trace_command(self, gcmd, handler):
+        trace = LatencyTrace(len(self.traces), gcmd.get_commandline(),
+                             self.reactor.monotonic())
+        self.traces.append(trace)
+        self.remaining -= 1
+        if not self.remaining:
+            self._unwrap_commands()
+        # The end time of the last queued move is the new move start time
+        toolhead = self.toolhead
+        toolhead.register_lookahead_callback(trace.note_start)
+        pos = toolhead.get_position()
+        try:
+            handler(gcmd)
+        finally:
+            trace.times['handled'] = self.reactor.monotonic()
+            if toolhead.get_position() == pos:
+                # No move was queued
+                trace.is_done = True
+        if trace.is_done:
+            self._check_done()
+            return
+        toolhead.register_lookahead_callback(
+            (lambda print_time: self._handle_trapq(trace, print_time)))
+    # Stage tracking
+    def _handle_sync_print_time(self, curtime, est_print_time, print_time):
+        for trace in self.traces:
+            if trace.start_time is not None and trace.end_time is None:
+                trace.start_time = print_time
+    def _handle_trapq(self, trace, print_time):
+        trace.times['trapq'] = self.reactor.monotonic()
+        trace.end_time = print_time
+        self.pending_steps.append(trace)
+    def _handle_step_gen(self, flush_time):
+        if not self.pending_steps:
+            return
+        curtime = self.reactor.monotonic()
+        for trace in list(self.pending_steps):
+            if trace.end_time <= flush_time:
+                trace.times['step_gen'] = curtime
+                self.pending_steps.remove(trace)
+                self.pending_flush.append(trace)
+    def _handle_flush(self, mcu, print_time):
+        if not self.pending_flush:
+            return
+        curtime = self.reactor.monotonic()
+        mcu_name = mcu.get_name()
+        for trace in list(self.pending_flush):
+            if trace.end_time > print_time or mcu_name in trace.mcu_times:
+                continue
+            trace.mcu_times[mcu_name] = {'flush': curtime}
+            marker = self.markers.get(mcu_name)
+            if marker is not None:
+                trace.pending_acks += 1
+                reqclock = mcu.print_time_to_clock(trace.end_time)
+                self.reactor.register_callback(
+                    (lambda e, t=trace, n=mcu_name, m=marker, c=reqclock:
+                     self._send_marker(t, n, m, c)))
+            if len(trace.mcu_times) == len(self.mcus):
+                self.pending_flush.remove(trace)
+                if not trace.pending_acks:
+                    self._note_motion(trace)
+    def _send_marker(self, trace, mcu_name, marker, reqclock):
+        params = marker.send_wait_ack(reqclock=reqclock)
+        mcu_times = trace.mcu_times[mcu_name]
+        mcu_times['transmit'] = params['#sent_time']
+        mcu_times['ack'] = params['#receive_time']
+        trace.pending_acks -= 1
+        if not trace.pending_acks and trace not in self.pending_flush:
+            self._note_motion(trace)
+    def _note_motion(self, trace):
+        # Estimate the host time of the start and end of the move
+        curtime = self.reactor.monotonic()
+        est_print_time = self.mcu.estimated_print_time(curtime)
+        for mcu_name, mcu_times in trace.mcu_times.items():
+            if mcu_name not in self.markers:
+                # Print time is not related to host time in batch mode
+                continue
+            mcu_times['move_start'] = (curtime + trace.start_time
+                                       - est_print_time)
+            mcu_times['move_end'] = curtime + trace.end_time - est_print_time
+        trace.is_done = True
+        self._check_done()
+    def _handle_shutdown(self):
+        if self.filename is not None:
+            self._unwrap_commands()
+            self._finish()
+    # Trace output
+    def _check_done(self):
+        if self.remaining or not all([t.is_done for t in self.traces]):
+            return
+        self._finish()
+    def _finish(self):
+        events = []
+        base_time = min([t.times['dispatch'] for t in self.traces] or [0.])
+        def add_span(pid, tid, name, times, start, end, args):
+            if start not in times or end not in times:
+                return
+            ts = (times[start] - base_time) * 1000000.
+            dur = max(0., times[end] - times[start]) * 1000000.
+            events.append({'name': name, 'ph': 'X', 'pid': pid, 'tid': tid,
+                           'ts': round(ts, 3), 'dur': round(dur, 3),
+                           'args': args})
+        pids = {}
+        for i, name in enumerate(['klippy'] + self.mcus):
+            pids[name] = i + 1
+            events.append({'name': 'process_name', 'ph': 'M', 'pid': i + 1,
+                           'args': {'name': name}})
+        for trace in self.traces:
+            tid = trace.trace_id + 1
+            args = {'line': trace.line, 'start_time': trace.start_time,
+                    'end_time': trace.end_time}
+            for pid in pids.values():
+                events.append({'name': 'thread_name', 'ph': 'M', 'pid': pid,
+                               'tid': tid, 'args': {
+                                   'name': "%d: %s" % (tid, trace.line)}})
+            for name, start, end in HOST_STAGES:
+                add_span(pids['klippy'], tid, name, trace.times, start, end,
+                         args)
+            for mcu_name, mcu_times in trace.mcu_times.items():
+                times = dict(trace.times)
+                times.update(mcu_times)
+                for name, start, end in MCU_STAGES:
+                    add_span(pids[mcu_name], tid, name, times, start, end,
+                             args)
+        filename = self.filename
+        count = len(self.traces)
+        self.filename = None
+        self.traces = []
+        self.pending_steps = []
+        self.pending_flush = []
+        try:
+            f = open(filename, 'w')
+            json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f)
+            f.close()
+        except (IOError, OSError):
+            logging.exception("Unable to write latency trace '%s'", filename)
+            return
+        self.gcode.respond_info("Wrote latency trace of %d commands to %s"
+                                % (count, filename))
+    cmd_LATENCY_TRACE_help = "Trace the latency of the next G-Code commands"
+    def cmd_LATENCY_TRACE(self, gcmd):
+        if self.filename is not None:
+            raise gcmd.error("A latency trace is already in progress")
+        count = gcmd.get_int('COUNT', 10, minval=1)
+        self.filename = gcmd.get('FILENAME', self.default_filename)
+        self.remaining = count
+        self._wrap_commands()
+        gcmd.respond_info("Tracing the next %d %s commands"
+                          % (count, ", ".join(self.commands)))
+
+def load_config(config):
+    return PrinterLatencyTrace(config)
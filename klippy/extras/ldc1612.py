@@ -1,9 +1,10 @@
 # Support for reading frequency samples from ldc1612
 #
-# Copyright (C) 2020-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2020-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+import chelper
 from . import bus, bulk_sensor
 
 MIN_MSG_TIME = 0.100
@@ -87,6 +88,8 @@ class LDC1612:
         self.oid = oid = mcu.create_oid()
         self.query_ldc1612_cmd = None
         self.ldc1612_setup_home_cmd = self.query_ldc1612_home_state_cmd = None
+        self.ldc1612_set_height_cmd = self.ldc1612_setup_home_height_cmd = None
+        self.height_table_size = self.filter_max_samples = 0
         if config.get('intb_pin', None) is not None:
             ppins = config.get_printer().lookup_object("pins")
             pin_params = ppins.lookup_pin(config.get('intb_pin'))
@@ -103,8 +106,15 @@ class LDC1612:
         mcu.register_config_callback(self._build_config)
         # Bulk sample message reading
         chip_smooth = self.data_rate * BATCH_UPDATES * 2
-        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, ">I")
+        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, ">I",
+                                                    packed=True)
         self.last_error_count = 0
+        # C based sample conversion (used with the C bulk_decoder)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.eddy_scan = ffi_main.gc(ffi_lib.eddy_scan_alloc(),
+                                     ffi_lib.eddy_scan_free)
+        self.decode_size = 0
+        self.decode_freqs = self.decode_heights = None
         # Process messages in batches
         self.batch_bulk = bulk_sensor.BatchBulkHelper(
             self.printer, self._process_batch,
@@ -126,6 +136,19 @@ class LDC1612:
             "query_ldc1612_home_state oid=%c",
             "ldc1612_home_state oid=%c homing=%c trigger_clock=%u",
             oid=self.oid, cq=cmdqueue)
+        # Height based homing (if supported by the mcu code)
+        constants = self.mcu.get_constants()
+        if 'LDC1612_HEIGHT_TABLE_SIZE' not in constants:
+            return
+        self.height_table_size = int(constants['LDC1612_HEIGHT_TABLE_SIZE'])
+        self.filter_max_samples = int(constants['LDC1612_FILTER_MAX_SAMPLES'])
+        self.ldc1612_set_height_cmd = self.mcu.lookup_command(
+            "ldc1612_set_height_entry oid=%c index=%c freq=%u height=%i",
+            cq=cmdqueue)
+        self.ldc1612_setup_home_height_cmd = self.mcu.lookup_command(
+            "ldc1612_setup_home_height oid=%c clock=%u trigger_height=%i"
+            " hysteresis=%u filter_samples=%c"
+            " trsync_oid=%c trigger_reason=%c error_reason=%c", cq=cmdqueue)
     def get_mcu(self):
         return self.i2c.get_mcu()
     def read_reg(self, reg):
@@ -137,13 +160,37 @@ class LDC1612:
                            minclock=minclock)
     def add_client(self, cb):
         self.batch_bulk.add_client(cb)
+    def get_eddy_scan(self):
+        # Return the C object storing samples for probe window averaging
+        if not self.ffreader.has_sample_arrays():
+            return None
+        return self.eddy_scan
     # Homing
+    def _freq_to_raw(self, freq):
+        return int(freq * (1<<28) / float(LDC1612_FREQ) + 0.5)
     def setup_home(self, print_time, trigger_freq,
                    trsync_oid, hit_reason, err_reason):
         clock = self.mcu.print_time_to_clock(print_time)
-        tfreq = int(trigger_freq * (1<<28) / float(LDC1612_FREQ) + 0.5)
+        tfreq = self._freq_to_raw(trigger_freq)
         self.ldc1612_setup_home_cmd.send(
             [self.oid, clock, tfreq, trsync_oid, hit_reason, err_reason])
+    def get_height_homing_limits(self):
+        # Return the mcu height table size and maximum filter length
+        # (both zero if the mcu does not support height based homing)
+        return self.height_table_size, self.filter_max_samples
+    def setup_home_height(self, print_time, height_table, trigger_height,
+                          hysteresis, filter_samples,
+                          trsync_oid, hit_reason, err_reason):
+        # The mcu table stores raw frequencies and heights in nanometers
+        for i, (freq, height) in enumerate(sorted(height_table)):
+            self.ldc1612_set_height_cmd.send(
+                [self.oid, i, self._freq_to_raw(freq),
+                 int(round(height * 1000000.))])
+        clock = self.mcu.print_time_to_clock(print_time)
+        self.ldc1612_setup_home_height_cmd.send(
+            [self.oid, clock, int(round(trigger_height * 1000000.)),
+             int(round(hysteresis * 1000000.)), filter_samples,
+             trsync_oid, hit_reason, err_reason])
     def clear_home(self):
         self.ldc1612_setup_home_cmd.send([self.oid, 0, 0, 0, 0, 0])
         if self.mcu.is_fileoutput():
@@ -161,6 +208,24 @@ class LDC1612:
                 self.last_error_count += 1
             samples[count] = (round(ptime, 6), round(freq_conv * mv, 3), 999.9)
             count += 1
+    def _decode_samples(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        count, times, values = self.ffreader.pull_sample_arrays()
+        if not count:
+            return []
+        if count > self.decode_size:
+            self.decode_size = count
+            self.decode_freqs = ffi_main.new('double[]', count)
+            self.decode_heights = ffi_main.new('double[]', count)
+        if self.calibration is not None:
+            self.calibration.update_height_table(self.eddy_scan)
+        freq_conv = float(LDC1612_FREQ) / (1<<28)
+        self.last_error_count += ffi_lib.eddy_scan_decode_ldc1612(
+            self.eddy_scan, times, values, count, freq_conv,
+            self.decode_freqs, self.decode_heights)
+        return list(zip(ffi_main.unpack(times, count),
+                        ffi_main.unpack(self.decode_freqs, count),
+                        ffi_main.unpack(self.decode_heights, count)))
     # Start, stop, and process message batches
     def _start_measurements(self):
         # In case of miswiring, testing LDC1612 device ID prevents treating
@@ -196,11 +261,14 @@ class LDC1612:
         self.ffreader.note_end()
         logging.info("LDC1612 finished '%s' measurements", self.name)
     def _process_batch(self, eventtime):
-        samples = self.ffreader.pull_samples()
-        self._convert_samples(samples)
+        if self.ffreader.has_sample_arrays():
+            samples = self._decode_samples()
+        else:
+            samples = self.ffreader.pull_samples()
+            self._convert_samples(samples)
+            if samples and self.calibration is not None:
+                self.calibration.apply_calibration(samples)
         if not samples:
             return {}
-        if self.calibration is not None:
-            self.calibration.apply_calibration(samples)
         return {'data': samples, 'errors': self.last_error_count,
                 'overflows': self.ffreader.get_last_overflows()}
@@ -30,6 +30,11 @@ REG_MOD_READ = 0x80
 LIS2DW_DEV_ID = 0x44
 LIS3DH_DEV_ID = 0x33
 
+# Fifo threshold (and the bits that route it to the INT1 pin)
+FIFO_THRESHOLD = 16
+LIS2DW_INT1_FTH = 0x02
+LIS3DH_I1_WTM = 0x04
+
 LIS_I2C_ADDR = 0x19
 
 # Right shift for left justified registers.
@@ -75,16 +80,35 @@ class LIS2DW:
                             default_addr=LIS_I2C_ADDR, default_speed=400000)
         self.mcu = mcu = self.bus.get_mcu()
         self.oid = oid = mcu.create_oid()
-        self.query_lis2dw_cmd = None
-        mcu.add_config_cmd("config_lis2dw oid=%d bus_oid=%d bus_oid_type=%s "
-                           "lis_chip_type=%s" % (oid, self.bus.get_oid(),
-                            self.bus_type, self.lis_type))
+        self.query_lis2dw_cmd = self.query_spectrum_cmd = None
+        self.spectrum_oid = None
+        self.spectrum_enabled = self.spectrum_running = False
+        compress = config.getboolean('compress', False)
+        int_pin = config.get('int_pin', None)
+        self.have_int = int_pin is not None
+        if self.have_int:
+            ppins = self.printer.lookup_object("pins")
+            pin_params = ppins.lookup_pin(int_pin)
+            if pin_params['chip'] != mcu:
+                raise config.error("lis2dw int_pin must be on same mcu")
+            mcu.add_config_cmd(
+                "config_lis2dw_with_int oid=%d bus_oid=%d bus_oid_type=%s "
+                "lis_chip_type=%s compress=%d int_pin=%s"
+                % (oid, self.bus.get_oid(), self.bus_type, self.lis_type,
+                   compress, pin_params['pin']))
+        else:
+            mcu.add_config_cmd(
+                "config_lis2dw oid=%d bus_oid=%d bus_oid_type=%s "
+                "lis_chip_type=%s compress=%d"
+                % (oid, self.bus.get_oid(), self.bus_type, self.lis_type,
+                   compress))
         mcu.add_config_cmd("query_lis2dw oid=%d rest_ticks=0"
                            % (oid,), on_restart=True)
         mcu.register_config_callback(self._build_config)
         # Bulk sample message reading
         chip_smooth = self.data_rate * BATCH_UPDATES * 2
-        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, "<hhh")
+        self.ffreader = bulk_sensor.FixedFreqReader(
+            mcu, chip_smooth, "<hhh", compress_fields=3 if compress else 0)
         self.last_error_count = 0
         # Process messages in batches
         self.batch_bulk = bulk_sensor.BatchBulkHelper(
@@ -101,6 +125,10 @@ class LIS2DW:
             "query_lis2dw oid=%c rest_ticks=%u", cq=cmdqueue)
         self.ffreader.setup_query_command("query_lis2dw_status oid=%c",
                                           oid=self.oid, cq=cmdqueue)
+        if self.spectrum_oid is not None:
+            self.query_spectrum_cmd = self.mcu.lookup_command(
+                "query_lis2dw_spectrum oid=%c rest_ticks=%u spectrum_oid=%c",
+                cq=cmdqueue)
     def read_reg(self, reg):
         if self.bus_type == SPI_SERIAL_TYPE:
             params = self.bus.spi_transfer([reg | REG_MOD_READ, 0x00])
@@ -121,7 +149,7 @@ class LIS2DW:
                     "(e.g. faulty wiring) or a faulty lis2dw chip." % (
                         reg, val, stored_val))
     def start_internal_client(self):
-        aqh = adxl345.AccelQueryHelper(self.printer)
+        aqh = adxl345.AccelQueryHelper(self.printer, self)
         self.batch_bulk.add_client(aqh.handle_batch)
         return aqh
     # Measurement decoding
@@ -135,8 +163,13 @@ class LIS2DW:
             z = round(raw_xyz[z_pos] * z_scale, 6)
             samples[count] = (round(ptime, 6), x, y, z)
             count += 1
-    # Start, stop, and process message batches
-    def _start_measurements(self):
+    def _get_int_reg(self):
+        # Register (and value) that routes the fifo threshold to INT1
+        if self.lis_type == LIS2DW_TYPE:
+            return REG_LIS2DW_CTRL_REG4_ADDR, LIS2DW_INT1_FTH
+        return REG_LIS2DW_CTRL_REG3_ADDR, LIS3DH_I1_WTM
+    # Chip setup
+    def _start_reading(self, spectrum=False):
         # In case of miswiring, testing LIS2DW device ID prevents treating
         # noise or wrong signal as a correctly initialized device
         dev_id = self.read_reg(REG_LIS2DW_WHO_AM_I_ADDR)
@@ -176,24 +209,64 @@ class LIS2DW:
             self.set_reg(REG_LIS2DW_CTRL_REG5_ADDR, 0x40)
             # Stream mode
             self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x80)
-        # Start bulk reading
+        fifo_ctrl = 0xC0 if self.lis_type == LIS2DW_TYPE else 0x80
         rest_ticks = self.mcu.seconds_to_clock(4. / self.data_rate)
-        self.query_lis2dw_cmd.send([self.oid, rest_ticks])
-        if self.lis_type == LIS2DW_TYPE:
-            self.set_reg(REG_LIS2DW_FIFO_CTRL, 0xC0)
+        if self.have_int:
+            # Signal the fifo threshold on the INT1 pin (the mcu then
+            # only needs to check the pin until the threshold is reached)
+            int_reg, int_val = self._get_int_reg()
+            self.set_reg(int_reg, int_val)
+            fifo_ctrl |= FIFO_THRESHOLD
+            rest_ticks = self.mcu.seconds_to_clock(
+                .5 * FIFO_THRESHOLD / self.data_rate)
+        # Start bulk reading (or on-mcu vibration summaries)
+        if spectrum:
+            self.query_spectrum_cmd.send([self.oid, rest_ticks,
+                                          self.spectrum_oid])
         else:
-            self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x80)
+            self.query_lis2dw_cmd.send([self.oid, rest_ticks])
+        self.spectrum_running = spectrum
+        self.set_reg(REG_LIS2DW_FIFO_CTRL, fifo_ctrl)
+    def _stop_reading(self):
+        self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x00)
+        self.query_lis2dw_cmd.send_wait_ack([self.oid, 0])
+        self.spectrum_running = False
+    def _disable_int(self):
+        self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x00)
+        if self.have_int:
+            int_reg, int_val = self._get_int_reg()
+            self.set_reg(int_reg, 0x00)
+    # Vibration summaries (see vibration_monitor.py)
+    def setup_spectrum(self, spectrum_oid):
+        self.spectrum_oid = spectrum_oid
+        return self.data_rate, self.axes_map
+    def start_spectrum(self):
+        self.spectrum_enabled = True
+        if not self.batch_bulk.is_started and not self.spectrum_running:
+            self._start_reading(spectrum=True)
+    def stop_spectrum(self):
+        self.spectrum_enabled = False
+        if self.spectrum_running:
+            self._stop_reading()
+            self._disable_int()
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        # Bulk clients take precedence over vibration summaries
+        if self.spectrum_running:
+            self._stop_reading()
+        self._start_reading()
         logging.info("LIS2DW starting '%s' measurements", self.name)
         # Initialize clock tracking
         self.ffreader.note_start()
         self.last_error_count = 0
     def _finish_measurements(self):
         # Halt bulk reading
-        self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x00)
-        self.query_lis2dw_cmd.send_wait_ack([self.oid, 0])
+        self._stop_reading()
         self.ffreader.note_end()
         logging.info("LIS2DW finished '%s' measurements", self.name)
-        self.set_reg(REG_LIS2DW_FIFO_CTRL, 0x00)
+        self._disable_int()
+        if self.spectrum_enabled:
+            self._start_reading(spectrum=True)
     def _process_batch(self, eventtime):
         samples = self.ffreader.pull_samples()
         self._convert_samples(samples)
@@ -0,0 +1,167 @@
+# Load cell based z probe (filtering and trigger detection run on the mcu)
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import math
+import mcu
+from . import probe, load_cell
+
+# Butterworth (Q=sqrt(0.5)) second order section using the bilinear transform
+def calc_biquad(cutoff_freq, sample_freq, is_highpass):
+    k = math.tan(math.pi * cutoff_freq / sample_freq)
+    inv_q = math.sqrt(2.)
+    norm = 1. / (1. + k * inv_q + k * k)
+    if is_highpass:
+        b0 = norm
+        b1 = -2. * b0
+    else:
+        b0 = k * k * norm
+        b1 = 2. * b0
+    a1 = 2. * (k * k - 1.) * norm
+    a2 = (1. - k * inv_q + k * k) * norm
+    return (b0, b1, b0, a1, a2)
+
+# Endstop wrapper that homes using the mcu load_cell_probe code
+class LoadCellEndstopWrapper:
+    REASON_SENSOR_ERROR = mcu.MCU_trsync.REASON_COMMS_TIMEOUT + 1
+    def __init__(self, config, sensor):
+        self._printer = config.get_printer()
+        self._sensor = sensor
+        self._mcu = sensor.get_mcu()
+        self._oid = self._mcu.create_oid()
+        self._position_endstop = config.getfloat('z_offset')
+        self._dispatch = mcu.TriggerDispatch(self._mcu)
+        self._is_streaming = False
+        # Trigger configuration
+        sps = sensor.get_samples_per_second()
+        self._trigger_counts = config.getint('trigger_counts', minval=1)
+        tare_time = config.getfloat('tare_time', 0.050, above=0.)
+        self._tare_samples = max(1, min(0xffff, int(tare_time * sps + .5)))
+        # Filters
+        self._sections = []
+        drift_freq = config.getfloat('drift_filter_cutoff_frequency', None,
+                                     above=0., below=sps / 2.)
+        if drift_freq is not None:
+            self._sections.append(calc_biquad(drift_freq, sps, True))
+        buzz_freq = config.getfloat('buzz_filter_cutoff_frequency', None,
+                                    above=0., below=sps / 2.)
+        if buzz_freq is not None:
+            self._sections.append(calc_biquad(buzz_freq, sps, False))
+        # Mcu configuration
+        self._mcu.add_config_cmd("config_load_cell_probe oid=%d"
+                                 % (self._oid,))
+        sensor.attach_load_cell_probe(self._oid)
+        self._mcu.register_config_callback(self._build_config)
+        self._home_cmd = self._query_state_cmd = None
+    def _build_config(self):
+        frac_bits = self._mcu.get_constant_float('LOAD_CELL_FILTER_FRAC_BITS')
+        max_sections = self._mcu.get_constant_float(
+            'LOAD_CELL_FILTER_MAX_SECTIONS')
+        if len(self._sections) > max_sections:
+            raise self._printer.config_error(
+                "load_cell_probe filter requires too many sections")
+        scale = float(1 << int(frac_bits))
+        for i, coeffs in enumerate(self._sections):
+            fixed = [int(round(c * scale)) for c in coeffs]
+            self._mcu.add_config_cmd(
+                "load_cell_probe_set_section oid=%d section=%d"
+                " b0=%d b1=%d b2=%d a1=%d a2=%d"
+                % tuple([self._oid, i] + fixed))
+        # Treat a saturated sensor reading as an error
+        range_min, range_max = self._sensor.get_range()
+        self._mcu.add_config_cmd(
+            "load_cell_probe_set_range oid=%d safety_min=%d safety_max=%d"
+            " trigger_counts=%d tare_samples=%d"
+            % (self._oid, range_min + 1, range_max - 1,
+               self._trigger_counts, self._tare_samples))
+        self._home_cmd = self._mcu.lookup_command(
+            "load_cell_probe_home oid=%c trsync_oid=%c trigger_reason=%c"
+            " error_reason=%c clock=%u")
+        self._query_state_cmd = self._mcu.lookup_query_command(
+            "load_cell_probe_query_state oid=%c",
+            "load_cell_probe_state oid=%c is_homing=%c trigger_clock=%u"
+            " tare=%i", oid=self._oid)
+    # Keep the sensor streaming samples to the mcu probe code
+    def _handle_batch(self, msg):
+        return self._is_streaming
+    def _start_streaming(self):
+        if not self._is_streaming:
+            self._is_streaming = True
+            self._sensor.add_client(self._handle_batch)
+    # Interface for MCU_endstop
+    def get_mcu(self):
+        return self._mcu
+    def add_stepper(self, stepper):
+        self._dispatch.add_stepper(stepper)
+    def get_steppers(self):
+        return self._dispatch.get_steppers()
+    def home_start(self, print_time, sample_time, sample_count, rest_time,
+                   triggered=True):
+        self._start_streaming()
+        clock = self._mcu.print_time_to_clock(print_time)
+        trigger_completion = self._dispatch.start(print_time)
+        self._home_cmd.send(
+            [self._oid, self._dispatch.get_oid(),
+             mcu.MCU_trsync.REASON_ENDSTOP_HIT, self.REASON_SENSOR_ERROR,
+             clock])
+        return trigger_completion
+    def home_wait(self, home_end_time):
+        self._dispatch.wait_end(home_end_time)
+        self._home_cmd.send([self._oid, 0, 0, 0, 0])
+        trigger_time = 0.
+        if not self._mcu.is_fileoutput():
+            params = self._query_state_cmd.send([self._oid])
+            tclock = self._mcu.clock32_to_clock64(params['trigger_clock'])
+            trigger_time = self._mcu.clock_to_print_time(tclock)
+        res = self._dispatch.stop()
+        if res >= mcu.MCU_trsync.REASON_COMMS_TIMEOUT:
+            if res == mcu.MCU_trsync.REASON_COMMS_TIMEOUT:
+                raise self._printer.command_error(
+                    "Communication timeout during homing")
+            raise self._printer.command_error("Load cell sensor error")
+        if res != mcu.MCU_trsync.REASON_ENDSTOP_HIT:
+            return 0.
+        if self._mcu.is_fileoutput():
+            return home_end_time
+        return trigger_time
+    def query_endstop(self, print_time):
+        return False
+    # Interface for ProbeEndstopWrapper
+    def multi_probe_begin(self):
+        self._start_streaming()
+    def multi_probe_end(self):
+        self._is_streaming = False
+    def probing_move(self, pos, speed):
+        phoming = self._printer.lookup_object('homing')
+        return phoming.probing_move(self, pos, speed)
+    def probe_prepare(self, hmove):
+        pass
+    def probe_finish(self, hmove):
+        pass
+    def get_position_endstop(self):
+        return self._position_endstop
+
+# Main "printer object"
+class PrinterLoadCellProbe:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.load_cell = load_cell.load_config(config)
+        sensor = self.load_cell.get_sensor()
+        self.mcu_probe = LoadCellEndstopWrapper(config, sensor)
+        self.cmd_helper = probe.ProbeCommandHelper(
+            config, self, self.mcu_probe.query_endstop)
+        self.probe_offsets = probe.ProbeOffsetsHelper(config)
+        self.probe_session = probe.ProbeSessionHelper(config, self.mcu_probe)
+        self.printer.add_object('probe', self)
+    def get_probe_params(self, gcmd=None):
+        return self.probe_session.get_probe_params(gcmd)
+    def get_offsets(self):
+        return self.probe_offsets.get_offsets()
+    def get_status(self, eventtime):
+        return self.cmd_helper.get_status(eventtime)
+    def start_probe_session(self, gcmd):
+        return self.probe_session.start_probe_session(gcmd)
+
+def load_config(config):
+    return PrinterLoadCellProbe(config)
@@ -3,10 +3,13 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
+import logging, struct
 import chelper
 from . import bulk_sensor
 
+# Number of entries to request from the C code in each extraction call
+EXTRACT_BATCH = 1024
+
 # Extract stepper queue_step messages
 class DumpStepper:
     def __init__(self, printer, mcu_stepper):
@@ -15,7 +18,7 @@ class DumpStepper:
         self.last_batch_clock = 0
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
-        api_resp = {'header': ('interval', 'count', 'add')}
+        api_resp = {'header': ('interval', 'count', 'add', 'add2')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_stepper", "name",
                                          mcu_stepper.get_name(), api_resp)
     def get_step_queue(self, start_clock, end_clock):
@@ -31,6 +34,28 @@ class DumpStepper:
             end_clock = data[count-1].first_clock
         res.reverse()
         return ([d[i] for d, cnt in res for i in range(cnt-1, -1, -1)], res)
+    def pull_steps(self, start_clock, end_clock):
+        # Decode the packed C records directly (instead of per-field cffi
+        # lookups) and return them as tuples in chronological order
+        ffi_main, ffi_lib = chelper.get_ffi()
+        mcu_stepper = self.mcu_stepper
+        res = []
+        while 1:
+            data, count = mcu_stepper.dump_steps(EXTRACT_BATCH, start_clock,
+                                                 end_clock)
+            if not count:
+                break
+            vals = struct.unpack(PULL_STEPS_FMT * count,
+                                 ffi_main.buffer(data, count * PULL_STEPS_SIZE))
+            rows = [vals[i:i+PULL_STEPS_FIELDS]
+                    for i in range(0, len(vals), PULL_STEPS_FIELDS)]
+            rows.reverse()
+            res.append(rows)
+            if count < len(data):
+                break
+            end_clock = rows[0][0]
+        res.reverse()
+        return [row for rows in res for row in rows]
     def log_steps(self, data):
         if not data:
             return
@@ -39,29 +64,34 @@ class DumpStepper:
                    % (self.mcu_stepper.get_name(),
                       self.mcu_stepper.get_mcu().get_name(), len(data)))
         for i, s in enumerate(data):
-            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d"
+            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d a2=%d"
                        % (i, s.first_clock, s.start_position, s.interval,
-                          s.step_count, s.add))
+                          s.step_count, s.add, s.add2))
         logging.info('\n'.join(out))
     def _process_batch(self, eventtime):
-        data, cdata = self.get_step_queue(self.last_batch_clock, 1<<63)
+        data = self.pull_steps(self.last_batch_clock, 1<<63)
         if not data:
             return {}
         clock_to_print_time = self.mcu_stepper.get_mcu().clock_to_print_time
-        first = data[0]
-        first_clock = first.first_clock
+        first_clock, _, mcu_pos = data[0][:3]
         first_time = clock_to_print_time(first_clock)
-        self.last_batch_clock = last_clock = data[-1].last_clock
+        self.last_batch_clock = last_clock = data[-1][1]
         last_time = clock_to_print_time(last_clock)
-        mcu_pos = first.start_position
         start_position = self.mcu_stepper.mcu_to_commanded_position(mcu_pos)
         step_dist = self.mcu_stepper.get_step_dist()
-        d = [(s.interval, s.step_count, s.add) for s in data]
+        d = [(s[4], s[3], s[5], s[6]) for s in data]
         return {"data": d, "start_position": start_position,
                 "start_mcu_position": mcu_pos, "step_distance": step_dist,
                 "first_clock": first_clock, "first_step_time": first_time,
                 "last_clock": last_clock, "last_step_time": last_time}
 
+# Layout of 'struct pull_history_steps' and 'struct pull_move'
+PULL_STEPS_FMT = "QQqiiii"
+PULL_STEPS_FIELDS = len(PULL_STEPS_FMT)
+PULL_STEPS_SIZE = struct.calcsize(PULL_STEPS_FMT)
+PULL_MOVE_FIELDS = 10
+PULL_MOVE_SIZE = PULL_MOVE_FIELDS * 8
+
 NEVER_TIME = 9999999999999999.
 
 # Extract trapezoidal motion queue (trapq)
@@ -71,6 +101,9 @@ class DumpTrapQ:
         self.name = name
         self.trapq = trapq
         self.last_batch_msg = (0., 0.)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.position_data = ffi_main.new('struct pull_move[1]')
+        self.position_move = None
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
         api_resp = {'header': ('time', 'duration', 'start_velocity',
@@ -92,6 +125,29 @@ class DumpTrapQ:
             end_time = data[count-1].print_time
         res.reverse()
         return ([d[i] for d, cnt in res for i in range(cnt-1, -1, -1)], res)
+    def _pull_moves(self, start_time, end_time):
+        # Decode the packed C records and return them as tuples of
+        # (print_time, move_t, start_v, accel, start_x, start_y, start_z,
+        #  x_r, y_r, z_r) in chronological order
+        ffi_main, ffi_lib = chelper.get_ffi()
+        data = ffi_main.new('struct pull_move[]', EXTRACT_BATCH)
+        res = []
+        while 1:
+            count = ffi_lib.trapq_extract_old(self.trapq, data, EXTRACT_BATCH,
+                                              start_time, end_time)
+            if not count:
+                break
+            vals = struct.unpack("%dd" % (count * PULL_MOVE_FIELDS,),
+                                 ffi_main.buffer(data, count * PULL_MOVE_SIZE))
+            rows = [vals[i:i+PULL_MOVE_FIELDS]
+                    for i in range(0, len(vals), PULL_MOVE_FIELDS)]
+            rows.reverse()
+            res.append(rows)
+            if count < EXTRACT_BATCH:
+                break
+            end_time = rows[0][0]
+        res.reverse()
+        return [row for rows in res for row in rows]
     def log_trapq(self, data):
         if not data:
             return
@@ -103,24 +159,34 @@ class DumpTrapQ:
                           m.start_x, m.start_y, m.start_z, m.x_r, m.y_r, m.z_r))
         logging.info('\n'.join(out))
     def get_trapq_position(self, print_time):
-        ffi_main, ffi_lib = chelper.get_ffi()
-        data = ffi_main.new('struct pull_move[1]')
-        count = ffi_lib.trapq_extract_old(self.trapq, data, 1, 0., print_time)
-        if not count:
-            return None, None
-        move = data[0]
+        move = self.position_move
+        if (move is None or print_time < move.print_time
+            or print_time > move.print_time + move.move_t):
+            # Not within the last found move - lookup from the history
+            ffi_main, ffi_lib = chelper.get_ffi()
+            self.position_move = None
+            data = self.position_data
+            count = ffi_lib.trapq_extract_old(self.trapq, data, 1,
+                                              0., print_time)
+            if not count:
+                return None, None
+            move = data[0]
+            if print_time <= move.print_time + move.move_t:
+                # Reuse this move on the next lookup (if still within it)
+                self.position_move = move
         move_time = max(0., min(move.move_t, print_time - move.print_time))
         dist = (move.start_v + .5 * move.accel * move_time) * move_time;
         pos = (move.start_x + move.x_r * dist, move.start_y + move.y_r * dist,
                move.start_z + move.z_r * dist)
         velocity = move.start_v + move.accel * move_time
         return pos, velocity
+    def reset_position_cache(self):
+        # The trapq history may have been truncated
+        self.position_move = None
     def _process_batch(self, eventtime):
         qtime = self.last_batch_msg[0] + min(self.last_batch_msg[1], 0.100)
-        data, cdata = self.extract_trapq(qtime, NEVER_TIME)
-        d = [(m.print_time, m.move_t, m.start_v, m.accel,
-              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r))
-             for m in data]
+        data = self._pull_moves(qtime, NEVER_TIME)
+        d = [(m[0], m[1], m[2], m[3], m[4:7], m[7:10]) for m in data]
         if d and d[0] == self.last_batch_msg:
             d.pop(0)
         if not d:
@@ -146,6 +212,8 @@ class PrinterMotionReport:
         # Register handlers
         self.printer.register_event_handler("klippy:connect", self._connect)
         self.printer.register_event_handler("klippy:shutdown", self._shutdown)
+        self.printer.register_event_handler("toolhead:set_position",
+                                            self._handle_set_position)
     def register_stepper(self, config, mcu_stepper):
         ds = DumpStepper(self.printer, mcu_stepper)
         self.steppers[mcu_stepper.get_name()] = ds
@@ -167,6 +235,9 @@ class PrinterMotionReport:
         # Populate 'trapq' and 'steppers' in get_status result
         self.last_status['steppers'] = list(sorted(self.steppers.keys()))
         self.last_status['trapq'] = list(sorted(self.trapqs.keys()))
+    def _handle_set_position(self):
+        for dtrapq in self.trapqs.values():
+            dtrapq.reset_position_cache()
     # Shutdown handling
     def _dump_shutdown(self, eventtime):
         # Log stepper queue_steps on mcu that started shutdown (if any)
@@ -12,6 +12,7 @@ BIT_MAX_TIME=.000004
 RESET_MIN_TIME=.000050
 
 MAX_MCU_SIZE = 500  # Sanity check on LED chain length
+MIN_FILL_LEDS = 3  # Minimum run of identical leds to send via neopixel_fill
 
 class PrinterNeoPixel:
     def __init__(self, config):
@@ -25,6 +26,7 @@ class PrinterNeoPixel:
         self.pin = pin_params['pin']
         self.mcu.register_config_callback(self.build_config)
         self.neopixel_update_cmd = self.neopixel_send_cmd = None
+        self.neopixel_fill_cmd = None
         # Build color map
         chain_count = config.getint('chain_count', 1, minval=1)
         color_order = config.getlist("color_order", ["GRB"])
@@ -33,9 +35,11 @@ class PrinterNeoPixel:
         if len(color_order) != chain_count:
             raise config.error("color_order does not match chain_count")
         color_indexes = []
+        self.led_spans = []
         for lidx, co in enumerate(color_order):
             if sorted(co) not in (sorted("RGB"), sorted("RGBW")):
                 raise config.error("Invalid color_order '%s'" % (co,))
+            self.led_spans.append((len(color_indexes), len(co)))
             color_indexes.extend([(lidx, "RGBW".index(c)) for c in co])
         self.color_map = list(enumerate(color_indexes))
         if len(self.color_map) > MAX_MCU_SIZE:
@@ -57,6 +61,8 @@ class PrinterNeoPixel:
         cmd_queue = self.mcu.alloc_command_queue()
         self.neopixel_update_cmd = self.mcu.lookup_command(
             "neopixel_update oid=%c pos=%hu data=%*s", cq=cmd_queue)
+        self.neopixel_fill_cmd = self.mcu.try_lookup_command(
+            "neopixel_fill oid=%c pos=%hu count=%hu data=%*s", cq=cmd_queue)
         self.neopixel_send_cmd = self.mcu.lookup_query_command(
             "neopixel_send oid=%c", "neopixel_result oid=%c success=%c",
             oid=self.oid, cq=cmd_queue)
@@ -64,10 +70,34 @@ class PrinterNeoPixel:
         color_data = self.color_data
         for cdidx, (lidx, cidx) in self.color_map:
             color_data[cdidx] = int(led_state[lidx][cidx] * 255. + .5)
+    def send_fills(self):
+        # Send runs of identical leds (that include a change) as fills
+        old_data, new_data = self.old_color_data, self.color_data
+        spans = self.led_spans
+        fcmd = self.neopixel_fill_cmd.send
+        i = 0
+        while i < len(spans):
+            pos, size = spans[i]
+            pattern = new_data[pos:pos+size]
+            j = i + 1
+            while j < len(spans):
+                jpos, jsize = spans[j]
+                if jsize != size or new_data[jpos:jpos+jsize] != pattern:
+                    break
+                j += 1
+            count, end = j - i, pos + (j - i) * size
+            is_changed = new_data[pos:end] != old_data[pos:end]
+            if count >= MIN_FILL_LEDS and is_changed:
+                fcmd([self.oid, pos, count, pattern],
+                     reqclock=BACKGROUND_PRIORITY_CLOCK)
+                old_data[pos:end] = new_data[pos:end]
+            i = j
     def send_data(self, print_time=None):
         old_data, new_data = self.old_color_data, self.color_data
         if new_data == old_data:
             return
+        if self.neopixel_fill_cmd is not None:
+            self.send_fills()
         # Find the position of all changed bytes in this framebuffer
         diffs = [[i, 1] for i, (n, o) in enumerate(zip(new_data, old_data))
                  if n != o]
@@ -24,6 +24,8 @@ class PauseResume:
         self.gcode.register_command("CANCEL_PRINT", self.cmd_CANCEL_PRINT,
                                     desc=self.cmd_CANCEL_PRINT_help)
         webhooks = self.printer.lookup_object('webhooks')
+        self.note_status_change = webhooks.register_status_notify(
+            config.get_name())
         webhooks.register_endpoint("pause_resume/cancel",
                                    self._handle_cancel_request)
         webhooks.register_endpoint("pause_resume/pause",
@@ -65,6 +67,7 @@ class PauseResume:
         self.send_pause_command()
         self.gcode.run_script_from_command("SAVE_GCODE_STATE NAME=PAUSE_STATE")
         self.is_paused = True
+        self.note_status_change()
     def send_resume_command(self):
         if self.sd_paused:
             # Printing from virtual sd, run pause command
@@ -84,10 +87,12 @@ class PauseResume:
             % (velocity))
         self.send_resume_command()
         self.is_paused = False
+        self.note_status_change()
     cmd_CLEAR_PAUSE_help = (
         "Clears the current paused state without resuming the print")
     def cmd_CLEAR_PAUSE(self, gcmd):
         self.is_paused = self.pause_command_sent = False
+        self.note_status_change()
     cmd_CANCEL_PRINT_help = ("Cancel the current print")
     def cmd_CANCEL_PRINT(self, gcmd):
         if self.is_sd_active() or self.sd_paused:
@@ -4,11 +4,100 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 
+FEATURE_PREFIXES = ('TYPE:', 'FEATURE:')
+
+# Per-layer and per-feature accounting of move throughput
+class ThroughputStats:
+    def __init__(self, printer):
+        self.printer = printer
+        self.reactor = printer.get_reactor()
+        self.toolhead = None
+        printer.register_event_handler("klippy:connect", self._handle_connect)
+        printer.register_event_handler("gcode:comment", self._handle_comment)
+        self.reset()
+    def _handle_connect(self):
+        self.toolhead = self.printer.lookup_object('toolhead')
+    def reset(self):
+        self.layer = 0
+        self.feature = None
+        self.last_totals = None
+        self.layer_totals = {}
+        self.feature_totals = {}
+        self.layers = {}
+        self.features = {}
+    def _get_totals(self):
+        res = self.toolhead.get_throughput_stats()
+        res['step_bytes'] = sum([m.get_step_stats()[1]
+                                 for m in self.toolhead.all_mcus])
+        res['wall_time'] = self.reactor.monotonic()
+        return res
+    def _summarize(self, totals):
+        moves = totals['moves']
+        avg_depth = 0.
+        if moves:
+            avg_depth = totals['queue_depth_sum'] / float(moves)
+        return {'planned_time': round(totals['planned_time'], 3),
+                'move_time': round(totals['move_time'], 3),
+                'wall_time': round(totals['wall_time'], 3),
+                'pause_time': round(totals['pause_time'], 3),
+                'avg_queue_depth': round(avg_depth, 1), 'moves': moves,
+                'step_bytes': totals['step_bytes'],
+                'stalls': totals['stalls']}
+    def _accumulate(self):
+        # Charge the activity since the last update to the current
+        # layer and feature
+        last = self.last_totals
+        if last is None or self.toolhead is None:
+            return
+        cur = self.last_totals = self._get_totals()
+        delta = {k: cur[k] - last[k] for k in cur}
+        if not delta['moves'] and not delta['move_time']:
+            return
+        layer_totals = self.layer_totals.setdefault(
+            self.layer, {k: 0 for k in cur})
+        feature_totals = self.feature_totals.setdefault(
+            self.feature, {k: 0 for k in cur})
+        for k, v in delta.items():
+            layer_totals[k] += v
+            feature_totals[k] += v
+        # Status dictionaries are replaced (not modified) on each update
+        layers = dict(self.layers)
+        layers[self.layer] = self._summarize(layer_totals)
+        self.layers = layers
+        if self.feature is not None:
+            features = dict(self.features)
+            features[self.feature] = self._summarize(feature_totals)
+            self.features = features
+    def note_start(self):
+        if self.last_totals is None and self.toolhead is not None:
+            self.last_totals = self._get_totals()
+    def note_stop(self):
+        self._accumulate()
+        self.last_totals = None
+    def set_layer(self, layer):
+        if layer != self.layer:
+            self._accumulate()
+            self.layer = layer
+    def _handle_comment(self, cmdline):
+        comment = cmdline[cmdline.find(';')+1:].strip()
+        for prefix in FEATURE_PREFIXES:
+            if comment.upper().startswith(prefix):
+                feature = comment[len(prefix):].strip()
+                if feature != self.feature:
+                    self._accumulate()
+                    self.feature = feature
+                return
+    def get_status(self, eventtime):
+        return {'layers': self.layers, 'features': self.features}
+
 class PrintStats:
     def __init__(self, config):
-        printer = config.get_printer()
+        self.printer = printer = config.get_printer()
         self.gcode_move = printer.load_object(config, 'gcode_move')
         self.reactor = printer.get_reactor()
+        self.throughput = None
+        if config.getboolean('throughput_stats', False):
+            self.throughput = ThroughputStats(printer)
         self.reset()
         # Register commands
         self.gcode = printer.lookup_object('gcode')
@@ -28,6 +117,7 @@ class PrintStats:
         curtime = self.reactor.monotonic()
         if self.print_start_time is None:
             self.print_start_time = curtime
+            self.printer.send_event("print_stats:start")
         elif self.last_pause_time is not None:
             # Update pause time duration
             pause_duration = curtime - self.last_pause_time
@@ -38,12 +128,16 @@ class PrintStats:
         self.last_epos = gc_status['position'].e
         self.state = "printing"
         self.error_message = ""
+        if self.throughput is not None:
+            self.throughput.note_start()
     def note_pause(self):
         if self.last_pause_time is None:
             curtime = self.reactor.monotonic()
             self.last_pause_time = curtime
             # update filament usage
             self._update_filament_usage(curtime)
+            if self.throughput is not None:
+                self.throughput.note_stop()
         if self.state != "error":
             self.state = "paused"
     def note_complete(self):
@@ -55,6 +149,8 @@ class PrintStats:
     def _note_finish(self, state, error_message = ""):
         if self.print_start_time is None:
             return
+        if self.throughput is not None:
+            self.throughput.note_stop()
         self.state = state
         self.error_message = error_message
         eventtime = self.reactor.monotonic()
@@ -82,6 +178,8 @@ class PrintStats:
                 current_layer is not None and \
                 current_layer != self.info_current_layer:
             self.info_current_layer = min(current_layer, self.info_total_layer)
+            if self.throughput is not None:
+                self.throughput.set_layer(self.info_current_layer)
     def reset(self):
         self.filename = self.error_message = ""
         self.state = "standby"
@@ -91,6 +189,8 @@ class PrintStats:
         self.init_duration = 0.
         self.info_total_layer = None
         self.info_current_layer = None
+        if self.throughput is not None:
+            self.throughput.reset()
     def get_status(self, eventtime):
         time_paused = self.prev_pause_duration
         if self.print_start_time is not None:
@@ -105,7 +205,7 @@ class PrintStats:
                 # Track duration prior to extrusion
                 self.init_duration = self.total_duration - time_paused
         print_duration = self.total_duration - self.init_duration - time_paused
-        return {
+        res = {
             'filename': self.filename,
             'total_duration': self.total_duration,
             'print_duration': print_duration,
@@ -115,6 +215,9 @@ class PrintStats:
             'info': {'total_layer': self.info_total_layer,
                      'current_layer': self.info_current_layer}
         }
+        if self.throughput is not None:
+            res['throughput'] = self.throughput.get_status(eventtime)
+        return res
 
 def load_config(config):
     return PrintStats(config)
@@ -259,6 +259,9 @@ class ProbeSessionHelper:
                                                  minval=0.)
         self.samples_retries = config.getint('samples_tolerance_retries', 0,
                                              minval=0)
+        # Probes that can report probing results after later moves
+        self.probing_move_deferred = getattr(mcu_probe,
+                                             'probing_move_deferred', None)
         # Session state
         self.multi_probe_pending = False
         self.results = []
@@ -307,7 +310,7 @@ class ProbeSessionHelper:
                 'samples_tolerance': samples_tolerance,
                 'samples_tolerance_retries': samples_retries,
                 'samples_result': samples_result}
-    def _probe(self, speed):
+    def _probing_move(self, probing_move, speed):
         toolhead = self.printer.lookup_object('toolhead')
         curtime = self.printer.get_reactor().monotonic()
         if 'z' not in toolhead.get_status(curtime)['homed_axes']:
@@ -315,12 +318,16 @@ class ProbeSessionHelper:
         pos = toolhead.get_position()
         pos[2] = self.z_position
         try:
-            epos = self.mcu_probe.probing_move(pos, speed)
+            return probing_move(pos, speed)
         except self.printer.command_error as e:
             reason = str(e)
             if "Timeout during endstop homing" in reason:
                 reason += HINT_TIMEOUT
             raise self.printer.command_error(reason)
+    def _probe(self, speed):
+        epos = self._probing_move(self.mcu_probe.probing_move, speed)
+        return self._note_result(epos)
+    def _note_result(self, epos):
         # Allow axis_twist_compensation to update results
         self.printer.send_event("probe:update_results", epos)
         # Report results
@@ -332,6 +339,13 @@ class ProbeSessionHelper:
         if not self.multi_probe_pending:
             self._probe_state_error()
         params = self.get_probe_params(gcmd)
+        if params['samples'] == 1 and self.probing_move_deferred is not None:
+            # Obtain the result in pull_probed_results() so that the
+            # caller can queue further moves without waiting for it
+            self._probing_move(self.probing_move_deferred,
+                               params['probe_speed'])
+            self.results.append(None)
+            return
         toolhead = self.printer.lookup_object('toolhead')
         probexy = toolhead.get_position()[:2]
         retries = 0
@@ -360,6 +374,10 @@ class ProbeSessionHelper:
     def pull_probed_results(self):
         res = self.results
         self.results = []
+        if None in res:
+            deferred = self.mcu_probe.pull_deferred_results()
+            res = [epos if epos is not None
+                   else self._note_result(deferred.pop(0)) for epos in res]
         return res
 
 # Helper to read the xyz probe offsets from the config
@@ -1,13 +1,15 @@
 # Support for eddy current based Z probes
 #
-# Copyright (C) 2021-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, bisect
-import mcu
+import mcu, chelper
 from . import ldc1612, probe, manual_probe
 
 OUT_OF_RANGE = 99.9
+# Height range (beyond the trigger and hysteresis) of mcu homing table
+HOMING_TABLE_MARGIN = 0.200
 
 # Tool for calibrating the sensor Z detection and applying that calibration
 class EddyCalibration:
@@ -18,6 +20,7 @@ class EddyCalibration:
         # Current calibration data
         self.cal_freqs = []
         self.cal_zpos = []
+        self.table_key = None
         cal = config.get('calibrate', None)
         if cal is not None:
             cal = [list(map(float, d.strip().split(':', 1)))
@@ -37,6 +40,7 @@ class EddyCalibration:
         cal = sorted([(c[1], c[0]) for c in cal])
         self.cal_freqs = [c[0] for c in cal]
         self.cal_zpos = [c[1] for c in cal]
+        self.table_key = None
     def apply_calibration(self, samples):
         cur_temp = self.drift_comp.get_temperature()
         for i, (samp_time, freq, dummy_z) in enumerate(samples):
@@ -56,6 +60,19 @@ class EddyCalibration:
                 offset = prev_zpos - prev_freq * gain
                 zpos = adj_freq * gain + offset
             samples[i] = (samp_time, freq, round(zpos, 6))
+    def update_height_table(self, eddy_scan):
+        # Provide the C code with a table of raw frequency to height
+        # for the current temperature
+        cur_temp = self.drift_comp.get_temperature()
+        if cur_temp == self.table_key:
+            return
+        self.table_key = cur_temp
+        table = sorted([(self.drift_comp.unadjust_freq(freq, cur_temp), z)
+                        for freq, z in zip(self.cal_freqs, self.cal_zpos)])
+        ffi_main, ffi_lib = chelper.get_ffi()
+        freqs = ffi_main.new('double[]', [t[0] for t in table])
+        heights = ffi_main.new('double[]', [t[1] for t in table])
+        ffi_lib.eddy_scan_set_table(eddy_scan, freqs, heights, len(table))
     def freq_to_height(self, freq):
         dummy_sample = [(0., freq, 0.)]
         self.apply_calibration(dummy_sample)
@@ -213,16 +230,25 @@ class EddyGatherSamples:
         if not self._calibration.is_calibrated():
             raise self._printer.command_error(
                 "Must calibrate probe_eddy_current first")
+        # Store samples and average probe windows in C code (if possible)
+        self._eddy_scan = sensor_helper.get_eddy_scan()
+        if self._eddy_scan is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.eddy_scan_capture(self._eddy_scan, 1)
         sensor_helper.add_client(self._add_measurement)
     def _add_measurement(self, msg):
         if self._need_stop:
             del self._samples[:]
             return False
-        self._samples.append(msg)
+        if self._eddy_scan is None:
+            self._samples.append(msg)
         self._check_samples()
         return True
     def finish(self):
         self._need_stop = True
+        if self._eddy_scan is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            ffi_lib.eddy_scan_capture(self._eddy_scan, 0)
     def _await_samples(self):
         # Make sure enough samples have been collected
         reactor = self._printer.get_reactor()
@@ -235,8 +261,17 @@ class EddyGatherSamples:
                 raise self._printer.command_error(
                     "probe_eddy_current sensor outage")
             reactor.pause(systime + 0.010)
+    def _have_samples(self, end_time):
+        if self._eddy_scan is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            return ffi_lib.eddy_scan_last_time(self._eddy_scan) >= end_time
+        return self._samples and self._samples[-1]['data'][-1][0] >= end_time
     def _pull_freq(self, start_time, end_time):
         # Find average sensor frequency between time range
+        if self._eddy_scan is not None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            return ffi_lib.eddy_scan_average(self._eddy_scan,
+                                             start_time, end_time)
         msg_num = discard_msgs = 0
         samp_sum = 0.
         samp_count = 0
@@ -266,9 +301,9 @@ class EddyGatherSamples:
                     for s in kin.get_steppers()}
         return kin.calc_position(kin_spos)
     def _check_samples(self):
-        while self._samples and self._probe_times:
+        while self._probe_times:
             start_time, end_time, pos_time, toolhead_pos = self._probe_times[0]
-            if self._samples[-1]['data'][-1][0] < end_time:
+            if not self._have_samples(end_time):
                 break
             freq = self._pull_freq(start_time, end_time)
             if pos_time is not None:
@@ -310,9 +345,13 @@ class EddyEndstopWrapper:
         self._mcu = sensor_helper.get_mcu()
         self._calibration = calibration
         self._z_offset = config.getfloat('z_offset', minval=0.)
+        self._filter_samples = config.getint('homing_filter_samples', 1,
+                                             minval=1)
+        self._hysteresis = config.getfloat('homing_hysteresis', 0., minval=0.)
         self._dispatch = mcu.TriggerDispatch(self._mcu)
         self._trigger_time = 0.
         self._gather = None
+        self._deferred = []
     # Interface for MCU_endstop
     def get_mcu(self):
         return self._mcu
@@ -320,13 +359,48 @@ class EddyEndstopWrapper:
         self._dispatch.add_stepper(stepper)
     def get_steppers(self):
         return self._dispatch.get_steppers()
+    def _build_height_table(self):
+        # Select heights around the trigger for the mcu height table
+        table_size, max_filter = self._sensor_helper.get_height_homing_limits()
+        if not table_size:
+            if self._filter_samples > 1 or self._hysteresis:
+                raise self._printer.command_error(
+                    "probe_eddy_current homing filter not supported by mcu")
+            return None
+        if self._filter_samples > max_filter:
+            raise self._printer.command_error(
+                "probe_eddy_current homing_filter_samples must not exceed %d"
+                % (max_filter,))
+        min_height = self._z_offset - HOMING_TABLE_MARGIN
+        max_height = self._z_offset + self._hysteresis + HOMING_TABLE_MARGIN
+        height_step = (max_height - min_height) / (table_size - 1)
+        table = []
+        for i in range(table_size):
+            height = min_height + i * height_step
+            try:
+                freq = self._calibration.height_to_freq(height)
+            except self._printer.command_error:
+                # Height not within the calibration range
+                continue
+            table.append((freq, height))
+        if len(table) < 2:
+            raise self._printer.command_error(
+                "Invalid probe_eddy_current height")
+        return table
     def home_start(self, print_time, sample_time, sample_count, rest_time,
                    triggered=True):
         self._trigger_time = 0.
         trigger_freq = self._calibration.height_to_freq(self._z_offset)
+        height_table = self._build_height_table()
         trigger_completion = self._dispatch.start(print_time)
-        self._sensor_helper.setup_home(
-            print_time, trigger_freq, self._dispatch.get_oid(),
+        if height_table is None:
+            self._sensor_helper.setup_home(
+                print_time, trigger_freq, self._dispatch.get_oid(),
+                mcu.MCU_trsync.REASON_ENDSTOP_HIT, self.REASON_SENSOR_ERROR)
+            return trigger_completion
+        self._sensor_helper.setup_home_height(
+            print_time, height_table, self._z_offset, self._hysteresis,
+            self._filter_samples, self._dispatch.get_oid(),
             mcu.MCU_trsync.REASON_ENDSTOP_HIT, self.REASON_SENSOR_ERROR)
         return trigger_completion
     def home_wait(self, home_end_time):
@@ -337,6 +411,10 @@ class EddyEndstopWrapper:
             if res == mcu.MCU_trsync.REASON_COMMS_TIMEOUT:
                 raise self._printer.command_error(
                     "Communication timeout during homing")
+            if self._hysteresis:
+                raise self._printer.command_error(
+                    "Eddy current sensor error (or the sensor was not above"
+                    " the homing_hysteresis range at the start of homing)")
             raise self._printer.command_error("Eddy current sensor error")
         if res != mcu.MCU_trsync.REASON_ENDSTOP_HIT:
             return 0.
@@ -348,19 +426,36 @@ class EddyEndstopWrapper:
         return False # XXX
     # Interface for ProbeEndstopWrapper
     def probing_move(self, pos, speed):
-        # Perform probing move
+        self.probing_move_deferred(pos, speed)
+        return self.pull_deferred_results()[0]
+    def probing_move_deferred(self, pos, speed):
+        # Perform probing move (without waiting for the sensor readings)
         phoming = self._printer.lookup_object('homing')
         trig_pos = phoming.probing_move(self, pos, speed)
         if not self._trigger_time:
-            return trig_pos
-        # Extract samples
+            self._deferred.append(trig_pos)
+            return
+        # Note samples to extract
         start_time = self._trigger_time + 0.050
         end_time = start_time + 0.100
         toolhead = self._printer.lookup_object("toolhead")
         toolhead_pos = toolhead.get_position()
         self._gather.note_probe(start_time, end_time, toolhead_pos)
-        return self._gather.pull_probed()[0]
+        self._deferred.append(None)
+        # Don't move the toolhead until the samples are taken
+        dwell_time = end_time - toolhead.get_last_move_time()
+        if dwell_time > 0.:
+            toolhead.dwell(dwell_time)
+    def pull_deferred_results(self):
+        results = self._deferred
+        self._deferred = []
+        if None in results:
+            probed = self._gather.pull_probed()
+            results = [pos if pos is not None else probed.pop(0)
+                       for pos in results]
+        return results
     def multi_probe_begin(self):
+        self._deferred = []
         self._gather = EddyGatherSamples(self._printer, self._sensor_helper,
                                          self._calibration, self._z_offset)
     def multi_probe_end(self):
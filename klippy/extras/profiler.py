@@ -0,0 +1,269 @@
+# Sampling profiler for the host software
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, threading, marshal, logging
+import reactor, gcode, webhooks, toolhead
+
+REPORT_COUNT = 10
+
+def get_code(func):
+    return getattr(func, '__func__', func).__code__
+
+def code_name(code):
+    name = getattr(code, 'co_qualname', code.co_name)
+    return "%s:%d(%s)" % (os.path.basename(code.co_filename),
+                          code.co_firstlineno, name)
+
+# Sample the main thread stack from a background thread.  The sampler
+# holds the python GIL while it inspects the stack, so the main thread
+# (and its currently running greenlet) is stopped during each sample.
+class HostProfiler:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.default_interval = config.getfloat('interval', .002,
+                                                minval=.0005, maxval=1.)
+        self.default_filename = config.get('filename', '/tmp/klippy.prof')
+        self._find_codes()
+        # Sampling state
+        self.lock = threading.Lock()
+        self.sample_thread = None
+        self.stop_event = threading.Event()
+        self.main_ident = threading.current_thread().ident
+        self.interval = self.default_interval
+        self.switch_interval = None
+        self._reset()
+        # Register commands
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("PROFILER_START", self.cmd_PROFILER_START,
+                               desc=self.cmd_PROFILER_START_help)
+        gcode.register_command("PROFILER_STOP", self.cmd_PROFILER_STOP,
+                               desc=self.cmd_PROFILER_STOP_help)
+        wh = self.printer.lookup_object('webhooks')
+        wh.register_endpoint("profiler/start", self._handle_start_request)
+        wh.register_endpoint("profiler/stop", self._handle_stop_request)
+    def _find_codes(self):
+        # Code objects that identify the activity of a sample
+        reactors = [getattr(reactor, n) for n in ['SelectReactor',
+                                                  'PollReactor',
+                                                  'EPollReactor']
+                    if hasattr(reactor, n)]
+        self.loop_codes = set([get_code(r._dispatch_loop) for r in reactors])
+        self.dispatch_codes = set([get_code(r._check_timers)
+                                   for r in reactors]) | self.loop_codes
+        self.idle_codes = set([get_code(r._sys_pause) for r in reactors])
+        self.callback_code = get_code(reactor.ReactorCallback.invoke)
+        self.gcode_code = get_code(gcode.GCodeDispatch._invoke_handler)
+        self.webhooks_code = get_code(
+            webhooks.ClientConnection._process_request)
+        self.stepgen_code = get_code(toolhead.ToolHead._generate_steps)
+    def _reset(self):
+        self.sample_time = self.idle_time = 0.
+        self.samples = 0
+        self.activity_time = {}
+        self.gcode_time = {}
+        self.webhooks_time = {}
+        self.stepgen_time = 0.
+        self.stacks = {}
+    def _handle_disconnect(self):
+        self.stop()
+    # Sampling
+    def _sample(self, frame, sample_time):
+        stack = []
+        activity = gcmd = webreq = None
+        stepgen = False
+        child = grandchild = None
+        while frame is not None:
+            code = frame.f_code
+            stack.append(code)
+            if code in self.dispatch_codes:
+                if child is None and code in self.loop_codes:
+                    # Waiting in poll() for the next event
+                    break
+                if activity is None and child is not None:
+                    activity = child
+                    if child is self.callback_code and grandchild is not None:
+                        activity = grandchild
+            elif code is self.gcode_code and gcmd is None:
+                gcmd = frame.f_locals.get('cmd')
+            elif code is self.webhooks_code and webreq is None:
+                wr = frame.f_locals.get('web_request')
+                if wr is not None:
+                    webreq = wr.get_method()
+            elif code is self.stepgen_code:
+                stepgen = True
+            elif code in self.idle_codes:
+                break
+            grandchild = child
+            child = code
+            frame = frame.f_back
+        with self.lock:
+            self.samples += 1
+            self.sample_time += sample_time
+            if frame is not None:
+                self.idle_time += sample_time
+                return
+            stack = tuple(stack)
+            self.stacks[stack] = self.stacks.get(stack, 0.) + sample_time
+            at = self.activity_time
+            at[activity] = at.get(activity, 0.) + sample_time
+            if gcmd is not None:
+                gt = self.gcode_time
+                gt[gcmd] = gt.get(gcmd, 0.) + sample_time
+            if webreq is not None:
+                wt = self.webhooks_time
+                wt[webreq] = wt.get(webreq, 0.) + sample_time
+            if stepgen:
+                self.stepgen_time += sample_time
+    def _sample_thread(self):
+        monotonic = self.printer.get_reactor().monotonic
+        interval = self.interval
+        last_time = monotonic()
+        while not self.stop_event.wait(interval):
+            frame = sys._current_frames().get(self.main_ident)
+            curtime = monotonic()
+            if frame is not None:
+                self._sample(frame, curtime - last_time)
+            del frame
+            last_time = curtime
+    def start(self, interval):
+        if self.sample_thread is not None:
+            return False
+        with self.lock:
+            self._reset()
+        self.interval = interval
+        if hasattr(sys, 'setswitchinterval'):
+            # Let the sampler obtain the GIL at the requested rate
+            self.switch_interval = sys.getswitchinterval()
+            sys.setswitchinterval(min(self.switch_interval, interval))
+        self.stop_event.clear()
+        self.sample_thread = threading.Thread(target=self._sample_thread)
+        self.sample_thread.daemon = True
+        self.sample_thread.start()
+        return True
+    def stop(self):
+        if self.sample_thread is None:
+            return False
+        self.stop_event.set()
+        self.sample_thread.join()
+        self.sample_thread = None
+        if self.switch_interval is not None:
+            sys.setswitchinterval(self.switch_interval)
+            self.switch_interval = None
+        return True
+    # Reporting
+    def _sorted_times(self, times, count=None):
+        res = sorted(times.items(), key=(lambda i: i[1]), reverse=True)
+        if count is not None:
+            res = res[:count]
+        return res
+    def _get_summary(self, count=None):
+        with self.lock:
+            activity = self._sorted_times(self.activity_time, count)
+            gcmds = self._sorted_times(self.gcode_time, count)
+            webreqs = self._sorted_times(self.webhooks_time, count)
+            return {
+                'active': self.sample_thread is not None,
+                'interval': self.interval, 'samples': self.samples,
+                'sample_time': self.sample_time,
+                'busy_time': self.sample_time - self.idle_time,
+                'step_generation': self.stepgen_time,
+                'reactor': {(code_name(c) if c is not None else 'other'): t
+                            for c, t in activity},
+                'gcode': dict(gcmds),
+                'webhooks': dict(webreqs),
+            }
+    def get_status(self, eventtime):
+        return self._get_summary(REPORT_COUNT)
+    def _write_pstats(self, filename):
+        # Produce a dump in the format used by the pstats module
+        def get_key(code):
+            return (code.co_filename, code.co_firstlineno, code.co_name)
+        stats = {}
+        with self.lock:
+            stacks = list(self.stacks.items())
+        for stack, stime in stacks:
+            count = int(round(stime / self.interval)) or 1
+            keys = [get_key(code) for code in stack]
+            seen = set()
+            for i, key in enumerate(keys):
+                st = stats.get(key)
+                if st is None:
+                    st = stats[key] = [0, 0, 0., 0., {}]
+                tt = stime if not i else 0.
+                st[2] += tt
+                if key in seen:
+                    continue
+                seen.add(key)
+                st[0] += count
+                st[1] += count
+                st[3] += stime
+                if i + 1 < len(keys):
+                    callers = st[4]
+                    cs = callers.get(keys[i+1])
+                    if cs is None:
+                        cs = callers[keys[i+1]] = [0, 0, 0., 0.]
+                    cs[0] += count
+                    cs[1] += count
+                    cs[2] += tt
+                    cs[3] += stime
+        out = {}
+        for key, (cc, nc, tt, ct, callers) in stats.items():
+            callers = {ck: tuple(cs) for ck, cs in callers.items()}
+            out[key] = (cc, nc, tt, ct, callers)
+        with open(filename, 'wb') as f:
+            marshal.dump(out, f)
+    def _stop_and_report(self, filename):
+        if not self.stop():
+            raise self.printer.command_error("Profiler is not running")
+        try:
+            self._write_pstats(filename)
+        except (IOError, OSError) as e:
+            logging.exception("Profiler pstats write error")
+            raise self.printer.command_error(
+                "Unable to write profile to '%s'" % (filename,))
+        summary = self._get_summary(REPORT_COUNT)
+        logging.info("Profiler stopped: %d samples over %.3fs (busy %.3fs)",
+                     summary['samples'], summary['sample_time'],
+                     summary['busy_time'])
+        return summary
+    def _format_summary(self, summary, filename):
+        lines = ["Profiler: %d samples over %.3fs busy=%.3fs"
+                 " step_generation=%.3fs (pstats data written to %s)" % (
+                     summary['samples'], summary['sample_time'],
+                     summary['busy_time'], summary['step_generation'],
+                     filename)]
+        for title, key in [("Reactor", 'reactor'), ("G-Code", 'gcode'),
+                           ("Webhooks", 'webhooks')]:
+            times = self._sorted_times(summary[key])
+            if times:
+                lines.append("%s: %s" % (title, " ".join(
+                    ["%s=%.3fs" % (n, t) for n, t in times])))
+        return "\n".join(lines)
+    cmd_PROFILER_START_help = "Start sampling the host software"
+    def cmd_PROFILER_START(self, gcmd):
+        interval = gcmd.get_float('INTERVAL', self.default_interval,
+                                  minval=.0005, maxval=1.)
+        if not self.start(interval):
+            raise gcmd.error("Profiler is already running")
+        gcmd.respond_info("Profiler started")
+    cmd_PROFILER_STOP_help = "Stop the profiler and write its results"
+    def cmd_PROFILER_STOP(self, gcmd):
+        filename = gcmd.get('FILENAME', self.default_filename)
+        summary = self._stop_and_report(filename)
+        gcmd.respond_info(self._format_summary(summary, filename))
+    def _handle_start_request(self, web_request):
+        interval = web_request.get_float('interval', self.default_interval)
+        if interval < .0005 or interval > 1.:
+            raise web_request.error("Invalid interval")
+        if not self.start(interval):
+            raise web_request.error("Profiler is already running")
+    def _handle_stop_request(self, web_request):
+        filename = web_request.get_str('filename', self.default_filename)
+        web_request.send(self._stop_and_report(filename))
+
+def load_config(config):
+    return HostProfiler(config)
@@ -36,6 +36,7 @@ class MCU_pwm_cycle:
                 "PWM pin cycle time too large")
         self._mcu.request_move_queue_slot()
         self._oid = self._mcu.create_oid()
+        self._mcu.register_move_queue_name(self._oid, self._pin)
         self._mcu.add_config_cmd(
             "config_digital_out oid=%d pin=%s value=%d"
             " default_value=%d max_duration=%d"
@@ -3,9 +3,12 @@
 # Copyright (C) 2017-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
+import binascii
 import chelper
 
 MAX_SCHEDULE_TIME = 5.0
+# Number of mcu move queue entries to fill with each pwm stream message
+STREAM_MSG_NODES = 12
 
 class error(Exception):
     pass
@@ -22,14 +25,18 @@ class MCU_queued_pwm:
                                       ffi_lib.stepcompress_free)
         self._mcu.register_stepqueue(self._stepqueue)
         self._stepcompress_queue_mq_msg = ffi_lib.stepcompress_queue_mq_msg
+        self._stepcompress_queue_mq_buffer = (
+            ffi_lib.stepcompress_queue_mq_buffer)
         self._mcu.register_config_callback(self._build_config)
         self._pin = pin_params['pin']
+        self._mcu.register_move_queue_name(self._oid, self._pin)
         self._invert = pin_params['invert']
         self._start_value = self._shutdown_value = float(self._invert)
         self._last_clock = self._last_value = self._default_value = 0
         self._duration_ticks = 0
         self._pwm_max = 0.
-        self._set_cmd_tag = None
+        self._set_cmd_tag = self._stream_cmd_tag = None
+        self._stream_scale = self._stream_node_values = 0
         self._toolhead = None
         printer = self._mcu.get_printer()
         printer.register_event_handler("klippy:connect", self._handle_connect)
@@ -82,6 +89,17 @@ class MCU_queued_pwm:
             self._set_cmd_tag = self._mcu.lookup_command(
                 "queue_pwm_out oid=%c clock=%u value=%hu",
                 cq=cmd_queue).get_command_tag()
+            # Setup support for streams of pwm values
+            self._stream_node_values = self._mcu.get_constants().get(
+                "PWM_STREAM_VALUES", 0)
+            if not self._stream_node_values:
+                return
+            self._stream_scale = int(self._pwm_max * 256. / 255. + 0.5)
+            self._mcu.add_config_cmd("config_pwm_out_stream oid=%d scale=%d"
+                                     % (self._oid, self._stream_scale))
+            self._stream_cmd_tag = self._mcu.lookup_command(
+                "queue_pwm_stream oid=%c clock=%u interval=%u values=%*s",
+                cq=cmd_queue).get_command_tag()
             return
         # Software PWM
         if self._shutdown_value not in [0., 1.]:
@@ -124,6 +142,40 @@ class MCU_queued_pwm:
             value = 1. - value
         v = int(max(0., min(1., value)) * self._pwm_max + 0.5)
         self._send_update(clock, v)
+    def check_pwm_stream(self, interval):
+        if self._stream_cmd_tag is None:
+            raise error("PWM streams require a hardware_pwm pin")
+        ticks = self._mcu.seconds_to_clock(interval)
+        if self._duration_ticks and ticks >= self._duration_ticks:
+            raise error("PWM stream interval exceeds maximum_mcu_duration")
+        if ticks < 1 or ticks >= 1<<31:
+            raise error("Invalid PWM stream interval")
+    def set_pwm_stream(self, print_time, interval, values):
+        # Queue a series of 8-bit (0-255) values spaced 'interval' apart
+        clock = self._mcu.print_time_to_clock(print_time)
+        clock = max(self._last_clock, clock)
+        ticks = self._mcu.seconds_to_clock(interval)
+        if self._invert:
+            values = [255 - v for v in values]
+        nv = self._stream_node_values
+        for i in range(0, len(values), STREAM_MSG_NODES * nv):
+            chunk = values[i:i + STREAM_MSG_NODES * nv]
+            last_clock = clock + ticks * (len(chunk) - 1)
+            data = (self._stream_cmd_tag, self._oid, clock & 0xffffffff,
+                    ticks)
+            ret = self._stepcompress_queue_mq_buffer(
+                self._stepqueue, clock, last_clock, (len(chunk) + nv - 1) // nv,
+                data, len(data), chunk, len(chunk))
+            if ret:
+                raise error("Internal error in stepcompress")
+            clock = last_clock + ticks
+        self._last_clock = last_clock
+        self._last_value = (values[-1] * self._stream_scale) >> 8
+        wakeclock = last_clock
+        if self._last_value != self._default_value:
+            wakeclock += self._duration_ticks
+        wake_print_time = self._mcu.clock_to_print_time(wakeclock)
+        self._toolhead.note_mcu_movequeue_activity(wake_print_time)
     def _flush_notification(self, print_time, clock):
         if self._last_value != self._default_value:
             while clock >= self._last_clock + self._duration_ticks:
@@ -160,6 +212,9 @@ class PrinterOutputPin:
         gcode.register_mux_command("SET_PIN", "PIN", pin_name,
                                    self.cmd_SET_PIN,
                                    desc=self.cmd_SET_PIN_help)
+        gcode.register_mux_command("SET_PIN_STREAM", "PIN", pin_name,
+                                   self.cmd_SET_PIN_STREAM,
+                                   desc=self.cmd_SET_PIN_STREAM_help)
     def get_status(self, eventtime):
         return {'value': self.last_value}
     def _set_pin(self, print_time, value):
@@ -179,5 +234,31 @@ class PrinterOutputPin:
         toolhead.register_lookahead_callback(
             lambda print_time: self._set_pin(print_time, value))
 
+    def _set_pin_stream(self, print_time, interval, values):
+        print_time = max(print_time, self.last_print_time)
+        self.mcu_pin.set_pwm_stream(print_time, interval, values)
+        self.last_value = values[-1] / 255.
+        self.last_print_time = print_time + interval * (len(values) - 1)
+    cmd_SET_PIN_STREAM_help = "Set a series of values at a fixed interval"
+    def cmd_SET_PIN_STREAM(self, gcmd):
+        interval = gcmd.get_float('INTERVAL', above=0.,
+                                  maxval=MAX_SCHEDULE_TIME)
+        data = gcmd.get('VALUES')
+        try:
+            values = list(bytearray(binascii.unhexlify(data)))
+        except (TypeError, ValueError):
+            raise gcmd.error("Invalid VALUES '%s'" % (data,))
+        if not values:
+            raise gcmd.error("No VALUES specified")
+        try:
+            self.mcu_pin.check_pwm_stream(interval)
+        except error as e:
+            raise gcmd.error(str(e))
+        # Obtain print_time and apply requested settings
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_lookahead_callback(
+            lambda print_time: self._set_pin_stream(print_time, interval,
+                                                    values))
+
 def load_config_prefix(config):
     return PrinterOutputPin(config)
@@ -1,9 +1,10 @@
 # A utility class to test resonances of the printer
 #
-# Copyright (C) 2020-2024  Dmitry Butyugin <dmbutyugin@google.com>
+# Copyright (C) 2020-2026  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, os, time
+import mcu
 from . import shaper_calibrate
 
 class TestAxis:
@@ -76,6 +77,9 @@ class VibrationPulseTestGenerator:
             freq += 2. * t_seg * self.test_hz_per_sec
             sign = -sign
         return res
+    def get_sweep_params(self):
+        return (self.freq_start, self.freq_end, self.test_accel_per_hz,
+                self.test_hz_per_sec)
     def get_max_freq(self):
         return self.freq_end
 
@@ -117,14 +121,88 @@ class SweepingVibrationsTestGenerator:
             res.append((next_t, accel + sweeping_accel * sig, freq))
             last_t = next_t
         return res
+    def get_sweep_params(self):
+        return self.vibration_generator.get_sweep_params()
     def get_max_freq(self):
         return self.vibration_generator.get_max_freq()
 
+# Minimum frequency range of a test that excites several axes at once
+MIN_INTERLEAVED_FREQ_RANGE = 40.
+# Duration of the vibrations of one axis before switching to the next one
+INTERLEAVED_BURST_TIME = 0.1
+
+class InterleavedVibrationsTestGenerator:
+    # Excite several axes during one test by alternating short bursts of
+    # vibrations between the axes.  The toolhead only changes the axis
+    # when it is at rest.  Each axis sweeps through the whole frequency
+    # range, but each starts at a different offset in the range (and
+    # wraps around at its end), so that the responses of the axes can
+    # be separated by frequency during the analysis.
+    def __init__(self, config):
+        self.vibration_generator = VibrationPulseTestGenerator(config)
+    def prepare_test(self, gcmd):
+        vg = self.vibration_generator
+        vg.prepare_test(gcmd)
+        if vg.freq_end - vg.freq_start < MIN_INTERLEAVED_FREQ_RANGE:
+            raise gcmd.error("Testing several axes at once requires a"
+                             " frequency range of at least %.0f Hz"
+                             % (MIN_INTERLEAVED_FREQ_RANGE,))
+    def gen_test(self, num_axes):
+        vg = self.vibration_generator
+        freq_range = vg.freq_end - vg.freq_start
+        # Each axis is only excited during every num_axes-th burst, so
+        # the frequency advances faster to keep the test duration of a
+        # single axis test
+        hz_per_sec = vg.test_hz_per_sec * num_axes
+        swept = [0.] * num_axes
+        signs = [1.] * num_axes
+        schedules = [([], []) for i in range(num_axes)]
+        res = []
+        time = 0.
+        axis_index = 0
+        while min(swept) <= freq_range + 0.000001:
+            if swept[axis_index] > freq_range + 0.000001:
+                axis_index = (axis_index + 1) % num_axes
+                continue
+            burst_end_time = time + INTERLEAVED_BURST_TIME
+            while (time < burst_end_time
+                   and swept[axis_index] <= freq_range + 0.000001):
+                offset = axis_index * freq_range / num_axes
+                freq = offset + swept[axis_index]
+                if freq > freq_range + 0.000001:
+                    freq -= freq_range
+                freq += vg.freq_start
+                schedules[axis_index][0].append(time)
+                schedules[axis_index][1].append(freq)
+                t_seg = .25 / freq
+                accel = vg.test_accel_per_hz * freq
+                sign = signs[axis_index]
+                time += t_seg
+                res.append((time, sign * accel, freq, axis_index))
+                time += t_seg
+                res.append((time, -sign * accel, freq, axis_index))
+                swept[axis_index] += 2. * t_seg * hz_per_sec
+                signs[axis_index] = -sign
+            axis_index = (axis_index + 1) % num_axes
+        return res, schedules, time
+    def get_max_freq_offset(self, num_axes):
+        # Up to half of the distance to the frequency of the other axes
+        vg = self.vibration_generator
+        return .5 * (vg.freq_end - vg.freq_start) / num_axes
+
 class ResonanceTestExecutor:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.gcode = self.printer.lookup_object('gcode')
     def run_test(self, test_seq, axis, gcmd):
+        self._run_moves([(t, accel, freq, axis)
+                         for t, accel, freq in test_seq], gcmd)
+    def run_interleaved_test(self, test_seq, axes, gcmd, start_cb):
+        # The axis index of each test step selects the vibration axis
+        self._run_moves([(t, accel, freq, axes[axis_index])
+                         for t, accel, freq, axis_index in test_seq],
+                        gcmd, start_cb)
+    def _run_moves(self, test_seq, gcmd, start_cb=None):
         reactor = self.printer.get_reactor()
         toolhead = self.printer.lookup_object('toolhead')
         X, Y, Z, E = toolhead.get_position()
@@ -134,7 +212,7 @@ class ResonanceTestExecutor:
         toolhead_info = toolhead.get_status(systime)
         old_max_accel = toolhead_info['max_accel']
         old_minimum_cruise_ratio = toolhead_info['minimum_cruise_ratio']
-        max_accel = max([abs(a) for _, a, _ in test_seq])
+        max_accel = max([abs(a) for _, a, _, _ in test_seq])
         self.gcode.run_script_from_command(
             "SET_VELOCITY_LIMIT ACCEL=%.3f MINIMUM_CRUISE_RATIO=0"
             % (max_accel,))
@@ -144,8 +222,10 @@ class ResonanceTestExecutor:
             gcmd.respond_info("Disabled [input_shaper] for resonance testing")
         else:
             input_shaper = None
+        if start_cb is not None:
+            start_cb(toolhead.get_last_move_time())
         last_v = last_t = last_accel = last_freq = 0.
-        for next_t, accel, freq in test_seq:
+        for next_t, accel, freq, axis in test_seq:
             t_seg = next_t - last_t
             toolhead.cmd_M204(self.gcode.create_gcode_command(
                 "M204", "M204", {"S": abs(accel)}))
@@ -170,14 +250,16 @@ class ResonanceTestExecutor:
                 toolhead.move([nX, nY, Z, E], abs_v)
             else:
                 toolhead.move([nX, nY, Z, E], max(abs_v, abs_last_v))
-            if math.floor(freq) > math.floor(last_freq):
+            if axis is test_seq[0][3] and (math.floor(freq)
+                                           > math.floor(last_freq)):
                 gcmd.respond_info("Testing frequency %.0f Hz" % (freq,))
                 reactor.pause(reactor.monotonic() + 0.01)
             X, Y = nX, nY
             last_t = next_t
             last_v = v
             last_accel = accel
-            last_freq = freq
+            if axis is test_seq[0][3]:
+                last_freq = freq
         if last_v:
             d_decel = -.5 * last_v2 / old_max_accel
             decel_X, decel_Y = axis.get_point(d_decel)
@@ -193,12 +275,197 @@ class ResonanceTestExecutor:
             input_shaper.enable_shaping()
             gcmd.respond_info("Re-enabled [input_shaper]")
 
+# Rate at which the mcu updates the position of a vibration
+MCU_EXCITATION_RATE = 20000.
+# Maximum duration of a single frequency sweep segment sent to the mcu
+MCU_EXCITATION_SEGMENT_TIME = 0.5
+# Duration of the ramp of the amplitude at the start and end of a test
+MCU_EXCITATION_RAMP_TIME = 0.5
+# Time between the setup of a vibration and its start on the mcu
+MCU_EXCITATION_START_DELAY = 0.100
+# How far ahead of the mcu the segments of a vibration are queued
+MCU_EXCITATION_QUEUE_TIME = 1.0
+MCU_EXCITATION_MAX_STEPPERS = 4
+MCU_EXCITATION_MAX_AMPLITUDE = 15.
+
+class MCUResonanceTestExecutor:
+    # Vibrate the toolhead with a sine wave frequency sweep that is
+    # generated on the mcu.  The host only sends one command per sweep
+    # segment and the steppers are stopped by a trsync if the host
+    # stops responding.
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.mcu = self.trigger_dispatch = None
+        self.steppers = []
+        self.oid = self.rate = None
+        self.set_stepper_cmd = self.segment_cmd = self.query_cmd = None
+        self.printer.register_event_handler("klippy:mcu_identify",
+                                            self._handle_mcu_identify)
+    def _handle_mcu_identify(self):
+        kin = self.printer.lookup_object('toolhead').get_kinematics()
+        self.steppers = [s for s in kin.get_steppers()
+                         if s.is_active_axis('x') or s.is_active_axis('y')]
+        mcus = set([s.get_mcu() for s in self.steppers])
+        if len(mcus) != 1:
+            raise self.printer.config_error(
+                "resonance_tester excitation: mcu requires all x and y"
+                " steppers to be on a single mcu")
+        if len(self.steppers) > MCU_EXCITATION_MAX_STEPPERS:
+            raise self.printer.config_error(
+                "resonance_tester excitation: mcu supports at most %d"
+                " x and y steppers" % (MCU_EXCITATION_MAX_STEPPERS,))
+        self.mcu = mcus.pop()
+        self.oid = self.mcu.create_oid()
+        self.trigger_dispatch = mcu.TriggerDispatch(self.mcu)
+        for s in self.steppers:
+            self.trigger_dispatch.add_stepper(s)
+        self.mcu.register_config_callback(self._build_config)
+    def _build_config(self):
+        segment_fmt = ("stepper_vibrate_segment oid=%c clock=%u count=%u"
+                       " phase_add=%u phase_add2=%i amplitude=%u"
+                       " amplitude_add=%i")
+        if self.mcu.try_lookup_command(segment_fmt) is None:
+            raise self.printer.config_error(
+                "mcu '%s' does not support resonance_tester excitation: mcu"
+                % (self.mcu.get_name(),))
+        rest_ticks = self.mcu.seconds_to_clock(1. / MCU_EXCITATION_RATE)
+        self.rate = self.mcu.seconds_to_clock(1.) / float(rest_ticks)
+        self.mcu.add_config_cmd("config_stepper_vibrate oid=%d rest_ticks=%d"
+                                % (self.oid, rest_ticks))
+        cq = self.mcu.alloc_command_queue()
+        self.set_stepper_cmd = self.mcu.lookup_command(
+            "stepper_vibrate_set_stepper oid=%c index=%c stepper_oid=%c"
+            " scale=%i", cq=cq)
+        self.segment_cmd = self.mcu.lookup_command(segment_fmt, cq=cq)
+        self.query_cmd = self.mcu.lookup_query_command(
+            "query_stepper_vibrate oid=%c",
+            "stepper_vibrate_state oid=%c active=%c", oid=self.oid, cq=cq)
+    def _gen_segments(self, freq_start, freq_end, accel_per_hz, hz_per_sec):
+        # The amplitude of each frequency is chosen to reach a peak
+        # acceleration of accel_per_hz * freq
+        def amplitude(freq):
+            return accel_per_hz / (4. * math.pi**2 * freq)
+        ramp = MCU_EXCITATION_RAMP_TIME
+        res = [(ramp, freq_start, freq_start, 0., amplitude(freq_start))]
+        freq = freq_start
+        while freq < freq_end - 0.000001:
+            next_freq = min(freq + MCU_EXCITATION_SEGMENT_TIME * hz_per_sec,
+                            freq_end)
+            res.append(((next_freq - freq) / hz_per_sec, freq, next_freq,
+                        amplitude(freq), amplitude(next_freq)))
+            freq = next_freq
+        res.append((ramp, freq_end, freq_end, amplitude(freq_end), 0.))
+        return res
+    def _calc_scales(self, axis, accel_per_hz, gcmd):
+        # Steps per mm of toolhead movement along the axis (in 1/2^16 steps)
+        toolhead = self.printer.lookup_object('toolhead')
+        pos = toolhead.get_position()
+        delta = .001
+        dX, dY = axis.get_point(delta)
+        max_rate = accel_per_hz / (2. * math.pi)
+        scales = []
+        for s in self.steppers:
+            start = s.calc_position_from_coord(pos)
+            end = s.calc_position_from_coord([pos[0] + dX, pos[1] + dY,
+                                              pos[2]])
+            steps_per_mm = (end - start) / (delta * s.get_step_dist())
+            if s.get_dir_inverted()[0]:
+                steps_per_mm = -steps_per_mm
+            if abs(steps_per_mm) * max_rate > self.rate * .25:
+                raise gcmd.error("Stepper '%s' step rate too high for"
+                                 " excitation on the mcu" % (s.get_name(),))
+            scales.append(int(round(steps_per_mm * 65536.)))
+        return scales
+    def run_test(self, sweep_params, axis, gcmd):
+        freq_start, freq_end, accel_per_hz, hz_per_sec = sweep_params
+        segments = self._gen_segments(freq_start, freq_end, accel_per_hz,
+                                      hz_per_sec)
+        if segments[0][4] > MCU_EXCITATION_MAX_AMPLITUDE:
+            raise gcmd.error("Vibration amplitude %.3fmm too large for"
+                             " excitation on the mcu" % (segments[0][4],))
+        scales = self._calc_scales(axis, accel_per_hz, gcmd)
+        reactor = self.printer.get_reactor()
+        toolhead = self.printer.lookup_object('toolhead')
+        is_fileoutput = self.mcu.is_fileoutput()
+        if not is_fileoutput and self.query_cmd.send([self.oid])['active']:
+            raise gcmd.error("Vibration on the mcu already in progress")
+        # Start the trsync that stops the steppers on a host failure
+        toolhead.flush_step_generation()
+        kin = toolhead.get_kinematics()
+        kin_spos = {s.get_name(): s.get_commanded_position()
+                    for s in kin.get_steppers()}
+        start_mcu_pos = [s.get_mcu_position() for s in self.steppers]
+        print_time = toolhead.get_last_move_time()
+        self.trigger_dispatch.start(print_time)
+        for i, (s, scale) in enumerate(zip(self.steppers, scales)):
+            self.set_stepper_cmd.send([self.oid, i, s.get_oid(), scale])
+        # Send the sweep segments (converting to the mcu fixed point units)
+        start_time = print_time + MCU_EXCITATION_START_DELAY
+        seg_time = start_time
+        ticks = 0
+        phase_add = amplitude = None
+        last_freq = 0.
+        for duration, seg_freq_start, seg_freq_end, amp_start, amp_end in (
+                segments):
+            count = max(1, int(duration * self.rate + .5))
+            if phase_add is None:
+                phase_add = int(seg_freq_start * 2.**32 / self.rate + .5)
+                amplitude = int(amp_start * 2.**28 + .5)
+            end_phase_add = int(seg_freq_end * 2.**32 / self.rate + .5)
+            end_amplitude = int(amp_end * 2.**28 + .5)
+            phase_add2 = int(round(float(end_phase_add - phase_add) / count))
+            # Round up so the amplitude never drops below its end value
+            amplitude_add = -((amplitude - end_amplitude) // count)
+            if not is_fileoutput:
+                systime = reactor.monotonic()
+                queue_time = seg_time - self.mcu.estimated_print_time(systime)
+                if queue_time > MCU_EXCITATION_QUEUE_TIME:
+                    reactor.pause(systime + queue_time
+                                  - MCU_EXCITATION_QUEUE_TIME)
+            clock = self.mcu.print_time_to_clock(seg_time)
+            self.segment_cmd.send([self.oid, clock, count,
+                                   phase_add, phase_add2, amplitude,
+                                   amplitude_add])
+            if math.floor(seg_freq_start) > math.floor(last_freq):
+                gcmd.respond_info("Testing frequency %.0f Hz"
+                                  % (seg_freq_start,))
+            last_freq = seg_freq_start
+            phase_add += phase_add2 * count
+            amplitude += amplitude_add * count
+            ticks += count
+            seg_time = start_time + ticks / self.rate
+        # Wait for the vibration to complete
+        end_time = seg_time + MCU_EXCITATION_START_DELAY
+        toolhead.dwell(end_time - print_time)
+        self.trigger_dispatch.wait_end(end_time)
+        res = self.trigger_dispatch.stop()
+        if res >= mcu.MCU_trsync.REASON_COMMS_TIMEOUT:
+            raise gcmd.error("Communication timeout during resonance test")
+        # Verify that the steppers returned to their start position
+        end_mcu_pos = [s.get_mcu_position() for s in self.steppers]
+        if end_mcu_pos != start_mcu_pos:
+            for s, start_pos, end_pos in zip(self.steppers, start_mcu_pos,
+                                             end_mcu_pos):
+                kin_spos[s.get_name()] += ((end_pos - start_pos)
+                                           * s.get_step_dist())
+            thpos = toolhead.get_position()
+            toolhead.set_position(list(kin.calc_position(kin_spos))[:3]
+                                  + thpos[3:])
+            raise gcmd.error("Resonance test vibration on the mcu was"
+                             " interrupted")
+
 class ResonanceTester:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.move_speed = config.getfloat('move_speed', 50., above=0.)
         self.generator = SweepingVibrationsTestGenerator(config)
+        self.interleaved_generator = InterleavedVibrationsTestGenerator(config)
         self.executor = ResonanceTestExecutor(config)
+        self.excitation = config.getchoice('excitation', ['host', 'mcu'],
+                                           'host')
+        self.mcu_executor = None
+        if self.excitation == 'mcu':
+            self.mcu_executor = MCUResonanceTestExecutor(config)
         if not config.get('accel_chip_x', None):
             self.accel_chip_names = [('xy', config.get('accel_chip').strip())]
         else:
@@ -229,11 +496,27 @@ class ResonanceTester:
                 for chip_axis, chip_name in self.accel_chip_names]
 
     def _run_test(self, gcmd, axes, helper, raw_name_suffix=None,
-                  accel_chips=None, test_point=None):
+                  accel_chips=None, test_point=None, raw_format='csv',
+                  simultaneous=False):
         toolhead = self.printer.lookup_object('toolhead')
         calibration_data = {axis: None for axis in axes}
 
         self.generator.prepare_test(gcmd)
+        excitation = gcmd.get("EXCITATION", self.excitation).lower()
+        if excitation not in ['host', 'mcu']:
+            raise gcmd.error("Invalid EXCITATION parameter")
+        if excitation == 'mcu':
+            if self.mcu_executor is None:
+                raise gcmd.error("EXCITATION=mcu requires 'excitation: mcu'"
+                                 " in the [resonance_tester] config section")
+            if simultaneous:
+                raise gcmd.error("EXCITATION=mcu does not support testing"
+                                 " several axes at once")
+        if simultaneous:
+            self.interleaved_generator.prepare_test(gcmd)
+            axis_groups = [axes]
+        else:
+            axis_groups = [[axis] for axis in axes]
 
         test_points = [test_point] if test_point else self.probe_points
 
@@ -242,49 +525,88 @@ class ResonanceTester:
             if len(test_points) > 1 or test_point is not None:
                 gcmd.respond_info(
                         "Probing point (%.3f, %.3f, %.3f)" % tuple(point))
-            for axis in axes:
+            for group in axis_groups:
+                axis = group[0]
                 toolhead.wait_moves()
                 toolhead.dwell(0.500)
-                if len(axes) > 1:
+                if len(group) > 1:
+                    gcmd.respond_info("Testing axes %s at once" % (
+                        ", ".join([a.get_name() for a in group]),))
+                elif len(axes) > 1:
                     gcmd.respond_info("Testing axis %s" % axis.get_name())
 
                 raw_values = []
                 if accel_chips is None:
                     for chip_axis, chip in self.accel_chips:
-                        if axis.matches(chip_axis):
+                        chip_axes = [a for a in group if a.matches(chip_axis)]
+                        if chip_axes:
                             aclient = chip.start_internal_client()
-                            raw_values.append((chip_axis, aclient, chip.name))
+                            raw_values.append((chip_axes, aclient, chip.name))
                 else:
                     for chip in accel_chips:
                         aclient = chip.start_internal_client()
-                        raw_values.append((axis, aclient, chip.name))
-
+                        raw_values.append((group, aclient, chip.name))
                 # Generate moves
-                test_seq = self.generator.gen_test()
-                self.executor.run_test(test_seq, axis, gcmd)
-                for chip_axis, aclient, chip_name in raw_values:
+                if len(group) > 1:
+                    test_seq, schedules, duration = (
+                            self.interleaved_generator.gen_test(len(group)))
+                    max_freq_offset = (
+                            self.interleaved_generator.get_max_freq_offset(
+                                len(group)))
+                elif excitation == 'host':
+                    test_seq = self.generator.gen_test()
+                # Calculate the frequency response while the test runs
+                accumulators = {}
+                if helper is not None:
+                    for chip_axes, aclient, chip_name in raw_values:
+                        if len(group) > 1:
+                            accum = helper.create_psd_accumulator(
+                                    [schedules[group.index(a)]
+                                     for a in chip_axes], max_freq_offset)
+                        else:
+                            accum = helper.create_psd_accumulator()
+                        aclient.stream_to(accum,
+                                          keep_msgs=raw_name_suffix is not None)
+                        accumulators[aclient] = accum
+
+                if len(group) > 1:
+                    def start_test(print_time):
+                        for accum in accumulators.values():
+                            accum.set_test_time(print_time, duration)
+                    self.executor.run_interleaved_test(test_seq, group, gcmd,
+                                                       start_test)
+                elif excitation == 'mcu':
+                    self.mcu_executor.run_test(
+                            self.generator.get_sweep_params(), axis, gcmd)
+                else:
+                    self.executor.run_test(test_seq, axis, gcmd)
+                for chip_axes, aclient, chip_name in raw_values:
                     aclient.finish_measurements()
                     if raw_name_suffix is not None:
                         raw_name = self.get_filename(
                                 'raw_data', raw_name_suffix, axis,
                                 point if len(test_points) > 1 else None,
-                                chip_name if accel_chips is not None else None,)
-                        aclient.write_to_file(raw_name)
+                                chip_name if accel_chips is not None else None,
+                                ext=shaper_calibrate.RAW_DATA_FORMATS[
+                                    raw_format])
+                        aclient.write_to_file(raw_name, raw_format)
                         gcmd.respond_info(
                                 "Writing raw accelerometer data to "
                                 "%s file" % (raw_name,))
                 if helper is None:
                     continue
-                for chip_axis, aclient, chip_name in raw_values:
+                for chip_axes, aclient, chip_name in raw_values:
                     if not aclient.has_valid_samples():
                         raise gcmd.error(
                             "accelerometer '%s' measured no data" % (
                                 chip_name,))
-                    new_data = helper.process_accelerometer_data(aclient)
-                    if calibration_data[axis] is None:
-                        calibration_data[axis] = new_data
-                    else:
-                        calibration_data[axis].add_data(new_data)
+                    for i, chip_axis in enumerate(chip_axes):
+                        new_data = helper.process_accelerometer_data(
+                            accumulators[aclient], i)
+                        if calibration_data[chip_axis] is None:
+                            calibration_data[chip_axis] = new_data
+                        else:
+                            calibration_data[chip_axis].add_data(new_data)
         return calibration_data
     def _parse_chips(self, accel_chips):
         parsed_chips = []
@@ -324,6 +646,9 @@ class ResonanceTester:
         name_suffix = gcmd.get("NAME", time.strftime("%Y%m%d_%H%M%S"))
         if not self.is_valid_name_suffix(name_suffix):
             raise gcmd.error("Invalid NAME parameter")
+        raw_format = gcmd.get("RAW_FORMAT", "csv").lower()
+        if raw_format not in shaper_calibrate.RAW_DATA_FORMATS:
+            raise gcmd.error("Invalid RAW_FORMAT parameter")
         csv_output = 'resonances' in outputs
         raw_output = 'raw_data' in outputs
 
@@ -336,7 +661,8 @@ class ResonanceTester:
         data = self._run_test(
                 gcmd, [axis], helper,
                 raw_name_suffix=name_suffix if raw_output else None,
-                accel_chips=accel_chips, test_point=test_point)[axis]
+                accel_chips=accel_chips, test_point=test_point,
+                raw_format=raw_format)[axis]
         if csv_output:
             csv_name = self.save_calibration_data(
                     'resonances', name_suffix, helper, axis, data,
@@ -354,6 +680,7 @@ class ResonanceTester:
             raise gcmd.error("Unsupported axis '%s'" % (axis,))
         else:
             calibrate_axes = [TestAxis(axis.lower())]
+        simultaneous = gcmd.get_int("SIMULTANEOUS", 0, minval=0, maxval=1)
         chips_str = gcmd.get("CHIPS", None)
         accel_chips = self._parse_chips(chips_str) if chips_str else None
 
@@ -369,8 +696,9 @@ class ResonanceTester:
         # Setup shaper calibration
         helper = shaper_calibrate.ShaperCalibrate(self.printer)
 
-        calibration_data = self._run_test(gcmd, calibrate_axes, helper,
-                                          accel_chips=accel_chips)
+        calibration_data = self._run_test(
+                gcmd, calibrate_axes, helper, accel_chips=accel_chips,
+                simultaneous=simultaneous and len(calibrate_axes) > 1)
 
         configfile = self.printer.lookup_object('configfile')
         for axis in calibrate_axes:
@@ -408,18 +736,21 @@ class ResonanceTester:
         "Measures noise of all enabled accelerometer chips")
     def cmd_MEASURE_AXES_NOISE(self, gcmd):
         meas_time = gcmd.get_float("MEAS_TIME", 2.)
-        raw_values = [(chip_axis, chip.start_internal_client())
+        helper = shaper_calibrate.ShaperCalibrate(self.printer)
+        raw_values = [(chip_axis, chip.start_internal_client(),
+                       helper.create_psd_accumulator())
                       for chip_axis, chip in self.accel_chips]
+        for chip_axis, aclient, accum in raw_values:
+            aclient.stream_to(accum)
         self.printer.lookup_object('toolhead').dwell(meas_time)
-        for chip_axis, aclient in raw_values:
+        for chip_axis, aclient, accum in raw_values:
             aclient.finish_measurements()
-        helper = shaper_calibrate.ShaperCalibrate(self.printer)
-        for chip_axis, aclient in raw_values:
+        for chip_axis, aclient, accum in raw_values:
             if not aclient.has_valid_samples():
                 raise gcmd.error(
                         "%s-axis accelerometer measured no data" % (
                             chip_axis,))
-            data = helper.process_accelerometer_data(aclient)
+            data = helper.process_accelerometer_data(accum)
             vx = data.psd_x.mean()
             vy = data.psd_y.mean()
             vz = data.psd_z.mean()
@@ -431,7 +762,7 @@ class ResonanceTester:
         return name_suffix.replace('-', '').replace('_', '').isalnum()
 
     def get_filename(self, base, name_suffix, axis=None,
-                     point=None, chip_name=None):
+                     point=None, chip_name=None, ext=".csv"):
         name = base
         if axis:
             name += '_' + axis.get_name()
@@ -440,7 +771,7 @@ class ResonanceTester:
         if point:
             name += "_%.3f_%.3f_%.3f" % (point[0], point[1], point[2])
         name += '_' + name_suffix
-        return os.path.join("/tmp", name + ".csv")
+        return os.path.join("/tmp", name + ext)
 
     def save_calibration_data(self, base_name, name_suffix, shaper_calibrate,
                               axis, calibration_data,
@@ -22,9 +22,9 @@ class HostResponder:
                                                'echo')
         self.default_prefix = config.get('default_prefix', self.default_prefix)
         gcode = self.printer.lookup_object('gcode')
-        gcode.register_command('M118', self.cmd_M118, True)
+        gcode.register_command('M118', self.cmd_M118, True, auxiliary=True)
         gcode.register_command('RESPOND', self.cmd_RESPOND, True,
-                               desc=self.cmd_RESPOND_help)
+                               desc=self.cmd_RESPOND_help, auxiliary=True)
     def cmd_M118(self, gcmd):
         msg = gcmd.get_raw_command_parameters()
         gcmd.respond_raw("%s %s" % (self.default_prefix, msg))
@@ -1,10 +1,10 @@
 # Save arbitrary variables so that values can be kept across restarts.
 #
 # Copyright (C) 2020 Dushyant Ahuja <dusht.ahuja@gmail.com>
-# Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, ast, configparser
+import os, logging, ast, configparser, threading
 
 class SaveVariables:
     def __init__(self, config):
@@ -17,9 +17,19 @@ class SaveVariables:
             self.loadVariables()
         except self.printer.command_error as e:
             raise config.error(str(e))
+        # Background writing of the variables file
+        self.cond = threading.Condition()
+        self.pending_write = None
+        self.must_stop = False
+        self.background_thread = threading.Thread(target=self._bg_thread)
+        self.background_thread.daemon = True
+        self.background_thread.start()
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command('SAVE_VARIABLE', self.cmd_SAVE_VARIABLE,
-                               desc=self.cmd_SAVE_VARIABLE_help)
+                               desc=self.cmd_SAVE_VARIABLE_help,
+                               auxiliary=True)
     def loadVariables(self):
         allvars = {}
         varfile = configparser.ConfigParser()
@@ -33,6 +43,40 @@ class SaveVariables:
             logging.exception(msg)
             raise self.printer.command_error(msg)
         self.allVariables = allvars
+    # Variable file writing (from background thread)
+    def _write_file(self, varfile):
+        tmpname = self.filename + ".tmp"
+        try:
+            f = open(tmpname, "w")
+            varfile.write(f)
+            f.flush()
+            os.fsync(f.fileno())
+            f.close()
+            os.rename(tmpname, self.filename)
+        except:
+            msg = "Unable to save variables to '%s'" % (self.filename,)
+            logging.exception(msg)
+            reactor = self.printer.get_reactor()
+            gcode = self.printer.lookup_object('gcode')
+            reactor.register_async_callback(
+                (lambda e: gcode.respond_info("!! " + msg)))
+    def _bg_thread(self):
+        while 1:
+            with self.cond:
+                while self.pending_write is None and not self.must_stop:
+                    self.cond.wait()
+                varfile = self.pending_write
+                self.pending_write = None
+            if varfile is None:
+                return
+            # Only the latest requested contents are written
+            self._write_file(varfile)
+    def _handle_disconnect(self):
+        # Flush pending writes
+        with self.cond:
+            self.must_stop = True
+            self.cond.notify()
+        self.background_thread.join()
     cmd_SAVE_VARIABLE_help = "Save arbitrary variables to disk"
     def cmd_SAVE_VARIABLE(self, gcmd):
         varname = gcmd.get('VARIABLE')
@@ -42,21 +86,19 @@ class SaveVariables:
         except ValueError as e:
             raise gcmd.error("Unable to parse '%s' as a literal" % (value,))
         newvars = dict(self.allVariables)
-        newvars[varname] = value
-        # Write file
+        newvars[varname.lower()] = value
+        # Queue the file write
         varfile = configparser.ConfigParser()
         varfile.add_section('Variables')
-        for name, val in sorted(newvars.items()):
-            varfile.set('Variables', name, repr(val))
         try:
-            f = open(self.filename, "w")
-            varfile.write(f)
-            f.close()
-        except:
-            msg = "Unable to save variable"
-            logging.exception(msg)
-            raise gcmd.error(msg)
-        self.loadVariables()
+            for name, val in sorted(newvars.items()):
+                varfile.set('Variables', name, repr(val))
+        except ValueError as e:
+            raise gcmd.error("Unable to save variable: %s" % (str(e),))
+        self.allVariables = newvars
+        with self.cond:
+            self.pending_write = varfile
+            self.cond.notify()
     def get_status(self, eventtime):
         return {'variables': self.allVariables}
 
@@ -1,15 +1,22 @@
 # Automatic calibration of input shapers
 #
-# Copyright (C) 2020-2024  Dmitry Butyugin <dmbutyugin@google.com>
+# Copyright (C) 2020-2026  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import collections, importlib, logging, math, multiprocessing, traceback
+import array, collections, importlib, json, logging, math, multiprocessing
+import sys, traceback
 shaper_defs = importlib.import_module('.shaper_defs', 'extras')
 
 MIN_FREQ = 5.
 MAX_FREQ = 200.
 WINDOW_T_SEC = 0.5
+# Measurement time used to estimate the sampling rate of streamed data
+STREAM_RATE_T_SEC = 1.
 MAX_SHAPER_FREQ = 150.
+# Number of shaper frequencies evaluated at once while fitting a shaper
+FIT_CHUNK_SIZE = 64
+# Acceleration used to compare the smoothing of the shapers
+SMOOTHING_TEST_ACCEL = 5000.
 
 TEST_DAMPING_RATIOS=[0.075, 0.1, 0.15]
 
@@ -55,6 +62,143 @@ class CalibrationData:
         return self._psd_map[axis]
 
 
+# Calculate the power spectral density of accelerometer samples as
+# they arrive (using the same windows as ShaperCalibrate._psd()) so
+# that only one window of samples needs to be kept in memory
+class PSDAccumulator:
+    def __init__(self, helper):
+        self.helper = helper
+        self.numpy = helper.numpy
+        self.pending = None
+        self.nfft = self.window = None
+        self.psd_sums = None
+        self.window_count = 0
+        self.sample_count = 0
+        self.first_time = self.last_time = None
+    def has_samples(self):
+        return self.sample_count > 0
+    def add_samples(self, data, start_time, end_time=None):
+        np = self.numpy
+        data = np.array(data)
+        if not len(data):
+            return
+        times = data[:,0]
+        keep = times >= start_time
+        if end_time is not None:
+            keep &= times <= end_time
+        data = data[keep]
+        if not len(data):
+            return
+        if self.first_time is None:
+            self.first_time = data[0,0]
+        self.last_time = data[-1,0]
+        self.sample_count += len(data)
+        if self.pending is not None:
+            data = np.concatenate((self.pending, data))
+        self.pending = data
+        if self.nfft is None:
+            if self.last_time - self.first_time < STREAM_RATE_T_SEC:
+                return
+            self._setup_window()
+        self._process_windows()
+    def _setup_window(self):
+        sampling_freq = self.sample_count / (self.last_time - self.first_time)
+        # Round up to the nearest power of 2 for faster FFT
+        self.nfft = 1 << int(sampling_freq * WINDOW_T_SEC - 1).bit_length()
+        self.window = self.numpy.kaiser(self.nfft, 6.)
+        self.psd_sums = [[0., 0., 0.]]
+    def _get_masks(self, window_times):
+        # All frequencies of every window contribute to the response
+        return [None]
+    def _process_windows(self):
+        x = self.pending
+        nfft = self.nfft
+        overlap = nfft // 2
+        step = nfft - overlap
+        n_windows = (x.shape[0] - overlap) // step
+        if n_windows <= 0:
+            return
+        masks = self._get_masks(x[overlap:n_windows*step+overlap:step, 0])
+        for i in range(3):
+            windows = self.helper._split_into_windows(x[:n_windows*step+overlap,
+                                                        i+1], nfft, overlap)
+            power = self.helper._windowed_power(windows, self.window)
+            for psd_sums, mask in zip(self.psd_sums, masks):
+                if mask is not None:
+                    psd_sums[i] = psd_sums[i] + (power * mask).sum(axis=-1)
+                else:
+                    psd_sums[i] = psd_sums[i] + power.sum(axis=-1)
+        self.window_count += n_windows
+        # Keep the samples needed by the next window
+        self.pending = x[n_windows*step:].copy()
+    def get_calibration_data(self, index=0):
+        np = self.numpy
+        if self.sample_count < 2 or self.last_time <= self.first_time:
+            return None
+        if self.nfft is None:
+            # Short measurement - the sampling rate estimate wasn't made
+            self._setup_window()
+            self._process_windows()
+        if not self.window_count:
+            return None
+        sampling_freq = self.sample_count / (self.last_time - self.first_time)
+        # Compensation for windowing loss
+        scale = 1.0 / (self.window**2).sum()
+        psds = []
+        for psd_sum in self.psd_sums[index]:
+            psd = psd_sum * (scale / (sampling_freq * self.window_count))
+            # For one-sided FFT output the response must be doubled,
+            # except the Nyquist frequency and the 'DC' term (0 Hz)
+            psd[1:-1] *= 2.
+            psds.append(psd)
+        freqs = np.fft.rfftfreq(self.nfft, 1. / sampling_freq)
+        px, py, pz = psds
+        calibration_data = CalibrationData(freqs, px+py+pz, px, py, pz)
+        calibration_data.set_numpy(np)
+        return calibration_data
+
+# Calculate the responses of several axes excited during the same test.
+# Each axis follows its own schedule of excitation frequencies, and a
+# window only contributes to the response of an axis at the frequencies
+# close to the excitation frequency of that axis during the window.
+class SeparatingPSDAccumulator(PSDAccumulator):
+    def __init__(self, helper, freq_schedules, max_freq_offset):
+        PSDAccumulator.__init__(self, helper)
+        np = self.numpy
+        self.freq_schedules = [(np.array(times), np.array(freqs))
+                               for times, freqs in freq_schedules]
+        self.max_freq_offset = max_freq_offset
+        self.test_start_time = self.test_end_time = None
+        self.freq_bins = None
+    def set_test_time(self, start_time, duration):
+        # Schedule times are relative to the start of the test
+        self.test_start_time = start_time
+        self.test_end_time = start_time + duration
+    def _setup_window(self):
+        PSDAccumulator._setup_window(self)
+        sampling_freq = self.sample_count / (self.last_time - self.first_time)
+        self.freq_bins = self.numpy.fft.rfftfreq(self.nfft, 1. / sampling_freq)
+        self.psd_sums = [[0., 0., 0.] for s in self.freq_schedules]
+    def _get_masks(self, window_times):
+        np = self.numpy
+        # Windows centered outside of the test do not count to any axis
+        inactive = window_times > self.test_end_time
+        masks = []
+        for times, freqs in self.freq_schedules:
+            idx = np.searchsorted(times, window_times - self.test_start_time,
+                                  side='right') - 1
+            window_freqs = freqs[np.maximum(idx, 0)]
+            mask = np.abs(self.freq_bins[:,None] - window_freqs[None,:])
+            mask = mask <= self.max_freq_offset
+            mask[:,inactive | (idx < 0)] = False
+            masks.append(mask)
+        return masks
+    def _process_windows(self):
+        # Wait for the test start time to be known
+        if self.test_start_time is not None:
+            PSDAccumulator._process_windows(self)
+
+
 CalibrationResult = collections.namedtuple(
         'CalibrationResult',
         ('name', 'freq', 'vals', 'vibrs', 'smoothing', 'score', 'max_accel'))
@@ -72,11 +216,15 @@ class ShaperCalibrate:
                     "docs/Measuring_Resonances.md for more details).")
 
     def background_process_exec(self, method, args):
+        return self.background_process_exec_all([(method, args)])[0]
+
+    def background_process_exec_all(self, calls):
+        # Run each (method, args) call in a separate process (using up
+        # to one process per cpu) and return the list of results
         if self.printer is None:
-            return method(*args)
+            return [method(*args) for method, args in calls]
         import queuelogger
-        parent_conn, child_conn = multiprocessing.Pipe()
-        def wrapper():
+        def wrapper(method, args, child_conn):
             queuelogger.clear_bg_logging()
             try:
                 res = method(*args)
@@ -86,26 +234,52 @@ class ShaperCalibrate:
                 return
             child_conn.send((False, res))
             child_conn.close()
-        # Start a process to perform the calculation
-        calc_proc = multiprocessing.Process(target=wrapper)
-        calc_proc.daemon = True
-        calc_proc.start()
-        # Wait for the process to finish
+        try:
+            max_procs = multiprocessing.cpu_count()
+        except NotImplementedError:
+            max_procs = 1
+        results = [None] * len(calls)
+        pending = list(enumerate(calls))
+        running = []
         reactor = self.printer.get_reactor()
         gcode = self.printer.lookup_object("gcode")
         eventtime = last_report_time = reactor.monotonic()
-        while calc_proc.is_alive():
+        while pending or running:
+            # Start processes to perform the calculations
+            while pending and len(running) < max_procs:
+                index, (method, args) = pending.pop(0)
+                parent_conn, child_conn = multiprocessing.Pipe()
+                calc_proc = multiprocessing.Process(
+                    target=wrapper, args=(method, args, child_conn))
+                calc_proc.daemon = True
+                calc_proc.start()
+                running.append((index, calc_proc, parent_conn))
+            # Collect the results of finished processes (reading the
+            # result before the process exits avoids blocking on a
+            # full pipe)
+            for info in list(running):
+                index, calc_proc, parent_conn = info
+                if not parent_conn.poll():
+                    if calc_proc.is_alive():
+                        continue
+                    err = "Remote calculation exited unexpectedly"
+                    results[index] = (True, err)
+                else:
+                    results[index] = parent_conn.recv()
+                calc_proc.join()
+                parent_conn.close()
+                running.remove(info)
+            if not running and not pending:
+                break
             if eventtime > last_report_time + 5.:
                 last_report_time = eventtime
                 gcode.respond_info("Wait for calculations..", log=False)
             eventtime = reactor.pause(eventtime + .1)
         # Return results
-        is_err, res = parent_conn.recv()
-        if is_err:
-            raise self.error("Error in remote calculation: %s" % (res,))
-        calc_proc.join()
-        parent_conn.close()
-        return res
+        for is_err, res in results:
+            if is_err:
+                raise self.error("Error in remote calculation: %s" % (res,))
+        return [res for is_err, res in results]
 
     def _split_into_windows(self, x, window_size, overlap):
         # Memory-efficient algorithm to split an input 'x' into a series
@@ -117,6 +291,16 @@ class ShaperCalibrate:
         return self.numpy.lib.stride_tricks.as_strided(
                 x, shape=shape, strides=strides, writeable=False)
 
+    def _windowed_power(self, x, window):
+        # Calculate the power of the frequency response of each window
+        np = self.numpy
+        nfft = x.shape[0]
+        # First detrend, then apply windowing function
+        x = window[:, None] * (x - np.mean(x, axis=0))
+        # Calculate frequency response for each window using FFT
+        result = np.fft.rfft(x, n=nfft, axis=0)
+        return (np.conjugate(result) * result).real
+
     def _psd(self, x, fs, nfft):
         # Calculate power spectral density (PSD) using Welch's algorithm
         np = self.numpy
@@ -128,12 +312,7 @@ class ShaperCalibrate:
         overlap = nfft // 2
         x = self._split_into_windows(x, nfft, overlap)
 
-        # First detrend, then apply windowing function
-        x = window[:, None] * (x - np.mean(x, axis=0))
-
-        # Calculate frequency response for each window using FFT
-        result = np.fft.rfft(x, n=nfft, axis=0)
-        result = np.conjugate(result) * result
+        result = self._windowed_power(x, window)
         result *= scale / fs
         # For one-sided FFT output the response must be doubled, except
         # the last point for unpaired Nyquist frequency (assuming even nfft)
@@ -141,7 +320,7 @@ class ShaperCalibrate:
         result[1:-1,:] *= 2.
 
         # Welch's algorithm: average response over windows
-        psd = result.real.mean(axis=-1)
+        psd = result.mean(axis=-1)
 
         # Calculate the frequency bins
         freqs = np.fft.rfftfreq(nfft, 1. / fs)
@@ -174,7 +353,21 @@ class ShaperCalibrate:
         fz, pz = self._psd(data[:,3], SAMPLING_FREQ, M)
         return CalibrationData(fx, px+py+pz, px, py, pz)
 
-    def process_accelerometer_data(self, data):
+    def create_psd_accumulator(self, freq_schedules=None,
+                               max_freq_offset=None):
+        if freq_schedules is not None:
+            return SeparatingPSDAccumulator(self, freq_schedules,
+                                            max_freq_offset)
+        return PSDAccumulator(self)
+
+    def process_accelerometer_data(self, data, index=0):
+        if isinstance(data, PSDAccumulator):
+            # Already computed while the samples arrived
+            calibration_data = data.get_calibration_data(index)
+            if calibration_data is None:
+                raise self.error(
+                    "Internal error processing accelerometer data")
+            return calibration_data
         calibration_data = self.background_process_exec(
                 self.calc_freq_response, (data,))
         if calibration_data is None:
@@ -185,17 +378,24 @@ class ShaperCalibrate:
 
     def _estimate_shaper(self, shaper, test_damping_ratio, test_freqs):
         np = self.numpy
+        A, T = np.array([shaper[0]]), np.array([shaper[1]])
+        return self._estimate_shapers(A, T, test_damping_ratio, test_freqs)[0]
 
-        A, T = np.array(shaper[0]), np.array(shaper[1])
-        inv_D = 1. / A.sum()
+    def _estimate_shapers(self, A, T, test_damping_ratio, test_freqs):
+        # Estimate the response of several shapers of the same type
+        # (given as one row of pulse amplitudes A and times T per shaper)
+        np = self.numpy
+        inv_D = 1. / A.sum(axis=1)
 
         omega = 2. * math.pi * test_freqs
         damping = test_damping_ratio * omega
         omega_d = omega * math.sqrt(1. - test_damping_ratio**2)
-        W = A * np.exp(np.outer(-damping, (T[-1] - T)))
-        S = W * np.sin(np.outer(omega_d, T))
-        C = W * np.cos(np.outer(omega_d, T))
-        return np.sqrt(S.sum(axis=1)**2 + C.sum(axis=1)**2) * inv_D
+        W = A[:,None,:] * np.exp(-damping[None,:,None]
+                                 * (T[:,-1:] - T)[:,None,:])
+        phase = omega_d[None,:,None] * T[:,None,:]
+        S = (W * np.sin(phase)).sum(axis=-1)
+        C = (W * np.cos(phase)).sum(axis=-1)
+        return np.sqrt(S**2 + C**2) * inv_D[:,None]
 
     def _estimate_remaining_vibrations(self, shaper, test_damping_ratio,
                                        freq_bins, psd):
@@ -209,25 +409,49 @@ class ShaperCalibrate:
         all_vibrations = self.numpy.maximum(psd - vibr_threshold, 0).sum()
         return (remaining_vibrations / all_vibrations, vals)
 
-    def _get_shaper_smoothing(self, shaper, accel=5000, scv=5.):
-        half_accel = accel * .5
-
-        A, T = shaper
-        inv_D = 1. / sum(A)
-        n = len(T)
+    def _get_smoothing_coeffs(self, A, T, scv):
+        # The smoothing of a shaper is a piecewise linear function of the
+        # acceleration: max(offset_90 + slope_90 * accel, slope_180 * accel).
+        # Returns the coefficients for each shaper (row) of A and T.
+        np = self.numpy
+        A, T = np.atleast_2d(A), np.atleast_2d(T)
+        inv_D = 1. / A.sum(axis=1)
         # Calculate input shaper shift
-        ts = sum([A[i] * T[i] for i in range(n)]) * inv_D
-
+        ts = (A * T).sum(axis=1) * inv_D
+        dt = T - ts[:,None]
         # Calculate offset for 90 and 180 degrees turn
-        offset_90 = offset_180 = 0.
-        for i in range(n):
-            if T[i] >= ts:
-                # Calculate offset for one of the axes
-                offset_90 += A[i] * (scv + half_accel * (T[i]-ts)) * (T[i]-ts)
-            offset_180 += A[i] * half_accel * (T[i]-ts)**2
-        offset_90 *= inv_D * math.sqrt(2.)
-        offset_180 *= inv_D
-        return max(offset_90, offset_180)
+        A_90 = np.where(dt >= 0., A, 0.)
+        offset_90 = (A_90 * scv * dt).sum(axis=1) * inv_D * math.sqrt(2.)
+        slope_90 = (A_90 * .5 * dt**2).sum(axis=1) * inv_D * math.sqrt(2.)
+        slope_180 = (A * .5 * dt**2).sum(axis=1) * inv_D
+        return offset_90, slope_90, slope_180
+
+    def get_shaper_smoothing(self, shaper, accels, scv=5.):
+        # Evaluate the smoothing of a shaper for each of the accels
+        np = self.numpy
+        offset_90, slope_90, slope_180 = self._get_smoothing_coeffs(
+                shaper[0], shaper[1], scv)
+        accels = np.asarray(accels, dtype=float)
+        return np.maximum(offset_90[0] + slope_90[0] * accels,
+                          slope_180[0] * accels)
+
+    def _get_shaper_smoothing(self, shaper, accel=SMOOTHING_TEST_ACCEL,
+                              scv=5.):
+        return float(self.get_shaper_smoothing(shaper, accel, scv))
+
+    def _find_max_accels(self, A, T, scv):
+        # Just some empirically chosen value which produces good projections
+        # for max_accel without much smoothing
+        TARGET_SMOOTHING = 0.12
+        np = self.numpy
+        offset_90, slope_90, slope_180 = self._get_smoothing_coeffs(A, T, scv)
+        with np.errstate(divide='ignore', invalid='ignore'):
+            accel_90 = np.where(slope_90 > 0.,
+                                (TARGET_SMOOTHING - offset_90) / slope_90,
+                                np.inf)
+            accel_180 = np.where(slope_180 > 0.,
+                                 TARGET_SMOOTHING / slope_180, np.inf)
+        return np.maximum(np.minimum(accel_90, accel_180), 0.)
 
     def fit_shaper(self, shaper_cfg, calibration_data, shaper_freqs,
                    damping_ratio, scv, max_smoothing, test_damping_ratios,
@@ -254,70 +478,73 @@ class ShaperCalibrate:
         psd = calibration_data.psd_sum[freq_bins <= max_freq]
         freq_bins = freq_bins[freq_bins <= max_freq]
 
+        # Smoothing grows as the shaper frequency is reduced, so only the
+        # frequencies down to the first one with too much smoothing matter
+        test_freqs = test_freqs[::-1]
+        shapers = [shaper_cfg.init_func(f, damping_ratio) for f in test_freqs]
+        A = np.array([s[0] for s in shapers])
+        T = np.array([s[1] for s in shapers])
+        offset_90, slope_90, slope_180 = self._get_smoothing_coeffs(A, T, scv)
+        smoothings = np.maximum(offset_90 + slope_90 * SMOOTHING_TEST_ACCEL,
+                                slope_180 * SMOOTHING_TEST_ACCEL)
+        max_accels = self._find_max_accels(A, T, scv)
+        count = len(test_freqs)
+        is_limited = False
+        if max_smoothing:
+            over = np.nonzero(smoothings[1:] > max_smoothing)[0]
+            if len(over):
+                count, is_limited = over[0] + 1, True
+        A, T = A[:count], T[:count]
+
+        # Exact damping ratio of the printer is unknown, pessimizing
+        # remaining vibrations over possible damping values
+        vibr_threshold = psd.max() / shaper_defs.SHAPER_VIBRATION_REDUCTION
+        all_vibrations = np.maximum(psd - vibr_threshold, 0).sum()
+        shaper_vals = np.zeros(shape=(count, freq_bins.shape[0]))
+        shaper_vibrations = np.zeros(shape=(count,))
+        for start in range(0, count, FIT_CHUNK_SIZE):
+            end = start + FIT_CHUNK_SIZE
+            for dr in test_damping_ratios:
+                vals = self._estimate_shapers(A[start:end], T[start:end],
+                                              dr, freq_bins)
+                vibrations = np.maximum(vals * psd - vibr_threshold,
+                                        0).sum(axis=1) / all_vibrations
+                shaper_vals[start:end] = np.maximum(shaper_vals[start:end],
+                                                    vals)
+                shaper_vibrations[start:end] = np.maximum(
+                        shaper_vibrations[start:end], vibrations)
+
         best_res = None
         results = []
-        for test_freq in test_freqs[::-1]:
-            shaper_vibrations = 0.
-            shaper_vals = np.zeros(shape=freq_bins.shape)
-            shaper = shaper_cfg.init_func(test_freq, damping_ratio)
-            shaper_smoothing = self._get_shaper_smoothing(shaper, scv=scv)
-            if max_smoothing and shaper_smoothing > max_smoothing and best_res:
-                return best_res
-            # Exact damping ratio of the printer is unknown, pessimizing
-            # remaining vibrations over possible damping values
-            for dr in test_damping_ratios:
-                vibrations, vals = self._estimate_remaining_vibrations(
-                        shaper, dr, freq_bins, psd)
-                shaper_vals = np.maximum(shaper_vals, vals)
-                if vibrations > shaper_vibrations:
-                    shaper_vibrations = vibrations
-            max_accel = self.find_shaper_max_accel(shaper, scv)
+        for i in range(count):
+            shaper_smoothing = smoothings[i]
+            vibrs = shaper_vibrations[i]
             # The score trying to minimize vibrations, but also accounting
             # the growth of smoothing. The formula itself does not have any
             # special meaning, it simply shows good results on real user data
-            shaper_score = shaper_smoothing * (shaper_vibrations**1.5 +
-                                               shaper_vibrations * .2 + .01)
+            shaper_score = shaper_smoothing * (vibrs**1.5 + vibrs * .2 + .01)
             results.append(
                     CalibrationResult(
-                        name=shaper_cfg.name, freq=test_freq, vals=shaper_vals,
-                        vibrs=shaper_vibrations, smoothing=shaper_smoothing,
-                        score=shaper_score, max_accel=max_accel))
+                        name=shaper_cfg.name, freq=test_freqs[i],
+                        vals=shaper_vals[i], vibrs=vibrs,
+                        smoothing=shaper_smoothing, score=shaper_score,
+                        max_accel=max_accels[i]))
             if best_res is None or best_res.vibrs > results[-1].vibrs:
                 # The current frequency is better for the shaper.
                 best_res = results[-1]
-        # Try to find an 'optimal' shapper configuration: the one that is not
-        # much worse than the 'best' one, but gives much less smoothing
         selected = best_res
-        for res in results[::-1]:
-            if res.vibrs < best_res.vibrs * 1.1 and res.score < selected.score:
-                selected = res
+        if not is_limited:
+            # Try to find an 'optimal' shapper configuration: the one that
+            # is not much worse than the 'best' one, but gives much less
+            # smoothing
+            for res in results[::-1]:
+                if (res.vibrs < best_res.vibrs * 1.1
+                        and res.score < selected.score):
+                    selected = res
         return selected
 
-    def _bisect(self, func):
-        left = right = 1.
-        if not func(1e-9):
-            return 0.
-        while not func(left):
-            right = left
-            left *= .5
-        if right == left:
-            while func(right):
-                right *= 2.
-        while right - left > 1e-8:
-            middle = (left + right) * .5
-            if func(middle):
-                left = middle
-            else:
-                right = middle
-        return left
-
     def find_shaper_max_accel(self, shaper, scv):
-        # Just some empirically chosen value which produces good projections
-        # for max_accel without much smoothing
-        TARGET_SMOOTHING = 0.12
-        max_accel = self._bisect(lambda test_accel: self._get_shaper_smoothing(
-            shaper, test_accel, scv) <= TARGET_SMOOTHING)
-        return max_accel
+        return float(self._find_max_accels(shaper[0], shaper[1], scv)[0])
 
     def find_best_shaper(self, calibration_data, shapers=None,
                          damping_ratio=None, scv=None, shaper_freqs=None,
@@ -326,12 +553,14 @@ class ShaperCalibrate:
         best_shaper = None
         all_shapers = []
         shapers = shapers or AUTOTUNE_SHAPERS
-        for shaper_cfg in shaper_defs.INPUT_SHAPERS:
-            if shaper_cfg.name not in shapers:
-                continue
-            shaper = self.background_process_exec(self.fit_shaper, (
-                shaper_cfg, calibration_data, shaper_freqs, damping_ratio,
-                scv, max_smoothing, test_damping_ratios, max_freq))
+        # Fit the shapers in parallel
+        calls = [(self.fit_shaper, (shaper_cfg, calibration_data,
+                                    shaper_freqs, damping_ratio, scv,
+                                    max_smoothing, test_damping_ratios,
+                                    max_freq))
+                 for shaper_cfg in shaper_defs.INPUT_SHAPERS
+                 if shaper_cfg.name in shapers]
+        for shaper in self.background_process_exec_all(calls):
             if logger is not None:
                 logger("Fitted shaper '%s' frequency = %.1f Hz "
                        "(vibrations = %.1f%%, smoothing ~= %.3f)" % (
@@ -396,3 +625,40 @@ class ShaperCalibrate:
                     csvfile.write("\n")
         except IOError as e:
             raise self.error("Error writing to file '%s': %s", output, str(e))
+
+
+######################################################################
+# Raw accelerometer data files
+######################################################################
+
+# The binary raw data format starts with RAW_DATA_MAGIC, followed by a
+# single line json header (describing the chip, its data rate and the
+# chip clock translation) and then the samples stored as little-endian
+# doubles in (time, accel_x, accel_y, accel_z) order.
+RAW_DATA_MAGIC = b"KLIPPER-ACCEL-1\n"
+RAW_DATA_FORMATS = {'csv': '.csv', 'binary': '.bin'}
+RAW_DATA_COLUMNS = ['time', 'accel_x', 'accel_y', 'accel_z']
+
+def write_raw_data_header(f, info):
+    info = dict(info, columns=RAW_DATA_COLUMNS)
+    f.write(RAW_DATA_MAGIC)
+    f.write(json.dumps(info, sort_keys=True).encode() + b"\n")
+
+def pack_raw_samples(samples):
+    data = array.array('d', [v for s in samples for v in s])
+    if sys.byteorder != 'little':
+        data.byteswap()
+    if hasattr(data, 'tobytes'):
+        return data.tobytes()
+    return data.tostring()
+
+# Read a binary raw data file - returns (info, data) with the samples
+# in an Nx4 numpy array, or None if the file is not in binary format
+def read_raw_data(filename, np):
+    with open(filename, 'rb') as f:
+        if f.read(len(RAW_DATA_MAGIC)) != RAW_DATA_MAGIC:
+            return None
+        info = json.loads(f.readline().decode())
+        data = np.fromfile(f, dtype='<f8')
+    ncols = len(info.get('columns', RAW_DATA_COLUMNS))
+    return info, data[:len(data) - len(data) % ncols].reshape(-1, ncols)
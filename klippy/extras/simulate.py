@@ -0,0 +1,187 @@
+# Report print duration, step rates, and bandwidth of a simulated print
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, json, logging, collections
+
+# Print time length of the windows used to find the peak mcu bandwidth
+BANDWIDTH_WINDOW = 1.
+# Print time that the host may queue moves ahead (toolhead BUFFER_TIME_HIGH)
+MOVE_QUEUE_WINDOW = 2.
+
+# Track the step rate of a stepper from its queue_step history
+class SimulateStepper:
+    def __init__(self, dump_stepper):
+        self.dump_stepper = dump_stepper
+        mcu = dump_stepper.mcu_stepper.get_mcu()
+        self.mcu_name = mcu.get_name()
+        self.mcu_freq = mcu.get_constant_float('CLOCK_FREQ')
+        self.last_clock = 0
+        self.total_steps = 0
+        self.min_interval = self.peak_clock = 0
+    def update(self):
+        rows = self.dump_stepper.pull_steps(self.last_clock, 1<<63)
+        if not rows:
+            return rows
+        min_interval = self.min_interval
+        for first_clock, last_clock, pos, step_count, iv, add, add2 in rows:
+            count = abs(step_count)
+            self.total_steps += count
+            # Step k of a queue_step is "iv + add*k + add2*k*(k-1)/2"
+            # ticks after the previous step
+            check = [0, count - 1]
+            if add2 > 0 and add < 0:
+                check.append(min((-add + add2 - 1) // add2, count - 1))
+            for k in check:
+                interval = iv + add*k + add2*k*(k-1)//2
+                if interval > 0 and (not min_interval
+                                     or interval < min_interval):
+                    min_interval = interval
+                    self.peak_clock = first_clock
+        self.min_interval = min_interval
+        self.last_clock = rows[-1][1]
+        return rows
+    def get_status(self):
+        peak_rate = 0.
+        if self.min_interval:
+            peak_rate = self.mcu_freq / self.min_interval
+        return {'mcu': self.mcu_name, 'steps': self.total_steps,
+                'peak_step_rate': round(peak_rate),
+                'peak_time': round(self.peak_clock / self.mcu_freq, 3)}
+
+# Track the queue_step message bandwidth and move queue use of an mcu
+class SimulateMCU:
+    def __init__(self, mcu):
+        self.mcu = mcu
+        self.window_time = self.window_bytes = None
+        self.peak_rate = 0.
+        self.queue_ticks = mcu.seconds_to_clock(MOVE_QUEUE_WINDOW)
+        self.queue_clocks = collections.deque()
+        self.peak_queue = 0
+        self.last_stats = {}
+    def note_moves(self, start_clocks):
+        # Find the most queue_step commands starting within a window
+        start_clocks.sort()
+        queue_clocks = self.queue_clocks
+        queue_ticks = self.queue_ticks
+        peak_queue = self.peak_queue
+        for clock in start_clocks:
+            queue_clocks.append(clock)
+            while clock - queue_clocks[0] >= queue_ticks:
+                queue_clocks.popleft()
+            peak_queue = max(peak_queue, len(queue_clocks))
+        self.peak_queue = peak_queue
+    def note_stats(self, eventtime):
+        self.mcu.stats(eventtime)
+        self.last_stats = self.mcu.get_status(eventtime).get('last_stats', {})
+    def update(self, print_time):
+        msg_count, msg_bytes, adaptive_bytes = self.mcu.get_step_stats()
+        if self.window_time is None:
+            self.window_time, self.window_bytes = print_time, msg_bytes
+            return
+        window = print_time - self.window_time
+        if window >= BANDWIDTH_WINDOW:
+            rate = (msg_bytes - self.window_bytes) / window
+            self.peak_rate = max(self.peak_rate, rate)
+            self.window_time, self.window_bytes = print_time, msg_bytes
+    def get_status(self, duration, with_steps):
+        if not with_steps:
+            return {'stats': self.last_stats}
+        msg_count, msg_bytes, adaptive_bytes = self.mcu.get_step_stats()
+        avg_rate = 0.
+        if duration > 0.:
+            avg_rate = msg_bytes / duration
+        return {'step_msgs': msg_count, 'step_bytes': msg_bytes,
+                'avg_bytes_per_sec': round(avg_rate),
+                'peak_bytes_per_sec': round(max(self.peak_rate, avg_rate)),
+                'peak_move_queue': self.peak_queue,
+                'stats': self.last_stats}
+
+class PrinterSimulate:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.mode = self.printer.get_start_args().get('simulate')
+        if self.mode is None:
+            raise config.error("The simulate module requires the"
+                               " klippy.py --simulate option")
+        self.steppers = {}
+        self.mcus = {}
+        self.start_time = self.end_time = None
+        self.start_systime = self.end_systime = 0.
+        self.gcode_error = None
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_output_handler(self._handle_output)
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        self.printer.register_event_handler("klippy:ready",
+                                            self._handle_ready)
+        self.printer.register_event_handler("toolhead:sync_print_time",
+                                            self._handle_sync_print_time)
+        self.printer.register_event_handler("gcode:request_restart",
+                                            self._handle_request_restart)
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+    def _handle_connect(self):
+        for name, mcu in self.printer.lookup_objects(module='mcu'):
+            self.mcus[mcu.get_name()] = SimulateMCU(mcu)
+        if self.mode != 'steps':
+            return
+        motion_report = self.printer.lookup_object('motion_report')
+        for name, dump_stepper in motion_report.steppers.items():
+            ss = SimulateStepper(dump_stepper)
+            self.steppers[name] = (ss, self.mcus[ss.mcu_name])
+        # Registered last, so this runs after all steppers have been flushed
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_step_generator(self._update)
+    def _handle_output(self, msg):
+        if msg.startswith('!! ') and self.gcode_error is None:
+            self.gcode_error = msg[3:]
+    def _handle_ready(self):
+        self.start_systime = self.reactor.monotonic()
+    def _handle_sync_print_time(self, curtime, est_print_time, print_time):
+        if self.start_time is None:
+            self.start_time = print_time
+    def _handle_request_restart(self, print_time):
+        self.end_time = print_time
+        self.end_systime = eventtime = self.reactor.monotonic()
+        # The mcu serial connections are closed before klippy:disconnect
+        for sm in self.mcus.values():
+            sm.note_stats(eventtime)
+    def _update(self, flush_time):
+        start_clocks = dict([(sm, []) for sm in self.mcus.values()])
+        for ss, sm in self.steppers.values():
+            start_clocks[sm].extend([row[0] for row in ss.update()])
+        for sm, clocks in start_clocks.items():
+            sm.note_moves(clocks)
+            sm.update(flush_time)
+    def _handle_disconnect(self):
+        self._update(self.end_time or 0.)
+        report = {'mode': self.mode}
+        if self.end_time is None:
+            error = self.gcode_error
+            if error is None:
+                error = self.printer.get_state_message()[0].strip()
+            report['error'] = error
+            duration = 0.
+        else:
+            duration = max(0., self.end_time - (self.start_time
+                                                or self.end_time))
+            report['print_duration'] = round(duration, 6)
+            report['host_time'] = round(self.end_systime
+                                        - self.start_systime, 3)
+            logging.info("Simulated print duration %.3fs (%.3fs host time)",
+                         duration, report['host_time'])
+        with_steps = self.mode == 'steps'
+        report['mcus'] = dict([(name, sm.get_status(duration, with_steps))
+                               for name, sm in self.mcus.items()])
+        if with_steps:
+            report['steppers'] = dict([(name, ss.get_status())
+                                       for name, (ss, sm)
+                                       in self.steppers.items()])
+        sys.stdout.write(json.dumps(report, sort_keys=True) + "\n")
+        sys.stdout.flush()
+
+def load_config(config):
+    return PrinterSimulate(config)
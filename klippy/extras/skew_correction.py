@@ -10,6 +10,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 
 import math
+import chelper
 
 def calc_skew_factor(ac, bd, ad):
     side = math.sqrt(2*ac*ac + 2*bd*bd - 4*ad*ad) / 2.
@@ -28,7 +29,8 @@ class PrinterSkew:
         self._load_storage(config)
         self.printer.register_event_handler("klippy:connect",
                                             self._handle_connect)
-        self.next_transform = None
+        self.native_transforms = None
+        self.stage = -1
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command('GET_CURRENT_SKEW', self.cmd_GET_CURRENT_SKEW,
                                desc=self.cmd_GET_CURRENT_SKEW_help)
@@ -40,8 +42,22 @@ class PrinterSkew:
         gcode.register_command('SKEW_PROFILE', self.cmd_SKEW_PROFILE,
                                desc=self.cmd_SKEW_PROFILE_help)
     def _handle_connect(self):
+        # The skew is applied by the C move transform code
         gcode_move = self.printer.lookup_object('gcode_move')
-        self.next_transform = gcode_move.set_move_transform(self, force=True)
+        self.native_transforms = gcode_move.get_native_transforms()
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.stage = ffi_lib.move_transform_add_skew(
+            self.native_transforms.get_c_transform())
+        if self.stage < 0:
+            raise self.printer.config_error("Too many move transforms")
+        self._sync_transform()
+    def _sync_transform(self):
+        if self.native_transforms is None:
+            return
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.move_transform_set_skew(
+            self.native_transforms.get_c_transform(), self.stage,
+            self.xy_factor, self.xz_factor, self.yz_factor)
     def _load_storage(self, config):
         stored_profs = config.get_prefix_sections(self.name)
         # Remove primary skew_correction section, as it is not a stored profile
@@ -64,15 +80,11 @@ class PrinterSkew:
             + pos[2] * self.xz_factor
         skewed_y = pos[1] + pos[2] * self.yz_factor
         return [skewed_x, skewed_y, pos[2], pos[3]]
-    def get_position(self):
-        return self.calc_unskew(self.next_transform.get_position())
-    def move(self, newpos, speed):
-        corrected_pos = self.calc_skew(newpos)
-        self.next_transform.move(corrected_pos, speed)
     def _update_skew(self, xy_factor, xz_factor, yz_factor):
         self.xy_factor = xy_factor
         self.xz_factor = xz_factor
         self.yz_factor = yz_factor
+        self._sync_transform()
         gcode_move = self.printer.lookup_object('gcode_move')
         gcode_move.reset_last_position()
     cmd_GET_CURRENT_SKEW_help = "Report current printer skew"
@@ -113,6 +125,7 @@ class PrinterSkew:
                         "plane [%s]\n%s" % (plane, gcmd.get_commandline()))
                 factor = plane.lower() + '_factor'
                 setattr(self, factor, calc_skew_factor(*lengths))
+        self._sync_transform()
     cmd_SKEW_PROFILE_help = "Profile management for skew_correction"
     def cmd_SKEW_PROFILE(self, gcmd):
         if gcmd.get('LOAD', None) is not None:
@@ -1,12 +1,13 @@
 # Support for logging periodic statistics
 #
-# Copyright (C) 2018-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, time, logging
+import os, re, time, logging
+import queuelogger
 
 class PrinterSysStats:
-    def __init__(self, config):
+    def __init__(self, config, pstats):
         printer = config.get_printer()
         self.last_process_time = self.total_process_time = 0.
         self.last_load_avg = 0.
@@ -17,11 +18,13 @@ class PrinterSysStats:
         except:
             pass
         printer.register_event_handler("klippy:disconnect", self._disconnect)
+        pstats.register_stats(('sysload', 'cputime', 'memavail'),
+                              self._sample_stats)
     def _disconnect(self):
         if self.mem_file is not None:
             self.mem_file.close()
             self.mem_file = None
-    def stats(self, eventtime):
+    def _sample_stats(self, eventtime):
         # Get core usage stats
         ptime = time.process_time()
         pdiff = ptime - self.last_process_time
@@ -29,8 +32,6 @@ class PrinterSysStats:
         if pdiff > 0.:
             self.total_process_time += pdiff
         self.last_load_avg = os.getloadavg()[0]
-        msg = "sysload=%.2f cputime=%.3f" % (self.last_load_avg,
-                                             self.total_process_time)
         # Get available system memory
         if self.mem_file is not None:
             try:
@@ -39,11 +40,11 @@ class PrinterSysStats:
                 for line in data.split('\n'):
                     if line.startswith("MemAvailable:"):
                         self.last_mem_avail = int(line.split()[1])
-                        msg = "%s memavail=%d" % (msg, self.last_mem_avail)
                         break
             except:
                 pass
-        return (False, msg)
+        return False, (round(self.last_load_avg, 2),
+                       round(self.total_process_time, 3), self.last_mem_avail)
     def get_status(self, eventtime):
         return {'sysload': self.last_load_avg,
                 'cputime': self.total_process_time,
@@ -55,20 +56,74 @@ class PrinterStats:
         reactor = self.printer.get_reactor()
         self.stats_timer = reactor.register_timer(self.generate_stats)
         self.stats_cb = []
+        # Registered numeric stats (sampled into a preallocated list)
+        self.stats_groups = []
+        self.stats_names = ()
+        self.stats_values = []
+        self.last_stats_msg = ""
         self.printer.register_event_handler("klippy:ready", self.handle_ready)
+        webhooks = self.printer.lookup_object('webhooks')
+        webhooks.register_endpoint("statistics/metrics",
+                                   self._handle_metrics_request)
+    def register_stats(self, names, sample_cb):
+        # The sample_cb(eventtime) callback must return a tuple of
+        # (is_active, values) with one number for each of the given names
+        self.stats_groups.append((len(names), sample_cb))
+        self.stats_names = self.stats_names + tuple(names)
     def handle_ready(self):
         self.stats_cb = [o.stats for n, o in self.printer.lookup_objects()
                          if hasattr(o, 'stats')]
+        self.stats_values = [0.] * len(self.stats_names)
         if self.printer.get_start_args().get('debugoutput') is None:
             reactor = self.printer.get_reactor()
             reactor.update_timer(self.stats_timer, reactor.NOW)
     def generate_stats(self, eventtime):
+        values = self.stats_values
+        is_active = False
+        pos = 0
+        for count, cb in self.stats_groups:
+            active, vals = cb(eventtime)
+            is_active |= active
+            values[pos:pos+count] = vals
+            pos += count
         stats = [cb(eventtime) for cb in self.stats_cb]
-        if max([s[0] for s in stats]):
-            logging.info("Stats %.1f: %s", eventtime,
-                         ' '.join([s[1] for s in stats]))
+        msg = ' '.join([s[1] for s in stats if s[1]])
+        self.last_stats_msg = msg
+        if is_active or max([s[0] for s in stats] + [False]):
+            if not queuelogger.log_binary_stats(eventtime, msg,
+                                                self.stats_names,
+                                                tuple(values)):
+                reg_msg = queuelogger.format_binlog_stats(
+                    list(zip(self.stats_names, values)))
+                msg = ' '.join([m for m in (reg_msg, msg) if m])
+                logging.info("Stats %.1f: %s", eventtime, msg)
         return eventtime + 1.
+    # Prometheus text export of the last reported stats
+    def _handle_metrics_request(self, web_request):
+        items = list(zip(self.stats_names, self.stats_values))
+        prefix = ""
+        for part in self.last_stats_msg.split():
+            if '=' not in part:
+                prefix = part
+                continue
+            name, val = part.split('=', 1)
+            try:
+                items.append((prefix + name, float(val)))
+            except ValueError:
+                pass
+        out = []
+        for key, val in items:
+            labels = ""
+            if ':' in key:
+                prefix, key = key.rsplit(':', 1)
+                prefix = prefix.replace('\\', '\\\\').replace('"', '\\"')
+                labels = '{object="%s"}' % (prefix,)
+            key = re.sub('[^a-zA-Z0-9_]', '_', key)
+            out.append("klipper_%s%s %s" % (key, labels, repr(float(val))))
+        web_request.send({'prometheus': '\n'.join(out) + '\n'})
 
 def load_config(config):
-    config.get_printer().add_object('system_stats', PrinterSysStats(config))
-    return PrinterStats(config)
+    pstats = PrinterStats(config)
+    config.get_printer().add_object('system_stats',
+                                    PrinterSysStats(config, pstats))
+    return pstats
@@ -0,0 +1,79 @@
+# Export printer status to a shared memory snapshot for local clients
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import os, mmap, json, struct, logging
+
+# Layout of the snapshot file (all values little-endian):
+#   magic (4 bytes), layout version (uint32), sequence (uint32),
+#   data length (uint32), eventtime (double), json data
+# The sequence is odd while the snapshot is being updated.
+HEADER = struct.Struct("<4sIIId")
+MAGIC = b"KSTS"
+LAYOUT_VERSION = 1
+
+class StatusSnapshot:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.path = config.get('path')
+        self.size = config.getint('size', 65536, minval=4096)
+        self.objects = config.getlist('objects', ('toolhead', 'print_stats',
+                                                  'motion_report'))
+        self.status = {}
+        self.sequence = 0
+        self.mm = None
+        self.warned_size = False
+        self.printer.register_event_handler("klippy:ready",
+                                            self._handle_ready)
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
+    def _handle_ready(self):
+        try:
+            fd = os.open(self.path, os.O_RDWR | os.O_CREAT | os.O_TRUNC,
+                         0o644)
+            try:
+                os.ftruncate(fd, self.size)
+                self.mm = mmap.mmap(fd, self.size)
+            finally:
+                os.close(fd)
+        except (OSError, IOError, mmap.error):
+            logging.exception("Unable to create status snapshot '%s'",
+                              self.path)
+            return
+        HEADER.pack_into(self.mm, 0, MAGIC, LAYOUT_VERSION, 0, 0, 0.)
+        qsh = self.printer.lookup_object('query_status')
+        subscription = dict([(name, None) for name in self.objects])
+        qsh.add_local_subscription(self, subscription, self._handle_status)
+    def _handle_disconnect(self):
+        if self.mm is not None:
+            self.mm.close()
+            self.mm = None
+    def is_closed(self):
+        return self.mm is None
+    def _handle_status(self, msg):
+        if self.mm is None:
+            return
+        params = msg['params']
+        for obj_name, changes in params['status'].items():
+            self.status.setdefault(obj_name, {}).update(changes)
+        data = json.dumps(self.status, separators=(',', ':')).encode()
+        if len(data) > self.size - HEADER.size:
+            if not self.warned_size:
+                logging.warning("Status snapshot '%s' too small (need %d)",
+                                self.path, len(data) + HEADER.size)
+                self.warned_size = True
+            return
+        # Update using a seqlock so readers can detect partial updates
+        mm = self.mm
+        seq = self.sequence
+        HEADER.pack_into(mm, 0, MAGIC, LAYOUT_VERSION, seq + 1, 0, 0.)
+        mm[HEADER.size:HEADER.size + len(data)] = data
+        HEADER.pack_into(mm, 0, MAGIC, LAYOUT_VERSION, seq + 1, len(data),
+                         params['eventtime'])
+        self.sequence = seq = seq + 2
+        HEADER.pack_into(mm, 0, MAGIC, LAYOUT_VERSION, seq, len(data),
+                         params['eventtime'])
+
+def load_config(config):
+    return StatusSnapshot(config)
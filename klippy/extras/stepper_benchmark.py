@@ -0,0 +1,90 @@
+# Check the micro-controller step rate capacity at startup
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
+
+BENCHMARK_CMD = "stepper_benchmark oid=%c count=%hu"
+BENCHMARK_RESP = ("stepper_benchmark_result oid=%c steps=%u ticks=%u"
+                  " max_ticks=%u")
+
+# Measure the cost of each step on the micro-controllers and warn if
+# the configured maximum velocities would exceed the available time
+class StepperBenchmark:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.step_count = config.getint('step_count', 100,
+                                        minval=1, maxval=1000)
+        self.max_load = config.getfloat('max_load', .5, above=0., maxval=1.)
+        self.results = {}
+        self.mcu_loads = {}
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+    def _benchmark_stepper(self, stepper):
+        # Only run on steppers with a driver disabled via its enable pin
+        mcu = stepper.get_mcu()
+        if mcu.is_fileoutput():
+            return None
+        if mcu.try_lookup_command(BENCHMARK_CMD) is None:
+            return None
+        stepper_enable = self.printer.lookup_object('stepper_enable')
+        try:
+            et = stepper_enable.lookup_enable(stepper.get_name())
+        except self.printer.config_error as e:
+            return None
+        if not et.is_driver_disabled():
+            return None
+        cmd = mcu.lookup_query_command(BENCHMARK_CMD, BENCHMARK_RESP,
+                                       oid=stepper.get_oid())
+        params = cmd.send([stepper.get_oid(), self.step_count])
+        if not params['steps']:
+            return None
+        mcu_freq = mcu.get_constant_float('CLOCK_FREQ')
+        return {'step_time': params['ticks'] / (params['steps'] * mcu_freq),
+                'max_step_time': params['max_ticks'] / mcu_freq}
+    def _handle_connect(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        kin = toolhead.get_kinematics()
+        max_velocity = toolhead.get_max_velocity()[0]
+        max_z_velocity = getattr(kin, 'max_z_velocity', max_velocity)
+        # Measure step times
+        mcu_steppers = {}
+        for stepper in kin.get_steppers():
+            mcu_steppers.setdefault(stepper.get_mcu(), []).append(stepper)
+            res = self._benchmark_stepper(stepper)
+            if res is not None:
+                self.results[stepper.get_name()] = res
+        # Estimate the load of each mcu at maximum velocity
+        for mcu, steppers in mcu_steppers.items():
+            step_times = [self.results[s.get_name()]['step_time']
+                          for s in steppers if s.get_name() in self.results]
+            if not step_times:
+                continue
+            avg_step_time = sum(step_times) / len(step_times)
+            load = 0.
+            for s in steppers:
+                velocity = max_velocity
+                if not s.is_active_axis('x') and not s.is_active_axis('y'):
+                    velocity = max_z_velocity
+                res = self.results.get(s.get_name())
+                step_time = avg_step_time
+                if res is not None:
+                    step_time = res['step_time']
+                load += velocity / s.get_step_dist() * step_time
+            self.mcu_loads[mcu.get_name()] = load
+            logging.info("stepper_benchmark: mcu '%s' estimated step load"
+                         " %.3f at maximum velocity", mcu.get_name(), load)
+            if load > self.max_load:
+                configfile = self.printer.lookup_object('configfile')
+                configfile.runtime_warning(
+                    "The step rate needed at max_velocity on mcu '%s' may"
+                    " exceed its capacity (estimated load %.3f). Consider"
+                    " reducing max_velocity or microsteps."
+                    % (mcu.get_name(), load))
+    def get_status(self, eventtime):
+        return {'steppers': dict(self.results),
+                'mcu_loads': dict(self.mcu_loads)}
+
+def load_config(config):
+    return StepperBenchmark(config)
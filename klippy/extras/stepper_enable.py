@@ -1,6 +1,6 @@
 # Support for enable pins on stepper motor drivers
 #
-# Copyright (C) 2019-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2019-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
@@ -69,6 +69,10 @@ class EnableTracking:
         return self.is_enabled
     def has_dedicated_enable(self):
         return self.enable.is_dedicated
+    def is_driver_disabled(self):
+        # Driver is known to be off (has an enable pin that is not active)
+        enable = self.enable
+        return enable.mcu_enable is not None and not enable.enable_count
 
 # Global stepper enable line tracking
 class PrinterStepperEnable:
@@ -0,0 +1,116 @@
+# Periodic sampling of stepper positions (performed by the mcu)
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
+from . import bulk_sensor
+
+MIN_MSG_TIME = 0.100
+MAX_STEPPERS = 3
+BATCH_UPDATES = 0.100
+
+class StepperSample:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.name = config.get_name().split()[-1]
+        self.stepper_names = config.getlist('steppers')
+        if len(self.stepper_names) > MAX_STEPPERS:
+            raise config.error("At most %d steppers may be sampled by '%s'"
+                               % (MAX_STEPPERS, self.name))
+        self.sample_period = config.getfloat('sample_period', 0.001,
+                                             above=0.)
+        self.mcu_steppers = []
+        # Lookup the mcu of the steppers
+        ppins = self.printer.lookup_object('pins')
+        sconfig = config.getsection(self.stepper_names[0])
+        step_pin = sconfig.get('step_pin', note_valid=False)
+        pin_params = ppins.parse_pin(step_pin, can_invert=True,
+                                     can_pullup=True)
+        self.mcu = mcu = pin_params['chip']
+        self.oid = oid = mcu.create_oid()
+        self.query_stepper_sample_cmd = None
+        mcu.add_config_cmd("config_stepper_sample oid=%d stepper_count=%d"
+                           % (oid, len(self.stepper_names)))
+        mcu.add_config_cmd("query_stepper_sample oid=%d clock=0 rest_ticks=0"
+                           % (oid,), on_restart=True)
+        mcu.register_config_callback(self._build_config)
+        # Samples are delta encoded 16bit positions
+        chip_smooth = BATCH_UPDATES * 2. / self.sample_period
+        self.ffreader = bulk_sensor.FixedFreqReader(
+            mcu, chip_smooth, "<" + "h" * len(self.stepper_names),
+            compress_fields=len(self.stepper_names))
+        self.last_positions = []
+        # Process messages in batches
+        self.batch_bulk = bulk_sensor.BatchBulkHelper(
+            self.printer, self._process_batch,
+            self._start_measurements, self._finish_measurements, BATCH_UPDATES)
+        api_resp = {'header': ('time',) + tuple(self.stepper_names)}
+        self.batch_bulk.add_mux_endpoint("stepper_sample/dump_positions",
+                                         "sensor", self.name, api_resp)
+    def _build_config(self):
+        force_move = self.printer.lookup_object('force_move')
+        self.mcu_steppers = [force_move.lookup_stepper(n)
+                             for n in self.stepper_names]
+        for i, mcu_stepper in enumerate(self.mcu_steppers):
+            if mcu_stepper.get_mcu() is not self.mcu:
+                raise self.printer.config_error(
+                    "Steppers of stepper_sample '%s' must be on the same mcu"
+                    % (self.name,))
+            self.mcu.add_config_cmd(
+                "stepper_sample_set_stepper oid=%d pos=%d stepper_oid=%d"
+                % (self.oid, i, mcu_stepper.get_oid()), is_init=True)
+        cmdqueue = self.mcu.alloc_command_queue()
+        self.query_stepper_sample_cmd = self.mcu.lookup_command(
+            "query_stepper_sample oid=%c clock=%u rest_ticks=%u", cq=cmdqueue)
+        self.ffreader.setup_query_command("query_stepper_sample_status oid=%c",
+                                          oid=self.oid, cq=cmdqueue)
+    def add_client(self, client_cb):
+        self.batch_bulk.add_client(client_cb)
+    # Measurement decoding
+    def _convert_samples(self, samples):
+        # Extend the 16bit mcu positions to full positions
+        mcu_steppers = self.mcu_steppers
+        last_positions = self.last_positions
+        for i, sample in enumerate(samples):
+            samp_time = sample[0]
+            if not last_positions:
+                # Use the host step history to find the upper bits
+                for mcu_stepper in mcu_steppers:
+                    mcu_pos = mcu_stepper.get_past_mcu_position(samp_time)
+                    if mcu_stepper.get_dir_inverted()[0]:
+                        mcu_pos = -mcu_pos
+                    last_positions.append(mcu_pos)
+            for j, value in enumerate(sample[1:]):
+                pos_diff = (value - last_positions[j]) & 0xffff
+                pos_diff -= (pos_diff & 0x8000) << 1
+                last_positions[j] += pos_diff
+            samples[i] = (round(samp_time, 6),) + tuple([
+                -pos if ms.get_dir_inverted()[0] else pos
+                for ms, pos in zip(mcu_steppers, last_positions)])
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        logging.info("Starting stepper_sample '%s' measurements", self.name)
+        self.last_positions = []
+        systime = self.printer.get_reactor().monotonic()
+        print_time = self.mcu.estimated_print_time(systime) + MIN_MSG_TIME
+        reqclock = self.mcu.print_time_to_clock(print_time)
+        rest_ticks = self.mcu.seconds_to_clock(self.sample_period)
+        self.query_stepper_sample_cmd.send([self.oid, reqclock, rest_ticks],
+                                           reqclock=reqclock)
+        self.ffreader.note_start()
+    def _finish_measurements(self):
+        # Halt bulk reading
+        self.query_stepper_sample_cmd.send_wait_ack([self.oid, 0, 0])
+        self.ffreader.note_end()
+        logging.info("Stopped stepper_sample '%s' measurements", self.name)
+    def _process_batch(self, eventtime):
+        samples = self.ffreader.pull_samples()
+        if not samples:
+            return {}
+        self._convert_samples(samples)
+        return {'data': samples,
+                'overflows': self.ffreader.get_last_overflows()}
+
+def load_config_prefix(config):
+    return StepperSample(config)
@@ -0,0 +1,73 @@
+# Report step rate and step compression statistics of each stepper
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+class StepperStats:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.steppers = {}
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        self.printer.register_event_handler("print_stats:start",
+                                            self._handle_print_start)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("STEPPER_STATS", self.cmd_STEPPER_STATS,
+                               desc=self.cmd_STEPPER_STATS_help)
+    def _handle_connect(self):
+        force_move = self.printer.lookup_object('force_move')
+        self.steppers = dict(force_move.steppers)
+    def _handle_print_start(self):
+        self._reset()
+    def _reset(self):
+        for stepper in self.steppers.values():
+            stepper.reset_step_rate_stats()
+    def _get_stepper_stats(self, stepper):
+        rs = stepper.get_step_rate_stats()
+        mcu_freq = stepper.get_mcu().get_constant_float('CLOCK_FREQ')
+        max_step_rate = 0.
+        if rs.step_count:
+            max_step_rate = mcu_freq / max(1, rs.min_interval)
+        return {
+            'step_count': rs.step_count, 'move_count': rs.move_count,
+            'msg_bytes': rs.msg_bytes, 'clock_freq': mcu_freq,
+            'max_step_rate': round(max_step_rate, 1),
+            'max_bytes_per_second': rs.max_window_bytes,
+            'interval_histogram': list(rs.interval_hist),
+            'steps_per_move_histogram': list(rs.count_hist),
+            'bytes_per_second_histogram': list(rs.bytes_hist)}
+    cmd_STEPPER_STATS_help = "Report step rate and step compression statistics"
+    def cmd_STEPPER_STATS(self, gcmd):
+        if gcmd.get_int('RESET', 0):
+            self._reset()
+            gcmd.respond_info("Stepper statistics reset")
+            return
+        names = sorted(self.steppers.keys())
+        name = gcmd.get('STEPPER', None)
+        if name is not None:
+            if name not in self.steppers:
+                raise gcmd.error("Unknown stepper '%s'" % (name,))
+            names = [name]
+        msgs = []
+        for name in names:
+            st = self._get_stepper_stats(self.steppers[name])
+            steps_per_move = bytes_per_step = 0.
+            if st['move_count']:
+                steps_per_move = st['step_count'] / float(st['move_count'])
+            if st['step_count']:
+                bytes_per_step = st['msg_bytes'] / float(st['step_count'])
+            msgs.append("%s: steps=%d moves=%d steps_per_move=%.1f"
+                        " max_step_rate=%.0f bytes=%d bytes_per_step=%.3f"
+                        " max_bytes_per_second=%d"
+                        % (name, st['step_count'], st['move_count'],
+                           steps_per_move, st['max_step_rate'],
+                           st['msg_bytes'], bytes_per_step,
+                           st['max_bytes_per_second']))
+        gcmd.respond_info("\n".join(msgs))
+    def get_status(self, eventtime):
+        return {'steppers': {name: self._get_stepper_stats(stepper)
+                             for name, stepper in self.steppers.items()}}
+
+def load_config(config):
+    return StepperStats(config)
@@ -1,10 +1,11 @@
 # Common helper code for TMC stepper drivers
 #
-# Copyright (C) 2018-2020  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, collections
 import stepper
+from . import bulk_sensor
 
 
 ######################################################################
@@ -128,6 +129,21 @@ class TMCErrorCheck:
         if self.adc_temp_reg is not None:
             pheaters = self.printer.load_object(config, 'heaters')
             pheaters.register_monitor(config)
+        # Setup for mcu based polling of the status registers (if available)
+        self.poll_regs = []
+        self.poll_active = False
+        register_poll = getattr(mcu_tmc, 'register_poll', None)
+        if (register_poll is not None and self.adc_temp_reg is None
+            and not cs_actual_mask):
+            for reg_info in [self.drv_status_reg_info, self.gstat_reg_info]:
+                if reg_info is None:
+                    continue
+                cb = (lambda et, s, v, ri=reg_info:
+                      self._handle_poll(et, ri, s, v))
+                preg = register_poll(reg_info[1], reg_info[2], reg_info[3],
+                                     cb)
+                if preg is not None:
+                    self.poll_regs.append(preg)
     def _query_register(self, reg_info, try_clear=False):
         last_value, reg_name, mask, err_mask, cs_actual_mask = reg_info
         cleared_flags = 0
@@ -185,30 +201,58 @@ class TMCErrorCheck:
             self.printer.invoke_shutdown(str(e))
             return self.printer.get_reactor().NEVER
         return eventtime + 1.
+    def _handle_poll(self, eventtime, reg_info, status, value):
+        if not self.poll_active:
+            return
+        last_value, reg_name, mask, err_mask = reg_info[:4]
+        if not status and not value & err_mask:
+            if value & mask != last_value & mask:
+                fmt = self.fields.pretty_format(reg_name, value)
+                logging.info("TMC '%s' reports %s", self.stepper_name, fmt)
+            reg_info[0] = value
+            return
+        # Read failure or error flags reported - verify from the host
+        try:
+            self._query_register(reg_info)
+        except self.printer.command_error as e:
+            self.printer.invoke_shutdown(str(e))
+    def _start_poll(self):
+        if (not self.poll_regs
+            or not all([preg.is_available() for preg in self.poll_regs])):
+            return False
+        for preg in self.poll_regs:
+            preg.set_enable(True)
+        self.poll_active = True
+        return True
     def stop_checks(self):
+        if self.poll_active:
+            self.poll_active = False
+            for preg in self.poll_regs:
+                preg.set_enable(False)
         if self.check_timer is None:
             return
         self.printer.get_reactor().unregister_timer(self.check_timer)
         self.check_timer = None
     def start_checks(self):
-        if self.check_timer is not None:
+        if self.check_timer is not None or self.poll_active:
             self.stop_checks()
         cleared_flags = 0
         self._query_register(self.drv_status_reg_info)
         if self.gstat_reg_info is not None:
             cleared_flags = self._query_register(self.gstat_reg_info,
                                                  try_clear=self.clear_gstat)
-        reactor = self.printer.get_reactor()
-        curtime = reactor.monotonic()
-        self.check_timer = reactor.register_timer(self._do_periodic_check,
-                                                  curtime + 1.)
+        if not self._start_poll():
+            reactor = self.printer.get_reactor()
+            curtime = reactor.monotonic()
+            self.check_timer = reactor.register_timer(
+                self._do_periodic_check, curtime + 1.)
         if cleared_flags:
             reset_mask = self.fields.all_fields["GSTAT"]["reset"]
             if cleared_flags & reset_mask:
                 return True
         return False
     def get_status(self, eventtime=None):
-        if self.check_timer is None:
+        if self.check_timer is None and not self.poll_active:
             return {'drv_status': None, 'temperature': None}
         temp = None
         if self.adc_temp is not None:
@@ -249,6 +293,8 @@ class TMCCommandHelper:
                                             self._handle_connect)
         # Set microstep config options
         TMCMicrostepHelper(config, mcu_tmc)
+        # Setup mcu based StallGuard sampling (if supported)
+        self.load_sampler = TMCLoadSamplerHelper(config, mcu_tmc)
         # Register commands
         gcode = self.printer.lookup_object("gcode")
         gcode.register_mux_command("SET_TMC_FIELD", "STEPPER", self.name,
@@ -457,6 +503,161 @@ class TMCCommandHelper:
                 gcmd.respond_info(self.fields.pretty_format(reg_name, val))
 
 
+######################################################################
+# TMC load (StallGuard) sampling
+######################################################################
+
+LOAD_UPDATE_INTERVAL = 0.100
+LOAD_SAMPLE_ERROR = 0xffffffff
+
+# Accumulate statistics for the TMC_LOAD_MEASURE command
+class TMCLoadMeasure:
+    def __init__(self):
+        self.is_finished = False
+        self.count = self.sg_total = self.cs_total = 0
+        self.sg_min = self.sg_max = None
+    def handle_batch(self, msg):
+        if self.is_finished:
+            return False
+        for ptime, sg_result, cs_actual in msg['data']:
+            if self.sg_min is None or sg_result < self.sg_min:
+                self.sg_min = sg_result
+            if self.sg_max is None or sg_result > self.sg_max:
+                self.sg_max = sg_result
+            self.sg_total += sg_result
+            if cs_actual is not None:
+                self.cs_total += cs_actual
+            self.count += 1
+        return True
+
+# Periodic reading of the StallGuard result on the mcu
+class TMCLoadSampler:
+    def __init__(self, config, mcu_tmc, reg_name, sample_config):
+        self.printer = config.get_printer()
+        self.name = config.get_name().split()[-1]
+        self.fields = mcu_tmc.get_fields()
+        self.reg_name = reg_name
+        self.mcu, self.set_cmd, default_rate = sample_config
+        reg_fields = self.fields.all_fields[reg_name]
+        self.has_cs_actual = "cs_actual" in reg_fields
+        self.sample_rate = config.getfloat("load_sample_rate", default_rate,
+                                           above=0., maxval=5000.)
+        self.oid = self.mcu.create_oid()
+        self.query_cmd = None
+        self.errors = 0
+        self.measure = None
+        # Clock tracking
+        chip_smooth = self.sample_rate * LOAD_UPDATE_INTERVAL * 2
+        self.ffreader = bulk_sensor.FixedFreqReader(self.mcu, chip_smooth,
+                                                    "<I")
+        # Process messages in batches
+        self.batch_bulk = bulk_sensor.BatchBulkHelper(
+            self.printer, self._process_batch, self._start_measurements,
+            self._finish_measurements, LOAD_UPDATE_INTERVAL)
+        hdr = {'header': ('time', 'sg_result', 'cs_actual')}
+        self.batch_bulk.add_mux_endpoint("tmc/dump_load", "stepper",
+                                         self.name, hdr)
+        self.mcu.register_config_callback(self._build_config)
+        # Register commands
+        gcode = self.printer.lookup_object("gcode")
+        gcode.register_mux_command("TMC_LOAD_MEASURE", "STEPPER", self.name,
+                                   self.cmd_TMC_LOAD_MEASURE,
+                                   desc=self.cmd_TMC_LOAD_MEASURE_help)
+    def _build_config(self):
+        cmd = "query_tmc_sample oid=%c rest_ticks=%u"
+        self.query_cmd = self.mcu.try_lookup_command(cmd)
+        if self.query_cmd is None:
+            # Mcu code does not support register sampling
+            return
+        self.mcu.add_config_cmd("config_tmc_sample oid=%d" % (self.oid,))
+        # The bus may be configured after this object - so set it during init
+        self.mcu.add_config_cmd(self.set_cmd % (self.oid,), is_init=True)
+        self.mcu.add_config_cmd("query_tmc_sample oid=%d rest_ticks=0"
+                                % (self.oid,), on_restart=True)
+        self.ffreader.setup_query_command("query_tmc_sample_status oid=%c",
+                                          oid=self.oid,
+                                          cq=self.mcu.alloc_command_queue())
+    # add_client interface, direct pass through to bulk_sensor API
+    def add_client(self, callback):
+        self.batch_bulk.add_client(callback)
+    # Measurement decoding
+    def _convert_samples(self, samples):
+        fields = self.fields
+        count = 0
+        for ptime, val in samples:
+            if val == LOAD_SAMPLE_ERROR:
+                # Read failed (or the uart was in use by the host)
+                self.errors += 1
+                continue
+            sg_result = fields.get_field("sg_result", val, self.reg_name)
+            cs_actual = None
+            if self.has_cs_actual:
+                cs_actual = fields.get_field("cs_actual", val, self.reg_name)
+            samples[count] = (round(ptime, 6), sg_result, cs_actual)
+            count += 1
+        del samples[count:]
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        if self.query_cmd is None:
+            raise self.printer.command_error(
+                "mcu does not support tmc load sampling")
+        self.errors = 0
+        rest_ticks = self.mcu.seconds_to_clock(1. / self.sample_rate)
+        self.query_cmd.send([self.oid, rest_ticks])
+        logging.info("Starting tmc '%s' load measurements", self.name)
+        # Initialize clock tracking
+        self.ffreader.note_start()
+    def _finish_measurements(self):
+        # Don't use serial connection after shutdown
+        if self.printer.is_shutdown():
+            return
+        # Halt bulk reading
+        self.query_cmd.send_wait_ack([self.oid, 0])
+        self.ffreader.note_end()
+        logging.info("Stopped tmc '%s' load measurements", self.name)
+    def _process_batch(self, eventtime):
+        samples = self.ffreader.pull_samples()
+        self._convert_samples(samples)
+        if not samples:
+            return {}
+        return {'data': samples, 'errors': self.errors,
+                'overflows': self.ffreader.get_last_overflows()}
+    cmd_TMC_LOAD_MEASURE_help = "Start/stop measuring the StallGuard load"
+    def cmd_TMC_LOAD_MEASURE(self, gcmd):
+        if self.query_cmd is None:
+            raise gcmd.error("mcu does not support tmc load sampling")
+        measure = self.measure
+        if measure is None:
+            self.measure = TMCLoadMeasure()
+            self.add_client(self.measure.handle_batch)
+            gcmd.respond_info("Load measurements started for '%s'"
+                              % (self.name,))
+            return
+        self.measure = None
+        measure.is_finished = True
+        if not measure.count:
+            raise gcmd.error("No load measurements obtained for '%s'"
+                             % (self.name,))
+        msg = ("sg_result: min=%d avg=%.1f max=%d (%d samples, %d errors)"
+               % (measure.sg_min, float(measure.sg_total) / measure.count,
+                  measure.sg_max, measure.count, self.errors))
+        if self.has_cs_actual:
+            msg += "\ncs_actual: avg=%.1f" % (
+                float(measure.cs_total) / measure.count,)
+        gcmd.respond_info(msg)
+
+# Setup load sampling for drivers with a StallGuard result register
+def TMCLoadSamplerHelper(config, mcu_tmc):
+    setup_sampling = getattr(mcu_tmc, 'setup_register_sampling', None)
+    reg_name = mcu_tmc.get_fields().lookup_register("sg_result")
+    if setup_sampling is None or reg_name is None:
+        return None
+    sample_config = setup_sampling(reg_name)
+    if sample_config is None:
+        return None
+    return TMCLoadSampler(config, mcu_tmc, reg_name, sample_config)
+
+
 ######################################################################
 # TMC virtual pins
 ######################################################################
@@ -182,6 +182,9 @@ class TMCCurrentHelper:
 # TMC2130 SPI
 ######################################################################
 
+TMC_SAMPLE_RATE = 1000.
+TMC_SAMPLE_MAX_CHAIN = 8
+
 class MCU_TMC_SPI_chain:
     def __init__(self, config, chain_len=1):
         self.printer = config.get_printer()
@@ -198,10 +201,12 @@ class MCU_TMC_SPI_chain:
                 data + [0x00] * ((chain_pos - 1) * 5))
     def reg_read(self, reg, chain_pos):
         cmd = self._build_cmd([reg, 0x00, 0x00, 0x00, 0x00], chain_pos)
-        self.spi.spi_send(cmd)
         if self.printer.get_start_args().get('debugoutput') is not None:
+            self.spi.spi_send(cmd)
             return 0
-        params = self.spi.spi_transfer(cmd)
+        # Send both transfers together so that mcu based register
+        # sampling can not run between them
+        params = self.spi.spi_transfer_with_preface(cmd, cmd)
         pr = bytearray(params['response'])
         pr = pr[(self.chain_len - chain_pos) * 5 :
                 (self.chain_len - chain_pos + 1) * 5]
@@ -223,6 +228,16 @@ class MCU_TMC_SPI_chain:
         pr = pr[(self.chain_len - chain_pos) * 5 :
                 (self.chain_len - chain_pos + 1) * 5]
         return (pr[1] << 24) | (pr[2] << 16) | (pr[3] << 8) | pr[4]
+    def setup_register_sampling(self, reg, chain_pos):
+        if self.chain_len > TMC_SAMPLE_MAX_CHAIN:
+            return None
+        cmd = self._build_cmd([reg, 0x00, 0x00, 0x00, 0x00], chain_pos)
+        value_pos = (self.chain_len - chain_pos) * 5 + 1
+        request_msg = "".join(["%02x" % (x,) for x in cmd])
+        set_cmd = ("tmc_sample_set_spi oid=%%d spi_oid=%d request=%s"
+                   " value_pos=%d" % (self.spi.get_oid(), request_msg,
+                                      value_pos))
+        return self.spi.get_mcu(), set_cmd, TMC_SAMPLE_RATE
 
 # Helper to setup an spi daisy chain bus from settings in a config section
 def lookup_tmc_spi_chain(config):
@@ -272,6 +287,9 @@ class MCU_TMC_SPI:
                     return
         raise self.printer.command_error(
             "Unable to write tmc spi '%s' register %s" % (self.name, reg_name))
+    def setup_register_sampling(self, reg_name):
+        reg = self.name_to_reg[reg_name]
+        return self.tmc_spi.setup_register_sampling(reg, self.chain_pos)
     def get_tmc_frequency(self):
         return self.tmc_frequency
 
@@ -1,9 +1,10 @@
 # Helper code for communicating with TMC stepper drivers via UART
 #
-# Copyright (C) 2018-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+from . import bus
 
 
 ######################################################################
@@ -58,29 +59,111 @@ class MCU_analog_mux:
 class PrinterTMCUartMutexes:
     def __init__(self):
         self.mcu_to_mutex = {}
-def lookup_tmc_uart_mutex(mcu):
-    printer = mcu.get_printer()
+        self.mcu_to_poll = {}
+def lookup_tmc_uart_printer_object(printer):
     pmutexes = printer.lookup_object('tmc_uart', None)
     if pmutexes is None:
         pmutexes = PrinterTMCUartMutexes()
         printer.add_object('tmc_uart', pmutexes)
+    return pmutexes
+def lookup_tmc_uart_mutex(mcu):
+    printer = mcu.get_printer()
+    pmutexes = lookup_tmc_uart_printer_object(printer)
     mutex = pmutexes.mcu_to_mutex.get(mcu)
     if mutex is None:
         mutex = printer.get_reactor().mutex()
         pmutexes.mcu_to_mutex[mcu] = mutex
     return mutex
 
+TMC_POLL_TIME = 1.
+
+# Periodic reading of tmc registers on the mcu.  The mcu reads the
+# registers of all drivers on a timer and only reports values that
+# changed, values with error bits set, and read failures.
+class MCU_TMC_uart_poll:
+    def __init__(self, mcu):
+        self.mcu = mcu
+        self.reactor = mcu.get_printer().get_reactor()
+        self.oid = mcu.create_oid()
+        self.regs = []
+        self.callbacks = []
+        self.enable_cmd = None
+        mcu.register_config_callback(self.build_config)
+    def add_register(self, mcu_uart, reg, request, mask, err_mask, callback):
+        self.regs.append((mcu_uart, reg, request, mask, err_mask))
+        self.callbacks.append(callback)
+        return len(self.regs) - 1
+    def build_config(self):
+        cmd = "config_tmcuart_poll oid=%c reg_count=%c"
+        if self.mcu.try_lookup_command(cmd) is None:
+            # Mcu code does not support polling - use host based checks
+            return
+        self.mcu.add_config_cmd("config_tmcuart_poll oid=%d reg_count=%d"
+                                % (self.oid, len(self.regs)))
+        # The registers reference tmcuart objects that may be configured
+        # after this object - so setup the registers during init
+        for pos, (mcu_uart, reg, request, mask,
+                  err_mask) in enumerate(self.regs):
+            request_msg = "".join(["%02x" % (x,) for x in request])
+            self.mcu.add_config_cmd(
+                "tmcuart_poll_set_reg oid=%d pos=%d tmcuart_oid=%d reg=%d"
+                " request=%s mask=%d err_mask=%d"
+                % (self.oid, pos, mcu_uart.oid, reg, request_msg,
+                   mask, err_mask), is_init=True)
+        clock = self.mcu.get_query_slot(self.oid)
+        rest_ticks = self.mcu.seconds_to_clock(TMC_POLL_TIME)
+        self.mcu.add_config_cmd(
+            "tmcuart_poll_query oid=%d clock=%d rest_ticks=%d"
+            % (self.oid, clock, rest_ticks), is_init=True)
+        self.enable_cmd = self.mcu.lookup_command(
+            "tmcuart_poll_enable oid=%c pos=%c enable=%c")
+        self.mcu.register_response(self._handle_poll_result,
+                                   "tmcuart_poll_result", self.oid)
+    def _handle_poll_result(self, params):
+        data = bytearray(params['data'])
+        for i in range(0, len(data) - 5, 6):
+            pos, status = data[i], data[i+1]
+            value = (data[i+2] | (data[i+3] << 8) | (data[i+4] << 16)
+                     | (data[i+5] << 24))
+            cb = self.callbacks[pos]
+            self.reactor.register_async_callback(
+                (lambda et, cb=cb, s=status, v=value: cb(et, s, v)))
+    def is_available(self):
+        return self.enable_cmd is not None
+    def set_enable(self, pos, enable):
+        self.enable_cmd.send([self.oid, pos, not not enable])
+def lookup_tmc_uart_poll(mcu):
+    pmutexes = lookup_tmc_uart_printer_object(mcu.get_printer())
+    poll = pmutexes.mcu_to_poll.get(mcu)
+    if poll is None:
+        poll = MCU_TMC_uart_poll(mcu)
+        pmutexes.mcu_to_poll[mcu] = poll
+    return poll
+
+# Handle to a register read by MCU_TMC_uart_poll
+class TMCUartPollRegister:
+    def __init__(self, poll, pos):
+        self.poll = poll
+        self.pos = pos
+    def is_available(self):
+        return self.poll.is_available()
+    def set_enable(self, enable):
+        self.poll.set_enable(self.pos, enable)
+
 TMC_BAUD_RATE = 40000
 TMC_BAUD_RATE_AVR = 9000
+TMC_SAMPLE_RATE = 100.
 
 # Code for sending messages on a TMC uart
 class MCU_TMC_uart_bitbang:
-    def __init__(self, rx_pin_params, tx_pin_params, select_pins_desc):
+    def __init__(self, rx_pin_params, tx_pin_params, select_pins_desc,
+                 uart_bus=None):
         self.mcu = rx_pin_params['chip']
         self.mutex = lookup_tmc_uart_mutex(self.mcu)
         self.pullup = rx_pin_params['pullup']
         self.rx_pin = rx_pin_params['pin']
         self.tx_pin = tx_pin_params['pin']
+        self.uart_bus = uart_bus
         self.oid = self.mcu.create_oid()
         self.cmd_queue = self.mcu.alloc_command_queue()
         self.analog_mux = None
@@ -95,18 +178,37 @@ class MCU_TMC_uart_bitbang:
         mcu_type = self.mcu.get_constants().get("MCU", "")
         if mcu_type.startswith("atmega") or mcu_type.startswith("at90usb"):
             baud = TMC_BAUD_RATE_AVR
-        bit_ticks = self.mcu.seconds_to_clock(1. / baud)
-        self.mcu.add_config_cmd(
-            "config_tmcuart oid=%d rx_pin=%s pull_up=%d tx_pin=%s bit_time=%d"
-            % (self.oid, self.rx_pin, self.pullup, self.tx_pin, bit_ticks))
+        if self.uart_bus is not None:
+            self._build_bus_config(baud)
+        else:
+            bit_ticks = self.mcu.seconds_to_clock(1. / baud)
+            self.mcu.add_config_cmd(
+                "config_tmcuart oid=%d rx_pin=%s pull_up=%d tx_pin=%s"
+                " bit_time=%d" % (self.oid, self.rx_pin, self.pullup,
+                                  self.tx_pin, bit_ticks))
         self.tmcuart_send_cmd = self.mcu.lookup_query_command(
             "tmcuart_send oid=%c write=%*s read=%c",
             "tmcuart_response oid=%c read=%*s", oid=self.oid,
             cq=self.cmd_queue, is_async=True)
+    def _build_bus_config(self, baud):
+        # Use a hardware uart on the mcu
+        ppins = self.mcu.get_printer().lookup_object("pins")
+        if "uart_bus" not in self.mcu.get_enumerations():
+            raise ppins.error("MCU '%s' does not support uart_bus"
+                              % (self.mcu.get_name(),))
+        bus_name = bus.resolve_bus_name(self.mcu, "uart_bus", self.uart_bus)
+        constants = self.mcu.get_constants()
+        bus_pins = constants.get('BUS_PINS_%s' % (bus_name,), "").split(',')
+        if self.rx_pin not in bus_pins:
+            raise ppins.error("TMC uart_pin %s is not the pin of uart_bus %s"
+                              % (self.rx_pin, bus_name))
+        self.mcu.add_config_cmd("config_tmcuart_bus oid=%d uart_bus=%s baud=%d"
+                                % (self.oid, bus_name, baud))
     def register_instance(self, rx_pin_params, tx_pin_params,
-                          select_pins_desc, addr):
+                          select_pins_desc, uart_bus, addr):
         if (rx_pin_params['pin'] != self.rx_pin
             or tx_pin_params['pin'] != self.tx_pin
+            or uart_bus != self.uart_bus
             or (select_pins_desc is None) != (self.analog_mux is None)):
             raise self.mcu.get_printer().config_error(
                 "Shared TMC uarts must use the same pins")
@@ -176,6 +278,17 @@ class MCU_TMC_uart_bitbang:
         msg = self._encode_read(0xf5, addr, reg)
         params = self.tmcuart_send_cmd.send([self.oid, msg, 10])
         return self._decode_read(reg, params['read'])
+    def register_poll(self, addr, reg, mask, err_mask, callback):
+        poll = lookup_tmc_uart_poll(self.mcu)
+        msg = self._encode_read(0xf5, addr, reg)
+        pos = poll.add_register(self, reg, msg, mask, err_mask, callback)
+        return TMCUartPollRegister(poll, pos)
+    def setup_register_sampling(self, addr, reg):
+        msg = self._encode_read(0xf5, addr, reg)
+        request_msg = "".join(["%02x" % (x,) for x in msg])
+        set_cmd = ("tmc_sample_set_uart oid=%%d tmcuart_oid=%d reg=%d"
+                   " request=%s" % (self.oid, reg, request_msg))
+        return self.mcu, set_cmd, TMC_SAMPLE_RATE
     def reg_write(self, instance_id, addr, reg, val, print_time=None):
         minclock = 0
         if print_time is not None:
@@ -197,15 +310,18 @@ def lookup_tmc_uart_bitbang(config, max_addr):
         tx_pin_params = ppins.lookup_pin(tx_pin_desc, share_type="tmc_uart_tx")
     if rx_pin_params['chip'] is not tx_pin_params['chip']:
         raise ppins.error("TMC uart rx and tx pins must be on the same mcu")
+    uart_bus = config.get('uart_bus', None)
+    if uart_bus is not None and tx_pin_desc is not None:
+        raise config.error("TMC uart_bus may not be used with tx_pin")
     select_pins_desc = config.getlist('select_pins', None)
     addr = config.getint('uart_address', 0, minval=0, maxval=max_addr)
     mcu_uart = rx_pin_params.get('class')
     if mcu_uart is None:
         mcu_uart = MCU_TMC_uart_bitbang(rx_pin_params, tx_pin_params,
-                                        select_pins_desc)
+                                        select_pins_desc, uart_bus)
         rx_pin_params['class'] = mcu_uart
     instance_id = mcu_uart.register_instance(rx_pin_params, tx_pin_params,
-                                             select_pins_desc, addr)
+                                             select_pins_desc, uart_bus, addr)
     return instance_id, addr, mcu_uart
 
 # Helper code for communicating via TMC uart
@@ -251,5 +367,20 @@ class MCU_TMC_uart:
                     return
         raise self.printer.command_error(
             "Unable to write tmc uart '%s' register %s" % (self.name, reg_name))
+    def register_poll(self, reg_name, mask, err_mask, callback):
+        # Only uarts without an analog mux can be polled by the mcu
+        if self.mcu_uart.analog_mux is not None:
+            return None
+        if self.printer.get_start_args().get('debugoutput') is not None:
+            return None
+        reg = self.name_to_reg[reg_name]
+        return self.mcu_uart.register_poll(self.addr, reg, mask, err_mask,
+                                           callback)
+    def setup_register_sampling(self, reg_name):
+        # Only uarts without an analog mux can be sampled by the mcu
+        if self.mcu_uart.analog_mux is not None:
+            return None
+        reg = self.name_to_reg[reg_name]
+        return self.mcu_uart.setup_register_sampling(self.addr, reg)
     def get_tmc_frequency(self):
         return self.tmc_frequency
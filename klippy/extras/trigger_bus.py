@@ -0,0 +1,68 @@
+# Wired trigger line shared between micro-controllers
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import mcu
+
+PULSE_TIME = 0.001
+POLL_TIME = 0.000100
+
+# Bus pin on a single micro-controller
+class MCU_trigger_bus:
+    def __init__(self, mcu, pin_params):
+        self._mcu = mcu
+        self._oid = mcu.create_oid()
+        self._pin = pin_params['pin']
+        self._pullup = pin_params['pullup']
+        mcu.register_config_callback(self._build_config)
+    def _build_config(self):
+        self._mcu.add_config_cmd(
+            "config_trsync_bus oid=%d pin=%s pull_up=%d pulse_ticks=%d"
+            " poll_ticks=%d" % (self._oid, self._pin, self._pullup,
+                                self._mcu.seconds_to_clock(PULSE_TIME),
+                                self._mcu.seconds_to_clock(POLL_TIME)))
+    def start(self, trsync, print_time):
+        # Must use the trsync command queue so that the command is
+        # sent after trsync_start
+        cmd = self._mcu.lookup_command(
+            "trsync_bus_start oid=%c trsync_oid=%c trigger_reason=%c"
+            " clock=%u", cq=trsync.get_command_queue())
+        clock = self._mcu.print_time_to_clock(print_time)
+        cmd.send([self._oid, trsync.get_oid(), trsync.REASON_HOST_REQUEST,
+                  clock], reqclock=clock)
+
+class TriggerBus:
+    def __init__(self, config):
+        self._printer = config.get_printer()
+        ppins = self._printer.lookup_object('pins')
+        self._mcu_buses = {}
+        for pin_desc in config.getlist('pins'):
+            pin_params = ppins.lookup_pin(pin_desc, can_pullup=True)
+            chip = pin_params['chip']
+            if not isinstance(chip, mcu.MCU):
+                raise config.error("trigger_bus pin '%s' must be on a"
+                                   " micro-controller" % (pin_desc,))
+            if chip in self._mcu_buses:
+                raise config.error("trigger_bus may only have one pin per"
+                                   " micro-controller")
+            self._mcu_buses[chip] = MCU_trigger_bus(chip, pin_params)
+        self._is_active = False
+    # Attach the bus to the trsyncs of a homing operation - returns
+    # True if the bus is in use for the operation
+    def start(self, trsyncs, print_time):
+        if self._is_active:
+            # Another homing operation owns the wire
+            return False
+        buses = [self._mcu_buses.get(trsync.get_mcu()) for trsync in trsyncs]
+        if None in buses:
+            return False
+        for bus, trsync in zip(buses, trsyncs):
+            bus.start(trsync, print_time)
+        self._is_active = True
+        return True
+    def stop(self):
+        self._is_active = False
+
+def load_config(config):
+    return TriggerBus(config)
@@ -44,8 +44,14 @@ class HeaterCheck:
         if self.check_timer is not None:
             reactor = self.printer.get_reactor()
             reactor.update_timer(self.check_timer, reactor.NEVER)
+    def get_params(self):
+        return (self.hysteresis, self.max_error, self.heating_gain,
+                self.check_gain_time)
     def check_event(self, eventtime):
         temp, target = self.heater.get_temp(eventtime)
+        if self.heater.is_mcu_control():
+            # These checks are performed by the mcu
+            target = 0.
         if temp >= target - self.hysteresis or target <= 0.:
             # Temperature near target - reset checks
             if self.approaching_target and target:
@@ -0,0 +1,107 @@
+# Monitor vibration levels using summaries computed on the mcu
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, math, struct
+
+MAX_BANDS = 4
+MAX_SAMPLES = 1024
+COEFF_BITS = 14
+
+class VibrationMonitor:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        chip_name = config.get('accel_chip', 'adxl345').strip()
+        self.chip = self.printer.load_object(config, chip_name)
+        if not hasattr(self.chip, 'setup_spectrum'):
+            raise config.error("accel_chip '%s' does not support"
+                               " vibration summaries" % (chip_name,))
+        self.frequencies = config.getfloatlist('frequencies', ())
+        if len(self.frequencies) > MAX_BANDS:
+            raise config.error("At most %d frequencies may be monitored"
+                               % (MAX_BANDS,))
+        report_time = config.getfloat('report_time', .250, above=0.)
+        self.enabled = config.getboolean('enable', True)
+        # Setup mcu summaries
+        self.mcu = self.chip.mcu
+        self.oid = self.mcu.create_oid()
+        rate, axes_map = self.chip.setup_spectrum(self.oid)
+        self.sample_count = int(rate * report_time + .5)
+        if self.sample_count < 8 or self.sample_count > MAX_SAMPLES:
+            raise config.error("report_time must cover between 8 and %d"
+                               " accelerometer samples" % (MAX_SAMPLES,))
+        self.scale = sum([abs(s) for p, s in axes_map]) / len(axes_map)
+        self.mcu.add_config_cmd("config_sensor_spectrum oid=%d sample_count=%d"
+                                % (self.oid, self.sample_count))
+        resolution = float(rate) / self.sample_count
+        for i, freq in enumerate(self.frequencies):
+            if freq < 2. * resolution or freq > .5 * rate - resolution:
+                raise config.error(
+                    "vibration_monitor frequency %.1f must be between"
+                    " %.1f and %.1f" % (freq, 2. * resolution,
+                                        .5 * rate - resolution))
+            coeff = 2. * math.cos(2. * math.pi * freq / rate)
+            coeff = min(int(coeff * (1 << COEFF_BITS) + .5), 0x7fff)
+            self.mcu.add_config_cmd(
+                "sensor_spectrum_set_band oid=%d band=%d coeff=%d"
+                % (self.oid, i, coeff))
+        self.mcu.register_response(self._handle_spectrum_data,
+                                   "sensor_spectrum_data", self.oid)
+        self.last_params = None
+        self.printer.register_event_handler("klippy:ready",
+                                            self._handle_ready)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("VIBRATION_MONITOR", self.cmd_VIBRATION_MONITOR,
+                               desc=self.cmd_VIBRATION_MONITOR_help)
+    def _handle_ready(self):
+        if self.enabled and not self.mcu.is_fileoutput():
+            reactor = self.printer.get_reactor()
+            reactor.register_callback(self._start)
+    def _start(self, eventtime):
+        try:
+            self.chip.start_spectrum()
+        except self.printer.command_error:
+            logging.exception("vibration_monitor start error")
+    def _handle_spectrum_data(self, params):
+        # Called from background thread - decode in get_status()
+        self.last_params = params
+    def _decode(self):
+        params = self.last_params
+        if params is None:
+            return 0., [0.] * len(self.frequencies), 0.
+        data = bytearray(params['data'])
+        count = len(data) // 4
+        values = struct.unpack('<%dI' % (count,), bytes(data[:count*4]))
+        accels = [math.sqrt(v) * self.scale for v in values]
+        accels += [0.] * (1 + len(self.frequencies) - len(accels))
+        clock = self.mcu.clock32_to_clock64(params['clock'])
+        return (accels[0], accels[1:1+len(self.frequencies)],
+                self.mcu.clock_to_print_time(clock))
+    def get_status(self, eventtime):
+        rms, bands, sample_time = self._decode()
+        return {'enabled': self.enabled, 'rms': round(rms, 3),
+                'frequencies': list(self.frequencies),
+                'bands': [round(b, 3) for b in bands],
+                'sample_time': sample_time}
+    cmd_VIBRATION_MONITOR_help = "Enable/disable or report vibration levels"
+    def cmd_VIBRATION_MONITOR(self, gcmd):
+        enable = gcmd.get_int('ENABLE', None, minval=0, maxval=1)
+        if enable is not None:
+            self.enabled = bool(enable)
+            if self.enabled:
+                self.chip.start_spectrum()
+            else:
+                self.chip.stop_spectrum()
+                self.last_params = None
+        if not self.enabled:
+            gcmd.respond_info("Vibration monitor disabled")
+            return
+        rms, bands, sample_time = self._decode()
+        msg = ["rms=%.1f" % (rms,)]
+        for freq, b in zip(self.frequencies, bands):
+            msg.append("%.1fHz=%.1f" % (freq, b))
+        gcmd.respond_info("Vibration (mm/s^2): " + " ".join(msg))
+
+def load_config(config):
+    return VibrationMonitor(config)
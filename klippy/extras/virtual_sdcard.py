@@ -3,7 +3,8 @@
 # Copyright (C) 2018-2024  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, sys, logging, io
+import os, sys, logging, io, threading, collections, struct, zlib
+import chelper
 
 VALID_GCODE_EXTS = ['gcode', 'g', 'gco']
 
@@ -13,6 +14,199 @@ DEFAULT_ERROR_GCODE = """
 {% endif %}
 """
 
+READ_SIZE = 64 * 1024
+READ_AHEAD_SIZE = 4 * 1024 * 1024
+DISPATCH_BATCH = 64
+
+# The optional "gcode cache" stores the tokenized lines of a file (as
+# produced by gcode_parse_moves() and stored by gcode_pack_moves()).
+# The cache contains a header followed by a series of blocks - each
+# block describes a run of complete lines in the original file and
+# contains a crc32 of that text.
+CACHE_MAGIC = b"KLGCACHE"
+CACHE_VERSION = 1
+CACHE_HEADER = struct.Struct("<8sIQd")
+CACHE_BLOCK = struct.Struct("<IIII")
+CACHE_SUFFIX = ".kcache"
+
+def get_cache_filename(filename):
+    dirname, basename = os.path.split(filename)
+    return os.path.join(dirname, "." + basename + CACHE_SUFFIX)
+
+# Helper to read, split, and tokenize upcoming file data in a
+# background thread
+class FileReadAhead:
+    def __init__(self, fileobj, cache_filename=None):
+        self.file = fileobj
+        self.ffi_main, ffi_lib = chelper.get_ffi()
+        self.gcode_parse_moves = ffi_lib.gcode_parse_moves
+        self.gcode_pack_moves = ffi_lib.gcode_pack_moves
+        self.gcode_unpack_moves = ffi_lib.gcode_unpack_moves
+        self.cond = threading.Condition()
+        self.chunks = collections.deque()
+        self.buffered = 0
+        self.is_eof = self.is_error = self.must_stop = False
+        if hasattr(os, 'posix_fadvise'):
+            try:
+                os.posix_fadvise(fileobj.fileno(), 0, 0,
+                                 os.POSIX_FADV_SEQUENTIAL)
+            except:
+                pass
+        self.cache_filename = cache_filename
+        self.cache_in = self.cache_out = None
+        if cache_filename is not None:
+            self._open_cache()
+        self.background_thread = threading.Thread(target=self._bg_thread)
+        self.background_thread.daemon = True
+        self.background_thread.start()
+    # Cache file handling
+    def _open_cache(self):
+        st = os.fstat(self.file.fileno())
+        header = CACHE_HEADER.pack(CACHE_MAGIC, CACHE_VERSION,
+                                   st.st_size, st.st_mtime)
+        try:
+            f = io.open(self.cache_filename, 'rb')
+            if f.read(len(header)) == header:
+                logging.info("Using gcode cache %s", self.cache_filename)
+                self.cache_in = f
+                return
+            f.close()
+        except (IOError, OSError):
+            pass
+        try:
+            self.cache_out = io.open(self.cache_filename + ".tmp", 'wb')
+            self.cache_out.write(header)
+        except (IOError, OSError):
+            logging.exception("virtual_sdcard cache create")
+            self.cache_out = None
+    def _close_cache(self, is_complete=False):
+        if self.cache_in is not None:
+            self.cache_in.close()
+            self.cache_in = None
+            if not is_complete:
+                logging.info("Discarding invalid gcode cache %s",
+                             self.cache_filename)
+                try:
+                    os.remove(self.cache_filename)
+                except OSError:
+                    pass
+        if self.cache_out is not None:
+            tmpname = self.cache_filename + ".tmp"
+            try:
+                self.cache_out.close()
+                if is_complete:
+                    os.rename(tmpname, self.cache_filename)
+                else:
+                    os.remove(tmpname)
+            except (IOError, OSError):
+                logging.exception("virtual_sdcard cache close")
+            self.cache_out = None
+    def _read_cached(self):
+        # Read the next block of lines using the tokens stored in the cache
+        hdr = self.cache_in.read(CACHE_BLOCK.size)
+        if len(hdr) < CACHE_BLOCK.size:
+            self._close_cache(is_complete=not hdr)
+            return None
+        text_len, crc, count, packed_len = CACHE_BLOCK.unpack(hdr)
+        packed = self.cache_in.read(packed_len)
+        data = self.file.read(text_len)
+        if (len(packed) == packed_len and len(data) == text_len
+            and zlib.crc32(data) & 0xffffffff == crc):
+            lines = data.split(b'\n')
+            lines.pop()
+            move_lines = self.ffi_main.new('struct gcode_move_line[]', count)
+            if (len(lines) == count and not self.gcode_unpack_moves(
+                    move_lines, count, packed, packed_len)):
+                return lines, move_lines, text_len
+        # Cache does not match file - continue with text file
+        self.file.seek(-len(data), os.SEEK_CUR)
+        self._close_cache()
+        return None
+    def _write_cached(self, data, move_lines, count):
+        buf = self.ffi_main.new('uint8_t[]', count * 41)
+        packed_len = self.gcode_pack_moves(move_lines, count, buf)
+        try:
+            self.cache_out.write(CACHE_BLOCK.pack(
+                len(data), zlib.crc32(data) & 0xffffffff, count, packed_len))
+            self.cache_out.write(self.ffi_main.buffer(buf, packed_len)[:])
+        except (IOError, OSError):
+            logging.exception("virtual_sdcard cache write")
+            self._close_cache()
+    # Background reading
+    def _read_text(self, partial_input):
+        data = self.file.read(READ_SIZE)
+        if not data:
+            return None, partial_input
+        data = partial_input + data
+        last_nl = data.rfind(b'\n')
+        if last_nl < 0:
+            return (), data
+        partial_input = data[last_nl+1:]
+        data = data[:last_nl+1]
+        lines = data.split(b'\n')
+        lines.pop()
+        count = len(lines)
+        move_lines = self.ffi_main.new('struct gcode_move_line[]', count)
+        self.gcode_parse_moves(move_lines, count, data, len(data) - 1)
+        if self.cache_out is not None:
+            self._write_cached(data, move_lines, count)
+        return (lines, move_lines, len(data)), partial_input
+    def _bg_thread(self):
+        partial_input = b""
+        while 1:
+            with self.cond:
+                while self.buffered >= READ_AHEAD_SIZE and not self.must_stop:
+                    self.cond.wait()
+                if self.must_stop:
+                    break
+            try:
+                chunk = None
+                if self.cache_in is not None:
+                    chunk = self._read_cached()
+                if chunk is None:
+                    chunk, partial_input = self._read_text(partial_input)
+            except:
+                logging.exception("virtual_sdcard read")
+                with self.cond:
+                    self.is_error = True
+                break
+            if chunk is None:
+                self._close_cache(is_complete=True)
+                with self.cond:
+                    self.is_eof = True
+                return
+            if not chunk:
+                continue
+            with self.cond:
+                self.chunks.append(chunk)
+                self.buffered += chunk[2]
+        self._close_cache()
+    def pop_lines(self):
+        # Returns a tuple (lines, move_lines) of upcoming complete lines
+        # (or None if none are ready yet)
+        with self.cond:
+            if not self.chunks:
+                return None
+            lines, move_lines, size = self.chunks.popleft()
+            self.buffered -= size
+            self.cond.notify()
+            return lines, move_lines
+    def check_done(self):
+        # Returns "eof", "error", or None if more data may be available
+        with self.cond:
+            if self.chunks:
+                return None
+            if self.is_error:
+                return "error"
+            if self.is_eof:
+                return "eof"
+            return None
+    def stop(self):
+        with self.cond:
+            self.must_stop = True
+            self.cond.notify()
+        self.background_thread.join()
+
 class VirtualSD:
     def __init__(self, config):
         self.printer = config.get_printer()
@@ -23,13 +217,14 @@ class VirtualSD:
         self.sdcard_dirname = os.path.normpath(os.path.expanduser(sd))
         self.current_file = None
         self.file_position = self.file_size = 0
+        self.use_gcode_cache = config.getboolean('gcode_cache', False)
         # Print Stat Tracking
         self.print_stats = self.printer.load_object(config, 'print_stats')
         # Work timer
         self.reactor = self.printer.get_reactor()
         self.must_pause_work = self.cmd_from_sd = False
         self.next_file_position = 0
-        self.work_timer = None
+        self.work_timer = self.file_reader = None
         # Error handling
         gcode_macro = self.printer.load_object(config, 'gcode_macro')
         self.on_error_gcode = gcode_macro.load_template(
@@ -49,6 +244,7 @@ class VirtualSD:
     def handle_shutdown(self):
         if self.work_timer is not None:
             self.must_pause_work = True
+            self._stop_reader()
             try:
                 readpos = max(self.file_position - 1024, 0)
                 readcount = self.file_position - readpos
@@ -119,9 +315,14 @@ class VirtualSD:
         self.must_pause_work = False
         self.work_timer = self.reactor.register_timer(
             self.work_handler, self.reactor.NOW)
+    def _stop_reader(self):
+        if self.file_reader is not None:
+            self.file_reader.stop()
+            self.file_reader = None
     def do_cancel(self):
         if self.current_file is not None:
             self.do_pause()
+            self._stop_reader()
             self.current_file.close()
             self.current_file = None
             self.print_stats.note_cancel()
@@ -132,6 +333,7 @@ class VirtualSD:
     def _reset_file(self):
         if self.current_file is not None:
             self.do_pause()
+            self._stop_reader()
             self.current_file.close()
             self.current_file = None
         self.file_position = self.file_size = 0
@@ -183,7 +385,7 @@ class VirtualSD:
             if fname not in flist:
                 fname = files_by_lower[fname.lower()]
             fname = os.path.join(self.sdcard_dirname, fname)
-            f = io.open(fname, 'r', newline='')
+            f = io.open(fname, 'rb')
             f.seek(0, os.SEEK_END)
             fsize = f.tell()
             f.seek(0)
@@ -222,55 +424,82 @@ class VirtualSD:
     def is_cmd_from_sd(self):
         return self.cmd_from_sd
     # Background work timer
-    def work_handler(self, eventtime):
-        logging.info("Starting SD card print (position %d)", self.file_position)
-        self.reactor.unregister_timer(self.work_timer)
+    def _start_reader(self):
+        self._stop_reader()
         try:
             self.current_file.seek(self.file_position)
         except:
             logging.exception("virtual_sdcard seek")
+            return False
+        cache_filename = None
+        if self.use_gcode_cache and not self.file_position:
+            cache_filename = get_cache_filename(self.current_file.name)
+        self.file_reader = FileReadAhead(self.current_file, cache_filename)
+        return True
+    def _dispatch_lines(self, gcode_mutex, lines, move_lines, pos):
+        # Run a batch of upcoming lines (caller must hold the gcode
+        # mutex).  The batch ends early if another request is waiting
+        # on the mutex.  Returns the index of the next line to run and
+        # if the file position was changed.
+        end_pos = min(len(lines), pos + DISPATCH_BATCH)
+        while (pos < end_pos and not self.must_pause_work
+               and not gcode_mutex.queue):
+            line = lines[pos]
+            move_line = move_lines[pos]
+            pos += 1
+            next_file_position = self.file_position + len(line) + 1
+            self.next_file_position = next_file_position
+            if sys.version_info.major >= 3:
+                line = line.decode()
+            self.gcode.run_line_from_command(line, move_line)
+            self.file_position = self.next_file_position
+            # Do we need to skip around?
+            if self.next_file_position != next_file_position:
+                return pos, True
+        return pos, False
+    def work_handler(self, eventtime):
+        logging.info("Starting SD card print (position %d)", self.file_position)
+        self.reactor.unregister_timer(self.work_timer)
+        if not self._start_reader():
             self.work_timer = None
             return self.reactor.NEVER
         self.print_stats.note_start()
         gcode_mutex = self.gcode.get_mutex()
-        partial_input = ""
-        lines = []
+        lines = move_lines = ()
+        pos = 0
         error_message = None
         while not self.must_pause_work:
-            if not lines:
-                # Read more data
-                try:
-                    data = self.current_file.read(8192)
-                except:
-                    logging.exception("virtual_sdcard read")
-                    break
-                if not data:
-                    # End of file
-                    self.current_file.close()
-                    self.current_file = None
-                    logging.info("Finished SD card print")
-                    self.gcode.respond_raw("Done printing file")
-                    break
-                lines = data.split('\n')
-                lines[0] = partial_input + lines[0]
-                partial_input = lines.pop()
-                lines.reverse()
+            if pos >= len(lines):
+                chunk = self.file_reader.pop_lines()
+                if chunk is None:
+                    status = self.file_reader.check_done()
+                    if status == "error":
+                        break
+                    if status == "eof":
+                        # End of file
+                        self._stop_reader()
+                        self.current_file.close()
+                        self.current_file = None
+                        logging.info("Finished SD card print")
+                        self.gcode.respond_raw("Done printing file")
+                        break
+                    # Wait for background reader
+                    self.reactor.pause(self.reactor.monotonic() + 0.010)
+                    continue
+                lines, move_lines = chunk
+                pos = 0
                 self.reactor.pause(self.reactor.NOW)
                 continue
             # Pause if any other request is pending in the gcode class
             if gcode_mutex.test():
                 self.reactor.pause(self.reactor.monotonic() + 0.100)
                 continue
-            # Dispatch command
+            # Dispatch commands
             self.cmd_from_sd = True
-            line = lines.pop()
-            if sys.version_info.major >= 3:
-                next_file_position = self.file_position + len(line.encode()) + 1
-            else:
-                next_file_position = self.file_position + len(line) + 1
-            self.next_file_position = next_file_position
             try:
-                self.gcode.run_script(line)
+                with gcode_mutex:
+                    pos, need_seek = self._dispatch_lines(
+                        gcode_mutex, lines, move_lines, pos)
             except self.gcode.error as e:
                 error_message = str(e)
                 try:
@@ -282,17 +511,12 @@ class VirtualSD:
                 logging.exception("virtual_sdcard dispatch")
                 break
             self.cmd_from_sd = False
-            self.file_position = self.next_file_position
-            # Do we need to skip around?
-            if self.next_file_position != next_file_position:
-                try:
-                    self.current_file.seek(self.file_position)
-                except:
-                    logging.exception("virtual_sdcard seek")
+            if need_seek:
+                lines = move_lines = ()
+                if not self._start_reader():
                     self.work_timer = None
                     return self.reactor.NEVER
-                lines = []
-                partial_input = ""
+        self._stop_reader()
         logging.info("Exiting SD card print (position %d)", self.file_position)
         self.work_timer = None
         self.cmd_from_sd = False
@@ -8,6 +8,7 @@
 # for thermal expansion of the printer frame.
 
 import threading
+import chelper
 
 KELVIN_TO_CELSIUS = -273.15
 
@@ -48,12 +49,10 @@ class ZThermalAdjuster:
         self.ref_temperature = 0.
         self.ref_temp_override = False
 
-        # Z transformation
-        self.z_adjust_mm = 0.
-        self.last_z_adjust_mm = 0.
+        # Z transformation (applied by the C move transform code)
         self.adjust_enable = True
-        self.last_position = [0., 0., 0., 0.]
-        self.next_transform = None
+        self.native_transforms = None
+        self.stage = -1
 
         # Register gcode commands
         self.gcode.register_command('SET_Z_THERMAL_ADJUST',
@@ -65,21 +64,47 @@ class ZThermalAdjuster:
         self.toolhead = self.printer.lookup_object('toolhead')
         gcode_move = self.printer.lookup_object('gcode_move')
 
-        # Register move transformation
-        self.next_transform = gcode_move.set_move_transform(self, force=True)
-
         # Pull Z step distance for minimum adjustment increment
         kin = self.printer.lookup_object('toolhead').get_kinematics()
         steppers = [s.get_name() for s in kin.get_steppers()]
         z_stepper = kin.get_steppers()[steppers.index("stepper_z")]
         self.z_step_dist = z_stepper.get_step_dist()
 
+        # Register move transformation
+        native_transforms = gcode_move.get_native_transforms()
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.stage = ffi_lib.move_transform_add_z_adjust(
+            native_transforms.get_c_transform(), self.max_z_adjust_mm,
+            self.z_step_dist, self.off_above_z)
+        if self.stage < 0:
+            raise self.printer.config_error("Too many move transforms")
+        self.native_transforms = native_transforms
+        self._update_adjust()
+
+    def _get_z_adjust(self):
+        if self.native_transforms is None:
+            return 0.
+        ffi_main, ffi_lib = chelper.get_ffi()
+        return ffi_lib.move_transform_get_z_adjust(
+            self.native_transforms.get_c_transform(), self.stage)
+
+    def _update_adjust(self):
+        'Z adjustment calculation (applied on the next move)'
+        if self.native_transforms is None:
+            return
+        delta_t = self.smoothed_temp - self.ref_temperature
+        adjust = -1 * self.temp_coeff * delta_t
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.move_transform_set_z_adjust(
+            self.native_transforms.get_c_transform(), self.stage,
+            self.adjust_enable, adjust)
+
     def get_status(self, eventtime):
         return {
             'temperature': self.smoothed_temp,
             'measured_min_temp': round(self.measured_min, 2),
             'measured_max_temp': round(self.measured_max, 2),
-            'current_z_adjust': self.z_adjust_mm,
+            'current_z_adjust': self._get_z_adjust(),
             'z_adjust_ref_temperature': self.ref_temperature,
             'enabled': self.adjust_enable
         }
@@ -89,49 +114,11 @@ class ZThermalAdjuster:
         if 2 in homing_state.get_axes():
             self.ref_temperature = self.smoothed_temp
             self.ref_temp_override = False
-            self.z_adjust_mm = 0.
-
-    def calc_adjust(self, pos):
-        'Z adjustment calculation'
-        if pos[2] < self.off_above_z:
-            delta_t = self.smoothed_temp - self.ref_temperature
-
-            # Calculate Z adjustment
-            adjust = -1 * self.temp_coeff * delta_t
-
-            # compute sign (+1 or -1) for maximum offset setting
-            sign = 1 - (adjust <= 0)*2
-
-            # Don't apply adjustments smaller than step distance
-            if abs(adjust - self.z_adjust_mm) > self.z_step_dist:
-                self.z_adjust_mm = min([self.max_z_adjust_mm*sign,
-                    adjust], key=abs)
-
-        # Apply Z adjustment
-        new_z = pos[2] + self.z_adjust_mm
-        self.last_z_adjust_mm = self.z_adjust_mm
-        return [pos[0], pos[1], new_z, pos[3]]
-
-    def calc_unadjust(self, pos):
-        'Remove Z adjustment'
-        unadjusted_z = pos[2] - self.z_adjust_mm
-        return [pos[0], pos[1], unadjusted_z, pos[3]]
-
-    def get_position(self):
-        position = self.calc_unadjust(self.next_transform.get_position())
-        self.last_position = self.calc_adjust(position)
-        return position
-
-    def move(self, newpos, speed):
-        # don't apply to extrude only moves or when disabled
-        if (newpos[0:2] == self.last_position[0:2]) or not self.adjust_enable:
-            z = newpos[2] + self.last_z_adjust_mm
-            adjusted_pos = [newpos[0], newpos[1], z, newpos[3]]
-            self.next_transform.move(adjusted_pos, speed)
-        else:
-            adjusted_pos = self.calc_adjust(newpos)
-            self.next_transform.move(adjusted_pos, speed)
-        self.last_position[:] = newpos
+            self._update_adjust()
+            if self.native_transforms is not None:
+                ffi_main, ffi_lib = chelper.get_ffi()
+                ffi_lib.move_transform_reset_z_adjust(
+                    self.native_transforms.get_c_transform(), self.stage)
 
     def temperature_callback(self, read_time, temp):
         'Called everytime the Z adjust thermistor is read'
@@ -144,6 +131,7 @@ class ZThermalAdjuster:
             self.smoothed_temp += temp_diff * adj_time
             self.measured_min = min(self.measured_min, self.smoothed_temp)
             self.measured_max = max(self.measured_max, self.smoothed_temp)
+            self._update_adjust()
 
     def get_temp(self, eventtime):
         return self.smoothed_temp, 0.
@@ -161,11 +149,13 @@ class ZThermalAdjuster:
             self.ref_temp_override = True
         if coeff is not None:
             self.temp_coeff = coeff
-        if enable is not None:
-            if enable != self.adjust_enable:
-                self.adjust_enable = True if enable else False
-                gcode_move = self.printer.lookup_object('gcode_move')
-                gcode_move.reset_last_position()
+        enable_changed = enable is not None and enable != self.adjust_enable
+        if enable_changed:
+            self.adjust_enable = True if enable else False
+        self._update_adjust()
+        if enable_changed:
+            gcode_move = self.printer.lookup_object('gcode_move')
+            gcode_move.reset_last_position()
 
         state = '1 (enabled)' if self.adjust_enable else '0 (disabled)'
         override = ' (manual)' if self.ref_temp_override else ''
@@ -179,7 +169,7 @@ class ZThermalAdjuster:
                   self.temp_coeff,
                   self.ref_temperature, override,
                   self.smoothed_temp,
-                  self.z_adjust_mm)
+                  self._get_z_adjust())
         )
         gcmd.respond_info(msg)
 
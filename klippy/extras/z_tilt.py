@@ -25,6 +25,12 @@ class ZAdjustHelper:
         if len(z_steppers) < 2:
             raise self.printer.config_error(
                 "%s requires multiple z steppers" % (self.name,))
+        for s in z_steppers:
+            if hasattr(s, 'get_group_leader'):
+                raise self.printer.config_error(
+                    "%s can not adjust stepper '%s' (it is in the step_group"
+                    " of '%s')" % (self.name, s.get_name(),
+                                   s.get_group_leader().get_name()))
         self.z_steppers = z_steppers
     def adjust_steppers(self, adjustments, speed):
         toolhead = self.printer.lookup_object('toolhead')
@@ -1,9 +1,10 @@
 # Parse gcode commands
 #
-# Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, re, logging, collections, shlex
+import chelper
 
 class CommandError(Exception):
     pass
@@ -98,12 +99,18 @@ class GCodeDispatch:
         # Command handling
         self.is_printer_ready = False
         self.mutex = printer.get_reactor().mutex()
+        self.aux_mutex = printer.get_reactor().mutex()
+        self.auxiliary_commands = {'': True}
         self.output_callbacks = []
         self.base_gcode_handlers = self.gcode_handlers = {}
         self.ready_gcode_handlers = {}
         self.mux_commands = {}
+        self.fast_move_handlers = {}
         self.gcode_help = {}
         self.status_commands = {}
+        # Native tokenizer for plain G0/G1 commands
+        self.ffi_main, ffi_lib = chelper.get_ffi()
+        self.gcode_parse_moves = ffi_lib.gcode_parse_moves
         # Register commands needed before config file is loaded
         handlers = ['M110', 'M112', 'M115',
                     'RESTART', 'FIRMWARE_RESTART', 'ECHO', 'STATUS', 'HELP']
@@ -111,6 +118,8 @@ class GCodeDispatch:
             func = getattr(self, 'cmd_' + cmd)
             desc = getattr(self, 'cmd_' + cmd + '_help', None)
             self.register_command(cmd, func, True, desc)
+        for cmd in ['M112', 'M115', 'ECHO', 'STATUS', 'HELP']:
+            self.auxiliary_commands[cmd] = True
     def is_traditional_gcode(self, cmd):
         # A "traditional" g-code command is a letter and followed by a number
         try:
@@ -119,13 +128,20 @@ class GCodeDispatch:
             return cmd[0].isupper() and cmd[1].isdigit()
         except:
             return False
-    def register_command(self, cmd, func, when_not_ready=False, desc=None):
+    # Commands registered with auxiliary=True must not interact with
+    # the toolhead, must not pause, and must not run other commands.
+    # Scripts consisting only of these commands may be run by
+    # run_script() without waiting for long running commands (such as
+    # moves or M109) to complete.
+    def register_command(self, cmd, func, when_not_ready=False, desc=None,
+                         auxiliary=False):
         if func is None:
             old_cmd = self.ready_gcode_handlers.get(cmd)
             if cmd in self.ready_gcode_handlers:
                 del self.ready_gcode_handlers[cmd]
             if cmd in self.base_gcode_handlers:
                 del self.base_gcode_handlers[cmd]
+            self.auxiliary_commands.pop(cmd, None)
             self._build_status_commands()
             return old_cmd
         if cmd in self.ready_gcode_handlers:
@@ -143,12 +159,16 @@ class GCodeDispatch:
             self.base_gcode_handlers[cmd] = func
         if desc is not None:
             self.gcode_help[cmd] = desc
+        if auxiliary:
+            self.auxiliary_commands[cmd] = True
         self._build_status_commands()
-    def register_mux_command(self, cmd, key, value, func, desc=None):
+    def register_mux_command(self, cmd, key, value, func, desc=None,
+                             auxiliary=False):
         prev = self.mux_commands.get(cmd)
         if prev is None:
             handler = lambda gcmd: self._cmd_mux(cmd, gcmd)
-            self.register_command(cmd, handler, desc=desc)
+            self.register_command(cmd, handler, desc=desc,
+                                  auxiliary=auxiliary)
             self.mux_commands[cmd] = prev = (key, {})
         prev_key, prev_values = prev
         if prev_key != key:
@@ -160,6 +180,10 @@ class GCodeDispatch:
                 "mux command %s %s %s already registered (%s)" % (
                     cmd, key, value, prev_values))
         prev_values[value] = func
+    def register_fast_move_handler(self, func, fast_func):
+        # Plain G0/G1 commands dispatched to 'func' may instead be
+        # passed to 'fast_func' as a pre-parsed 'struct gcode_move_line'
+        self.fast_move_handlers[func] = fast_func
     def get_command_help(self):
         return dict(self.gcode_help)
     def get_status(self, eventtime):
@@ -188,8 +212,46 @@ class GCodeDispatch:
         self._respond_state("Ready")
     # Parse input into commands
     args_r = re.compile('([A-Z_]+|[A-Z*])')
-    def _process_commands(self, commands, need_ack=True):
-        for line in commands:
+    move_commands = ('G0', 'G1')
+    def _parse_moves(self, commands):
+        data = '\n'.join(commands)
+        if not isinstance(data, bytes):
+            data = data.encode('utf-8', 'replace')
+        count = len(commands)
+        move_lines = self.ffi_main.new('struct gcode_move_line[]', count)
+        if self.gcode_parse_moves(move_lines, count, data, len(data)) != count:
+            return None
+        return move_lines
+    def _invoke_handler(self, cmd, handler, arg, need_ack):
+        try:
+            handler(arg)
+        except self.error as e:
+            self._respond_error(str(e))
+            self.printer.send_event("gcode:command_error")
+            if not need_ack:
+                raise
+        except:
+            msg = 'Internal error on command:"%s"' % (cmd,)
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            self._respond_error(msg)
+            if not need_ack:
+                raise
+    def _process_commands(self, commands, need_ack=True, move_lines=None):
+        if move_lines is None and self.fast_move_handlers:
+            move_lines = self._parse_moves(commands)
+        for lineno, line in enumerate(commands):
+            if move_lines is not None and move_lines[lineno].cmd >= 0:
+                # Plain G0/G1 command - use fast handler if available
+                ml = move_lines[lineno]
+                cmd = self.move_commands[ml.cmd]
+                handler = self.gcode_handlers.get(cmd)
+                fast_handler = self.fast_move_handlers.get(handler)
+                if fast_handler is not None:
+                    self._invoke_handler(cmd, fast_handler, ml, need_ack)
+                    if need_ack:
+                        self.respond_raw("ok")
+                    continue
             # Ignore comments and leading/trailing spaces
             line = origline = line.strip()
             cpos = line.find(';')
@@ -208,26 +270,35 @@ class GCodeDispatch:
             gcmd = GCodeCommand(self, cmd, origline, params, need_ack)
             # Invoke handler for command
             handler = self.gcode_handlers.get(cmd, self.cmd_default)
-            try:
-                handler(gcmd)
-            except self.error as e:
-                self._respond_error(str(e))
-                self.printer.send_event("gcode:command_error")
-                if not need_ack:
-                    raise
-            except:
-                msg = 'Internal error on command:"%s"' % (cmd,)
-                logging.exception(msg)
-                self.printer.invoke_shutdown(msg)
-                self._respond_error(msg)
-                if not need_ack:
-                    raise
+            self._invoke_handler(cmd, handler, gcmd, need_ack)
             gcmd.ack()
     def run_script_from_command(self, script):
         self._process_commands(script.split('\n'), need_ack=False)
+    def run_line_from_command(self, line, move_line):
+        # Run a single line previously tokenized by gcode_parse_moves()
+        self._process_commands([line], need_ack=False, move_lines=[move_line])
+    def _is_auxiliary_script(self, commands):
+        aux = self.auxiliary_commands
+        for line in commands:
+            cpos = line.find(';')
+            if cpos >= 0:
+                line = line[:cpos]
+            parts = self.args_r.split(line.strip().upper())
+            if ''.join(parts[:2]) == 'N':
+                cmd = ''.join(parts[3:5]).strip()
+            else:
+                cmd = ''.join(parts[:3]).strip()
+            if cmd not in aux or (cmd and cmd not in self.gcode_handlers):
+                return False
+        return True
     def run_script(self, script):
-        with self.mutex:
-            self._process_commands(script.split('\n'), need_ack=False)
+        commands = script.split('\n')
+        mutex = self.mutex
+        if self._is_auxiliary_script(commands):
+            # Don't wait for commands that may affect the toolhead
+            mutex = self.aux_mutex
+        with mutex:
+            self._process_commands(commands, need_ack=False)
     def get_mutex(self):
         return self.mutex
     def create_gcode_command(self, command, commandline, params):
@@ -285,6 +356,7 @@ class GCodeDispatch:
             cmdline = gcmd.get_commandline()
             if cmdline:
                 logging.debug(cmdline)
+                self.printer.send_event("gcode:comment", cmdline)
             return
         if ' ' in cmd:
             # Handle M117/M118 gcode with numeric and special characters
@@ -437,6 +509,8 @@ class GCodeIO:
                     if self.m112_r.match(line) is not None:
                         self.gcode.cmd_M112(None)
             if self.is_processing_data:
+                if not self.is_fileinput:
+                    self._process_fast_reports(lines)
                 if len(pending_commands) >= 20:
                     # Stop reading input
                     self.reactor.unregister_fd(self.fd_handle)
@@ -453,6 +527,17 @@ class GCodeIO:
         if self.fd_handle is None:
             self.fd_handle = self.reactor.register_fd(self.fd,
                                                       self._process_data)
+    # Temperature polls (as sent by hosts such as OctoPrint) are
+    # answered immediately instead of waiting behind long running
+    # commands.  The reported values do not depend on command order.
+    m105_r = re.compile(r'^(?:[nN][0-9]+)?\s*[mM]105(?:[\s*;]|$)')
+    def _process_fast_reports(self, lines):
+        fast_lines = [l for l in lines if self.m105_r.match(l) is not None]
+        if not fast_lines:
+            return
+        for line in fast_lines:
+            self.pending_commands.remove(line)
+        self.gcode._process_commands(fast_lines)
     def _respond_raw(self, msg):
         if self.pipe_is_active:
             try:
@@ -1,6 +1,6 @@
 # Code for handling the kinematics of cartesian robots
 #
-# Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
@@ -49,6 +49,11 @@ class CartKinematics:
         self.max_z_accel = config.getfloat('max_z_accel', max_accel,
                                            above=0., maxval=max_accel)
         self.limits = [(1.0, -1.0)] * 3
+        self.toolhead = toolhead
+        # Have the look-ahead code check moves against these limits
+        toolhead.set_kin_limits(self.limits, self.max_z_velocity,
+                                self.max_z_accel)
+        self.concurrent_homing = config.getboolean('concurrent_homing', False)
     def get_steppers(self):
         return [s for rail in self.rails for s in rail.get_steppers()]
     def calc_position(self, stepper_positions):
@@ -64,6 +69,7 @@ class CartKinematics:
         # otherwise leave in un-homed state.
         if l <= h:
             self.limits[i] = range
+            self.toolhead.update_kin_limits()
     def set_position(self, newpos, homing_axes):
         for i, rail in enumerate(self.rails):
             rail.set_position(newpos)
@@ -73,26 +79,42 @@ class CartKinematics:
             else:
                 rail = self.rails[axis]
             self.limits[axis] = rail.get_range()
+        self.toolhead.update_kin_limits()
     def clear_homing_state(self, axes):
         for i, _ in enumerate(self.limits):
             if i in axes:
                 self.limits[i] = (1.0, -1.0)
-    def home_axis(self, homing_state, axis, rail):
-        # Determine movement
+        self.toolhead.update_kin_limits()
+    def _calc_homing_pos(self, axis, rail, forcepos, homepos):
         position_min, position_max = rail.get_range()
         hi = rail.get_homing_info()
-        homepos = [None, None, None, None]
-        homepos[axis] = hi.position_endstop
-        forcepos = list(homepos)
+        homepos[axis] = forcepos[axis] = hi.position_endstop
         if hi.positive_dir:
             forcepos[axis] -= 1.5 * (hi.position_endstop - position_min)
         else:
             forcepos[axis] += 1.5 * (position_max - hi.position_endstop)
+    def home_axis(self, homing_state, axis, rail):
+        # Determine movement
+        homepos = [None, None, None, None]
+        forcepos = list(homepos)
+        self._calc_homing_pos(axis, rail, forcepos, homepos)
         # Perform homing
         homing_state.home_rails([rail], forcepos, homepos)
     def home(self, homing_state):
-        # Each axis is homed independently and in order
-        for axis in homing_state.get_axes():
+        axes = homing_state.get_axes()
+        concurrent_axes = [axis for axis in axes if axis in (0, 1)
+                           and axis != self.dual_carriage_axis]
+        if self.concurrent_homing and len(concurrent_axes) > 1:
+            # Home the X and Y axes at the same time
+            homepos = [None, None, None, None]
+            forcepos = list(homepos)
+            axis_rails = [(axis, self.rails[axis]) for axis in concurrent_axes]
+            for axis, rail in axis_rails:
+                self._calc_homing_pos(axis, rail, forcepos, homepos)
+            homing_state.home_rails_concurrent(axis_rails, forcepos, homepos)
+            axes = [axis for axis in axes if axis not in concurrent_axes]
+        # Each remaining axis is homed independently and in order
+        for axis in axes:
             if self.dc_module is not None and axis == self.dual_carriage_axis:
                 self.dc_module.home(homing_state)
             else:
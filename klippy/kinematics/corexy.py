@@ -30,6 +30,10 @@ class CoreXYKinematics:
         self.max_z_accel = config.getfloat(
             'max_z_accel', max_accel, above=0., maxval=max_accel)
         self.limits = [(1.0, -1.0)] * 3
+        self.toolhead = toolhead
+        # Have the look-ahead code check moves against these limits
+        toolhead.set_kin_limits(self.limits, self.max_z_velocity,
+                                self.max_z_accel)
         ranges = [r.get_range() for r in self.rails]
         self.axes_min = toolhead.Coord(*[r[0] for r in ranges], e=0.)
         self.axes_max = toolhead.Coord(*[r[1] for r in ranges], e=0.)
@@ -43,10 +47,12 @@ class CoreXYKinematics:
             rail.set_position(newpos)
             if i in homing_axes:
                 self.limits[i] = rail.get_range()
+        self.toolhead.update_kin_limits()
     def clear_homing_state(self, axes):
         for i, _ in enumerate(self.limits):
             if i in axes:
                 self.limits[i] = (1.0, -1.0)
+        self.toolhead.update_kin_limits()
     def home(self, homing_state):
         # Each axis is homed independently and in order
         for axis in homing_state.get_axes():
@@ -51,6 +51,10 @@ class HybridCoreXZKinematics:
         self.max_z_accel = config.getfloat(
             'max_z_accel', max_accel, above=0., maxval=max_accel)
         self.limits = [(1.0, -1.0)] * 3
+        self.toolhead = toolhead
+        # Have the look-ahead code check moves against these limits
+        toolhead.set_kin_limits(self.limits, self.max_z_velocity,
+                                self.max_z_accel)
     def get_steppers(self):
         return [s for rail in self.rails for s in rail.get_steppers()]
     def calc_position(self, stepper_positions):
@@ -66,6 +70,7 @@ class HybridCoreXZKinematics:
         # otherwise leave in un-homed state.
         if l <= h:
             self.limits[i] = range
+            self.toolhead.update_kin_limits()
     def set_position(self, newpos, homing_axes):
         for i, rail in enumerate(self.rails):
             rail.set_position(newpos)
@@ -75,10 +80,12 @@ class HybridCoreXZKinematics:
             else:
                 rail = self.rails[axis]
             self.limits[axis] = rail.get_range()
+        self.toolhead.update_kin_limits()
     def clear_homing_state(self, axes):
         for i, _ in enumerate(self.limits):
             if i in axes:
                 self.limits[i] = (1.0, -1.0)
+        self.toolhead.update_kin_limits()
     def home_axis(self, homing_state, axis, rail):
         position_min, position_max = rail.get_range()
         hi = rail.get_homing_info()
@@ -47,13 +47,29 @@ class DualCarriages:
             if rail.mode == PRIMARY:
                 return rail
         return None
-    def toggle_active_dc_rail(self, index):
+    def _apply_transforms(self):
+        # Carriage transforms take effect after the end of the queued
+        # moves, so the pending step generation does not need to be
+        # flushed. The step generation (and input shaper) window around
+        # the switch time must only see a stationary toolhead, otherwise
+        # the carriage position would jump when the transform changes.
         toolhead = self.printer.lookup_object('toolhead')
+        kin_flush_delay = toolhead.kin_flush_delay
+        print_time = toolhead.get_last_move_time() + kin_flush_delay
+        expire_time = toolhead.last_flush_time - kin_flush_delay
+        if all([dc.queue_transform(print_time, expire_time)
+                for dc in self.dc]):
+            toolhead.dwell(2. * kin_flush_delay)
+            return
+        # Too many pending transforms - wait for step generation
         toolhead.flush_step_generation()
+        for dc in self.dc:
+            dc.apply_transform()
+    def toggle_active_dc_rail(self, index):
+        toolhead = self.printer.lookup_object('toolhead')
         pos = toolhead.get_position()
         kin = toolhead.get_kinematics()
         for i, dc in enumerate(self.dc):
-            dc_rail = dc.get_rail()
             if i != index:
                 if dc.is_active():
                     dc.inactivate(pos)
@@ -62,7 +78,10 @@ class DualCarriages:
             newpos = pos[:self.axis] + [target_dc.get_axis_position(pos)] \
                         + pos[self.axis+1:]
             target_dc.activate(PRIMARY, newpos, old_position=pos)
+            self._apply_transforms()
             toolhead.set_position(newpos)
+        else:
+            self._apply_transforms()
         kin.update_limits(self.axis, target_dc.get_rail().get_range())
     def home(self, homing_state):
         kin = self.printer.lookup_object('toolhead').get_kinematics()
@@ -150,15 +169,16 @@ class DualCarriages:
         return -1
     def activate_dc_mode(self, index, mode):
         toolhead = self.printer.lookup_object('toolhead')
-        toolhead.flush_step_generation()
         kin = toolhead.get_kinematics()
         if mode == INACTIVE:
             self.dc[index].inactivate(toolhead.get_position())
+            self._apply_transforms()
         elif mode == PRIMARY:
             self.toggle_active_dc_rail(index)
         else:
             self.toggle_active_dc_rail(0)
             self.dc[index].activate(mode, toolhead.get_position())
+            self._apply_transforms()
         kin.update_limits(self.axis, self.get_kin_range(toolhead, mode))
     def _handle_ready(self):
         # Apply the transform later during Klipper initialization to make sure
@@ -222,11 +242,13 @@ class DualCarriages:
                 self.dc[1-primary_ind].override_axis_scaling(
                         abs(dl[1-primary_ind] / dl[primary_ind]),
                         cur_pos[primary_ind])
+                self._apply_transforms()
             toolhead.manual_move(move_pos, move_speed or homing_speed)
             toolhead.flush_step_generation()
             # Make sure the scaling coefficients are restored with the mode
             self.dc[0].inactivate(move_pos)
             self.dc[1].inactivate(move_pos)
+            self._apply_transforms()
         for i, dc in enumerate(self.dc):
             saved_mode = saved_state['carriage_modes'][i]
             self.activate_dc_mode(i, saved_mode)
@@ -263,19 +285,25 @@ class DualCarriagesRail:
         for sk in self.dc_stepper_kinematics:
             ffi_lib.dual_carriage_set_transform(
                     sk, self.ENC_AXES[self.axis], self.scale, self.offset)
+    def queue_transform(self, print_time, expire_time):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        for sk in self.dc_stepper_kinematics:
+            ret = ffi_lib.dual_carriage_queue_transform(
+                    sk, self.ENC_AXES[self.axis], self.scale, self.offset,
+                    print_time, expire_time)
+            if ret:
+                return False
+        return True
     def activate(self, mode, position, old_position=None):
         old_axis_position = self.get_axis_position(old_position or position)
         self.scale = -1. if mode == MIRROR else 1.
         self.offset = old_axis_position - position[self.axis] * self.scale
-        self.apply_transform()
         self.mode = mode
     def inactivate(self, position):
         self.offset = self.get_axis_position(position)
         self.scale = 0.
-        self.apply_transform()
         self.mode = INACTIVE
     def override_axis_scaling(self, new_scale, position):
         old_axis_position = self.get_axis_position(position)
         self.scale = math.copysign(new_scale, self.scale)
         self.offset = old_axis_position - position[self.axis] * self.scale
-        self.apply_transform()
@@ -123,6 +123,8 @@ class Printer:
             self.load_object(config, section_config.get_name(), None)
         for m in [toolhead]:
             m.add_printer_objects(config)
+        if self.start_args.get('simulate'):
+            self.load_object(config, 'simulate')
         # Validate that there are no undefined parameters in the config file
         pconfig.check_unused_options(config)
     def _connect(self, eventtime):
@@ -267,6 +269,8 @@ def main():
                     help="api server unix domain socket filename")
     opts.add_option("-l", "--logfile", dest="logfile",
                     help="write log to file instead of stderr")
+    opts.add_option("--binlog", dest="binlog",
+                    help="write stats and debug dumps to binary log file")
     opts.add_option("-v", action="store_true", dest="verbose",
                     help="enable debug messages")
     opts.add_option("-o", "--debugoutput", dest="debugoutput",
@@ -274,6 +278,10 @@ def main():
     opts.add_option("-d", "--dictionary", dest="dictionary", type="string",
                     action="callback", callback=arg_dictionary,
                     help="file to read for mcu protocol dictionary")
+    opts.add_option("--simulate", dest="simulate", type="choice",
+                    choices=["moves", "steps"],
+                    help="run the input file as fast as possible without"
+                    " output and report the print duration")
     opts.add_option("--import-test", action="store_true",
                     help="perform an import module test")
     options, args = opts.parse_args()
@@ -281,6 +289,13 @@ def main():
         import_test()
     if len(args) != 1:
         opts.error("Incorrect number of arguments")
+    if options.binlog and not options.logfile:
+        opts.error("The --binlog option requires a --logfile")
+    if options.simulate:
+        if not options.debuginput or options.dictionary is None:
+            opts.error("The --simulate option requires -i and -d")
+        if not options.debugoutput:
+            options.debugoutput = os.devnull
     start_args = {'config_file': args[0], 'apiserver': options.apiserver,
                   'start_reason': 'startup'}
 
@@ -296,10 +311,13 @@ def main():
     if options.debugoutput:
         start_args['debugoutput'] = options.debugoutput
         start_args.update(options.dictionary)
+    if options.simulate:
+        start_args['simulate'] = options.simulate
     bglogger = None
     if options.logfile:
         start_args['log_file'] = options.logfile
-        bglogger = queuelogger.setup_bg_logging(options.logfile, debuglevel)
+        bglogger = queuelogger.setup_bg_logging(options.logfile, debuglevel,
+                                                options.binlog)
     else:
         logging.getLogger().setLevel(debuglevel)
     logging.info("Starting Klippy...")
@@ -1,10 +1,10 @@
 # Interface to Klipper micro-controller code
 #
-# Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, zlib, logging, math
-import serialhdl, msgproto, pins, chelper, clocksync
+import sys, os, zlib, logging, math, struct, traceback
+import serialhdl, msgproto, pins, chelper, clocksync, queuelogger
 
 class error(Exception):
     pass
@@ -88,12 +88,17 @@ class CommandWrapper:
             cmd_queue = serial.get_default_command_queue()
         self._cmd_queue = cmd_queue
         self._msgtag = msgparser.lookup_msgid(msgformat) & 0xffffffff
+        self._encoder = serial.alloc_command_encoder(self._cmd)
     def send(self, data=(), minclock=0, reqclock=0):
+        if self._encoder is not None and self._serial.raw_send_encoded(
+                self._encoder, data, minclock, reqclock, self._cmd_queue):
+            return
         cmd = self._cmd.encode(data)
         self._serial.raw_send(cmd, minclock, reqclock, self._cmd_queue)
     def send_wait_ack(self, data=(), minclock=0, reqclock=0):
         cmd = self._cmd.encode(data)
-        self._serial.raw_send_wait_ack(cmd, minclock, reqclock, self._cmd_queue)
+        return self._serial.raw_send_wait_ack(cmd, minclock, reqclock,
+                                              self._cmd_queue)
     def get_command_tag(self):
         return self._msgtag
 
@@ -114,7 +119,7 @@ class MCU_trsync:
         self._steppers = []
         self._trdispatch_mcu = None
         self._oid = mcu.create_oid()
-        self._cmd_queue = mcu.alloc_command_queue()
+        self._cmd_queue = mcu.alloc_command_queue(high_priority=True)
         self._trsync_start_cmd = self._trsync_set_timeout_cmd = None
         self._trsync_trigger_cmd = self._trsync_query_cmd = None
         self._stepper_stop_cmd = None
@@ -166,7 +171,7 @@ class MCU_trsync:
         state_tag = state_cmd.get_command_tag()
         ffi_main, ffi_lib = chelper.get_ffi()
         self._trdispatch_mcu = ffi_main.gc(ffi_lib.trdispatch_mcu_alloc(
-            self._trdispatch, mcu._serial.get_serialqueue(), # XXX
+            self._trdispatch, mcu.get_serialqueue(),
             self._cmd_queue, self._oid, set_timeout_tag, trigger_tag,
             state_tag), ffi_lib.free)
     def _shutdown(self):
@@ -230,6 +235,7 @@ class TriggerDispatch:
     def __init__(self, mcu):
         self._mcu = mcu
         self._trigger_completion = None
+        self._trigger_bus = None
         ffi_main, ffi_lib = chelper.get_ffi()
         self._trdispatch = ffi_main.gc(ffi_lib.trdispatch_alloc(), ffi_lib.free)
         self._trsyncs = [MCU_trsync(mcu, self._trdispatch)]
@@ -265,6 +271,14 @@ class TriggerDispatch:
             report_offset = float(i) / len(self._trsyncs)
             trsync.start(print_time, report_offset,
                          self._trigger_completion, expire_timeout)
+        # Forward triggers between mcus using a trigger_bus wire (if any)
+        self._trigger_bus = None
+        if len(self._trsyncs) > 1:
+            printer = self._mcu.get_printer()
+            trigger_bus = printer.lookup_object('trigger_bus', None)
+            if (trigger_bus is not None
+                and trigger_bus.start(self._trsyncs, print_time)):
+                self._trigger_bus = trigger_bus
         etrsync = self._trsyncs[0]
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.trdispatch_start(self._trdispatch, etrsync.REASON_HOST_REQUEST)
@@ -279,6 +293,9 @@ class TriggerDispatch:
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.trdispatch_stop(self._trdispatch)
         res = [trsync.stop() for trsync in self._trsyncs]
+        if self._trigger_bus is not None:
+            self._trigger_bus.stop()
+            self._trigger_bus = None
         err_res = [r for r in res if r >= MCU_trsync.REASON_COMMS_TIMEOUT]
         if err_res:
             return err_res[0]
@@ -379,6 +396,7 @@ class MCU_digital_out:
             raise pins.error("Digital pin max duration too large")
         self._mcu.request_move_queue_slot()
         self._oid = self._mcu.create_oid()
+        self._mcu.register_move_queue_name(self._oid, self._pin)
         self._mcu.add_config_cmd(
             "config_digital_out oid=%d pin=%s value=%d default_value=%d"
             " max_duration=%d" % (self._oid, self._pin, self._start_value,
@@ -416,6 +434,10 @@ class MCU_pwm:
     def setup_cycle_time(self, cycle_time, hardware_pwm=False):
         self._cycle_time = cycle_time
         self._hardware_pwm = hardware_pwm
+    def get_oid(self):
+        return self._oid
+    def get_pwm_params(self):
+        return self._hardware_pwm, self._pwm_max, self._invert
     def setup_start_value(self, start_value, shutdown_value):
         if self._invert:
             start_value = 1. - start_value
@@ -438,6 +460,7 @@ class MCU_pwm:
             self._pwm_max = self._mcu.get_constant_float("PWM_MAX")
             self._mcu.request_move_queue_slot()
             self._oid = self._mcu.create_oid()
+            self._mcu.register_move_queue_name(self._oid, self._pin)
             self._mcu.add_config_cmd(
                 "config_pwm_out oid=%d pin=%s cycle_ticks=%d value=%d"
                 " default_value=%d max_duration=%d"
@@ -458,6 +481,7 @@ class MCU_pwm:
             raise pins.error("PWM pin cycle time too large")
         self._mcu.request_move_queue_slot()
         self._oid = self._mcu.create_oid()
+        self._mcu.register_move_queue_name(self._oid, self._pin)
         self._mcu.add_config_cmd(
             "config_digital_out oid=%d pin=%s value=%d"
             " default_value=%d max_duration=%d"
@@ -492,10 +516,14 @@ class MCU_adc:
         self._report_clock = 0
         self._last_state = (0., 0.)
         self._oid = self._callback = None
+        self._allow_group = True
         self._mcu.register_config_callback(self._build_config)
         self._inv_max_adc = 0.
     def get_mcu(self):
         return self._mcu
+    def disable_group_report(self):
+        # Always report this adc in its own analog_in_state messages
+        self._allow_group = False
     def setup_adc_sample(self, sample_time, sample_count,
                          minval=0., maxval=1., range_check_count=0):
         self._sample_time = sample_time
@@ -508,13 +536,26 @@ class MCU_adc:
         self._callback = callback
     def get_last_value(self):
         return self._last_state
+    def get_oid(self):
+        return self._oid
+    def get_max_adc(self):
+        # Maximum raw value reported by the mcu (sum of sample_count reads)
+        return self._sample_count * self._mcu.get_constant_float("ADC_MAX")
     def _build_config(self):
         if not self._sample_count:
             return
         self._oid = self._mcu.create_oid()
         self._mcu.add_config_cmd("config_analog_in oid=%d pin=%s" % (
             self._oid, self._pin))
-        clock = self._mcu.get_query_slot(self._oid)
+        group = None
+        if self._allow_group:
+            group = self._mcu.get_adc_group(
+                (self._sample_time, self._sample_count, self._report_time))
+        if group is not None:
+            # Group members must be sampled at the same time
+            clock = group.add_adc(self)
+        else:
+            clock = self._mcu.get_query_slot(self._oid)
         sample_ticks = self._mcu.seconds_to_clock(self._sample_time)
         mcu_adc_max = self._mcu.get_constant_float("ADC_MAX")
         max_adc = self._sample_count * mcu_adc_max
@@ -529,22 +570,116 @@ class MCU_adc:
                 self._oid, clock, sample_ticks, self._sample_count,
                 self._report_clock, min_sample, max_sample,
                 self._range_check_count), is_init=True)
-        self._mcu.register_response(self._handle_analog_in_state,
-                                    "analog_in_state", self._oid)
+        if group is None:
+            self._mcu.register_response(self._handle_analog_in_state,
+                                        "analog_in_state", self._oid,
+                                        coalesce=True)
     def _handle_analog_in_state(self, params):
-        last_value = params['value'] * self._inv_max_adc
-        next_clock = self._mcu.clock32_to_clock64(params['next_clock'])
+        self.handle_adc_value(params['value'], params['next_clock'])
+    def handle_adc_value(self, value, next_clock32):
+        last_value = value * self._inv_max_adc
+        next_clock = self._mcu.clock32_to_clock64(next_clock32)
         last_read_clock = next_clock - self._report_clock
         last_read_time = self._mcu.clock_to_print_time(last_read_clock)
         self._last_state = (last_value, last_read_time)
         if self._callback is not None:
             self._callback(last_read_time, last_value)
 
+# Report the measurements of several adcs in a single mcu message
+class MCU_adc_group:
+    MAX_CHANNELS = 16
+    def __init__(self, mcu):
+        self._mcu = mcu
+        self._adcs = []
+        self._clock = 0
+        self._oid = None
+        mcu.register_config_callback(self._build_config)
+    def is_full(self):
+        return self._oid is not None or len(self._adcs) >= self.MAX_CHANNELS
+    def add_adc(self, mcu_adc):
+        if not self._adcs:
+            self._clock = self._mcu.get_query_slot(mcu_adc.get_oid())
+        self._adcs.append(mcu_adc)
+        return self._clock
+    def _build_config(self):
+        mcu = self._mcu
+        self._oid = mcu.create_oid()
+        mcu.add_config_cmd("config_analog_in_group oid=%d count=%d"
+                           % (self._oid, len(self._adcs)))
+        for i, mcu_adc in enumerate(self._adcs):
+            mcu.add_config_cmd(
+                "analog_in_group_add oid=%d pos=%d analog_in_oid=%d"
+                % (self._oid, i, mcu_adc.get_oid()))
+        mcu.register_response(self._handle_group_state,
+                              "analog_in_group_state", self._oid,
+                              coalesce=True)
+    def _handle_group_state(self, params):
+        values = bytearray(params['values'])
+        next_clock = params['next_clock']
+        for i, mcu_adc in enumerate(self._adcs):
+            mcu_adc.handle_adc_value(values[i*2] | (values[i*2+1] << 8),
+                                     next_clock)
+
+# Report timer and task profiling from mcus built with SCHED_PROFILE
+class MCU_profile:
+    def __init__(self, mcu, get_profile_cmd):
+        self._mcu = mcu
+        self._get_profile_cmd = get_profile_cmd
+        self._mcu_freq = mcu.get_constant_float('CLOCK_FREQ')
+        self._timers = {}
+        self._tasks = {}
+        self._status = {}
+        mcu.register_response(self._handle_timer, 'profile_timer')
+        mcu.register_response(self._handle_task, 'profile_task')
+        mcu.register_response(self._handle_latency, 'profile_latency')
+    def _calc_stat(self, params):
+        inv_freq = 1. / self._mcu_freq
+        count = params['count']
+        return {'count': count, 'avg': params['sum'] * inv_freq / count,
+                'max': params['max'] * inv_freq}
+    def _handle_timer(self, params):
+        stat = self._calc_stat(params)
+        stat['latency_max'] = params['latency'] / self._mcu_freq
+        self._timers['0x%08x' % (params['func'],)] = stat
+    def _handle_task(self, params):
+        self._tasks[str(params['task'])] = self._calc_stat(params)
+    def _handle_latency(self, params):
+        # The latency report is sent last - publish the collected report
+        inv_freq = 1. / self._mcu_freq
+        data = bytes(bytearray(params['hist']))
+        hist = list(struct.unpack('<%dI' % (len(data) // 4,), data))
+        shift = params['shift']
+        bounds = [(1 << (i + shift)) * inv_freq for i in range(len(hist)-1)]
+        self._status = {
+            'timers': self._timers, 'tasks': self._tasks,
+            'latency_max': params['max'] * inv_freq,
+            'latency_histogram': hist, 'latency_bounds': bounds}
+        self._timers = {}
+        self._tasks = {}
+    def query(self):
+        self._get_profile_cmd.send()
+    def stats(self):
+        status = self._status
+        if not status:
+            return ""
+        timer_max = max([t['max'] for t in status['timers'].values()] + [0.])
+        task_max = max([t['max'] for t in status['tasks'].values()] + [0.])
+        return ("prof_timer_max=%.06f prof_task_max=%.06f"
+                " prof_latency_max=%.06f" % (
+                    timer_max, task_max, status['latency_max']))
+    def get_status(self, eventtime):
+        return self._status
+
 
 ######################################################################
 # Main MCU class
 ######################################################################
 
+# Number of message types reported per direction in the stats log
+MSG_STATS_TOP = 3
+# The move_queue_stats min_lead value when no move started an idle queue
+MOVE_LEAD_NONE = 0x7fffffff
+
 class MCU:
     error = error
     def __init__(self, config, clocksync):
@@ -563,13 +698,23 @@ class MCU:
         if canbus_uuid is not None:
             self._serialport = canbus_uuid
             self._canbus_iface = config.get('canbus_interface', 'can0')
+            self._canbus_fd = config.getboolean('canbus_fd', False)
             cbid = self._printer.load_object(config, 'canbus_ids')
             cbid.add_uuid(config, canbus_uuid, self._canbus_iface)
         else:
             self._serialport = config.get('serial')
             if not (self._serialport.startswith("/dev/rpmsg_")
-                    or self._serialport.startswith("/tmp/klipper_host_")):
+                    or self._serialport.startswith("/tmp/klipper_host_")
+                    or self._serialport.startswith("udp:")):
                 self._baud = config.getint('baud', 250000, minval=2400)
+        self._serial.set_adaptive_window(
+            config.getboolean('adaptive_window', False))
+        serial_sched = get_thread_scheduling(config, 'serial_thread')
+        self._serial.set_thread_scheduling(*serial_sched)
+        thread_group = config.get('serial_thread_group', None)
+        if thread_group is not None:
+            self._serial.set_shared_thread(
+                get_serial_thread(printer, thread_group, serial_sched))
         # Restarts
         restart_methods = [None, 'arduino', 'cheetah', 'command', 'rpi_usb']
         self._restart_method = 'command'
@@ -589,11 +734,17 @@ class MCU:
         self._config_cmds = []
         self._restart_cmds = []
         self._init_cmds = []
+        self._adc_groups = {}
         self._mcu_freq = 0.
         # Move command queuing
-        ffi_main, self._ffi_lib = chelper.get_ffi()
+        self._ffi_main, self._ffi_lib = chelper.get_ffi()
         self._max_stepper_error = config.getfloat('max_stepper_error', 0.000025,
                                                   minval=0.)
+        self._adaptive_error_ratio = config.getfloat(
+            'adaptive_stepper_error_ratio', 0., minval=0., maxval=.5)
+        self._adaptive_max_error = config.getfloat(
+            'adaptive_max_stepper_error', 0.000100,
+            minval=self._max_stepper_error)
         self._reserved_move_slots = 0
         self._stepqueues = []
         self._steppersync = None
@@ -604,13 +755,15 @@ class MCU:
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._mcu_move_min_free = None
+        self._move_queue_names = {}
+        self._move_queue_stats = {}
+        self._move_queue_cmd = None
+        self._profile = None
         # Register handlers
         printer.load_object(config, "error_mcu")
         printer.register_event_handler("klippy:firmware_restart",
                                        self._firmware_restart)
-        printer.register_event_handler("klippy:mcu_identify",
-                                       self._mcu_identify)
-        printer.register_event_handler("klippy:connect", self._connect)
         printer.register_event_handler("klippy:shutdown", self._shutdown)
         printer.register_event_handler("klippy:disconnect", self._disconnect)
         printer.register_event_handler("klippy:ready", self._ready)
@@ -624,6 +777,24 @@ class MCU:
         diff = count*tick_sumsq - tick_sum**2
         self._mcu_tick_stddev = c * math.sqrt(max(0., diff))
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+        self._mcu_move_min_free = params.get('move_min_free')
+    def _handle_move_queue_stats(self, params):
+        oid = params['oid']
+        name = self._move_queue_names.get(oid, "oid%d" % (oid,))
+        max_count = params['max_count']
+        prev = self._move_queue_stats.get(name, {})
+        stats = {'count': params['count'], 'max_count': max_count,
+                 'peak_count': max(prev.get('peak_count', 0), max_count)}
+        min_lead = params.get('min_lead', MOVE_LEAD_NONE)
+        lowest = prev.get('lowest_lead_time')
+        if min_lead != MOVE_LEAD_NONE:
+            min_lead_time = min_lead / self._mcu_freq
+            stats['min_lead_time'] = min_lead_time
+            if lowest is None or min_lead_time < lowest:
+                lowest = min_lead_time
+        if lowest is not None:
+            stats['lowest_lead_time'] = lowest
+        self._move_queue_stats[name] = stats
     def _handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -638,7 +809,8 @@ class MCU:
                              "event_type": event_type})
         logging.info("MCU '%s' %s: %s\n%s\n%s", self._name, event_type,
                      self._shutdown_msg, self._clocksync.dump_debug(),
-                     self._serial.dump_debug())
+                     self._serial.dump_debug(self._name,
+                                             self._clocksync.clock_est))
     def _handle_starting(self, params):
         if not self._is_shutdown:
             self._printer.invoke_async_shutdown("MCU '%s' spontaneous restart"
@@ -767,12 +939,16 @@ class MCU:
                                       move_count-self._reserved_move_slots),
             ffi_lib.steppersync_free)
         ffi_lib.steppersync_set_time(self._steppersync, 0., self._mcu_freq)
+        toolhead = self._printer.lookup_object('toolhead')
+        for stepqueue in self._stepqueues:
+            ffi_lib.stepcompress_set_history_limit(
+                stepqueue, toolhead.get_history_memory())
         # Log config information
         move_msg = "Configured MCU '%s' (%d moves)" % (self._name, move_count)
         logging.info(move_msg)
         log_info = self._log_info() + "\n" + move_msg
         self._printer.set_rollover_info(self._name, log_info, log=False)
-    def _mcu_identify(self):
+    def _mcu_connect(self):
         if self.is_fileoutput():
             self._connect_file()
         else:
@@ -784,19 +960,31 @@ class MCU:
                 if self._canbus_iface is not None:
                     cbid = self._printer.lookup_object('canbus_ids')
                     nodeid = cbid.get_nodeid(self._serialport)
+                    sched = cbid.get_scheduler(self._canbus_iface)
+                    cbid.start_assignment(self._canbus_iface, self._canbus_fd)
                     self._serial.connect_canbus(self._serialport, nodeid,
-                                                self._canbus_iface)
+                                                self._canbus_iface,
+                                                self._canbus_fd, sched)
+                    cbid.note_connected(self._serialport)
                 elif self._baud:
                     # Cheetah boards require RTS to be deasserted
                     # else a reset will trigger the built-in bootloader.
                     rts = (resmeth != "cheetah")
                     self._serial.connect_uart(self._serialport, self._baud, rts)
+                elif self._serialport.startswith("udp:"):
+                    self._serial.connect_udp(self._serialport[4:])
                 else:
                     self._serial.connect_pipe(self._serialport)
                 self._clocksync.connect(self._serial)
             except serialhdl.error as e:
                 raise error(str(e))
+    def _mcu_identify(self):
+        if not self.is_fileoutput():
+            self._clocksync.sync_main()
         logging.info(self._log_info())
+        msgparser = self._serial.get_msgparser()
+        queuelogger.log_binary_dict(self._reactor.monotonic(), self._name,
+                                    msgparser.get_raw_data_dictionary())
         ppins = self._printer.lookup_object('pins')
         pin_resolver = ppins.get_pin_resolver(self._name)
         for cname, value in self.get_constants().items():
@@ -805,7 +993,8 @@ class MCU:
                     pin_resolver.reserve_pin(pin, cname[13:])
         self._mcu_freq = self.get_constant_float('CLOCK_FREQ')
         self._stats_sumsq_base = self.get_constant_float('STATS_SUMSQ_BASE')
-        self._emergency_stop_cmd = self.lookup_command("emergency_stop")
+        self._emergency_stop_cmd = self.lookup_command(
+            "emergency_stop", cq=self.alloc_command_queue(high_priority=True))
         self._reset_cmd = self.try_lookup_command("reset")
         self._config_reset_cmd = self.try_lookup_command("config_reset")
         ext_only = self._reset_cmd is None and self._config_reset_cmd is None
@@ -823,7 +1012,19 @@ class MCU:
         self._get_status_info['mcu_constants'] = msgparser.get_constants()
         self.register_response(self._handle_shutdown, 'shutdown')
         self.register_response(self._handle_shutdown, 'is_shutdown')
-        self.register_response(self._handle_mcu_stats, 'stats')
+        self.register_response(self._handle_mcu_stats, 'stats',
+                               coalesce=True)
+        get_profile_cmd = self.try_lookup_command("get_profile")
+        if get_profile_cmd is not None:
+            self._profile = MCU_profile(self, get_profile_cmd)
+            pname = "mcu_profile"
+            if self._name != 'mcu':
+                pname = "mcu_profile " + self._name
+            self._printer.add_object(pname, self._profile)
+        self._move_queue_cmd = self.try_lookup_command("get_move_queue_stats")
+        if self._move_queue_cmd is not None:
+            self.register_response(self._handle_move_queue_stats,
+                                   'move_queue_stats')
     def _ready(self):
         if self.is_fileoutput():
             return
@@ -859,6 +1060,15 @@ class MCU:
             self._restart_cmds.append(cmd)
         else:
             self._config_cmds.append(cmd)
+    def get_adc_group(self, key):
+        # Group adcs that are sampled with identical settings
+        if self.try_lookup_command(
+                "config_analog_in_group oid=%c count=%c") is None:
+            return None
+        group = self._adc_groups.get(key)
+        if group is None or group.is_full():
+            group = self._adc_groups[key] = MCU_adc_group(self)
+        return group
     def get_query_slot(self, oid):
         slot = self.seconds_to_clock(oid * .01)
         t = int(self.estimated_print_time(self._reactor.monotonic()) + 1.5)
@@ -867,24 +1077,29 @@ class MCU:
         return int(time * self._mcu_freq)
     def get_max_stepper_error(self):
         return self._max_stepper_error
+    def get_adaptive_stepper_error(self):
+        return self._adaptive_error_ratio, self._adaptive_max_error
     # Wrapper functions
     def get_printer(self):
         return self._printer
     def get_name(self):
         return self._name
-    def register_response(self, cb, msg, oid=None):
-        self._serial.register_response(cb, msg, oid)
-    def alloc_command_queue(self):
-        return self._serial.alloc_command_queue()
+    def register_response(self, cb, msg, oid=None, coalesce=False):
+        self._serial.register_response(cb, msg, oid, coalesce)
+    def get_serialqueue(self):
+        return self._serial.get_serialqueue()
+    def alloc_command_queue(self, high_priority=False, coalesce_params=0):
+        return self._serial.alloc_command_queue(high_priority,
+                                                coalesce_params)
     def lookup_command(self, msgformat, cq=None):
         return CommandWrapper(self._serial, msgformat, cq)
     def lookup_query_command(self, msgformat, respformat, oid=None,
                              cq=None, is_async=False):
         return CommandQueryWrapper(self._serial, msgformat, respformat, oid,
                                    cq, is_async, self._printer.command_error)
-    def try_lookup_command(self, msgformat):
+    def try_lookup_command(self, msgformat, cq=None):
         try:
-            return self.lookup_command(msgformat)
+            return self.lookup_command(msgformat, cq)
         except self._serial.get_msgparser().error as e:
             return None
     def get_enumerations(self):
@@ -961,6 +1176,8 @@ class MCU:
         self._stepqueues.append(stepqueue)
     def request_move_queue_slot(self):
         self._reserved_move_slots += 1
+    def register_move_queue_name(self, oid, name):
+        self._move_queue_names[oid] = name
     def register_flush_callback(self, callback):
         self._flush_callbacks.append(callback)
     def flush_moves(self, print_time, clear_history_time):
@@ -999,27 +1216,157 @@ class MCU:
     def get_shutdown_clock(self):
         return self._shutdown_clock
     def get_status(self, eventtime=None):
-        return dict(self._get_status_info)
+        status = dict(self._get_status_info)
+        if self._move_queue_cmd is not None:
+            status['move_queues'] = dict(self._move_queue_stats)
+        return status
+    def get_move_queue_summary(self):
+        # Highest move queue usage and lowest move lead time of all objects
+        if not self._move_queue_stats:
+            return None
+        qstats = self._move_queue_stats.values()
+        res = {'max_count': max([qs['max_count'] for qs in qstats]),
+               'peak_count': max([qs['peak_count'] for qs in qstats])}
+        for key in ['min_lead_time', 'lowest_lead_time']:
+            leads = [qs[key] for qs in qstats if key in qs]
+            if leads:
+                res[key] = min(leads)
+        return res
+    def get_step_stats(self):
+        # Total queue_step messages generated for the steppers of this mcu
+        sc_stats = self._ffi_main.new('struct stepcompress_stats *')
+        msg_count = msg_bytes = adaptive_bytes = 0
+        for stepqueue in self._stepqueues:
+            self._ffi_lib.stepcompress_get_stats(stepqueue, sc_stats)
+            msg_count += sc_stats.msg_count
+            msg_bytes += sc_stats.msg_bytes
+            adaptive_bytes += sc_stats.adaptive_bytes
+        return msg_count, msg_bytes, adaptive_bytes
+    def get_step_memory_stats(self):
+        # Memory used for the step queues and step history of this
+        # mcu's steppers (and the high-water mark of the history memory)
+        sc_stats = self._ffi_main.new('struct stepcompress_stats *')
+        res = {'history_bytes': 0, 'history_peak_bytes': 0, 'queue_bytes': 0}
+        for stepqueue in self._stepqueues:
+            self._ffi_lib.stepcompress_get_stats(stepqueue, sc_stats)
+            for key in res:
+                res[key] += getattr(sc_stats, key)
+        return res
     def stats(self, eventtime):
         load = "mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
+        if self._mcu_move_min_free is not None:
+            load += " mcu_move_min_free=%d" % (self._mcu_move_min_free,)
+        mq_summary = self.get_move_queue_summary()
+        if mq_summary is not None:
+            load += " move_queue_max=%d" % (mq_summary['max_count'],)
+            if 'min_lead_time' in mq_summary:
+                load += " move_min_lead=%.3f" % (mq_summary['min_lead_time'],)
+        if self._stepqueues:
+            mem = self.get_step_memory_stats()
+            load += (" step_queue_bytes=%d step_history_bytes=%d"
+                     " step_history_peak_bytes=%d" % (
+                         mem['queue_bytes'], mem['history_bytes'],
+                         mem['history_peak_bytes']))
+        if self._adaptive_error_ratio:
+            step_msgs, step_bytes, adaptive_bytes = self.get_step_stats()
+            load += " step_bytes=%d step_adaptive_bytes=%d" % (
+                step_bytes, adaptive_bytes)
         stats = ' '.join([load, self._serial.stats(eventtime),
                           self._clocksync.stats(eventtime)])
+        msg_stats = self._serial.get_msgid_stats()
+        self._get_status_info['message_stats'] = msg_stats
+        for direction in ['send', 'receive']:
+            # Report the message types using the most bandwidth
+            key = direction + '_bytes'
+            top = sorted([(-st[key], name) for name, st in msg_stats.items()
+                          if st[key]])[:MSG_STATS_TOP]
+            stats += ''.join([" %s_%s=%d" % (key, name, -count)
+                              for count, name in top])
+        if self._profile is not None and not self.is_fileoutput():
+            stats += ' ' + self._profile.stats()
+            if not self._is_shutdown:
+                self._profile.query()
+        if self._move_queue_cmd is not None and not self.is_fileoutput():
+            self._move_queue_cmd.send()
         parts = [s.split('=', 1) for s in stats.split()]
         last_stats = {k:(float(v) if '.' in v else int(v)) for k, v in parts}
         self._get_status_info['last_stats'] = last_stats
         return False, '%s: %s' % (self._name, stats)
 
+# Connect to and configure all micro-controllers concurrently
+class MCUConnectGroup:
+    def __init__(self, printer):
+        self._printer = printer
+        self._reactor = printer.get_reactor()
+        self._mcus = []
+        printer.register_event_handler("klippy:mcu_identify",
+                                       self._mcu_identify)
+        printer.register_event_handler("klippy:connect", self._connect)
+    def add_mcu(self, mcu):
+        self._mcus.append(mcu)
+    def _start(self, func):
+        def callback(eventtime):
+            try:
+                func()
+            except Exception as e:
+                return e, traceback.format_exc()
+            return None
+        return self._reactor.register_callback(callback)
+    def _run_all(self, method, desc):
+        # Run the method of each mcu in its own greenlet and wait for all
+        completions = [(mcu, self._start(getattr(mcu, method)))
+                       for mcu in self._mcus]
+        errors = []
+        for mcu, completion in completions:
+            res = completion.wait()
+            if res is not None:
+                logging.info("MCU '%s' error during %s:\n%s",
+                             mcu.get_name(), desc, res[1])
+                errors.append(res[0])
+        if errors:
+            raise errors[0]
+    def _mcu_identify(self):
+        self._run_all('_mcu_connect', "identify")
+        for mcu in self._mcus:
+            mcu._mcu_identify()
+    def _connect(self):
+        self._run_all('_connect', "config")
+
 def add_printer_objects(config):
     printer = config.get_printer()
     reactor = printer.get_reactor()
+    connect_group = MCUConnectGroup(printer)
     mainsync = clocksync.ClockSync(reactor)
-    printer.add_object('mcu', MCU(config.getsection('mcu'), mainsync))
+    mainmcu = MCU(config.getsection('mcu'), mainsync)
+    printer.add_object('mcu', mainmcu)
+    connect_group.add_mcu(mainmcu)
     for s in config.get_prefix_sections('mcu '):
-        printer.add_object(s.section, MCU(
-            s, clocksync.SecondarySync(reactor, mainsync)))
+        secmcu = MCU(s, clocksync.SecondarySync(reactor, mainsync))
+        printer.add_object(s.section, secmcu)
+        connect_group.add_mcu(secmcu)
 
 def get_printer_mcu(printer, name):
     if name == 'mcu':
         return printer.lookup_object(name)
     return printer.lookup_object('mcu ' + name)
+
+# Lookup (or create) the communication thread shared by an mcu group
+def get_serial_thread(printer, group, sched):
+    name = 'serial_thread_group ' + group
+    serial_thread = printer.lookup_object(name, None)
+    if serial_thread is None:
+        serial_thread = serialhdl.SerialThread(*sched)
+        printer.add_object(name, serial_thread)
+    return serial_thread
+
+# Read the realtime priority and cpu affinity options of a host thread
+def get_thread_scheduling(config, prefix):
+    priority = config.getint(prefix + '_priority', 0, minval=0, maxval=99)
+    cpus = config.getintlist(prefix + '_cpus', ())
+    for cpu in cpus:
+        if cpu < 0 or cpu > 63:
+            raise config.error("Invalid cpu %d in option '%s_cpus'"
+                               " in section '%s'"
+                               % (cpu, prefix, config.get_name()))
+    return priority, sum([1 << cpu for cpu in cpus])
@@ -1,6 +1,6 @@
 # Protocol definitions for firmware communication
 #
-# Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import json, zlib, logging
@@ -23,6 +23,9 @@ MESSAGE_SEQ_MASK = 0x0f
 MESSAGE_DEST = 0x10
 MESSAGE_SYNC = 0x7e
 
+IDENTIFY_HASH_OFFSET = 0xffffffff
+IDENTIFY_HASH_SIZE = 8
+
 class error(Exception):
     pass
 
@@ -438,3 +441,85 @@ class MessageParser:
         return self.get_constant(name, default, parser=float)
     def get_constant_int(self, name, default=sentinel):
         return self.get_constant(name, default, parser=int)
+
+# Format message blocks with the C helper code (falling back to
+# MessageParser.dump() for any blocks the C code can not handle)
+class MessageDumper:
+    def __init__(self, msgparser):
+        self.msgparser = msgparser
+        self.msgdump = None
+        try:
+            import chelper
+            self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        except Exception:
+            logging.info("Unable to load C helper - using python dump")
+            return
+        self.msgdump = self.ffi_main.gc(
+            self.ffi_lib.msgdump_alloc(int(bytes is not str)),
+            self.ffi_lib.msgdump_free)
+        self.out_buf = self.ffi_main.new('char[65536]')
+        self.out_pos = self.ffi_main.new('int *')
+        for msgid, mid in sorted(msgparser.messages_by_id.items()):
+            self._add_format(msgid, mid)
+    def _add_format(self, msgid, mid):
+        if isinstance(mid, OutputFormat):
+            types = [(t.is_dynamic_string, t.is_int and t.signed, None)
+                     for t in mid.param_types]
+            prefix = "#output "
+        else:
+            types = []
+            for name, t in mid.param_names:
+                enums = None
+                if isinstance(t, Enumeration):
+                    enums = t.reverse_enums
+                    t = t.pt
+                if enums is not None and not t.is_int:
+                    return
+                types.append((t.is_dynamic_string, t.is_int and t.signed,
+                              enums))
+            prefix = ""
+        try:
+            template = prefix + mid.debugformat % (('\x01',) * len(types))
+        except (TypeError, ValueError):
+            return
+        if template.count('\x01') != len(types) or '\n' in template:
+            return
+        param_types = ""
+        for is_string, is_signed, enums in types:
+            if is_string:
+                param_types += 's'
+            else:
+                c = 'i' if is_signed else 'u'
+                param_types += c.upper() if enums is not None else c
+        self.ffi_lib.msgdump_add_format(self.msgdump, msgid,
+                                        template.encode(),
+                                        param_types.encode())
+        for i, (is_string, is_signed, enums) in enumerate(types):
+            for value, name in (enums or {}).items():
+                self.ffi_lib.msgdump_add_enum(self.msgdump, msgid, i, value,
+                                              str(name).encode())
+    def dump_blocks(self, data):
+        # Return the dump() output of the valid blocks at the start of
+        # data and the number of bytes of data consumed
+        if self.msgdump is None:
+            return [], 0
+        out = []
+        pos = 0
+        data = bytearray(data)
+        buf = self.ffi_main.cast('uint8_t *', self.ffi_main.from_buffer(data))
+        while 1:
+            count = self.ffi_lib.msgdump_format_blocks(
+                self.msgdump, buf + pos, len(data) - pos, self.out_buf,
+                len(self.out_buf), self.out_pos)
+            if not count:
+                break
+            pos += count
+            text = self.ffi_main.buffer(self.out_buf, self.out_pos[0])[:]
+            out.extend([blk.split('\n')
+                        for blk in text.decode().split('\0')[:-1]])
+        return out, pos
+    def dump(self, s):
+        out, count = self.dump_blocks(s)
+        if count != len(s) or len(out) != 1:
+            return self.msgparser.dump(s)
+        return out[0]
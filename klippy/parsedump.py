@@ -20,16 +20,22 @@ def main():
 
     mp = msgproto.MessageParser()
     mp.process_identify(dictionary, decompress=False)
+    dumper = msgproto.MessageDumper(mp)
 
     f = open(data_filename, 'rb')
     fd = f.fileno()
     data = bytearray()
     while 1:
-        newdata = os.read(fd, 4096)
+        newdata = os.read(fd, 65536)
         if not newdata:
             break
         data += bytearray(newdata)
         while 1:
+            blocks, l = dumper.dump_blocks(data)
+            if blocks:
+                sys.stdout.write(''.join(['\n'.join(msgs[1:]) + '\n'
+                                          for msgs in blocks]))
+                data = data[l:]
             l = mp.check_packet(data)
             if l == 0:
                 break
@@ -1,9 +1,9 @@
 # Code to implement asynchronous logging from a background thread
 #
-# Copyright (C) 2016-2019  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, logging.handlers, threading, queue, time
+import logging, logging.handlers, threading, queue, time, struct, zlib, os
 
 # Class to forward all messages through a queue to a background thread
 class QueueHandler(logging.Handler):
@@ -29,15 +29,22 @@ class QueueListener(logging.handlers.TimedRotatingFileHandler):
         self.bg_thread = threading.Thread(target=self._bg_thread)
         self.bg_thread.start()
         self.rollover_info = {}
+        self.binlog = None
     def _bg_thread(self):
         while 1:
             record = self.bg_queue.get(True)
             if record is None:
                 break
+            if type(record) is tuple:
+                if self.binlog is not None:
+                    self.binlog.write_record(*record)
+                continue
             self.handle(record)
     def stop(self):
         self.bg_queue.put_nowait(None)
         self.bg_thread.join()
+        if self.binlog is not None:
+            self.binlog.close()
     def set_rollover_info(self, name, info):
         if info is None:
             self.rollover_info.pop(name, None)
@@ -55,11 +62,201 @@ class QueueListener(logging.handlers.TimedRotatingFileHandler):
         self.emit(logging.makeLogRecord(
             {'msg': "\n".join(lines), 'level': logging.INFO}))
 
+
+######################################################################
+# Binary log
+######################################################################
+
+# The binary log file starts with BINLOG_MAGIC followed by a series of
+# records.  Each record has a header (record type, payload length, and
+# the reactor eventtime of the record) followed by its payload.
+BINLOG_MAGIC = b"KLIPPER-BINLOG-1\n"
+BINLOG_HEADER = struct.Struct("<BId")
+# Names of the values in later BL_STATS records: u16 schema id, names
+BL_SCHEMA = 1
+# Periodic stats: u16 schema id, one double for each value
+BL_STATS = 2
+# Stats containing non-numeric values: text of the stats message
+BL_STATS_TEXT = 3
+# Mcu data dictionary: mcu name, zlib compressed dictionary
+BL_DICT = 4
+# Mcu message dump: mcu name, serial stats, clock estimate, sent and
+# received messages
+BL_DUMP = 5
+BL_CLOCK_EST = struct.Struct("<ddd")
+BL_MESSAGE = struct.Struct("<ddB")
+# Once the file reaches this size it is renamed to "<filename>.1"
+# (replacing any previous one) and a new file is started
+BINLOG_MAX_SIZE = 64 * 1024 * 1024
+
+# Writer for the binary log (invoked from the background logging thread)
+class BinaryLogWriter:
+    def __init__(self, filename, max_size=BINLOG_MAX_SIZE):
+        self.filename = filename
+        self.max_size = max_size
+        self.dicts = {}
+        self._open()
+    def _open(self):
+        self.file = open(self.filename, 'ab')
+        if not self.file.tell():
+            self.file.write(BINLOG_MAGIC)
+        self.schemas = {}
+    def close(self):
+        self.file.close()
+    def _rollover(self):
+        self.file.close()
+        os.rename(self.filename, self.filename + ".1")
+        self._open()
+        # Each file must contain the dictionaries needed to decode it
+        for name, (eventtime, data) in sorted(self.dicts.items()):
+            self._write(BL_DICT, eventtime, data)
+    def _write(self, rtype, eventtime, data):
+        self.file.write(BINLOG_HEADER.pack(rtype, len(data), eventtime))
+        self.file.write(data)
+    def _write_stats(self, eventtime, msg, reg_names=(), reg_values=()):
+        names, values = parse_stats_msg(msg)
+        if values is None:
+            text = format_binlog_stats(list(zip(reg_names, reg_values)))
+            text = ' '.join([t for t in (text, msg) if t])
+            self._write(BL_STATS_TEXT, eventtime, text.encode())
+            return
+        names = tuple(reg_names) + tuple(names)
+        values = tuple(reg_values) + tuple(values)
+        schema_id = self.schemas.get(names)
+        if schema_id is None:
+            self.schemas[names] = schema_id = len(self.schemas)
+            data = struct.pack("<H", schema_id) + '\0'.join(names).encode()
+            self._write(BL_SCHEMA, eventtime, data)
+        data = struct.pack("<H%dd" % (len(values),), schema_id, *values)
+        self._write(BL_STATS, eventtime, data)
+        self.file.flush()
+    def _write_dict(self, eventtime, name, data):
+        if not isinstance(data, bytes):
+            data = data.encode()
+        data = name.encode() + b'\0' + zlib.compress(data)
+        self.dicts[name] = (eventtime, data)
+        self._write(BL_DICT, eventtime, data)
+        self.file.flush()
+    def _write_dump(self, eventtime, name, stats, clock_est, sent, received):
+        out = [name.encode(), b'\0', stats.encode(), b'\0',
+               BL_CLOCK_EST.pack(*clock_est)]
+        for msgs in (sent, received):
+            out.append(struct.pack("<H", len(msgs)))
+            for sent_time, receive_time, msg in msgs:
+                out.append(BL_MESSAGE.pack(sent_time, receive_time, len(msg)))
+                out.append(msg)
+        self._write(BL_DUMP, eventtime, b''.join(out))
+        self.file.flush()
+    def write_record(self, rtype, eventtime, *args):
+        if self.file.tell() >= self.max_size:
+            self._rollover()
+        if rtype == BL_STATS:
+            self._write_stats(eventtime, *args)
+        elif rtype == BL_DICT:
+            self._write_dict(eventtime, *args)
+        elif rtype == BL_DUMP:
+            self._write_dump(eventtime, *args)
+
+# Iterate over the records of a binary log file - yields (record
+# type, eventtime, decoded payload) tuples
+def read_binlog(f):
+    if f.read(len(BINLOG_MAGIC)) != BINLOG_MAGIC:
+        raise ValueError("Not a binary log file")
+    schemas = {}
+    while 1:
+        header = f.read(BINLOG_HEADER.size)
+        if len(header) < BINLOG_HEADER.size:
+            break
+        rtype, length, eventtime = BINLOG_HEADER.unpack(header)
+        data = f.read(length)
+        if len(data) < length:
+            break
+        if rtype == BL_SCHEMA:
+            schema_id = struct.unpack_from("<H", data)[0]
+            names = data[2:].decode().split('\0')
+            schemas[schema_id] = names if names != [''] else []
+        elif rtype == BL_STATS:
+            schema_id = struct.unpack_from("<H", data)[0]
+            names = schemas.get(schema_id)
+            if names is None:
+                continue
+            values = struct.unpack_from("<%dd" % (len(names),), data, 2)
+            yield rtype, eventtime, list(zip(names, values))
+        elif rtype == BL_STATS_TEXT:
+            yield rtype, eventtime, data.decode()
+        elif rtype == BL_DICT:
+            name, zdata = data.split(b'\0', 1)
+            yield rtype, eventtime, (name.decode(), zlib.decompress(zdata))
+        elif rtype == BL_DUMP:
+            name, stats, data = data.split(b'\0', 2)
+            clock_est = BL_CLOCK_EST.unpack_from(data)
+            pos = BL_CLOCK_EST.size
+            dumps = []
+            for i in range(2):
+                count = struct.unpack_from("<H", data, pos)[0]
+                pos += 2
+                msgs = []
+                for j in range(count):
+                    sent_time, receive_time, mlen = BL_MESSAGE.unpack_from(
+                        data, pos)
+                    pos += BL_MESSAGE.size
+                    msgs.append((sent_time, receive_time,
+                                 bytearray(data[pos:pos+mlen])))
+                    pos += mlen
+                dumps.append(msgs)
+            yield rtype, eventtime, (name.decode(), stats.decode(),
+                                     clock_est, dumps[0], dumps[1])
+
+# Split the text of a stats message into a list of names (including
+# any "prefix:" part) and a list of values.  The values are None if the
+# message contains non-numeric values.
+def parse_stats_msg(msg):
+    prefix = ""
+    names = []
+    values = []
+    for part in msg.split():
+        if '=' not in part:
+            prefix = part
+            continue
+        name, val = part.split('=', 1)
+        try:
+            values.append(float(val))
+        except ValueError:
+            return names, None
+        names.append(prefix + name)
+    return names, values
+
+# Produce the text form of the values in a BL_STATS record
+def format_binlog_stats(values):
+    out = []
+    prefix = ""
+    for key, val in values:
+        name = key
+        if ':' in key:
+            p, name = key.rsplit(':', 1)
+            if p + ':' != prefix:
+                prefix = p + ':'
+                out.append(prefix)
+        val = float(val)
+        if val.is_integer():
+            val = int(val)
+        out.append("%s=%s" % (name, repr(val)))
+    return ' '.join(out)
+
+
+######################################################################
+# Setup
+######################################################################
+
 MainQueueHandler = None
+MainBinaryLog = False
 
-def setup_bg_logging(filename, debuglevel):
-    global MainQueueHandler
+def setup_bg_logging(filename, debuglevel, binlog_filename=None):
+    global MainQueueHandler, MainBinaryLog
     ql = QueueListener(filename)
+    if binlog_filename is not None:
+        ql.binlog = BinaryLogWriter(binlog_filename)
+        MainBinaryLog = True
     MainQueueHandler = QueueHandler(ql.bg_queue)
     root = logging.getLogger()
     root.addHandler(MainQueueHandler)
@@ -67,9 +264,31 @@ def setup_bg_logging(filename, debuglevel):
     return ql
 
 def clear_bg_logging():
-    global MainQueueHandler
+    global MainQueueHandler, MainBinaryLog
     if MainQueueHandler is not None:
         root = logging.getLogger()
         root.removeHandler(MainQueueHandler)
         root.setLevel(logging.WARNING)
         MainQueueHandler = None
+        MainBinaryLog = False
+
+# Binary log helpers (these return False if there is no binary log)
+def is_binary_log_active():
+    return MainQueueHandler is not None and MainBinaryLog
+
+def _binlog_record(*record):
+    handler = MainQueueHandler
+    if handler is None or not MainBinaryLog:
+        return False
+    handler.queue.put_nowait(record)
+    return True
+
+def log_binary_stats(eventtime, msg, reg_names=(), reg_values=()):
+    return _binlog_record(BL_STATS, eventtime, msg, reg_names, reg_values)
+
+def log_binary_dict(eventtime, name, data):
+    return _binlog_record(BL_DICT, eventtime, name, data)
+
+def log_binary_dump(eventtime, name, stats, clock_est, sent, received):
+    return _binlog_record(BL_DUMP, eventtime, name, stats,
+                          clock_est, sent, received)
@@ -1,9 +1,9 @@
 # File descriptor and timer event helper
 #
-# Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, queue
+import os, gc, select, math, time, logging, queue, heapq, struct
 import greenlet
 import chelper, util
 
@@ -14,6 +14,8 @@ class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        self.is_registered = True
+        self.heap_entry = None
 
 class ReactorCompletion:
     class sentinel: pass
@@ -101,12 +103,16 @@ class SelectReactor:
         # Python garbage collection
         self._check_gc = gc_checking
         self._last_gc_times = [0., 0., 0.]
-        # Timers
-        self._timers = []
+        # Timers (a heap of [waketime, sequence, timer] entries - an entry
+        # is stale if it is no longer its timer's heap_entry)
+        self._timer_heap = []
+        self._timer_seq = 0
+        self._stale_timers = 0
         self._next_timer = self.NEVER
         # Callbacks
         self._pipe_fds = None
         self._async_queue = queue.Queue()
+        self._async_polls = []
         # File descriptors
         self._read_fds = []
         self._write_fds = []
@@ -117,21 +123,34 @@ class SelectReactor:
     def get_gc_stats(self):
         return tuple(self._last_gc_times)
     # Timers
-    def update_timer(self, timer_handler, waketime):
+    def _schedule_timer(self, timer_handler, waketime):
         timer_handler.waketime = waketime
         self._next_timer = min(self._next_timer, waketime)
+        if timer_handler.heap_entry is not None:
+            timer_handler.heap_entry = None
+            self._stale_timers += 1
+        if waketime >= self.NEVER or not timer_handler.is_registered:
+            return
+        entry = [waketime, self._timer_seq, timer_handler]
+        self._timer_seq += 1
+        timer_handler.heap_entry = entry
+        heap = self._timer_heap
+        heapq.heappush(heap, entry)
+        if self._stale_timers > 32 and self._stale_timers * 2 > len(heap):
+            # Discard stale entries
+            heap = [e for e in heap if e[2].heap_entry is e]
+            heapq.heapify(heap)
+            self._timer_heap = heap
+            self._stale_timers = 0
+    def update_timer(self, timer_handler, waketime):
+        self._schedule_timer(timer_handler, waketime)
     def register_timer(self, callback, waketime=NEVER):
-        timer_handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(timer_handler)
-        self._timers = timers
-        self._next_timer = min(self._next_timer, waketime)
+        timer_handler = ReactorTimer(callback, self.NEVER)
+        self._schedule_timer(timer_handler, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
-        timer_handler.waketime = self.NEVER
-        timers = list(self._timers)
-        timers.pop(timers.index(timer_handler))
-        self._timers = timers
+        timer_handler.is_registered = False
+        self._schedule_timer(timer_handler, self.NEVER)
     def _check_timers(self, eventtime, busy):
         if eventtime < self._next_timer:
             if busy:
@@ -149,19 +168,30 @@ class SelectReactor:
                     gc.collect(gc_level)
                     return 0.
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
-        return 0.
+        # Only run timers scheduled before this pass (a timer that
+        # reschedules itself to the past is run on the next pass)
+        seq_limit = self._timer_seq
+        while 1:
+            heap = self._timer_heap
+            while heap and heap[0][2].heap_entry is not heap[0]:
+                heapq.heappop(heap)
+                self._stale_timers -= 1
+            if not heap:
+                self._next_timer = self.NEVER
+                return 0.
+            waketime, seq, t = heap[0]
+            if eventtime < waketime or seq >= seq_limit:
+                self._next_timer = waketime
+                return 0.
+            heapq.heappop(heap)
+            t.heap_entry = None
+            t.waketime = self.NEVER
+            waketime = t.callback(eventtime)
+            self._schedule_timer(t, waketime)
+            if g_dispatch is not self._g_dispatch:
+                self._end_greenlet(g_dispatch)
+                return 0.
     # Callbacks and Completions
     def completion(self):
         return ReactorCompletion(self)
@@ -169,19 +199,28 @@ class SelectReactor:
         rcb = ReactorCallback(self, callback, waketime)
         return rcb.completion
     # Asynchronous (from another thread) callbacks and completions
-    def register_async_callback(self, callback, waketime=NOW):
-        self._async_queue.put_nowait(
-            (ReactorCallback, (self, callback, waketime)))
+    def _async_signal(self):
         try:
-            os.write(self._pipe_fds[1], b'.')
+            os.write(self._pipe_fds[1], struct.pack("=Q", 1))
         except os.error:
             pass
+    def register_async_callback(self, callback, waketime=NOW):
+        self._async_queue.put_nowait(
+            (ReactorCallback, (self, callback, waketime)))
+        self._async_signal()
     def async_complete(self, completion, result):
         self._async_queue.put_nowait((completion.complete, (result,)))
-        try:
-            os.write(self._pipe_fds[1], b'.')
-        except os.error:
-            pass
+        self._async_signal()
+    # Callbacks run in the main thread each time the wake fd is
+    # signaled.  The returned fd may be signaled directly from C code
+    # (by writing an 8 byte counter increment to it).
+    def register_async_poll(self, callback):
+        if self._pipe_fds is None:
+            self._setup_async_callbacks()
+        self._async_polls = self._async_polls + [callback]
+        return self._pipe_fds[1]
+    def unregister_async_poll(self, callback):
+        self._async_polls = [p for p in self._async_polls if p != callback]
     def _got_pipe_signal(self, eventtime):
         try:
             os.read(self._pipe_fds[0], 4096)
@@ -193,10 +232,17 @@ class SelectReactor:
             except queue.Empty:
                 break
             func(*args)
+        for poll_cb in self._async_polls:
+            poll_cb(eventtime)
     def _setup_async_callbacks(self):
-        self._pipe_fds = os.pipe()
-        util.set_nonblock(self._pipe_fds[0])
-        util.set_nonblock(self._pipe_fds[1])
+        if hasattr(os, 'eventfd'):
+            # A single eventfd is both the read and write side
+            fd = os.eventfd(0, os.EFD_NONBLOCK | os.EFD_CLOEXEC)
+            self._pipe_fds = (fd, fd)
+        else:
+            self._pipe_fds = os.pipe()
+            util.set_nonblock(self._pipe_fds[0])
+            util.set_nonblock(self._pipe_fds[1])
         self.register_fd(self._pipe_fds[0], self._got_pipe_signal)
     # Greenlets
     def _sys_pause(self, waketime):
@@ -302,8 +348,8 @@ class SelectReactor:
                 logging.exception("reactor finalize greenlet terminate")
         self._all_greenlets = []
         if self._pipe_fds is not None:
-            os.close(self._pipe_fds[0])
-            os.close(self._pipe_fds[1])
+            for fd in set(self._pipe_fds):
+                os.close(fd)
             self._pipe_fds = None
 
 class PollReactor(SelectReactor):
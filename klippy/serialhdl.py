@@ -1,16 +1,22 @@
 # Serial port management for firmware communication
 #
-# Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading, os
+import logging, threading, os, socket, stat, hashlib, binascii
 import serial
 
-import msgproto, chelper, util
+import msgproto, chelper, util, queuelogger
 
 class error(Exception):
     pass
 
+DISPATCH_MAX_PARAMS = 16
+SQ_PRIORITY_HIGH = 1 # Must match serialqueue.h
+
+# Location of previously downloaded data dictionaries
+IDENTIFY_CACHE_DIR = "~/.cache/klipper/dictionaries"
+
 class SerialReader:
     def __init__(self, reactor, warn_prefix=""):
         self.reactor = reactor
@@ -21,52 +27,140 @@ class SerialReader:
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
         self.serialqueue = None
+        self.adaptive_window = False
+        self.sched_priority = self.sched_cpu_mask = 0
+        self.shared_thread = None
         self.default_cmd_queue = self.alloc_command_queue()
+        self.canbus_sched = None
         self.stats_buf = self.ffi_main.new('char[4096]')
-        # Threading
+        self.msgid_stats_buf = self.ffi_main.new(
+            'struct serialqueue_msgid_stats[1024]')
+        # Response delivery (from the reactor's main thread)
         self.lock = threading.Lock()
-        self.background_thread = None
+        self.pull_buf = self.ffi_main.new('struct pull_queue_message[32]')
+        self.is_polling = False
         # Message handlers
         self.handlers = {}
+        self.coalesce_handlers = set()
+        self.dispatch_ids = {}
+        self.dispatchers = {}
         self.register_response(self._handle_unknown_init, '#unknown')
         self.register_response(self.handle_output, '#output')
         # Sent message notification tracking
         self.last_notify_id = 0
         self.pending_notifications = {}
-    def _bg_thread(self):
-        response = self.ffi_main.new('struct pull_queue_message *')
-        while 1:
-            self.ffi_lib.serialqueue_pull(self.serialqueue, response)
-            count = response.len
-            if count < 0:
+    def _pull_messages(self, eventtime):
+        # Deliver all available responses (the serialqueue signals the
+        # reactor's wake fd once new messages arrive)
+        responses = self.pull_buf
+        while self.serialqueue is not None:
+            rcount = self.ffi_lib.serialqueue_pull_nowait(
+                self.serialqueue, responses, len(responses))
+            if rcount <= 0:
                 break
-            if response.notify_id:
-                params = {'#sent_time': response.sent_time,
-                          '#receive_time': response.receive_time}
-                completion = self.pending_notifications.pop(response.notify_id)
-                self.reactor.async_complete(completion, params)
-                continue
-            params = self.msgparser.parse(response.msg[0:count])
-            params['#sent_time'] = response.sent_time
-            params['#receive_time'] = response.receive_time
+            for i in range(rcount):
+                self._handle_pulled(responses[i])
+    def _start_polling(self):
+        wake_fd = self.reactor.register_async_poll(self._pull_messages)
+        self.is_polling = True
+        self.ffi_lib.serialqueue_set_wake_fd(self.serialqueue, wake_fd)
+    def _stop_polling(self):
+        if self.is_polling:
+            self.reactor.unregister_async_poll(self._pull_messages)
+            self.is_polling = False
+            # Deliver any responses received prior to the disconnect
+            self._pull_messages(self.reactor.monotonic())
+    def _handle_pulled(self, response):
+        if response.notify_id:
+            params = {'#sent_time': response.sent_time,
+                      '#receive_time': response.receive_time}
+            completion = self.pending_notifications.pop(response.notify_id)
+            completion.complete(params)
+            return
+        dispatch = self.dispatchers.get(response.dispatch_id)
+        if dispatch is None:
+            params = self.msgparser.parse(response.msg[0:response.len])
             hdl = (params['#name'], params.get('oid'))
-            try:
-                with self.lock:
-                    hdl = self.handlers.get(hdl, self.handle_default)
-                    hdl(params)
-            except:
-                logging.exception("%sException in serial callback",
-                                  self.warn_prefix)
+        else:
+            # Parameters were decoded in the C code
+            hdl, param_names = dispatch
+            params = dict(zip(param_names, response.params))
+            params['#name'] = hdl[0]
+        params['#sent_time'] = response.sent_time
+        params['#receive_time'] = response.receive_time
+        try:
+            with self.lock:
+                hdl = self.handlers.get(hdl, self.handle_default)
+                hdl(params)
+        except:
+            logging.exception("%sException in serial callback",
+                              self.warn_prefix)
     def _error(self, msg, *params):
         raise error(self.warn_prefix + (msg % params))
+    def _get_identify_cache_file(self, identify_hash):
+        dirname = os.path.expanduser(IDENTIFY_CACHE_DIR)
+        return os.path.join(dirname, binascii.hexlify(identify_hash).decode())
+    def _check_identify_hash(self, identify_hash, identify_data):
+        digest = hashlib.sha1(identify_data).digest()
+        return digest[:msgproto.IDENTIFY_HASH_SIZE] == identify_hash
+    def _read_identify_cache(self, identify_hash):
+        filename = self._get_identify_cache_file(identify_hash)
+        try:
+            f = open(filename, 'rb')
+            identify_data = f.read()
+            f.close()
+        except (IOError, OSError):
+            return None
+        if not self._check_identify_hash(identify_hash, identify_data):
+            logging.info("%sIgnoring corrupt data dictionary cache %s",
+                         self.warn_prefix, filename)
+            return None
+        return identify_data
+    def _write_identify_cache(self, identify_hash, identify_data):
+        if not self._check_identify_hash(identify_hash, identify_data):
+            return
+        filename = self._get_identify_cache_file(identify_hash)
+        tmpname = "%s.%d.tmp" % (filename, os.getpid())
+        try:
+            dirname = os.path.dirname(filename)
+            if not os.path.isdir(dirname):
+                os.makedirs(dirname)
+            f = open(tmpname, 'wb')
+            f.write(identify_data)
+            f.close()
+            os.rename(tmpname, filename)
+        except (IOError, OSError) as e:
+            logging.warning("%sUnable to cache data dictionary: %s",
+                            self.warn_prefix, e)
+    def _get_identify_hash(self):
+        # Newer micro-controller code reports a hash of its dictionary
+        msg = "identify offset=%d count=%d" % (msgproto.IDENTIFY_HASH_OFFSET,
+                                               msgproto.IDENTIFY_HASH_SIZE)
+        params = self.send_with_response(msg, 'identify_response')
+        msgdata = params['data']
+        if (params['offset'] != msgproto.IDENTIFY_HASH_OFFSET
+            or len(msgdata) != msgproto.IDENTIFY_HASH_SIZE):
+            return None
+        return bytes(msgdata)
     def _get_identify_data(self, eventtime):
+        # Check for a previously downloaded copy of the "data dictionary"
+        try:
+            identify_hash = self._get_identify_hash()
+        except error:
+            logging.exception("%sWait for identify_response",
+                              self.warn_prefix)
+            return None
+        if identify_hash is not None:
+            identify_data = self._read_identify_cache(identify_hash)
+            if identify_data is not None:
+                return identify_data
         # Query the "data dictionary" from the micro-controller
         identify_data = b""
         while 1:
             msg = "identify offset=%d count=%d" % (len(identify_data), 40)
             try:
                 params = self.send_with_response(msg, 'identify_response')
-            except error as e:
+            except error:
                 logging.exception("%sWait for identify_response",
                                   self.warn_prefix)
                 return None
@@ -74,16 +168,23 @@ class SerialReader:
                 msgdata = params['data']
                 if not msgdata:
                     # Done
+                    if identify_hash is not None:
+                        self._write_identify_cache(identify_hash,
+                                                   identify_data)
                     return identify_data
                 identify_data += msgdata
     def _start_session(self, serial_dev, serial_fd_type=b'u', client_id=0):
         self.serial_dev = serial_dev
-        self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
-                                           serial_fd_type, client_id),
-            self.ffi_lib.serialqueue_free)
-        self.background_thread = threading.Thread(target=self._bg_thread)
-        self.background_thread.start()
+        if self.shared_thread is not None:
+            sq = self.ffi_lib.serialqueue_alloc_shared(
+                serial_dev.fileno(), serial_fd_type, client_id,
+                self.shared_thread.get_c_thread())
+        else:
+            sq = self.ffi_lib.serialqueue_alloc(
+                serial_dev.fileno(), serial_fd_type, client_id,
+                self.sched_priority, self.sched_cpu_mask)
+        self.serialqueue = self.ffi_main.gc(sq, self.ffi_lib.serialqueue_free)
+        self._start_polling()
         # Obtain and load the data dictionary from the firmware
         completion = self.reactor.register_callback(self._get_identify_data)
         identify_data = completion.wait(self.reactor.monotonic() + 5.)
@@ -95,23 +196,53 @@ class SerialReader:
         msgparser.process_identify(identify_data)
         self.msgparser = msgparser
         self.register_response(self.handle_unknown, '#unknown')
+        with self.lock:
+            for name, oid in list(self.dispatch_ids):
+                self._remove_dispatch(name, oid)
+            for name, oid in self.handlers:
+                self._add_dispatch(name, oid)
         # Setup baud adjust
-        if serial_fd_type == b'c':
+        if serial_fd_type in (b'c', b'd'):
             wire_freq = msgparser.get_constant_float('CANBUS_FREQUENCY', None)
+        elif serial_fd_type == b'n':
+            wire_freq = msgparser.get_constant_float('ETHERNET_FREQUENCY',
+                                                     None)
         else:
             wire_freq = msgparser.get_constant_float('SERIAL_BAUD', None)
         if wire_freq is not None:
             self.ffi_lib.serialqueue_set_wire_frequency(self.serialqueue,
                                                         wire_freq)
+        if serial_fd_type == b'd':
+            data_freq = msgparser.get_constant_float('CANBUS_FD_FREQUENCY',
+                                                     None)
+            if data_freq is None:
+                logging.warning("%sCAN FD requested but mcu does not"
+                                " report CANBUS_FD_FREQUENCY", self.warn_prefix)
+            else:
+                self.ffi_lib.serialqueue_set_data_frequency(self.serialqueue,
+                                                            data_freq)
         receive_window = msgparser.get_constant_int('RECEIVE_WINDOW', None)
         if receive_window is not None:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
+        if self.adaptive_window:
+            self.ffi_lib.serialqueue_set_adaptive_window(self.serialqueue, 1)
+        sack_blocks = msgparser.get_constant_int('SELECTIVE_ACK', None)
+        sack_msg = msgparser.messages_by_name.get('selective_ack')
+        if (sack_blocks is not None and sack_msg is not None
+            and sack_msg.msgformat == "selective_ack mask=%c"):
+            prefix = list(sack_msg.msgid_bytes)
+            self.ffi_lib.serialqueue_set_selective_ack(
+                self.serialqueue, prefix, len(prefix), sack_blocks)
         return True
-    def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0"):
+    def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0",
+                       canbus_fd=False, canbus_sched=None):
         import can # XXX
         txid = canbus_nodeid * 2 + 256
-        filters = [{"can_id": txid+1, "can_mask": 0x7ff, "extended": False}]
+        CANBUS_ID_BULK_OFFSET = 0x400
+        filters = [{"can_id": txid+1, "can_mask": 0x7ff, "extended": False},
+                   {"can_id": txid+1 + CANBUS_ID_BULK_OFFSET,
+                    "can_mask": 0x7ff, "extended": False}]
         # Prep for SET_NODEID command
         try:
             uuid = int(canbus_uuid, 16)
@@ -134,7 +265,7 @@ class SerialReader:
             try:
                 bus = can.interface.Bus(channel=canbus_iface,
                                         can_filters=filters,
-                                        bustype='socketcan')
+                                        bustype='socketcan', fd=canbus_fd)
                 bus.send(set_id_msg)
             except (can.CanError, os.error, IOError) as e:
                 logging.warning("%sUnable to open CAN port: %s",
@@ -142,9 +273,14 @@ class SerialReader:
                 self.reactor.pause(self.reactor.monotonic() + 5.)
                 continue
             bus.close = bus.shutdown # XXX
-            ret = self._start_session(bus, b'c', txid)
+            ret = self._start_session(bus, b'd' if canbus_fd else b'c', txid)
             if not ret:
                 continue
+            if canbus_sched is not None:
+                # Share bus bandwidth with other mcus on this interface
+                self.canbus_sched = canbus_sched
+                self.ffi_lib.serialqueue_set_canbus_sched(self.serialqueue,
+                                                          canbus_sched)
             # Verify correct canbus_nodeid to canbus_uuid mapping
             try:
                 params = self.send_with_response('get_canbus_id', 'canbus_id')
@@ -164,14 +300,50 @@ class SerialReader:
             if self.reactor.monotonic() > start_time + 90.:
                 self._error("Unable to connect")
             try:
-                fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
-            except OSError as e:
+                if stat.S_ISSOCK(os.stat(filename).st_mode):
+                    # Host mcu listening on a unix socket
+                    serial_dev = socket.socket(socket.AF_UNIX,
+                                               socket.SOCK_STREAM)
+                    serial_dev.connect(filename)
+                    serial_fd_type = b's'
+                else:
+                    fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
+                    serial_dev = os.fdopen(fd, 'rb+', 0)
+                    serial_fd_type = b'u'
+            except (OSError, socket.error) as e:
                 logging.warning("%sUnable to open port: %s",
                                 self.warn_prefix, e)
                 self.reactor.pause(self.reactor.monotonic() + 5.)
                 continue
-            serial_dev = os.fdopen(fd, 'rb+', 0)
-            ret = self._start_session(serial_dev)
+            ret = self._start_session(serial_dev, serial_fd_type)
+            if ret:
+                break
+    def connect_udp(self, address):
+        # Address is in "host:port" form (with "[host]:port" for ipv6)
+        host, sep, port = address.rpartition(':')
+        try:
+            port = int(port)
+        except ValueError:
+            port = -1
+        if not sep or not host or port < 1 or port > 65535:
+            self._error("Invalid udp address '%s'", address)
+        host = host.strip('[]')
+        logging.info("%sStarting udp connect", self.warn_prefix)
+        start_time = self.reactor.monotonic()
+        while 1:
+            if self.reactor.monotonic() > start_time + 90.:
+                self._error("Unable to connect")
+            try:
+                addrs = socket.getaddrinfo(host, port, 0, socket.SOCK_DGRAM)
+                family, socktype, proto, cname, sockaddr = addrs[0]
+                serial_dev = socket.socket(family, socktype, proto)
+                serial_dev.connect(sockaddr)
+            except (OSError, socket.error) as e:
+                logging.warning("%sUnable to open udp socket: %s",
+                                self.warn_prefix, e)
+                self.reactor.pause(self.reactor.monotonic() + 5.)
+                continue
+            ret = self._start_session(serial_dev, b'n')
             if ret:
                 break
     def connect_uart(self, serialport, baud, rts=True):
@@ -200,17 +372,28 @@ class SerialReader:
         self.serial_dev = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
         self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(), b'f', 0),
+            self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(), b'f', 0,
+                                           0, 0),
             self.ffi_lib.serialqueue_free)
     def set_clock_est(self, freq, conv_time, conv_clock, last_clock):
         self.ffi_lib.serialqueue_set_clock_est(
             self.serialqueue, freq, conv_time, conv_clock, last_clock)
+    def set_clock_sync(self, clock_msgid, mcu_freq, sent_time, clock):
+        self.ffi_lib.serialqueue_set_clock_sync(
+            self.serialqueue, clock_msgid, mcu_freq, sent_time, clock)
+    def get_clock_sync(self):
+        cs = self.ffi_main.new('struct clock_sync_state *')
+        if self.serialqueue is not None:
+            self.ffi_lib.serialqueue_get_clock_sync(self.serialqueue, cs)
+        return cs
     def disconnect(self):
         if self.serialqueue is not None:
             self.ffi_lib.serialqueue_exit(self.serialqueue)
-            if self.background_thread is not None:
-                self.background_thread.join()
-            self.background_thread = self.serialqueue = None
+            self._stop_polling()
+            self.serialqueue = None
+            with self.lock:
+                self.dispatch_ids.clear()
+                self.dispatchers.clear()
         if self.serial_dev is not None:
             self.serial_dev.close()
             self.serial_dev = None
@@ -223,6 +406,34 @@ class SerialReader:
         self.ffi_lib.serialqueue_get_stats(self.serialqueue,
                                            self.stats_buf, len(self.stats_buf))
         return str(self.ffi_main.string(self.stats_buf).decode())
+    def get_msgid_stats(self):
+        # Return the bytes and messages sent and received per message type
+        if self.serialqueue is None:
+            return {}
+        ms = self.msgid_stats_buf
+        count = self.ffi_lib.serialqueue_get_msgid_stats(
+            self.serialqueue, ms, len(ms))
+        out = {}
+        for i in range(count):
+            mid = self.msgparser.messages_by_id.get(ms[i].msgid,
+                                                    self.msgparser.unknown)
+            st = out.setdefault(mid.name, {
+                'send_msgs': 0, 'send_bytes': 0,
+                'receive_msgs': 0, 'receive_bytes': 0})
+            st['send_msgs'] += ms[i].send_msgs
+            st['send_bytes'] += ms[i].send_bytes
+            st['receive_msgs'] += ms[i].receive_msgs
+            st['receive_bytes'] += ms[i].receive_bytes
+        return out
+    def set_adaptive_window(self, adaptive_window):
+        self.adaptive_window = adaptive_window
+    def set_thread_scheduling(self, priority, cpu_mask):
+        # Realtime priority and cpu affinity of the background thread
+        self.sched_priority = priority
+        self.sched_cpu_mask = cpu_mask
+    def set_shared_thread(self, shared_thread):
+        # Service this connection from a SerialThread used by other mcus
+        self.shared_thread = shared_thread
     def get_reactor(self):
         return self.reactor
     def get_msgparser(self):
@@ -232,16 +443,62 @@ class SerialReader:
     def get_default_command_queue(self):
         return self.default_cmd_queue
     # Serial response callbacks
-    def register_response(self, callback, name, oid=None):
+    def _add_dispatch(self, name, oid):
+        # Request the C code decode messages for this handler (if possible)
+        if self.serialqueue is None or (name, oid) in self.dispatch_ids:
+            return
+        msgformat = self.msgparser.messages_by_name.get(name)
+        if msgformat is None or not hasattr(msgformat, 'param_names'):
+            return
+        param_names = [n for n, t in msgformat.param_names]
+        param_types = msgformat.param_types
+        if (len(param_types) > DISPATCH_MAX_PARAMS
+            or not all([t.is_int for t in param_types])):
+            return
+        prefix = list(msgformat.msgid_bytes)
+        if oid is not None:
+            if not param_names or param_names[0] != 'oid':
+                return
+            param_types[0].encode(prefix, oid)
+        elif 'oid' in param_names:
+            return
+        unsigned_mask = 0
+        for i, t in enumerate(param_types):
+            if not t.signed:
+                unsigned_mask |= 1 << i
+        coalesce = (name, oid) in self.coalesce_handlers
+        dispatch_id = self.ffi_lib.serialqueue_add_response(
+            self.serialqueue, prefix, len(prefix), len(msgformat.msgid_bytes),
+            len(param_types), unsigned_mask, coalesce)
+        if dispatch_id < 0:
+            return
+        self.dispatch_ids[name, oid] = dispatch_id
+        self.dispatchers[dispatch_id] = ((name, oid), param_names)
+    def _remove_dispatch(self, name, oid):
+        dispatch_id = self.dispatch_ids.pop((name, oid), None)
+        if dispatch_id is None:
+            return
+        self.dispatchers.pop(dispatch_id, None)
+        if self.serialqueue is not None:
+            self.ffi_lib.serialqueue_rm_response(self.serialqueue, dispatch_id)
+    def register_response(self, callback, name, oid=None, coalesce=False):
         with self.lock:
             if callback is None:
                 del self.handlers[name, oid]
+                self.coalesce_handlers.discard((name, oid))
+                self._remove_dispatch(name, oid)
             else:
                 self.handlers[name, oid] = callback
+                if coalesce:
+                    self.coalesce_handlers.add((name, oid))
+                self._add_dispatch(name, oid)
     # Command sending
     def raw_send(self, cmd, minclock, reqclock, cmd_queue):
         self.ffi_lib.serialqueue_send(self.serialqueue, cmd_queue,
                                       cmd, len(cmd), minclock, reqclock, 0)
+    def raw_send_encoded(self, encoder, data, minclock, reqclock, cmd_queue):
+        return encoder.send(self.serialqueue, cmd_queue, data,
+                            minclock, reqclock)
     def raw_send_wait_ack(self, cmd, minclock, reqclock, cmd_queue):
         self.last_notify_id += 1
         nid = self.last_notify_id
@@ -260,14 +517,27 @@ class SerialReader:
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
         return src.get_response([cmd], self.default_cmd_queue)
-    def alloc_command_queue(self):
-        return self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
-                                self.ffi_lib.serialqueue_free_commandqueue)
+    def alloc_command_encoder(self, msgformat):
+        try:
+            return CommandEncoder(self.ffi_main, self.ffi_lib, msgformat)
+        except error:
+            return None
+    def alloc_command_queue(self, high_priority=False, coalesce_params=0):
+        cq = self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
+                              self.ffi_lib.serialqueue_free_commandqueue)
+        if high_priority:
+            self.ffi_lib.serialqueue_set_commandqueue_priority(
+                cq, SQ_PRIORITY_HIGH)
+        if coalesce_params:
+            self.ffi_lib.serialqueue_set_commandqueue_coalesce(
+                cq, coalesce_params)
+        return cq
     # Dumping debug lists
-    def dump_debug(self):
+    def dump_debug(self, binlog_name=None, clock_est=(0., 0., 0.)):
+        eventtime = self.reactor.monotonic()
+        stats = self.stats(eventtime)
         out = []
-        out.append("Dumping serial stats: %s" % (
-            self.stats(self.reactor.monotonic()),))
+        out.append("Dumping serial stats: %s" % (stats,))
         sdata = self.ffi_main.new('struct pull_queue_message[1024]')
         rdata = self.ffi_main.new('struct pull_queue_message[1024]')
         scount = self.ffi_lib.serialqueue_extract_old(self.serialqueue, 1,
@@ -286,6 +556,12 @@ class SerialReader:
             cmds = self.msgparser.dump(msg.msg[0:msg.len])
             out.append("Receive: %d %f %f %d: %s" % (
                 i, msg.receive_time, msg.sent_time, msg.len, ', '.join(cmds)))
+        if binlog_name is not None and queuelogger.is_binary_log_active():
+            dumps = [[(m.sent_time, m.receive_time, bytes(bytearray(
+                m.msg[0:m.len]))) for m in data[0:count]]
+                     for data, count in ((sdata, scount), (rdata, rcount))]
+            queuelogger.log_binary_dump(eventtime, binlog_name, stats,
+                                        clock_est, dumps[0], dumps[1])
         return '\n'.join(out)
     # Default message handlers
     def _handle_unknown_init(self, params):
@@ -330,6 +606,69 @@ class SerialRetryCommand:
             retries -= 1
             retry_delay *= 2.
 
+# A background thread that handles the low-level communication of
+# several mcus (see SerialReader.set_shared_thread())
+class SerialThread:
+    def __init__(self, sched_priority=0, sched_cpu_mask=0):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.c_thread = ffi_main.gc(
+            ffi_lib.serialqueue_thread_alloc(sched_priority, sched_cpu_mask),
+            ffi_lib.serialqueue_thread_free)
+    def get_c_thread(self):
+        return self.c_thread
+
+# Helper to encode a command directly from its arguments in C code
+CE_INT, CE_BUFFER = 0, 1
+
+class CommandEncoder:
+    def __init__(self, ffi_main, ffi_lib, msgformat):
+        self.ffi_main = ffi_main
+        self.ffi_lib = ffi_lib
+        ptypes = []
+        self.buf_index = None
+        for i, t in enumerate(msgformat.param_types):
+            if t.is_int:
+                ptypes.append(CE_INT)
+            elif t.is_dynamic_string and self.buf_index is None:
+                ptypes.append(CE_BUFFER)
+                self.buf_index = i
+            else:
+                raise error("Unsupported parameters in '%s'"
+                            % (msgformat.msgformat,))
+        self.num_params = len(ptypes)
+        msgid = msgformat.msgid_bytes
+        self.encoder = ffi_main.gc(
+            ffi_lib.command_encoder_alloc(msgid, len(msgid),
+                                          ptypes, len(ptypes)),
+            ffi_lib.command_encoder_free)
+        if self.encoder == ffi_main.NULL:
+            raise error("Unable to encode '%s'" % (msgformat.msgformat,))
+        self.args = ffi_main.new('int64_t[%d]' % (max(1, self.num_params),))
+        self.no_buf = ffi_main.NULL
+    def send(self, sq, cq, data, minclock, reqclock, notify_id=0):
+        # Returns False if the caller should encode the command in python
+        num_params = self.num_params
+        if len(data) != num_params:
+            return False
+        buf = self.no_buf
+        buf_len = 0
+        args = self.args
+        try:
+            if self.buf_index is None:
+                args[0:num_params] = data
+            else:
+                data = list(data)
+                buf = list(bytearray(data[self.buf_index]))
+                buf_len = len(buf)
+                data[self.buf_index] = 0
+                args[0:num_params] = data
+        except OverflowError:
+            return False
+        ret = self.ffi_lib.serialqueue_send_encoded(
+            sq, cq, self.encoder, args, buf, buf_len,
+            minclock, reqclock, notify_id)
+        return ret == 0
+
 # Attempt to place an AVR stk500v2 style programmer into normal mode
 def stk500v2_leave(ser, reactor):
     logging.debug("Starting stk500v2 leave programmer sequence")
@@ -20,12 +20,14 @@ MIN_BOTH_EDGE_DURATION = 0.000000200
 class MCU_stepper:
     def __init__(self, name, step_pin_params, dir_pin_params,
                  rotation_dist, steps_per_rotation,
-                 step_pulse_duration=None, units_in_radians=False):
+                 step_pulse_duration=None, units_in_radians=False,
+                 step_timer=False):
         self._name = name
         self._rotation_dist = rotation_dist
         self._steps_per_rotation = steps_per_rotation
         self._step_pulse_duration = step_pulse_duration
         self._units_in_radians = units_in_radians
+        self._step_timer = step_timer
         self._step_dist = rotation_dist / steps_per_rotation
         self._mcu = step_pin_params['chip']
         self._oid = oid = self._mcu.create_oid()
@@ -38,6 +40,7 @@ class MCU_stepper:
         self._dir_pin = dir_pin_params['pin']
         self._invert_dir = self._orig_invert_dir = dir_pin_params['invert']
         self._step_both_edge = self._req_step_both_edge = False
+        self._group_members = []
         self._mcu_position_offset = 0.
         self._reset_cmd_tag = self._get_position_cmd = None
         self._active_callbacks = []
@@ -46,7 +49,10 @@ class MCU_stepper:
                                       ffi_lib.stepcompress_free)
         ffi_lib.stepcompress_set_invert_sdir(self._stepqueue, self._invert_dir)
         self._mcu.register_stepqueue(self._stepqueue)
+        self._mcu.register_move_queue_name(oid, name)
         self._stepper_kinematics = None
+        self._gang_leader = None
+        self._gang_followers = []
         self._itersolve_generate_steps = ffi_lib.itersolve_generate_steps
         self._itersolve_check_active = ffi_lib.itersolve_check_active
         self._trapq = ffi_main.NULL
@@ -71,12 +77,32 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         sk = ffi_main.gc(getattr(ffi_lib, alloc_func)(*params), ffi_lib.free)
         self.set_stepper_kinematics(sk)
+    def add_group_member(self, step_pin_params, dir_pin_params,
+                         step_pulse_duration=None):
+        # Drive the pins of another stepper with this stepper's steps
+        if (step_pin_params['chip'] is not self._mcu
+            or dir_pin_params['chip'] is not self._mcu):
+            raise self._mcu.get_printer().config_error(
+                "Stepper step_group pins must be on same mcu as the"
+                " primary stepper")
+        self._group_members.append((step_pin_params, dir_pin_params,
+                                    step_pulse_duration))
     def _build_config(self):
+        for sp, dp, pulse_duration in self._group_members:
+            if pulse_duration is not None:
+                self._step_pulse_duration = max(self._step_pulse_duration
+                                                or 0., pulse_duration)
         if self._step_pulse_duration is None:
             self._step_pulse_duration = .000002
         invert_step = self._invert_step
         sbe = int(self._mcu.get_constants().get('STEPPER_BOTH_EDGE', '0'))
-        if (self._req_step_both_edge and sbe
+        if self._step_timer:
+            if self._group_members:
+                raise self._mcu.get_printer().config_error(
+                    "Stepper '%s' step_timer can not be used with a"
+                    " step_group" % (self._name,))
+            self._check_step_timer()
+        elif (self._req_step_both_edge and sbe
             and self._step_pulse_duration <= MIN_BOTH_EDGE_DURATION):
             # Enable stepper optimized step on both edges
             self._step_both_edge = True
@@ -87,6 +113,15 @@ class MCU_stepper:
             "config_stepper oid=%d step_pin=%s dir_pin=%s invert_step=%d"
             " step_pulse_ticks=%u" % (self._oid, self._step_pin, self._dir_pin,
                                       invert_step, step_pulse_ticks))
+        if self._step_timer:
+            self._mcu.add_config_cmd("config_stepper_timer oid=%d step_pin=%s"
+                                     % (self._oid, self._step_pin))
+        for sp, dp, pulse_duration in self._group_members:
+            invert_dir = dp['invert'] != self._orig_invert_dir
+            self._mcu.add_config_cmd(
+                "config_stepper_group_member oid=%d step_pin=%s dir_pin=%s"
+                " invert_step=%d invert_dir=%d"
+                % (self._oid, sp['pin'], dp['pin'], sp['invert'], invert_dir))
         self._mcu.add_config_cmd("reset_step_clock oid=%d clock=0"
                                  % (self._oid,), on_restart=True)
         step_cmd_tag = self._mcu.lookup_command(
@@ -103,6 +138,40 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
                                   step_cmd_tag, dir_cmd_tag)
+        error_ratio, adaptive_error = self._mcu.get_adaptive_stepper_error()
+        if error_ratio:
+            ffi_lib.stepcompress_set_adaptive_error(
+                self._stepqueue, error_ratio,
+                self._mcu.seconds_to_clock(adaptive_error))
+        add2 = int(self._mcu.get_constants().get('STEPPER_ADD2', '0'))
+        if add2 and not self._step_both_edge:
+            step2_cmd_tag = self._mcu.lookup_command(
+                "queue_step2 oid=%c interval=%u count=%hu add=%hi add2=%hi"
+            ).get_command_tag()
+            ffi_lib.stepcompress_set_queue_step2(self._stepqueue,
+                                                 step2_cmd_tag)
+        if self._mcu.get_constants().get('STEPPER_STEP_DIR'):
+            step_dir_cmd_tag = self._mcu.lookup_command(
+                "queue_step_dir oid=%c interval=%u count=%hu add=%hi dir=%c"
+            ).get_command_tag()
+            ffi_lib.stepcompress_set_queue_step_dir(self._stepqueue,
+                                                    step_dir_cmd_tag)
+        step_batch_cmd = self._mcu.try_lookup_command(
+            "queue_step_batch oid=%c moves=%*s")
+        if step_batch_cmd is not None:
+            ffi_lib.stepcompress_set_queue_step_batch(
+                self._stepqueue, step_batch_cmd.get_command_tag())
+    def _check_step_timer(self):
+        pins = self._mcu.get_constants().get('STEPPER_TIMER_PINS', '')
+        pins = [p.strip().upper() for p in pins.split(',') if p.strip()]
+        if self._step_pin.upper() not in pins:
+            raise self._mcu.get_printer().config_error(
+                "Stepper '%s' step_pin does not support step_timer"
+                " (available pins: %s)" % (self._name, ', '.join(pins)))
+        if not self._step_pulse_duration:
+            raise self._mcu.get_printer().config_error(
+                "Stepper '%s' step_timer requires a step_pulse_duration"
+                % (self._name,))
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -162,6 +231,14 @@ class MCU_stepper:
         count = ffi_lib.stepcompress_extract_old(self._stepqueue, data, count,
                                                  start_clock, end_clock)
         return (data, count)
+    def get_step_rate_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        stats = ffi_main.new('struct stepcompress_rate_stats *')
+        ffi_lib.stepcompress_get_rate_stats(self._stepqueue, stats)
+        return stats
+    def reset_step_rate_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.stepcompress_reset_rate_stats(self._stepqueue)
     def get_stepper_kinematics(self):
         return self._stepper_kinematics
     def set_stepper_kinematics(self, sk):
@@ -174,7 +251,26 @@ class MCU_stepper:
         ffi_lib.itersolve_set_stepcompress(sk, self._stepqueue, self._step_dist)
         self.set_trapq(self._trapq)
         self._set_mcu_position(mcu_pos)
+        if old_sk is not None:
+            ffi_lib.itersolve_set_gang(old_sk, ffi_main.NULL, 0)
+        leader = self._gang_leader or self
+        if leader._gang_followers:
+            leader._update_gang()
         return old_sk
+    def set_gang_followers(self, followers):
+        # Steppers with identical kinematics can reuse this stepper's
+        # step times (eg, multiple steppers on the same rail)
+        for s in self._gang_followers:
+            s._gang_leader = None
+        self._gang_followers = list(followers)
+        for s in self._gang_followers:
+            s._gang_leader = self
+        self._update_gang()
+    def _update_gang(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        sks = [s._stepper_kinematics for s in self._gang_followers]
+        fsk = ffi_main.new('struct stepper_kinematics *[]', sks)
+        ffi_lib.itersolve_set_gang(self._stepper_kinematics, fsk, len(sks))
     def note_homing_end(self):
         ffi_main, ffi_lib = chelper.get_ffi()
         ret = ffi_lib.stepcompress_reset(self._stepqueue, 0)
@@ -213,7 +309,7 @@ class MCU_stepper:
         return old_tq
     def add_active_callback(self, cb):
         self._active_callbacks.append(cb)
-    def generate_steps(self, flush_time):
+    def check_active(self, flush_time):
         # Check for activity if necessary
         if self._active_callbacks:
             sk = self._stepper_kinematics
@@ -223,6 +319,11 @@ class MCU_stepper:
                 self._active_callbacks = []
                 for cb in cbs:
                     cb(ret)
+        # Gang followers may have their steps generated with this stepper
+        for s in self._gang_followers:
+            s.check_active(flush_time)
+    def generate_steps(self, flush_time):
+        self.check_active(flush_time)
         # Generate steps
         sk = self._stepper_kinematics
         ret = self._itersolve_generate_steps(sk, flush_time)
@@ -233,6 +334,84 @@ class MCU_stepper:
         a = axis.encode()
         return ffi_lib.itersolve_is_active_axis(self._stepper_kinematics, a)
 
+# A stepper whose step and dir pins are driven by the micro-controller
+# along with the primary stepper of a rail (see the step_group option)
+class MCU_grouped_stepper:
+    def __init__(self, name, leader):
+        self._name = name
+        self._leader = leader
+    def __getattr__(self, name):
+        # Positions and step history are identical to the group leader
+        return getattr(self._leader, name)
+    def get_name(self, short=False):
+        if short and self._name.startswith('stepper_'):
+            return self._name[8:]
+        return self._name
+    def get_group_leader(self):
+        return self._leader
+    # The steps are generated by the group leader
+    def setup_itersolve(self, alloc_func, *params):
+        pass
+    def _separate_move_error(self):
+        return self._leader.get_mcu().get_printer().command_error(
+            "Stepper '%s' can not be moved separately from '%s'"
+            % (self._name, self._leader.get_name()))
+    def set_stepper_kinematics(self, sk):
+        raise self._separate_move_error()
+    def set_trapq(self, tq):
+        leader_tq = self._leader.get_trapq()
+        if tq is None:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            tq = ffi_main.NULL
+        if tq != leader_tq:
+            raise self._separate_move_error()
+        return leader_tq
+    def set_position(self, coord):
+        pass
+    def generate_steps(self, flush_time):
+        pass
+
+# Generate steps for several steppers in parallel using a C thread pool
+class StepGenerationPool:
+    def __init__(self, num_threads, sched_priority=0, sched_cpu_mask=0):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self._ffi_main = ffi_main
+        self._pool = ffi_main.gc(
+            ffi_lib.stepgen_pool_alloc(num_threads - 1, sched_priority,
+                                       sched_cpu_mask),
+            ffi_lib.stepgen_pool_free)
+        self._stepgen_pool_generate = ffi_lib.stepgen_pool_generate
+        self._step_generators = []
+        self._steppers = []
+        self._other_generators = []
+    def _update_generators(self, step_generators):
+        self._step_generators = list(step_generators)
+        self._steppers = []
+        self._other_generators = []
+        for sg in step_generators:
+            stepper = getattr(sg, '__self__', None)
+            func = getattr(sg, '__func__', None)
+            if (isinstance(stepper, MCU_stepper)
+                and func is MCU_stepper.generate_steps):
+                self._steppers.append(stepper)
+            else:
+                self._other_generators.append(sg)
+    def generate_steps(self, step_generators, flush_time):
+        if step_generators != self._step_generators:
+            self._update_generators(step_generators)
+        # Run python activity callbacks prior to launching threads
+        steppers = self._steppers
+        for stepper in steppers:
+            stepper.check_active(flush_time)
+        sks = [s.get_stepper_kinematics() for s in steppers]
+        sk_list = self._ffi_main.new('struct stepper_kinematics *[]', sks)
+        ret = self._stepgen_pool_generate(self._pool, sk_list, len(sks),
+                                          flush_time)
+        if ret:
+            raise error("Internal error in stepcompress")
+        for sg in self._other_generators:
+            sg(flush_time)
+
 # Helper code to build a stepper object from a config section
 def PrinterStepper(config, units_in_radians=False):
     printer = config.get_printer()
@@ -247,9 +426,35 @@ def PrinterStepper(config, units_in_radians=False):
         config, units_in_radians, True)
     step_pulse_duration = config.getfloat('step_pulse_duration', None,
                                           minval=0., maxval=.001)
+    step_timer = config.getboolean('step_timer', False)
     mcu_stepper = MCU_stepper(name, step_pin_params, dir_pin_params,
                               rotation_dist, steps_per_rotation,
-                              step_pulse_duration, units_in_radians)
+                              step_pulse_duration, units_in_radians,
+                              step_timer)
+    # Register with helper modules
+    for mname in ['stepper_enable', 'force_move', 'motion_report']:
+        m = printer.load_object(config, mname)
+        m.register_stepper(config, mcu_stepper)
+    return mcu_stepper
+
+# Create a stepper that is stepped along with a rail's primary stepper
+def PrinterGroupedStepper(config, leader, units_in_radians=False):
+    printer = config.get_printer()
+    name = config.get_name()
+    ppins = printer.lookup_object('pins')
+    step_pin_params = ppins.lookup_pin(config.get('step_pin'), can_invert=True)
+    dir_pin_params = ppins.lookup_pin(config.get('dir_pin'), can_invert=True)
+    rotation_dist, steps_per_rotation = parse_step_distance(
+        config, units_in_radians, True)
+    if abs(rotation_dist / steps_per_rotation
+           - leader.get_step_dist()) > 1e-12:
+        raise config.error("Stepper '%s' step_group requires the same step"
+                           " distance as '%s'" % (name, leader.get_name()))
+    step_pulse_duration = config.getfloat('step_pulse_duration', None,
+                                          minval=0., maxval=.001)
+    leader.add_group_member(step_pin_params, dir_pin_params,
+                            step_pulse_duration)
+    mcu_stepper = MCU_grouped_stepper(name, leader)
     # Register with helper modules
     for mname in ['stepper_enable', 'force_move', 'motion_report']:
         m = printer.load_object(config, mname)
@@ -374,6 +579,14 @@ class PrinterRail:
     def get_endstops(self):
         return list(self.endstops)
     def add_extra_stepper(self, config):
+        if config.getboolean('step_group', False):
+            if config.get('endstop_pin', None) is not None:
+                raise config.error("Stepper '%s' with step_group must use the"
+                                   " primary endstop" % (config.get_name(),))
+            stepper = PrinterGroupedStepper(config, self.steppers[0],
+                                            self.stepper_units_in_radians)
+            self.steppers.append(stepper)
+            return
         stepper = PrinterStepper(config, self.stepper_units_in_radians)
         self.steppers.append(stepper)
         if self.endstops and config.get('endstop_pin', None) is None:
@@ -410,6 +623,8 @@ class PrinterRail:
     def setup_itersolve(self, alloc_func, *params):
         for stepper in self.steppers:
             stepper.setup_itersolve(alloc_func, *params)
+        self.steppers[0].set_gang_followers(
+            [s for s in self.steppers[1:] if isinstance(s, MCU_stepper)])
     def generate_steps(self, flush_time):
         for stepper in self.steppers:
             stepper.generate_steps(flush_time)
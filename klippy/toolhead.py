@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging, importlib
-import mcu, chelper, kinematics.extruder
+import mcu, chelper, stepper, util, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
@@ -12,42 +12,52 @@ import mcu, chelper, kinematics.extruder
 
 # Class to track each move request
 class Move:
+    # Many moves may be queued, so avoid a per-instance dict (and keep
+    # the number of allocated objects per move low)
+    __slots__ = ('toolhead', 'start_pos', 'end_pos', 'accel',
+                 'junction_deviation', 'timing_callbacks',
+                 'is_kinematic_move', 'axes_d', 'move_d', 'axes_r',
+                 'min_move_t', 'max_cruise_v2', 'delta_v2', 'smooth_delta_v2')
     def __init__(self, toolhead, start_pos, end_pos, speed):
         self.toolhead = toolhead
-        self.start_pos = tuple(start_pos)
-        self.end_pos = tuple(end_pos)
+        self.start_pos = start_pos = tuple(start_pos)
         self.accel = toolhead.max_accel
         self.junction_deviation = toolhead.junction_deviation
-        self.timing_callbacks = []
+        self.timing_callbacks = ()
         velocity = min(speed, toolhead.max_velocity)
         self.is_kinematic_move = True
-        self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
-        self.move_d = move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
+        dx = end_pos[0] - start_pos[0]
+        dy = end_pos[1] - start_pos[1]
+        dz = end_pos[2] - start_pos[2]
+        de = end_pos[3] - start_pos[3]
+        move_d = math.sqrt(dx*dx + dy*dy + dz*dz)
         if move_d < .000000001:
             # Extrude only move
             self.end_pos = (start_pos[0], start_pos[1], start_pos[2],
                             end_pos[3])
-            axes_d[0] = axes_d[1] = axes_d[2] = 0.
-            self.move_d = move_d = abs(axes_d[3])
+            self.axes_d = (0., 0., 0., de)
+            move_d = abs(de)
             inv_move_d = 0.
             if move_d:
                 inv_move_d = 1. / move_d
             self.accel = 99999999.9
             velocity = speed
             self.is_kinematic_move = False
+            self.axes_r = (0., 0., 0., de * inv_move_d)
         else:
+            self.end_pos = tuple(end_pos)
+            self.axes_d = (dx, dy, dz, de)
             inv_move_d = 1. / move_d
-        self.axes_r = [d * inv_move_d for d in axes_d]
+            self.axes_r = (dx * inv_move_d, dy * inv_move_d, dz * inv_move_d,
+                           de * inv_move_d)
+        self.move_d = move_d
         self.min_move_t = move_d / velocity
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
-        self.max_start_v2 = 0.
         self.max_cruise_v2 = velocity**2
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
-        self.next_junction_v2 = 999999999.9
     def limit_speed(self, speed, accel):
         speed2 = speed**2
         if speed2 < self.max_cruise_v2:
@@ -56,59 +66,10 @@ class Move:
         self.accel = min(self.accel, accel)
         self.delta_v2 = 2.0 * self.move_d * self.accel
         self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
-    def limit_next_junction_speed(self, speed):
-        self.next_junction_v2 = min(self.next_junction_v2, speed**2)
     def move_error(self, msg="Move out of range"):
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extruder to calculate its maximum junction
-        extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        max_start_v2 = min(extruder_v2, self.max_cruise_v2,
-                           prev_move.max_cruise_v2, prev_move.next_junction_v2,
-                           prev_move.max_start_v2 + prev_move.delta_v2)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
-        junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
-                               + axes_r[1] * prev_axes_r[1]
-                               + axes_r[2] * prev_axes_r[2])
-        sin_theta_d2 = math.sqrt(max(0.5*(1.0-junction_cos_theta), 0.))
-        cos_theta_d2 = math.sqrt(max(0.5*(1.0+junction_cos_theta), 0.))
-        one_minus_sin_theta_d2 = 1. - sin_theta_d2
-        if one_minus_sin_theta_d2 > 0. and cos_theta_d2 > 0.:
-            R_jd = sin_theta_d2 / one_minus_sin_theta_d2
-            move_jd_v2 = R_jd * self.junction_deviation * self.accel
-            pmove_jd_v2 = R_jd * prev_move.junction_deviation * prev_move.accel
-            # Approximated circle must contact moves no further than mid-move
-            #   centripetal_v2 = .5 * self.move_d * self.accel * tan_theta_d2
-            quarter_tan_theta_d2 = .25 * sin_theta_d2 / cos_theta_d2
-            move_centripetal_v2 = self.delta_v2 * quarter_tan_theta_d2
-            pmove_centripetal_v2 = prev_move.delta_v2 * quarter_tan_theta_d2
-            max_start_v2 = min(max_start_v2, move_jd_v2, pmove_jd_v2,
-                               move_centripetal_v2, pmove_centripetal_v2)
-        # Apply limits
-        self.max_start_v2 = max_start_v2
-        self.max_smoothed_v2 = min(
-            max_start_v2, prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
-    def set_junction(self, start_v2, cruise_v2, end_v2):
-        # Determine accel, cruise, and decel portions of the move distance
-        half_inv_accel = .5 / self.accel
-        accel_d = (cruise_v2 - start_v2) * half_inv_accel
-        decel_d = (cruise_v2 - end_v2) * half_inv_accel
-        cruise_d = self.move_d - accel_d - decel_d
-        # Determine move velocities
-        self.start_v = start_v = math.sqrt(start_v2)
-        self.cruise_v = cruise_v = math.sqrt(cruise_v2)
-        self.end_v = end_v = math.sqrt(end_v2)
-        # Determine time spent in each portion of move (time is the
-        # distance divided by average velocity)
-        self.accel_t = accel_d / ((start_v + cruise_v) * 0.5)
-        self.cruise_t = cruise_d / cruise_v
-        self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
 
 LOOKAHEAD_FLUSH_TIME = 0.250
 
@@ -119,73 +80,96 @@ class LookAheadQueue:
         self.toolhead = toolhead
         self.queue = []
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.lookahead = ffi_main.gc(ffi_lib.lookahead_alloc(),
+                                     ffi_lib.lookahead_free)
+        self.next_time = ffi_main.new('double *')
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        self.lookahead_flush = ffi_lib.lookahead_flush
+        self.lookahead_queue_moves = ffi_lib.lookahead_queue_moves
+        # Throughput accounting (see print_stats.py)
+        self.planned_time = self.move_time = 0.
+        self.move_count = self.queue_depth_sum = 0
     def reset(self):
         del self.queue[:]
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_reset(self.lookahead)
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
+    def set_kin_limits(self, limits, max_z_velocity, max_z_accel):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_set_kin_limits(
+            self.lookahead, [l for l, h in limits], [h for l, h in limits],
+            max_z_velocity, max_z_accel)
+    def limit_next_junction_speed(self, speed):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_limit_next_junction(self.lookahead, speed**2)
+    def add_timing_callback(self, callback):
+        move = self.queue[-1]
+        move.timing_callbacks = move.timing_callbacks + (callback,)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_note_callback(self.lookahead)
     def flush(self, lazy=False):
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
-        queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, -1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
+        # Determine velocities of queued moves (see lookahead.c)
+        flush_count = self.lookahead_flush(self.lookahead, lazy)
+        if not flush_count:
             return
         # Generate step times for all moves ready to be flushed
+        queue = self.queue
         self.toolhead._process_moves(queue[:flush_count])
         # Remove processed moves from the queue
         del queue[:flush_count]
+    def queue_moves(self, moves, print_time):
+        # Add finalized moves to the toolhead and extruder trapq
+        toolhead = self.toolhead
+        trapq = toolhead.trapq
+        count = len(moves)
+        start_time = print_time
+        pos = 0
+        while pos < count:
+            pos = self.lookahead_queue_moves(self.lookahead, trapq, pos, count,
+                                             print_time, self.next_time)
+            print_time = self.next_time[0]
+            for cb in moves[pos-1].timing_callbacks:
+                cb(print_time)
+        for move in reversed(moves):
+            if move.axes_d[3]:
+                toolhead.extruder.note_move_end(move.end_pos[3])
+                break
+        self.move_time += print_time - start_time
+        return print_time
     def add_move(self, move):
-        self.queue.append(move)
-        if len(self.queue) == 1:
+        ffi_main, ffi_lib = chelper.get_ffi()
+        queue = self.queue
+        extruder_v2 = 0.
+        extruder_trapq = ffi_main.NULL
+        if move.axes_d[3]:
+            extruder_trapq = self.toolhead.extruder.get_trapq()
+        if queue and move.is_kinematic_move and queue[-1].is_kinematic_move:
+            # Allow extruder to calculate its maximum junction
+            extruder_v2 = self.toolhead.extruder.calc_junction(queue[-1], move)
+        min_move_t = self.lookahead_add_move(
+            self.lookahead, move.start_pos, move.end_pos, move.axes_r,
+            move.move_d, move.accel, move.junction_deviation,
+            move.max_cruise_v2, move.delta_v2, move.smooth_delta_v2,
+            extruder_v2, move.is_kinematic_move, extruder_trapq)
+        if min_move_t < 0.:
+            # Move rejected by the kinematic limits - report the error
+            self.toolhead.kin.check_move(move)
+            raise move.move_error()
+        queue.append(move)
+        self.planned_time += min_move_t
+        self.move_count += 1
+        self.queue_depth_sum += len(queue)
+        if len(queue) == 1:
             return
-        move.calc_junction(self.queue[-2])
-        self.junction_flush -= move.min_move_t
+        self.junction_flush -= min_move_t
         if self.junction_flush <= 0.:
             # Enough moves have been queued to reach the target flush time.
             self.flush(lazy=True)
@@ -202,8 +186,70 @@ STEPCOMPRESS_FLUSH_TIME = 0.050
 SDS_CHECK_TIME = 0.001 # step+dir+step filter in stepcompress.c
 MOVE_HISTORY_EXPIRE = 30.
 
+ADAPTIVE_SAFETY_FACTOR = 10.
+ADAPTIVE_MAX_LOAD = 0.9
+ADAPTIVE_DECAY = 0.1
+
+# Helper to tune the toolhead buffer times from measured host load
+class AdaptiveBufferTime:
+    def __init__(self, toolhead, config):
+        self.toolhead = toolhead
+        self.min_buffer_time = config.getfloat('min_buffer_time', 0.250,
+                                               minval=MIN_KIN_TIME)
+        self.max_buffer_time = config.getfloat(
+            'max_buffer_time', BUFFER_TIME_HIGH, above=self.min_buffer_time)
+        self.buffer_time = BUFFER_TIME_LOW
+        self.last_update_time = 0.
+        self.step_gen_time = self.step_gen_peak = 0.
+        self.last_retransmits = {}
+        self.step_gen_load = self.backlog_time = 0.
+    def note_step_generation(self, duration):
+        self.step_gen_time += duration
+        self.step_gen_peak = max(self.step_gen_peak, duration)
+    def _calc_backlog_time(self, eventtime):
+        # Estimate the time needed to transmit queued mcu commands
+        backlog_time = 0.
+        for m in self.toolhead.all_mcus:
+            last_stats = m.get_status(eventtime).get('last_stats', {})
+            ready_bytes = last_stats.get('ready_bytes', 0)
+            retransmits = last_stats.get('bytes_retransmit', 0)
+            last_retransmits = self.last_retransmits.get(m, retransmits)
+            self.last_retransmits[m] = retransmits
+            baud = m.get_constants().get('SERIAL_BAUD')
+            if baud:
+                # An 8N1 serial line is 10 bits per byte
+                mcu_time = 10. * (ready_bytes + retransmits
+                                  - last_retransmits) / float(baud)
+                backlog_time = max(backlog_time, mcu_time)
+        return backlog_time
+    def update(self, eventtime):
+        elapsed = eventtime - self.last_update_time
+        self.last_update_time = eventtime
+        if elapsed <= 0. or elapsed > 5.:
+            self.step_gen_time = self.step_gen_peak = 0.
+            return
+        # Determine host load and peak step generation latency
+        load = min(ADAPTIVE_MAX_LOAD, self.step_gen_time / elapsed)
+        self.step_gen_load = load
+        self.backlog_time = self._calc_backlog_time(eventtime)
+        want = (ADAPTIVE_SAFETY_FACTOR * self.step_gen_peak / (1. - load)
+                + self.backlog_time)
+        self.step_gen_time = self.step_gen_peak = 0.
+        want = max(self.min_buffer_time, min(self.max_buffer_time, want))
+        # Increase buffering immediately, but reduce it gradually
+        if want >= self.buffer_time:
+            self.buffer_time = want
+        else:
+            self.buffer_time += (want - self.buffer_time) * ADAPTIVE_DECAY
+        self.toolhead.set_buffer_time(self.buffer_time)
+    def get_status(self, eventtime):
+        return {'step_generation_load': self.step_gen_load,
+                'serial_backlog_time': self.backlog_time}
+
 DRIP_SEGMENT_TIME = 0.050
 DRIP_TIME = 0.100
+DRIP_MIN_TIME = 0.030
+DRIP_RTO_FACTOR = 1.5
 class DripModeEndSignal(Exception):
     pass
 
@@ -215,9 +261,17 @@ class ToolHead:
         self.all_mcus = [
             m for n, m in self.printer.lookup_objects(module='mcu')]
         self.mcu = self.all_mcus[0]
+        # Buffer time tracking
+        self.buffer_time_low = BUFFER_TIME_LOW
+        self.buffer_time_high = BUFFER_TIME_HIGH
+        self.move_batch_time = MOVE_BATCH_TIME
+        self.adaptive_buffer = None
+        if config.getboolean('adaptive_buffer_time', False):
+            self.adaptive_buffer = AdaptiveBufferTime(self, config)
         self.lookahead = LookAheadQueue(self)
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.commanded_pos = [0., 0., 0., 0.]
+        self.native_kin_limits = None
         # Velocity and acceleration control
         self.max_velocity = config.getfloat('max_velocity', above=0.)
         self.max_accel = config.getfloat('max_accel', above=0.)
@@ -239,6 +293,7 @@ class ToolHead:
         # Input stall detection
         self.check_stall_time = 0.
         self.print_stall = 0
+        self.pause_wait_time = 0.
         # Input pause tracking
         self.can_pause = True
         if self.mcu.is_fileoutput():
@@ -249,20 +304,49 @@ class ToolHead:
         self.special_queuing_state = "NeedPrime"
         self.priming_timer = None
         self.drip_completion = None
+        self.drip_time = DRIP_TIME
+        self.drip_segment_time = DRIP_SEGMENT_TIME
+        self.adaptive_drip = config.getboolean('adaptive_drip_time', False)
         # Flush tracking
         self.flush_timer = self.reactor.register_timer(self._flush_handler)
         self.do_kick_flush_timer = True
         self.last_flush_time = self.min_restart_time = 0.
         self.need_flush_time = self.step_gen_time = self.clear_history_time = 0.
+        # Movement history limits (see trapq.c and stepcompress.c)
+        self.history_time = config.getfloat('move_history_time',
+                                            MOVE_HISTORY_EXPIRE, above=0.)
+        self.history_memory = config.getint('move_history_memory', 4096,
+                                            minval=16) * 1024
         # Kinematic step generation scan window time tracking
         self.kin_flush_delay = SDS_CHECK_TIME
         self.kin_flush_times = []
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
-        self.trapq_append = ffi_lib.trapq_append
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
+        ffi_lib.trapq_set_history_limit(self.trapq, self.history_memory)
+        self.trapq_get_history_bytes = ffi_lib.trapq_get_history_bytes
+        self.trapq_get_history_peak_bytes = (
+            ffi_lib.trapq_get_history_peak_bytes)
         self.step_generators = []
+        self.step_gen_pool = None
+        step_gen_threads = config.getint('step_generation_threads', 1,
+                                         minval=0)
+        sched = mcu.get_thread_scheduling(config, 'step_generation_thread')
+        if not step_gen_threads:
+            # Use all available cpus (the kernel then shares idle cpus
+            # between printers that run on the same host)
+            step_gen_threads = util.get_available_cpu_count(sched[1])
+            logging.info("Using %d step generation threads",
+                         step_gen_threads)
+        if step_gen_threads > 1:
+            self.step_gen_pool = stepper.StepGenerationPool(step_gen_threads,
+                                                            *sched)
+        # Realtime priority and cpu affinity of the main thread
+        main_sched = mcu.get_thread_scheduling(config, 'main_thread')
+        if main_sched[0] or main_sched[1]:
+            if ffi_lib.set_thread_scheduling(*main_sched):
+                logging.warning("Unable to set main thread scheduling")
         # Create kinematics class
         gcode = self.printer.lookup_object('gcode')
         self.Coord = gcode.Coord
@@ -293,20 +377,42 @@ class ToolHead:
                    "manual_probe", "tuning_tower"]
         for module_name in modules:
             self.printer.load_object(config, module_name)
+        pstats = self.printer.lookup_object('statistics')
+        pstats.register_stats(('print_time', 'buffer_time', 'print_stall',
+                               'move_history_bytes',
+                               'move_history_peak_bytes'), self._sample_stats)
     # Print time and flush tracking
+    def set_buffer_time(self, buffer_time_low):
+        self.buffer_time_low = buffer_time_low
+        self.buffer_time_high = buffer_time_low + (BUFFER_TIME_HIGH
+                                                   - BUFFER_TIME_LOW)
+        self.move_batch_time = buffer_time_low * (MOVE_BATCH_TIME
+                                                  / BUFFER_TIME_LOW)
+    def _generate_steps(self, sg_flush_time):
+        if self.step_gen_pool is not None:
+            self.step_gen_pool.generate_steps(self.step_generators,
+                                              sg_flush_time)
+        else:
+            for sg in self.step_generators:
+                sg(sg_flush_time)
     def _advance_flush_time(self, flush_time):
         flush_time = max(flush_time, self.last_flush_time)
         # Generate steps via itersolve
         sg_flush_want = min(flush_time + STEPCOMPRESS_FLUSH_TIME,
                             self.print_time - self.kin_flush_delay)
         sg_flush_time = max(sg_flush_want, flush_time)
-        for sg in self.step_generators:
-            sg(sg_flush_time)
+        if self.adaptive_buffer is not None:
+            start_time = self.reactor.monotonic()
+            self._generate_steps(sg_flush_time)
+            self.adaptive_buffer.note_step_generation(
+                self.reactor.monotonic() - start_time)
+        else:
+            self._generate_steps(sg_flush_time)
         self.min_restart_time = max(self.min_restart_time, sg_flush_time)
         # Free trapq entries that are no longer needed
         clear_history_time = self.clear_history_time
         if not self.can_pause:
-            clear_history_time = flush_time - MOVE_HISTORY_EXPIRE
+            clear_history_time = flush_time - self.history_time
         free_time = sg_flush_time - self.kin_flush_delay
         self.trapq_finalize_moves(self.trapq, free_time, clear_history_time)
         self.extruder.update_move_time(free_time, clear_history_time)
@@ -320,7 +426,8 @@ class ToolHead:
         self.print_time = max(self.print_time, next_print_time)
         want_flush_time = max(flush_time, self.print_time - pt_delay)
         while 1:
-            flush_time = min(flush_time + MOVE_BATCH_TIME, want_flush_time)
+            flush_time = min(flush_time + self.move_batch_time,
+                             want_flush_time)
             self._advance_flush_time(flush_time)
             if flush_time >= want_flush_time:
                 break
@@ -343,21 +450,7 @@ class ToolHead:
                 self.need_check_pause = -1.
             self._calc_print_time()
         # Queue moves into trapezoid motion queue (trapq)
-        next_move_time = self.print_time
-        for move in moves:
-            if move.is_kinematic_move:
-                self.trapq_append(
-                    self.trapq, next_move_time,
-                    move.accel_t, move.cruise_t, move.decel_t,
-                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
-                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                    move.start_v, move.cruise_v, move.accel)
-            if move.axes_d[3]:
-                self.extruder.move(next_move_time, move)
-            next_move_time = (next_move_time + move.accel_t
-                              + move.cruise_t + move.decel_t)
-            for cb in move.timing_callbacks:
-                cb(next_move_time)
+        next_move_time = self.lookahead.queue_moves(moves, self.print_time)
         # Generate steps for moves
         if self.special_queuing_state:
             self._update_drip_move_time(next_move_time)
@@ -369,7 +462,7 @@ class ToolHead:
         self.lookahead.flush()
         self.special_queuing_state = "NeedPrime"
         self.need_check_pause = -1.
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
     def flush_step_generation(self):
         self._flush_lookahead()
@@ -398,22 +491,25 @@ class ToolHead:
             if self.priming_timer is None:
                 self.priming_timer = self.reactor.register_timer(
                     self._priming_handler)
-            wtime = eventtime + max(0.100, buffer_time - BUFFER_TIME_LOW)
+            wtime = eventtime + max(0.100, buffer_time - self.buffer_time_low)
             self.reactor.update_timer(self.priming_timer, wtime)
         # Check if there are lots of queued moves and pause if so
         while 1:
-            pause_time = buffer_time - BUFFER_TIME_HIGH
+            pause_time = buffer_time - self.buffer_time_high
             if pause_time <= 0.:
                 break
             if not self.can_pause:
                 self.need_check_pause = self.reactor.NEVER
                 return
+            wait_start = eventtime
             eventtime = self.reactor.pause(eventtime + min(1., pause_time))
+            self.pause_wait_time += eventtime - wait_start
             est_print_time = self.mcu.estimated_print_time(eventtime)
             buffer_time = self.print_time - est_print_time
         if not self.special_queuing_state:
             # In main state - defer pause checking until needed
-            self.need_check_pause = est_print_time + BUFFER_TIME_HIGH + 0.100
+            self.need_check_pause = (est_print_time + self.buffer_time_high
+                                     + 0.100)
     def _priming_handler(self, eventtime):
         self.reactor.unregister_timer(self.priming_timer)
         self.priming_timer = None
@@ -432,9 +528,10 @@ class ToolHead:
                 # In "main" state - flush lookahead if buffer runs low
                 print_time = self.print_time
                 buffer_time = print_time - est_print_time
-                if buffer_time > BUFFER_TIME_LOW:
+                buffer_time_low = self.buffer_time_low
+                if buffer_time > buffer_time_low:
                     # Running normally - reschedule check
-                    return eventtime + buffer_time - BUFFER_TIME_LOW
+                    return eventtime + buffer_time - buffer_time_low
                 # Under ran low buffer mark - flush lookahead queue
                 self._flush_lookahead()
                 if print_time != self.print_time:
@@ -466,19 +563,17 @@ class ToolHead:
         self.kin.set_position(newpos, homing_axes)
         self.printer.send_event("toolhead:set_position")
     def limit_next_junction_speed(self, speed):
-        last_move = self.lookahead.get_last()
-        if last_move is not None:
-            last_move.limit_next_junction_speed(speed)
+        self.lookahead.limit_next_junction_speed(speed)
     def move(self, newpos, speed):
         move = Move(self, self.commanded_pos, newpos, speed)
         if not move.move_d:
             return
-        if move.is_kinematic_move:
+        if move.is_kinematic_move and not self.native_kin_limits:
             self.kin.check_move(move)
         if move.axes_d[3]:
             self.extruder.check_move(move)
-        self.commanded_pos[:] = move.end_pos
         self.lookahead.add_move(move)
+        self.commanded_pos[:] = move.end_pos
         if self.print_time > self.need_check_pause:
             self._check_pause()
     def manual_move(self, coord, speed):
@@ -506,8 +601,24 @@ class ToolHead:
     def get_extruder(self):
         return self.extruder
     # Homing "drip move" handling
+    def _calc_drip_time(self):
+        # Size the drip buffer from the mcu retransmit timeouts (the
+        # time an mcu message, and thus a trsync trigger, may need)
+        self.drip_time = DRIP_TIME
+        self.drip_segment_time = DRIP_SEGMENT_TIME
+        if not self.adaptive_drip or self.mcu.is_fileoutput():
+            return
+        rto = 0.
+        for m in self.all_mcus:
+            rto = max(rto, m.get_status().get('last_stats', {}).get('rto', 0.))
+        if not rto:
+            return
+        self.drip_time = max(DRIP_MIN_TIME, min(DRIP_TIME,
+                                                DRIP_RTO_FACTOR * rto))
+        self.drip_segment_time = min(DRIP_SEGMENT_TIME, self.drip_time / 2.)
     def _update_drip_move_time(self, next_print_time):
-        flush_delay = DRIP_TIME + STEPCOMPRESS_FLUSH_TIME + self.kin_flush_delay
+        flush_delay = (self.drip_time + STEPCOMPRESS_FLUSH_TIME
+                       + self.kin_flush_delay)
         while self.print_time < next_print_time:
             if self.drip_completion.test():
                 raise DripModeEndSignal()
@@ -518,7 +629,8 @@ class ToolHead:
                 # Pause before sending more steps
                 self.drip_completion.wait(curtime + wait_time)
                 continue
-            npt = min(self.print_time + DRIP_SEGMENT_TIME, next_print_time)
+            npt = min(self.print_time + self.drip_segment_time,
+                      next_print_time)
             self.note_mcu_movequeue_activity(npt + self.kin_flush_delay,
                                              set_step_gen_time=True)
             self._advance_move_time(npt)
@@ -530,9 +642,10 @@ class ToolHead:
         self.need_check_pause = self.reactor.NEVER
         self.reactor.update_timer(self.flush_timer, self.reactor.NEVER)
         self.do_kick_flush_timer = False
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
         self.drip_completion = drip_completion
+        self._calc_drip_time()
         # Submit move
         try:
             self.move(newpos, speed)
@@ -550,18 +663,31 @@ class ToolHead:
         self.reactor.update_timer(self.flush_timer, self.reactor.NOW)
         self.flush_step_generation()
     # Misc commands
-    def stats(self, eventtime):
+    def _sample_stats(self, eventtime):
         max_queue_time = max(self.print_time, self.last_flush_time)
         for m in self.all_mcus:
             m.check_active(max_queue_time, eventtime)
         est_print_time = self.mcu.estimated_print_time(eventtime)
-        self.clear_history_time = est_print_time - MOVE_HISTORY_EXPIRE
+        self.clear_history_time = est_print_time - self.history_time
+        if self.adaptive_buffer is not None:
+            self.adaptive_buffer.update(eventtime)
         buffer_time = self.print_time - est_print_time
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
             buffer_time = 0.
-        return is_active, "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
-            self.print_time, max(buffer_time, 0.), self.print_stall)
+        history_bytes = self.trapq_get_history_bytes(self.trapq)
+        history_peak = self.trapq_get_history_peak_bytes(self.trapq)
+        return is_active, (round(self.print_time, 3),
+                           round(max(buffer_time, 0.), 3), self.print_stall,
+                           history_bytes, history_peak)
+    def get_throughput_stats(self):
+        # Cumulative move planning totals (planned_time is the time the
+        # moves would take at their requested speed)
+        la = self.lookahead
+        return {'planned_time': la.planned_time, 'move_time': la.move_time,
+                'moves': la.move_count, 'queue_depth_sum': la.queue_depth_sum,
+                'pause_time': self.pause_wait_time,
+                'stalls': self.print_stall}
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
         lookahead_empty = not self.lookahead.queue
@@ -578,16 +704,39 @@ class ToolHead:
                      'max_velocity': self.max_velocity,
                      'max_accel': self.max_accel,
                      'minimum_cruise_ratio': self.min_cruise_ratio,
-                     'square_corner_velocity': self.square_corner_velocity})
+                     'square_corner_velocity': self.square_corner_velocity,
+                     'buffer_time_low': self.buffer_time_low,
+                     'buffer_time_high': self.buffer_time_high})
+        if self.adaptive_buffer is not None:
+            res.update(self.adaptive_buffer.get_status(eventtime))
+        mq_stats = {}
+        for m in self.all_mcus:
+            summary = m.get_move_queue_summary()
+            if summary is not None:
+                mq_stats[m.get_name()] = summary
+        if mq_stats:
+            res['mcu_move_queues'] = mq_stats
         return res
     def _handle_shutdown(self):
         self.can_pause = False
         self.lookahead.reset()
+    def set_kin_limits(self, limits, max_z_velocity, max_z_accel):
+        # Kinematics with simple per-axis limits may have the C
+        # look-ahead code perform the kin.check_move() tests. The
+        # kinematics update the limits list in place and then call
+        # update_kin_limits().
+        self.native_kin_limits = (limits, max_z_velocity, max_z_accel)
+        self.update_kin_limits()
+    def update_kin_limits(self):
+        self.lookahead.set_kin_limits(*self.native_kin_limits)
     def get_kinematics(self):
         return self.kin
     def get_trapq(self):
         return self.trapq
     def register_step_generator(self, handler):
+        if self.printer.get_start_args().get('simulate') == 'moves':
+            # Only the motion planning is simulated (no step generation)
+            return
         self.step_generators.append(handler)
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
@@ -602,7 +751,7 @@ class ToolHead:
         if last_move is None:
             callback(self.get_last_move_time())
             return
-        last_move.timing_callbacks.append(callback)
+        self.lookahead.add_timing_callback(callback)
     def note_mcu_movequeue_activity(self, mq_time, set_step_gen_time=False):
         self.need_flush_time = max(self.need_flush_time, mq_time)
         if set_step_gen_time:
@@ -610,6 +759,8 @@ class ToolHead:
         if self.do_kick_flush_timer:
             self.do_kick_flush_timer = False
             self.reactor.update_timer(self.flush_timer, self.reactor.NOW)
+    def get_history_memory(self):
+        return self.history_memory
     def get_max_velocity(self):
         return self.max_velocity, self.max_accel
     def _calc_junction_deviation(self):
@@ -125,6 +125,21 @@ def get_cpu_info():
     model_name = dict(lines).get("model name", "?")
     return "%d core %s" % (core_count, model_name)
 
+def get_available_cpu_count(cpu_mask=0):
+    # Number of host cpus this process may run on (optionally limited
+    # to the cpus in a bit mask)
+    try:
+        cpus = list(os.sched_getaffinity(0))
+    except (AttributeError, OSError):
+        try:
+            import multiprocessing
+            cpus = list(range(multiprocessing.cpu_count()))
+        except (ImportError, NotImplementedError):
+            cpus = [0]
+    if cpu_mask:
+        cpus = [c for c in cpus if cpu_mask & (1 << c)] or cpus
+    return len(cpus)
+
 def get_version_from_file(klippy_src):
     try:
         with open(os.path.join(klippy_src, '.version')) as h:
@@ -7,6 +7,7 @@ import logging, socket, os, sys, errno, json, collections
 import gcode
 
 REQUEST_LOG_SIZE = 20
+SEND_BUFFER_LIMIT = 16 * 1024 * 1024
 
 # Json decodes strings as unicode types in Python 2.x.  This doesn't
 # play well with some parts of Klipper (particuarly displays), so we
@@ -77,6 +78,9 @@ class WebRequest:
     def get_dict(self, item, default=Sentinel):
         return self.get(item, default, types=(dict,))
 
+    def get_boolean(self, item, default=Sentinel):
+        return self.get(item, default, types=(bool,))
+
     def get_method(self):
         return self.method
 
@@ -137,6 +141,7 @@ class ServerSocket:
 
     def _handle_disconnect(self):
         for client in list(self.clients.values()):
+            client.flush()
             client.close()
         if self.sock is not None:
             self.reactor.unregister_fd(self.fd_handle)
@@ -183,6 +188,9 @@ class ClientConnection:
         self.fd_handle = self.reactor.register_fd(
             self.sock.fileno(), self.process_received, self._do_send)
         self.partial_data = self.send_buffer = b""
+        self.send_queue = []
+        self.send_pending = 0
+        self.send_timer = self.reactor.register_timer(self._send_event)
         self.is_blocking = False
         self.blocking_count = 0
         self.set_client_info("?", "New connection")
@@ -212,7 +220,10 @@ class ClientConnection:
             return
         self.set_client_info(None, "Disconnected")
         self.reactor.unregister_fd(self.fd_handle)
+        self.reactor.unregister_timer(self.send_timer)
         self.fd_handle = None
+        self.send_buffer = b""
+        self.send_queue = []
         try:
             self.sock.close()
         except socket.error:
@@ -267,21 +278,58 @@ class ClientConnection:
             return
         self.send(result)
 
-    def send(self, data):
+    def encode_message(self, data, binary_payload=None):
+        # Returns the raw bytes transmitted for a message (or None on error)
+        if binary_payload is not None:
+            # Binary frame - a json header followed by the raw payload
+            data = dict(data)
+            data['binary_length'] = len(binary_payload)
         try:
-            jmsg = json.dumps(data, separators=(',', ':'))
-            self.send_buffer += jmsg.encode() + b"\x03"
+            jmsg = json.dumps(data, separators=(',', ':')).encode() + b"\x03"
         except (TypeError, ValueError) as e:
             msg = ("json encoding error: %s" % (str(e),))
             logging.exception(msg)
             self.printer.invoke_shutdown(msg)
+            return None
+        if binary_payload is not None:
+            jmsg += binary_payload
+        return jmsg
+
+    def send(self, data, binary_payload=None):
+        if self.fd_handle is None:
             return
-        if not self.is_blocking:
+        jmsg = self.encode_message(data, binary_payload)
+        if jmsg is not None:
+            self.send_encoded(jmsg)
+
+    def send_encoded(self, jmsg):
+        # Send a message previously created with encode_message()
+        if self.fd_handle is None:
+            return
+        self.send_queue.append(jmsg)
+        self.send_pending += len(jmsg)
+        if self.is_blocking and self.send_pending > SEND_BUFFER_LIMIT:
+            logging.info("Closing client %s - send buffer full", self.uid)
+            self.close()
+            return
+        if not self.is_blocking and len(self.send_queue) == 1:
+            # Write all messages queued during this reactor pass at once
+            self.reactor.update_timer(self.send_timer, self.reactor.NOW)
+
+    def _send_event(self, eventtime):
+        self._do_send()
+        return self.reactor.NEVER
+
+    def flush(self):
+        if self.send_queue:
             self._do_send()
 
     def _do_send(self, eventtime=None):
         if self.fd_handle is None:
             return
+        if self.send_queue:
+            self.send_buffer += b"".join(self.send_queue)
+            self.send_queue = []
         try:
             sent = self.sock.send(self.send_buffer)
         except socket.error as e:
@@ -299,6 +347,7 @@ class ClientConnection:
             self.reactor.set_fd_wake(self.fd_handle, True, False)
             self.is_blocking = False
         self.send_buffer = self.send_buffer[sent:]
+        self.send_pending = len(self.send_buffer)
 
 class WebHooks:
     def __init__(self, printer):
@@ -306,6 +355,7 @@ class WebHooks:
         self._endpoints = {"list_endpoints": self._handle_list_endpoints}
         self._remote_methods = {}
         self._mux_endpoints = {}
+        self._status_changed = {}
         self.register_endpoint("info", self._handle_info_request)
         self.register_endpoint("emergency_stop", self._handle_estop_request)
         self.register_endpoint("register_remote_method",
@@ -333,6 +383,19 @@ class WebHooks:
                 % (path, key, value, prev_values))
         prev_values[value] = callback
 
+    # Objects whose get_status() only changes on events may opt-in to
+    # change notification - the returned function must then be called
+    # whenever the object's status may have changed
+    def register_status_notify(self, obj_name):
+        changed = self._status_changed
+        changed[obj_name] = True
+        def note_status_change():
+            changed[obj_name] = True
+        return note_status_change
+
+    def get_status_changes(self):
+        return self._status_changed
+
     def _handle_mux(self, web_request):
         key, values = self._mux_endpoints[web_request.get_method()]
         if None in values:
@@ -465,6 +528,7 @@ class QueryStatusHelper:
         self.last_query = {}
         # Register webhooks
         webhooks = printer.lookup_object('webhooks')
+        self.status_changed = webhooks.get_status_changes()
         webhooks.register_endpoint("objects/list", self._handle_list)
         webhooks.register_endpoint("objects/query", self._handle_query)
         webhooks.register_endpoint("objects/subscribe", self._handle_subscribe)
@@ -475,6 +539,8 @@ class QueryStatusHelper:
     def _do_query(self, eventtime):
         last_query = self.last_query
         query = self.last_query = {}
+        changed = self.status_changed
+        unchanged = {}
         msglist = self.pending_queries
         self.pending_queries = []
         msglist.extend(self.clients.values())
@@ -489,11 +555,21 @@ class QueryStatusHelper:
             for obj_name, req_items in subscription.items():
                 res = query.get(obj_name, None)
                 if res is None:
-                    po = self.printer.lookup_object(obj_name, None)
-                    if po is None or not hasattr(po, 'get_status'):
-                        res = query[obj_name] = {}
+                    if (not changed.get(obj_name, True)
+                        and obj_name in last_query):
+                        # Object reports no change since last query
+                        res = query[obj_name] = last_query[obj_name]
+                        unchanged[obj_name] = True
                     else:
-                        res = query[obj_name] = po.get_status(eventtime)
+                        po = self.printer.lookup_object(obj_name, None)
+                        if po is None or not hasattr(po, 'get_status'):
+                            res = query[obj_name] = {}
+                        else:
+                            if obj_name in changed:
+                                changed[obj_name] = False
+                            res = query[obj_name] = po.get_status(eventtime)
+                if obj_name in unchanged and not is_query:
+                    continue
                 if req_items is None:
                     req_items = list(res.keys())
                     if req_items:
@@ -537,9 +613,7 @@ class QueryStatusHelper:
         complete = reactor.completion()
         self.pending_queries.append((None, objects, complete.complete, {}))
         # Start timer if needed
-        if self.query_timer is None:
-            qt = reactor.register_timer(self._do_query, reactor.NOW)
-            self.query_timer = qt
+        self._start_query_timer()
         # Wait for data to be queried
         msg = complete.wait()
         web_request.send(msg['params'])
@@ -547,8 +621,20 @@ class QueryStatusHelper:
             self.clients[cconn] = (cconn, objects, cconn.send, template)
     def _handle_subscribe(self, web_request):
         self._handle_query(web_request, is_subscribe=True)
+    def _start_query_timer(self):
+        if self.query_timer is None:
+            reactor = self.printer.get_reactor()
+            qt = reactor.register_timer(self._do_query, reactor.NOW)
+            self.query_timer = qt
+    # Subscription from host code - 'client' must provide an is_closed()
+    # method. The send_func is first called with the full status and
+    # then with the changed fields at each refresh.
+    def add_local_subscription(self, client, objects, send_func):
+        self.pending_queries.append((None, objects, send_func, {}))
+        self.clients[client] = (client, objects, send_func, {})
+        self._start_query_timer()
 
 def add_early_printer_objects(printer):
     printer.add_object('webhooks', WebHooks(printer))
     GCodeHelper(printer)
-    QueryStatusHelper(printer)
+    printer.add_object('query_status', QueryStatusHelper(printer))
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+# Simulate many gcode files with klippy and summarize the results
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, json, time, subprocess, tempfile, shutil
+import concurrent.futures
+KLIPPER_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+KLIPPY_SCRIPT = os.path.join(KLIPPER_DIR, "klippy", "klippy.py")
+
+LOG_TAIL_LINES = 20
+
+
+######################################################################
+# Simulation runs
+######################################################################
+
+class SimulateRun:
+    def __init__(self, index, gcode_fname, options, config_fname, logdir):
+        self.gcode_fname = gcode_fname
+        self.options = options
+        self.config_fname = config_fname
+        base = os.path.splitext(os.path.basename(gcode_fname))[0]
+        self.log_fname = os.path.join(logdir, "%04d-%s.log" % (index, base))
+        self.report = None
+        self.error = None
+        self.wall_time = 0.
+    def run(self):
+        args = [self.options.python, KLIPPY_SCRIPT, self.config_fname,
+                '-i', self.gcode_fname, '--simulate', self.options.mode,
+                '-l', self.log_fname]
+        for df in self.options.dictionary:
+            args += ['-d', df]
+        start_time = time.time()
+        try:
+            res = subprocess.run(args, stdout=subprocess.PIPE,
+                                 stderr=subprocess.STDOUT,
+                                 timeout=self.options.timeout)
+        except subprocess.TimeoutExpired:
+            self.error = "timeout"
+            return self
+        finally:
+            self.wall_time = time.time() - start_time
+        lines = res.stdout.decode(errors='replace').strip().split('\n')
+        try:
+            self.report = json.loads(lines[-1])
+        except ValueError:
+            self.error = "no report (exit code %d)" % (res.returncode,)
+            return self
+        if 'error' in self.report:
+            self.error = self.report['error'].split('\n')[0]
+        elif res.returncode:
+            self.error = "exit code %d" % (res.returncode,)
+        return self
+    def show_log(self):
+        try:
+            f = open(self.log_fname, 'r')
+            lines = f.readlines()
+            f.close()
+        except IOError:
+            return
+        sys.stderr.write("".join(lines[-LOG_TAIL_LINES:]))
+
+
+######################################################################
+# Summary table
+######################################################################
+
+def format_time(seconds):
+    hours, rem = divmod(seconds, 3600.)
+    minutes, secs = divmod(rem, 60.)
+    return "%d:%02d:%04.1f" % (hours, minutes, secs)
+
+def get_stepper_rows(report):
+    # Find the stepper with the highest step rate on each mcu
+    peak = {}
+    for name, status in report.get('steppers', {}).items():
+        rate = status['peak_step_rate']
+        mcu_name = status['mcu']
+        if mcu_name not in peak or rate > peak[mcu_name][0]:
+            peak[mcu_name] = (rate, name)
+    return peak
+
+def build_table(runs, mode):
+    header = ["file", "print time", "host time", "mcu"]
+    if mode == 'steps':
+        header += ["peak steps/s", "stepper", "avg bytes/s", "peak bytes/s",
+                   "move queue"]
+    header += ["bytes_write"]
+    rows = [header]
+    for r in runs:
+        fname = os.path.basename(r.gcode_fname)
+        if r.error is not None:
+            rows.append([fname, "FAILED: %s" % (r.error,)])
+            continue
+        report = r.report
+        peak = get_stepper_rows(report)
+        for mcu_name, status in sorted(report['mcus'].items()):
+            row = [fname, format_time(report['print_duration']),
+                   "%.2f" % (report['host_time'],), mcu_name]
+            if mode == 'steps':
+                rate, stepper = peak.get(mcu_name, (0, ""))
+                row += ["%d" % (rate,), stepper,
+                        "%d" % (status['avg_bytes_per_sec'],),
+                        "%d" % (status['peak_bytes_per_sec'],),
+                        "%d" % (status['peak_move_queue'],)]
+            row += ["%d" % (status['stats'].get('bytes_write', 0),)]
+            rows.append(row)
+            fname = ""
+    widths = [max([len(row[i]) for row in rows if i < len(row)
+                   and (len(row) > 2 or i == 0)])
+              for i in range(len(header))]
+    out = []
+    for row in rows:
+        if len(row) == 2:
+            out.append("%-*s  %s" % (widths[0], row[0], row[1]))
+            continue
+        out.append("  ".join(["%-*s" % (widths[i], row[i])
+                              for i in range(len(row))]).rstrip())
+    return "\n".join(out)
+
+
+######################################################################
+# Startup
+######################################################################
+
+def arg_dictionary(option, opt_str, value, parser):
+    parser.values.dictionary.append(value)
+
+def main():
+    usage = "%prog [options] <config file> <gcode files>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-d", "--dictionary", dest="dictionary", type="string",
+                    default=[], action="callback", callback=arg_dictionary,
+                    help="file to read for mcu protocol dictionary"
+                    " (may be given once per mcu as 'mcu_name=file')")
+    opts.add_option("-j", "--jobs", dest="jobs", type="int",
+                    default=os.cpu_count(),
+                    help="number of simulations to run in parallel")
+    opts.add_option("-m", "--mode", dest="mode", type="choice",
+                    choices=["moves", "steps"], default="steps",
+                    help="klippy --simulate mode (default steps)")
+    opts.add_option("-l", "--logdir", dest="logdir",
+                    help="directory to store the klippy log of each run")
+    opts.add_option("-o", "--output", dest="output",
+                    help="write the report of each run to a json file")
+    opts.add_option("-t", "--timeout", dest="timeout", type="float",
+                    help="maximum seconds to allow for each run")
+    opts.add_option("-p", "--python", dest="python", default=sys.executable,
+                    help="python interpreter used to run klippy")
+    options, args = opts.parse_args()
+    if len(args) < 2:
+        opts.error("Incorrect number of arguments")
+    if not options.dictionary:
+        opts.error("At least one -d dictionary file is required")
+    config_fname = args[0]
+    logdir = options.logdir
+    if logdir is None:
+        logdir = tempfile.mkdtemp(prefix="batch_simulate_")
+    elif not os.path.isdir(logdir):
+        os.makedirs(logdir)
+
+    # Run all simulations
+    runs = [SimulateRun(i, fname, options, config_fname, logdir)
+            for i, fname in enumerate(args[1:])]
+    start_time = time.time()
+    failed = []
+    with concurrent.futures.ThreadPoolExecutor(options.jobs) as executor:
+        for r in executor.map(SimulateRun.run, runs):
+            if r.error is None:
+                sys.stderr.write("    %s: %s\n" % (
+                    r.gcode_fname, format_time(r.report['print_duration'])))
+                continue
+            sys.stderr.write("    %s: FAILED (%s)\n" % (r.gcode_fname,
+                                                       r.error))
+            r.show_log()
+            failed.append(r)
+    wall_time = time.time() - start_time
+    if options.logdir is None:
+        shutil.rmtree(logdir)
+
+    # Report results
+    sys.stdout.write(build_table(runs, options.mode) + "\n")
+    total = sum([r.report['print_duration'] for r in runs
+                 if r.error is None])
+    sys.stdout.write("\n%d files (%d failed), total print time %s,"
+                     " %.1f seconds to simulate\n" % (
+                         len(runs), len(failed), format_time(total),
+                         wall_time))
+    if options.output is not None:
+        f = open(options.output, 'w')
+        json.dump([{'file': r.gcode_fname, 'error': r.error,
+                    'wall_time': round(r.wall_time, 3), 'report': r.report}
+                   for r in runs], f, indent=1, sort_keys=True)
+        f.close()
+    if failed:
+        sys.exit(-1)
+
+if __name__ == '__main__':
+    main()
@@ -1,22 +1,24 @@
 #!/usr/bin/env python2
 # Script to handle build time requests embedded in C code.
 #
-# Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, subprocess, optparse, logging, shlex, socket, time, traceback
-import json, zlib
+import json, zlib, hashlib
 sys.path.append('./klippy')
 import msgproto
 
 FILEHEADER = """
 /* DO NOT EDIT! This is an autogenerated file. See scripts/buildcommands.py. */
 
+#include <string.h>
 #include "board/irq.h"
 #include "board/pgm.h"
 #include "command.h"
 #include "compiler.h"
 #include "initial_pins.h"
+#include "sched.h"
 """
 
 def error(msg):
@@ -34,12 +36,53 @@ Handlers = []
 class HandleCallList:
     def __init__(self):
         self.call_lists = {'ctr_run_initfuncs': []}
-        self.ctr_dispatch = { '_DECL_CALLLIST': self.decl_calllist }
+        self.wake_tasks = []
+        self.task_profile = False
+        self.ctr_dispatch = { '_DECL_CALLLIST': self.decl_calllist,
+                              '_DECL_WAKE_TASK': self.decl_wake_task,
+                              '_DECL_TASK_PROFILE': self.decl_task_profile }
     def decl_calllist(self, req):
         funcname, callname = req.split()[1:]
         self.call_lists.setdefault(funcname, []).append(callname)
+    def decl_wake_task(self, req):
+        taskname, wakename = req.split()[1:]
+        self.wake_tasks.append((taskname, wakename))
+        self.call_lists.setdefault('ctr_run_taskfuncs', [])
+    def decl_task_profile(self, req):
+        self.task_profile = True
+    def get_task_names(self):
+        tasks = self.call_lists.get('ctr_run_taskfuncs', [])
+        return tasks + [t for t, w in self.wake_tasks]
     def update_data_dictionary(self, data):
-        pass
+        if self.task_profile:
+            for i, taskname in enumerate(self.get_task_names()):
+                HandlerEnumerations.add_enumeration("task", taskname, i)
+    def generate_task_call(self, taskname, indent):
+        code = ["extern void %s(void);" % (taskname,)]
+        if self.task_profile:
+            task_id = self.get_task_names().index(taskname)
+            code += ["uint32_t start = profile_task_begin();",
+                     "%s();" % (taskname,),
+                     "profile_task_end(%d, start);" % (task_id,)]
+            code = ["{"] + ["    " + c for c in code] + ["}"]
+        else:
+            code.append("%s();" % (taskname,))
+        return "\n".join([indent + c for c in code])
+    def generate_wake_tasks(self):
+        # Assign each task a bit in the wake bitmap
+        if len(self.wake_tasks) > 32:
+            error("Too many wake tasks (%d)" % (len(self.wake_tasks),))
+        wake_masks = {}
+        func_code = ["    uint32_t wake_bitmap = sched_take_task_bitmap();"]
+        for i, (taskname, wakename) in enumerate(self.wake_tasks):
+            wake_masks[wakename] = wake_masks.get(wakename, 0) | (1 << i)
+            func_code.append("    if (wake_bitmap & 0x%x) {\n%s\n"
+                             "        irq_poll();\n    }" % (
+                                 1 << i,
+                                 self.generate_task_call(taskname, " "*8)))
+        wakes = ["struct task_wake %s = { .task_mask = 0x%x };" % (w, m)
+                 for w, m in sorted(wake_masks.items())]
+        return "\n".join(wakes), func_code
     def generate_code(self, options):
         code = []
         for funcname, funcs in self.call_lists.items():
@@ -47,8 +90,13 @@ class HandleCallList:
                          for f in funcs]
             if funcname == 'ctr_run_taskfuncs':
                 add_poll = '    irq_poll();\n'
-                func_code = [add_poll + fc for fc in func_code]
+                func_code = [add_poll + self.generate_task_call(f, " "*4)
+                             for f in funcs]
                 func_code.append(add_poll)
+                if self.wake_tasks:
+                    wakes, wake_code = self.generate_wake_tasks()
+                    code.append("\n" + wakes + "\n")
+                    func_code.extend(wake_code)
             fmt = """
 void
 %s(void)
@@ -255,6 +303,8 @@ class HandleCommandGeneration:
         self.encid_to_msgid = {}
         self.messages_by_name = { m.split()[0]: m for m in self.msg_to_encid }
         self.all_param_types = {}
+        self.parse_funcs = {}
+        self.encode_funcs = {}
         self.ctr_dispatch = {
             'DECL_COMMAND_FLAGS': self.decl_command,
             '_DECL_ENCODER': self.decl_encoder,
@@ -371,14 +421,19 @@ class HandleCommandGeneration:
                     % (msg, encoded_msgid))
             if msgname is None:
                 parsercode = self.build_parser(encoded_msgid, msg, 'output')
+                encodefunc = self.build_encode_func(encoded_msgid, msg,
+                                                    'output')
                 output_code.append(code)
             else:
                 parsercode = self.build_parser(encoded_msgid, msg, 'command')
+                encodefunc = self.build_encode_func(encoded_msgid, msg,
+                                                    'command')
                 encoder_code.append(code)
             encoder_defs.append(
                 "const struct command_encoder command_encoder_%s PROGMEM = {"
-                "    %s\n};\n" % (
-                    encoded_msgid, parsercode))
+                "    %s\n#if CONFIG_COMMAND_ENCODERS\n"
+                "    .encode=%s,\n#endif\n};\n" % (
+                    encoded_msgid, parsercode, encodefunc))
         fmt = """
 %s
 
@@ -396,9 +451,91 @@ ctr_lookup_output(const char *str)
     return NULL;
 }
 """
-        return fmt % ("".join(encoder_defs).strip(),
+        return fmt % (self.generate_encode_funcs_code()
+                      + "".join(encoder_defs).strip(),
                       "".join(encoder_code).strip(),
                       "".join(output_code).strip())
+    def build_encode_func(self, encoded_msgid, msgformat, msgtype):
+        if msgtype == "output":
+            param_types = msgproto.lookup_output_params(msgformat)
+        else:
+            param_types = [t for name, t in msgproto.lookup_params(msgformat)]
+        types = tuple([t.__class__.__name__ for t in param_types])
+        # Bounds checks are only needed if the message may be truncated
+        msgid_size = 1
+        if encoded_msgid >= 0x80:
+            msgid_size = 2
+        need_check = (msgproto.MESSAGE_MIN + msgid_size
+                      + sum([t.max_length for t in param_types])
+                      > msgproto.MESSAGE_MAX)
+        key = (types, need_check)
+        funcid = self.encode_funcs.get(key)
+        if funcid is None:
+            funcid = len(self.encode_funcs)
+            self.encode_funcs[key] = funcid
+        return 'command_encode_params%d' % (funcid,)
+    def generate_encode_funcs_code(self):
+        # Create a straight-line encoder for each set of parameter types
+        int_code = {
+            'PT_uint32': "va_arg(args, uint32_t)",
+            'PT_int32': "va_arg(args, uint32_t)",
+            'PT_uint16': ("(sizeof(uint32_t) > sizeof(int)"
+                          " ? va_arg(args, unsigned int)"
+                          " : va_arg(args, uint32_t))"),
+            'PT_int16': ("(sizeof(uint32_t) > sizeof(int)"
+                         " ? (int32_t)va_arg(args, int)"
+                         " : va_arg(args, uint32_t))"),
+        }
+        int_code['PT_byte'] = int_code['PT_uint16']
+        funcs = []
+        for (types, need_check), funcid in sorted(self.encode_funcs.items(),
+                                                  key=lambda i: i[1]):
+            code = []
+            for t in types:
+                if need_check:
+                    code.append("    if (p > maxend)\n"
+                                "        return NULL;\n")
+                if t in int_code:
+                    code.append("    p = command_encode_int(p, %s);\n"
+                                % (int_code[t],))
+                elif t == 'PT_string':
+                    code.append(
+                        "    s = va_arg(args, uint8_t*);\n"
+                        "    lenp = p++;\n"
+                        "    while (*s && p<maxend)\n"
+                        "        *p++ = *s++;\n"
+                        "    *lenp = p-lenp-1;\n")
+                else:
+                    memcpy = "memcpy"
+                    if t == 'PT_progmem_buffer':
+                        memcpy = "memcpy_P"
+                    code.append(
+                        "    v = va_arg(args, int);\n"
+                        "    if (v > maxend-p)\n"
+                        "        v = maxend-p;\n"
+                        "    *p++ = v;\n"
+                        "    s = va_arg(args, uint8_t*);\n"
+                        "    %s(p, s, v);\n"
+                        "    p += v;\n" % (memcpy,))
+            decls = []
+            if 'PT_string' in types:
+                decls.append("    uint8_t *s, *lenp;\n")
+            elif 'PT_buffer' in types or 'PT_progmem_buffer' in types:
+                decls.append("    uint8_t *s;\n")
+            if 'PT_buffer' in types or 'PT_progmem_buffer' in types:
+                decls.append("    uint32_t v;\n")
+            if not types:
+                decls.append("    (void)args;\n")
+            if not need_check and not [t for t in types
+                                       if t not in int_code]:
+                decls.append("    (void)maxend;\n")
+            funcs.append(
+                "static uint8_t *\n"
+                "command_encode_params%d(uint8_t *p, uint8_t *maxend"
+                ", va_list args)\n{\n%s%s    return p;\n}\n" % (
+                    funcid, "".join(decls), "".join(code)))
+        return ("#if CONFIG_COMMAND_ENCODERS\n%s#endif\n\n"
+                % ("\n".join(funcs),))
     def generate_commands_code(self):
         cmd_by_encid = {
             self.msg_to_encid[self.messages_by_name.get(msgname, msgname)]: cmd
@@ -415,13 +552,18 @@ ctr_lookup_output(const char *str)
             msg = self.messages_by_name[msgname]
             externs[funcname] = 1
             parsercode = self.build_parser(encoded_msgid, msg, 'response')
-            index.append(" {%s\n    .flags=%s,\n    .func=%s\n}," % (
-                parsercode, flags, funcname))
+            parsefunc = self.build_parse_func(msg)
+            index.append(" {%s\n    .flags=%s,\n    .func=%s,\n"
+                         "#if CONFIG_COMMAND_PARSERS\n"
+                         "    .parse=%s,\n"
+                         "#endif\n}," % (
+                             parsercode, flags, funcname, parsefunc))
         index = "".join(index).strip()
         externs = "\n".join(["extern void "+funcname+"(uint32_t*);"
                              for funcname in sorted(externs)])
         fmt = """
 %s
+%s
 
 const struct command_parser command_index[] PROGMEM = {
 %s
@@ -429,7 +571,55 @@ const struct command_parser command_index[] PROGMEM = {
 
 const uint16_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
 """
-        return fmt % (externs, index)
+        return fmt % (externs, self.generate_parse_funcs_code(), index)
+    def build_parse_func(self, msgformat):
+        # Integer types are all parsed the same way
+        types = tuple([t.__class__.__name__ if t.is_dynamic_string else 'int'
+                       for name, t in msgproto.lookup_params(msgformat)])
+        funcid = self.parse_funcs.get(types)
+        if funcid is None:
+            funcid = len(self.parse_funcs)
+            self.parse_funcs[types] = funcid
+        return 'command_parse_params%d' % (funcid,)
+    def generate_parse_funcs_code(self):
+        # Create a straight-line parser for each set of parameter types
+        funcs = []
+        for types, funcid in sorted(self.parse_funcs.items(),
+                                    key=lambda i: i[1]):
+            code = []
+            argpos = 0
+            for t in types:
+                code.append("    if (p > maxend)\n"
+                            "        return NULL;\n")
+                if t == 'PT_buffer':
+                    code.append("    len = *p++;\n"
+                                "    if (p + len > maxend)\n"
+                                "        return NULL;\n"
+                                "    args[%d] = len;\n"
+                                "    args[%d] = command_encode_ptr(p);\n"
+                                "    p += len;\n"
+                                % (argpos, argpos + 1))
+                    argpos += 2
+                elif t in ('PT_string', 'PT_progmem_buffer'):
+                    code.append("    return NULL;\n")
+                    break
+                else:
+                    code.append("    args[%d] = command_parse_int(&p);\n"
+                                % (argpos,))
+                    argpos += 1
+            decls = ""
+            if 'PT_buffer' in types:
+                decls = "    uint_fast8_t len;\n"
+            unused = ""
+            if not argpos:
+                unused = "    (void)maxend;\n    (void)args;\n"
+            funcs.append(
+                "static uint8_t *\n"
+                "command_parse_params%d(uint8_t *p, uint8_t *maxend"
+                ", uint32_t *args)\n{\n%s%s%s    return p;\n}\n" % (
+                    funcid, decls, unused, "".join(code)))
+        return ("\n#if CONFIG_COMMAND_PARSERS\n%s#endif\n"
+                % ("\n".join(funcs),))
     def generate_param_code(self):
         sorted_param_types = sorted(
             [(i, a) for a, i in self.all_param_types.items()])
@@ -576,6 +766,9 @@ class HandleIdentify:
             if i % 8 == 0:
                 out.append('\n   ')
             out.append(" 0x%02x," % (zdatadict[i],))
+        # Hash of the compressed data (allows the host to cache it)
+        zhash = hashlib.sha1(zdatadict).digest()
+        zhash = bytearray(zhash[:msgproto.IDENTIFY_HASH_SIZE])
         fmt = """
 const uint8_t command_identify_data[] PROGMEM = {%s
 };
@@ -583,8 +776,13 @@ const uint8_t command_identify_data[] PROGMEM = {%s
 // Identify size = %d (%d uncompressed)
 const uint32_t command_identify_size PROGMEM
     = ARRAY_SIZE(command_identify_data);
+
+const uint8_t command_identify_hash[] PROGMEM = {
+    %s
+};
 """
-        return fmt % (''.join(out), len(zdatadict), len(datadict))
+        return fmt % (''.join(out), len(zdatadict), len(datadict),
+                      ' '.join(["0x%02x," % (c,) for c in zhash]))
 
 Handlers.append(HandleIdentify())
 
@@ -16,6 +16,10 @@ shaper_calibrate = importlib.import_module('.shaper_calibrate', 'extras')
 MAX_TITLE_LENGTH=65
 
 def parse_log(logname):
+    raw_data = shaper_calibrate.read_raw_data(logname, np)
+    if raw_data is not None:
+        # Binary raw accelerometer data
+        return raw_data[1]
     with open(logname) as f:
         for header in f:
             if not header.startswith('#'):
@@ -5,8 +5,12 @@
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse, datetime, math
+import optparse, datetime, math, os, sys, importlib
 import matplotlib
+try:
+    import numpy
+except ImportError:
+    numpy = None
 
 SEG_TIME = .000100
 INV_SEG_TIME = 1. / SEG_TIME
@@ -91,11 +95,67 @@ def gen_positions():
     return out
 
 
+######################################################################
+# Motion generation using the klippy chelper code
+######################################################################
+
+START_TIME = 1.
+
+def load_klippy_module(name):
+    klippy_dir = os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                              '..', 'klippy')
+    if klippy_dir not in sys.path:
+        sys.path.append(klippy_dir)
+    return importlib.import_module(name)
+
+# Calculate positions (and shaped positions) of an X stepper using the
+# same trapq and input shaper code as the printer (accel_order=2 only)
+def gen_positions_chelper(shaper_name):
+    chelper = load_klippy_module('chelper')
+    shaper_defs = load_klippy_module('extras.shaper_defs')
+    ffi_main, ffi_lib = chelper.get_ffi()
+    tq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
+    # Each entry of 'Moves' is added as a single constant acceleration
+    # segment (the velocity and acceleration may be negative)
+    print_time = START_TIME
+    start_d = 0.
+    for start_v, end_v, move_t in Moves:
+        if move_t is None:
+            move_t = abs(end_v - start_v) / get_acc(start_v, end_v)
+        accel = (end_v - start_v) / move_t
+        ffi_lib.trapq_append(tq, print_time, move_t, 0., 0.,
+                             start_d, 0., 0., 1., 0., 0.,
+                             start_v, start_v, accel)
+        start_d += get_acc_pos_ao2(move_t, start_v, accel, move_t)
+        print_time += move_t
+    count = time_to_index(print_time - START_TIME) + 1
+    # Setup stepper kinematics
+    sk = ffi_main.gc(ffi_lib.cartesian_stepper_alloc(b'x'), ffi_lib.free)
+    ffi_lib.itersolve_set_trapq(sk, tq)
+    shaper_sk = ffi_main.gc(ffi_lib.input_shaper_alloc(), ffi_lib.free)
+    ffi_lib.input_shaper_set_sk(shaper_sk, sk)
+    ffi_lib.itersolve_set_trapq(shaper_sk, tq)
+    shapers = dict([(s.name, s) for s in shaper_defs.INPUT_SHAPERS])
+    if shaper_name not in shapers:
+        sys.exit("Unknown input shaper '%s'" % (shaper_name,))
+    A, T = shapers[shaper_name].init_func(CONFIG_FREQ, CONFIG_DAMPING_RATIO)
+    ffi_lib.input_shaper_set_shaper_params(shaper_sk, b'x', len(A), A, T)
+    # Sample positions
+    def sample(sk):
+        buf = ffi_main.new('double[]', count)
+        ffi_lib.itersolve_sample_positions(sk, START_TIME, SEG_TIME,
+                                           count, buf)
+        return list(buf)
+    return sample(sk), sample(shaper_sk)
+
+
 ######################################################################
 # Estimated motion with belt as spring
 ######################################################################
 
 def estimate_spring(positions):
+    if numpy is not None:
+        return estimate_spring_numpy(positions)
     ang_freq2 = (SPRING_FREQ * 2. * math.pi)**2
     damping_factor = 4. * math.pi * DAMPING_RATIO * SPRING_FREQ
     head_pos = head_v = 0.
@@ -108,6 +168,32 @@ def estimate_spring(positions):
         out.append(head_pos)
     return out
 
+# Same model as estimate_spring() - the head position is a linear
+# function of the stepper positions, so calculate it as a convolution
+# with the model's impulse response
+def estimate_spring_numpy(positions):
+    np = numpy
+    ang_freq2 = (SPRING_FREQ * 2. * math.pi)**2
+    damping_factor = 4. * math.pi * DAMPING_RATIO * SPRING_FREQ
+    dt = SEG_TIME
+    # State transition of [head_pos, head_v] for each SEG_TIME step
+    dk = 1. - damping_factor * dt
+    M = np.array([[1., dt], [-dk * ang_freq2 * dt,
+                             dk * (1. - ang_freq2 * dt * dt)]])
+    B = np.array([0., dk * ang_freq2 * dt])
+    C = np.array([1., dt])
+    # Impulse response h[n] = C * M**n * B (using eigendecomposition)
+    n = len(positions)
+    w, V = np.linalg.eig(M)
+    coeffs = C.dot(V) * np.linalg.solve(V, B)
+    steps = np.arange(n)
+    h = np.real(sum([coeffs[i] * w[i]**steps for i in range(len(w))]))
+    # Convolve with the positions
+    size = 1 << (2 * n - 1).bit_length()
+    conv = np.fft.irfft(np.fft.rfft(positions, size) * np.fft.rfft(h, size),
+                        size)
+    return [0.] + list(conv[:n-1])
+
 
 ######################################################################
 # List helper functions
@@ -340,13 +426,15 @@ def gen_updated_position(positions):
 # Plotting and startup
 ######################################################################
 
-def plot_motion():
-    # Nominal motion
-    positions = gen_positions()
+def plot_motion(shaper_name=None):
+    # Nominal and updated motion
+    if shaper_name is not None:
+        positions, upd_positions = gen_positions_chelper(shaper_name)
+    else:
+        positions = gen_positions()
+        upd_positions = gen_updated_position(positions)
     velocities = gen_deriv(positions)
     accels = gen_deriv(velocities)
-    # Updated motion
-    upd_positions = gen_updated_position(positions)
     upd_velocities = gen_deriv(upd_positions)
     upd_accels = gen_deriv(upd_velocities)
     # Estimated position with model of belt as spring
@@ -408,13 +496,16 @@ def main():
     opts = optparse.OptionParser(usage)
     opts.add_option("-o", "--output", type="string", dest="output",
                     default=None, help="filename of output graph")
+    opts.add_option("-c", "--chelper", type="string", dest="shaper",
+                    default=None, help="use the klippy chelper code to"
+                    " generate motion with the given input shaper")
     options, args = opts.parse_args()
     if len(args) != 0:
         opts.error("Incorrect number of arguments")
 
     # Draw graph
     setup_matplotlib(options.output is not None)
-    fig = plot_motion()
+    fig = plot_motion(options.shaper)
 
     # Show graph
     if options.output is None:
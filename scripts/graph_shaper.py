@@ -5,7 +5,7 @@
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse, math
+import optparse, math, os, sys, importlib
 import matplotlib
 
 # A set of damping ratios to calculate shaper response for
@@ -132,6 +132,17 @@ def shift_pulses(shaper):
 # Shaper selection
 get_shaper = get_ei_shaper
 
+# Load a shaper from the klippy input_shaper definitions
+def get_klippy_shaper(name):
+    sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                                 '..', 'klippy'))
+    shaper_defs = importlib.import_module('.shaper_defs', 'extras')
+    for shaper_cfg in shaper_defs.INPUT_SHAPERS:
+        if shaper_cfg.name == name:
+            A, T = shaper_cfg.init_func(SHAPER_FREQ, SHAPER_DAMPING_RATIO)
+            return (list(A), list(T), name)
+    sys.exit("Unknown input shaper '%s'" % (name,))
+
 
 ######################################################################
 # Plotting and startup
@@ -259,18 +270,28 @@ def setup_matplotlib(output_to_file):
     import matplotlib.ticker
 
 def main():
+    global SHAPER_FREQ
     # Parse command-line arguments
     usage = "%prog [options]"
     opts = optparse.OptionParser(usage)
     opts.add_option("-o", "--output", type="string", dest="output",
                     default=None, help="filename of output graph")
+    opts.add_option("-s", "--shaper", type="string", dest="shaper",
+                    default=None, help="name of a klippy input shaper")
+    opts.add_option("-f", "--freq", type="float", dest="freq",
+                    default=SHAPER_FREQ, help="shaper frequency")
     options, args = opts.parse_args()
     if len(args) != 0:
         opts.error("Incorrect number of arguments")
+    SHAPER_FREQ = options.freq
+    if options.shaper is not None:
+        shaper = get_klippy_shaper(options.shaper)
+    else:
+        shaper = get_shaper()
 
     # Draw graph
     setup_matplotlib(options.output is not None)
-    fig = plot_shaper(get_shaper())
+    fig = plot_shaper(shaper)
 
     # Show graph
     if options.output is None:
@@ -1,11 +1,14 @@
 #!/usr/bin/env python
 # Script to parse a logging file, extract the stats, and graph them
 #
-# Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse, datetime
+import sys, os, optparse, datetime
 import matplotlib
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import queuelogger
 
 MAXBANDWIDTH=25000.
 MAXBUFFER=2.
@@ -18,31 +21,55 @@ APPLY_PREFIX = [
     'target', 'temp', 'pwm'
 ]
 
+def parse_stats(parts, mcu_prefix, apply_prefix):
+    prefix = ""
+    keyparts = {}
+    for p in parts:
+        if '=' not in p:
+            prefix = p
+            if prefix == mcu_prefix:
+                prefix = ''
+            continue
+        name, val = p.split('=', 1)
+        if name in apply_prefix:
+            name = prefix + name
+        keyparts[name] = val
+    return keyparts
+
+# Extract the "Stats" parts from the records of a binary log
+def binlog_stats_parts(f):
+    for rtype, eventtime, data in queuelogger.read_binlog(f):
+        if rtype == queuelogger.BL_STATS_TEXT:
+            yield eventtime, data.split()
+        elif rtype == queuelogger.BL_STATS:
+            yield eventtime, queuelogger.format_binlog_stats(data).split()
+
 def parse_log(logname, mcu):
     if mcu is None:
         mcu = "mcu"
     mcu_prefix = mcu + ":"
     apply_prefix = { p: 1 for p in APPLY_PREFIX }
-    f = open(logname, 'r')
     out = []
+    f = open(logname, 'rb')
+    if f.read(len(queuelogger.BINLOG_MAGIC)) == queuelogger.BINLOG_MAGIC:
+        f.seek(0)
+        for eventtime, parts in binlog_stats_parts(f):
+            keyparts = parse_stats(parts, mcu_prefix, apply_prefix)
+            if 'print_time' not in keyparts:
+                continue
+            keyparts['#sampletime'] = eventtime
+            out.append(keyparts)
+        f.close()
+        return out
+    f.close()
+    f = open(logname, 'r')
     for line in f:
         parts = line.split()
         if not parts or parts[0] not in ('Stats', 'INFO:root:Stats'):
             #if parts and parts[0] == 'INFO:root:shutdown:':
             #    break
             continue
-        prefix = ""
-        keyparts = {}
-        for p in parts[2:]:
-            if '=' not in p:
-                prefix = p
-                if prefix == mcu_prefix:
-                    prefix = ''
-                continue
-            name, val = p.split('=', 1)
-            if name in apply_prefix:
-                name = prefix + name
-            keyparts[name] = val
+        keyparts = parse_stats(parts[2:], mcu_prefix, apply_prefix)
         if 'print_time' not in keyparts:
             continue
         keyparts['#sampletime'] = float(parts[1][:-1])
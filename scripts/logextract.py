@@ -1,10 +1,13 @@
 #!/usr/bin/env python3
 # Script to extract config and shutdown information file a klippy.log file
 #
-# Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+# Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, re, collections, ast, itertools
+import sys, os, re, collections, ast, itertools
+sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
+                             '..', 'klippy'))
+import queuelogger, msgproto
 
 def format_comment(line_num, line):
     return "# %6d: %s" % (line_num, line)
@@ -576,6 +579,49 @@ class GatherShutdown:
 # Startup
 ######################################################################
 
+# Produce the text log lines equivalent to the records of a binary log
+def read_binlog_lines(f):
+    msgparsers = {}
+    for rtype, eventtime, data in queuelogger.read_binlog(f):
+        if rtype == queuelogger.BL_STATS_TEXT:
+            yield "Stats %.1f: %s" % (eventtime, data)
+        elif rtype == queuelogger.BL_STATS:
+            yield "Stats %.1f: %s" % (
+                eventtime, queuelogger.format_binlog_stats(data))
+        elif rtype == queuelogger.BL_DICT:
+            name, raw_dict = data
+            msgparser = msgproto.MessageParser()
+            msgparser.process_identify(raw_dict, decompress=False)
+            msgparsers[name] = msgproto.MessageDumper(msgparser)
+        elif rtype == queuelogger.BL_DUMP:
+            name, stats, clock_est, sent, received = data
+            msgparser = msgparsers.get(name)
+            if msgparser is None:
+                continue
+            yield "MCU '%s' shutdown: (binary log dump)" % (name,)
+            yield "clocksync state: mcu_freq=%d clock_est=(%.3f %d %.3f)" % (
+                clock_est[2], clock_est[0], clock_est[1], clock_est[2])
+            yield "Dumping serial stats: %s" % (stats,)
+            for desc, title, msgs in [("Sent", "send", sent),
+                                      ("Receive:", "receive", received)]:
+                yield "Dumping %s queue %d messages" % (title, len(msgs))
+                for i, (sent_time, receive_time, msg) in enumerate(msgs):
+                    cmds = msgparser.dump(msg)
+                    yield "%s %d %f %f %d: %s" % (
+                        desc, i, receive_time, sent_time, len(msg),
+                        ', '.join(cmds))
+
+def read_log_lines(logname):
+    with open(logname, 'rb') as f:
+        if f.read(len(queuelogger.BINLOG_MAGIC)) == queuelogger.BINLOG_MAGIC:
+            f.seek(0)
+            for line in read_binlog_lines(f):
+                yield line
+            return
+    with open(logname, 'rt') as f:
+        for line in f:
+            yield line.rstrip()
+
 def main():
     logname = sys.argv[1]
     last_git = last_start = None
@@ -583,31 +629,29 @@ def main():
     handler = None
     recent_lines = collections.deque([], 200)
     # Parse log file
-    with open(logname, 'rt') as f:
-        for line_num, line in enumerate(f):
-            line = line.rstrip()
-            line_num += 1
-            recent_lines.append((line_num, line))
-            if handler is not None:
-                ret = handler.add_line(line_num, line)
-                if ret:
-                    continue
-                recent_lines.clear()
-                handler = None
-            if line.startswith('Git version'):
-                last_git = format_comment(line_num, line)
-            elif line.startswith('Start printer at'):
-                last_start = format_comment(line_num, line)
-            elif line == '===== Config file =====':
-                handler = GatherConfig(configs, line_num,
-                                       recent_lines, logname)
-                handler.add_comment(last_git)
-                handler.add_comment(last_start)
-            elif 'shutdown: ' in line or line.startswith('Dumping '):
-                handler = GatherShutdown(configs, line_num,
-                                         recent_lines, logname)
-                handler.add_comment(last_git)
-                handler.add_comment(last_start)
+    for line_num, line in enumerate(read_log_lines(logname)):
+        line_num += 1
+        recent_lines.append((line_num, line))
+        if handler is not None:
+            ret = handler.add_line(line_num, line)
+            if ret:
+                continue
+            recent_lines.clear()
+            handler = None
+        if line.startswith('Git version'):
+            last_git = format_comment(line_num, line)
+        elif line.startswith('Start printer at'):
+            last_start = format_comment(line_num, line)
+        elif line == '===== Config file =====':
+            handler = GatherConfig(configs, line_num,
+                                   recent_lines, logname)
+            handler.add_comment(last_git)
+            handler.add_comment(last_start)
+        elif 'shutdown: ' in line or line.startswith('Dumping '):
+            handler = GatherShutdown(configs, line_num,
+                                     recent_lines, logname)
+            handler.add_comment(last_git)
+            handler.add_comment(last_start)
     if handler is not None:
         handler.finalize()
     # Write found config files
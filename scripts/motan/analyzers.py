@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, collections
+import numpy
 import readlog
 
 
@@ -40,10 +41,9 @@ class GenDerivative:
         return {'label': lname, 'units': units}
     def generate_data(self):
         inv_seg_time = 1. / self.amanager.get_segment_time()
-        data = self.amanager.get_datasets()[self.source]
-        deriv = [(data[i+1] - data[i]) * inv_seg_time
-                 for i in range(len(data)-1)]
-        return [deriv[0]] + deriv
+        data = numpy.asarray(self.amanager.get_datasets()[self.source])
+        deriv = numpy.diff(data) * inv_seg_time
+        return numpy.concatenate((deriv[:1], deriv))
 AHandlers["derivative"] = GenDerivative
 
 # Calculate an integral (accel to velocity, or velocity to position)
@@ -84,23 +84,22 @@ class GenIntegral:
         return {'label': lname, 'units': units}
     def generate_data(self):
         seg_time = self.amanager.get_segment_time()
-        src = self.amanager.get_datasets()[self.source]
-        offset = sum(src) / len(src)
-        total = 0.
-        ref = None
-        if self.ref is not None:
-            ref = self.amanager.get_datasets()[self.ref]
-            offset -= (ref[-1] - ref[0]) / (len(src) * seg_time)
-            total = ref[0]
-            src_weight = 1.
-            if self.half_life:
-                src_weight = math.exp(math.log(.5) * seg_time / self.half_life)
-            ref_weight = 1. - src_weight
+        src = numpy.asarray(self.amanager.get_datasets()[self.source])
+        offset = numpy.mean(src)
+        if self.ref is None:
+            return numpy.cumsum((src - offset) * seg_time)
+        ref = self.amanager.get_datasets()[self.ref]
+        offset -= (ref[-1] - ref[0]) / (len(src) * seg_time)
+        total = ref[0]
+        src_weight = 1.
+        if self.half_life:
+            src_weight = math.exp(math.log(.5) * seg_time / self.half_life)
+        ref_weight = 1. - src_weight
+        # The weighting with the reference is a recursive filter
         data = [0.] * len(src)
-        for i, v in enumerate(src):
+        for i, v in enumerate(src.tolist()):
             total += (v - offset) * seg_time
-            if ref is not None:
-                total = src_weight * total + ref_weight * ref[i]
+            total = src_weight * total + ref_weight * ref[i]
             data[i] = total
         return data
 AHandlers["integral"] = GenIntegral
@@ -145,17 +144,9 @@ class GenNorm2:
         lname += ' ' + data_name + ' norm2'
         return {'label': lname, 'units': units}
     def generate_data(self):
-        seg_time = self.amanager.get_segment_time()
-        data = []
-        for dataset in self.datasets:
-            data.append(self.amanager.get_datasets()[dataset])
-        res = [0.] * len(data[0])
-        for i in range(len(data[0])):
-            norm2 = 0.
-            for dataset in data:
-                norm2 += dataset[i] * dataset[i]
-            res[i] = math.sqrt(norm2)
-        return res
+        datasets = self.amanager.get_datasets()
+        data = [numpy.asarray(datasets[dataset]) for dataset in self.datasets]
+        return numpy.sqrt(sum([d * d for d in data]))
 AHandlers["norm2"] = GenNorm2
 
 class GenSmoothed:
@@ -179,20 +170,25 @@ class GenSmoothed:
         return {'label': 'Smoothed ' + label['label'], 'units': label['units']}
     def generate_data(self):
         seg_time = self.amanager.get_segment_time()
-        src = self.amanager.get_datasets()[self.source]
+        src = numpy.asarray(self.amanager.get_datasets()[self.source])
         n = len(src)
-        data = [0.] * n
         hst = 0.5 * self.smooth_time
-        seg_half_len = round(hst / seg_time)
-        inv_norm = 1. / sum([min(k + 1, seg_half_len + seg_half_len - k)
-                             for k in range(2 * seg_half_len)])
-        for i in range(n):
+        seg_half_len = int(round(hst / seg_time))
+        weights = numpy.minimum(numpy.arange(1, 2 * seg_half_len + 1),
+                                numpy.arange(2 * seg_half_len, 0, -1))
+        inv_norm = 1. / weights.sum()
+        data = numpy.zeros(n)
+        # Full windows
+        if n >= 2 * seg_half_len:
+            full = numpy.convolve(src, weights[::-1], mode='valid')
+            data[seg_half_len:seg_half_len + len(full)] = full * inv_norm
+        # Windows truncated at the start or the end of the dataset
+        edges = (list(range(min(seg_half_len, n)))
+                 + list(range(max(seg_half_len, n - seg_half_len + 1), n)))
+        for i in edges:
             j = max(0, i - seg_half_len)
             je = min(n, i + seg_half_len)
-            avg_val = 0.
-            for k, v in enumerate(src[j:je]):
-                avg_val += v * min(k + 1, seg_half_len + seg_half_len - k)
-            data[i] = avg_val * inv_norm
+            data[i] = numpy.dot(src[j:je], weights[:je-j]) * inv_norm
         return data
 AHandlers["smooth"] = GenSmoothed
 
@@ -229,14 +225,14 @@ class GenKinematicPosition:
         return {'label': 'Position', 'units': 'Position\n(mm)'}
     def generate_data_corexy_plus(self):
         datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 + d2 for d1, d2 in zip(data1, data2)]
+        data1 = numpy.asarray(datasets[self.source1])
+        data2 = numpy.asarray(datasets[self.source2])
+        return data1 + data2
     def generate_data_corexy_minus(self):
         datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 - d2 for d1, d2 in zip(data1, data2)]
+        data1 = numpy.asarray(datasets[self.source1])
+        data2 = numpy.asarray(datasets[self.source2])
+        return data1 - data2
     def generate_data_passthrough(self):
         return self.amanager.get_datasets()[self.source1]
 AHandlers["kin"] = GenKinematicPosition
@@ -262,11 +258,11 @@ class GenCorexyPosition:
                 'units': 'Position\n(mm)'}
     def generate_data(self):
         datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
+        data1 = numpy.asarray(datasets[self.source1])
+        data2 = numpy.asarray(datasets[self.source2])
         if self.is_plus:
-            return [.5 * (d1 + d2) for d1, d2 in zip(data1, data2)]
-        return [.5 * (d1 - d2) for d1, d2 in zip(data1, data2)]
+            return .5 * (data1 + data2)
+        return .5 * (data1 - data2)
 AHandlers["corexy"] = GenCorexyPosition
 
 # Calculate a position deviation
@@ -290,9 +286,9 @@ class GenDeviation:
         return {'label': label1['label'] + ' deviation', 'units': units}
     def generate_data(self):
         datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 - d2 for d1, d2 in zip(data1, data2)]
+        data1 = numpy.asarray(datasets[self.source1])
+        data2 = numpy.asarray(datasets[self.source2])
+        return data1 - data2
 AHandlers["deviation"] = GenDeviation
 
 
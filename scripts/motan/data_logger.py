@@ -4,7 +4,7 @@
 # Copyright (C) 2020-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, optparse, socket, select, json, errno, time, zlib
+import sys, os, optparse, socket, select, json, errno, time, zlib, struct
 
 INDEX_UPDATE_TIME = 5.0
 ClientInfo = {'program': 'motan_data_logger', 'version': 'v0.1'}
@@ -52,16 +52,94 @@ class LogWriter:
         self.file = None
         self.comp = None
 
+# Log stored as a compressed stream of all messages (log.json.gz)
+# along with a compressed stream of index messages (log.index.gz)
+class JsonLog:
+    def __init__(self, log_prefix):
+        self.logger = LogWriter(log_prefix + ".json.gz")
+        self.index = LogWriter(log_prefix + ".index.gz")
+    def add_msg(self, msg, raw_msg):
+        self.logger.add_data(raw_msg)
+    def add_index(self, db):
+        db['file_position'] = self.logger.flush()
+        self.index.add_data(json.dumps(db, separators=(',', ':')).encode())
+    def close(self):
+        self.logger.close()
+        self.index.close()
+
+# The chunked log format (log.chunks) stores the messages of each
+# subscription in separately compressed chunks.  Each chunk has a
+# header with the stream name, the index block it belongs to, and the
+# range of print times of its messages, so that a reader can locate
+# the data of a stream and time range without decompressing the rest
+# of the log.
+CHUNK_MAGIC = b"KLIPPER-MOTAN-CHUNKS-1\n"
+CHUNK_HEADER = struct.Struct("<BIIdd")
+CHUNK_MAX_SIZE = 256 * 1024
+CHUNK_RESPONSES = "responses"
+CHUNK_INDEX = "index"
+
+class ChunkedLog:
+    def __init__(self, log_prefix):
+        self.file = open(log_prefix + ".chunks", "wb")
+        self.file.write(CHUNK_MAGIC)
+        self.streams = {}
+        self.block = 0
+        self.print_time = 0.
+    def _write_chunk(self, name):
+        start_time, parts, size = self.streams.pop(name)
+        ename = name.encode()[:255]
+        data = zlib.compress(b"\x03".join(parts) + b"\x03")
+        self.file.write(CHUNK_HEADER.pack(len(ename), self.block, len(data),
+                                          start_time, self.print_time))
+        self.file.write(ename)
+        self.file.write(data)
+    def _add_data(self, name, data):
+        stream = self.streams.get(name)
+        if stream is None:
+            stream = self.streams[name] = [self.print_time, [], 0]
+        stream[1].append(data)
+        stream[2] += len(data) + 1
+        if stream[2] >= CHUNK_MAX_SIZE:
+            self._write_chunk(name)
+    def add_msg(self, msg, raw_msg):
+        name = msg.get("q")
+        if name is None:
+            name = CHUNK_RESPONSES
+        elif name == "status":
+            toolhead = msg["params"].get("status", {}).get("toolhead", {})
+            self.print_time = toolhead.get("estimated_print_time",
+                                           self.print_time)
+        self._add_data(name, raw_msg)
+    def add_index(self, db):
+        db['block'] = self.block
+        status = db.get("status", {})
+        self.print_time = status.get("toolhead", {}).get(
+            "estimated_print_time", self.print_time)
+        self._add_data(CHUNK_INDEX,
+                       json.dumps(db, separators=(',', ':')).encode())
+        for name in sorted(self.streams.keys()):
+            self._write_chunk(name)
+        self.file.flush()
+        self.block += 1
+    def close(self):
+        for name in sorted(self.streams.keys()):
+            self._write_chunk(name)
+        self.file.close()
+        self.file = None
+
 class DataLogger:
-    def __init__(self, uds_filename, log_prefix):
+    def __init__(self, uds_filename, log_prefix, chunked=False):
         # IO
         self.webhook_socket = webhook_socket_create(uds_filename)
         self.poll = select.poll()
         self.poll.register(self.webhook_socket, select.POLLIN | select.POLLHUP)
         self.socket_data = b""
         # Data log
-        self.logger = LogWriter(log_prefix + ".json.gz")
-        self.index = LogWriter(log_prefix + ".index.gz")
+        if chunked:
+            self.logger = ChunkedLog(log_prefix)
+        else:
+            self.logger = JsonLog(log_prefix)
         # Handlers
         self.query_handlers = {}
         self.async_handlers = {}
@@ -76,7 +154,6 @@ class DataLogger:
     def finish(self, msg):
         self.error(msg)
         self.logger.close()
-        self.index.close()
         sys.exit(0)
     # Unix Domain Socket IO
     def send_query(self, msg_id, method, params, cb):
@@ -97,7 +174,7 @@ class DataLogger:
             except:
                 self.error("ERROR: Unable to parse line")
                 continue
-            self.logger.add_data(part)
+            self.logger.add_msg(msg, part)
             msg_q = msg.get("q")
             if msg_q is not None:
                 hdl = self.async_handlers.get(msg_q)
@@ -170,8 +247,7 @@ class DataLogger:
             return
         self.db.setdefault("subscriptions", {})[msg_id] = msg["result"]
     def flush_index(self):
-        self.db['file_position'] = self.logger.flush()
-        self.index.add_data(json.dumps(self.db, separators=(',', ':')).encode())
+        self.logger.add_index(self.db)
         self.db = {"status": {}}
     def handle_async_db(self, msg, raw_msg):
         params = msg["params"]
@@ -193,12 +269,14 @@ def nice():
 def main():
     usage = "%prog [options] <socket filename> <log name>"
     opts = optparse.OptionParser(usage)
+    opts.add_option("-c", "--chunked", action="store_true",
+                    help="write the indexed chunked log format")
     options, args = opts.parse_args()
     if len(args) != 2:
         opts.error("Incorrect number of arguments")
 
     nice()
-    dl = DataLogger(args[0], args[1])
+    dl = DataLogger(args[0], args[1], options.chunked)
     dl.run()
 
 if __name__ == '__main__':
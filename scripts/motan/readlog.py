@@ -3,7 +3,8 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import json, zlib
+import os, json, zlib, struct, mmap, logging
+import numpy
 
 class error(Exception):
     pass
@@ -139,6 +140,35 @@ class HandleTrapQ:
         return accel
 LogHandlers["trapq"] = HandleTrapQ
 
+# Expand the queue_step entries of a dump_stepper block into arrays of
+# step times and step directions
+def expand_steps(jmsg):
+    first_time = jmsg['first_step_time']
+    first_clock = jmsg['first_clock']
+    cdiff = jmsg['last_clock'] - first_clock
+    tdiff = jmsg['last_step_time'] - first_time
+    inv_freq = 0.
+    if cdiff:
+        inv_freq = tdiff / cdiff
+    data = jmsg['data']
+    intervals = numpy.array([qs[0] for qs in data], dtype=numpy.int64)
+    raw_counts = numpy.array([qs[1] for qs in data], dtype=numpy.int64)
+    adds = numpy.array([qs[2] for qs in data], dtype=numpy.int64)
+    adds2 = numpy.array([qs[3] if len(qs) > 3 else 0 for qs in data],
+                        dtype=numpy.int64)
+    # Interval of the j-th step of an entry is
+    # interval + j*add + add2*j*(j-1)/2
+    counts = numpy.abs(raw_counts)
+    seg = numpy.repeat(numpy.arange(len(data)), counts)
+    j = numpy.arange(len(seg)) - numpy.repeat(numpy.cumsum(counts) - counts,
+                                              counts)
+    step_intervals = (intervals[seg] + j * adds[seg]
+                      + adds2[seg] * (j * (j - 1) // 2))
+    step_clocks = numpy.cumsum(step_intervals) - data[0][0]
+    step_times = first_time + step_clocks * inv_freq
+    step_dirs = numpy.where(raw_counts < 0, -1, 1)[seg]
+    return step_times, step_dirs
+
 # Extract positions from queue_step log
 class HandleStepQ:
     SubscriptionIdParts = 2
@@ -207,31 +237,16 @@ class HandleStepQ:
             if req_time <= last_time:
                 break
         # Process block into (time, half_position, position) 3-tuples
-        first_time = step_time = jmsg['first_step_time']
-        first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
-        cdiff = jmsg['last_clock'] - first_clock
-        tdiff = last_time - first_time
-        inv_freq = 0.
-        if cdiff:
-            inv_freq = tdiff / cdiff
         step_dist = jmsg['step_distance']
         step_pos = jmsg['start_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos, step_pos)
-        for interval, raw_count, add in jmsg['data']:
-            qs_dist = step_dist
-            count = raw_count
-            if count < 0:
-                qs_dist = -qs_dist
-                count = -count
-            for i in range(count):
-                step_clock += interval
-                interval += add
-                step_time = first_time + (step_clock - first_clock) * inv_freq
-                step_halfpos = step_pos + .5 * qs_dist
-                step_pos += qs_dist
-                step_data.append((step_time, step_halfpos, step_pos))
+        step_times, step_dirs = expand_steps(jmsg)
+        step_dists = step_dirs * step_dist
+        step_positions = step_pos + numpy.cumsum(step_dists)
+        step_halfpos = step_positions - .5 * step_dists
+        step_data.extend(zip(step_times.tolist(), step_halfpos.tolist(),
+                             step_positions.tolist()))
 LogHandlers["stepq"] = HandleStepQ
 
 # Extract stepper motor phase position
@@ -309,29 +324,12 @@ class HandleStepPhase:
             if req_time <= last_time:
                 break
         # Process block into (time, position) 2-tuples
-        first_time = step_time = jmsg['first_step_time']
-        first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
-        cdiff = jmsg['last_clock'] - first_clock
-        tdiff = last_time - first_time
-        inv_freq = 0.
-        if cdiff:
-            inv_freq = tdiff / cdiff
         step_pos = jmsg['start_mcu_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos)
-        for interval, raw_count, add in jmsg['data']:
-            qs_dist = 1
-            count = raw_count
-            if count < 0:
-                qs_dist = -1
-                count = -count
-            for i in range(count):
-                step_clock += interval
-                interval += add
-                step_time = first_time + (step_clock - first_clock) * inv_freq
-                step_pos += qs_dist
-                step_data.append((step_time, step_pos))
+        step_times, step_dirs = expand_steps(jmsg)
+        step_positions = step_pos + numpy.cumsum(step_dirs)
+        step_data.extend(zip(step_times.tolist(), step_positions.tolist()))
 LogHandlers["step_phase"] = HandleStepPhase
 
 # Extract accelerometer data
@@ -545,6 +543,8 @@ class JsonDispatcher:
         self.last_read_time = 0.
         self.log_reader = JsonLogReader(log_prefix + ".json.gz")
         self.is_eof = False
+    def seek_index(self, index_msg):
+        self.log_reader.seek(index_msg['file_position'])
     def check_end_of_data(self):
         return self.is_eof and not any(self.queues.values())
     def add_handler(self, name, subscription_id):
@@ -569,6 +569,94 @@ class JsonDispatcher:
             for mq in self.queues.get(qid, []):
                 mq.append(json_msg['params'])
 
+# Access to the streams of a log in the chunked format (see
+# data_logger.py) - only the chunk headers are read on startup
+CHUNK_MAGIC = b"KLIPPER-MOTAN-CHUNKS-1\n"
+CHUNK_HEADER = struct.Struct("<BIIdd")
+CHUNK_INDEX = "index"
+
+class ChunkedLogReader:
+    def __init__(self, filename):
+        self.file = open(filename, "rb")
+        self.data = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.data[:len(CHUNK_MAGIC)] != CHUNK_MAGIC:
+            raise error("File '%s' is not a chunked log" % (filename,))
+        # Build the per-stream index of chunks
+        self.streams = {}
+        pos = len(CHUNK_MAGIC)
+        data_len = len(self.data)
+        while pos + CHUNK_HEADER.size <= data_len:
+            name_len, block, size, start_time, end_time = (
+                CHUNK_HEADER.unpack_from(self.data, pos))
+            name_pos = pos + CHUNK_HEADER.size
+            chunk_pos = name_pos + name_len
+            if chunk_pos + size > data_len:
+                # Log truncated while writing the chunk
+                break
+            name = self.data[name_pos:chunk_pos].decode()
+            self.streams.setdefault(name, []).append(
+                (block, start_time, end_time, chunk_pos, size))
+            pos = chunk_pos + size
+    def get_chunks(self, name, start_block=0):
+        return [c for c in self.streams.get(name, []) if c[0] >= start_block]
+    def read_chunk(self, chunk):
+        block, start_time, end_time, pos, size = chunk
+        data = zlib.decompress(self.data[pos:pos+size])
+        msgs = []
+        for part in data.split(b'\x03')[:-1]:
+            try:
+                msgs.append(json.loads(part))
+            except:
+                logging.exception("Unable to parse line")
+        return msgs
+
+# Read the index messages of a chunked log
+class ChunkedIndexReader:
+    def __init__(self, log_reader):
+        self.log_reader = log_reader
+        self.chunks = log_reader.get_chunks(CHUNK_INDEX)
+        self.msgs = []
+    def pull_msg(self):
+        while not self.msgs:
+            if not self.chunks:
+                return None
+            self.msgs = self.log_reader.read_chunk(self.chunks.pop(0))
+        return self.msgs.pop(0)
+
+# Load chunks of a stream only when a handler of that stream needs them
+class ChunkedDispatcher:
+    def __init__(self, log_reader):
+        self.log_reader = log_reader
+        self.names = {}
+        self.streams = {}
+        self.start_block = 0
+    def seek_index(self, index_msg):
+        self.start_block = index_msg['block'] + 1
+        for queues, chunks in self.streams.values():
+            chunks[:] = [c for c in chunks if c[0] >= self.start_block]
+    def check_end_of_data(self):
+        return not any([chunks or any(queues)
+                        for queues, chunks in self.streams.values()])
+    def add_handler(self, name, subscription_id):
+        q = []
+        stream = self.streams.get(subscription_id)
+        if stream is None:
+            chunks = self.log_reader.get_chunks(subscription_id,
+                                                self.start_block)
+            stream = self.streams[subscription_id] = ([], chunks)
+        stream[0].append(q)
+        self.names[name] = (q, stream)
+    def pull_msg(self, req_time, name):
+        q, (queues, chunks) = self.names[name]
+        while 1:
+            if q:
+                return q.pop(0)
+            if not chunks or chunks[0][1] > req_time + 1.:
+                return None
+            for json_msg in self.log_reader.read_chunk(chunks.pop(0)):
+                for mq in queues:
+                    mq.append(json_msg['params'])
+
 
 ######################################################################
 # Dataset and log tracking
@@ -631,8 +719,13 @@ def list_datasets():
 class LogManager:
     error = error
     def __init__(self, log_prefix):
-        self.index_reader = JsonLogReader(log_prefix + ".index.gz")
-        self.jdispatch = JsonDispatcher(log_prefix)
+        if os.path.exists(log_prefix + ".chunks"):
+            log_reader = ChunkedLogReader(log_prefix + ".chunks")
+            self.index_reader = ChunkedIndexReader(log_reader)
+            self.jdispatch = ChunkedDispatcher(log_reader)
+        else:
+            self.index_reader = JsonLogReader(log_prefix + ".index.gz")
+            self.jdispatch = JsonDispatcher(log_prefix)
         self.initial_start_time = self.start_time = 0.
         self.datasets = {}
         self.initial_status = {}
@@ -656,7 +749,7 @@ class LogManager:
         self.start_time = req_start_time = self.initial_start_time + req_time
         start_status = self.start_status
         seek_time = max(self.initial_start_time, req_start_time - 1.)
-        file_position = 0
+        seek_msg = None
         while 1:
             fmsg = self.index_reader.pull_msg()
             if fmsg is None:
@@ -667,9 +760,9 @@ class LogManager:
                 break
             for k, v in fmsg["status"].items():
                 start_status.setdefault(k, {}).update(v)
-            file_position = fmsg['file_position']
-        if file_position:
-            self.jdispatch.log_reader.seek(file_position)
+            seek_msg = fmsg
+        if seek_msg is not None:
+            self.jdispatch.seek_index(seek_msg)
     def get_initial_start_time(self):
         return self.initial_start_time
     def get_start_time(self):
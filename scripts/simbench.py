@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# Replay recorded host commands in the host simulator and report timing
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, subprocess
+KLIPPER_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.append(os.path.join(KLIPPER_DIR, "klippy"))
+import msgproto
+
+START_LEAD = 0.100
+
+def read_file(filename):
+    f = open(filename, 'rb')
+    data = bytearray(f.read())
+    f.close()
+    return data
+
+# Extract the individual messages from a message block
+def parse_block(mp, block):
+    pos = msgproto.MESSAGE_HEADER_SIZE
+    while pos < len(block) - msgproto.MESSAGE_TRAILER_SIZE:
+        msgid, param_pos = mp.msgid_parser.parse(block, pos)
+        mid = mp.messages_by_id.get(msgid, mp.unknown)
+        params, pos = mid.parse(block, pos)
+        params['#name'] = mid.name
+        yield params
+
+# Extract the message blocks from a serial data stream
+def parse_stream(mp, data):
+    while data:
+        l = mp.check_packet(data)
+        if l == 0:
+            break
+        if l < 0:
+            data = data[-l:]
+            continue
+        for params in parse_block(mp, data[:l]):
+            yield params
+        data = data[l:]
+
+# Find a start time for the simulated clock just before the first
+# scheduled command
+def find_start_clock(mp, data, freq):
+    for params in parse_stream(mp, data):
+        if 'clock' in params:
+            return (params['clock'] - int(START_LEAD * freq)) & 0xffffffff
+    return 0
+
+# Map code addresses to the function names in the elf file
+def load_symbols(elf_filename):
+    syms = {}
+    try:
+        out = subprocess.check_output(['nm', elf_filename])
+    except (OSError, subprocess.CalledProcessError):
+        return syms
+    for line in out.decode().splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in 'tT':
+            syms[int(parts[0], 16) & 0xffffffff] = parts[2]
+    return syms
+
+def main():
+    usage = "%prog [options] <klipper.elf> <klipper.dict> <debugoutput>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-m", "--scale", type="float", dest="scale", default=1.,
+                    help="how many times slower the simulated mcu is")
+    opts.add_option("-l", "--max-latency", type="float", dest="max_latency",
+                    help="fail if any timer is later than this (in us)")
+    options, args = opts.parse_args()
+    if len(args) != 3:
+        opts.error("Incorrect number of arguments")
+    elf_filename, dict_filename, data_filename = args
+
+    mp = msgproto.MessageParser()
+    mp.process_identify(read_file(dict_filename), decompress=False)
+    if 'get_profile' not in mp.messages_by_name:
+        opts.error("Simulator must be built with"
+                   " \"Profile timer and task execution\" enabled")
+    freq = mp.get_constant_float('CLOCK_FREQ')
+    start_clock = find_start_clock(mp, read_file(data_filename), freq)
+
+    # Run the simulator
+    cmd = [elf_filename, "-i", data_filename, "-c", str(start_clock),
+           "-m", str(options.scale)]
+    output = bytearray(subprocess.check_output(cmd))
+
+    # Collect the reports
+    timers = []
+    tasks = []
+    latency = None
+    loop_count = loop_sum = 0
+    shutdown_msg = None
+    for params in parse_stream(mp, output):
+        name = params['#name']
+        if name == 'profile_timer':
+            timers.append(params)
+        elif name == 'profile_task':
+            tasks.append(params)
+        elif name == 'profile_latency':
+            latency = params['max']
+        elif name == 'stats':
+            loop_count += params['count']
+            loop_sum += params['sum']
+        elif name in ('shutdown', 'is_shutdown') and shutdown_msg is None:
+            shutdown_msg = params['static_string_id']
+    if latency is None:
+        sys.stderr.write("Simulator did not report a profile\n")
+        sys.exit(1)
+
+    # Report results
+    us = 1000000. / freq
+    syms = load_symbols(elf_filename)
+    print("%-32s %10s %10s %10s %10s" % (
+        "timer", "count", "avg_us", "max_us", "late_us"))
+    step_jitter = 0
+    for params in timers:
+        func = params['func']
+        fname = syms.get(func, "0x%08x" % (func,))
+        if 'step' in fname:
+            step_jitter = max(step_jitter, params['latency'])
+        print("%-32s %10d %10.3f %10.3f %10.3f" % (
+            fname, params['count'], params['sum'] * us / params['count'],
+            params['max'] * us, params['latency'] * us))
+    task_max = max([params['max'] for params in tasks] + [0])
+    print("max_timer_latency_us=%.3f" % (latency * us,))
+    print("step_jitter_us=%.3f" % (step_jitter * us,))
+    if loop_count:
+        print("task_loop_avg_us=%.3f" % (loop_sum * us / loop_count,))
+    print("task_max_us=%.3f" % (task_max * us,))
+    if shutdown_msg is not None:
+        print("shutdown=%s" % (shutdown_msg,))
+        sys.exit(1)
+    if options.max_latency is not None and latency * us > options.max_latency:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
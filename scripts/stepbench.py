@@ -0,0 +1,451 @@
+#!/usr/bin/env python3
+# Benchmark host step generation by driving the chelper code directly
+#
+# Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math, time, json, resource, importlib
+KLIPPER_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.append(os.path.join(KLIPPER_DIR, "klippy"))
+import chelper
+shaper_defs = importlib.import_module('.shaper_defs', 'extras')
+
+MCU_FREQ = 72000000.
+MAX_STEP_ERROR = 0.000025
+STEP_DIST = 0.0125
+EXTRUDER_STEP_DIST = 0.0025
+MOVE_BATCH_TIME = 0.100
+STEPCOMPRESS_FLUSH_TIME = 0.050
+QUEUE_AHEAD_TIME = 0.500
+SDS_CHECK_TIME = 0.001
+MOVE_HISTORY_EXPIRE = 1.
+NEVER_TIME = 9999999999999999.
+
+
+######################################################################
+# Move stream generation
+######################################################################
+
+# Build a stream of trapq_append() parameters for a toolhead path
+# (along with the matching extruder moves)
+class MoveStream:
+    def __init__(self, speed, accel, scv=5.):
+        self.speed = speed
+        self.accel = accel
+        self.junction_deviation = scv**2 * (math.sqrt(2.) - 1.) / accel
+        self.print_time = 0.100
+        self.moves = []
+        self.extruder_moves = []
+        self.epos = 0.
+        self.last_pos = None
+    def _junction_v2(self, prev, seg):
+        p_d, p_r = prev
+        d, r = seg
+        cos_theta = -sum([a * b for a, b in zip(p_r, r)])
+        if cos_theta > 0.999999:
+            return 0.
+        cos_theta = max(cos_theta, -0.999999)
+        sin_theta_d2 = math.sqrt(0.5 * (1. - cos_theta))
+        r_jd = sin_theta_d2 / (1. - sin_theta_d2)
+        tan_theta_d2 = sin_theta_d2 / math.sqrt(0.5 * (1. + cos_theta))
+        centripetal_v2 = .5 * min(d, p_d) * tan_theta_d2 * self.accel
+        return min(r_jd * self.junction_deviation * self.accel,
+                   centripetal_v2, self.speed**2)
+    def add_path(self, points, extrude_ratio=0.):
+        last_pos, self.last_pos = self.last_pos, None
+        if last_pos is not None:
+            # Travel from the end of the previous path
+            self.add_path([last_pos, points[0]])
+        self.last_pos = points[-1]
+        segs = []
+        starts = []
+        for p1, p2 in zip(points[:-1], points[1:]):
+            axes_d = [b - a for a, b in zip(p1, p2)]
+            d = math.sqrt(sum([a * a for a in axes_d]))
+            if d < .000000001:
+                continue
+            segs.append((d, [a / d for a in axes_d]))
+            starts.append(p1)
+        if not segs:
+            return
+        # Simple lookahead - limit junction speeds by acceleration
+        v2 = [0.] + [self._junction_v2(p, s) for p, s in zip(segs[:-1],
+                                                             segs[1:])] + [0.]
+        accel = self.accel
+        for i in range(len(segs) - 1, -1, -1):
+            v2[i] = min(v2[i], v2[i+1] + 2. * accel * segs[i][0])
+        for i in range(len(segs)):
+            v2[i+1] = min(v2[i+1], v2[i] + 2. * accel * segs[i][0])
+        for i, (d, axes_r) in enumerate(segs):
+            start_v2, end_v2 = v2[i], v2[i+1]
+            cruise_v2 = min(self.speed**2, (start_v2 + end_v2) * .5
+                            + accel * d)
+            start_v, cruise_v = math.sqrt(start_v2), math.sqrt(cruise_v2)
+            end_v = math.sqrt(end_v2)
+            accel_d = (cruise_v2 - start_v2) / (2. * accel)
+            decel_d = (cruise_v2 - end_v2) / (2. * accel)
+            cruise_d = max(0., d - accel_d - decel_d)
+            accel_t = accel_d / ((start_v + cruise_v) * .5)
+            decel_t = decel_d / ((end_v + cruise_v) * .5)
+            cruise_t = cruise_d / cruise_v
+            x, y, z = starts[i]
+            self.moves.append((self.print_time, accel_t, cruise_t, decel_t,
+                               x, y, z, axes_r[0], axes_r[1], axes_r[2],
+                               start_v, cruise_v, accel))
+            if extrude_ratio:
+                r = extrude_ratio
+                self.extruder_moves.append((
+                    self.print_time, accel_t, cruise_t, decel_t,
+                    self.epos, 0., 0., 1., 0., 0.,
+                    start_v * r, cruise_v * r, accel * r))
+                self.epos += d * r
+            self.print_time += accel_t + cruise_t + decel_t
+    def add_trapq_dump(self, data):
+        # Add the moves of a motion_report/dump_trapq message
+        for print_time, move_t, start_v, accel, start_pos, axes_r in data:
+            x, y, z = start_pos
+            xr, yr, zr = axes_r
+            accel_t = cruise_t = decel_t = 0.
+            cruise_v = start_v
+            if accel > 0.:
+                accel_t = move_t
+                cruise_v = start_v + accel * move_t
+            elif accel < 0.:
+                decel_t = move_t
+                accel = -accel
+            else:
+                cruise_t = move_t
+            self.moves.append((print_time, accel_t, cruise_t, decel_t,
+                               x, y, z, xr, yr, zr, start_v, cruise_v, accel))
+            self.print_time = print_time + move_t
+
+def arc_points(cx, cy, z, radius, turns, segment_len):
+    count = int(2. * math.pi * radius * turns / segment_len)
+    return [(cx + radius * math.cos(2. * math.pi * turns * i / count),
+             cy + radius * math.sin(2. * math.pi * turns * i / count), z)
+            for i in range(count + 1)]
+
+def zigzag_points(size, spacing, z):
+    points = []
+    for i in range(int(size / spacing)):
+        y = i * spacing
+        if i & 1:
+            points.extend([(size, y, z), (0., y, z)])
+        else:
+            points.extend([(0., y, z), (size, y, z)])
+    return points
+
+def load_motan_trace(log_prefix, trapq_name="toolhead"):
+    sys.path.append(os.path.join(KLIPPER_DIR, "scripts", "motan"))
+    import readlog
+    lmanager = readlog.LogManager(log_prefix)
+    lmanager.setup_index()
+    jdispatch = lmanager.get_jdispatch()
+    jdispatch.add_handler("bench", "trapq:" + trapq_name)
+    data = []
+    while 1:
+        msg = jdispatch.pull_msg(NEVER_TIME, "bench")
+        if msg is None:
+            break
+        data.extend(msg.get('data', []))
+    return data
+
+
+######################################################################
+# Benchmark scenarios
+######################################################################
+
+DELTA_ARM = 250.
+DELTA_RADIUS = 140.
+
+def setup_cartesian(ffi_main, ffi_lib):
+    return [(ffi_lib.cartesian_stepper_alloc(a), STEP_DIST)
+            for a in [b'x', b'y', b'z']]
+
+def setup_corexy(ffi_main, ffi_lib):
+    return [(ffi_lib.corexy_stepper_alloc(b'+'), STEP_DIST),
+            (ffi_lib.corexy_stepper_alloc(b'-'), STEP_DIST),
+            (ffi_lib.cartesian_stepper_alloc(b'z'), STEP_DIST)]
+
+def setup_delta(ffi_main, ffi_lib):
+    res = []
+    for angle in [210., 330., 90.]:
+        a = math.radians(angle)
+        sk = ffi_lib.delta_stepper_alloc(DELTA_ARM**2,
+                                         math.cos(a) * DELTA_RADIUS,
+                                         math.sin(a) * DELTA_RADIUS)
+        res.append((sk, STEP_DIST))
+    return res
+
+def setup_shaper(ffi_main, ffi_lib):
+    res = []
+    for axis, freq in [(b'x', 40.), (b'y', 50.)]:
+        orig_sk = ffi_lib.cartesian_stepper_alloc(axis)
+        is_sk = ffi_lib.input_shaper_alloc()
+        res.append((is_sk, STEP_DIST, orig_sk, axis, freq))
+    return res
+
+def setup_extruder(ffi_main, ffi_lib):
+    return [(ffi_lib.extruder_stepper_alloc(), EXTRUDER_STEP_DIST)]
+
+def build_arcs():
+    ms = MoveStream(200., 5000.)
+    for i in range(10):
+        ms.add_path(arc_points(100., 100., 0.2 * i, 10. + i, 2., 0.1))
+    return ms
+
+def build_zigzag():
+    ms = MoveStream(300., 10000.)
+    for i in range(4):
+        ms.add_path(zigzag_points(100., 0.4, 0.2 * i), extrude_ratio=0.035)
+    return ms
+
+def build_delta_arcs():
+    ms = MoveStream(200., 5000.)
+    for i in range(10):
+        ms.add_path(arc_points(0., 0., 5. + 0.2 * i, 40. + 2. * i, 2., 0.1))
+    return ms
+
+# name: (description, move stream builder, stepper setup, extruder)
+SCENARIOS = {
+    'arcs': ("Cartesian dense arcs", build_arcs, setup_cartesian, False),
+    'corexy': ("CoreXY infill", build_zigzag, setup_corexy, False),
+    'delta': ("Delta dense arcs", build_delta_arcs, setup_delta, False),
+    'input_shaper': ("Cartesian infill with mzv input shaping",
+                     build_zigzag, setup_shaper, False),
+    'pressure_advance': ("Extruder with pressure advance",
+                         build_zigzag, setup_extruder, True),
+}
+SCENARIO_ORDER = ['arcs', 'corexy', 'delta', 'input_shaper',
+                  'pressure_advance']
+
+def get_rss_kb():
+    try:
+        f = open("/proc/self/statm", "r")
+        pages = int(f.read().split()[1])
+        f.close()
+        return pages * resource.getpagesize() // 1024
+    except (IOError, OSError, ValueError):
+        return 0
+
+def run_scenario(ms, setup_func, use_extruder):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    moves = ms.extruder_moves if use_extruder else ms.moves
+    start_rss = get_rss_kb()
+    # Setup serialqueue (writing to /dev/null) and steppersync
+    devnull = open(os.devnull, "wb")
+    sq = ffi_lib.serialqueue_alloc(devnull.fileno(), b'f', 0, 0, 0)
+    ffi_lib.serialqueue_set_clock_est(sq, 1000000000000.,
+                                      ffi_lib.get_monotonic(), 0, 0)
+    tq = ffi_lib.trapq_alloc()
+    steppers = []
+    sc_list = []
+    kin_flush_delay = SDS_CHECK_TIME
+    start = moves[0][4:7] if moves else (0., 0., 0.)
+    for oid, info in enumerate(setup_func(ffi_main, ffi_lib)):
+        sk, step_dist = info[:2]
+        sc = ffi_lib.stepcompress_alloc(oid)
+        ffi_lib.stepcompress_fill(sc, int(MAX_STEP_ERROR * MCU_FREQ), 1, 2)
+        ffi_lib.itersolve_set_stepcompress(sk, sc, step_dist)
+        ffi_lib.itersolve_set_trapq(sk, tq)
+        if len(info) > 2:
+            orig_sk, axis, freq = info[2:]
+            ffi_lib.input_shaper_set_sk(sk, orig_sk)
+            A, T = shaper_defs.get_mzv_shaper(freq, 0.1)
+            ffi_lib.input_shaper_set_shaper_params(sk, axis, len(A), A, T)
+            window = ffi_lib.input_shaper_get_step_generation_window(sk)
+            kin_flush_delay = max(kin_flush_delay, window)
+        if use_extruder:
+            smooth_time = 0.040
+            ffi_lib.extruder_set_pressure_advance(sk, 0., 0.050, smooth_time)
+            kin_flush_delay = max(kin_flush_delay, smooth_time * .5)
+        ffi_lib.itersolve_set_position(sk, start[0], start[1], start[2])
+        steppers.append(sk)
+        sc_list.append(sc)
+    ss = ffi_lib.steppersync_alloc(sq, sc_list, len(sc_list), 1024)
+    ffi_lib.steppersync_set_time(ss, 0., MCU_FREQ)
+    pull = ffi_main.new('struct pull_history_steps[]', 256)
+    last_first_clock = [-1] * len(sc_list)
+    # Main step generation loop (only this part is timed)
+    elapsed = 0.
+    total_steps = 0
+    move_pos = 0
+    end_time = ms.print_time + kin_flush_delay + STEPCOMPRESS_FLUSH_TIME
+    flush_time = 0.
+    while flush_time < end_time:
+        start_time = time.perf_counter()
+        flush_time += MOVE_BATCH_TIME
+        queue_time = flush_time + kin_flush_delay + QUEUE_AHEAD_TIME
+        while move_pos < len(moves) and moves[move_pos][0] < queue_time:
+            ffi_lib.trapq_append(tq, *moves[move_pos])
+            move_pos += 1
+        if move_pos >= len(moves):
+            queue_time = NEVER_TIME
+        sg_flush_time = max(flush_time, min(
+            flush_time + STEPCOMPRESS_FLUSH_TIME, queue_time - kin_flush_delay))
+        for sk in steppers:
+            if ffi_lib.itersolve_generate_steps(sk, sg_flush_time):
+                raise Exception("Internal error in stepcompress")
+        clear_history_time = flush_time - MOVE_HISTORY_EXPIRE
+        ffi_lib.trapq_finalize_moves(tq, sg_flush_time - kin_flush_delay,
+                                     clear_history_time)
+        ret = ffi_lib.steppersync_flush(
+            ss, int(flush_time * MCU_FREQ),
+            max(0, int(clear_history_time * MCU_FREQ)))
+        if ret:
+            raise Exception("Internal error in steppersync")
+        elapsed += time.perf_counter() - start_time
+        # Count the generated steps (not timed)
+        for i, sc in enumerate(sc_list):
+            last_clock = newest_clock = last_first_clock[i]
+            end_clock = 1<<63
+            while 1:
+                count = ffi_lib.stepcompress_extract_old(
+                    sc, pull, len(pull), max(0, last_clock), end_clock)
+                for j in range(count):
+                    first_clock = pull[j].first_clock
+                    if first_clock > last_clock:
+                        total_steps += abs(pull[j].step_count)
+                        newest_clock = max(newest_clock, first_clock)
+                if count < len(pull):
+                    break
+                end_clock = pull[count-1].first_clock
+            last_first_clock[i] = newest_clock
+    # Gather the message stats
+    stats = ffi_main.new('struct stepcompress_stats *')
+    msg_count = msg_bytes = 0
+    for sc in sc_list:
+        ffi_lib.stepcompress_get_stats(sc, stats)
+        msg_count += stats.msg_count
+        msg_bytes += stats.msg_bytes
+    peak_kb = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss - start_rss
+    ffi_lib.serialqueue_exit(sq)
+    devnull.close()
+    return {'elapsed': elapsed, 'steps': total_steps,
+            'print_time': ms.print_time, 'queue_step': msg_count,
+            'bytes': msg_bytes, 'peak_kb': max(0, peak_kb),
+            'steps_per_sec': total_steps / elapsed,
+            'msgs_per_sec': msg_count / elapsed,
+            'bytes_per_sec': msg_bytes / elapsed}
+
+# Run a scenario in a child process so that its peak memory usage
+# can be measured independently of the other scenarios
+def run_isolated(ms, setup_func, use_extruder):
+    rfd, wfd = os.pipe()
+    pid = os.fork()
+    if not pid:
+        os.close(rfd)
+        try:
+            res = run_scenario(ms, setup_func, use_extruder)
+        except Exception as e:
+            res = {'error': str(e)}
+        os.write(wfd, json.dumps(res).encode())
+        os._exit(0)
+    os.close(wfd)
+    data = b""
+    while 1:
+        d = os.read(rfd, 4096)
+        if not d:
+            break
+        data += d
+    os.close(rfd)
+    os.waitpid(pid, 0)
+    if not data:
+        return {'error': "benchmark process failed"}
+    return json.loads(data.decode())
+
+
+######################################################################
+# Reporting
+######################################################################
+
+# Print the results of a scenario - returns the relative change in
+# steps/sec compared to the baseline (or None if not available)
+def report(name, res, baseline):
+    if 'error' in res:
+        print("%-18s ERROR: %s" % (name, res['error']))
+        return None
+    line = "%-18s %10d %12.0f %10.0f %12.0f %8d" % (
+        name, res['steps'], res['steps_per_sec'], res['msgs_per_sec'],
+        res['bytes_per_sec'], res['peak_kb'])
+    base = baseline.get(name)
+    change = None
+    if base is not None:
+        change = res['steps_per_sec'] / base['steps_per_sec'] - 1.
+        line += " %+7.1f%%" % (change * 100.,)
+        if res['queue_step'] != base['queue_step']:
+            line += " (queue_step %d vs %d)" % (res['queue_step'],
+                                                base['queue_step'])
+    print(line)
+    return change
+
+def main():
+    usage = "%prog [options] [scenario ...]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-r", "--repeat", type="int", dest="repeat", default=3,
+                    help="number of runs of each scenario (best is reported)")
+    opts.add_option("-b", "--baseline", type="string", dest="baseline",
+                    help="compare results against the given baseline file")
+    opts.add_option("-s", "--save", type="string", dest="save",
+                    help="write results to the given baseline file")
+    opts.add_option("-t", "--tolerance", type="float", dest="tolerance",
+                    default=10.,
+                    help="fail if steps/sec is this percent below baseline")
+    opts.add_option("-m", "--motan", type="string", dest="motan",
+                    help="also replay the toolhead trapq of a motan log"
+                    " (data_logger.py log prefix)")
+    opts.add_option("-l", "--list", action="store_true", dest="list",
+                    help="list the available scenarios")
+    options, args = opts.parse_args()
+    if options.list:
+        for name in SCENARIO_ORDER:
+            print("%-18s %s" % (name, SCENARIOS[name][0]))
+        return
+    names = args or list(SCENARIO_ORDER)
+    for name in names:
+        if name not in SCENARIOS:
+            opts.error("Unknown scenario '%s'" % (name,))
+    baseline = {}
+    if options.baseline is not None:
+        f = open(options.baseline, "r")
+        baseline = json.load(f)
+        f.close()
+    # Build the move streams (before starting any measurements)
+    chelper.get_ffi()
+    runs = [(name, SCENARIOS[name][1](), SCENARIOS[name][2],
+             SCENARIOS[name][3]) for name in names]
+    if options.motan is not None:
+        ms = MoveStream(1., 1.)
+        ms.add_trapq_dump(load_motan_trace(options.motan))
+        if not ms.moves:
+            opts.error("No toolhead trapq data found in motan log")
+        runs.append(("motan_cartesian", ms, setup_cartesian, False))
+        runs.append(("motan_corexy", ms, setup_corexy, False))
+    # Run benchmarks
+    print("%-18s %10s %12s %10s %12s %8s" % (
+        "scenario", "steps", "steps/sec", "msgs/sec", "bytes/sec", "peak_kb"))
+    results = {}
+    failed = False
+    for name, ms, setup_func, use_extruder in runs:
+        best = None
+        for i in range(max(1, options.repeat)):
+            res = run_isolated(ms, setup_func, use_extruder)
+            if 'error' in res:
+                best = res
+                break
+            if best is None or res['elapsed'] < best['elapsed']:
+                best = res
+        results[name] = best
+        change = report(name, best, baseline)
+        if 'error' in best or (change is not None
+                               and change * 100. < -options.tolerance):
+            failed = True
+    if options.save is not None:
+        f = open(options.save, "w")
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.close()
+    if failed:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -28,8 +28,11 @@ def main():
             so = steppers[args['oid']]
             so[0] += 1
             so[1] = args['dir']
-        elif parts[0] == 'queue_step':
+        elif parts[0] in ('queue_step', 'queue_step2', 'queue_step_dir'):
             so = steppers[args['oid']]
+            if 'dir' in args:
+                so[0] += 1
+                so[1] = args['dir']
             so[2] += 1
             so[{'0': 3, '1': 4}[so[1]]] += int(args['count'])
     for oid, so in sorted([(int(i[0]), i[1]) for i in steppers.items()]):
@@ -0,0 +1,67 @@
+// Report the measurements of several analog_in channels in one message
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "adc_group.h" // analog_in_group_report
+#include "basecmd.h" // oid_alloc
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // shutdown
+
+#define MAX_CHANNELS 16
+
+struct analog_in_group {
+    uint32_t next_clock;
+    uint16_t pending, full_mask;
+    uint8_t oid, count;
+    uint8_t values[MAX_CHANNELS * 2];
+};
+
+void
+command_config_analog_in_group(uint32_t *args)
+{
+    uint8_t count = args[1];
+    if (!count || count > MAX_CHANNELS)
+        shutdown("Invalid analog_in_group channel count");
+    struct analog_in_group *g = oid_alloc(
+        args[0], command_config_analog_in_group, sizeof(*g));
+    g->oid = args[0];
+    g->count = count;
+}
+DECL_COMMAND(command_config_analog_in_group,
+             "config_analog_in_group oid=%c count=%c");
+
+void
+command_analog_in_group_add(uint32_t *args)
+{
+    struct analog_in_group *g = oid_lookup(
+        args[0], command_config_analog_in_group);
+    uint8_t pos = args[1];
+    if (pos >= g->count)
+        shutdown("Set analog_in_group channel past maximum count");
+    analog_in_attach_group(args[2], g, pos);
+    g->full_mask |= 1 << pos;
+}
+DECL_COMMAND(command_analog_in_group_add,
+             "analog_in_group_add oid=%c pos=%c analog_in_oid=%c");
+
+// Note a completed channel measurement (called from analog_in_task)
+void
+analog_in_group_report(struct analog_in_group *g, uint8_t pos
+                       , uint32_t next_clock, uint16_t value)
+{
+    if (next_clock != g->next_clock) {
+        // Start of a new measurement cycle
+        g->next_clock = next_clock;
+        g->pending = 0;
+    }
+    g->values[pos * 2] = value;
+    g->values[pos * 2 + 1] = value >> 8;
+    g->pending |= 1 << pos;
+    if (g->pending != g->full_mask)
+        return;
+    g->pending = 0;
+    sendf("analog_in_group_state oid=%c next_clock=%u values=%*s"
+          , g->oid, next_clock, g->count * 2, g->values);
+}
@@ -0,0 +1,15 @@
+#ifndef __ADC_GROUP_H
+#define __ADC_GROUP_H
+
+#include <stdint.h> // uint32_t
+
+// adc_group.c
+struct analog_in_group;
+void analog_in_group_report(struct analog_in_group *g, uint8_t pos
+                            , uint32_t next_clock, uint16_t value);
+
+// adccmds.c
+void analog_in_attach_group(uint8_t oid, struct analog_in_group *g
+                            , uint8_t pos);
+
+#endif // adc_group.h
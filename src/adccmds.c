@@ -1,13 +1,16 @@
 // Commands for controlling GPIO analog-to-digital input pins
 //
-// Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "adc_group.h" // analog_in_group_report
+#include "autoconf.h" // CONFIG_ADC_CONTINUOUS
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_adc
 #include "board/irq.h" // irq_disable
 #include "command.h" // DECL_COMMAND
+#include "pid_heater.h" // pid_heater_report
 #include "sched.h" // DECL_TASK
 
 struct analog_in {
@@ -17,14 +20,43 @@ struct analog_in {
     struct gpio_adc pin;
     uint8_t invalid_count, range_check_count;
     uint8_t state, sample_count;
+    struct pid_heater *heater;
+    struct analog_in_group *group;
+    uint8_t group_pos;
 };
 
-static struct task_wake analog_wake;
+DECL_TASK_WAKE(analog_wake);
+
+// Check the range of a completed measurement and schedule its report
+static uint_fast8_t
+analog_in_report(struct analog_in *a)
+{
+    if (likely(a->value >= a->min_value && a->value <= a->max_value)) {
+        a->invalid_count = 0;
+    } else {
+        a->invalid_count++;
+        if (a->invalid_count >= a->range_check_count) {
+            try_shutdown("ADC out of range");
+            a->invalid_count = 0;
+        }
+    }
+    sched_wake_task(&analog_wake);
+    a->next_begin_time += a->rest_time;
+    a->timer.waketime = a->next_begin_time;
+    return SF_RESCHEDULE;
+}
 
 static uint_fast8_t
 analog_in_event(struct timer *timer)
 {
     struct analog_in *a = container_of(timer, struct analog_in, timer);
+    if (CONFIG_ADC_CONTINUOUS) {
+        // The board continuously samples the pin - scale its latest
+        // average to the sum of sample_count samples the host expects
+        a->value = gpio_adc_read(a->pin) * a->sample_count;
+        a->state = a->sample_count;
+        return analog_in_report(a);
+    }
     uint32_t sample_delay = gpio_adc_sample(a->pin);
     if (sample_delay) {
         a->timer.waketime += sample_delay;
@@ -43,19 +75,7 @@ analog_in_event(struct timer *timer)
         a->timer.waketime += a->sample_time;
         return SF_RESCHEDULE;
     }
-    if (likely(a->value >= a->min_value && a->value <= a->max_value)) {
-        a->invalid_count = 0;
-    } else {
-        a->invalid_count++;
-        if (a->invalid_count >= a->range_check_count) {
-            try_shutdown("ADC out of range");
-            a->invalid_count = 0;
-        }
-    }
-    sched_wake_task(&analog_wake);
-    a->next_begin_time += a->rest_time;
-    a->timer.waketime = a->next_begin_time;
-    return SF_RESCHEDULE;
+    return analog_in_report(a);
 }
 
 void
@@ -93,6 +113,23 @@ DECL_COMMAND(command_query_analog_in,
              "query_analog_in oid=%c clock=%u sample_ticks=%u sample_count=%c"
              " rest_ticks=%u min_value=%hu max_value=%hu range_check_count=%c");
 
+// Forward completed measurements to an mcu based heater controller
+void
+analog_in_attach_pid_heater(uint8_t oid, struct pid_heater *ph)
+{
+    struct analog_in *a = oid_lookup(oid, command_config_analog_in);
+    a->heater = ph;
+}
+
+// Report completed measurements as part of an analog_in_group
+void
+analog_in_attach_group(uint8_t oid, struct analog_in_group *g, uint8_t pos)
+{
+    struct analog_in *a = oid_lookup(oid, command_config_analog_in);
+    a->group = g;
+    a->group_pos = pos;
+}
+
 void
 analog_in_task(void)
 {
@@ -112,11 +149,20 @@ analog_in_task(void)
         uint32_t next_begin_time = a->next_begin_time;
         a->state++;
         irq_enable();
+        if (CONFIG_WANT_PID_HEATER && a->heater
+            && !pid_heater_report(a->heater, value))
+            // Heater is decimating the reports sent to the host
+            continue;
+        if (CONFIG_WANT_ADC_GROUP && a->group) {
+            analog_in_group_report(a->group, a->group_pos
+                                   , next_begin_time, value);
+            continue;
+        }
         sendf("analog_in_state oid=%c next_clock=%u value=%hu"
               , oid, next_begin_time, value);
     }
 }
-DECL_TASK(analog_in_task);
+DECL_WAKE_TASK(analog_in_task, analog_wake);
 
 void
 analog_in_shutdown(void)
@@ -22,7 +22,7 @@ DECL_CONSTANT_STR("MCU", "ar100");
 
 #define RESET_VECTOR 0x0100
 
-static struct task_wake console_wake;
+DECL_TASK_WAKE(console_wake);
 static uint8_t receive_buf[192];
 static int receive_pos;
 static char dynmem_pool[8 * 1024];
@@ -108,7 +108,7 @@ console_task(void)
     }
     receive_pos = len;
 }
-DECL_TASK(console_task);
+DECL_WAKE_TASK(console_task, console_wake);
 
 // Encode and transmit a "response" message
 void
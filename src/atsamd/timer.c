@@ -76,7 +76,7 @@ timer_init(void)
     irqstatus_t flag = irq_save();
     tc->CTRLA.reg = 0;
     tc->CTRLA.reg = TC_CTRLA_MODE_COUNT32;
-    armcm_enable_irq(TCp_Handler, TCp_IRQn, 2);
+    armcm_enable_irq(TCp_Handler, TCp_IRQn, TIMER_PRIO);
     tc->INTENSET.reg = TC_INTENSET_MC0;
     tc->COUNT.reg = 0;
     timer_kick();
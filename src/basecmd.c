@@ -6,6 +6,7 @@
 
 #include <string.h> // memset
 #include "basecmd.h" // oid_lookup
+#include "board/io.h" // readw
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
 #include "board/pgm.h" // READP
@@ -60,8 +61,9 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
 
 static struct move_node *move_free_list;
 static void *move_list;
-static uint16_t move_count;
+static uint16_t move_count, move_free_count, move_min_free;
 static uint8_t move_item_size;
+static struct move_queue_head *move_queue_list;
 
 // Is the config and move queue finalized?
 static int
@@ -78,6 +80,7 @@ move_free(void *m)
     struct move_node *mf = m;
     mf->next = move_free_list;
     move_free_list = mf;
+    move_free_count++;
 }
 
 // Allocate runtime storage
@@ -89,10 +92,20 @@ move_alloc(void)
     if (!mf)
         shutdown("Move queue overflow");
     move_free_list = mf->next;
+    if (--move_free_count < move_min_free)
+        move_min_free = move_free_count;
     irq_restore(flag);
     return mf;
 }
 
+// Return the number of free move queue slots (and the total slots)
+uint16_t
+move_free_slots(uint16_t *pcount)
+{
+    *pcount = move_count;
+    return readw(&move_free_count);
+}
+
 // Check if a move_queue is empty
 int
 move_queue_empty(struct move_queue_head *mh)
@@ -112,6 +125,10 @@ int
 move_queue_push(struct move_node *m, struct move_queue_head *mh)
 {
     m->next = NULL;
+#if CONFIG_MOVE_QUEUE_STATS
+    if (++mh->count > mh->max_count)
+        mh->max_count = mh->count;
+#endif
     if (mh->first) {
         mh->last->next = m;
         mh->last = m;
@@ -127,6 +144,9 @@ move_queue_pop(struct move_queue_head *mh)
 {
     struct move_node *mn = mh->first;
     mh->first = mn->next;
+#if CONFIG_MOVE_QUEUE_STATS
+    mh->count--;
+#endif
     return mn;
 }
 
@@ -135,20 +155,70 @@ void
 move_queue_clear(struct move_queue_head *mh)
 {
     mh->first = NULL;
+#if CONFIG_MOVE_QUEUE_STATS
+    mh->count = 0;
+#endif
 }
 
-// Initialize a move_queue with nodes of the give size
+// Note the size of move_queue nodes
 void
-move_queue_setup(struct move_queue_head *mh, int size)
+move_request_size(int size)
 {
-    mh->first = mh->last = NULL;
-
     if (size > UINT8_MAX || is_finalized())
         shutdown("Invalid move request size");
     if (size > move_item_size)
         move_item_size = size;
 }
 
+// Initialize a move_queue (of object 'oid') with nodes of the give size
+void
+move_queue_setup(struct move_queue_head *mh, int size, uint8_t oid)
+{
+    mh->first = mh->last = NULL;
+    move_request_size(size);
+#if CONFIG_MOVE_QUEUE_STATS
+    mh->count = mh->max_count = 0;
+    mh->min_lead = INT32_MAX;
+    mh->oid = oid;
+    mh->next_queue = move_queue_list;
+    move_queue_list = mh;
+#endif
+}
+
+#if CONFIG_MOVE_QUEUE_STATS
+// Note the time until the first event of a move that was queued
+// while the queue was idle (a low value warns of a queue underrun).
+// Caller must disable irqs.
+void
+move_queue_note_lead(struct move_queue_head *mh, uint32_t waketime)
+{
+    int32_t lead = waketime - timer_read_time();
+    if (lead < mh->min_lead)
+        mh->min_lead = lead;
+}
+
+// Report the usage of each move_queue (and reset the high-water marks)
+void
+command_get_move_queue_stats(uint32_t *args)
+{
+    struct move_queue_head *mh;
+    for (mh = move_queue_list; mh; mh = mh->next_queue) {
+        irq_disable();
+        uint16_t count = mh->count, max_count = mh->max_count;
+        int32_t min_lead = mh->min_lead;
+        mh->max_count = count;
+        mh->min_lead = INT32_MAX;
+        irq_enable();
+        if (!max_count)
+            continue;
+        sendf("move_queue_stats oid=%c count=%hu max_count=%hu min_lead=%i"
+              , mh->oid, count, max_count, min_lead);
+    }
+}
+DECL_COMMAND_FLAGS(command_get_move_queue_stats, HF_IN_SHUTDOWN,
+                   "get_move_queue_stats");
+#endif
+
 void
 move_reset(void)
 {
@@ -163,6 +233,7 @@ move_reset(void)
     struct move_node *mf = move_list + (move_count - 1)*move_item_size;
     mf->next = NULL;
     move_free_list = move_list;
+    move_free_count = move_min_free = move_count;
 }
 DECL_SHUTDOWN(move_reset);
 
@@ -171,8 +242,7 @@ move_finalize(void)
 {
     if (is_finalized())
         shutdown("Already finalized");
-    struct move_queue_head dummy;
-    move_queue_setup(&dummy, sizeof(*move_free_list));
+    move_request_size(sizeof(*move_free_list));
     move_list = alloc_chunks(move_item_size, 1024, &move_count);
     move_reset();
 }
@@ -269,7 +339,8 @@ config_reset(uint32_t *args)
     oids = NULL;
     move_free_list = NULL;
     move_list = NULL;
-    move_count = move_item_size = 0;
+    move_queue_list = NULL;
+    move_count = move_free_count = move_min_free = move_item_size = 0;
     alloc_init();
     sched_timer_reset();
     sched_clear_shutdown();
@@ -324,7 +395,13 @@ stats_update(uint32_t start, uint32_t cur)
 
     if (timer_is_before(cur, stats_send_time + timer_from_us(5000000)))
         return;
-    sendf("stats count=%u sum=%u sumsq=%u", count, sum, sumsq);
+    // Report the minimum number of free move queue slots since last stats
+    irq_disable();
+    uint16_t min_free = move_min_free;
+    move_min_free = move_free_count;
+    irq_enable();
+    sendf("stats count=%u sum=%u sumsq=%u move_min_free=%hu"
+          , count, sum, sumsq, min_free);
     if (cur < stats_send_time)
         stats_send_time_high++;
     stats_send_time = cur;
@@ -356,12 +433,19 @@ command_identify(uint32_t *args)
     uint32_t offset = args[0];
     uint8_t count = args[1];
     uint32_t isize = READP(command_identify_size);
-    if (offset >= isize)
+    const uint8_t *data = command_identify_data;
+    if (offset == IDENTIFY_HASH_OFFSET) {
+        // Report a hash of the data dictionary
+        data = command_identify_hash;
+        count = IDENTIFY_HASH_SIZE;
+    } else if (offset >= isize) {
         count = 0;
-    else if (offset + count > isize)
-        count = isize - offset;
-    sendf("identify_response offset=%u data=%.*s"
-          , offset, count, &command_identify_data[offset]);
+    } else {
+        if (offset + count > isize)
+            count = isize - offset;
+        data = &command_identify_data[offset];
+    }
+    sendf("identify_response offset=%u data=%.*s", offset, count, data);
 }
 DECL_COMMAND_FLAGS(command_identify, HF_IN_SHUTDOWN,
                    "identify offset=%u count=%c");
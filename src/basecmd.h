@@ -3,23 +3,33 @@
 
 #include <stddef.h> // size_t
 #include <stdint.h> // uint8_t
+#include "autoconf.h" // CONFIG_MOVE_QUEUE_STATS
 
 struct move_node {
     struct move_node *next;
 };
 struct move_queue_head {
     struct move_node *first, *last;
+#if CONFIG_MOVE_QUEUE_STATS
+    struct move_queue_head *next_queue;
+    int32_t min_lead;
+    uint16_t count, max_count;
+    uint8_t oid;
+#endif
 };
 
 void *alloc_chunk(size_t size);
 void move_free(void *m);
 void *move_alloc(void);
+uint16_t move_free_slots(uint16_t *pcount);
 int move_queue_empty(struct move_queue_head *mh);
 struct move_node *move_queue_first(struct move_queue_head *mh);
 int move_queue_push(struct move_node *m, struct move_queue_head *mh);
 struct move_node *move_queue_pop(struct move_queue_head *mh);
 void move_queue_clear(struct move_queue_head *mh);
-void move_queue_setup(struct move_queue_head *mh, int size);
+void move_request_size(int size);
+void move_queue_setup(struct move_queue_head *mh, int size, uint8_t oid);
+void move_queue_note_lead(struct move_queue_head *mh, uint32_t waketime);
 void *oid_lookup(uint8_t oid, void *type);
 void *oid_alloc(uint8_t oid, void *type, uint16_t size);
 void *oid_next(uint8_t *i, void *type);
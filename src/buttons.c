@@ -1,28 +1,66 @@
 // Report on user interface buttons
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ENDSTOP_IRQ
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_in
 #include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
+#include "endstop.h" // endstop_hw_setup
 #include "sched.h" // struct timer
 
+struct button_irq {
+    struct endstop_irq irq;
+    struct buttons *b;
+    uint8_t bit;
+};
+
 struct buttons {
     struct timer time;
     uint32_t rest_ticks;
     uint8_t pressed, last_pressed;
     uint8_t report_count, reports[8];
     uint8_t ack_count, retransmit_state, retransmit_count;
-    uint8_t button_count;
+    uint8_t button_count, flags, irq_mask, debounce, debounce_new;
+    struct button_irq *irqs;
     struct gpio_in pins[0];
 };
 
 enum { BF_NO_RETRANSMIT = 0x80, BF_PENDING = 0xff, BF_ACKED = 0xfe };
 
-static struct task_wake buttons_wake;
+enum { BS_IRQ = 1<<0, BS_TIMER_ACTIVE = 1<<1 };
+
+DECL_TASK_WAKE(buttons_wake);
+
+// Note a new state of the buttons
+static void
+buttons_note_state(struct buttons *b, uint8_t status)
+{
+    b->pressed = status;
+    if (b->report_count < sizeof(b->reports)) {
+        b->reports[b->report_count++] = status;
+        sched_wake_task(&buttons_wake);
+        b->retransmit_state = BF_PENDING;
+    }
+}
+
+// Check if a retransmit is needed
+static void
+buttons_check_retransmit(struct buttons *b)
+{
+    uint8_t retransmit_state = b->retransmit_state;
+    if (!(retransmit_state & BF_NO_RETRANSMIT)) {
+        retransmit_state--;
+        if (retransmit_state & BF_NO_RETRANSMIT)
+            // timeout - do retransmit
+            sched_wake_task(&buttons_wake);
+        b->retransmit_state = retransmit_state;
+    }
+}
 
 static uint_fast8_t
 buttons_event(struct timer *t)
@@ -42,33 +80,116 @@ buttons_event(struct timer *t)
     if (diff) {
         // At least one pin has changed - do button debouncing
         uint8_t debounced = ~(status ^ b->last_pressed);
-        if (diff & debounced) {
+        if (diff & debounced)
             // Pin has been consistently different - report it
-            b->pressed = (b->pressed & ~debounced) | (status & debounced);
-            if (b->report_count < sizeof(b->reports)) {
-                b->reports[b->report_count++] = b->pressed;
-                sched_wake_task(&buttons_wake);
-                b->retransmit_state = BF_PENDING;
-            }
-        }
+            buttons_note_state(b, (b->pressed & ~debounced)
+                               | (status & debounced));
     }
     b->last_pressed = status;
 
-    // Check if a retransmit is needed
-    uint8_t retransmit_state = b->retransmit_state;
-    if (!(retransmit_state & BF_NO_RETRANSMIT)) {
-        retransmit_state--;
-        if (retransmit_state & BF_NO_RETRANSMIT)
-            // timeout - do retransmit
-            sched_wake_task(&buttons_wake);
-        b->retransmit_state = retransmit_state;
-    }
+    buttons_check_retransmit(b);
 
     // Reschedule timer
     b->time.waketime += b->rest_ticks;
     return SF_RESCHEDULE;
 }
 
+
+/****************************************************************
+ * Pin change irq support
+ ****************************************************************/
+
+// Arm the irq of a pin for the edge away from its current state.
+// Returns non-zero if the pin changed while arming (the pin is then
+// still bouncing and should be checked again later).
+static int
+buttons_irq_arm(struct buttons *b, uint8_t pos, uint8_t val)
+{
+    struct endstop_irq *ei = &b->irqs[pos].irq;
+    endstop_hw_enable(ei, !val);
+    if (!gpio_in_read(b->pins[pos]) == !val)
+        return 0;
+    // An edge may have been missed - discard any pending irq
+    endstop_hw_disable(ei);
+    return -1;
+}
+
+// Timer callback that completes the debouncing of pins (only runs
+// while a pin is being debounced or a report is unacknowledged)
+static uint_fast8_t
+buttons_irq_event(struct timer *t)
+{
+    struct buttons *b = container_of(t, struct buttons, time);
+    uint8_t done = b->debounce & ~b->debounce_new;
+    b->debounce_new = 0;
+    uint8_t i, bit, status = b->pressed;
+    for (i = 0, bit = 1; i < b->button_count; i++, bit <<= 1) {
+        if (!(done & bit))
+            continue;
+        uint8_t val = gpio_in_read(b->pins[i]) ? bit : 0;
+        if (val != (status & bit)) {
+            // Pin changed during the debounce time - report the new
+            // state and debounce it again
+            status ^= bit;
+            b->debounce_new |= bit;
+        } else if (!buttons_irq_arm(b, i, val)) {
+            b->debounce &= ~bit;
+        }
+    }
+    if (status != b->pressed)
+        buttons_note_state(b, status);
+
+    buttons_check_retransmit(b);
+
+    if (!b->debounce && b->retransmit_state == BF_ACKED) {
+        // Nothing more to do until the next pin change irq
+        b->flags &= ~BS_TIMER_ACTIVE;
+        return SF_DONE;
+    }
+    b->time.waketime += b->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+// Pin change irq callback (runs at the same priority as timers)
+static void
+buttons_irq_edge(struct endstop_irq *ei, uint32_t time)
+{
+    struct button_irq *bi = container_of(ei, struct button_irq, irq);
+    struct buttons *b = bi->b;
+    uint8_t bit = bi->bit;
+    // The irq was armed for the edge away from the last reported
+    // state, so report the change immediately and then ignore the pin
+    // (contact bounce) until the timer checks it again
+    buttons_note_state(b, b->pressed ^ bit);
+    b->debounce |= bit;
+    if (b->flags & BS_TIMER_ACTIVE) {
+        // Debounce for at least a full rest_ticks period
+        b->debounce_new |= bit;
+        return;
+    }
+    b->flags |= BS_TIMER_ACTIVE;
+    b->time.waketime = time + b->rest_ticks;
+    // Don't schedule the timer in the past if the irq was delayed
+    uint32_t min_wake = timer_read_time() + timer_from_us(100);
+    if (timer_is_before(b->time.waketime, min_wake))
+        b->time.waketime = min_wake;
+    sched_add_timer(&b->time);
+}
+
+// Disarm the pin change irqs of all the pins
+static void
+buttons_irq_disable(struct buttons *b)
+{
+    uint8_t i;
+    for (i = 0; i < b->button_count; i++)
+        endstop_hw_disable(&b->irqs[i].irq);
+}
+
+
+/****************************************************************
+ * Commands
+ ****************************************************************/
+
 void
 command_config_buttons(uint32_t *args)
 {
@@ -80,6 +201,8 @@ command_config_buttons(uint32_t *args)
         , sizeof(*b) + sizeof(b->pins[0]) * button_count);
     b->button_count = button_count;
     b->time.func = buttons_event;
+    if (CONFIG_ENDSTOP_IRQ)
+        b->irqs = alloc_chunk(sizeof(b->irqs[0]) * button_count);
 }
 DECL_COMMAND(command_config_buttons, "config_buttons oid=%c button_count=%c");
 
@@ -91,6 +214,14 @@ command_buttons_add(uint32_t *args)
     if (pos >= b->button_count)
         shutdown("Set button past maximum button count");
     b->pins[pos] = gpio_in_setup(args[2], args[3]);
+    if (!CONFIG_ENDSTOP_IRQ)
+        return;
+    struct button_irq *bi = &b->irqs[pos];
+    bi->irq.func = buttons_irq_edge;
+    bi->b = b;
+    bi->bit = 1 << pos;
+    if (!endstop_hw_setup(&bi->irq, args[2]))
+        b->irq_mask |= bi->bit;
 }
 DECL_COMMAND(command_buttons_add,
              "buttons_add oid=%c pos=%c pin=%u pull_up=%c");
@@ -99,7 +230,12 @@ void
 command_buttons_query(uint32_t *args)
 {
     struct buttons *b = oid_lookup(args[0], command_config_buttons);
+    irq_disable();
     sched_del_timer(&b->time);
+    if (CONFIG_ENDSTOP_IRQ && b->flags & BS_IRQ)
+        buttons_irq_disable(b);
+    b->flags = 0;
+    irq_enable();
     b->time.waketime = args[1];
     b->rest_ticks = args[2];
     b->pressed = b->last_pressed = args[4];
@@ -110,6 +246,17 @@ command_buttons_query(uint32_t *args)
         shutdown("Invalid buttons retransmit count");
     if (! b->rest_ticks)
         return;
+    if (CONFIG_ENDSTOP_IRQ && b->button_count
+        && b->irq_mask == (1 << b->button_count) - 1) {
+        // Every pin has an irq - check (and arm) all pins on the first
+        // timer event, then only run the timer after pin changes
+        b->flags = BS_IRQ | BS_TIMER_ACTIVE;
+        b->debounce = b->irq_mask;
+        b->debounce_new = 0;
+        b->time.func = buttons_irq_event;
+    } else {
+        b->time.func = buttons_event;
+    }
     sched_add_timer(&b->time);
 }
 DECL_COMMAND(command_buttons_query,
@@ -160,4 +307,4 @@ buttons_task(void)
               , oid, b->ack_count, report_count, b->reports);
     }
 }
-DECL_TASK(buttons_task);
+DECL_WAKE_TASK(buttons_task, buttons_wake);
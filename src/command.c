@@ -1,11 +1,12 @@
 // Code for parsing incoming commands and encoding outgoing messages
 //
-// Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <stdarg.h> // va_start
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_SELECTIVE_ACK
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // crc16_ccitt
@@ -15,7 +16,7 @@
 
 static uint8_t next_sequence = MESSAGE_DEST;
 
-static uint32_t
+uint32_t
 command_encode_ptr(void *p)
 {
     if (sizeof(size_t) > sizeof(uint32_t))
@@ -37,8 +38,8 @@ command_decode_ptr(uint32_t v)
  ****************************************************************/
 
 // Encode an integer as a variable length quantity (vlq)
-static uint8_t *
-encode_int(uint8_t *p, uint32_t v)
+uint8_t *
+command_encode_int(uint8_t *p, uint32_t v)
 {
     int32_t sv = v;
     if (sv < (3L<<5)  && sv >= -(1L<<5))  goto f4;
@@ -54,8 +55,8 @@ f4: *p++ = v & 0x7f;
 }
 
 // Parse an integer that was encoded as a "variable length quantity"
-static uint32_t
-parse_int(uint8_t **pp)
+uint32_t
+command_parse_int(uint8_t **pp)
 {
     uint8_t *p = *pp, c = *p++;
     uint32_t v = c & 0x7f;
@@ -96,6 +97,14 @@ uint8_t *
 command_parsef(uint8_t *p, uint8_t *maxend
                , const struct command_parser *cp, uint32_t *args)
 {
+#if CONFIG_COMMAND_PARSERS
+    // Use the parser generated for this command by buildcommands.py
+    uint8_t *(*parse)(uint8_t*, uint8_t*, uint32_t*) = READP(cp->parse);
+    p = parse(p, maxend, args);
+    if (!p)
+        goto error;
+    return p;
+#else
     uint_fast8_t num_params = READP(cp->num_params);
     const uint8_t *param_types = READP(cp->param_types);
     while (num_params--) {
@@ -109,7 +118,7 @@ command_parsef(uint8_t *p, uint8_t *maxend
         case PT_uint16:
         case PT_int16:
         case PT_byte:
-            *args++ = parse_int(&p);
+            *args++ = command_parse_int(&p);
             break;
         case PT_buffer: {
             uint_fast8_t len = *p++;
@@ -125,6 +134,7 @@ command_parsef(uint8_t *p, uint8_t *maxend
         }
     }
     return p;
+#endif
 error:
     shutdown("Command parser error");
 }
@@ -139,9 +149,16 @@ command_encodef(uint8_t *buf, const struct command_encoder *ce, va_list args)
         return max_size;
     uint8_t *p = &buf[MESSAGE_HEADER_SIZE];
     uint8_t *maxend = &p[max_size - MESSAGE_MIN];
+    p = encode_msgid(p, READP(ce->encoded_msgid));
+#if CONFIG_COMMAND_ENCODERS
+    // Use the encoder generated for this message by buildcommands.py
+    uint8_t *(*encode)(uint8_t*, uint8_t*, va_list) = READP(ce->encode);
+    p = encode(p, maxend, args);
+    if (!p)
+        goto error;
+#else
     uint_fast8_t num_params = READP(ce->num_params);
     const uint8_t *param_types = READP(ce->param_types);
-    p = encode_msgid(p, READP(ce->encoded_msgid));
     while (num_params--) {
         if (p > maxend)
             goto error;
@@ -161,7 +178,7 @@ command_encodef(uint8_t *buf, const struct command_encoder *ce, va_list args)
                     v = va_arg(args, unsigned int);
             else
                 v = va_arg(args, uint32_t);
-            p = encode_int(p, v);
+            p = command_encode_int(p, v);
             break;
         case PT_string: {
             uint8_t *s = va_arg(args, uint8_t*), *lenp = p++;
@@ -188,6 +205,7 @@ command_encodef(uint8_t *buf, const struct command_encoder *ce, va_list args)
             goto error;
         }
     }
+#endif
     return p - buf + MESSAGE_TRAILER_SIZE;
 error:
     shutdown("Message encode error");
@@ -215,24 +233,47 @@ command_encode_and_frame(uint8_t *buf, const struct command_encoder *ce
     return msglen;
 }
 
+enum { SF_ACTIVE=1<<0, SF_BULK=1<<1 };
+
 static uint8_t in_sendf;
 
-// Encode and transmit a "response" message
-void
-command_sendf(const struct command_encoder *ce, ...)
+static void
+command_vsendf(uint8_t flags, const struct command_encoder *ce, va_list args)
 {
     if (readb(&in_sendf))
         // This sendf call was made from an irq handler while the main
         // code was already in sendf - just drop this sendf request.
         return;
-    writeb(&in_sendf, 1);
+    writeb(&in_sendf, flags);
+    console_sendf(ce, args);
+    writeb(&in_sendf, 0);
+}
 
+// Encode and transmit a "response" message
+void
+command_sendf(const struct command_encoder *ce, ...)
+{
     va_list args;
     va_start(args, ce);
-    console_sendf(ce, args);
+    command_vsendf(SF_ACTIVE, ce, args);
     va_end(args);
+}
 
-    writeb(&in_sendf, 0);
+// Encode and transmit a "response" message that carries bulk data
+void
+command_sendf_bulk(const struct command_encoder *ce, ...)
+{
+    va_list args;
+    va_start(args, ce);
+    command_vsendf(SF_ACTIVE | SF_BULK, ce, args);
+    va_end(args);
+}
+
+// Check if the message being transmitted was sent with sendf_bulk()
+int
+command_sendf_is_bulk(void)
+{
+    return readb(&in_sendf) & SF_BULK;
 }
 
 void
@@ -263,6 +304,57 @@ const struct command_encoder encode_acknak PROGMEM = {
 
 enum { CF_NEED_SYNC=1<<0, CF_NEED_VALID=1<<1 };
 
+// Storage for message blocks received after a lost block
+static uint8_t sack_mask;
+
+#if CONFIG_SELECTIVE_ACK
+
+#define SACK_BLOCKS 4
+static uint8_t sack_buf[SACK_BLOCKS][MESSAGE_MAX];
+
+DECL_CONSTANT("SELECTIVE_ACK", SACK_BLOCKS);
+
+// Store a message block that follows a lost block.  Returns 1 if the
+// block was stored (and reported) or 0 if a nak should be sent.
+static int
+sack_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t msgseq)
+{
+    uint_fast8_t pos = (msgseq - next_sequence) & MESSAGE_SEQ_MASK;
+    if (!pos || pos > SACK_BLOCKS)
+        return 0;
+    memcpy(sack_buf[msgseq % SACK_BLOCKS], buf, msglen);
+    sack_mask |= 1 << pos;
+    sendf("selective_ack mask=%c", sack_mask);
+    return 1;
+}
+
+// Dispatch any stored blocks that are now in sequence
+static void
+sack_dispatch(void)
+{
+    while (sack_mask & 1) {
+        uint8_t *buf = sack_buf[next_sequence % SACK_BLOCKS];
+        next_sequence = ((next_sequence + 1) & MESSAGE_SEQ_MASK) | MESSAGE_DEST;
+        sack_mask >>= 1;
+        command_dispatch(buf, buf[MESSAGE_POS_LEN]);
+    }
+}
+
+#else
+
+static int
+sack_store(uint8_t *buf, uint_fast8_t msglen, uint_fast8_t msgseq)
+{
+    return 0;
+}
+
+static void
+sack_dispatch(void)
+{
+}
+
+#endif
+
 // Find the next complete message block
 int_fast8_t
 command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
@@ -275,7 +367,11 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
     uint_fast8_t msglen = buf[MESSAGE_POS_LEN];
     if (msglen < MESSAGE_MIN || msglen > MESSAGE_MAX)
         goto error;
-    uint_fast8_t msgseq = buf[MESSAGE_POS_SEQ];
+    uint_fast8_t msgseq = buf[MESSAGE_POS_SEQ], msgsack = 0;
+    if (CONFIG_SELECTIVE_ACK && msgseq & MESSAGE_SEQ_SACK) {
+        msgseq &= ~MESSAGE_SEQ_SACK;
+        msgsack = 1;
+    }
     if ((msgseq & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST)
         goto error;
     if (buf_len < msglen)
@@ -289,12 +385,18 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
         goto error;
     sync_state &= ~CF_NEED_VALID;
     *pop_count = msglen;
+    if (!msgsack)
+        // Host does not use selective acks - discard any stored blocks
+        sack_mask = 0;
     // Check sequence number
     if (msgseq != next_sequence) {
+        if (msgsack && sack_store(buf, msglen, msgseq))
+            return -1;
         // Lost message - discard messages until it is retransmitted
         goto nak;
     }
     next_sequence = ((msgseq + 1) & MESSAGE_SEQ_MASK) | MESSAGE_DEST;
+    sack_mask >>= 1;
     return 1;
 
 need_more_data:
@@ -349,6 +451,7 @@ command_dispatch(uint8_t *buf, uint_fast8_t msglen)
 void
 command_send_ack(void)
 {
+    sack_dispatch();
     command_sendf(&encode_acknak);
 }
 
@@ -4,6 +4,7 @@
 #include <stdarg.h> // va_list
 #include <stddef.h>
 #include <stdint.h> // uint8_t
+#include "autoconf.h" // CONFIG_COMMAND_PARSERS
 #include "ctr.h" // DECL_CTR
 
 // Declare a function to run when the specified command is received
@@ -37,6 +38,11 @@
 #define sendf(FMT, args...)                     \
     command_sendf(_DECL_ENCODER(FMT) , ##args )
 
+// Transmit a message that carries bulk data (transports may send it
+// at a lower priority than other messages)
+#define sendf_bulk(FMT, args...)                \
+    command_sendf_bulk(_DECL_ENCODER(FMT) , ##args )
+
 // Shut down the machine (also declares a static string to transmit)
 #define shutdown(msg)                           \
     sched_shutdown(_DECL_STATIC_STR(msg))
@@ -54,18 +60,29 @@
 #define MESSAGE_PAYLOAD_MAX (MESSAGE_MAX - MESSAGE_MIN)
 #define MESSAGE_SEQ_MASK 0x0f
 #define MESSAGE_DEST 0x10
+#define MESSAGE_SEQ_SACK 0x20
 #define MESSAGE_SYNC 0x7E
 
+// "identify" offset that reports a hash of the data dictionary
+#define IDENTIFY_HASH_OFFSET 0xffffffff
+#define IDENTIFY_HASH_SIZE 8
+
 struct command_encoder {
     uint16_t encoded_msgid;
     uint8_t max_size, num_params;
     const uint8_t *param_types;
+#if CONFIG_COMMAND_ENCODERS
+    uint8_t *(*encode)(uint8_t *p, uint8_t *maxend, va_list args);
+#endif
 };
 struct command_parser {
     uint16_t encoded_msgid;
     uint8_t num_args, flags, num_params;
     const uint8_t *param_types;
     void (*func)(uint32_t *args);
+#if CONFIG_COMMAND_PARSERS
+    uint8_t *(*parse)(uint8_t *p, uint8_t *maxend, uint32_t *args);
+#endif
 };
 enum {
     PT_uint32, PT_int32, PT_uint16, PT_int16, PT_byte,
@@ -73,13 +90,18 @@ enum {
 };
 
 // command.c
+uint32_t command_encode_ptr(void *p);
 void *command_decode_ptr(uint32_t v);
+uint8_t *command_encode_int(uint8_t *p, uint32_t v);
+uint32_t command_parse_int(uint8_t **pp);
 uint_fast16_t command_parse_msgid(uint8_t **pp);
 uint8_t *command_parsef(uint8_t *p, uint8_t *maxend
                         , const struct command_parser *cp, uint32_t *args);
 uint_fast8_t command_encode_and_frame(
     uint8_t *buf, const struct command_encoder *ce, va_list args);
 void command_sendf(const struct command_encoder *ce, ...);
+void command_sendf_bulk(const struct command_encoder *ce, ...);
+int command_sendf_is_bulk(void);
 int_fast8_t command_find_block(uint8_t *buf, uint_fast8_t buf_len
                                , uint_fast8_t *pop_count);
 void command_dispatch(uint8_t *buf, uint_fast8_t msglen);
@@ -92,6 +114,7 @@ extern const struct command_parser command_index[];
 extern const uint16_t command_index_size;
 extern const uint8_t command_identify_data[];
 extern const uint32_t command_identify_size;
+extern const uint8_t command_identify_hash[];
 const struct command_encoder *ctr_lookup_encoder(const char *str);
 const struct command_encoder *ctr_lookup_output(const char *str);
 uint8_t ctr_lookup_static_string(const char *str);
@@ -1,13 +1,16 @@
 // Handling of end stops.
 //
-// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ENDSTOP_IRQ
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio
 #include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
+#include "endstop.h" // endstop_hw_setup
 #include "sched.h" // struct timer
 #include "trsync.h" // trsync_do_trigger
 
@@ -17,11 +20,13 @@ struct endstop {
     uint32_t rest_time, sample_time, nextwake;
     struct trsync *ts;
     uint8_t flags, sample_count, trigger_count, trigger_reason;
+    struct endstop_irq irq;
 };
 
-enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1 };
+enum { ESF_PIN_HIGH=1<<0, ESF_HOMING=1<<1, ESF_IRQ=1<<2 };
 
 static uint_fast8_t endstop_oversample_event(struct timer *t);
+static uint_fast8_t endstop_irq_event(struct timer *t);
 
 // Timer callback for an end stop
 static uint_fast8_t
@@ -48,7 +53,8 @@ endstop_oversample_event(struct timer *t)
     uint8_t val = gpio_in_read(e->pin);
     if ((val ? ~e->flags : e->flags) & ESF_PIN_HIGH) {
         // No longer matching - reschedule for the next attempt
-        e->time.func = endstop_event;
+        e->time.func = (CONFIG_ENDSTOP_IRQ && e->flags & ESF_IRQ
+                        ? endstop_irq_event : endstop_event);
         e->time.waketime = e->nextwake;
         e->trigger_count = e->sample_count;
         return SF_RESCHEDULE;
@@ -63,11 +69,52 @@ endstop_oversample_event(struct timer *t)
     return SF_RESCHEDULE;
 }
 
+// Timer callback that waits for a pin change irq
+static uint_fast8_t
+endstop_irq_event(struct timer *t)
+{
+    struct endstop *e = container_of(t, struct endstop, time);
+    endstop_hw_enable(&e->irq, e->flags & ESF_PIN_HIGH);
+    uint8_t val = gpio_in_read(e->pin);
+    if ((val ? ~e->flags : e->flags) & ESF_PIN_HIGH)
+        // No match - endstop_irq_edge() is called on the next edge
+        return SF_DONE;
+    // Pin already matches (the irq can not run until this returns)
+    endstop_hw_disable(&e->irq);
+    e->nextwake = e->time.waketime + e->rest_time;
+    e->time.func = endstop_oversample_event;
+    return endstop_oversample_event(t);
+}
+
+// Pin change irq callback (runs at the same priority as timers)
+static void
+endstop_irq_edge(struct endstop_irq *ei, uint32_t time)
+{
+    struct endstop *e = container_of(ei, struct endstop, irq);
+    if (!(e->flags & ESF_HOMING))
+        return;
+    // Report the time of the edge (as opposed to the time of the next
+    // poll) to the host
+    e->nextwake = time + e->rest_time;
+    e->time.waketime = time;
+    e->time.func = endstop_oversample_event;
+    if (endstop_oversample_event(&e->time) != SF_RESCHEDULE)
+        return;
+    // Don't schedule the timer in the past if the irq was delayed
+    uint32_t min_wake = timer_read_time() + e->sample_time;
+    if (timer_is_before(e->time.waketime, min_wake))
+        e->time.waketime = min_wake;
+    sched_add_timer(&e->time);
+}
+
 void
 command_config_endstop(uint32_t *args)
 {
     struct endstop *e = oid_alloc(args[0], command_config_endstop, sizeof(*e));
     e->pin = gpio_in_setup(args[1], args[2]);
+    e->irq.func = endstop_irq_edge;
+    if (CONFIG_ENDSTOP_IRQ && !endstop_hw_setup(&e->irq, args[1]))
+        e->flags = ESF_IRQ;
 }
 DECL_COMMAND(command_config_endstop, "config_endstop oid=%c pin=%c pull_up=%c");
 
@@ -76,20 +123,26 @@ void
 command_endstop_home(uint32_t *args)
 {
     struct endstop *e = oid_lookup(args[0], command_config_endstop);
+    uint8_t irq_flag = e->flags & ESF_IRQ;
+    irq_disable();
     sched_del_timer(&e->time);
+    if (CONFIG_ENDSTOP_IRQ && irq_flag)
+        endstop_hw_disable(&e->irq);
+    irq_enable();
     e->time.waketime = args[1];
     e->sample_time = args[2];
     e->sample_count = args[3];
     if (!e->sample_count) {
         // Disable end stop checking
         e->ts = NULL;
-        e->flags = 0;
+        e->flags = irq_flag;
         return;
     }
     e->rest_time = args[4];
-    e->time.func = endstop_event;
+    e->time.func = (CONFIG_ENDSTOP_IRQ && irq_flag
+                    ? endstop_irq_event : endstop_event);
     e->trigger_count = e->sample_count;
-    e->flags = ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
+    e->flags = irq_flag | ESF_HOMING | (args[5] ? ESF_PIN_HIGH : 0);
     e->ts = trsync_oid_lookup(args[6]);
     e->trigger_reason = args[7];
     sched_add_timer(&e->time);
@@ -0,0 +1,19 @@
+#ifndef __ENDSTOP_H
+#define __ENDSTOP_H
+
+#include <stdint.h> // uint8_t
+
+// Pin change interrupt used to timestamp endstop edges (and to wake
+// sensors on a data ready pin).  The func callback is invoked from irq
+// context once per endstop_hw_enable().
+struct endstop_irq {
+    void (*func)(struct endstop_irq *ei, uint32_t time);
+    uint8_t line;
+};
+
+// Board code (if CONFIG_ENDSTOP_IRQ)
+int endstop_hw_setup(struct endstop_irq *ei, uint32_t pin);
+void endstop_hw_enable(struct endstop_irq *ei, uint8_t rising);
+void endstop_hw_disable(struct endstop_irq *ei);
+
+#endif // endstop.h
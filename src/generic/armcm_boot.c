@@ -15,6 +15,7 @@ DECL_CONSTANT_STR("MCU", CONFIG_MCU);
 
 // Symbols created by armcm_link.lds.S linker script
 extern uint32_t _data_start, _data_end, _data_flash;
+extern uint32_t _itcm_start, _itcm_end, _itcm_flash;
 extern uint32_t _bss_start, _bss_end, _stack_start;
 extern uint32_t _stack_end;
 
@@ -91,6 +92,14 @@ reset_handler_stage_two(void)
     uint32_t count = (&_data_end - &_data_start) * 4;
     boot_memcpy(&_data_start, &_data_flash, count);
 
+#if CONFIG_ARMCM_ITCM_SIZE
+    // Copy ram functions from flash to the instruction tightly coupled ram
+    count = (&_itcm_end - &_itcm_start) * 4;
+    boot_memcpy(&_itcm_start, &_itcm_flash, count);
+    __DSB();
+    __ISB();
+#endif
+
     // Clear the bss segment
     boot_memset(&_bss_start, 0, (&_bss_end - &_bss_start) * 4);
 
@@ -16,6 +16,11 @@ void armcm_main(void);
         NVIC_EnableIRQ((NUM));                          \
     } while (0)
 
+// Priority of the timer irq.  Irqs with handlers that share state
+// with timer callbacks (eg, endstop, i2c, and tmcuart irqs) use the
+// same priority so that the handlers can not interrupt each other.
+#define TIMER_PRIO 2
+
 // Vectors created by scripts/buildcommands.py from DECL_ARMCM_IRQ commands
 extern const void * const VectorTable[];
 
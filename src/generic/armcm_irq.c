@@ -1,6 +1,6 @@
 // Definitions for irq enable/disable on ARM Cortex-M processors
 //
-// Copyright (C) 2017-2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -8,6 +8,65 @@
 #include "irq.h" // irqstatus_t
 #include "sched.h" // DECL_SHUTDOWN
 
+#if CONFIG_SCHED_TIMER_CORE
+
+// The timers run on another cpu core - a core holds a cross core lock
+// (see irq_core_lock() in the board code) whenever its irqs are disabled
+
+static inline irqstatus_t
+irq_get_primask(void)
+{
+    irqstatus_t flag;
+    asm volatile("mrs %0, primask" : "=r" (flag) :: "memory");
+    return flag;
+}
+
+void
+irq_disable(void)
+{
+    if (irq_get_primask())
+        return;
+    asm volatile("cpsid i" ::: "memory");
+    irq_core_lock();
+}
+
+void
+irq_enable(void)
+{
+    if (!irq_get_primask())
+        return;
+    irq_core_unlock();
+    asm volatile("cpsie i" ::: "memory");
+}
+
+irqstatus_t
+irq_save(void)
+{
+    irqstatus_t flag = irq_get_primask();
+    irq_disable();
+    return flag;
+}
+
+void
+irq_restore(irqstatus_t flag)
+{
+    if (flag)
+        irq_disable();
+    else
+        irq_enable();
+}
+
+void
+irq_wait(void)
+{
+    // The timer core signals an event after running timers
+    irq_enable();
+    asm volatile("wfe" ::: "memory");
+    irq_disable();
+}
+
+#else // !CONFIG_SCHED_TIMER_CORE
+
 void
 irq_disable(void)
 {
@@ -45,6 +104,8 @@ irq_wait(void)
         asm volatile("cpsie i\n    wfi\n    cpsid i\n" ::: "memory");
 }
 
+#endif // !CONFIG_SCHED_TIMER_CORE
+
 void
 irq_poll(void)
 {
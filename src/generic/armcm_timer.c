@@ -103,7 +103,7 @@ timer_init(void)
 
     // Enable SysTick
     irqstatus_t flag = irq_save();
-    NVIC_SetPriority(SysTick_IRQn, 2);
+    NVIC_SetPriority(SysTick_IRQn, TIMER_PRIO);
     SysTick->CTRL = (SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk
                      | SysTick_CTRL_ENABLE_Msk);
     timer_kick();
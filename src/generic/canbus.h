@@ -2,20 +2,67 @@
 #define __CANBUS_H__
 
 #include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_CANBUS_FD
+
+#if CONFIG_CANBUS_FD
+ #define CANMSG_DATA_MAX 64
+#else
+ #define CANMSG_DATA_MAX 8
+#endif
 
 struct canbus_msg {
     uint32_t id;
     uint32_t dlc;
     union {
-        uint8_t data[8];
-        uint32_t data32[2];
+        uint8_t data[CANMSG_DATA_MAX];
+        uint32_t data32[CANMSG_DATA_MAX / 4];
     };
 };
 
+#define CANMSG_ID_FDF (1<<29) // CAN FD frame (with bit rate switching)
 #define CANMSG_ID_RTR (1<<30)
 #define CANMSG_ID_EFF (1<<31)
 
-#define CANMSG_DATA_LEN(msg) ((msg)->dlc > 8 ? 8 : (msg)->dlc)
+// Return the number of data bytes in a message
+static inline uint32_t
+canmsg_data_len(struct canbus_msg *msg)
+{
+    uint32_t dlc = msg->dlc;
+    if (dlc <= 8)
+        return dlc;
+    if (!CONFIG_CANBUS_FD || !(msg->id & CANMSG_ID_FDF))
+        return 8;
+    static const uint8_t fd_lens[] = { 12, 16, 20, 24, 32, 48, 64 };
+    return dlc > 15 ? 64 : fd_lens[dlc - 9];
+}
+
+#define CANMSG_DATA_LEN(msg) canmsg_data_len(msg)
+
+// Return the smallest CAN FD frame size that can hold 'len' bytes
+static inline uint32_t
+canmsg_fd_frame_len(uint32_t len)
+{
+    if (len <= 8)
+        return len;
+    if (len >= 64)
+        return 64;
+    // Valid frame sizes for lengths 9 to 64 (in four byte units)
+    static const uint8_t fd_sizes[] = {
+        12, 16, 20, 24, 32, 32, 48, 48, 48, 48, 64, 64, 64, 64
+    };
+    return fd_sizes[(len + 3) / 4 - 3];
+}
+
+// Return the dlc code for a CAN FD frame of the given size
+static inline uint32_t
+canmsg_fd_len_to_dlc(uint32_t len)
+{
+    if (len <= 8)
+        return len;
+    if (len <= 24)
+        return 9 + (len - 12) / 4;
+    return len == 32 ? 13 : (len == 48 ? 14 : 15);
+}
 
 // callbacks provided by board specific code
 int canhw_send(struct canbus_msg *msg);
@@ -2,12 +2,12 @@
 //
 // Copyright (C) 2019 Eug Krashtan <eug.krashtan@gmail.com>
 // Copyright (C) 2020 Pontus Borg <glpontus@gmail.com>
-// Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <string.h> // memcpy
-#include "autoconf.h" // CONFIG_HAVE_BOOTLOADER_REQUEST
+#include <string.h> // memcpy, memset
+#include "autoconf.h" // CONFIG_CANBUS_FD
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // console_sendf
@@ -19,6 +19,12 @@
 
 #define CANBUS_UUID_LEN 6
 
+// Buffer of encoded message blocks waiting to be transmitted
+struct canserial_txbuf {
+    uint8_t pos, max;
+    uint8_t buf[96];
+};
+
 // Global storage
 static struct canbus_data {
     uint32_t assigned_id;
@@ -26,16 +32,15 @@ static struct canbus_data {
 
     // Tx data
     struct task_wake tx_wake;
-    uint8_t transmit_pos, transmit_max;
+    struct canserial_txbuf transmit, bulk;
 
     // Rx data
     struct task_wake rx_wake;
-    uint8_t receive_pos;
+    uint8_t receive_start, receive_count;
     uint32_t admin_pull_pos, admin_push_pos;
 
     // Transfer buffers
     struct canbus_msg admin_queue[8];
-    uint8_t transmit_buf[96];
     uint8_t receive_buf[192];
 } CanData;
 
@@ -50,31 +55,53 @@ canserial_notify_tx(void)
     sched_wake_task(&CanData.tx_wake);
 }
 
-void
-canserial_tx_task(void)
+// Transmit the contents of a buffer on the given CAN id.  Returns
+// non-zero if all of the buffer was sent.
+static int
+canserial_tx_buf(struct canserial_txbuf *tb, uint32_t id)
 {
-    if (!sched_check_wake(&CanData.tx_wake))
-        return;
-    uint32_t id = CanData.assigned_id;
-    if (!id) {
-        CanData.transmit_pos = CanData.transmit_max = 0;
-        return;
-    }
     struct canbus_msg msg;
-    msg.id = id + 1;
-    uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
+    msg.id = id | (CONFIG_CANBUS_FD ? CANMSG_ID_FDF : 0);
+    uint32_t tpos = tb->pos, tmax = tb->max;
     for (;;) {
         int avail = tmax - tpos, now = avail > 8 ? 8 : avail;
         if (avail <= 0)
             break;
-        msg.dlc = now;
-        memcpy(msg.data, &CanData.transmit_buf[tpos], now);
+        if (CONFIG_CANBUS_FD) {
+            // Pad the frame to a valid size (leading syncs are ignored)
+            int size = canmsg_fd_frame_len(avail);
+            now = avail < size ? avail : size;
+            memset(&msg.data[now], MESSAGE_SYNC, size - now);
+            msg.dlc = canmsg_fd_len_to_dlc(size);
+        } else {
+            msg.dlc = now;
+        }
+        memcpy(msg.data, &tb->buf[tpos], now);
         int ret = canbus_send(&msg);
         if (ret <= 0)
             break;
         tpos += now;
     }
-    CanData.transmit_pos = tpos;
+    tb->pos = tpos;
+    return tpos >= tmax;
+}
+
+// Bulk data (see command_sendf_bulk()) is sent on a separate CAN id
+// that loses bus arbitration to the regular traffic of all nodes.
+// The bulk buffer is only transmitted once the regular one is empty.
+void
+canserial_tx_task(void)
+{
+    if (!sched_check_wake(&CanData.tx_wake))
+        return;
+    uint32_t id = CanData.assigned_id;
+    if (!id) {
+        CanData.transmit.pos = CanData.transmit.max = 0;
+        CanData.bulk.pos = CanData.bulk.max = 0;
+        return;
+    }
+    if (canserial_tx_buf(&CanData.transmit, id + 1))
+        canserial_tx_buf(&CanData.bulk, id + 1 + CANBUS_ID_BULK_OFFSET);
 }
 DECL_TASK(canserial_tx_task);
 
@@ -82,28 +109,30 @@ DECL_TASK(canserial_tx_task);
 void
 console_sendf(const struct command_encoder *ce, va_list args)
 {
+    struct canserial_txbuf *tb = (command_sendf_is_bulk()
+                                  ? &CanData.bulk : &CanData.transmit);
+
     // Verify space for message
-    uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
+    uint32_t tpos = tb->pos, tmax = tb->max;
     if (tpos >= tmax)
-        CanData.transmit_pos = CanData.transmit_max = tpos = tmax = 0;
+        tb->pos = tb->max = tpos = tmax = 0;
     uint32_t max_size = ce->max_size;
-    if (tmax + max_size > sizeof(CanData.transmit_buf)) {
-        if (tmax + max_size - tpos > sizeof(CanData.transmit_buf))
+    if (tmax + max_size > sizeof(tb->buf)) {
+        if (tmax + max_size - tpos > sizeof(tb->buf))
             // Not enough space for message
             return;
         // Move buffer
         tmax -= tpos;
-        memmove(&CanData.transmit_buf[0], &CanData.transmit_buf[tpos], tmax);
-        CanData.transmit_pos = tpos = 0;
-        CanData.transmit_max = tmax;
+        memmove(&tb->buf[0], &tb->buf[tpos], tmax);
+        tb->pos = tpos = 0;
+        tb->max = tmax;
     }
 
     // Generate message
-    uint32_t msglen = command_encode_and_frame(&CanData.transmit_buf[tmax]
-                                               , ce, args);
+    uint32_t msglen = command_encode_and_frame(&tb->buf[tmax], ce, args);
 
     // Start message transmit
-    CanData.transmit_max = tmax + msglen;
+    tb->max = tmax + msglen;
     canserial_notify_tx();
 }
 
@@ -227,15 +256,24 @@ DECL_CONSTANT("RECEIVE_WINDOW", ARRAY_SIZE(CanData.receive_buf));
 void
 canserial_process_data(struct canbus_msg *msg)
 {
-    uint32_t id = msg->id;
+    uint32_t id = msg->id & ~CANMSG_ID_FDF;
     if (CanData.assigned_id && id == CanData.assigned_id) {
-        // Add to incoming data buffer
-        int rpos = CanData.receive_pos;
+        // Add to incoming data ring buffer
+        int count = CanData.receive_count;
         uint32_t len = CANMSG_DATA_LEN(msg);
-        if (len > sizeof(CanData.receive_buf) - rpos)
+        if (len > sizeof(CanData.receive_buf) - count)
             return;
-        memcpy(&CanData.receive_buf[rpos], msg->data, len);
-        CanData.receive_pos = rpos + len;
+        int pos = CanData.receive_start + count;
+        if (pos >= sizeof(CanData.receive_buf))
+            pos -= sizeof(CanData.receive_buf);
+        int avail = sizeof(CanData.receive_buf) - pos;
+        if (len > avail) {
+            memcpy(&CanData.receive_buf[pos], msg->data, avail);
+            memcpy(CanData.receive_buf, &msg->data[avail], len - avail);
+        } else {
+            memcpy(&CanData.receive_buf[pos], msg->data, len);
+        }
+        CanData.receive_count = count + len;
         canserial_notify_rx();
     } else if (id == CANBUS_ID_ADMIN
                || (CanData.assigned_id && id == CanData.assigned_id + 1)) {
@@ -255,26 +293,16 @@ canserial_process_data(struct canbus_msg *msg)
 static void
 console_pop_input(int len)
 {
-    int copied = 0;
-    for (;;) {
-        int rpos = readb(&CanData.receive_pos);
-        int needcopy = rpos - len;
-        if (needcopy) {
-            memmove(&CanData.receive_buf[copied]
-                    , &CanData.receive_buf[copied + len], needcopy - copied);
-            copied = needcopy;
-            canserial_notify_rx();
-        }
-        irqstatus_t flag = irq_save();
-        if (rpos != readb(&CanData.receive_pos)) {
-            // Raced with irq handler - retry
-            irq_restore(flag);
-            continue;
-        }
-        CanData.receive_pos = needcopy;
-        irq_restore(flag);
-        break;
-    }
+    int start = CanData.receive_start + len;
+    if (start >= sizeof(CanData.receive_buf))
+        start -= sizeof(CanData.receive_buf);
+    irqstatus_t flag = irq_save();
+    CanData.receive_start = start;
+    int count = CanData.receive_count - len;
+    CanData.receive_count = count;
+    irq_restore(flag);
+    if (count)
+        canserial_notify_rx();
 }
 
 // Task to process incoming commands and admin messages
@@ -292,7 +320,7 @@ canserial_rx_task(void)
             break;
         uint32_t pos = pullp % ARRAY_SIZE(CanData.admin_queue);
         struct canbus_msg *msg = &CanData.admin_queue[pos];
-        uint32_t id = msg->id;
+        uint32_t id = msg->id & ~CANMSG_ID_FDF;
         if (CanData.assigned_id && id == CanData.assigned_id + 1)
             can_id_conflict();
         else if (id == CANBUS_ID_ADMIN)
@@ -301,10 +329,23 @@ canserial_rx_task(void)
     }
 
     // Check for a complete message block and process it
-    uint_fast8_t rpos = readb(&CanData.receive_pos), pop_count;
-    int ret = command_find_block(CanData.receive_buf, rpos, &pop_count);
+    int start = CanData.receive_start, count = readb(&CanData.receive_count);
+    uint8_t *buf = &CanData.receive_buf[start], flatbuf[MESSAGE_MAX];
+    int tail = sizeof(CanData.receive_buf) - start;
+    if (count > tail) {
+        if (count > MESSAGE_MAX)
+            count = MESSAGE_MAX;
+        if (count > tail) {
+            // Block wraps around the end of the ring - copy it to flatbuf
+            memcpy(flatbuf, buf, tail);
+            memcpy(&flatbuf[tail], CanData.receive_buf, count - tail);
+            buf = flatbuf;
+        }
+    }
+    uint_fast8_t pop_count;
+    int ret = command_find_block(buf, count, &pop_count);
     if (ret > 0)
-        command_dispatch(CanData.receive_buf, pop_count);
+        command_dispatch(buf, pop_count);
     if (ret) {
         console_pop_input(pop_count);
         if (ret > 0)
@@ -5,6 +5,7 @@
 
 #define CANBUS_ID_ADMIN 0x3f0
 #define CANBUS_ID_ADMIN_RESP 0x3f1
+#define CANBUS_ID_BULK_OFFSET 0x400
 
 // canserial.c
 void canserial_notify_tx(void);
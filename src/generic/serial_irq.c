@@ -1,10 +1,10 @@
 // Generic interrupt based serial uart helper code
 //
-// Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <string.h> // memmove
+#include <string.h> // memcpy
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_save
@@ -16,22 +16,34 @@
 
 #define RX_BUFFER_SIZE 192
 
-static uint8_t receive_buf[RX_BUFFER_SIZE], receive_pos;
-static uint8_t transmit_buf[96], transmit_pos, transmit_max;
+// Incoming data is stored in a ring buffer starting at receive_start
+static uint8_t receive_buf[RX_BUFFER_SIZE], receive_start, receive_count;
+static uint8_t transmit_buf[96], transmit_pos, transmit_max, transmit_busy;
+static uint8_t rx_dma_pos;
 
 DECL_CONSTANT("SERIAL_BAUD", CONFIG_SERIAL_BAUD);
 DECL_CONSTANT("RECEIVE_WINDOW", RX_BUFFER_SIZE);
 
+// Return the position in the receive ring buffer to store new data at
+static uint_fast8_t
+receive_next_pos(uint_fast8_t count)
+{
+    uint_fast8_t tail = sizeof(receive_buf) - receive_start;
+    return count < tail ? receive_start + count : count - tail;
+}
+
 // Rx interrupt - store read data
 void
 serial_rx_byte(uint_fast8_t data)
 {
     if (data == MESSAGE_SYNC)
         sched_wake_tasks();
-    if (receive_pos >= sizeof(receive_buf))
+    uint_fast8_t count = receive_count;
+    if (count >= sizeof(receive_buf))
         // Serial overflow - ignore it as crc error will force retransmit
         return;
-    receive_buf[receive_pos++] = data;
+    receive_buf[receive_next_pos(count)] = data;
+    receive_count = count + 1;
 }
 
 // Tx interrupt - get next byte to transmit
@@ -44,43 +56,110 @@ serial_get_tx_byte(uint8_t *pdata)
     return 0;
 }
 
+// Rx dma - store data added to a circular dma buffer
+static void
+serial_rx_data(const uint8_t *data, uint_fast8_t len)
+{
+    if (memchr(data, MESSAGE_SYNC, len))
+        sched_wake_tasks();
+    uint_fast8_t count = receive_count, space = sizeof(receive_buf) - count;
+    if (len > space)
+        // Serial overflow - ignore it as crc error will force retransmit
+        len = space;
+    uint_fast8_t pos = receive_next_pos(count);
+    uint_fast8_t avail = sizeof(receive_buf) - pos;
+    if (len > avail) {
+        memcpy(&receive_buf[pos], data, avail);
+        memcpy(receive_buf, &data[avail], len - avail);
+    } else {
+        memcpy(&receive_buf[pos], data, len);
+    }
+    receive_count = count + len;
+}
+
+// Rx dma interrupt - process the data in a circular dma buffer of
+// 'size' bytes that the dma controller has written up to 'pos'
+void
+serial_rx_dma(const uint8_t *buf, uint_fast8_t size, uint_fast8_t pos)
+{
+    if (pos >= size)
+        pos = 0;
+    uint_fast8_t rpos = rx_dma_pos;
+    if (pos < rpos) {
+        serial_rx_data(&buf[rpos], size - rpos);
+        rpos = 0;
+    }
+    if (pos > rpos)
+        serial_rx_data(&buf[rpos], pos - rpos);
+    rx_dma_pos = pos;
+}
+
+// Tx dma - get the pending transmit data.  The data remains in use
+// until serial_tx_data_done() is called.
+uint_fast8_t
+serial_get_tx_data(uint8_t **pdata)
+{
+    uint_fast8_t tpos = transmit_pos, tmax = transmit_max;
+    if (tpos >= tmax)
+        return 0;
+    *pdata = &transmit_buf[tpos];
+    transmit_busy = tmax - tpos;
+    return transmit_busy;
+}
+
+// Tx dma complete interrupt - release the data sent by the dma.  The
+// data may have been copied to the start of transmit_buf while the
+// dma was sending it (see console_sendf()), so transmit_pos is
+// advanced relative to its current value.
+void
+serial_tx_data_done(void)
+{
+    transmit_pos += transmit_busy;
+    transmit_busy = 0;
+}
+
 // Remove from the receive buffer the given number of bytes
 static void
 console_pop_input(uint_fast8_t len)
 {
-    uint_fast8_t copied = 0;
-    for (;;) {
-        uint_fast8_t rpos = readb(&receive_pos);
-        uint_fast8_t needcopy = rpos - len;
-        if (needcopy) {
-            memmove(&receive_buf[copied], &receive_buf[copied + len]
-                    , needcopy - copied);
-            copied = needcopy;
-            sched_wake_tasks();
-        }
-        irqstatus_t flag = irq_save();
-        if (rpos != readb(&receive_pos)) {
-            // Raced with irq handler - retry
-            irq_restore(flag);
-            continue;
-        }
-        receive_pos = needcopy;
-        irq_restore(flag);
-        break;
-    }
+    uint_fast8_t start = receive_start + len;
+    if (start >= sizeof(receive_buf))
+        start -= sizeof(receive_buf);
+    irqstatus_t flag = irq_save();
+    receive_start = start;
+    uint_fast8_t count = receive_count - len;
+    receive_count = count;
+    irq_restore(flag);
+    if (count)
+        sched_wake_tasks();
 }
 
 // Process any incoming commands
 void
 console_task(void)
 {
-    uint_fast8_t rpos = readb(&receive_pos), pop_count;
-    int_fast8_t ret = command_find_block(receive_buf, rpos, &pop_count);
+    // Not on the stack as command_encode_ptr() can only encode
+    // pointers to static data on 64bit hosts (such as the simulator)
+    static uint8_t flatbuf[MESSAGE_MAX];
+    uint_fast8_t start = receive_start, count = readb(&receive_count);
+    uint8_t *buf = &receive_buf[start];
+    uint_fast8_t tail = sizeof(receive_buf) - start, pop_count;
+    if (count > tail) {
+        if (count > MESSAGE_MAX)
+            count = MESSAGE_MAX;
+        if (count > tail) {
+            // Block wraps around the end of the ring - copy it to flatbuf
+            memcpy(flatbuf, buf, tail);
+            memcpy(&flatbuf[tail], receive_buf, count - tail);
+            buf = flatbuf;
+        }
+    }
+    int_fast8_t ret = command_find_block(buf, count, &pop_count);
     if (ret > 0)
-        command_dispatch(receive_buf, pop_count);
+        command_dispatch(buf, pop_count);
     if (ret) {
         if (CONFIG_HAVE_BOOTLOADER_REQUEST && ret < 0 && pop_count == 32
-            && !memcmp(receive_buf, " \x1c Request Serial Bootloader!! ~", 32))
+            && !memcmp(buf, " \x1c Request Serial Bootloader!! ~", 32))
             bootloader_request();
         console_pop_input(pop_count);
         if (ret > 0)
@@ -105,14 +184,30 @@ console_sendf(const struct command_encoder *ce, va_list args)
         if (tmax + max_size - tpos > sizeof(transmit_buf))
             // Not enough space for message
             return;
-        // Disable TX irq and move buffer
-        writeb(&transmit_max, 0);
-        tpos = readb(&transmit_pos);
-        tmax -= tpos;
-        memmove(&transmit_buf[0], &transmit_buf[tpos], tmax);
-        writeb(&transmit_pos, 0);
-        writeb(&transmit_max, tmax);
-        serial_enable_tx_irq();
+        if (CONFIG_SERIAL_DMA) {
+            // Move buffer (without overwriting data the dma is sending)
+            irqstatus_t flag = irq_save();
+            tpos = transmit_pos;
+            if (transmit_busy && tmax - tpos + max_size > tpos) {
+                irq_restore(flag);
+                // Not enough space for message
+                return;
+            }
+            tmax -= tpos;
+            memmove(&transmit_buf[0], &transmit_buf[tpos], tmax);
+            transmit_pos = 0;
+            transmit_max = tmax;
+            irq_restore(flag);
+        } else {
+            // Disable TX irq and move buffer
+            writeb(&transmit_max, 0);
+            tpos = readb(&transmit_pos);
+            tmax -= tpos;
+            memmove(&transmit_buf[0], &transmit_buf[tpos], tmax);
+            writeb(&transmit_pos, 0);
+            writeb(&transmit_max, tmax);
+            serial_enable_tx_irq();
+        }
     }
 
     // Generate message
@@ -9,5 +9,8 @@ void serial_enable_tx_irq(void);
 // serial_irq.c
 void serial_rx_byte(uint_fast8_t data);
 int serial_get_tx_byte(uint8_t *pdata);
+void serial_rx_dma(const uint8_t *buf, uint_fast8_t size, uint_fast8_t pos);
+uint_fast8_t serial_get_tx_data(uint8_t **pdata);
+void serial_tx_data_done(void);
 
 #endif // serial_irq.h
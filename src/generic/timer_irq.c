@@ -37,7 +37,7 @@ static uint32_t timer_repeat_until;
 #define TIMER_DEFER_REPEAT_TICKS timer_from_us(5)
 
 // Invoke timers - called from board irq code.
-uint32_t
+uint32_t __hot_ram
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
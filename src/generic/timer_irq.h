@@ -1,6 +1,11 @@
 #ifndef __GENERIC_TIMER_IRQ_H
 #define __GENERIC_TIMER_IRQ_H
 
+#include <stdint.h> // uint32_t
+
 uint32_t timer_dispatch_many(void);
 
+// Board code (if CONFIG_SCHED_TIMER_CORE)
+void timer_core_check_shutdown(uint_fast8_t reason);
+
 #endif // timer_irq.h
@@ -1,6 +1,6 @@
 // Support for Linux "gs_usb" CANbus adapter emulation
 //
-// Copyright (C) 2018-2022  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -100,6 +100,17 @@ struct gs_host_frame {
  * Message sending
  ****************************************************************/
 
+// Use larger queues on chips with ram available (the Linux gs_usb
+// driver expects one frame per usb transfer, so bursts of traffic can
+// only be absorbed by queuing)
+#if CONFIG_RAM_SIZE >= 0x8000
+ #define HOST_QUEUE_SIZE 64
+ #define CANHW_QUEUE_SIZE 128
+#else
+ #define HOST_QUEUE_SIZE 16
+ #define CANHW_QUEUE_SIZE 32
+#endif
+
 // Global storage
 static struct usbcan_data {
     struct task_wake wake;
@@ -111,11 +122,11 @@ static struct usbcan_data {
     // Canbus data from host
     uint8_t host_status;
     uint32_t host_pull_pos, host_push_pos;
-    struct gs_host_frame host_frames[16];
+    struct gs_host_frame host_frames[HOST_QUEUE_SIZE];
 
     // Data from physical canbus interface
     uint32_t canhw_pull_pos, canhw_push_pos;
-    struct canbus_msg canhw_queue[32];
+    struct canbus_msg canhw_queue[CANHW_QUEUE_SIZE];
 } UsbCan;
 
 enum {
@@ -167,6 +178,11 @@ send_frame(struct canbus_msg *msg)
 static void
 drain_canhw_queue(void)
 {
+    if (UsbCan.notify_local) {
+        // Let local responses use the next usb packet
+        UsbCan.usb_send_busy = 0;
+        return;
+    }
     uint32_t pull_pos = UsbCan.canhw_pull_pos;
     for (;;) {
         uint32_t push_pos = readl(&UsbCan.canhw_push_pos);
@@ -281,7 +297,8 @@ canbus_send(struct canbus_msg *msg)
     int ret = send_frame(msg);
     if (ret < 0)
         goto retry_later;
-    if (UsbCan.notify_local && UsbCan.host_status)
+    if (UsbCan.notify_local)
+        // Resume sending of pending hw and echo frames
         canbus_notify_tx();
     UsbCan.notify_local = 0;
     return msg->dlc;
@@ -669,7 +686,7 @@ usb_state_ready(void)
 }
 
 // State tracking dispatch
-static struct task_wake usb_ep0_wake;
+DECL_TASK_WAKE(usb_ep0_wake);
 
 void
 usb_notify_ep0(void)
@@ -687,7 +704,7 @@ usb_ep0_task(void)
     else
         usb_state_ready();
 }
-DECL_TASK(usb_ep0_task);
+DECL_WAKE_TASK(usb_ep0_task, usb_ep0_wake);
 
 void
 usb_shutdown(void)
@@ -30,7 +30,7 @@
  * Message block sending
  ****************************************************************/
 
-static struct task_wake usb_bulk_in_wake;
+DECL_TASK_WAKE(usb_bulk_in_wake);
 static uint8_t transmit_buf[192], transmit_pos;
 
 void
@@ -44,22 +44,25 @@ usb_bulk_in_task(void)
 {
     if (!sched_check_wake(&usb_bulk_in_wake))
         return;
-    uint_fast8_t tpos = transmit_pos;
-    if (!tpos)
-        return;
-    uint_fast8_t max_tpos = (tpos > USB_CDC_EP_BULK_IN_SIZE
-                             ? USB_CDC_EP_BULK_IN_SIZE : tpos);
-    int_fast8_t ret = usb_send_bulk_in(transmit_buf, max_tpos);
-    if (ret <= 0)
-        return;
-    uint_fast8_t needcopy = tpos - ret;
-    if (needcopy) {
-        memmove(transmit_buf, &transmit_buf[ret], needcopy);
-        usb_notify_bulk_in();
+    // Fill all packet buffers that the hardware has available
+    uint_fast8_t tpos = transmit_pos, spos = 0;
+    while (spos < tpos) {
+        uint_fast8_t len = tpos - spos;
+        if (len > USB_CDC_EP_BULK_IN_SIZE)
+            len = USB_CDC_EP_BULK_IN_SIZE;
+        int_fast8_t ret = usb_send_bulk_in(&transmit_buf[spos], len);
+        if (ret <= 0)
+            break;
+        spos += ret;
     }
+    if (!spos)
+        return;
+    uint_fast8_t needcopy = tpos - spos;
+    if (needcopy)
+        memmove(transmit_buf, &transmit_buf[spos], needcopy);
     transmit_pos = needcopy;
 }
-DECL_TASK(usb_bulk_in_task);
+DECL_WAKE_TASK(usb_bulk_in_task, usb_bulk_in_wake);
 
 // Encode and transmit a "response" message
 void
@@ -85,8 +88,8 @@ console_sendf(const struct command_encoder *ce, va_list args)
  * Message block reading
  ****************************************************************/
 
-static struct task_wake usb_bulk_out_wake;
-static uint8_t receive_buf[128], receive_pos;
+DECL_TASK_WAKE(usb_bulk_out_wake);
+static uint8_t receive_buf[CONFIG_MACH_AVR ? 128 : 192], receive_pos;
 
 void
 usb_notify_bulk_out(void)
@@ -99,32 +102,37 @@ usb_bulk_out_task(void)
 {
     if (!sched_check_wake(&usb_bulk_out_wake))
         return;
-    // Read data
-    uint_fast8_t rpos = receive_pos, pop_count;
-    if (rpos + USB_CDC_EP_BULK_OUT_SIZE <= sizeof(receive_buf)) {
-        int_fast8_t ret = usb_read_bulk_out(
-            &receive_buf[rpos], USB_CDC_EP_BULK_OUT_SIZE);
-        if (ret > 0) {
-            rpos += ret;
+    // Read all packets that the hardware has available
+    uint_fast8_t rpos = receive_pos, pos = 0, pop_count;
+    for (;;) {
+        if (rpos + USB_CDC_EP_BULK_OUT_SIZE > sizeof(receive_buf)) {
             usb_notify_bulk_out();
+            break;
         }
-    } else {
-        usb_notify_bulk_out();
+        int_fast8_t ret = usb_read_bulk_out(
+            &receive_buf[rpos], USB_CDC_EP_BULK_OUT_SIZE);
+        if (ret < 0)
+            break;
+        rpos += ret;
+    }
+    // Process message blocks
+    while (pos < rpos) {
+        int_fast8_t ret = command_find_and_dispatch(
+            &receive_buf[pos], rpos - pos, &pop_count);
+        if (!ret)
+            break;
+        pos += pop_count;
     }
-    // Process a message block
-    int_fast8_t ret = command_find_and_dispatch(receive_buf, rpos, &pop_count);
-    if (ret) {
+    if (pos) {
         // Move buffer
-        uint_fast8_t needcopy = rpos - pop_count;
-        if (needcopy) {
-            memmove(receive_buf, &receive_buf[pop_count], needcopy);
-            usb_notify_bulk_out();
-        }
+        uint_fast8_t needcopy = rpos - pos;
+        if (needcopy)
+            memmove(receive_buf, &receive_buf[pos], needcopy);
         rpos = needcopy;
     }
     receive_pos = rpos;
 }
-DECL_TASK(usb_bulk_out_task);
+DECL_WAKE_TASK(usb_bulk_out_task, usb_bulk_out_wake);
 
 
 /****************************************************************
@@ -507,7 +515,7 @@ usb_state_ready(void)
 }
 
 // State tracking dispatch
-static struct task_wake usb_ep0_wake;
+DECL_TASK_WAKE(usb_ep0_wake);
 
 void
 usb_notify_ep0(void)
@@ -525,7 +533,7 @@ usb_ep0_task(void)
     else
         usb_state_ready();
 }
-DECL_TASK(usb_ep0_task);
+DECL_WAKE_TASK(usb_ep0_task, usb_ep0_wake);
 
 void
 usb_shutdown(void)
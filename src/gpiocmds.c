@@ -9,6 +9,7 @@
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_is_before
 #include "command.h" // DECL_COMMAND
+#include "pid_heater.h" // digital_out_update_pwm
 #include "sched.h" // sched_add_timer
 
 struct digital_out_s {
@@ -122,7 +123,7 @@ command_config_digital_out(uint32_t *args)
     d->pin = pin;
     d->flags = (args[2] ? DF_ON : 0) | (args[3] ? DF_DEFAULT_ON : 0);
     d->max_duration = args[4];
-    move_queue_setup(&d->mq, sizeof(struct digital_move));
+    move_queue_setup(&d->mq, sizeof(struct digital_move), args[0]);
 }
 DECL_COMMAND(command_config_digital_out,
              "config_digital_out oid=%c pin=%u value=%c"
@@ -141,13 +142,18 @@ command_set_digital_out_pwm_cycle(uint32_t *args)
 DECL_COMMAND(command_set_digital_out_pwm_cycle,
              "set_digital_out_pwm_cycle oid=%c cycle_ticks=%u");
 
-void
-command_queue_digital_out(uint32_t *args)
+struct digital_out_s *
+digital_out_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_digital_out);
+}
+
+static void
+digital_out_queue(struct digital_out_s *d, uint32_t time, uint32_t on_ticks)
 {
-    struct digital_out_s *d = oid_lookup(args[0], command_config_digital_out);
     struct digital_move *m = move_alloc();
-    uint32_t time = m->waketime = args[1];
-    m->on_duration = args[2];
+    m->waketime = time;
+    m->on_duration = on_ticks;
 
     irq_disable();
     int first_on_queue = move_queue_push(&m->node, &d->mq);
@@ -171,9 +177,33 @@ command_queue_digital_out(uint32_t *args)
     }
     irq_enable();
 }
+
+void
+command_queue_digital_out(uint32_t *args)
+{
+    struct digital_out_s *d = oid_lookup(args[0], command_config_digital_out);
+    digital_out_queue(d, args[1], args[2]);
+}
 DECL_COMMAND(command_queue_digital_out,
              "queue_digital_out oid=%c clock=%u on_ticks=%u");
 
+// Schedule a soft pwm update from local code (such as pid_heater.c)
+void
+digital_out_update_pwm(struct digital_out_s *d, uint32_t on_ticks)
+{
+    // Apply shortly from now, but never before an already queued update
+    uint32_t time = timer_read_time() + timer_from_us(1000);
+    irq_disable();
+    if (!move_queue_empty(&d->mq)) {
+        struct digital_move *m = container_of(d->mq.last, struct digital_move
+                                              , node);
+        if (!timer_is_before(m->waketime, time))
+            time = m->waketime + 1;
+    }
+    irq_enable();
+    digital_out_queue(d, time, on_ticks);
+}
+
 void
 command_update_digital_out(uint32_t *args)
 {
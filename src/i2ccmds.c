@@ -10,6 +10,8 @@
 #include "command.h"  //sendf
 #include "sched.h" //DECL_COMMAND
 #include "board/gpio.h" //i2c_write/read/setup
+#include "board/io.h" // readb
+#include "board/irq.h" // irq_poll
 #include "i2c_software.h" // i2c_software_setup
 #include "i2ccmds.h"
 
@@ -63,8 +65,11 @@ void i2c_shutdown_on_err(int ret)
     }
 }
 
+static void i2c_async_wait(void);
+
 int i2c_dev_write(struct i2cdev_s *i2c, uint8_t write_len, uint8_t *data)
 {
+    i2c_async_wait();
     uint_fast8_t flags = i2c->flags;
     if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
         return i2c_software_write(i2c->i2c_sw, write_len, data);
@@ -86,6 +91,7 @@ DECL_COMMAND(command_i2c_write, "i2c_write oid=%c data=%*s");
 int i2c_dev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
                   , uint8_t read_len, uint8_t *read)
 {
+    i2c_async_wait();
     uint_fast8_t flags = i2c->flags;
     if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
         return i2c_software_read(i2c->i2c_sw, reg_len, reg, read_len, read);
@@ -106,3 +112,148 @@ void command_i2c_read(uint32_t *args)
     sendf("i2c_read_response oid=%c response=%*s", oid, data_len, data);
 }
 DECL_COMMAND(command_i2c_read, "i2c_read oid=%c reg=%*s read_len=%u");
+
+
+/****************************************************************
+ * Asynchronous transfers
+ ****************************************************************/
+
+// Asynchronous transfers are queued and run one at a time.  If the
+// board supports interrupt driven transfers (CONFIG_GPIO_I2C_ASYNC)
+// then hardware busses are started with i2c_async_start() and
+// i2c_async_done() is called (from irq context) on completion.
+// Otherwise the transfer is run from i2c_async_task().  The
+// transfer's callback is always invoked from task context.
+
+static struct i2c_xfer *xfer_first, **xfer_lastp = &xfer_first;
+
+DECL_TASK_WAKE(i2c_async_wake);
+
+static void
+i2c_async_queue(struct i2c_xfer *x, uint8_t flags)
+{
+    if (x->flags & IXF_QUEUED)
+        shutdown("i2c transfer already queued");
+    x->flags = flags | IXF_QUEUED;
+    x->next = NULL;
+    *xfer_lastp = x;
+    xfer_lastp = &x->next;
+    sched_wake_task(&i2c_async_wake);
+}
+
+// Queue a register read - x->callback is invoked on completion
+void
+i2c_dev_read_async(struct i2cdev_s *i2c, struct i2c_xfer *x
+                   , uint8_t reg_len, uint8_t *reg
+                   , uint8_t read_len, uint8_t *read)
+{
+    x->i2c = i2c;
+    x->reg_len = reg_len;
+    x->reg = reg;
+    x->data_len = read_len;
+    x->data = read;
+    i2c_async_queue(x, IXF_READ);
+}
+
+// Queue a write - x->callback is invoked on completion
+void
+i2c_dev_write_async(struct i2cdev_s *i2c, struct i2c_xfer *x
+                    , uint8_t write_len, uint8_t *data)
+{
+    x->i2c = i2c;
+    x->reg_len = 0;
+    x->data_len = write_len;
+    x->data = data;
+    i2c_async_queue(x, 0);
+}
+
+// Note completion of a transfer started with i2c_async_start()
+void
+i2c_async_done(struct i2c_xfer *x, int ret)
+{
+    x->ret = ret;
+    writeb(&x->flags, x->flags | IXF_DONE);
+    sched_wake_task(&i2c_async_wake);
+}
+
+// Wait for an in progress hardware transfer to complete
+static void
+i2c_async_wait(void)
+{
+    struct i2c_xfer *x = xfer_first;
+    if (!CONFIG_GPIO_I2C_ASYNC || !x || !(x->flags & IXF_ACTIVE))
+        return;
+    while (!(readb(&x->flags) & IXF_DONE))
+        irq_poll();
+}
+
+// Remove a transfer from the queue (its callback will not be invoked)
+void
+i2c_async_cancel(struct i2c_xfer *x)
+{
+    if (!(x->flags & IXF_QUEUED))
+        return;
+    i2c_async_wait();
+    struct i2c_xfer **pprev = &xfer_first;
+    while (*pprev != x)
+        pprev = &(*pprev)->next;
+    *pprev = x->next;
+    if (xfer_lastp == &x->next)
+        xfer_lastp = pprev;
+    x->flags = 0;
+    sched_wake_task(&i2c_async_wake);
+}
+
+static int
+i2c_async_run(struct i2c_xfer *x)
+{
+    if (x->flags & IXF_READ)
+        return i2c_dev_read(x->i2c, x->reg_len, x->reg, x->data_len, x->data);
+    return i2c_dev_write(x->i2c, x->data_len, x->data);
+}
+
+void
+i2c_async_task(void)
+{
+    if (!sched_check_wake(&i2c_async_wake))
+        return;
+    struct i2c_xfer *x = xfer_first;
+    if (!x)
+        return;
+    uint_fast8_t flags = readb(&x->flags);
+    int ret;
+    if (flags & IXF_ACTIVE) {
+        if (!(flags & IXF_DONE))
+            // Hardware transfer still in progress
+            return;
+        ret = x->ret;
+    } else if (CONFIG_GPIO_I2C_ASYNC
+               && !(CONFIG_WANT_SOFTWARE_I2C && x->i2c->flags & IF_SOFTWARE)) {
+        x->flags = flags | IXF_ACTIVE;
+        i2c_async_start(x->i2c->i2c_hw, x);
+        return;
+    } else {
+        ret = i2c_async_run(x);
+    }
+
+    // Transfer complete - remove from queue and invoke callback
+    xfer_first = x->next;
+    if (!xfer_first)
+        xfer_lastp = &xfer_first;
+    x->flags = 0;
+    x->callback(x, ret);
+    if (xfer_first)
+        sched_wake_task(&i2c_async_wake);
+}
+DECL_WAKE_TASK(i2c_async_task, i2c_async_wake);
+
+void
+i2c_async_shutdown(void)
+{
+    struct i2c_xfer *x;
+    for (x = xfer_first; x; x = x->next)
+        x->flags = 0;
+    xfer_first = NULL;
+    xfer_lastp = &xfer_first;
+}
+DECL_SHUTDOWN(i2c_async_shutdown);
@@ -28,4 +28,29 @@ int i2c_dev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
 int i2c_dev_write(struct i2cdev_s *i2c, uint8_t write_len, uint8_t *data);
 void i2c_shutdown_on_err(int ret);
 
+// Asynchronous i2c transfer (see i2c_dev_read_async())
+struct i2c_xfer {
+    struct i2c_xfer *next;
+    struct i2cdev_s *i2c;
+    void (*callback)(struct i2c_xfer *x, int ret);
+    uint8_t *reg, *data;
+    uint8_t reg_len, data_len, flags;
+    int8_t ret;
+};
+
+enum {
+    IXF_READ = 1<<0, IXF_QUEUED = 1<<1, IXF_ACTIVE = 1<<2, IXF_DONE = 1<<3,
+};
+
+void i2c_dev_read_async(struct i2cdev_s *i2c, struct i2c_xfer *x
+                        , uint8_t reg_len, uint8_t *reg
+                        , uint8_t read_len, uint8_t *read);
+void i2c_dev_write_async(struct i2cdev_s *i2c, struct i2c_xfer *x
+                         , uint8_t write_len, uint8_t *data);
+void i2c_async_cancel(struct i2c_xfer *x);
+void i2c_async_done(struct i2c_xfer *x, int ret);
+
+// Board code (if CONFIG_GPIO_I2C_ASYNC)
+void i2c_async_start(struct i2c_config config, struct i2c_xfer *x);
+
 #endif
@@ -1,23 +1,35 @@
 // Commands for sending messages to a 4-bit hd44780 lcd driver
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include "autoconf.h" // CONFIG_MACH_AVR
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // gpio_out_write
+#include "board/io.h" // readb
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_from_us
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_SHUTDOWN
 
+// Bytes are queued and transmitted from a timer so that the command
+// handlers do not need to wait for the chip between bytes
+#define QUEUE_SIZE (CONFIG_MACH_AVR ? 32 : 64)
+DECL_CONSTANT("HD44780_QUEUE_SIZE", QUEUE_SIZE);
+
 struct hd44780 {
+    struct timer timer;
     uint32_t last_cmd_time, cmd_wait_ticks;
     uint8_t last;
     struct gpio_out rs, e, d4, d5, d6, d7;
+    uint8_t active, queue_pos, queue_count;
+    uint16_t queue[QUEUE_SIZE];
 };
 
+// Queue entry flag for data bytes (transmitted with the rs pin high)
+#define QF_DATA (1<<8)
+
 
 /****************************************************************
  * Transmit functions
@@ -37,7 +49,7 @@ ndelay(uint32_t nsecs)
         return;
     uint32_t end = timer_read_time() + nsecs_to_ticks(nsecs);
     while (timer_is_before(timer_read_time(), end))
-        irq_poll();
+        ;
 }
 
 // Write 4 bits to the hd44780 using the 4bit parallel interface
@@ -69,19 +81,48 @@ hd44780_xmit_byte(struct hd44780 *h, uint8_t data)
     hd44780_xmit_bits(data ^ h->last, e, d4, d5, d6, d7);
 }
 
-// Transmit a series of bytes to the chip
+// Timer callback that transmits the byte at the head of the queue
+static uint_fast8_t
+hd44780_event(struct timer *t)
+{
+    struct hd44780 *h = container_of(t, struct hd44780, timer);
+    uint16_t entry = h->queue[h->queue_pos];
+    gpio_out_write(h->rs, !!(entry & QF_DATA));
+    ndelay(40);
+    hd44780_xmit_byte(h, entry);
+    h->last_cmd_time = timer_read_time();
+    h->queue_pos = (h->queue_pos + 1) % QUEUE_SIZE;
+    if (!--h->queue_count) {
+        h->active = 0;
+        return SF_DONE;
+    }
+    h->timer.waketime = h->last_cmd_time + h->cmd_wait_ticks;
+    return SF_RESCHEDULE;
+}
+
+// Add a series of command (or data) bytes to the transmit queue
 static void
-hd44780_xmit(struct hd44780 *h, uint8_t len, uint8_t *data)
+hd44780_queue(struct hd44780 *h, uint8_t len, uint8_t *data, uint16_t flags)
 {
-    uint32_t last_cmd_time=h->last_cmd_time, cmd_wait_ticks=h->cmd_wait_ticks;
     while (len--) {
-        uint8_t b = *data++;
-        while (timer_read_time() - last_cmd_time < cmd_wait_ticks)
+        // Wait for space in the queue
+        while (readb(&h->queue_count) >= QUEUE_SIZE)
             irq_poll();
-        hd44780_xmit_byte(h, b);
-        last_cmd_time = timer_read_time();
+        irq_disable();
+        uint8_t pos = (h->queue_pos + h->queue_count) % QUEUE_SIZE;
+        h->queue[pos] = *data++ | flags;
+        h->queue_count++;
+        if (!h->active) {
+            // Start transmitting
+            h->active = 1;
+            uint32_t cur = timer_read_time(), lct = h->last_cmd_time;
+            uint32_t wait_ticks = h->cmd_wait_ticks;
+            h->timer.waketime = (cur - lct < wait_ticks
+                                 ? lct + wait_ticks : cur);
+            sched_add_timer(&h->timer);
+        }
+        irq_enable();
     }
-    h->last_cmd_time = last_cmd_time;
 }
 
 
@@ -99,6 +140,7 @@ command_config_hd44780(uint32_t *args)
     h->d5 = gpio_out_setup(args[4], 0);
     h->d6 = gpio_out_setup(args[5], 0);
     h->d7 = gpio_out_setup(args[6], 0);
+    h->timer.func = hd44780_event;
 
     if (!CONFIG_HAVE_STRICT_TIMING) {
         h->cmd_wait_ticks = args[7];
@@ -123,9 +165,8 @@ void
 command_hd44780_send_cmds(uint32_t *args)
 {
     struct hd44780 *h = oid_lookup(args[0], command_config_hd44780);
-    gpio_out_write(h->rs, 0);
     uint8_t len = args[1], *cmds = command_decode_ptr(args[2]);
-    hd44780_xmit(h, len, cmds);
+    hd44780_queue(h, len, cmds, 0);
 }
 DECL_COMMAND(command_hd44780_send_cmds, "hd44780_send_cmds oid=%c cmds=%*s");
 
@@ -133,9 +174,8 @@ void
 command_hd44780_send_data(uint32_t *args)
 {
     struct hd44780 *h = oid_lookup(args[0], command_config_hd44780);
-    gpio_out_write(h->rs, 1);
     uint8_t len = args[1], *data = command_decode_ptr(args[2]);
-    hd44780_xmit(h, len, data);
+    hd44780_queue(h, len, data, QF_DATA);
 }
 DECL_COMMAND(command_hd44780_send_data, "hd44780_send_data oid=%c data=%*s");
 
@@ -152,6 +192,7 @@ hd44780_shutdown(void)
         gpio_out_write(h->d6, 0);
         gpio_out_write(h->d7, 0);
         h->last = 0;
+        h->active = h->queue_count = 0;
     }
 }
 DECL_SHUTDOWN(hd44780_shutdown);
@@ -1,22 +1,34 @@
 // Commands for sending messages to an st7920 lcd driver
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include "autoconf.h" // CONFIG_MACH_AVR
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // gpio_out_write
+#include "board/io.h" // readb
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // timer_from_us
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_SHUTDOWN
 
+// Bytes are queued and transmitted from a timer so that the command
+// handlers do not need to wait for the chip between bytes
+#define QUEUE_SIZE (CONFIG_MACH_AVR ? 32 : 64)
+DECL_CONSTANT("ST7920_QUEUE_SIZE", QUEUE_SIZE);
+
 struct st7920 {
+    struct timer timer;
     uint32_t last_cmd_time, sync_wait_ticks, cmd_wait_ticks;
     struct gpio_out sclk, sid;
+    uint8_t active, queue_pos, queue_count;
+    uint16_t queue[QUEUE_SIZE];
 };
 
+// Queue entry flags (the first byte of each message has QF_SYNC set)
+enum { QF_SYNC = 1<<8, QF_DATA = 1<<9 };
+
 
 /****************************************************************
  * Transmit functions
@@ -36,7 +48,7 @@ ndelay(uint32_t nsecs)
         return;
     uint32_t end = timer_read_time() + nsecs_to_ticks(nsecs);
     while (timer_is_before(timer_read_time(), end))
-        irq_poll();
+        ;
 }
 
 #define SYNC_CMD  0xf8
@@ -61,36 +73,66 @@ st7920_xmit_byte(struct st7920 *s, uint8_t data)
     }
 }
 
-// Transmit a series of command bytes to the chip
-static void
-st7920_xmit(struct st7920 *s, uint8_t count, uint8_t *cmds)
+// Send the sync byte (if needed) and the high bits of the byte at the
+// head of the queue - returns the ticks to wait before the low bits
+static uint32_t
+st7920_xmit_start(struct st7920 *s)
 {
-    if (!count)
-        return;
+    uint16_t entry = s->queue[s->queue_pos];
+    uint32_t wait_ticks = s->cmd_wait_ticks;
+    if (entry & QF_SYNC) {
+        st7920_xmit_byte(s, entry & QF_DATA ? SYNC_DATA : SYNC_CMD);
+        wait_ticks = s->sync_wait_ticks;
+    }
+    st7920_xmit_byte(s, entry & 0xf0);
+    return wait_ticks;
+}
 
-    // Send first byte (with longer delay)
-    uint32_t last_cmd_time = s->last_cmd_time, wait_ticks = s->sync_wait_ticks;
-    uint8_t cmd = *cmds++;
-    st7920_xmit_byte(s, cmd & 0xf0);
-    while (timer_read_time() - last_cmd_time < wait_ticks)
-        // Can't complete transfer until delay complete
-        irq_poll();
-    st7920_xmit_byte(s, cmd << 4);
-    last_cmd_time = timer_read_time();
-
-    // Send subsequent bytes
-    wait_ticks = s->cmd_wait_ticks;
-    while (--count) {
-        uint8_t cmd = *cmds++;
-        st7920_xmit_byte(s, cmd & 0xf0);
-        while (timer_read_time() - last_cmd_time < wait_ticks)
-            // Can't complete transfer until delay complete
-            irq_poll();
-        st7920_xmit_byte(s, cmd << 4);
-        last_cmd_time = timer_read_time();
+// Timer callback that completes the byte at the head of the queue
+static uint_fast8_t
+st7920_event(struct timer *t)
+{
+    struct st7920 *s = container_of(t, struct st7920, timer);
+    st7920_xmit_byte(s, s->queue[s->queue_pos] << 4);
+    s->last_cmd_time = timer_read_time();
+    s->queue_pos = (s->queue_pos + 1) % QUEUE_SIZE;
+    if (!--s->queue_count) {
+        s->active = 0;
+        return SF_DONE;
     }
+    s->timer.waketime = s->last_cmd_time + st7920_xmit_start(s);
+    return SF_RESCHEDULE;
+}
 
-    s->last_cmd_time = last_cmd_time;
+// Add a series of command (or data) bytes to the transmit queue
+static void
+st7920_queue(struct st7920 *s, uint8_t count, uint8_t *cmds, uint16_t flags)
+{
+    flags |= QF_SYNC;
+    while (count--) {
+        // Wait for space in the queue
+        while (readb(&s->queue_count) >= QUEUE_SIZE)
+            irq_poll();
+        irq_disable();
+        uint8_t pos = (s->queue_pos + s->queue_count) % QUEUE_SIZE;
+        s->queue[pos] = *cmds++ | flags;
+        s->queue_count++;
+        flags = 0;
+        if (s->active) {
+            irq_enable();
+            continue;
+        }
+        s->active = 1;
+        irq_enable();
+
+        // Start transmitting
+        uint32_t wait_ticks = st7920_xmit_start(s);
+        uint32_t cur = timer_read_time(), lct = s->last_cmd_time;
+        irq_disable();
+        s->timer.waketime = cur - lct < wait_ticks ? lct + wait_ticks : cur;
+        sched_add_timer(&s->timer);
+        irq_enable();
+    }
 }
 
 
@@ -105,6 +147,7 @@ command_config_st7920(uint32_t *args)
     s->sclk = gpio_out_setup(args[2], 0);
     s->sid = gpio_out_setup(args[3], 0);
     gpio_out_setup(args[1], 1);
+    s->timer.func = st7920_event;
 
     if (!CONFIG_HAVE_STRICT_TIMING) {
         s->sync_wait_ticks = args[4];
@@ -136,9 +179,8 @@ void
 command_st7920_send_cmds(uint32_t *args)
 {
     struct st7920 *s = oid_lookup(args[0], command_config_st7920);
-    st7920_xmit_byte(s, SYNC_CMD);
     uint8_t len = args[1], *cmds = command_decode_ptr(args[2]);
-    st7920_xmit(s, len, cmds);
+    st7920_queue(s, len, cmds, 0);
 }
 DECL_COMMAND(command_st7920_send_cmds, "st7920_send_cmds oid=%c cmds=%*s");
 
@@ -146,9 +188,8 @@ void
 command_st7920_send_data(uint32_t *args)
 {
     struct st7920 *s = oid_lookup(args[0], command_config_st7920);
-    st7920_xmit_byte(s, SYNC_DATA);
     uint8_t len = args[1], *data = command_decode_ptr(args[2]);
-    st7920_xmit(s, len, data);
+    st7920_queue(s, len, data, QF_DATA);
 }
 DECL_COMMAND(command_st7920_send_data, "st7920_send_data oid=%c data=%*s");
 
@@ -158,6 +199,7 @@ st7920_shutdown(void)
     uint8_t i;
     struct st7920 *s;
     foreach_oid(i, s, command_config_st7920) {
+        s->active = s->queue_count = 0;
         gpio_out_write(s->sclk, 0);
         gpio_out_write(s->sid, 0);
     }
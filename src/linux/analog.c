@@ -1,13 +1,17 @@
 // Read analog values from Linux IIO device
 //
-// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <errno.h> // errno
 #include <fcntl.h> // open
+#include <poll.h> // poll
 #include <stdio.h> // snprintf
 #include <stdlib.h> // atoi
+#include <string.h> // strlen
 #include <unistd.h> // read
+#include "autoconf.h" // CONFIG_ADC_CONTINUOUS
 #include "command.h" // shutdown
 #include "gpio.h" // gpio_adc_setup
 #include "internal.h" // report_errno
@@ -16,10 +20,231 @@
 DECL_CONSTANT("ADC_MAX", 4095); // Assume 12bit adc
 
 #define ANALOG_START (1<<12)
+#define ANALOG_COUNT 8
 
-DECL_ENUMERATION_RANGE("pin", "analog0", ANALOG_START, 8);
+DECL_ENUMERATION_RANGE("pin", "analog0", ANALOG_START, ANALOG_COUNT);
 
-#define IIO_PATH "/sys/bus/iio/devices/iio:device0/in_voltage%d_raw"
+#define IIO_DIR "/sys/bus/iio/devices/iio:device0/"
+#define IIO_PATH IIO_DIR "in_voltage%d_raw"
+
+#if CONFIG_ADC_CONTINUOUS
+
+
+/****************************************************************
+ * IIO buffered capture
+ ****************************************************************/
+
+// The configured channels are captured using the iio device buffer
+// (the device must have a trigger assigned) and each read reports the
+// average of the most recent samples.
+
+#define IIO_DEV "/dev/iio:device0"
+#define ADC_OVERSAMPLE 8
+
+struct adc_chan_fmt {
+    uint8_t offset, bytes, bits, shift, is_signed, is_be;
+};
+
+static struct {
+    int fd;
+    uint8_t chans, scan_size, count, pos;
+    struct adc_chan_fmt fmt[ANALOG_COUNT];
+    uint16_t buf[ADC_OVERSAMPLE][ANALOG_COUNT];
+} AdcScan = { .fd = -1 };
+
+// Write a string to an iio sysfs attribute
+static int
+adc_sysfs_write(const char *name, int chan, const char *val)
+{
+    char fname[256];
+    snprintf(fname, sizeof(fname), name, chan);
+    int fd = open(fname, O_WRONLY|O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int ret = write(fd, val, strlen(val));
+    close(fd);
+    return ret < 0 ? -1 : 0;
+}
+
+// Read an iio sysfs attribute
+static int
+adc_sysfs_read(const char *name, int chan, char *buf, int len)
+{
+    char fname[256];
+    snprintf(fname, sizeof(fname), name, chan);
+    int fd = open(fname, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int ret = read(fd, buf, len - 1);
+    close(fd);
+    if (ret <= 0)
+        return -1;
+    buf[ret] = '\0';
+    return 0;
+}
+
+// Determine the layout of the enabled channels in each scan
+static int
+adc_scan_layout(void)
+{
+    int index[ANALOG_COUNT], order[ANALOG_COUNT], count = 0, i, j;
+    for (i=0; i<ANALOG_COUNT; i++) {
+        if (!(AdcScan.chans & (1 << i)))
+            continue;
+        char buf[64];
+        if (adc_sysfs_read(IIO_DIR "scan_elements/in_voltage%d_index", i
+                           , buf, sizeof(buf)))
+            return -1;
+        index[i] = atoi(buf);
+        // Parse a type description such as "le:s12/16>>4"
+        if (adc_sysfs_read(IIO_DIR "scan_elements/in_voltage%d_type", i
+                           , buf, sizeof(buf)))
+            return -1;
+        char endian, sign;
+        unsigned int bits, storage, shift;
+        if (sscanf(buf, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage
+                   , &shift) != 5 || !bits || bits > 16 || (storage != 8
+                   && storage != 16 && storage != 32))
+            return -1;
+        struct adc_chan_fmt *f = &AdcScan.fmt[i];
+        f->bytes = storage / 8;
+        f->bits = bits;
+        f->shift = shift;
+        f->is_signed = sign == 's';
+        f->is_be = endian == 'b';
+        // Sort by scan index
+        for (j=count; j > 0 && index[order[j-1]] > index[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+        count++;
+    }
+    // Each element is aligned to its storage size
+    int offset = 0, align = 1;
+    for (j=0; j<count; j++) {
+        struct adc_chan_fmt *f = &AdcScan.fmt[order[j]];
+        offset = (offset + f->bytes - 1) / f->bytes * f->bytes;
+        f->offset = offset;
+        offset += f->bytes;
+        if (f->bytes > align)
+            align = f->bytes;
+    }
+    AdcScan.scan_size = (offset + align - 1) / align * align;
+    return 0;
+}
+
+// Enable the configured channels and start the iio buffer
+static void
+adc_scan_start(void)
+{
+    adc_sysfs_write(IIO_DIR "buffer/enable", 0, "0");
+    adc_sysfs_write(IIO_DIR "scan_elements/in_timestamp_en", 0, "0");
+    int i;
+    for (i=0; i<ANALOG_COUNT; i++) {
+        int is_used = AdcScan.chans & (1 << i);
+        if (adc_sysfs_write(IIO_DIR "scan_elements/in_voltage%d_en", i
+                            , is_used ? "1" : "0") && is_used)
+            goto fail;
+    }
+    if (adc_scan_layout()
+        || adc_sysfs_write(IIO_DIR "buffer/length", 0, "64")
+        || adc_sysfs_write(IIO_DIR "buffer/enable", 0, "1"))
+        goto fail;
+    int fd = open(IIO_DEV, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0)
+        goto fail;
+    AdcScan.fd = fd;
+    // Wait for the first samples so that initial reads are valid
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 1000) <= 0)
+        shutdown("No adc buffer data (is an iio trigger assigned?)");
+    return;
+fail:
+    report_errno("adc buffer setup", -1);
+    shutdown("Unable to start adc buffer");
+}
+
+// Extract a channel value from a scan
+static uint16_t
+adc_scan_decode(struct adc_chan_fmt *f, uint8_t *scan)
+{
+    uint8_t *p = &scan[f->offset];
+    uint32_t v = 0;
+    int i;
+    for (i=0; i<f->bytes; i++)
+        v = (v << 8) | p[f->is_be ? i : f->bytes - 1 - i];
+    v = (v >> f->shift) & ((1 << f->bits) - 1);
+    if (f->is_signed && v & (1 << (f->bits - 1)))
+        // Negative readings are reported as zero
+        return 0;
+    return v;
+}
+
+// Store all available scans
+static void
+adc_scan_update(void)
+{
+    if (AdcScan.fd < 0)
+        adc_scan_start();
+    uint8_t data[1024];
+    for (;;) {
+        int ret = read(AdcScan.fd, data, sizeof(data));
+        if (ret <= 0) {
+            if (ret < 0 && errno != EAGAIN) {
+                report_errno("adc buffer read", ret);
+                try_shutdown("Error on analog read");
+            }
+            return;
+        }
+        uint8_t *scan;
+        for (scan = data; scan + AdcScan.scan_size <= &data[ret]
+                 ; scan += AdcScan.scan_size) {
+            uint16_t *buf = AdcScan.buf[AdcScan.pos];
+            int i;
+            for (i=0; i<ANALOG_COUNT; i++)
+                if (AdcScan.chans & (1 << i))
+                    buf[i] = adc_scan_decode(&AdcScan.fmt[i], scan);
+            AdcScan.pos = (AdcScan.pos + 1) % ADC_OVERSAMPLE;
+            if (AdcScan.count < ADC_OVERSAMPLE)
+                AdcScan.count++;
+        }
+    }
+}
+
+struct gpio_adc
+gpio_adc_setup(uint32_t pin)
+{
+    uint32_t chan = pin - ANALOG_START;
+    if (chan >= ANALOG_COUNT || AdcScan.fd >= 0)
+        shutdown("Unable to open adc device");
+    AdcScan.chans |= 1 << chan;
+    return (struct gpio_adc){ .fd = -1, .chan = chan };
+}
+
+// Try to sample a value - always ready when scanning continuously
+uint32_t
+gpio_adc_sample(struct gpio_adc g)
+{
+    return 0;
+}
+
+// Return the average of the most recent samples of a channel
+uint16_t
+gpio_adc_read(struct gpio_adc g)
+{
+    adc_scan_update();
+    uint32_t sum = 0;
+    int i;
+    for (i=0; i<AdcScan.count; i++)
+        sum += AdcScan.buf[i][g.chan];
+    return AdcScan.count ? sum / AdcScan.count : 0;
+}
+
+void
+gpio_adc_cancel_sample(struct gpio_adc g)
+{
+}
+
+#else // !CONFIG_ADC_CONTINUOUS
 
 struct gpio_adc
 gpio_adc_setup(uint32_t pin)
@@ -66,3 +291,5 @@ void
 gpio_adc_cancel_sample(struct gpio_adc g)
 {
 }
+
+#endif // !CONFIG_ADC_CONTINUOUS
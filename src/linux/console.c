@@ -1,17 +1,20 @@
-// TTY based IO
+// TTY (or unix socket or udp) based IO
 //
-// Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #define _GNU_SOURCE
 #include <errno.h> // errno
 #include <fcntl.h> // fcntl
-#include <poll.h> // ppoll
+#include <netinet/in.h> // sockaddr_in
+#include <poll.h> // poll
 #include <pty.h> // openpty
 #include <stdio.h> // fprintf
 #include <string.h> // memmove
+#include <sys/socket.h> // socket
 #include <sys/stat.h> // chmod
+#include <sys/un.h> // sockaddr_un
 #include <time.h> // struct timespec
 #include <unistd.h> // ttyname
 #include "board/irq.h" // irq_wait
@@ -20,8 +23,19 @@
 #include "internal.h" // console_setup
 #include "sched.h" // sched_wake_task
 
-static struct pollfd main_pfd[1];
-#define MP_TTY_IDX   0
+#define MP_TTY_IDX    0
+#define MP_LISTEN_IDX 1
+#define MP_TIMER_IDX  2
+#define MP_IRQ_IDX    3
+#define MP_IRQ_MAX    8
+static struct pollfd main_pfd[MP_IRQ_IDX + MP_IRQ_MAX];
+static void (*irq_fd_funcs[MP_IRQ_MAX])(int fd);
+static int irq_fd_count;
+
+// The udp "connection" is with the sender of the last datagram
+static int use_udp;
+static struct sockaddr_in udp_host;
+static socklen_t udp_host_len;
 
 // Report 'errno' in a message written to stderr
 void
@@ -63,9 +77,88 @@ set_close_on_exec(int fd)
     return 0;
 }
 
+// Listen for host connections on a unix socket (instead of a tty)
+static int
+console_setup_socket(char *name)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", name);
+        return -1;
+    }
+    strcpy(addr.sun_path, name);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        report_errno("socket", fd);
+        return -1;
+    }
+    unlink(name);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret) {
+        report_errno("bind", ret);
+        return -1;
+    }
+    ret = chmod(name, 0660);
+    if (ret) {
+        report_errno("chmod", ret);
+        return -1;
+    }
+    ret = listen(fd, 1);
+    if (ret) {
+        report_errno("listen", ret);
+        return -1;
+    }
+    main_pfd[MP_TTY_IDX].fd = -1;
+    main_pfd[MP_TTY_IDX].events = POLLIN;
+    main_pfd[MP_LISTEN_IDX].fd = fd;
+    main_pfd[MP_LISTEN_IDX].events = POLLIN;
+    return 0;
+}
+
+// Receive host commands on a udp port
+static int
+console_setup_udp(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        report_errno("socket", fd);
+        return -1;
+    }
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret) {
+        report_errno("bind", ret);
+        return -1;
+    }
+    use_udp = 1;
+    main_pfd[MP_TTY_IDX].fd = fd;
+    main_pfd[MP_TTY_IDX].events = POLLIN;
+    return 0;
+}
+
 int
-console_setup(char *name)
+console_setup(char *name, int use_socket, int udp_port)
 {
+    main_pfd[MP_LISTEN_IDX].fd = main_pfd[MP_TIMER_IDX].fd = -1;
+    if (udp_port) {
+        int ret = console_setup_udp(udp_port);
+        if (ret)
+            return -1;
+        return set_non_blocking(STDERR_FILENO);
+    }
+    if (use_socket) {
+        int ret = console_setup_socket(name);
+        if (ret)
+            return -1;
+        return set_non_blocking(STDERR_FILENO);
+    }
+
     // Open pseudo-tty
     struct termios ti;
     memset(&ti, 0, sizeof(ti));
@@ -112,12 +205,33 @@ console_setup(char *name)
     return 0;
 }
 
+// Wake from console_sleep() when the given timer fd is ready
+void
+console_add_timer_fd(int fd)
+{
+    main_pfd[MP_TIMER_IDX].fd = fd;
+    main_pfd[MP_TIMER_IDX].events = POLLIN;
+}
+
+// Wake from console_sleep() and invoke func when the given fd is
+// readable - returns non-zero if there are too many fds
+int
+console_add_irq_fd(int fd, void (*func)(int fd))
+{
+    if (irq_fd_count >= MP_IRQ_MAX)
+        return -1;
+    main_pfd[MP_IRQ_IDX + irq_fd_count].fd = fd;
+    main_pfd[MP_IRQ_IDX + irq_fd_count].events = POLLIN;
+    irq_fd_funcs[irq_fd_count++] = func;
+    return 0;
+}
+
 
 /****************************************************************
  * Console handling
  ****************************************************************/
 
-static struct task_wake console_wake;
+DECL_TASK_WAKE(console_wake);
 static uint8_t receive_buf[4096];
 static int receive_pos;
 
@@ -127,6 +241,23 @@ console_receive_buffer(void)
     return receive_buf;
 }
 
+// Read the next datagram (once all blocks of the last one are handled)
+static int
+console_read_udp(int fd)
+{
+    if (receive_pos)
+        return 0;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int ret = recvfrom(fd, receive_buf, sizeof(receive_buf), 0
+                       , (struct sockaddr *)&addr, &addr_len);
+    if (ret >= 0) {
+        udp_host = addr;
+        udp_host_len = addr_len;
+    }
+    return ret;
+}
+
 // Process any incoming commands
 void
 console_task(void)
@@ -135,8 +266,22 @@ console_task(void)
         return;
 
     // Read data
-    int ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
+    int fd = main_pfd[MP_TTY_IDX].fd;
+    if (fd < 0)
+        return;
+    int ret;
+    if (use_udp)
+        ret = console_read_udp(fd);
+    else
+        ret = read(fd, &receive_buf[receive_pos]
                    , sizeof(receive_buf) - receive_pos);
+    if (!ret && main_pfd[MP_LISTEN_IDX].fd >= 0) {
+        // Host closed the socket connection
+        close(fd);
+        main_pfd[MP_TTY_IDX].fd = -1;
+        receive_pos = 0;
+        return;
+    }
     if (ret < 0) {
         if (errno == EWOULDBLOCK) {
             ret = 0;
@@ -159,35 +304,96 @@ console_task(void)
             memmove(receive_buf, &receive_buf[pop_count], len);
             sched_wake_task(&console_wake);
         }
+    } else if (use_udp) {
+        // Message blocks never span datagrams - discard the rest
+        len = 0;
     }
     receive_pos = len;
 }
-DECL_TASK(console_task);
+DECL_WAKE_TASK(console_task, console_wake);
+
+// Responses are grouped into datagrams of up to 15 message blocks
+static uint8_t transmit_buf[MESSAGE_MAX * 15];
+static int transmit_pos;
+
+// Send any pending udp responses
+static void
+console_flush_udp(void)
+{
+    if (!transmit_pos)
+        return;
+    int ret = sendto(main_pfd[MP_TTY_IDX].fd, transmit_buf, transmit_pos, 0
+                     , (struct sockaddr *)&udp_host, udp_host_len);
+    if (ret < 0 && errno != ECONNREFUSED)
+        report_errno("sendto", ret);
+    transmit_pos = 0;
+}
 
 // Encode and transmit a "response" message
 void
 console_sendf(const struct command_encoder *ce, va_list args)
 {
+    if (use_udp) {
+        if (!udp_host_len)
+            // No host has connected yet
+            return;
+        if (transmit_pos + MESSAGE_MAX > sizeof(transmit_buf))
+            console_flush_udp();
+        transmit_pos += command_encode_and_frame(&transmit_buf[transmit_pos]
+                                                 , ce, args);
+        return;
+    }
+
     // Generate message
     uint8_t buf[MESSAGE_MAX];
     uint_fast8_t msglen = command_encode_and_frame(buf, ce, args);
 
     // Transmit message
-    int ret = write(main_pfd[MP_TTY_IDX].fd, buf, msglen);
+    int fd = main_pfd[MP_TTY_IDX].fd;
+    if (fd < 0)
+        return;
+    int ret = write(fd, buf, msglen);
     if (ret < 0)
         report_errno("write", ret);
 }
 
-// Sleep until a signal received (waking early for console input if needed)
+// Accept a new host connection (replacing any existing connection)
+static void
+console_accept(void)
+{
+    int fd = accept4(main_pfd[MP_LISTEN_IDX].fd, NULL, NULL
+                     , SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EWOULDBLOCK)
+            report_errno("accept", fd);
+        return;
+    }
+    if (main_pfd[MP_TTY_IDX].fd >= 0)
+        close(main_pfd[MP_TTY_IDX].fd);
+    main_pfd[MP_TTY_IDX].fd = fd;
+    receive_pos = 0;
+}
+
+// Sleep until the timer fd is ready (waking early for console input)
 void
-console_sleep(sigset_t *sigset)
+console_sleep(void)
 {
-    int ret = ppoll(main_pfd, ARRAY_SIZE(main_pfd), NULL, sigset);
+    if (use_udp)
+        console_flush_udp();
+    int ret = poll(main_pfd, MP_IRQ_IDX + irq_fd_count, -1);
     if (ret <= 0) {
         if (errno != EINTR)
-            report_errno("ppoll main_pfd", ret);
+            report_errno("poll main_pfd", ret);
         return;
     }
+    if (main_pfd[MP_TIMER_IDX].revents)
+        timer_fd_ack();
+    if (main_pfd[MP_LISTEN_IDX].revents)
+        console_accept();
     if (main_pfd[MP_TTY_IDX].revents)
         sched_wake_task(&console_wake);
+    int i;
+    for (i=0; i<irq_fd_count; i++)
+        if (main_pfd[MP_IRQ_IDX + i].revents)
+            irq_fd_funcs[i](main_pfd[MP_IRQ_IDX + i].fd);
 }
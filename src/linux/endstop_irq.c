@@ -0,0 +1,123 @@
+// Gpio edge events for endstop triggering on linux
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <errno.h> // errno
+#include <linux/gpio.h> // struct gpio_v2_line_event
+#include <unistd.h> // read
+#include "compiler.h" // ARRAY_SIZE
+#include "endstop.h" // endstop_hw_setup
+#include "internal.h" // gpio_in_enable_events
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+
+struct endstop_line {
+    struct endstop_irq *ei;
+    int fd;
+    uint8_t flags;
+};
+static struct endstop_line endstop_lines[8];
+static int endstop_line_count;
+
+enum { ELF_ENABLED = 1<<0, ELF_RISING = 1<<1 };
+
+// Read (and discard) any queued events of a line
+static void
+endstop_line_flush(struct endstop_line *el)
+{
+    struct gpio_v2_line_event ev[4];
+    while (read(el->fd, ev, sizeof(ev)) > 0)
+        ;
+}
+
+// Process the edge events of a line (called from console_sleep())
+static void
+endstop_line_event(int fd)
+{
+    struct endstop_line *el = endstop_lines;
+    while (el->fd != fd)
+        el++;
+    struct gpio_v2_line_event ev[4];
+    for (;;) {
+        int ret = read(fd, ev, sizeof(ev));
+        if (ret <= 0) {
+            if (ret < 0 && errno != EAGAIN)
+                report_errno("read gpio event", ret);
+            return;
+        }
+        int i, count = ret / sizeof(ev[0]);
+        for (i=0; i<count; i++) {
+            uint_fast8_t flags = el->flags;
+            if (!(flags & ELF_ENABLED))
+                continue;
+            int rising = ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+            if (!rising != !(flags & ELF_RISING))
+                continue;
+            // Only report the first edge - the endstop code re-arms as needed
+            el->flags = 0;
+            struct endstop_irq *ei = el->ei;
+            ei->func(ei, timer_from_monotonic_ns(ev[i].timestamp_ns));
+        }
+    }
+}
+
+// Request kernel edge events for a pin - returns non-zero if edge
+// events are not available (the caller should then poll the pin)
+int
+endstop_hw_setup(struct endstop_irq *ei, uint32_t pin)
+{
+    if (endstop_line_count >= ARRAY_SIZE(endstop_lines))
+        return -1;
+    int fd = gpio_in_enable_events(pin);
+    if (fd < 0)
+        return -1;
+    int ret = console_add_irq_fd(fd, endstop_line_event);
+    if (ret)
+        return -1;
+    struct endstop_line *el = &endstop_lines[endstop_line_count];
+    el->ei = ei;
+    el->fd = fd;
+    ei->line = endstop_line_count++;
+    return 0;
+}
+
+// Arm the event for the next rising (or falling) edge
+void
+endstop_hw_enable(struct endstop_irq *ei, uint8_t rising)
+{
+    struct endstop_line *el = &endstop_lines[ei->line];
+    endstop_line_flush(el);
+    el->flags = ELF_ENABLED | (rising ? ELF_RISING : 0);
+}
+
+// Disarm the event (and discard any queued edges)
+void
+endstop_hw_disable(struct endstop_irq *ei)
+{
+    struct endstop_line *el = &endstop_lines[ei->line];
+    el->flags = 0;
+    endstop_line_flush(el);
+}
+
+#else // !GPIO_V2_GET_LINE_IOCTL
+
+// Kernel headers without gpio v2 support - always poll the pin
+int
+endstop_hw_setup(struct endstop_irq *ei, uint32_t pin)
+{
+    return -1;
+}
+
+void
+endstop_hw_enable(struct endstop_irq *ei, uint8_t rising)
+{
+}
+
+void
+endstop_hw_disable(struct endstop_irq *ei)
+{
+}
+
+#endif // !GPIO_V2_GET_LINE_IOCTL
@@ -1,6 +1,6 @@
 // Very basic support via a Linux gpiod device
 //
-// Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -10,7 +10,7 @@
 #include <string.h> // memset
 #include <sys/ioctl.h> // ioctl
 #include <unistd.h> // close
-#include <linux/gpio.h> // GPIOHANDLE_REQUEST_OUTPUT
+#include <linux/gpio.h> // GPIO_V2_GET_LINE_IOCTL
 #include "command.h" // shutdown
 #include "gpio.h" // gpio_out_write
 #include "internal.h" // report_errno
@@ -34,6 +34,7 @@ struct gpio_line {
     int offset;
     int fd;
     int state;
+    uint64_t flags;
 };
 static struct gpio_line gpio_lines[9 * MAX_GPIO_LINES];
 static int gpio_chip_fd[9] = { -1, -1, -1, -1, -1, -1, -1, -1, -1 };
@@ -65,17 +66,6 @@ get_chip_fd(uint8_t chipId)
     return fd;
 }
 
-struct gpio_out
-gpio_out_setup(uint32_t pin, uint8_t val)
-{
-    struct gpio_line *line = &gpio_lines[pin];
-    line->offset = GPIO2PIN(pin);
-    line->chipid = GPIO2PORT(pin);
-    struct gpio_out g = { .line = line };
-    gpio_out_reset(g,val);
-    return g;
-}
-
 static void
 gpio_release_line(struct gpio_line *line)
 {
@@ -85,35 +75,165 @@ gpio_release_line(struct gpio_line *line)
     }
 }
 
-void
-gpio_out_reset(struct gpio_out g, uint8_t val)
+#ifdef GPIO_V2_GET_LINE_IOCTL
+
+// Request a line using the gpio v2 character device api
+static int
+gpio_request_line(struct gpio_line *line, uint64_t flags, uint8_t val)
+{
+    gpio_release_line(line);
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.num_lines = 1;
+    req.offsets[0] = line->offset;
+    req.config.flags = flags;
+    if (flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+        req.config.num_attrs = 1;
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        req.config.attrs[0].attr.values = !!val;
+        req.config.attrs[0].mask = 1;
+    }
+    strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+    int fd = get_chip_fd(line->chipid);
+    int ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    if (ret < 0)
+        return ret;
+    set_close_on_exec(req.fd);
+    line->fd = req.fd;
+    line->flags = flags;
+    return 0;
+}
+
+#define GPIO_FLAG_OUTPUT GPIO_V2_LINE_FLAG_OUTPUT
+#define GPIO_FLAG_INPUT GPIO_V2_LINE_FLAG_INPUT
+#define GPIO_FLAG_PULL_UP GPIO_V2_LINE_FLAG_BIAS_PULL_UP
+#define GPIO_FLAG_PULL_DOWN GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN
+
+static void
+gpio_line_write(struct gpio_line *line, uint8_t val)
 {
-    gpio_release_line(g.line);
+    struct gpio_v2_line_values values = { .bits = !!val, .mask = 1 };
+    ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+static uint8_t
+gpio_line_read(struct gpio_line *line)
+{
+    struct gpio_v2_line_values values = { .bits = 0, .mask = 1 };
+    ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values);
+    return values.bits & 1;
+}
+
+// Report edges of an input line as events on its file descriptor -
+// returns the file descriptor (or negative on error)
+int
+gpio_in_enable_events(uint32_t pin)
+{
+    struct gpio_line *line = &gpio_lines[pin];
+    if (line->fd <= 0 || !(line->flags & GPIO_V2_LINE_FLAG_INPUT))
+        return -1;
+    struct gpio_v2_line_config config;
+    memset(&config, 0, sizeof(config));
+    config.flags = (line->flags | GPIO_V2_LINE_FLAG_EDGE_RISING
+                    | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+    int ret = ioctl(line->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config);
+    if (ret < 0) {
+        report_errno("gpio set edge config", ret);
+        return -1;
+    }
+    line->flags = config.flags;
+    ret = set_non_blocking(line->fd);
+    if (ret < 0)
+        return -1;
+    return line->fd;
+}
+
+#else // !GPIO_V2_GET_LINE_IOCTL
+
+// Request a line using the (deprecated) gpio v1 line handle api
+static int
+gpio_request_line(struct gpio_line *line, uint64_t flags, uint8_t val)
+{
+    gpio_release_line(line);
     struct gpiohandle_request req;
     memset(&req, 0, sizeof(req));
     req.lines = 1;
-    req.flags = GPIOHANDLE_REQUEST_OUTPUT;
-    req.lineoffsets[0] = g.line->offset;
+    req.flags = flags;
+    req.lineoffsets[0] = line->offset;
     req.default_values[0] = !!val;
     strncpy(req.consumer_label, GPIO_CONSUMER, sizeof(req.consumer_label) - 1);
-    int fd = get_chip_fd(g.line->chipid);
+    int fd = get_chip_fd(line->chipid);
     int ret = ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+    if (ret < 0)
+        return ret;
+    set_close_on_exec(req.fd);
+    line->fd = req.fd;
+    line->flags = flags;
+    return 0;
+}
+
+#define GPIO_FLAG_OUTPUT GPIOHANDLE_REQUEST_OUTPUT
+#define GPIO_FLAG_INPUT GPIOHANDLE_REQUEST_INPUT
+#if defined(GPIOHANDLE_REQUEST_BIAS_PULL_UP)
+#define GPIO_FLAG_PULL_UP GPIOHANDLE_REQUEST_BIAS_PULL_UP
+#define GPIO_FLAG_PULL_DOWN GPIOHANDLE_REQUEST_BIAS_PULL_DOWN
+#else
+#define GPIO_FLAG_PULL_UP 0
+#define GPIO_FLAG_PULL_DOWN 0
+#endif
+
+static void
+gpio_line_write(struct gpio_line *line, uint8_t val)
+{
+    struct gpiohandle_data data;
+    memset(&data, 0, sizeof(data));
+    data.values[0] = !!val;
+    ioctl(line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+}
+
+static uint8_t
+gpio_line_read(struct gpio_line *line)
+{
+    struct gpiohandle_data data;
+    memset(&data, 0, sizeof(data));
+    ioctl(line->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data);
+    return data.values[0];
+}
+
+int
+gpio_in_enable_events(uint32_t pin)
+{
+    return -1;
+}
+
+#endif // !GPIO_V2_GET_LINE_IOCTL
+
+struct gpio_out
+gpio_out_setup(uint32_t pin, uint8_t val)
+{
+    struct gpio_line *line = &gpio_lines[pin];
+    line->offset = GPIO2PIN(pin);
+    line->chipid = GPIO2PORT(pin);
+    struct gpio_out g = { .line = line };
+    gpio_out_reset(g,val);
+    return g;
+}
+
+void
+gpio_out_reset(struct gpio_out g, uint8_t val)
+{
+    int ret = gpio_request_line(g.line, GPIO_FLAG_OUTPUT, val);
     if (ret < 0) {
         report_errno("gpio_out_reset get line", ret);
         shutdown("Unable to open out GPIO chip line");
     }
-    set_close_on_exec(req.fd);
-    g.line->fd = req.fd;
     g.line->state = !!val;
 }
 
 void
 gpio_out_write(struct gpio_out g, uint8_t val)
 {
-    struct gpiohandle_data data;
-    memset(&data, 0, sizeof(data));
-    data.values[0] = !!val;
-    ioctl(g.line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+    gpio_line_write(g.line, val);
     g.line->state = !!val;
 }
 
@@ -143,35 +263,20 @@ gpio_in_setup(uint32_t pin, int8_t pull_up)
 void
 gpio_in_reset(struct gpio_in g, int8_t pull_up)
 {
-    gpio_release_line(g.line);
-    struct gpiohandle_request req;
-    memset(&req, 0, sizeof(req));
-    req.lines = 1;
-    req.flags = GPIOHANDLE_REQUEST_INPUT;
-#if defined(GPIOHANDLE_REQUEST_BIAS_PULL_UP)
-    if (pull_up > 0) {
-        req.flags |= GPIOHANDLE_REQUEST_BIAS_PULL_UP;
-    } else if (pull_up < 0) {
-        req.flags |= GPIOHANDLE_REQUEST_BIAS_PULL_DOWN;
-    }
-#endif
-    req.lineoffsets[0] = g.line->offset;
-    strncpy(req.consumer_label, GPIO_CONSUMER, sizeof(req.consumer_label) - 1);
-    int fd = get_chip_fd(g.line->chipid);
-    int ret = ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+    uint64_t flags = GPIO_FLAG_INPUT;
+    if (pull_up > 0)
+        flags |= GPIO_FLAG_PULL_UP;
+    else if (pull_up < 0)
+        flags |= GPIO_FLAG_PULL_DOWN;
+    int ret = gpio_request_line(g.line, flags, 0);
     if (ret < 0) {
         report_errno("gpio_in_reset get line", ret);
         shutdown("Unable to open in GPIO chip line");
     }
-    set_close_on_exec(req.fd);
-    g.line->fd = req.fd;
 }
 
 uint8_t
 gpio_in_read(struct gpio_in g)
 {
-    struct gpiohandle_data data;
-    memset(&data, 0, sizeof(data));
-    ioctl(g.line->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data);
-    return data.values[0];
+    return gpio_line_read(g.line);
 }
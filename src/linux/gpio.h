@@ -20,7 +20,7 @@ void gpio_in_reset(struct gpio_in g, int8_t pull_up);
 uint8_t gpio_in_read(struct gpio_in g);
 
 struct gpio_adc {
-    int fd;
+    int fd, chan;
 };
 struct gpio_adc gpio_adc_setup(uint32_t pin);
 uint32_t gpio_adc_sample(struct gpio_adc g);
@@ -35,10 +35,13 @@ struct spi_config spi_setup(uint32_t bus, uint8_t mode, uint32_t rate);
 void spi_prepare(struct spi_config config);
 void spi_transfer(struct spi_config config, uint8_t receive_data
                   , uint8_t len, uint8_t *data);
+void spi_transfer_batch(struct spi_config config, uint8_t receive_data
+                        , uint8_t count, uint8_t len, uint8_t *data);
 
 struct gpio_pwm {
     int duty_fd, enable_fd;
     uint32_t period;
+    struct pwm_state *state;
 };
 struct gpio_pwm gpio_pwm_setup(uint32_t pin, uint32_t cycle_time, uint16_t val);
 void gpio_pwm_write(struct gpio_pwm g, uint16_t val);
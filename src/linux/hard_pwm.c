@@ -37,6 +37,12 @@ DECL_ENUMERATION_RANGE("pin", "pwmchip7/pwm0", HARD_PWM(7, 0), 16);
 #define PWM_PATH "/sys/class/pwm/pwmchip%u/pwm%u/%s"
 #define PWM_PATH_BB "/sys/class/pwm/pwm-%u:%u/%s"
 
+// Last state written to each pwm channel (to skip redundant writes)
+static struct pwm_state {
+    uint32_t duty_cycle;
+    uint8_t enabled;
+} pwm_states[8 * 16];
+
 struct gpio_pwm gpio_pwm_setup(uint32_t pin, uint32_t cycle_time, uint16_t val)
 {
     char filename[256];
@@ -47,6 +53,7 @@ struct gpio_pwm gpio_pwm_setup(uint32_t pin, uint32_t cycle_time, uint16_t val)
 
     struct gpio_pwm g = {};
     g.period = cycle_time * NSECS_PER_TICK;
+    g.state = &pwm_states[pin - HARD_PWM_START];
 
     // configure period/cycle time. Always in nanoseconds
     snprintf(filename, sizeof(filename), pwm_path, chip_id, pwm_id, "period");
@@ -88,6 +95,9 @@ struct gpio_pwm gpio_pwm_setup(uint32_t pin, uint32_t cycle_time, uint16_t val)
         goto fail;
     }
     g.enable_fd = fd;
+    // Force an initial write of the enable and duty cycle
+    g.state->duty_cycle = ~0;
+    g.state->enabled = !val;
     gpio_pwm_write(g, val);
 
     return g;
@@ -101,13 +111,23 @@ fail:
 
 void gpio_pwm_write(struct gpio_pwm g, uint16_t val)
 {
+    struct pwm_state *s = g.state;
     if (!val) {
-        write(g.enable_fd, "0", 2);
+        if (s->enabled) {
+            write(g.enable_fd, "0", 2);
+            s->enabled = 0;
+        }
         return;
     }
-    char scratch[16];
     uint32_t duty_cycle = g.period * (uint64_t)val / MAX_PWM;
-    int len = snprintf(scratch, sizeof(scratch), "%u", duty_cycle);
-    write(g.duty_fd, scratch, len + 1);
-    write(g.enable_fd, "1", 2);
+    if (duty_cycle != s->duty_cycle) {
+        char scratch[16];
+        int len = snprintf(scratch, sizeof(scratch), "%u", duty_cycle);
+        write(g.duty_fd, scratch, len + 1);
+        s->duty_cycle = duty_cycle;
+    }
+    if (!s->enabled) {
+        write(g.enable_fd, "1", 2);
+        s->enabled = 1;
+    }
 }
@@ -2,7 +2,6 @@
 #define __LINUX_INTERNAL_H
 // Local definitions for micro-controllers running on linux
 
-#include <signal.h> // sigset_t
 #include <stdint.h> // uint32_t
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 
@@ -18,13 +17,18 @@
 void report_errno(char *where, int rc);
 int set_non_blocking(int fd);
 int set_close_on_exec(int fd);
-int console_setup(char *name);
-void console_sleep(sigset_t *sigset);
+int console_setup(char *name, int use_socket, int udp_port);
+void console_add_timer_fd(int fd);
+int console_add_irq_fd(int fd, void (*func)(int fd));
+void console_sleep(void);
+
+// gpio.c
+int gpio_in_enable_events(uint32_t pin);
 
 // timer.c
 int timer_check_periodic(uint32_t *ts);
-void timer_disable_signals(void);
-void timer_enable_signals(void);
+uint32_t timer_from_monotonic_ns(uint64_t ns);
+void timer_fd_ack(void);
 
 // watchdog.c
 int watchdog_setup(void);
@@ -1,11 +1,13 @@
 // Main starting point for micro-controller code running on linux systems
 //
-// Copyright (C) 2017  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#define _GNU_SOURCE
 #include <sched.h> // sched_setscheduler sched_get_priority_max
 #include <stdio.h> // fprintf
+#include <stdlib.h> // atoi
 #include <string.h> // memset
 #include <unistd.h> // getopt
 #include <sys/mman.h> // mlockall MCL_CURRENT MCL_FUTURE
@@ -41,6 +43,21 @@ realtime_setup(void)
     return 0;
 }
 
+// Only run on the given cpu
+static int
+cpu_setup(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = sched_setaffinity(0, sizeof(set), &set);
+    if (ret < 0) {
+        report_errno("sched_setaffinity", ret);
+        return -1;
+    }
+    return 0;
+}
+
 
 /****************************************************************
  * Restart
@@ -68,9 +85,10 @@ main(int argc, char **argv)
 {
     // Parse program args
     orig_argv = argv;
-    int opt, watchdog = 0, realtime = 0;
+    int opt, watchdog = 0, realtime = 0, use_socket = 0, cpu = -1;
+    int udp_port = 0;
     char *serial = "/tmp/klipper_host_mcu";
-    while ((opt = getopt(argc, argv, "wrI:")) != -1) {
+    while ((opt = getopt(argc, argv, "wrsc:I:u:")) != -1) {
         switch (opt) {
         case 'w':
             watchdog = 1;
@@ -78,22 +96,37 @@ main(int argc, char **argv)
         case 'r':
             realtime = 1;
             break;
+        case 's':
+            use_socket = 1;
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
         case 'I':
             serial = optarg;
             break;
+        case 'u':
+            udp_port = atoi(optarg);
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-w] [-r] [-I path]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-w] [-r] [-s] [-c cpu] [-I path]"
+                    " [-u udp_port]\n", argv[0]);
             return -1;
         }
     }
 
     // Initial setup
+    if (cpu >= 0) {
+        int ret = cpu_setup(cpu);
+        if (ret)
+            return ret;
+    }
     if (realtime) {
         int ret = realtime_setup();
         if (ret)
             return ret;
     }
-    int ret = console_setup(serial);
+    int ret = console_setup(serial, use_socket, udp_port);
     if (ret)
         return -1;
     if (watchdog) {
@@ -200,7 +200,7 @@ command_config_pca9685(uint32_t *args)
     p->default_value = default_value;
     p->max_duration = args[7];
     p->timer.func = pca9685_event;
-    move_queue_setup(&p->mq, sizeof(struct pca9685_move));
+    move_queue_setup(&p->mq, sizeof(struct pca9685_move), args[0]);
 }
 DECL_COMMAND(command_config_pca9685, "config_pca9685 oid=%c bus=%c addr=%c"
              " channel=%c cycle_ticks=%u value=%hu"
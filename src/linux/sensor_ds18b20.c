@@ -124,7 +124,7 @@ reader_start_routine(void *param) {
     pthread_exit(NULL);
 }
 
-static struct task_wake ds18_wake;
+DECL_TASK_WAKE(ds18_wake);
 
 static uint_fast8_t
 ds18_event(struct timer *timer)
@@ -169,9 +169,7 @@ command_config_ds18b20(uint32_t *args)
         goto fail4;
 
     pthread_t reader_tid; // Not used
-    timer_disable_signals();
     ret = pthread_create(&reader_tid, NULL, reader_start_routine, d);
-    timer_enable_signals();
     if (ret)
         goto fail5;
 
@@ -284,4 +282,4 @@ ds18_task(void)
         ds18_send_and_request(d, next_begin_time, oid);
     }
 }
-DECL_TASK(ds18_task);
+DECL_WAKE_TASK(ds18_task, ds18_wake);
@@ -1,6 +1,6 @@
 // Very basic shift-register support via a Linux SPI device
 //
-// Copyright (C) 2017-2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -117,3 +117,43 @@ spi_transfer(struct spi_config config, uint8_t receive_data
         }
     }
 }
+
+// Maximum number of transfers submitted with a single ioctl
+#define SPI_BATCH_MAX 16
+// Chip select release time between transfers of a batch (some sensors
+// need time to update their fifo registers)
+#define SPI_BATCH_DELAY_US 5
+
+// Issue several transfers (each with its own chip select) per ioctl
+void
+spi_transfer_batch(struct spi_config config, uint8_t receive_data
+                   , uint8_t count, uint8_t len, uint8_t *data)
+{
+    if (!len)
+        return;
+    struct spi_ioc_transfer transfers[SPI_BATCH_MAX];
+    while (count) {
+        uint_fast8_t num = count > SPI_BATCH_MAX ? SPI_BATCH_MAX : count, i;
+        memset(transfers, 0, sizeof(transfers[0]) * num);
+        for (i=0; i<num; i++, data += len) {
+            struct spi_ioc_transfer *t = &transfers[i];
+            t->tx_buf = (uintptr_t)data;
+            if (receive_data)
+                t->rx_buf = (uintptr_t)data;
+            t->len = len;
+            t->speed_hz = config.rate;
+            t->bits_per_word = 8;
+            if (i < num - 1) {
+                t->delay_usecs = SPI_BATCH_DELAY_US;
+                t->cs_change = 1;
+            }
+        }
+        int ret = ioctl(config.fd, SPI_IOC_MESSAGE(num), transfers);
+        if (ret < 0) {
+            report_errno("spi batch ioctl", ret);
+            try_shutdown("Unable to issue spi ioctl");
+            return;
+        }
+        count -= num;
+    }
+}
@@ -1,10 +1,14 @@
 // Handling of timers on linux systems
 //
-// Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <errno.h> // errno
+#include <sys/prctl.h> // prctl
+#include <sys/timerfd.h> // timerfd_create
 #include <time.h> // struct timespec
+#include <unistd.h> // read
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 #include "board/io.h" // readl
 #include "board/irq.h" // irq_disable
@@ -19,14 +23,13 @@ static struct {
     uint32_t last_read_time;
     // Fields for converting from a systime to ticks
     time_t start_sec;
-    // Flags for tracking irq_enable()/irq_disable()
+    // Flag set by timer_kick()
     uint32_t must_wake_timers;
     // Time of next software timer (also used to convert from ticks to systime)
     uint32_t next_wake_counter;
     struct timespec next_wake;
-    // Unix signal tracking
-    timer_t t_alarm;
-    sigset_t ss_alarm, ss_sleep;
+    // Timer file descriptor (readable once next_wake is reached)
+    int timer_fd;
 } TimerInfo;
 
 
@@ -62,6 +65,14 @@ timespec_from_time(uint32_t time)
     return ts;
 }
 
+// Convert a CLOCK_MONOTONIC timestamp (in nanoseconds) to a counter value
+uint32_t
+timer_from_monotonic_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / NSECS, .tv_nsec = ns % NSECS };
+    return timespec_to_time(ts);
+}
+
 // Return the current time
 static struct timespec
 timespec_read(void)
@@ -118,8 +129,7 @@ timer_read_time(void)
 void
 timer_kick(void)
 {
-    struct itimerspec it = { .it_interval = {0, 0}, .it_value = {0, 1} };
-    timer_settime(TimerInfo.t_alarm, TIMER_ABSTIME, &it, NULL);
+    TimerInfo.must_wake_timers = 1;
 }
 
 #define TIMER_IDLE_REPEAT_COUNT 100
@@ -162,80 +172,47 @@ timer_dispatch(void)
             diff = next - timer_read_time();
     }
 
-    // Schedule SIGALRM signal
+    // Program the timer fd for the next wake time
     struct itimerspec it;
     it.it_interval = (struct timespec){0, 0};
     TimerInfo.next_wake = it.it_value = timespec_from_time(next);
     TimerInfo.next_wake_counter = next;
     TimerInfo.must_wake_timers = 0;
-    timer_settime(TimerInfo.t_alarm, TIMER_ABSTIME, &it, NULL);
-}
-
-// OS signal handler
-static void
-timer_signal(int signal)
-{
-    TimerInfo.must_wake_timers = 1;
+    timerfd_settime(TimerInfo.timer_fd, TFD_TIMER_ABSTIME, &it, NULL);
 }
 
 void
 timer_init(void)
 {
-    // Initialize ss_alarm signal set
-    int ret = sigemptyset(&TimerInfo.ss_alarm);
-    if (ret < 0) {
-        report_errno("sigemptyset", ret);
-        return;
-    }
-    ret = sigaddset(&TimerInfo.ss_alarm, SIGALRM);
-    if (ret < 0) {
-        report_errno("sigaddset", ret);
-        return;
-    }
-    // Initialize ss_sleep signal set
-    ret = sigprocmask(0, NULL, &TimerInfo.ss_sleep);
-    if (ret < 0) {
-        report_errno("sigprocmask ss_sleep", ret);
-        return;
-    }
-    ret = sigdelset(&TimerInfo.ss_sleep, SIGALRM);
-    if (ret < 0) {
-        report_errno("sigdelset", ret);
-        return;
-    }
     // Initialize timespec_to_time() and timespec_from_time()
     struct timespec curtime = timespec_read();
     TimerInfo.start_sec = curtime.tv_sec + 1;
     TimerInfo.next_wake = curtime;
     TimerInfo.next_wake_counter = timespec_to_time(curtime);
-    // Initialize t_alarm signal based timer
-    ret = timer_create(CLOCK_MONOTONIC, NULL, &TimerInfo.t_alarm);
-    if (ret < 0) {
-        report_errno("timer_create", ret);
-        return;
-    }
-    struct sigaction act = {.sa_handler = timer_signal, .sa_flags = SA_RESTART};
-    ret = sigaction(SIGALRM, &act, NULL);
-    if (ret < 0) {
-        report_errno("sigaction", ret);
+    // Initialize the absolute time (CLOCK_MONOTONIC) timer fd
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        report_errno("timerfd_create", fd);
         return;
     }
+    TimerInfo.timer_fd = fd;
+    console_add_timer_fd(fd);
+    // Don't let the kernel coalesce wakeups (not needed for realtime tasks)
+    int ret = prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+    if (ret < 0)
+        report_errno("prctl timerslack", ret);
     timer_kick();
 }
 DECL_INIT(timer_init);
 
-// Block SIGALRM signal
-void
-timer_disable_signals(void)
-{
-    sigprocmask(SIG_BLOCK, &TimerInfo.ss_alarm, NULL);
-}
-
-// Restore reception of SIGALRM signal
+// Discard the expiration count of the timer fd
 void
-timer_enable_signals(void)
+timer_fd_ack(void)
 {
-    sigprocmask(SIG_UNBLOCK, &TimerInfo.ss_alarm, NULL);
+    uint64_t count;
+    int ret = read(TimerInfo.timer_fd, &count, sizeof(count));
+    if (ret < 0 && errno != EAGAIN)
+        report_errno("read timerfd", ret);
 }
 
 
@@ -267,19 +244,16 @@ irq_restore(irqstatus_t flag)
 void
 irq_wait(void)
 {
-    // Must atomically sleep until signaled
-    if (!readl(&TimerInfo.must_wake_timers)) {
-        timer_disable_signals();
-        if (!TimerInfo.must_wake_timers)
-            console_sleep(&TimerInfo.ss_sleep);
-        timer_enable_signals();
-    }
+    if (!readl(&TimerInfo.must_wake_timers))
+        // Sleep until the timer fd is ready (or console input)
+        console_sleep();
     irq_poll();
 }
 
 void
 irq_poll(void)
 {
-    if (readl(&TimerInfo.must_wake_timers))
+    if (readl(&TimerInfo.must_wake_timers)
+        || !timer_is_before(timer_read_time(), TimerInfo.next_wake_counter))
         timer_dispatch();
 }
@@ -0,0 +1,229 @@
+// Load cell probe support (sample filtering and trigger detection)
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "load_cell_probe.h" // load_cell_probe_report_sample
+#include "sched.h" // shutdown
+#include "trsync.h" // trsync_do_trigger
+
+// Filter coefficients are fixed point values with this many fraction bits
+#define FILTER_FRAC_BITS 29
+DECL_CONSTANT("LOAD_CELL_FILTER_FRAC_BITS", FILTER_FRAC_BITS);
+#define MAX_SECTIONS 4
+DECL_CONSTANT("LOAD_CELL_FILTER_MAX_SECTIONS", MAX_SECTIONS);
+
+// A second order (biquad) filter section
+struct lcp_section {
+    int32_t b0, b1, b2, a1, a2;
+    int64_t s1, s2;
+    int32_t err;
+};
+
+struct load_cell_probe {
+    // homing
+    struct trsync *ts;
+    uint8_t flags, trigger_reason, error_reason;
+    uint32_t homing_clock;
+    // trigger detection
+    int32_t safety_min, safety_max, tare;
+    uint32_t trigger_counts;
+    uint16_t tare_samples, tare_count;
+    int64_t tare_sum;
+    // filter chain
+    uint8_t section_count;
+    struct lcp_section sections[MAX_SECTIONS];
+};
+
+enum {
+    LCP_AWAIT_HOMING = 1<<0, LCP_CAN_TRIGGER = 1<<1, LCP_TARED = 1<<2,
+};
+
+void
+command_config_load_cell_probe(uint32_t *args)
+{
+    struct load_cell_probe *lcp = oid_alloc(
+        args[0], command_config_load_cell_probe, sizeof(*lcp));
+    lcp->safety_min = INT32_MIN;
+    lcp->safety_max = INT32_MAX;
+    lcp->tare_samples = 1;
+}
+DECL_COMMAND(command_config_load_cell_probe, "config_load_cell_probe oid=%c");
+
+struct load_cell_probe *
+load_cell_probe_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_load_cell_probe);
+}
+
+// Set the coefficients of a filter section
+void
+command_load_cell_probe_set_section(uint32_t *args)
+{
+    struct load_cell_probe *lcp = load_cell_probe_oid_lookup(args[0]);
+    uint8_t section = args[1];
+    if (section >= MAX_SECTIONS)
+        shutdown("Invalid load_cell_probe filter section");
+    struct lcp_section *s = &lcp->sections[section];
+    irq_disable();
+    s->b0 = args[2];
+    s->b1 = args[3];
+    s->b2 = args[4];
+    s->a1 = args[5];
+    s->a2 = args[6];
+    s->s1 = s->s2 = 0;
+    s->err = 0;
+    if (section >= lcp->section_count)
+        lcp->section_count = section + 1;
+    irq_enable();
+}
+DECL_COMMAND(command_load_cell_probe_set_section,
+             "load_cell_probe_set_section oid=%c section=%c"
+             " b0=%i b1=%i b2=%i a1=%i a2=%i");
+
+// Set the trigger threshold and the range of valid sensor readings
+void
+command_load_cell_probe_set_range(uint32_t *args)
+{
+    struct load_cell_probe *lcp = load_cell_probe_oid_lookup(args[0]);
+    uint16_t tare_samples = args[4];
+    if (!tare_samples)
+        shutdown("Invalid load_cell_probe tare_samples");
+    irq_disable();
+    lcp->safety_min = args[1];
+    lcp->safety_max = args[2];
+    lcp->trigger_counts = args[3];
+    lcp->tare_samples = tare_samples;
+    irq_enable();
+}
+DECL_COMMAND(command_load_cell_probe_set_range,
+             "load_cell_probe_set_range oid=%c safety_min=%i safety_max=%i"
+             " trigger_counts=%u tare_samples=%hu");
+
+// Start (or with a trigger_reason of zero, cancel) a homing operation
+void
+command_load_cell_probe_home(uint32_t *args)
+{
+    struct load_cell_probe *lcp = load_cell_probe_oid_lookup(args[0]);
+    irq_disable();
+    lcp->trigger_reason = args[2];
+    if (!lcp->trigger_reason) {
+        lcp->ts = NULL;
+        lcp->flags = 0;
+        irq_enable();
+        return;
+    }
+    lcp->ts = trsync_oid_lookup(args[1]);
+    lcp->error_reason = args[3];
+    lcp->homing_clock = args[4];
+    lcp->tare_count = 0;
+    lcp->tare_sum = 0;
+    lcp->flags = LCP_AWAIT_HOMING | LCP_CAN_TRIGGER;
+    irq_enable();
+}
+DECL_COMMAND(command_load_cell_probe_home,
+             "load_cell_probe_home oid=%c trsync_oid=%c trigger_reason=%c"
+             " error_reason=%c clock=%u");
+
+void
+command_load_cell_probe_query_state(uint32_t *args)
+{
+    struct load_cell_probe *lcp = load_cell_probe_oid_lookup(args[0]);
+    irq_disable();
+    uint8_t is_homing = !!(lcp->flags & LCP_CAN_TRIGGER);
+    uint32_t homing_clock = lcp->homing_clock;
+    int32_t tare = lcp->tare;
+    irq_enable();
+    sendf("load_cell_probe_state oid=%c is_homing=%c trigger_clock=%u"
+          " tare=%i"
+          , args[0], is_homing, homing_clock, tare);
+}
+DECL_COMMAND(command_load_cell_probe_query_state,
+             "load_cell_probe_query_state oid=%c");
+
+// Run a sample through the filter chain
+static int32_t
+lcp_filter(struct load_cell_probe *lcp, int32_t sample)
+{
+    int32_t v = sample;
+    uint_fast8_t i;
+    for (i=0; i<lcp->section_count; i++) {
+        // Transposed direct form II
+        struct lcp_section *s = &lcp->sections[i];
+        int64_t acc = (int64_t)s->b0 * v + s->s1 + s->err;
+        int32_t out = acc >> FILTER_FRAC_BITS;
+        // Carry the truncated fraction to the next sample (error
+        // feedback) so that poles near z=1 do not amplify the rounding
+        s->err = acc - ((int64_t)out << FILTER_FRAC_BITS);
+        s->s1 = (int64_t)s->b1 * v - (int64_t)s->a1 * out + s->s2;
+        s->s2 = (int64_t)s->b2 * v - (int64_t)s->a2 * out;
+        v = out;
+    }
+    return v;
+}
+
+// Stop homing and signal the trsync
+static void
+lcp_trigger(struct load_cell_probe *lcp, uint8_t reason)
+{
+    lcp->flags = 0;
+    lcp->homing_clock = timer_read_time();
+    trsync_do_trigger(lcp->ts, reason);
+}
+
+// Process a new sample from the load cell sensor
+void
+load_cell_probe_report_sample(struct load_cell_probe *lcp, int32_t sample)
+{
+    // Always filter (so that the filter is settled when homing starts)
+    int32_t v = lcp_filter(lcp, sample);
+
+    irqstatus_t flag = irq_save();
+    uint8_t flags = lcp->flags;
+    if (!(flags & LCP_CAN_TRIGGER))
+        goto done;
+    if (sample < lcp->safety_min || sample > lcp->safety_max) {
+        // Sensor out of range - cancel homing
+        lcp_trigger(lcp, lcp->error_reason);
+        goto done;
+    }
+    if (flags & LCP_AWAIT_HOMING) {
+        if (timer_is_before(timer_read_time(), lcp->homing_clock))
+            goto done;
+        flags &= ~LCP_AWAIT_HOMING;
+    }
+    if (!(flags & LCP_TARED)) {
+        // Average the first samples of the homing move to find the tare
+        lcp->tare_sum += v;
+        if (++lcp->tare_count >= lcp->tare_samples) {
+            lcp->tare = lcp->tare_sum / lcp->tare_samples;
+            flags |= LCP_TARED;
+        }
+        lcp->flags = flags;
+        goto done;
+    }
+    int32_t diff = v - lcp->tare;
+    uint32_t force = diff < 0 ? -diff : diff;
+    if (force >= lcp->trigger_counts) {
+        lcp_trigger(lcp, lcp->trigger_reason);
+        goto done;
+    }
+    lcp->flags = flags;
+done:
+    irq_restore(flag);
+}
+
+// Note that the sensor reported an error
+void
+load_cell_probe_report_error(struct load_cell_probe *lcp)
+{
+    irqstatus_t flag = irq_save();
+    if (lcp->flags & LCP_CAN_TRIGGER)
+        lcp_trigger(lcp, lcp->error_reason);
+    irq_restore(flag);
+}
@@ -0,0 +1,11 @@
+#ifndef __LOAD_CELL_PROBE_H
+#define __LOAD_CELL_PROBE_H
+
+#include <stdint.h> // int32_t
+
+struct load_cell_probe *load_cell_probe_oid_lookup(uint8_t oid);
+void load_cell_probe_report_sample(struct load_cell_probe *lcp
+                                   , int32_t sample);
+void load_cell_probe_report_error(struct load_cell_probe *lcp);
+
+#endif // load_cell_probe.h
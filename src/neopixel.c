@@ -1,6 +1,6 @@
 // Support for bit-banging commands to WS2812 type "neopixel" LEDs
 //
-// Copyright (C) 2019  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2019-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -11,6 +11,7 @@
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
+#include "neopixel.h" // neopixel_hw_setup
 #include "sched.h" // sched_shutdown
 
 // The WS2812 uses a bit-banging protocol where each bit is
@@ -22,6 +23,10 @@
 //   exceed ~5000ns. The average bit time must be at least 1250ns.
 // - The specs generally indicate a minimum high pulse and low pulse
 //   of 200ns, but the actual requirement might be smaller.
+//
+// If the board supports it (CONFIG_NEOPIXEL_HARDWARE) the chain is
+// instead transmitted by dma at a fixed 1250ns bit time - the send
+// command then returns without waiting for the transmission.
 
 
 
@@ -85,12 +90,16 @@ neopixel_delay(neopixel_time_t start, neopixel_time_t ticks)
 
 struct neopixel_s {
     struct gpio_out pin;
+    struct neopixel_hw hw;
     neopixel_time_t bit_max_ticks;
     uint32_t last_req_time, reset_min_ticks;
     uint16_t data_size;
+    uint8_t flags;
     uint8_t data[0];
 };
 
+enum { NF_HW = 1<<0, NF_HW_ACTIVE = 1<<1 };
+
 void
 command_config_neopixel(uint32_t *args)
 {
@@ -104,14 +113,33 @@ command_config_neopixel(uint32_t *args)
     n->data_size = data_size;
     n->bit_max_ticks = args[3];
     n->reset_min_ticks = args[4];
+    if (CONFIG_NEOPIXEL_HARDWARE && !neopixel_hw_setup(&n->hw, args[1]))
+        n->flags = NF_HW;
 }
 DECL_COMMAND(command_config_neopixel, "config_neopixel oid=%c pin=%u"
              " data_size=%hu bit_max_ticks=%u reset_min_ticks=%u");
 
+// Wait for a hardware transmission to complete
+static void
+neopixel_hw_wait(struct neopixel_s *n)
+{
+    if (!(n->flags & NF_HW_ACTIVE))
+        return;
+    while (neopixel_hw_busy(&n->hw))
+        irq_poll();
+    n->flags &= ~NF_HW_ACTIVE;
+    // The transmission ended before both now and its expected end time
+    uint32_t cur = timer_read_time();
+    if (timer_is_before(cur, n->last_req_time))
+        n->last_req_time = cur;
+}
+
 static int
 send_data(struct neopixel_s *n)
 {
     // Make sure the reset time has elapsed since last request
+    if (CONFIG_NEOPIXEL_HARDWARE)
+        neopixel_hw_wait(n);
     uint32_t last_req_time = n->last_req_time, rmt = n->reset_min_ticks;
     uint32_t cur = timer_read_time();
     while (cur - last_req_time < rmt) {
@@ -119,6 +147,15 @@ send_data(struct neopixel_s *n)
         cur = timer_read_time();
     }
 
+    if (CONFIG_NEOPIXEL_HARDWARE && n->flags & NF_HW) {
+        // Start the transmission and note when it will be complete
+        neopixel_hw_send(&n->hw, n->data, n->data_size);
+        n->last_req_time = (cur + n->data_size * timer_from_us(10)
+                            + timer_from_us(2));
+        n->flags |= NF_HW_ACTIVE;
+        return 0;
+    }
+
     // Transmit data
     uint8_t *data = n->data;
     uint_fast16_t data_len = n->data_size;
@@ -184,11 +221,38 @@ command_neopixel_update(uint32_t *args)
     uint8_t *data = command_decode_ptr(args[3]);
     if (pos & 0x8000 || pos + data_len > n->data_size)
         shutdown("Invalid neopixel update command");
+    if (CONFIG_NEOPIXEL_HARDWARE)
+        // Don't modify the data while it is being transmitted
+        neopixel_hw_wait(n);
     memcpy(&n->data[pos], data, data_len);
 }
 DECL_COMMAND(command_neopixel_update,
              "neopixel_update oid=%c pos=%hu data=%*s");
 
+void
+command_neopixel_fill(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct neopixel_s *n = oid_lookup(oid, command_config_neopixel);
+    uint_fast16_t pos = args[1], count = args[2];
+    uint_fast8_t data_len = args[3];
+    uint8_t *data = command_decode_ptr(args[4]);
+    if (pos & 0x8000 || count & 0x8000 || !data_len
+        || pos + (uint32_t)count * data_len > n->data_size)
+        shutdown("Invalid neopixel fill command");
+    if (CONFIG_NEOPIXEL_HARDWARE)
+        // Don't modify the data while it is being transmitted
+        neopixel_hw_wait(n);
+    // Repeat the pattern 'count' times starting at 'pos'
+    uint8_t *d = &n->data[pos];
+    while (count--) {
+        memcpy(d, data, data_len);
+        d += data_len;
+    }
+}
+DECL_COMMAND(command_neopixel_fill,
+             "neopixel_fill oid=%c pos=%hu count=%hu data=%*s");
+
 void
 command_neopixel_send(uint32_t *args)
 {
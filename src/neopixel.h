@@ -0,0 +1,17 @@
+#ifndef __NEOPIXEL_H
+#define __NEOPIXEL_H
+
+#include <stdint.h> // uint8_t
+
+// Hardware (dma driven) transmitter for a neopixel chain
+struct neopixel_hw {
+    uint8_t chan;
+};
+
+// Board code (if CONFIG_NEOPIXEL_HARDWARE)
+int neopixel_hw_setup(struct neopixel_hw *h, uint32_t pin);
+void neopixel_hw_send(struct neopixel_hw *h, uint8_t *data
+                      , uint_fast16_t len);
+int neopixel_hw_busy(struct neopixel_hw *h);
+
+#endif // neopixel.h
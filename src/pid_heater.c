@@ -0,0 +1,282 @@
+// Heater temperature control (PID) and runaway checks on the mcu
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_HAVE_GPIO_HARD_PWM
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "command.h" // DECL_COMMAND
+#include "pid_heater.h" // pid_heater_report
+#include "sched.h" // DECL_SHUTDOWN
+
+// Temperatures are in host defined units (the host sends an adc to
+// temperature conversion table), the pid output is Q15 power
+#define TABLE_SIZE 16
+DECL_CONSTANT("PID_HEATER_TABLE_SIZE", TABLE_SIZE);
+#define POWER_FRAC_BITS 15
+DECL_CONSTANT("PID_HEATER_POWER_FRAC_BITS", POWER_FRAC_BITS);
+
+struct pid_heater {
+    void *out;
+    uint32_t pwm_max;
+    uint8_t oid, flags, table_count;
+    uint16_t report_div, report_count;
+    // Temperature conversion
+    uint16_t table_adc[TABLE_SIZE];
+    int16_t table_temp[TABLE_SIZE];
+    // PID state
+    int32_t kp, ki, kd, integ_max;
+    int32_t integ, prev_temp, deriv;
+    uint16_t max_power, deriv_alpha;
+    int16_t target;
+    uint16_t expire_count;
+    // Runaway checks (see klippy/extras/verify_heater.py)
+    int16_t hysteresis, heating_gain, last_target;
+    int32_t max_error, error, goal_temp;
+    uint16_t gain_reports, goal_count;
+};
+
+enum {
+    PH_HARD_PWM = 1<<0, PH_INVERT = 1<<1, PH_ACTIVE = 1<<2,
+    PH_HAVE_TEMP = 1<<3, PH_APPROACHING = 1<<4, PH_STARTING = 1<<5,
+};
+
+void
+command_config_pid_heater(uint32_t *args)
+{
+    uint8_t hard_pwm = args[3];
+    void *out;
+    if (CONFIG_HAVE_GPIO_HARD_PWM && hard_pwm)
+        out = pwm_out_oid_lookup(args[2]);
+    else if (!hard_pwm)
+        out = digital_out_oid_lookup(args[2]);
+    else
+        shutdown("Hardware pwm not supported");
+    struct pid_heater *ph = oid_alloc(
+        args[0], command_config_pid_heater, sizeof(*ph));
+    ph->oid = args[0];
+    ph->out = out;
+    ph->flags = (hard_pwm ? PH_HARD_PWM : 0) | (args[4] ? PH_INVERT : 0);
+    ph->pwm_max = args[5];
+    ph->report_div = args[6] ? args[6] : 1;
+    analog_in_attach_pid_heater(args[1], ph);
+}
+DECL_COMMAND(command_config_pid_heater,
+             "config_pid_heater oid=%c adc_oid=%c pwm_oid=%c hard_pwm=%c"
+             " invert=%c pwm_max=%u report_div=%hu");
+
+static struct pid_heater *
+pid_heater_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_pid_heater);
+}
+
+// Add an entry to the adc to temperature conversion table
+void
+command_pid_heater_set_table(uint32_t *args)
+{
+    struct pid_heater *ph = pid_heater_oid_lookup(args[0]);
+    uint8_t index = args[1];
+    uint16_t adc = args[2];
+    if (index >= TABLE_SIZE || index > ph->table_count
+        || (index && adc <= ph->table_adc[index - 1]))
+        shutdown("Invalid pid_heater table entry");
+    ph->table_adc[index] = adc;
+    ph->table_temp[index] = args[3];
+    ph->table_count = index + 1;
+}
+DECL_COMMAND(command_pid_heater_set_table,
+             "pid_heater_set_table oid=%c index=%c adc=%hu temp=%hi");
+
+void
+command_pid_heater_set_pid(uint32_t *args)
+{
+    struct pid_heater *ph = pid_heater_oid_lookup(args[0]);
+    ph->kp = args[1];
+    ph->ki = args[2];
+    ph->kd = args[3];
+    ph->integ_max = args[4];
+    ph->max_power = args[5];
+    ph->deriv_alpha = args[6];
+}
+DECL_COMMAND(command_pid_heater_set_pid,
+             "pid_heater_set_pid oid=%c kp=%i ki=%i kd=%i integ_max=%i"
+             " max_power=%hu deriv_alpha=%hu");
+
+void
+command_pid_heater_set_verify(uint32_t *args)
+{
+    struct pid_heater *ph = pid_heater_oid_lookup(args[0]);
+    ph->hysteresis = args[1];
+    ph->heating_gain = args[2];
+    ph->max_error = args[3];
+    ph->gain_reports = args[4];
+}
+DECL_COMMAND(command_pid_heater_set_verify,
+             "pid_heater_set_verify oid=%c hysteresis=%hi heating_gain=%hi"
+             " max_error=%i gain_reports=%hu");
+
+// Set the target temperature (a target of zero disables the heater)
+void
+command_pid_heater_set_target(uint32_t *args)
+{
+    struct pid_heater *ph = pid_heater_oid_lookup(args[0]);
+    int16_t target = args[1];
+    if (ph->table_count < 2)
+        shutdown("pid_heater conversion table not configured");
+    irq_disable();
+    uint8_t flags = ph->flags;
+    if (target > 0) {
+        if (!(flags & PH_ACTIVE)) {
+            ph->integ = 0;
+            ph->last_target = 0;
+            ph->error = 0;
+            flags &= ~(PH_APPROACHING | PH_STARTING);
+        }
+        flags |= PH_ACTIVE;
+    }
+    ph->flags = flags;
+    ph->target = target;
+    ph->expire_count = args[2];
+    irq_enable();
+}
+DECL_COMMAND(command_pid_heater_set_target,
+             "pid_heater_set_target oid=%c target=%hi expire_reports=%hu");
+
+// Convert an adc reading to a temperature using the host supplied table
+static int32_t
+pid_heater_calc_temp(struct pid_heater *ph, uint16_t adc)
+{
+    uint_fast8_t i, count = ph->table_count;
+    for (i=1; i<count-1; i++)
+        if (adc < ph->table_adc[i])
+            break;
+    int32_t a0 = ph->table_adc[i-1], a1 = ph->table_adc[i];
+    int32_t t0 = ph->table_temp[i-1], t1 = ph->table_temp[i];
+    return t0 + (t1 - t0) * ((int32_t)adc - a0) / (a1 - a0);
+}
+
+// Check that the heater is able to reach and maintain its target
+static void
+pid_heater_verify(struct pid_heater *ph, int32_t temp)
+{
+    int32_t target = ph->target;
+    uint8_t flags = ph->flags;
+    if (temp >= target - ph->hysteresis) {
+        // Temperature near target - reset checks
+        flags &= ~(PH_APPROACHING | PH_STARTING);
+        if (temp <= target + ph->hysteresis)
+            ph->error = 0;
+    } else {
+        ph->error += (target - ph->hysteresis) - temp;
+        if (!(flags & PH_APPROACHING)) {
+            if (target != ph->last_target) {
+                // Target changed - reset checks
+                flags |= PH_APPROACHING | PH_STARTING;
+                ph->goal_temp = temp + ph->heating_gain;
+                ph->goal_count = ph->gain_reports;
+            } else if (ph->error >= ph->max_error) {
+                shutdown("Heater not heating at expected rate");
+            }
+        } else if (temp >= ph->goal_temp) {
+            // Temperature approaching target - reset checks
+            flags &= ~PH_STARTING;
+            ph->error = 0;
+            ph->goal_temp = temp + ph->heating_gain;
+            ph->goal_count = ph->gain_reports;
+        } else if (!ph->goal_count || !--ph->goal_count) {
+            // Temperature is no longer approaching target
+            flags &= ~PH_APPROACHING;
+        } else if (flags & PH_STARTING) {
+            if (temp + ph->heating_gain < ph->goal_temp)
+                ph->goal_temp = temp + ph->heating_gain;
+        }
+    }
+    ph->flags = flags;
+    ph->last_target = target;
+}
+
+// Calculate the new heater power (Q15)
+static uint16_t
+pid_heater_calc_power(struct pid_heater *ph, int32_t temp)
+{
+    int32_t err = ph->target - temp;
+    int32_t integ = ph->integ + err;
+    if (integ < 0)
+        integ = 0;
+    else if (integ > ph->integ_max)
+        integ = ph->integ_max;
+    int64_t co = ((int64_t)ph->kp * err + (int64_t)ph->ki * integ
+                  - (int64_t)ph->kd * ph->deriv) >> 16;
+    if (co < 0)
+        return 0;
+    if (co > ph->max_power)
+        return ph->max_power;
+    // Only integrate while the output is not saturated
+    ph->integ = integ;
+    return co;
+}
+
+static void
+pid_heater_set_power(struct pid_heater *ph, uint16_t power)
+{
+    uint32_t value = ((uint64_t)power * ph->pwm_max) >> POWER_FRAC_BITS;
+    if (ph->flags & PH_INVERT)
+        value = ph->pwm_max - value;
+    if (CONFIG_HAVE_GPIO_HARD_PWM && ph->flags & PH_HARD_PWM)
+        pwm_out_update(ph->out, value);
+    else
+        digital_out_update_pwm(ph->out, value);
+}
+
+// Process a new adc measurement - returns non-zero if the measurement
+// should also be reported to the host
+uint_fast8_t
+pid_heater_report(struct pid_heater *ph, uint16_t value)
+{
+    int32_t temp = pid_heater_calc_temp(ph, value);
+    if (!(ph->flags & PH_HAVE_TEMP)) {
+        ph->flags |= PH_HAVE_TEMP;
+        ph->prev_temp = temp;
+    }
+
+    // Smoothed rate of change (in 1/256th units per report)
+    int32_t diff = (temp - ph->prev_temp) << 8;
+    ph->deriv += ((int64_t)(diff - ph->deriv) * ph->deriv_alpha) >> 15;
+    ph->prev_temp = temp;
+
+    if (!(ph->flags & PH_ACTIVE))
+        return 1;
+
+    uint16_t power = 0;
+    if (ph->target <= 0 || (ph->expire_count && !--ph->expire_count)) {
+        // Heater disabled (or host stopped refreshing the target)
+        ph->flags &= ~PH_ACTIVE;
+        ph->target = 0;
+    } else {
+        pid_heater_verify(ph, temp);
+        power = pid_heater_calc_power(ph, temp);
+    }
+    pid_heater_set_power(ph, power);
+
+    if (ph->flags & PH_ACTIVE && ++ph->report_count < ph->report_div)
+        return 0;
+    ph->report_count = 0;
+    sendf("pid_heater_state oid=%c target=%hi power=%hu"
+          , ph->oid, ph->target, power);
+    return 1;
+}
+
+void
+pid_heater_shutdown(void)
+{
+    uint8_t i;
+    struct pid_heater *ph;
+    foreach_oid(i, ph, command_config_pid_heater) {
+        ph->flags &= ~PH_ACTIVE;
+        ph->target = 0;
+    }
+}
+DECL_SHUTDOWN(pid_heater_shutdown);
@@ -0,0 +1,21 @@
+#ifndef __PID_HEATER_H
+#define __PID_HEATER_H
+
+#include <stdint.h> // uint32_t
+
+// pid_heater.c
+struct pid_heater;
+uint_fast8_t pid_heater_report(struct pid_heater *ph, uint16_t value);
+
+// adccmds.c
+void analog_in_attach_pid_heater(uint8_t oid, struct pid_heater *ph);
+
+// gpiocmds.c
+struct digital_out_s *digital_out_oid_lookup(uint8_t oid);
+void digital_out_update_pwm(struct digital_out_s *d, uint32_t on_ticks);
+
+// pwmcmds.c
+struct pwm_out_s *pwm_out_oid_lookup(uint8_t oid);
+void pwm_out_update(struct pwm_out_s *p, uint16_t value);
+
+#endif // pid_heater.h
@@ -0,0 +1,160 @@
+// Timer and task execution profiling
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memset
+#include "autoconf.h" // CONFIG_INLINE_STEPPER_HACK
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // profile_timer
+#include "stepper.h" // stepper_event
+
+// Request that buildcommands.py add profiling to ctr_run_taskfuncs()
+DECL_CTR("_DECL_TASK_PROFILE");
+
+struct profile_stat {
+    uint32_t count, sum, max;
+};
+
+struct timer_profile {
+    uint_fast8_t (*func)(struct timer*);
+    struct profile_stat stat;
+    uint32_t latency_max;
+};
+
+// Timer functions beyond the size of the table are accumulated in
+// the last entry (which is reported with a func of zero)
+#define PROFILE_TIMERS 16
+#define PROFILE_TASKS 32
+#define PROFILE_HIST 8
+
+static struct timer_profile timer_profiles[PROFILE_TIMERS];
+static struct profile_stat task_profiles[PROFILE_TASKS];
+static uint32_t latency_max, latency_hist[PROFILE_HIST];
+static uint8_t latency_shift, timer_overflow;
+
+static void
+profile_stat_update(struct profile_stat *s, uint32_t diff)
+{
+    s->count++;
+    uint32_t sum = s->sum + diff;
+    s->sum = sum < diff ? 0xffffffff : sum;
+    if (diff > s->max)
+        s->max = diff;
+}
+
+// Note the dispatch latency and run time of a timer callback
+void
+profile_timer(uint_fast8_t (*func)(struct timer*), uint32_t waketime
+              , uint32_t start)
+{
+    uint32_t end = timer_read_time();
+
+    // Update latency between scheduled waketime and dispatch
+    uint32_t latency = 0;
+    if (timer_is_before(waketime, start))
+        latency = start - waketime;
+    if (latency > latency_max)
+        latency_max = latency;
+    uint32_t v = latency >> latency_shift;
+    uint_fast8_t bucket = 0;
+    while (v && bucket < PROFILE_HIST - 1) {
+        v >>= 1;
+        bucket++;
+    }
+    latency_hist[bucket]++;
+
+    // Update run time of the timer function
+    if (CONFIG_INLINE_STEPPER_HACK && !func)
+        func = stepper_event;
+    struct timer_profile *tp = timer_profiles;
+    for (;;) {
+        if (tp->func == func)
+            break;
+        if (!tp->func) {
+            tp->func = func;
+            break;
+        }
+        if (tp == &timer_profiles[PROFILE_TIMERS - 1]) {
+            timer_overflow = 1;
+            break;
+        }
+        tp++;
+    }
+    profile_stat_update(&tp->stat, end - start);
+    if (latency > tp->latency_max)
+        tp->latency_max = latency;
+}
+
+// Task profiling helpers (called from the generated ctr_run_taskfuncs)
+uint32_t
+profile_task_begin(void)
+{
+    return timer_read_time();
+}
+
+void
+profile_task_end(uint8_t task, uint32_t start)
+{
+    if (task < PROFILE_TASKS)
+        profile_stat_update(&task_profiles[task], timer_read_time() - start);
+}
+
+void
+profile_init(void)
+{
+    // Latency histogram buckets are powers of two of ~1us
+    uint32_t ticks = timer_from_us(1);
+    while (ticks > 1) {
+        ticks >>= 1;
+        latency_shift++;
+    }
+}
+DECL_INIT(profile_init);
+
+// Report (and reset) the collected profile
+void
+command_get_profile(uint32_t *args)
+{
+    uint_fast8_t i;
+    for (i=0; i<PROFILE_TIMERS; i++) {
+        struct timer_profile *tp = &timer_profiles[i];
+        irq_disable();
+        uint_fast8_t (*func)(struct timer*) = tp->func;
+        struct profile_stat stat = tp->stat;
+        uint32_t latency = tp->latency_max;
+        memset(&tp->stat, 0, sizeof(tp->stat));
+        tp->latency_max = 0;
+        irq_enable();
+        if (!func)
+            break;
+        if (!stat.count)
+            continue;
+        if (i == PROFILE_TIMERS - 1 && timer_overflow)
+            func = NULL;
+        sendf("profile_timer func=%u count=%u sum=%u max=%u latency=%u"
+              , (uint32_t)(size_t)func, stat.count, stat.sum, stat.max
+              , latency);
+    }
+    for (i=0; i<PROFILE_TASKS; i++) {
+        struct profile_stat *s = &task_profiles[i];
+        if (!s->count)
+            continue;
+        sendf("profile_task task=%c count=%u sum=%u max=%u"
+              , i, s->count, s->sum, s->max);
+        memset(s, 0, sizeof(*s));
+    }
+    uint32_t hist[PROFILE_HIST];
+    irq_disable();
+    uint32_t max = latency_max;
+    memcpy(hist, latency_hist, sizeof(hist));
+    latency_max = 0;
+    memset(latency_hist, 0, sizeof(latency_hist));
+    irq_enable();
+    sendf("profile_latency max=%u shift=%c hist=%*s"
+          , max, latency_shift, sizeof(hist), (uint8_t*)hist);
+}
+DECL_COMMAND(command_get_profile, "get_profile");
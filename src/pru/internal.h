@@ -28,17 +28,25 @@
 
 #define ALT_PRU_PTR(ptr) ((typeof(ptr))((uint32_t)(ptr) ^ 0x2000))
 
+// Parsed command passed from PRU0 to PRU1
+struct shared_command {
+    const struct command_parser *cp;
+    uint32_t args[16];
+};
+
+#define COMMAND_RING_SIZE 8
+
 // Layout of shared memory
 struct shared_mem {
     uint32_t signal;
     void *next_encoder_args;
     uint32_t next_encoder;
-    const struct command_parser *next_command;
-    uint32_t next_command_args[16];
+    uint32_t command_head, command_tail;
+    struct shared_command commands[COMMAND_RING_SIZE];
     const struct command_parser *command_index;
     uint32_t command_index_size;
     const struct command_parser *shutdown_handler;
-    uint8_t read_data[512];
+    uint8_t read_data[2][512];
 };
 
 #define SIGNAL_PRU0_WAITING 0xefefefef
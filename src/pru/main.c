@@ -1,6 +1,6 @@
 // Main starting point for PRU code.
 //
-// Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -122,22 +122,27 @@ DECL_INIT(timer_init);
 // Writes over 496 bytes don't fit in a single "rpmsg" page
 DECL_CONSTANT("RECEIVE_WINDOW", 496 - 1);
 
-// Process any incoming commands
+// Process any incoming commands (as queued by PRU0)
 void
 console_task(void)
 {
-    const struct command_parser *cp = SHARED_MEM->next_command;
-    if (!cp)
-        return;
-
-    if (sched_is_shutdown() && !(cp->flags & HF_IN_SHUTDOWN)) {
-        sched_report_shutdown();
-    } else {
-        void (*func)(uint32_t*) = cp->func;
-        func(SHARED_MEM->next_command_args);
+    for (;;) {
+        uint32_t tail = SHARED_MEM->command_tail;
+        if (tail == readl(&SHARED_MEM->command_head))
+            return;
+        struct shared_command *sc;
+        sc = &SHARED_MEM->commands[tail % COMMAND_RING_SIZE];
+        const struct command_parser *cp = sc->cp;
+
+        if (sched_is_shutdown() && !(cp->flags & HF_IN_SHUTDOWN)) {
+            sched_report_shutdown();
+        } else {
+            void (*func)(uint32_t*) = cp->func;
+            func(sc->args);
+        }
+
+        writel(&SHARED_MEM->command_tail, tail + 1);
     }
-
-    writel(&SHARED_MEM->next_command, 0);
 }
 DECL_TASK(console_task);
 
@@ -159,7 +164,7 @@ console_sendf(const struct command_encoder *ce, va_list args)
 void
 console_shutdown(void)
 {
-    writel(&SHARED_MEM->next_command, 0);
+    writel(&SHARED_MEM->command_tail, readl(&SHARED_MEM->command_head));
     writel(&SHARED_MEM->next_encoder, 0);
     in_timer_dispatch = 0;
 }
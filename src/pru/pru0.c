@@ -1,6 +1,6 @@
 // Code to handle IO on PRU0 and pass the messages to PRU1
 //
-// Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2017-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -105,22 +105,40 @@ check_can_send(void)
     }
 }
 
-// Wait for PRU1 to finish processing a command
+static uint32_t command_head;
+
+// Check if PRU1 has processed all commands queued up to 'head'
+static int
+pru1_commands_done(uint32_t head)
+{
+    return (int32_t)(readl(&SHARED_MEM->command_tail) - head) >= 0;
+}
+
+// Wait for PRU1 to finish processing all queued commands
 static void
 wait_pru1_command(void)
 {
-    while (readl(&SHARED_MEM->next_command))
+    while (!pru1_commands_done(command_head))
         check_can_send();
     check_can_send();
 }
 
+// Wait for a free slot in the command ring
+static struct shared_command *
+get_pru1_command(void)
+{
+    while (!pru1_commands_done(command_head - COMMAND_RING_SIZE + 1))
+        check_can_send();
+    return &SHARED_MEM->commands[command_head % COMMAND_RING_SIZE];
+}
+
 // Signal PRU1 that a new command is ready
 static void
-send_pru1_command(const struct command_parser *cp)
+send_pru1_command(struct shared_command *sc, const struct command_parser *cp)
 {
+    sc->cp = cp;
     barrier();
-    SHARED_MEM->next_command = cp;
-    barrier();
+    writel(&SHARED_MEM->command_head, ++command_head);
     write_r31(R31_WRITE_IRQ_SELECT | (KICK_PRU1_EVENT - R31_WRITE_IRQ_OFFSET));
 }
 
@@ -129,7 +147,7 @@ static void
 send_pru1_shutdown(void)
 {
     wait_pru1_command();
-    send_pru1_command(SHARED_MEM->shutdown_handler);
+    send_pru1_command(get_pru1_command(), SHARED_MEM->shutdown_handler);
     wait_pru1_command();
 }
 
@@ -143,28 +161,55 @@ do_dispatch(uint8_t *buf, uint32_t msglen)
         // Parse command
         uint_fast16_t cmdid = command_parse_msgid(&p);
         const struct command_parser *cp = &SHARED_MEM->command_index[cmdid];
+        struct shared_command *sc = get_pru1_command();
         if (!cmdid || cmdid >= SHARED_MEM->command_index_size
-            || cp->num_args > ARRAY_SIZE(SHARED_MEM->next_command_args)) {
+            || cp->num_args > ARRAY_SIZE(sc->args)) {
             send_pru1_shutdown();
             return;
         }
-        p = command_parsef(p, msgend, cp, SHARED_MEM->next_command_args);
+        p = command_parsef(p, msgend, cp, sc->args);
 
-        send_pru1_command(ALT_PRU_PTR(cp));
-        wait_pru1_command();
+        // PRU1 runs the command while the next one is parsed
+        send_pru1_command(sc, ALT_PRU_PTR(cp));
     }
 }
 
+static uint32_t ack_head;
+static uint8_t ack_pending;
+
+// Send a pending ack once PRU1 has processed the acknowledged commands
+static int
+check_send_ack(void)
+{
+    if (!ack_pending)
+        return 0;
+    if (!pru1_commands_done(ack_head))
+        return 1;
+    command_send_ack();
+    ack_pending = 0;
+    return 0;
+}
+
+static uint32_t read_buf;
+static uint32_t read_buf_head[ARRAY_SIZE(SHARED_MEM->read_data)];
+
 // See if there are commands from the host ready to be processed
 static int
 check_can_read(void)
 {
+    // Queued commands may reference (buffer) parameters in the read
+    // data, so only reuse a read buffer once its commands are done
+    uint32_t rb = read_buf;
+    while (!pru1_commands_done(read_buf_head[rb]))
+        check_can_send();
+
     // Read data
     uint16_t dst, len;
-    uint8_t *p = SHARED_MEM->read_data;
+    uint8_t *p = SHARED_MEM->read_data[rb];
     int16_t ret = pru_rpmsg_receive(&transport, &transport_dst, &dst, p, &len);
     if (ret)
         return ret == PRU_RPMSG_NO_BUF_AVAILABLE;
+    read_buf = (rb + 1) % ARRAY_SIZE(SHARED_MEM->read_data);
 
     // Check for force shutdown request
     if (len == 15 && p[14] == '\n' && memcmp(p, "FORCE_SHUTDOWN\n", 15) == 0) {
@@ -180,11 +225,14 @@ check_can_read(void)
             break;
         if (ret > 0) {
             do_dispatch(p, pop_count);
-            command_send_ack();
+            // Acks are cumulative - send one when the commands complete
+            ack_head = command_head;
+            ack_pending = 1;
         }
         p += pop_count;
         len -= pop_count;
     }
+    read_buf_head[rb] = command_head;
     return 0;
 }
 
@@ -197,6 +245,8 @@ process_io(void)
                          | (1 << KICK_PRU0_EVENT));
         check_can_send();
         int can_sleep = check_can_read();
+        if (check_send_ack())
+            can_sleep = 0;
         if (can_sleep) {
             flush_messages();
             while (!(read_r31() & (1 << (WAKE_PRU0_IRQ + R31_IRQ_OFFSET)))) {
@@ -4,11 +4,13 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_COUNTER_HARDWARE
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_in
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "command.h" // DECL_COMMAND
+#include "pulse_counter.h" // counter_hw_setup
 #include "sched.h" // DECL_TASK
 
 struct counter {
@@ -18,13 +20,17 @@ struct counter {
     uint32_t count, last_count_time;
     uint8_t flags;
     struct gpio_in pin;
+#if CONFIG_COUNTER_HARDWARE
+    struct counter_hw *hw;
+    uint16_t hw_last;
+#endif
 };
 
 enum {
     CF_PENDING = 1,
 };
 
-static struct task_wake counter_wake;
+DECL_TASK_WAKE(counter_wake);
 
 static uint_fast8_t
 counter_event(struct timer *timer)
@@ -50,11 +56,45 @@ counter_event(struct timer *timer)
     return SF_RESCHEDULE;
 }
 
+#if CONFIG_COUNTER_HARDWARE
+// Event handler for pins counted by a hardware peripheral.  The
+// peripheral only counts rising edges and only needs to be read once
+// per sample.
+static uint_fast8_t
+counter_hw_event(struct timer *timer)
+{
+    struct counter *c = container_of(timer, struct counter, timer);
+
+    uint32_t time = c->timer.waketime;
+    uint16_t hw_count = counter_hw_read(c->hw);
+    uint16_t diff = hw_count - c->hw_last;
+    if (diff) {
+        // Report both edges of each pulse (as done by counter_event)
+        c->count += 2 * diff;
+        c->last_count_time = time;
+        c->hw_last = hw_count;
+    }
+
+    c->flags |= CF_PENDING;
+    sched_wake_task(&counter_wake);
+
+    c->timer.waketime += c->sample_ticks;
+    return SF_RESCHEDULE;
+}
+#endif
+
 void
 command_config_counter(uint32_t *args)
 {
     struct counter *c = oid_alloc(
         args[0], command_config_counter, sizeof(*c));
+#if CONFIG_COUNTER_HARDWARE
+    c->hw = counter_hw_setup(args[1], args[2]);
+    if (c->hw) {
+        c->timer.func = counter_hw_event;
+        return;
+    }
+#endif
     c->pin = gpio_in_setup(args[1], args[2]);
     c->timer.func = counter_event;
 }
@@ -70,6 +110,10 @@ command_query_counter(uint32_t *args)
     c->poll_ticks = args[2];
     c->sample_ticks = args[3];
     c->next_sample_time = c->timer.waketime; // sample immediately
+#if CONFIG_COUNTER_HARDWARE
+    if (c->hw)
+        c->hw_last = counter_hw_read(c->hw);
+#endif
     sched_add_timer(&c->timer);
 }
 DECL_COMMAND(command_query_counter,
@@ -92,8 +136,13 @@ counter_task(void)
         uint32_t count_time = c->last_count_time;
         c->flags &= ~CF_PENDING;
         irq_enable();
+#if CONFIG_COUNTER_HARDWARE
+        if (c->hw)
+            // Report the time as if the sample was taken by counter_event
+            waketime += c->poll_ticks - c->sample_ticks;
+#endif
         sendf("counter_state oid=%c next_clock=%u count=%u count_clock=%u",
               oid, waketime, count, count_time);
     }
 }
-DECL_TASK(counter_task);
+DECL_WAKE_TASK(counter_task, counter_wake);
@@ -0,0 +1,11 @@
+#ifndef __PULSE_COUNTER_H
+#define __PULSE_COUNTER_H
+
+#include <stdint.h> // uint16_t
+
+// Board code (if CONFIG_COUNTER_HARDWARE)
+struct counter_hw;
+struct counter_hw *counter_hw_setup(uint32_t pin, uint8_t pull_up);
+uint16_t counter_hw_read(struct counter_hw *h);
+
+#endif // pulse_counter.h
@@ -4,25 +4,39 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <stddef.h> // offsetof
+#include <string.h> // memcpy
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_pwm
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_is_before
 #include "command.h" // DECL_COMMAND
+#include "pid_heater.h" // pwm_out_update
 #include "sched.h" // sched_add_timer
 
 struct pwm_out_s {
     struct timer timer;
     struct gpio_pwm pin;
-    uint32_t max_duration;
+    uint32_t max_duration, stream_scale;
     uint16_t default_value;
+    uint8_t stream_pos;
     struct move_queue_head mq;
 };
 
+// Number of 8-bit "pwm stream" values stored in each move queue entry
+#define PWM_STREAM_VALUES 3
+DECL_CONSTANT("PWM_STREAM_VALUES", PWM_STREAM_VALUES);
+
 struct pwm_move {
     struct move_node node;
     uint32_t waketime;
-    uint16_t value;
+    union {
+        uint16_t value;
+        uint32_t interval;
+    };
+    // Entries with a non-zero count replay 'values' every 'interval'
+    uint8_t count;
+    uint8_t values[PWM_STREAM_VALUES];
 };
 
 static uint_fast8_t
@@ -34,12 +48,25 @@ pwm_end_event(struct timer *timer)
 static uint_fast8_t
 pwm_event(struct timer *timer)
 {
-    // Apply next update and remove it from queue
     struct pwm_out_s *p = container_of(timer, struct pwm_out_s, timer);
-    struct move_node *mn = move_queue_pop(&p->mq);
+    struct move_node *mn = move_queue_first(&p->mq);
     struct pwm_move *m = container_of(mn, struct pwm_move, node);
     uint16_t value = m->value;
+    if (m->count) {
+        // Apply next value of a pwm stream
+        uint8_t pos = p->stream_pos++;
+        value = (m->values[pos] * p->stream_scale) >> 8;
+        if (pos + 1 < m->count) {
+            gpio_pwm_write(p->pin, value);
+            p->timer.waketime += m->interval;
+            return SF_RESCHEDULE;
+        }
+        p->stream_pos = 0;
+    }
     gpio_pwm_write(p->pin, value);
+
+    // Remove completed update from queue
+    move_queue_pop(&p->mq);
     move_free(m);
 
     // Check if more updates queued
@@ -73,20 +100,22 @@ command_config_pwm_out(uint32_t *args)
     p->default_value = args[4];
     p->max_duration = args[5];
     p->timer.func = pwm_event;
-    move_queue_setup(&p->mq, sizeof(struct pwm_move));
+    move_queue_setup(&p->mq, offsetof(struct pwm_move, values), args[0]);
 }
 DECL_COMMAND(command_config_pwm_out,
              "config_pwm_out oid=%c pin=%u cycle_ticks=%u value=%hu"
              " default_value=%hu max_duration=%u");
 
-void
-command_queue_pwm_out(uint32_t *args)
+struct pwm_out_s *
+pwm_out_oid_lookup(uint8_t oid)
 {
-    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
-    struct pwm_move *m = move_alloc();
-    m->waketime = args[1];
-    m->value = args[2];
+    return oid_lookup(oid, command_config_pwm_out);
+}
 
+// Add an entry to the pwm move queue
+static void
+pwm_out_queue_move(struct pwm_out_s *p, struct pwm_move *m)
+{
     irq_disable();
     int need_add_timer = move_queue_push(&m->node, &p->mq);
     irq_enable();
@@ -102,8 +131,81 @@ command_queue_pwm_out(uint32_t *args)
     p->timer.waketime = m->waketime;
     sched_add_timer(&p->timer);
 }
+
+static void
+pwm_out_queue(struct pwm_out_s *p, uint32_t time, uint16_t value)
+{
+    struct pwm_move *m = move_alloc();
+    m->waketime = time;
+    m->value = value;
+    m->count = 0;
+    pwm_out_queue_move(p, m);
+}
+
+void
+command_queue_pwm_out(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    pwm_out_queue(p, args[1], args[2]);
+}
 DECL_COMMAND(command_queue_pwm_out, "queue_pwm_out oid=%c clock=%u value=%hu");
 
+// Enable support for "pwm streams" (a series of evenly spaced updates)
+void
+command_config_pwm_out_stream(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    move_request_size(sizeof(struct pwm_move));
+    p->stream_scale = args[1];
+}
+DECL_COMMAND(command_config_pwm_out_stream,
+             "config_pwm_out_stream oid=%c scale=%u");
+
+// Queue 8-bit values that are applied every 'interval' ticks from 'clock'
+void
+command_queue_pwm_stream(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    uint32_t time = args[1], interval = args[2];
+    uint8_t count = args[3], *values = command_decode_ptr(args[4]);
+    if (!p->stream_scale || !interval
+        || (p->max_duration && interval >= p->max_duration))
+        shutdown("Invalid pwm stream request");
+    while (count) {
+        uint8_t c = count > PWM_STREAM_VALUES ? PWM_STREAM_VALUES : count;
+        struct pwm_move *m = move_alloc();
+        m->waketime = time;
+        m->interval = interval;
+        m->count = c;
+        memcpy(m->values, values, c);
+        pwm_out_queue_move(p, m);
+        time += interval * c;
+        values += c;
+        count -= c;
+    }
+}
+DECL_COMMAND(command_queue_pwm_stream,
+             "queue_pwm_stream oid=%c clock=%u interval=%u values=%*s");
+
+// Schedule a pwm update from local code (such as pid_heater.c)
+void
+pwm_out_update(struct pwm_out_s *p, uint16_t value)
+{
+    // Apply shortly from now, but never before an already queued update
+    uint32_t time = timer_read_time() + timer_from_us(1000);
+    irq_disable();
+    if (!move_queue_empty(&p->mq)) {
+        struct pwm_move *m = container_of(p->mq.last, struct pwm_move, node);
+        uint32_t last = m->waketime;
+        if (m->count)
+            last += m->interval * (m->count - 1);
+        if (!timer_is_before(last, time))
+            time = last + 1;
+    }
+    irq_enable();
+    pwm_out_queue(p, time, value);
+}
+
 void
 pwm_shutdown(void)
 {
@@ -112,6 +214,7 @@ pwm_shutdown(void)
     foreach_oid(i, p, command_config_pwm_out) {
         gpio_pwm_write(p->pin, p->default_value);
         p->timer.func = pwm_event;
+        p->stream_pos = 0;
         move_queue_clear(&p->mq);
     }
 }
@@ -4,10 +4,14 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ADC_CONTINUOUS
+#include "board/io.h" // readw
 #include "board/misc.h" // timer_from_us
 #include "command.h" // shutdown
 #include "gpio.h" // gpio_adc_setup
 #include "hardware/structs/adc.h" // adc_hw
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/regs/dreq.h" // DREQ_ADC
 #include "hardware/structs/padsbank0.h" // padsbank0_hw
 #include "hardware/structs/resets.h" // RESETS_RESET_ADC_BITS
 #include "internal.h" // enable_pclock
@@ -18,6 +22,82 @@ DECL_CONSTANT("ADC_MAX", 4095);
 #define ADC_TEMPERATURE_PIN 0xfe
 DECL_ENUMERATION("pin", "ADC_TEMPERATURE", ADC_TEMPERATURE_PIN);
 
+#if CONFIG_ADC_CONTINUOUS
+
+// In continuous mode the adc round-robins over all configured
+// channels and dma stores the results in a buffer holding the last
+// ADC_OVERSAMPLE samples of each channel.  A second dma channel
+// restarts the data channel each time the buffer has been filled.
+#define ADC_OVERSAMPLE 8
+#define ADC_CHANNELS 5
+#define ADC_DIV 960 // 50Khz sample rate (with a 48Mhz adc clock)
+// Dma channels 6 and up are used by spi.c and stepper_pio.c
+#define DATA_CHAN 4
+#define CTRL_CHAN 5
+
+static uint16_t adc_buf[ADC_CHANNELS * ADC_OVERSAMPLE];
+static uint16_t *adc_buf_ptr = adc_buf;
+static uint8_t adc_mask;
+
+// (Re)start the continuous round-robin sampling of the adc
+static void
+adc_scan_start(void)
+{
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+
+    // Stop any active sampling
+    uint32_t cs = adc_hw->cs & (ADC_CS_TS_EN_BITS | ADC_CS_EN_BITS);
+    adc_hw->cs = cs;
+    while (!(adc_hw->cs & ADC_CS_READY_BITS))
+        ;
+    uint32_t chan_bits = (1 << DATA_CHAN) | (1 << CTRL_CHAN);
+    dma_hw->abort = chan_bits;
+    while (dma_hw->abort & chan_bits)
+        ;
+    adc_hw->fcs = 0;
+    while (adc_hw->fcs & ADC_FCS_LEVEL_BITS)
+        adc_hw->fifo;
+
+    // Setup dma of the results
+    dma_channel_hw_t *data = &dma_hw->ch[DATA_CHAN];
+    dma_channel_hw_t *ctrl = &dma_hw->ch[CTRL_CHAN];
+    ctrl->read_addr = (uint32_t)&adc_buf_ptr;
+    ctrl->write_addr = (uint32_t)&data->al2_write_addr_trig;
+    ctrl->transfer_count = 1;
+    ctrl->al1_ctrl = (
+        DMA_CH0_CTRL_TRIG_TREQ_SEL_VALUE_PERMANENT
+        << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+        | CTRL_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+        | 2 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB
+        | DMA_CH0_CTRL_TRIG_EN_BITS);
+    data->read_addr = (uint32_t)&adc_hw->fifo;
+    data->write_addr = (uint32_t)adc_buf;
+    data->transfer_count = __builtin_popcount(adc_mask) * ADC_OVERSAMPLE;
+    dma_hw->intr = 1 << CTRL_CHAN;
+    data->ctrl_trig = (DREQ_ADC << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+                       | CTRL_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+                       | 1 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB
+                       | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS
+                       | DMA_CH0_CTRL_TRIG_EN_BITS);
+
+    // Start round-robin sampling (starting with the lowest channel)
+    adc_hw->div = (ADC_DIV - 1) << ADC_DIV_INT_LSB;
+    adc_hw->fcs = (ADC_FCS_EN_BITS | ADC_FCS_DREQ_EN_BITS
+                   | 1 << ADC_FCS_THRESH_LSB);
+    adc_hw->cs = (cs | adc_mask << ADC_CS_RROBIN_LSB
+                  | __builtin_ctz(adc_mask) << ADC_CS_AINSEL_LSB
+                  | ADC_CS_START_MANY_BITS);
+
+    // Wait for the buffer to be filled
+    uint32_t end = timer_read_time() + timer_from_us(10000);
+    while (!(dma_hw->intr & (1 << CTRL_CHAN)))
+        if (timer_is_before(end, timer_read_time()))
+            shutdown("Timeout on adc dma");
+}
+
+#endif // CONFIG_ADC_CONTINUOUS
+
 struct gpio_adc
 gpio_adc_setup(uint32_t pin)
 {
@@ -39,9 +119,45 @@ gpio_adc_setup(uint32_t pin)
         padsbank0_hw->io[pin] = PADS_BANK0_GPIO0_OD_BITS;
     }
 
+#if CONFIG_ADC_CONTINUOUS
+    if (!(adc_mask & (1 << chan))) {
+        adc_mask |= 1 << chan;
+        adc_scan_start();
+    }
+#endif
+
     return (struct gpio_adc){ .chan = chan };
 }
 
+#if CONFIG_ADC_CONTINUOUS
+
+// Try to sample a value - always ready when sampling continuously
+uint32_t
+gpio_adc_sample(struct gpio_adc g)
+{
+    return 0;
+}
+
+// Return the average of the most recent samples of a channel
+uint16_t
+gpio_adc_read(struct gpio_adc g)
+{
+    uint_fast8_t count = __builtin_popcount(adc_mask), i;
+    uint_fast8_t slot = __builtin_popcount(adc_mask & ((1 << g.chan) - 1));
+    uint32_t sum = 0;
+    for (i=0; i<ADC_OVERSAMPLE; i++)
+        sum += readw(&adc_buf[i * count + slot]);
+    return sum / ADC_OVERSAMPLE;
+}
+
+// Cancel a sample that may have been started with gpio_adc_sample()
+void
+gpio_adc_cancel_sample(struct gpio_adc g)
+{
+}
+
+#else // !CONFIG_ADC_CONTINUOUS
+
 enum { ADC_DUMMY=0xff };
 static uint8_t last_analog_read = ADC_DUMMY;
 
@@ -86,3 +202,5 @@ gpio_adc_cancel_sample(struct gpio_adc g)
     if (last_analog_read == g.chan)
         last_analog_read = ADC_DUMMY;
 }
+
+#endif // !CONFIG_ADC_CONTINUOUS
@@ -0,0 +1,82 @@
+// Pin change (gpio) interrupts for endstop triggering on rp2040
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "compiler.h" // DIV_ROUND_UP
+#include "endstop.h" // endstop_hw_setup
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "internal.h" // IO_IRQ_BANK0_IRQn
+
+#define GPIO_COUNT 30
+
+// Each gpio has four irq bits (level low, level high, edge low, edge high)
+#define IRQ_EDGE_LOW 0x04
+#define IRQ_EDGE_HIGH 0x08
+#define IRQ_EDGE_BITS (IRQ_EDGE_LOW | IRQ_EDGE_HIGH)
+
+// Endstop (if any) using each gpio
+static struct endstop_irq *endstop_irq_active[GPIO_COUNT];
+
+// Handle the gpio irq of the bank
+void
+EndstopIO_IRQHandler(void)
+{
+    uint32_t time = timer_read_time();
+    uint32_t reg;
+    for (reg=0; reg<DIV_ROUND_UP(GPIO_COUNT, 8); reg++) {
+        uint32_t pending = iobank0_hw->proc0_irq_ctrl.ints[reg];
+        while (pending) {
+            uint32_t shift = __builtin_ctz(pending) & ~3;
+            uint32_t bits = IRQ_EDGE_BITS << shift;
+            pending &= ~bits;
+            // Only report the first edge - the endstop code re-arms as needed
+            iobank0_hw->proc0_irq_ctrl.inte[reg] &= ~bits;
+            iobank0_hw->intr[reg] = bits;
+            struct endstop_irq *ei = endstop_irq_active[reg * 8 + shift / 4];
+            ei->func(ei, time);
+        }
+    }
+}
+
+// Note the endstop of a gpio - returns non-zero if the gpio is
+// already in use (the caller should then poll the pin)
+int
+endstop_hw_setup(struct endstop_irq *ei, uint32_t pin)
+{
+    if (pin >= GPIO_COUNT || endstop_irq_active[pin])
+        return -1;
+    irqstatus_t flag = irq_save();
+    endstop_irq_active[pin] = ei;
+    ei->line = pin;
+    irq_restore(flag);
+    armcm_enable_irq(EndstopIO_IRQHandler, IO_IRQ_BANK0_IRQn, TIMER_PRIO);
+    return 0;
+}
+
+// Arm the irq for the next rising (or falling) edge
+void
+endstop_hw_enable(struct endstop_irq *ei, uint8_t rising)
+{
+    uint32_t reg = ei->line / 8, shift = (ei->line % 8) * 4;
+    irqstatus_t flag = irq_save();
+    iobank0_hw->intr[reg] = IRQ_EDGE_BITS << shift;
+    iobank0_hw->proc0_irq_ctrl.inte[reg] |= ((rising ? IRQ_EDGE_HIGH
+                                              : IRQ_EDGE_LOW) << shift);
+    irq_restore(flag);
+}
+
+// Disarm the irq (and discard any pending edge)
+void
+endstop_hw_disable(struct endstop_irq *ei)
+{
+    uint32_t reg = ei->line / 8, shift = (ei->line % 8) * 4;
+    irqstatus_t flag = irq_save();
+    iobank0_hw->proc0_irq_ctrl.inte[reg] &= ~(IRQ_EDGE_BITS << shift);
+    iobank0_hw->intr[reg] = IRQ_EDGE_BITS << shift;
+    irq_restore(flag);
+}
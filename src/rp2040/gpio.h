@@ -54,4 +54,11 @@ int i2c_write(struct i2c_config config, uint8_t write_len, uint8_t *write);
 int i2c_read(struct i2c_config config, uint8_t reg_len, uint8_t *reg
              , uint8_t read_len, uint8_t *read);
 
+struct stepper;
+struct step_timer *step_timer_setup(uint8_t pin, uint8_t invert
+                                   , uint32_t pulse_ticks, struct stepper *s);
+void step_timer_start(struct step_timer *st);
+uint32_t step_timer_pending(struct step_timer *st);
+uint32_t step_timer_stop(struct step_timer *st);
+
 #endif // gpio.h
@@ -0,0 +1,47 @@
+// Hardware pulse counting using the rp2040 PWM slices
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "internal.h" // gpio_peripheral
+#include "pulse_counter.h" // counter_hw_setup
+#include "hardware/structs/pwm.h" // pwm_hw
+#include "hardware/structs/iobank0.h" // IO_BANK0_GPIO0_CTRL_FUNCSEL_*
+#include "hardware/regs/resets.h" // RESETS_RESET_PWM_BITS
+
+// Setup a PWM slice to count rising edges on its channel B input.
+// Returns NULL if the pin can not be counted in hardware.
+struct counter_hw *
+counter_hw_setup(uint32_t pin, uint8_t pull_up)
+{
+    // Only the channel B pin of a slice can be used as an input
+    if (pin >= 30 || !(pin & 1))
+        return NULL;
+    pwm_slice_hw_t *slice = &pwm_hw->slice[(pin >> 1) & 0x7];
+
+    // Enable clock
+    if (!is_enabled_pclock(RESETS_RESET_PWM_BITS))
+        enable_pclock(RESETS_RESET_PWM_BITS);
+
+    // Don't take over a slice already in use (eg, for hardware pwm)
+    if (slice->csr & PWM_CH0_CSR_EN_BITS)
+        return NULL;
+
+    slice->div = 1 << PWM_CH0_DIV_INT_LSB;
+    slice->top = PWM_CH0_TOP_BITS;
+    slice->ctr = 0;
+    slice->cc = PWM_CH0_CC_RESET;
+    slice->csr = (PWM_CH0_CSR_EN_BITS
+                  | (PWM_CH0_CSR_DIVMODE_VALUE_RISE
+                     << PWM_CH0_CSR_DIVMODE_LSB));
+    gpio_peripheral(pin, IO_BANK0_GPIO0_CTRL_FUNCSEL_VALUE_PWM_A_0, pull_up);
+    return (void*)slice;
+}
+
+uint16_t
+counter_hw_read(struct counter_hw *h)
+{
+    pwm_slice_hw_t *slice = (void*)h;
+    return slice->ctr;
+}
@@ -70,6 +70,8 @@ gpio_pwm_setup(uint8_t pin, uint32_t cycle_time, uint8_t val) {
         slice->cc = PWM_CH0_CC_RESET;
         slice->csr = PWM_CH0_CSR_EN_BITS;
     } else {
+        if (slice->csr & PWM_CH0_CSR_DIVMODE_BITS)
+            shutdown("PWM slice in use by a pulse counter");
         if (slice->div != pwm_div)
             shutdown("PWM pin has different cycle time from another in "
                      "the same slice");
@@ -17,6 +17,35 @@ void gpio_peripheral(uint32_t gpio, int func, int pull_up);
 void bootrom_reboot_usb_bootloader(void);
 void bootrom_read_unique_id(uint8_t *out, uint32_t maxlen);
 
+// Cross core lock held while irqs are disabled (if CONFIG_RP2040_DUAL_CORE)
+#if CONFIG_RP2040_DUAL_CORE
+#include <setjmp.h> // jmp_buf
+#include "hardware/structs/sio.h" // sio_hw
+
+#define IRQ_CORE_SPINLOCK 31
+
+static inline void
+irq_core_lock(void)
+{
+    while (!sio_hw->spinlock[IRQ_CORE_SPINLOCK])
+        ;
+}
+
+static inline void
+irq_core_unlock(void)
+{
+    sio_hw->spinlock[IRQ_CORE_SPINLOCK] = 0;
+}
+
+// multicore.c
+extern jmp_buf timer_core_jmp;
+int timer_core_shutdown_pending(int reason);
+void timer_core_init(void);
+
+// timer.c
+void TIMER0_IRQHandler(void);
+#endif
+
 // Force a function to run from ram
 #define UNIQSEC __FILE__ "." __stringify(__LINE__)
 #define _ramfunc noinline __section(".ramfunc." UNIQSEC)
@@ -179,5 +179,9 @@ armcm_main(void)
 {
     enable_ram_vectortable();
     clock_setup();
+#if CONFIG_RP2040_DUAL_CORE
+    // The lock may still be held from before a reset
+    irq_core_unlock();
+#endif
     sched_main();
 }
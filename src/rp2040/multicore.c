@@ -0,0 +1,120 @@
+// Dispatch of scheduler timers from the second rp2040 core
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <setjmp.h> // longjmp
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_disable
+#include "board/timer_irq.h" // timer_core_check_shutdown
+#include "hardware/structs/psm.h" // psm_hw
+#include "hardware/structs/sio.h" // sio_hw
+#include "internal.h" // timer_core_init
+#include "sched.h" // sched_shutdown
+
+jmp_buf timer_core_jmp;
+static volatile uint32_t timer_core_shutdown_reason;
+static uint32_t timer_core_stack[256] __aligned(8);
+
+
+/****************************************************************
+ * Shutdown forwarding
+ ****************************************************************/
+
+// Called from sched_shutdown() - the timer core can't run the
+// shutdown handlers itself, so exit the timer irq and notify core0.
+void
+timer_core_check_shutdown(uint_fast8_t reason)
+{
+    if (sio_hw->cpuid)
+        longjmp(timer_core_jmp, reason);
+}
+
+// Note a shutdown request from the timer core (called with irqs disabled)
+int
+timer_core_shutdown_pending(int reason)
+{
+    if (reason) {
+        timer_core_shutdown_reason = reason;
+        if (sio_hw->fifo_st & SIO_FIFO_ST_RDY_BITS)
+            sio_hw->fifo_wr = reason;
+    }
+    return !!timer_core_shutdown_reason;
+}
+
+// Core0 handler of shutdown notifications from the timer core
+void
+SIO_IRQ_PROC0_IRQHandler(void)
+{
+    while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS)
+        (void)sio_hw->fifo_rd;
+    sio_hw->fifo_st = 0;
+    irq_disable();
+    uint32_t reason = timer_core_shutdown_reason;
+    if (reason) {
+        timer_core_shutdown_reason = 0;
+        sched_shutdown(reason);
+    }
+    irq_enable();
+}
+
+
+/****************************************************************
+ * Core1 startup
+ ****************************************************************/
+
+static void
+timer_core_main(void)
+{
+    armcm_enable_irq(TIMER0_IRQHandler, TIMER_IRQ_0_IRQn, TIMER_PRIO);
+    asm volatile("cpsie i" ::: "memory");
+    for (;;)
+        asm volatile("wfi" ::: "memory");
+}
+
+static void
+fifo_push(uint32_t val)
+{
+    while (!(sio_hw->fifo_st & SIO_FIFO_ST_RDY_BITS))
+        ;
+    sio_hw->fifo_wr = val;
+    asm volatile("sev" ::: "memory");
+}
+
+static uint32_t
+fifo_pop(void)
+{
+    while (!(sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS))
+        asm volatile("wfe" ::: "memory");
+    return sio_hw->fifo_rd;
+}
+
+void
+timer_core_init(void)
+{
+    // Reset core1
+    psm_hw->frce_off |= PSM_FRCE_OFF_PROC1_BITS;
+    while (!(psm_hw->frce_off & PSM_FRCE_OFF_PROC1_BITS))
+        ;
+    psm_hw->frce_off &= ~PSM_FRCE_OFF_PROC1_BITS;
+
+    // Launch core1 using the bootrom fifo protocol
+    uint32_t seq[] = {
+        0, 0, 1, SCB->VTOR, (uint32_t)&timer_core_stack[ARRAY_SIZE(
+            timer_core_stack)], (uint32_t)timer_core_main
+    };
+    uint_fast8_t pos = 0;
+    while (pos < ARRAY_SIZE(seq)) {
+        uint32_t cmd = seq[pos];
+        if (!cmd) {
+            while (sio_hw->fifo_st & SIO_FIFO_ST_VLD_BITS)
+                (void)sio_hw->fifo_rd;
+            asm volatile("sev" ::: "memory");
+        }
+        fifo_push(cmd);
+        pos = fifo_pop() == cmd ? pos + 1 : 0;
+    }
+
+    armcm_enable_irq(SIO_IRQ_PROC0_IRQHandler, SIO_IRQ_PROC0_IRQn, 2);
+}
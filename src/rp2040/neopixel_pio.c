@@ -0,0 +1,140 @@
+// PIO based neopixel (WS2812) output on rp2040 and rp2350
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each chain is driven by a state machine that shifts out bytes from
+// its tx fifo, and a dma channel feeds the fifo from the neopixel data
+// buffer.  The PIO1 block is used by stepper_pio.c and PIO0 is used by
+// can2040, so the rp2350 uses PIO2 and the rp2040 uses PIO0 (if the
+// canbus code is not compiled in).
+
+#include "autoconf.h" // CONFIG_MACH_RP2350
+#include "board/irq.h" // irq_save
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/pio.h" // pio0_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_PIO0_BITS
+#include "hardware/regs/dreq.h" // DREQ_PIO0_TX0
+#include "internal.h" // enable_pclock
+#include "neopixel.h" // neopixel_hw_setup
+
+#if CONFIG_MACH_RP2350
+  #define NEO_PIO pio2_hw
+  #define NEO_PIO_RESET_BITS RESETS_RESET_PIO2_BITS
+  #define NEO_PIO_FUNC 8
+  #define NEO_DREQ_TX0 DREQ_PIO2_TX0
+#else
+  #define NEO_PIO pio0_hw
+  #define NEO_PIO_RESET_BITS RESETS_RESET_PIO0_BITS
+  #define NEO_PIO_FUNC 6
+  #define NEO_DREQ_TX0 DREQ_PIO0_TX0
+#endif
+
+#define NUM_SM 4
+// Dma channels 4-7 are used by adc.c and spi.c, 8 and up by stepper_pio.c
+#define DMA_CHAN(sm) (sm)
+
+// PIO program (4 instructions, loaded at offset 0, one side-set bit).
+// Each bit takes 10 cycles - the line is high for 2 cycles for a zero
+// bit and 7 cycles for a one bit.
+#define PIO_PROGRAM_LEN 4
+#define PIO_BIT_CYCLES 10
+#define PIO_BIT_RATE 800000
+static const uint16_t neopixel_program_instructions[] = {
+    0x6221, //  0: out    x, 1            side 0 [2]
+    0x1123, //  1: jmp    !x, 3           side 1 [1]
+    0x1400, //  2: jmp    0               side 1 [4]
+    0xa442, //  3: nop                    side 0 [4]
+};
+#define PIO_INSN_SET_PINDIRS 0xe081
+#define PIO_INSN_JMP_START 0x0000
+
+static uint8_t neopixel_sm_count;
+
+// Assign a state machine to a neopixel chain - returns non-zero if
+// none are available (the caller should then bit-bang the pin)
+int
+neopixel_hw_setup(struct neopixel_hw *h, uint32_t pin)
+{
+    if (pin >= 30 || neopixel_sm_count >= NUM_SM)
+        return -1;
+    uint32_t sm = neopixel_sm_count++;
+    h->chan = sm;
+
+    // Load the program
+    if (!is_enabled_pclock(NEO_PIO_RESET_BITS)) {
+        enable_pclock(NEO_PIO_RESET_BITS);
+        uint32_t i;
+        for (i=0; i<PIO_PROGRAM_LEN; i++)
+            NEO_PIO->instr_mem[i] = neopixel_program_instructions[i];
+    }
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+
+    // Setup the state machine (shift out the top 8 bits of each fifo
+    // entry msb first - byte writes to the fifo are replicated across
+    // the word)
+    uint32_t pclk = get_pclock_frequency(NEO_PIO_RESET_BITS);
+    uint32_t div = pclk / (PIO_BIT_RATE * PIO_BIT_CYCLES / 256);
+    pio_sm_hw_t *smhw = &NEO_PIO->sm[sm];
+    smhw->clkdiv = ((div >> 8) << PIO_SM0_CLKDIV_INT_LSB
+                    | (div & 0xff) << PIO_SM0_CLKDIV_FRAC_LSB);
+    smhw->execctrl = (
+        (PIO_PROGRAM_LEN - 1) << PIO_SM0_EXECCTRL_WRAP_TOP_LSB
+        | 0 << PIO_SM0_EXECCTRL_WRAP_BOTTOM_LSB);
+    smhw->shiftctrl = (PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS
+                       | PIO_SM0_SHIFTCTRL_AUTOPULL_BITS
+                       | 8 << PIO_SM0_SHIFTCTRL_PULL_THRESH_LSB);
+    smhw->pinctrl = (1 << PIO_SM0_PINCTRL_SET_COUNT_LSB
+                     | pin << PIO_SM0_PINCTRL_SET_BASE_LSB
+                     | 1 << PIO_SM0_PINCTRL_SIDESET_COUNT_LSB
+                     | pin << PIO_SM0_PINCTRL_SIDESET_BASE_LSB);
+    smhw->instr = PIO_INSN_SET_PINDIRS;
+    smhw->instr = PIO_INSN_JMP_START;
+
+    // Route the pin to the pio block and start the state machine (it
+    // stalls with the line low until data arrives in the fifo)
+    gpio_peripheral(pin, NEO_PIO_FUNC, 0);
+    NEO_PIO->ctrl |= 1 << (PIO_CTRL_SM_ENABLE_LSB + sm);
+    return 0;
+}
+
+// Start transmitting 'len' bytes of 'data' (the buffer must not be
+// modified until neopixel_hw_busy() returns zero)
+void
+neopixel_hw_send(struct neopixel_hw *h, uint8_t *data, uint_fast16_t len)
+{
+    if (!len)
+        return;
+    uint32_t sm = h->chan, chan = DMA_CHAN(sm);
+    // Queue the first byte before clearing the stall flag so that the
+    // flag is only set again once the transmission completes
+    irqstatus_t flag = irq_save();
+    *(volatile uint8_t *)&NEO_PIO->txf[sm] = data[0];
+    NEO_PIO->fdebug = 1 << (PIO_FDEBUG_TXSTALL_LSB + sm);
+    irq_restore(flag);
+    if (len == 1)
+        return;
+    dma_channel_hw_t *ch = &dma_hw->ch[chan];
+    ch->read_addr = (uint32_t)&data[1];
+    ch->write_addr = (uint32_t)&NEO_PIO->txf[sm];
+    ch->transfer_count = len - 1;
+    ch->ctrl_trig = (
+        (NEO_DREQ_TX0 + sm) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+        | chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+        | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+        | 0 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB
+        | DMA_CH0_CTRL_TRIG_EN_BITS);
+}
+
+// Report if a transmission is still in progress
+int
+neopixel_hw_busy(struct neopixel_hw *h)
+{
+    uint32_t sm = h->chan;
+    if (dma_hw->ch[DMA_CHAN(sm)].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        return 1;
+    // The state machine stalls once the last bit has been sent
+    return !(NEO_PIO->fdebug & (1 << (PIO_FDEBUG_TXSTALL_LSB + sm)));
+}
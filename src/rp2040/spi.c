@@ -4,11 +4,17 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_GPIO_SPI_ASYNC
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "gpio.h" // spi_setup, spi_prepare, spi_transfer
 #include "command.h" // shutdown"
 #include "sched.h" // sched_shutdown"
+#include "spicmds.h" // spi_async_done
 #include "internal.h" // pclock, gpio_peripheral
+#include "hardware/structs/dma.h" // dma_hw
 #include "hardware/structs/spi.h" // spi_hw_t
+#include "hardware/regs/dreq.h" // DREQ_SPI0_TX
 #include "hardware/regs/resets.h" // RESETS_RESET_SPI*_BITS
 
 
@@ -133,3 +139,103 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
         data++;
     }
 }
+
+
+/****************************************************************
+ * DMA transfers
+ ****************************************************************/
+
+#if CONFIG_GPIO_SPI_ASYNC
+
+// Dma channels 8 and up are used by stepper_pio.c
+#define TX_CHAN 6
+#define RX_CHAN 7
+
+static struct spi_xfer *spi_dma_xfer;
+static spi_hw_t *spi_dma_spi;
+static uint8_t spi_dma_dummy;
+
+// Complete the active transfer if the rx dma channel has finished
+static void
+spi_dma_check(void)
+{
+    spi_hw_t *spi = spi_dma_spi;
+    if (!spi || dma_hw->ch[RX_CHAN].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+        return;
+    while (spi->sr & SPI_SSPSR_BSY_BITS)
+        ;
+    spi->dmacr = 0;
+    dma_hw->ints1 = 1 << RX_CHAN;
+    struct spi_xfer *x = spi_dma_xfer;
+    spi_dma_spi = NULL;
+    spi_dma_xfer = NULL;
+    spi_async_done(x);
+}
+
+void
+SPI_DMA_IRQHandler(void)
+{
+    spi_dma_check();
+}
+
+void
+spi_dma_init(void)
+{
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+    armcm_enable_irq(SPI_DMA_IRQHandler, DMA_IRQ_1_IRQn, 1);
+}
+DECL_INIT(spi_dma_init);
+
+// Start a dma transfer (returns non-zero if dma is not available)
+int
+spi_async_start(struct spi_config config, struct spi_xfer *x)
+{
+    if (!x->data_len)
+        return -1;
+    spi_hw_t *spi = config.spi;
+    while (spi->sr & SPI_SSPSR_RNE_BITS)
+        spi->dr;
+    uint32_t dreq_tx = spi == spi0_hw ? DREQ_SPI0_TX : DREQ_SPI1_TX;
+    uint32_t dreq_rx = spi == spi0_hw ? DREQ_SPI0_RX : DREQ_SPI1_RX;
+    uint32_t rx_incr = 0;
+    dma_channel_hw_t *rx = &dma_hw->ch[RX_CHAN], *tx = &dma_hw->ch[TX_CHAN];
+    rx->read_addr = (uint32_t)&spi->dr;
+    if (x->flags & SXF_RECEIVE) {
+        rx->write_addr = (uint32_t)x->data;
+        rx_incr = DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS;
+    } else {
+        rx->write_addr = (uint32_t)&spi_dma_dummy;
+    }
+    rx->transfer_count = x->data_len;
+    tx->read_addr = (uint32_t)x->data;
+    tx->write_addr = (uint32_t)&spi->dr;
+    tx->transfer_count = x->data_len;
+
+    irqstatus_t flag = irq_save();
+    spi_dma_spi = spi;
+    spi_dma_xfer = x;
+    dma_hw->ints1 = 1 << RX_CHAN;
+    dma_hw->inte1 |= 1 << RX_CHAN;
+    spi->dmacr = SPI_SSPDMACR_TXDMAE_BITS | SPI_SSPDMACR_RXDMAE_BITS;
+    rx->ctrl_trig = (dreq_rx << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+                     | RX_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+                     | rx_incr | DMA_CH0_CTRL_TRIG_EN_BITS);
+    tx->ctrl_trig = (dreq_tx << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+                     | TX_CHAN << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+                     | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+                     | DMA_CH0_CTRL_TRIG_EN_BITS);
+    irq_restore(flag);
+    return 0;
+}
+
+// Check for completion of a dma transfer (may be called with irqs off)
+void
+spi_async_poll(struct spi_config config, struct spi_xfer *x)
+{
+    irqstatus_t flag = irq_save();
+    spi_dma_check();
+    irq_restore(flag);
+}
+
+#endif // CONFIG_GPIO_SPI_ASYNC
@@ -0,0 +1,354 @@
+// PIO based step pulse generation on rp2040 and rp2350
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// A stepper using this code has its step pin driven by a state
+// machine of the PIO1 block.  The state machine pulls the delay until
+// the next step from its tx fifo, waits, and then produces a pulse of
+// fixed duration.  A dma channel feeds the fifo from a ring of
+// precalculated delays that is refilled (from the stepper's move
+// queue) each time half of the ring has been transferred.  A "run" of
+// steps ends when the move queue is empty or the direction changes -
+// the stepper code is then notified from a regular timer.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "command.h" // shutdown
+#include "gpio.h" // step_timer_setup
+#include "hardware/structs/dma.h" // dma_hw
+#include "hardware/structs/iobank0.h" // iobank0_hw
+#include "hardware/structs/pio.h" // pio1_hw
+#include "hardware/structs/resets.h" // RESETS_RESET_PIO1_BITS
+#include "hardware/regs/dreq.h" // DREQ_PIO1_TX0
+#include "internal.h" // enable_pclock
+#include "sched.h" // sched_add_timer
+#include "stepper.h" // stepper_timer_fill
+
+DECL_CONSTANT_STR("STEPPER_TIMER_PINS"
+                  , "gpio0,gpio1,gpio2,gpio3,gpio4,gpio5,gpio6,gpio7,gpio8"
+                  ",gpio9,gpio10,gpio11,gpio12,gpio13,gpio14,gpio15,gpio16"
+                  ",gpio17,gpio18,gpio19,gpio20,gpio21,gpio22,gpio23,gpio24"
+                  ",gpio25,gpio26,gpio27,gpio28,gpio29");
+
+#define RING_SIZE 32
+#define RING_BITS 7 // log2(RING_SIZE * sizeof(uint32_t))
+#define IDLE_DELAY 0xffffffff
+#define START_TICKS (CONFIG_CLOCK_FREQ / 500000)
+#define NUM_SM 4
+#define DMA_CHAN(sm) (8 + (sm))
+#define PIO1_FUNC 7
+
+// PIO program (6 instructions, loaded at offset 0, one side-set bit)
+enum {
+    PIO_OFFSET_DELAY = 1, PIO_OFFSET_PULSE = 3, PIO_PROGRAM_LEN = 6,
+    PIO_RUN_CYCLES = 6, PIO_FIRST_CYCLES = 3,
+};
+static const uint16_t stepper_program_instructions[] = {
+    0x80a0, //  0: pull   block           side 0
+    0x6020, //  1: out    x, 32           side 0
+    0x0042, //  2: jmp    x--, 2          side 0
+    0xb046, //  3: mov    y, isr          side 1
+    0x1084, //  4: jmp    y--, 4          side 1
+    0xa042, //  5: nop                    side 0
+};
+#define PIO_INSN_PULL 0x80a0
+#define PIO_INSN_MOV_ISR_OSR 0xa0c7
+#define PIO_INSN_SET_PINDIRS 0xe081
+#define PIO_INSN_NOP 0xa042
+#define PIO_INSN_JMP_START 0x0000
+
+struct step_timer {
+    struct timer done_timer;
+    struct stepper *stepper;
+    uint8_t sm, pin;
+    uint32_t pulse_ticks, pulse_cycles;
+    // Conversion from mcu clock ticks to pio cycles
+    uint32_t clk_mul, clk_div, clk_max, clk_rem;
+    // Run state
+    uint32_t last_time, gen_count, tc_count;
+    uint8_t active, ending;
+    uint32_t ring[RING_SIZE] __aligned(RING_SIZE * sizeof(uint32_t));
+};
+
+static struct step_timer step_timer_data[NUM_SM];
+static uint8_t step_timer_count;
+
+// Convert mcu clock ticks to pio cycles (the remainder is carried to
+// the next conversion so that step times do not drift)
+static uint32_t
+step_cycles(struct step_timer *st, uint32_t ticks)
+{
+    if (st->clk_div == 1)
+        return ticks * st->clk_mul;
+    if (likely(ticks <= st->clk_max)) {
+        uint32_t c = ticks * st->clk_mul + st->clk_rem;
+        st->clk_rem = c % st->clk_div;
+        return c / st->clk_div;
+    }
+    uint64_t c = (uint64_t)ticks * st->clk_mul + st->clk_rem;
+    st->clk_rem = c % st->clk_div;
+    return c / st->clk_div;
+}
+
+// Convert the time of the next step to a state machine delay
+static uint32_t
+step_delay(struct step_timer *st, uint32_t time)
+{
+    uint32_t cycles = step_cycles(st, time - st->last_time);
+    st->last_time = time;
+    uint32_t min_cycles = st->pulse_cycles + PIO_RUN_CYCLES;
+    if (cycles < min_cycles)
+        // Step closer than the pulse duration - push it back
+        return 0;
+    return cycles - min_cycles;
+}
+
+// Fill 'count' entries of 'delays' with upcoming step delays
+static void
+step_timer_fill(struct step_timer *st, uint32_t *delays, uint_fast8_t count)
+{
+    if (!st->ending) {
+        uint_fast8_t i, n = stepper_timer_fill(st->stepper, delays, count);
+        for (i=0; i<n; i++)
+            delays[i] = step_delay(st, delays[i]);
+        st->gen_count += n;
+        delays += n;
+        count -= n;
+        if (!count)
+            return;
+        // End of this run - notify stepper code after the last pulse
+        st->ending = 1;
+        st->done_timer.waketime = (st->last_time + st->pulse_ticks
+                                   + START_TICKS);
+    }
+    while (count--)
+        *delays++ = IDLE_DELAY;
+}
+
+// Stop the state machine and dma channel and disable the pulse output
+static void
+step_timer_halt(struct step_timer *st)
+{
+    uint32_t sm = st->sm, chan_bit = 1 << DMA_CHAN(sm);
+    pio1_hw->ctrl &= ~(1 << (PIO_CTRL_SM_ENABLE_LSB + sm));
+    dma_hw->inte0 &= ~chan_bit;
+    dma_hw->abort = chan_bit;
+    while (dma_hw->abort & chan_bit)
+        ;
+    dma_hw->ints0 = chan_bit;
+    pio1_hw->sm[sm].instr = PIO_INSN_NOP;
+}
+
+// Report the number of delays written to the fifo that have not
+// resulted in a step
+static uint32_t
+step_timer_queued(struct step_timer *st)
+{
+    uint32_t sm = st->sm;
+    uint32_t level = (pio1_hw->flevel >> (sm * 8)) & PIO_FLEVEL_TX0_BITS;
+    uint32_t addr = pio1_hw->sm[sm].addr;
+    return level + (addr >= PIO_OFFSET_DELAY && addr < PIO_OFFSET_PULSE);
+}
+
+// Start a run of steps (caller must disable irqs).  Returns non-zero
+// if the run is already fully generated (done_timer must be scheduled).
+static uint_fast8_t
+step_timer_run(struct step_timer *st)
+{
+    uint32_t sm = st->sm, chan = DMA_CHAN(sm);
+    uint32_t first;
+    stepper_timer_fill(st->stepper, &first, 1);
+    uint32_t min_time = timer_read_time() + START_TICKS;
+    if (timer_is_before(first, min_time)) {
+        if ((int32_t)(first - min_time) < (int32_t)-timer_from_us(1000))
+            shutdown("Stepper too far in past");
+        first = min_time;
+    }
+    st->last_time = first;
+    st->ending = st->clk_rem = 0;
+    st->gen_count = 1;
+    st->tc_count = 0;
+    st->active = 1;
+    step_timer_fill(st, st->ring, RING_SIZE);
+
+    // Flush the fifo and restart the program
+    pio_sm_hw_t *smhw = &pio1_hw->sm[sm];
+    smhw->shiftctrl = 0;
+    smhw->shiftctrl = PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    smhw->instr = PIO_INSN_JMP_START;
+
+    // Queue the delay until the first step, start dma, and start the sm
+    uint32_t now = timer_read_time();
+    uint32_t cycles = step_cycles(st, first - now);
+    pio1_hw->txf[sm] = (cycles > PIO_FIRST_CYCLES
+                        ? cycles - PIO_FIRST_CYCLES : 0);
+    dma_channel_hw_t *ch = &dma_hw->ch[chan];
+    ch->read_addr = (uint32_t)st->ring;
+    ch->write_addr = (uint32_t)&pio1_hw->txf[sm];
+    ch->transfer_count = RING_SIZE / 2;
+    dma_hw->ints0 = 1 << chan;
+    dma_hw->inte0 |= 1 << chan;
+    ch->ctrl_trig = (
+        (DREQ_PIO1_TX0 + sm) << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB
+        | chan << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB
+        | RING_BITS << DMA_CH0_CTRL_TRIG_RING_SIZE_LSB
+        | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+        | 2 << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB
+        | DMA_CH0_CTRL_TRIG_EN_BITS);
+    pio1_hw->ctrl |= 1 << (PIO_CTRL_SM_ENABLE_LSB + sm);
+    return st->ending;
+}
+
+// Start stepping (caller must disable irqs)
+void
+step_timer_start(struct step_timer *st)
+{
+    if (step_timer_run(st))
+        sched_add_timer(&st->done_timer);
+}
+
+// Report the number of generated steps not yet taken (caller must
+// disable irqs)
+uint32_t
+step_timer_pending(struct step_timer *st)
+{
+    if (!st->active)
+        return 0;
+    dma_channel_hw_t *ch = &dma_hw->ch[DMA_CHAN(st->sm)];
+    uint32_t count, queued;
+    for (;;) {
+        count = ch->transfer_count;
+        queued = step_timer_queued(st);
+        if (count == ch->transfer_count)
+            break;
+    }
+    uint32_t written = 1 + st->tc_count * (RING_SIZE / 2)
+                       + RING_SIZE / 2 - count;
+    uint32_t done = written - queued;
+    if (done > st->gen_count)
+        return 0;
+    return st->gen_count - done;
+}
+
+// Stop stepping and return the number of steps not taken (caller
+// must disable irqs)
+uint32_t
+step_timer_stop(struct step_timer *st)
+{
+    sched_del_timer(&st->done_timer);
+    step_timer_halt(st);
+    uint32_t pending = step_timer_pending(st);
+    st->active = 0;
+    return pending;
+}
+
+// Timer event after the last step of a run
+static uint_fast8_t
+step_timer_event(struct timer *t)
+{
+    struct step_timer *st = container_of(t, struct step_timer, done_timer);
+    step_timer_halt(st);
+    st->active = 0;
+    if (!stepper_timer_next(st->stepper) || !step_timer_run(st))
+        return SF_DONE;
+    return SF_RESCHEDULE;
+}
+
+// Refill the half of the dma ring that was just transferred
+void
+DMA_IRQHandler(void)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t ints = dma_hw->ints0;
+    dma_hw->ints0 = ints;
+    uint_fast8_t i;
+    for (i=0; i<step_timer_count; i++) {
+        struct step_timer *st = &step_timer_data[i];
+        uint32_t chan = DMA_CHAN(st->sm);
+        if (!(ints & (1 << chan)) || !st->active)
+            continue;
+        uint_fast8_t was_ending = st->ending;
+        uint32_t *half = &st->ring[st->tc_count & 1 ? RING_SIZE / 2 : 0];
+        step_timer_fill(st, half, RING_SIZE / 2);
+        st->tc_count++;
+        dma_hw->ch[chan].al1_transfer_count_trig = RING_SIZE / 2;
+        if (st->ending && !was_ending)
+            sched_add_timer(&st->done_timer);
+    }
+    irq_restore(flag);
+}
+
+// Configure a step pin for pio step generation
+struct step_timer *
+step_timer_setup(uint8_t pin, uint8_t invert, uint32_t pulse_ticks
+                 , struct stepper *s)
+{
+    if (pin >= 30)
+        shutdown("Not a valid step timer pin");
+    if (step_timer_count >= NUM_SM)
+        shutdown("Too many step timers");
+    uint32_t sm = step_timer_count;
+    struct step_timer *st = &step_timer_data[step_timer_count++];
+    st->sm = sm;
+    st->pin = pin;
+    st->stepper = s;
+    st->pulse_ticks = pulse_ticks;
+    st->done_timer.func = step_timer_event;
+
+    // Calculate the ratio of pio cycles to mcu clock ticks
+    uint32_t pclk = get_pclock_frequency(RESETS_RESET_PIO1_BITS);
+    uint32_t a = pclk, b = CONFIG_CLOCK_FREQ;
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    st->clk_mul = pclk / a;
+    st->clk_div = CONFIG_CLOCK_FREQ / a;
+    st->clk_max = (0xffffffff - st->clk_div) / st->clk_mul;
+    uint32_t cycles = step_cycles(st, pulse_ticks);
+    st->pulse_cycles = cycles > 2 ? cycles - 2 : 0;
+    st->clk_rem = 0;
+
+    // Load the program
+    if (!is_enabled_pclock(RESETS_RESET_PIO1_BITS)) {
+        enable_pclock(RESETS_RESET_PIO1_BITS);
+        uint32_t i;
+        for (i=0; i<PIO_PROGRAM_LEN; i++)
+            pio1_hw->instr_mem[i] = stepper_program_instructions[i];
+    }
+    if (!is_enabled_pclock(RESETS_RESET_DMA_BITS))
+        enable_pclock(RESETS_RESET_DMA_BITS);
+
+    // Setup the state machine
+    pio_sm_hw_t *smhw = &pio1_hw->sm[sm];
+    smhw->clkdiv = 1 << PIO_SM0_CLKDIV_INT_LSB;
+    smhw->execctrl = (
+        (PIO_PROGRAM_LEN - 1) << PIO_SM0_EXECCTRL_WRAP_TOP_LSB
+        | 0 << PIO_SM0_EXECCTRL_WRAP_BOTTOM_LSB);
+    smhw->shiftctrl = PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    smhw->pinctrl = (1 << PIO_SM0_PINCTRL_SET_COUNT_LSB
+                     | pin << PIO_SM0_PINCTRL_SET_BASE_LSB
+                     | 1 << PIO_SM0_PINCTRL_SIDESET_COUNT_LSB
+                     | pin << PIO_SM0_PINCTRL_SIDESET_BASE_LSB);
+    smhw->instr = PIO_INSN_SET_PINDIRS;
+    smhw->instr = PIO_INSN_NOP;
+    // Store the pulse duration in the isr register
+    smhw->shiftctrl = 0;
+    smhw->shiftctrl = PIO_SM0_SHIFTCTRL_FJOIN_TX_BITS;
+    pio1_hw->txf[sm] = st->pulse_cycles;
+    smhw->instr = PIO_INSN_PULL;
+    smhw->instr = PIO_INSN_MOV_ISR_OSR;
+
+    // Route the pin to the pio block
+    gpio_peripheral(pin, PIO1_FUNC, 0);
+    if (invert)
+        iobank0_hw->io[pin].ctrl |= (IO_BANK0_GPIO0_CTRL_OUTOVER_VALUE_INVERT
+                                     << IO_BANK0_GPIO0_CTRL_OUTOVER_LSB);
+    armcm_enable_irq(DMA_IRQHandler, DMA_IRQ_0_IRQn, 1);
+    return st;
+}
@@ -1,9 +1,10 @@
 // rp2040 timer support
 //
-// Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <setjmp.h> // setjmp
 #include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
@@ -50,9 +51,20 @@ TIMER0_IRQHandler(void)
 {
     irq_disable();
     timer_hw->intr = 1;
+#if CONFIG_RP2040_DUAL_CORE
+    // A shutdown on the timer core returns here (see multicore.c)
+    int ret = setjmp(timer_core_jmp);
+    if (timer_core_shutdown_pending(ret)) {
+        irq_enable();
+        return;
+    }
+#endif
     uint32_t next = timer_dispatch_many();
     timer_set(next);
     irq_enable();
+    if (CONFIG_RP2040_DUAL_CORE)
+        // Wake the main core in case a timer woke a task
+        asm volatile("sev" ::: "memory");
 }
 
 void
@@ -62,7 +74,11 @@ timer_init(void)
     enable_pclock(RESETS_RESET_TIMER_BITS);
     timer_hw->timelw = 0;
     timer_hw->timehw = 0;
-    armcm_enable_irq(TIMER0_IRQHandler, TIMER_IRQ_0_IRQn, 2);
+#if CONFIG_RP2040_DUAL_CORE
+    timer_core_init();
+#else
+    armcm_enable_irq(TIMER0_IRQHandler, TIMER_IRQ_0_IRQn, TIMER_PRIO);
+#endif
     timer_hw->inte = 1;
     timer_kick();
     irq_enable();
@@ -264,7 +264,7 @@ usb_set_configure(void)
 // after a reset.  The following code has extracts from the PICO SDK.
 
 static uint8_t need_errata;
-static struct task_wake usb_errata_wake;
+DECL_TASK_WAKE(usb_errata_wake);
 
 // Workaround for rp2040-e5 errata
 void
@@ -337,7 +337,7 @@ usb_errata_task(void)
     iobank0_hw->io[dp].ctrl = gpio_ctrl_prev;
     padsbank0_hw->io[dp] = pad_ctrl_prev;
 }
-DECL_TASK(usb_errata_task);
+DECL_WAKE_TASK(usb_errata_task, usb_errata_wake);
 
 
 /****************************************************************
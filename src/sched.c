@@ -11,6 +11,7 @@
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // timer_from_us
 #include "board/pgm.h" // READP
+#include "board/timer_irq.h" // timer_core_check_shutdown
 #include "command.h" // shutdown
 #include "sched.h" // sched_check_periodic
 #include "stepper.h" // stepper_event
@@ -63,6 +64,183 @@ static struct timer sentinel_timer = {
     .waketime = 0x80000000,
 };
 
+// Invoke a timer callback (and note its run time when profiling)
+static __always_inline uint_fast8_t
+invoke_timer(struct timer *t)
+{
+    uint_fast8_t (*func)(struct timer*) = t->func;
+    uint32_t waketime = t->waketime, start = 0;
+    if (CONFIG_SCHED_PROFILE)
+        start = timer_read_time();
+    uint_fast8_t res;
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!func))
+        res = stepper_event(t);
+    else
+        res = func(t);
+    if (CONFIG_SCHED_PROFILE)
+        profile_timer(func, waketime, start);
+    return res;
+}
+
+#if CONFIG_SCHED_TIMER_HEAP
+
+// Scheduled timers are stored in a binary min-heap ordered by
+// waketime.  The heap always contains periodic_timer and has room
+// for deleted_timer in addition to the configured number of timers.
+static struct timer *timer_heap[CONFIG_SCHED_TIMER_HEAP_SIZE + 2] = {
+    &periodic_timer
+};
+static uint_fast8_t timer_heap_count = 1;
+
+DECL_CONSTANT_STR("SCHED_TIMERS", "heap");
+
+// Move a timer towards the top of the heap from position 'pos'
+static void __hot_ram
+heap_sift_up(uint_fast8_t pos, struct timer *t, uint32_t waketime)
+{
+    while (pos) {
+        uint_fast8_t parent = (pos - 1) / 2;
+        struct timer *p = timer_heap[parent];
+        if (!timer_is_before(waketime, p->waketime))
+            break;
+        timer_heap[pos] = p;
+        pos = parent;
+    }
+    timer_heap[pos] = t;
+}
+
+// Move a timer towards the bottom of the heap from position 'pos'
+static void __hot_ram
+heap_sift_down(uint_fast8_t pos, struct timer *t, uint32_t waketime)
+{
+    uint_fast8_t count = timer_heap_count;
+    for (;;) {
+        uint_fast8_t child = pos * 2 + 1;
+        if (child >= count)
+            break;
+        struct timer *c = timer_heap[child];
+        if (child + 1 < count
+            && timer_is_before(timer_heap[child + 1]->waketime, c->waketime))
+            c = timer_heap[++child];
+        if (!timer_is_before(c->waketime, waketime))
+            break;
+        timer_heap[pos] = c;
+        pos = child;
+    }
+    timer_heap[pos] = t;
+}
+
+// Remove the timer at position 'pos' of the heap
+static void __hot_ram
+heap_remove(uint_fast8_t pos)
+{
+    struct timer *last = timer_heap[--timer_heap_count];
+    if (pos >= timer_heap_count)
+        return;
+    uint32_t waketime = last->waketime;
+    if (pos && timer_is_before(waketime, timer_heap[(pos - 1) / 2]->waketime))
+        heap_sift_up(pos, last, waketime);
+    else
+        heap_sift_down(pos, last, waketime);
+}
+
+// Schedule a function call at a supplied time.
+void
+sched_add_timer(struct timer *add)
+{
+    uint32_t waketime = add->waketime;
+    irqstatus_t flag = irq_save();
+    if (timer_heap_count >= ARRAY_SIZE(timer_heap) - 1) {
+        // Always leave room for deleted_timer
+        try_shutdown("Too many timers");
+        irq_restore(flag);
+        return;
+    }
+    struct timer *top = timer_heap[0];
+    if (unlikely(timer_is_before(waketime, top->waketime))) {
+        // This timer is before all other scheduled timers
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+        // Dispatch deleted_timer on the kick so that the new timer
+        // is not run early
+        deleted_timer.waketime = waketime - 1;
+        if (top != &deleted_timer)
+            heap_sift_up(timer_heap_count++, &deleted_timer
+                         , deleted_timer.waketime);
+        heap_sift_up(timer_heap_count++, add, waketime);
+        timer_kick();
+    } else {
+        heap_sift_up(timer_heap_count++, add, waketime);
+    }
+    irq_restore(flag);
+}
+
+// The deleted timer is used when deleting an active timer.
+static uint_fast8_t
+deleted_event(struct timer *t)
+{
+    return SF_DONE;
+}
+
+static struct timer deleted_timer = {
+    .func = deleted_event,
+};
+
+// Remove a timer that may be live.
+void
+sched_del_timer(struct timer *del)
+{
+    irqstatus_t flag = irq_save();
+    if (timer_heap[0] == del) {
+        // Deleting the next active timer - replace with deleted_timer
+        deleted_timer.waketime = del->waketime;
+        timer_heap[0] = &deleted_timer;
+    } else {
+        // Find and remove from timer heap (if present)
+        uint_fast8_t pos;
+        for (pos = 1; pos < timer_heap_count; pos++) {
+            if (timer_heap[pos] == del) {
+                heap_remove(pos);
+                break;
+            }
+        }
+    }
+    irq_restore(flag);
+}
+
+// Invoke the next timer - called from board hardware irq code.
+unsigned int __hot_ram
+sched_timer_dispatch(void)
+{
+    // Invoke timer callback
+    struct timer *t = timer_heap[0];
+    uint_fast8_t res = invoke_timer(t);
+    uint32_t updated_waketime = t->waketime;
+
+    // Update timer_heap (rescheduling current timer if necessary)
+    if (unlikely(res == SF_DONE))
+        heap_remove(0);
+    else
+        heap_sift_down(0, t, updated_waketime);
+
+    return timer_heap[0]->waketime;
+}
+
+// Remove all user timers
+void
+sched_timer_reset(void)
+{
+    deleted_timer.waketime = periodic_timer.waketime;
+    timer_heap[0] = &deleted_timer;
+    timer_heap[1] = &periodic_timer;
+    timer_heap_count = 2;
+    timer_kick();
+}
+
+#else // !CONFIG_SCHED_TIMER_HEAP
+
+DECL_CONSTANT_STR("SCHED_TIMERS", "list");
+
 // Find position for a timer in timer_list and insert it
 static void __always_inline
 insert_timer(struct timer *pos, struct timer *t, uint32_t waketime)
@@ -143,20 +321,13 @@ sched_del_timer(struct timer *del)
 }
 
 // Invoke the next timer - called from board hardware irq code.
-unsigned int
+unsigned int __hot_ram
 sched_timer_dispatch(void)
 {
     // Invoke timer callback
     struct timer *t = SchedStatus.timer_list;
-    uint_fast8_t res;
-    uint32_t updated_waketime;
-    if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
-        res = stepper_event(t);
-        updated_waketime = t->waketime;
-    } else {
-        res = t->func(t);
-        updated_waketime = t->waketime;
-    }
+    uint_fast8_t res = invoke_timer(t);
+    uint32_t updated_waketime = t->waketime;
 
     // Update timer_list (rescheduling current timer if necessary)
     unsigned int next_waketime = updated_waketime;
@@ -189,6 +360,8 @@ sched_timer_reset(void)
     timer_kick();
 }
 
+#endif
+
 
 /****************************************************************
  * Tasks
@@ -216,14 +389,46 @@ sched_check_set_tasks_busy(void)
     return 0;
 }
 
+#if CONFIG_SCHED_TASK_BITMAP
+
+// Bitmap of DECL_WAKE_TASK tasks that have been woken
+static uint32_t task_bitmap;
+
 // Note that a task is ready to run
 void
 sched_wake_task(struct task_wake *w)
 {
     sched_wake_tasks();
     writeb(&w->wake, 1);
+    irqstatus_t flag = irq_save();
+    task_bitmap |= w->task_mask;
+    irq_restore(flag);
 }
 
+// Return (and clear) the bitmap of woken tasks (called from the
+// generated ctr_run_taskfuncs() code)
+uint32_t
+sched_take_task_bitmap(void)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t bitmap = task_bitmap;
+    task_bitmap = 0;
+    irq_restore(flag);
+    return bitmap;
+}
+
+#else
+
+// Note that a task is ready to run
+void
+sched_wake_task(struct task_wake *w)
+{
+    sched_wake_tasks();
+    writeb(&w->wake, 1);
+}
+
+#endif
+
 // Check if a task is ready to run (as indicated by sched_wake_task)
 uint8_t
 sched_check_wake(struct task_wake *w)
@@ -333,6 +538,9 @@ void
 sched_shutdown(uint_fast8_t reason)
 {
     irq_disable();
+    if (CONFIG_SCHED_TIMER_CORE)
+        // Timers may run on another cpu core (with its own stack)
+        timer_core_check_shutdown(reason);
     longjmp(shutdown_jmp, reason);
 }
 
@@ -2,6 +2,7 @@
 #define __SCHED_H
 
 #include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_SCHED_TASK_BITMAP
 #include "ctr.h" // DECL_CTR
 
 // Declare an init function (called at firmware startup)
@@ -10,6 +11,16 @@
 #define DECL_TASK(FUNC) _DECL_CALLLIST(ctr_run_taskfuncs, FUNC)
 // Declare a shutdown function (called on an emergency stop)
 #define DECL_SHUTDOWN(FUNC) _DECL_CALLLIST(ctr_run_shutdownfuncs, FUNC)
+// Declare a task_wake (DECL_TASK_WAKE) and a task function that only
+// needs to run after that task_wake is signaled (DECL_WAKE_TASK)
+#if CONFIG_SCHED_TASK_BITMAP
+#define DECL_TASK_WAKE(WAKE) extern struct task_wake WAKE
+#define DECL_WAKE_TASK(FUNC, WAKE)                                      \
+    DECL_CTR("_DECL_WAKE_TASK " __stringify(FUNC) " " __stringify(WAKE))
+#else
+#define DECL_TASK_WAKE(WAKE) static struct task_wake WAKE
+#define DECL_WAKE_TASK(FUNC, WAKE) DECL_TASK(FUNC)
+#endif
 
 // Timer structure for scheduling timed events (see sched_add_timer() )
 struct timer {
@@ -20,9 +31,20 @@ struct timer {
 
 enum { SF_DONE=0, SF_RESCHEDULE=1 };
 
+// Place a time critical function (timer dispatch and step events) in ram
+#if CONFIG_RAM_HOT_CODE
+#define __hot_ram                                                       \
+    __section(".ramfunc.hot." __FILE__ "." __stringify(__LINE__))
+#else
+#define __hot_ram
+#endif
+
 // Task waking struct
 struct task_wake {
     uint8_t wake;
+#if CONFIG_SCHED_TASK_BITMAP
+    uint32_t task_mask;
+#endif
 };
 
 // sched.c
@@ -34,6 +56,7 @@ void sched_wake_tasks(void);
 uint8_t sched_check_set_tasks_busy(void);
 void sched_wake_task(struct task_wake *w);
 uint8_t sched_check_wake(struct task_wake *w);
+uint32_t sched_take_task_bitmap(void);
 uint8_t sched_is_shutdown(void);
 void sched_clear_shutdown(void);
 void sched_try_shutdown(uint_fast8_t reason);
@@ -41,6 +64,13 @@ void sched_shutdown(uint_fast8_t reason) __noreturn;
 void sched_report_shutdown(void);
 void sched_main(void);
 
+// profile.c
+void profile_timer(uint_fast8_t (*func)(struct timer*), uint32_t waketime
+                   , uint32_t start);
+uint32_t profile_task_begin(void);
+void profile_task_end(uint8_t task, uint32_t start);
+void command_get_profile(uint32_t *args);
+
 // Compiler glue for DECL_X macros above.
 #define _DECL_CALLLIST(NAME, FUNC)                                      \
     DECL_CTR("_DECL_CALLLIST " __stringify(NAME) " " __stringify(FUNC))
@@ -4,11 +4,13 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_LOAD_CELL_PROBE
 #include "board/irq.h" // irq_disable
 #include "board/gpio.h" // gpio_out_write
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
+#include "load_cell_probe.h" // load_cell_probe_report_sample
 #include "sched.h" // sched_add_timer
 #include "sensor_bulk.h" // sensor_bulk_report
 #include "spicmds.h" // spidev_transfer
@@ -19,18 +21,21 @@ struct ads1220_adc {
     uint32_t rest_ticks;
     struct gpio_in data_ready;
     struct spidev_s *spi;
-    uint8_t pending_flag, data_count;
+    struct spi_xfer xfer;
+    uint8_t oid, pending_flag, data_count;
+    uint8_t msg[3];
     struct sensor_bulk sb;
+    struct load_cell_probe *lcp;
 };
 
 // Flag types
 enum {
-    FLAG_PENDING = 1 << 0
+    FLAG_PENDING = 1 << 0, FLAG_BUSY = 1 << 1
 };
 
 #define BYTES_PER_SAMPLE 4
 
-static struct task_wake wake_ads1220;
+DECL_TASK_WAKE(wake_ads1220);
 
 /****************************************************************
  * ADS1220 Sensor Support
@@ -76,12 +81,25 @@ add_sample(struct ads1220_adc *ads1220, uint8_t oid, uint_fast32_t counts)
     }
 }
 
+static void ads1220_read_done(struct spi_xfer *x);
+
 // ADS1220 ADC query
 void
-ads1220_read_adc(struct ads1220_adc *ads1220, uint8_t oid)
+ads1220_read_adc(struct ads1220_adc *ads1220)
+{
+    ads1220->pending_flag |= FLAG_BUSY;
+    uint8_t *msg = ads1220->msg;
+    msg[0] = msg[1] = msg[2] = 0;
+    ads1220->xfer.callback = ads1220_read_done;
+    spidev_transfer_async(ads1220->spi, &ads1220->xfer, 1
+                          , sizeof(ads1220->msg), msg);
+}
+
+static void
+ads1220_read_done(struct spi_xfer *x)
 {
-    uint8_t msg[3] = {0, 0, 0};
-    spidev_transfer(ads1220->spi, 1, sizeof(msg), msg);
+    struct ads1220_adc *ads1220 = container_of(x, struct ads1220_adc, xfer);
+    uint8_t *msg = ads1220->msg;
     ads1220->pending_flag = 0;
     barrier();
 
@@ -94,7 +112,11 @@ ads1220_read_adc(struct ads1220_adc *ads1220, uint8_t oid)
     if (counts & 0x800000)
         counts |= 0xFF000000;
 
-    add_sample(ads1220, oid, counts);
+    // Notify the load cell probe (if any)
+    if (CONFIG_WANT_LOAD_CELL_PROBE && ads1220->lcp)
+        load_cell_probe_report_sample(ads1220->lcp, counts);
+
+    add_sample(ads1220, ads1220->oid, counts);
 }
 
 // Create an ads1220 sensor
@@ -104,6 +126,7 @@ command_config_ads1220(uint32_t *args)
     struct ads1220_adc *ads1220 = oid_alloc(args[0]
                 , command_config_ads1220, sizeof(*ads1220));
     ads1220->timer.func = ads1220_event;
+    ads1220->oid = args[0];
     ads1220->pending_flag = 0;
     ads1220->spi = spidev_oid_lookup(args[1]);
     ads1220->data_ready = gpio_in_setup(args[2], 0);
@@ -111,6 +134,18 @@ command_config_ads1220(uint32_t *args)
 DECL_COMMAND(command_config_ads1220, "config_ads1220 oid=%c"
     " spi_oid=%c data_ready_pin=%u");
 
+#if CONFIG_WANT_LOAD_CELL_PROBE
+// Forward samples to a load cell probe
+void
+command_ads1220_attach_load_cell_probe(uint32_t *args)
+{
+    struct ads1220_adc *ads1220 = oid_lookup(args[0], command_config_ads1220);
+    ads1220->lcp = load_cell_probe_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_ads1220_attach_load_cell_probe,
+             "ads1220_attach_load_cell_probe oid=%c load_cell_probe_oid=%c");
+#endif
+
 // start/stop capturing ADC data
 void
 command_query_ads1220(uint32_t *args)
@@ -118,6 +153,7 @@ command_query_ads1220(uint32_t *args)
     uint8_t oid = args[0];
     struct ads1220_adc *ads1220 = oid_lookup(oid, command_config_ads1220);
     sched_del_timer(&ads1220->timer);
+    spidev_async_cancel(&ads1220->xfer);
     ads1220->pending_flag = 0;
     ads1220->rest_ticks = args[1];
     if (!ads1220->rest_ticks) {
@@ -156,8 +192,8 @@ ads1220_capture_task(void)
     uint8_t oid;
     struct ads1220_adc *ads1220;
     foreach_oid(oid, ads1220, command_config_ads1220) {
-        if (ads1220->pending_flag)
-            ads1220_read_adc(ads1220, oid);
+        if (ads1220->pending_flag == FLAG_PENDING)
+            ads1220_read_adc(ads1220);
     }
 }
-DECL_TASK(ads1220_capture_task);
+DECL_WAKE_TASK(ads1220_capture_task, wake_ads1220);
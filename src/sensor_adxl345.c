@@ -1,42 +1,80 @@
 // Support for gathering acceleration data from ADXL345 chip
 //
-// Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2020-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_HAVE_GPIO_SPI_BATCH
+#include "board/gpio.h" // gpio_in_read
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
+#include "endstop.h" // endstop_hw_setup
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
+#include "sensor_spectrum.h" // sensor_spectrum_add_sample
 #include "spicmds.h" // spidev_transfer
 
+// Size of each fifo read and number of fifo entries read per batch
+#define MSG_SIZE 9
+#define BATCH_MAX (CONFIG_HAVE_GPIO_SPI_BATCH ? 8 : 1)
+
+// Number of fifo entries that assert the watermark interrupt (the
+// samples field of the fifo_ctl register set by the host)
+#define INT_WATERMARK 16
+
 struct adxl345 {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
-    uint8_t flags;
+    struct spi_xfer xfer;
+    uint8_t oid, flags, msg_count;
+    uint8_t msg[MSG_SIZE * BATCH_MAX];
     struct sensor_bulk sb;
+    struct sensor_spectrum *ss;
+    struct gpio_in int_pin;
+    struct endstop_irq irq;
 };
 
 enum {
-    AX_PENDING = 1<<0,
+    AX_PENDING = 1<<0, AX_HAVE_INT = 1<<1, AX_HAVE_IRQ = 1<<2,
 };
 
-static struct task_wake adxl345_wake;
+#define BYTES_PER_SAMPLE 5
+
+DECL_TASK_WAKE(adxl345_wake);
 
 // Event handler that wakes adxl345_task() periodically
 static uint_fast8_t
 adxl345_event(struct timer *timer)
 {
     struct adxl345 *ax = container_of(timer, struct adxl345, timer);
+    if (ax->flags & AX_HAVE_INT) {
+        if (!gpio_in_read(ax->int_pin)) {
+            // Fifo watermark not reached - check the int pin again later
+            ax->timer.waketime += ax->rest_ticks;
+            return SF_RESCHEDULE;
+        }
+        if (CONFIG_ENDSTOP_IRQ && ax->flags & AX_HAVE_IRQ)
+            endstop_hw_disable(&ax->irq);
+    }
     ax->flags |= AX_PENDING;
     sched_wake_task(&adxl345_wake);
     return SF_DONE;
 }
 
+// Pin change irq callback for the fifo watermark interrupt
+static void
+adxl345_irq_edge(struct endstop_irq *ei, uint32_t time)
+{
+    struct adxl345 *ax = container_of(ei, struct adxl345, irq);
+    sched_del_timer(&ax->timer);
+    ax->flags |= AX_PENDING;
+    sched_wake_task(&adxl345_wake);
+}
+
 void
 command_config_adxl345(uint32_t *args)
 {
@@ -44,8 +82,28 @@ command_config_adxl345(uint32_t *args)
                                    , sizeof(*ax));
     ax->timer.func = adxl345_event;
     ax->spi = spidev_oid_lookup(args[1]);
+    ax->oid = args[0];
+    if (args[2])
+        sensor_bulk_set_compress(&ax->sb, 3, BYTES_PER_SAMPLE);
 }
-DECL_COMMAND(command_config_adxl345, "config_adxl345 oid=%c spi_oid=%c");
+DECL_COMMAND(command_config_adxl345
+             , "config_adxl345 oid=%c spi_oid=%c compress=%c");
+
+// Use the chip's fifo watermark interrupt to detect when to read data
+void
+command_config_adxl345_with_int(uint32_t *args)
+{
+    command_config_adxl345(args);
+    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
+    ax->int_pin = gpio_in_setup(args[3], 0);
+    ax->irq.func = adxl345_irq_edge;
+    ax->flags = AX_HAVE_INT;
+    if (CONFIG_ENDSTOP_IRQ && !endstop_hw_setup(&ax->irq, args[3]))
+        ax->flags |= AX_HAVE_IRQ;
+}
+DECL_COMMAND(command_config_adxl345_with_int
+             , "config_adxl345_with_int oid=%c spi_oid=%c compress=%c"
+             " int_pin=%c");
 
 // Helper code to reschedule the adxl345_event() timer
 static void
@@ -53,6 +111,10 @@ adxl_reschedule_timer(struct adxl345 *ax)
 {
     irq_disable();
     ax->timer.waketime = timer_read_time() + ax->rest_ticks;
+    if (CONFIG_ENDSTOP_IRQ && ax->flags & AX_HAVE_IRQ)
+        // Wake on the next watermark edge (the timer still polls the
+        // pin in case the watermark was reached before the irq was armed)
+        endstop_hw_enable(&ax->irq, 1);
     sched_add_timer(&ax->timer);
     irq_enable();
 }
@@ -65,67 +127,140 @@ adxl_reschedule_timer(struct adxl345 *ax)
 
 #define SET_FIFO_CTL 0x90
 
-#define BYTES_PER_SAMPLE 5
+// Compressed mode value reported on a data error
+#define ERROR_VALUE 0x7fff
+
+static void adxl_query_done(struct spi_xfer *x);
 
-// Query accelerometer data
+// Start an asynchronous read of 'count' fifo entries
 static void
-adxl_query(struct adxl345 *ax, uint8_t oid)
+adxl_query(struct adxl345 *ax, uint_fast8_t count)
+{
+    ax->flags &= ~AX_PENDING;
+    uint8_t *msg = ax->msg;
+    memset(msg, 0, MSG_SIZE * count);
+    uint_fast8_t i;
+    for (i=0; i<count; i++)
+        msg[i * MSG_SIZE] = AR_DATAX0 | AM_READ | AM_MULTI;
+    ax->msg_count = count;
+    ax->xfer.callback = adxl_query_done;
+    spidev_transfer_async_batch(ax->spi, &ax->xfer, 1, count, MSG_SIZE, msg);
+}
+
+// Process a fifo entry - returns the reported fifo status
+static uint_fast8_t
+adxl_process_msg(struct adxl345 *ax, uint8_t *msg)
 {
-    // Read data
-    uint8_t msg[9] = { AR_DATAX0 | AM_READ | AM_MULTI, 0, 0, 0, 0, 0, 0, 0, 0 };
-    spidev_transfer(ax->spi, 1, sizeof(msg), msg);
     // Extract x, y, z measurements
     uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
-    uint8_t *d = &ax->sb.data[ax->sb.data_count];
-    if (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
-        || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
-        || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
-        || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32)) {
+    int is_error = (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
+                    || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
+                    || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
+                    || (msg[7] != SET_FIFO_CTL) || (fifo_status > 32));
+    if (is_error)
         // Data error - may be a CS, MISO, MOSI, or SCLK glitch
-        d[0] = d[1] = d[2] = d[3] = d[4] = 0xff;
         fifo_status = 0;
+    int16_t v[3] = { ERROR_VALUE, ERROR_VALUE, ERROR_VALUE };
+    if (!is_error) {
+        v[0] = (int16_t)((msg[2] << 8) | msg[1]);
+        v[1] = (int16_t)((msg[4] << 8) | msg[3]);
+        v[2] = (int16_t)((msg[6] << 8) | msg[5]);
+    }
+    if (CONFIG_WANT_SENSOR_SPECTRUM && ax->ss) {
+        // Summary mode - add sample to the vibration summary
+        if (!is_error)
+            sensor_spectrum_add_sample(ax->ss, v);
+    } else if (ax->sb.field_count) {
+        // Compressed mode - send sign extended 13bit values
+        sensor_bulk_add_sample(&ax->sb, ax->oid, v);
     } else {
-        // Copy data
-        d[0] = msg[1]; // x low bits
-        d[1] = msg[3]; // y low bits
-        d[2] = msg[5]; // z low bits
-        d[3] = (msg[2] & 0x1f) | (msg[6] << 5); // x high bits and z high bits
-        d[4] = (msg[4] & 0x1f) | ((msg[6] << 2) & 0x60); // y high and z high
+        uint8_t *d = &ax->sb.data[ax->sb.data_count];
+        if (is_error) {
+            d[0] = d[1] = d[2] = d[3] = d[4] = 0xff;
+        } else {
+            // Copy data
+            d[0] = msg[1]; // x low bits
+            d[1] = msg[3]; // y low bits
+            d[2] = msg[5]; // z low bits
+            d[3] = (msg[2] & 0x1f) | (msg[6] << 5); // x high and z high
+            d[4] = (msg[4] & 0x1f) | ((msg[6] << 2) & 0x60); // y high, z high
+        }
+        ax->sb.data_count += BYTES_PER_SAMPLE;
+        if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
+            sensor_bulk_report(&ax->sb, ax->oid);
     }
-    ax->sb.data_count += BYTES_PER_SAMPLE;
-    if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
-        sensor_bulk_report(&ax->sb, oid);
     // Check fifo status
     if (fifo_status >= 31)
         ax->sb.possible_overflows++;
-    if (fifo_status > 1) {
-        // More data in fifo - wake this task again
-        sched_wake_task(&adxl345_wake);
-    } else {
+    return fifo_status;
+}
+
+// Process accelerometer data
+static void
+adxl_query_done(struct spi_xfer *x)
+{
+    struct adxl345 *ax = container_of(x, struct adxl345, xfer);
+    uint_fast8_t fifo_status = 0, i;
+    for (i=0; i<ax->msg_count; i++)
+        fifo_status = adxl_process_msg(ax, &ax->msg[i * MSG_SIZE]);
+    if (fifo_status > 1)
+        // More data in fifo - read it now
+        adxl_query(ax, fifo_status - 1 > BATCH_MAX
+                   ? BATCH_MAX : fifo_status - 1);
+    else
         // Sleep until next check time
-        ax->flags &= ~AX_PENDING;
         adxl_reschedule_timer(ax);
-    }
 }
 
-void
-command_query_adxl345(uint32_t *args)
+// Stop any active measurements and optionally start new measurements
+static void
+adxl_start(struct adxl345 *ax, uint32_t rest_ticks
+           , struct sensor_spectrum *ss)
 {
-    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
-
+    uint8_t int_flags = ax->flags & (AX_HAVE_INT | AX_HAVE_IRQ);
+    irq_disable();
     sched_del_timer(&ax->timer);
-    ax->flags = 0;
-    if (!args[1])
+    if (CONFIG_ENDSTOP_IRQ && int_flags & AX_HAVE_IRQ)
+        endstop_hw_disable(&ax->irq);
+    irq_enable();
+    spidev_async_cancel(&ax->xfer);
+    ax->flags = int_flags;
+    ax->ss = NULL;
+    if (!rest_ticks)
         // End measurements
         return;
 
     // Start new measurements query
-    ax->rest_ticks = args[1];
+    ax->rest_ticks = rest_ticks;
     sensor_bulk_reset(&ax->sb);
+    if (CONFIG_WANT_SENSOR_SPECTRUM && ss) {
+        sensor_spectrum_reset(ss);
+        ax->ss = ss;
+    }
     adxl_reschedule_timer(ax);
 }
+
+void
+command_query_adxl345(uint32_t *args)
+{
+    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
+    adxl_start(ax, args[1], NULL);
+}
 DECL_COMMAND(command_query_adxl345, "query_adxl345 oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_SPECTRUM
+// Start measurements that are reported as vibration summaries
+void
+command_query_adxl345_spectrum(uint32_t *args)
+{
+    struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
+    struct sensor_spectrum *ss = sensor_spectrum_oid_lookup(args[2]);
+    adxl_start(ax, args[1], ss);
+}
+DECL_COMMAND(command_query_adxl345_spectrum,
+             "query_adxl345_spectrum oid=%c rest_ticks=%u spectrum_oid=%c");
+#endif
+
 void
 command_query_adxl345_status(uint32_t *args)
 {
@@ -154,8 +289,15 @@ adxl345_task(void)
     struct adxl345 *ax;
     foreach_oid(oid, ax, command_config_adxl345) {
         uint_fast8_t flags = ax->flags;
-        if (flags & AX_PENDING)
-            adxl_query(ax, oid);
+        if (!(flags & AX_PENDING))
+            continue;
+        if (flags & AX_HAVE_INT)
+            // At least a watermark of entries is available - read them
+            // without first checking the fifo status
+            adxl_query(ax, INT_WATERMARK > BATCH_MAX
+                       ? BATCH_MAX : INT_WATERMARK);
+        else
+            adxl_query(ax, 1);
     }
 }
-DECL_TASK(adxl345_task);
+DECL_WAKE_TASK(adxl345_task, adxl345_wake);
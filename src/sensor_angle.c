@@ -1,6 +1,6 @@
 // Support for querying magnetic angle sensors via SPI
 //
-// Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2021-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -12,6 +12,7 @@
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
 #include "spicmds.h" // spidev_transfer
+#include "stepper.h" // stepper_read_position
 
 enum {
     SA_CHIP_A1333,
@@ -41,15 +42,24 @@ struct spi_angle {
     struct spidev_s *spi;
     uint8_t flags, chip_type, time_shift, overflow;
     struct sensor_bulk sb;
+    // Stepper position monitoring
+    struct stepper *mon_stepper;
+    uint32_t mon_step_angle;
+    uint16_t mon_offset, mon_threshold, mon_report_count;
+    uint16_t mon_count, mon_errors, mon_exceed;
+    int16_t mon_min, mon_max;
+    uint8_t mon_flags;
 };
 
 enum {
     SA_PENDING = 1<<2,
 };
 
+enum { SAM_ENABLED = 1<<0, SAM_IN_ERROR = 1<<1 };
+
 #define BYTES_PER_SAMPLE 3
 
-static struct task_wake angle_wake;
+DECL_TASK_WAKE(angle_wake);
 
 // Event handler that wakes spi_angle_task() periodically
 static uint_fast8_t
@@ -91,10 +101,35 @@ angle_check_report(struct spi_angle *sa, uint8_t oid)
         sensor_bulk_report(&sa->sb, oid);
 }
 
+// Compare a measurement with the position of the monitored stepper
+static void
+angle_monitor_add(struct spi_angle *sa, uint_fast8_t tcode
+                  , uint_fast16_t angle)
+{
+    if (tcode == TCODE_ERROR) {
+        sa->mon_errors++;
+        return;
+    }
+    uint32_t pos = stepper_read_position(sa->mon_stepper);
+    uint16_t expected = sa->mon_offset + ((pos * sa->mon_step_angle) >> 16);
+    int16_t err = (uint16_t)(angle - expected);
+    if (!sa->mon_count || err < sa->mon_min)
+        sa->mon_min = err;
+    if (!sa->mon_count || err > sa->mon_max)
+        sa->mon_max = err;
+    sa->mon_count++;
+    if (err > (int)sa->mon_threshold || err < -(int)sa->mon_threshold)
+        sa->mon_exceed++;
+}
+
 // Add an entry to the measurement buffer
 static void
 angle_add(struct spi_angle *sa, uint_fast8_t tcode, uint_fast16_t data)
 {
+    if (sa->mon_flags & SAM_ENABLED) {
+        angle_monitor_add(sa, tcode, data);
+        return;
+    }
     sa->sb.data[sa->sb.data_count] = tcode;
     sa->sb.data[sa->sb.data_count + 1] = data;
     sa->sb.data[sa->sb.data_count + 2] = data >> 8;
@@ -290,7 +325,7 @@ command_query_spi_angle(uint32_t *args)
     struct spi_angle *sa = oid_lookup(oid, command_config_spi_angle);
 
     sched_del_timer(&sa->timer);
-    sa->flags = 0;
+    sa->flags = sa->mon_flags = 0;
     if (!args[2])
         // End measurements
         return;
@@ -305,6 +340,48 @@ command_query_spi_angle(uint32_t *args)
 DECL_COMMAND(command_query_spi_angle,
              "query_spi_angle oid=%c clock=%u rest_ticks=%u time_shift=%c");
 
+void
+command_spi_angle_monitor(uint32_t *args)
+{
+    struct spi_angle *sa = oid_lookup(args[0], command_config_spi_angle);
+    sa->mon_flags = 0;
+    sa->mon_count = sa->mon_errors = sa->mon_exceed = 0;
+    sa->mon_report_count = args[5];
+    if (!sa->mon_report_count)
+        // Disable monitoring (resume bulk measurement reports)
+        return;
+    sa->mon_stepper = stepper_oid_lookup(args[1]);
+    sa->mon_offset = args[2];
+    sa->mon_step_angle = args[3];
+    sa->mon_threshold = args[4];
+    sa->mon_flags = SAM_ENABLED;
+}
+DECL_COMMAND(command_spi_angle_monitor,
+             "spi_angle_monitor oid=%c stepper_oid=%c angle_offset=%hu"
+             " step_angle=%u threshold=%hu report_count=%hu");
+
+// Send spi_angle_monitor_status message if needed
+static void
+angle_monitor_check_report(struct spi_angle *sa, uint8_t oid)
+{
+    uint_fast8_t mon_flags = sa->mon_flags;
+    if (!(mon_flags & SAM_ENABLED))
+        return;
+    uint_fast16_t samples = sa->mon_count + sa->mon_errors;
+    if (samples < sa->mon_report_count) {
+        // Report the start of a position error immediately
+        if (!sa->mon_exceed || mon_flags & SAM_IN_ERROR)
+            return;
+    }
+    sendf("spi_angle_monitor_status oid=%c clock=%u count=%hu errors=%hu"
+          " exceed=%hu min_err=%hi max_err=%hi"
+          , oid, timer_read_time(), sa->mon_count, sa->mon_errors
+          , sa->mon_exceed, sa->mon_min, sa->mon_max);
+    sa->mon_flags = (sa->mon_exceed ? SAM_ENABLED | SAM_IN_ERROR
+                     : SAM_ENABLED);
+    sa->mon_count = sa->mon_errors = sa->mon_exceed = 0;
+}
+
 void
 command_spi_angle_transfer(uint32_t *args)
 {
@@ -375,6 +452,7 @@ spi_angle_task(void)
         else if (chip == SA_CHIP_MT6826S)
             mt6826s_query(sa, stime);
         angle_check_report(sa, oid);
+        angle_monitor_check_report(sa, oid);
     }
 }
-DECL_TASK(spi_angle_task);
+DECL_WAKE_TASK(spi_angle_task, angle_wake);
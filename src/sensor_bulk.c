@@ -4,9 +4,14 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <string.h> // memset
 #include "command.h" // sendf
+#include "sched.h" // shutdown
 #include "sensor_bulk.h" // sensor_bulk_report
 
+// Sensors that support packed reports (see sensor_bulk_add_data()) use them
+DECL_CONSTANT("SENSOR_BULK_PACKED", 1);
+
 // Reset counters
 void
 sensor_bulk_reset(struct sensor_bulk *sb)
@@ -14,16 +19,86 @@ sensor_bulk_reset(struct sensor_bulk *sb)
     sb->sequence = 0;
     sb->possible_overflows = 0;
     sb->data_count = 0;
+    sb->sample_count = 0;
+    memset(sb->last, 0, sizeof(sb->last));
 }
 
 // Report local measurement buffer
 void
 sensor_bulk_report(struct sensor_bulk *sb, uint8_t oid)
 {
-    sendf("sensor_bulk_data oid=%c sequence=%hu data=%*s"
-          , oid, sb->sequence, sb->data_count, sb->data);
+    sendf_bulk("sensor_bulk_data oid=%c sequence=%hu data=%*s"
+               , oid, sb->sequence, sb->data_count, sb->data);
     sb->data_count = 0;
-    sb->sequence++;
+    if (sb->field_count) {
+        // In compressed mode the sequence is the index of the first
+        // sample in the message
+        sb->sequence += sb->sample_count;
+        sb->sample_count = 0;
+        memset(sb->last, 0, sizeof(sb->last));
+    } else {
+        sb->sequence++;
+    }
+}
+
+// Select compressed mode - each sample has 'field_count' values that
+// are sent via sensor_bulk_add_sample().  The 'sample_size' is the
+// size of an uncompressed sample (as used by sensor_bulk_status).
+void
+sensor_bulk_set_compress(struct sensor_bulk *sb, uint8_t field_count
+                         , uint8_t sample_size)
+{
+    if (field_count > SENSOR_BULK_MAX_FIELDS)
+        shutdown("Too many sensor_bulk compress fields");
+    sb->field_count = field_count;
+    sb->sample_size = sample_size;
+    sensor_bulk_reset(sb);
+}
+
+// Add a sample in compressed mode.  Each value is stored as the
+// difference from the previous sample in the message, encoded as a
+// zigzag varint (7 bits per byte, least significant bits first).
+void
+sensor_bulk_add_sample(struct sensor_bulk *sb, uint8_t oid, int16_t *values)
+{
+    uint8_t *d = &sb->data[sb->data_count];
+    uint_fast8_t i;
+    for (i=0; i<sb->field_count; i++) {
+        int32_t diff = values[i] - sb->last[i];
+        uint32_t zz = ((uint32_t)diff << 1) ^ (diff >> 31);
+        while (zz >= 0x80) {
+            *d++ = zz | 0x80;
+            zz >>= 7;
+        }
+        *d++ = zz;
+        sb->last[i] = values[i];
+    }
+    sb->data_count = d - sb->data;
+    sb->sample_count++;
+    // A value difference is at most 17 bits (3 bytes once encoded)
+    if (sb->data_count + sb->field_count * 3 > ARRAY_SIZE(sb->data))
+        sensor_bulk_report(sb, oid);
+}
+
+// Add sample data in packed mode.  Samples are stored back to back
+// and may span two messages, so that every sensor_bulk_data message is
+// full.  The stream position of the first byte of a message is its
+// sequence times SENSOR_BULK_DATA_SIZE.
+void
+sensor_bulk_add_data(struct sensor_bulk *sb, uint8_t oid
+                     , uint8_t *data, uint_fast8_t len)
+{
+    while (len) {
+        uint_fast8_t count = ARRAY_SIZE(sb->data) - sb->data_count;
+        if (count > len)
+            count = len;
+        memcpy(&sb->data[sb->data_count], data, count);
+        sb->data_count += count;
+        data += count;
+        len -= count;
+        if (sb->data_count >= ARRAY_SIZE(sb->data))
+            sensor_bulk_report(sb, oid);
+    }
 }
 
 // Report buffer and fifo status
@@ -31,8 +106,11 @@ void
 sensor_bulk_status(struct sensor_bulk *sb, uint8_t oid
                    , uint32_t time1, uint32_t query_ticks, uint32_t fifo)
 {
-    sendf("sensor_bulk_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
-          " buffered=%u possible_overflows=%hu"
-          , oid, time1, query_ticks, sb->sequence
-          , sb->data_count + fifo, sb->possible_overflows);
+    uint32_t buffered = sb->data_count;
+    if (sb->field_count)
+        buffered = sb->sample_count * sb->sample_size;
+    sendf_bulk("sensor_bulk_status oid=%c clock=%u query_ticks=%u"
+               " next_sequence=%hu buffered=%u possible_overflows=%hu"
+               , oid, time1, query_ticks, sb->sequence
+               , buffered + fifo, sb->possible_overflows);
 }
@@ -1,14 +1,26 @@
 #ifndef __SENSOR_BULK_H
 #define __SENSOR_BULK_H
 
+#define SENSOR_BULK_MAX_FIELDS 3
+#define SENSOR_BULK_DATA_SIZE 51
+
 struct sensor_bulk {
     uint16_t sequence, possible_overflows;
     uint8_t data_count;
-    uint8_t data[51];
+    uint8_t data[SENSOR_BULK_DATA_SIZE];
+    // Compressed mode state (see sensor_bulk_add_sample())
+    uint8_t field_count, sample_size, sample_count;
+    int16_t last[SENSOR_BULK_MAX_FIELDS];
 };
 
 void sensor_bulk_reset(struct sensor_bulk *sb);
 void sensor_bulk_report(struct sensor_bulk *sb, uint8_t oid);
+void sensor_bulk_set_compress(struct sensor_bulk *sb, uint8_t field_count
+                              , uint8_t sample_size);
+void sensor_bulk_add_sample(struct sensor_bulk *sb, uint8_t oid
+                            , int16_t *values);
+void sensor_bulk_add_data(struct sensor_bulk *sb, uint8_t oid
+                          , uint8_t *data, uint_fast8_t len);
 void sensor_bulk_status(struct sensor_bulk *sb, uint8_t oid
                         , uint32_t time1, uint32_t query_ticks, uint32_t fifo);
 
@@ -10,6 +10,7 @@
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
+#include "load_cell_probe.h" // load_cell_probe_report_sample
 #include "sched.h" // sched_add_timer
 #include "sensor_bulk.h" // sensor_bulk_report
 #include <stdbool.h>
@@ -24,6 +25,7 @@ struct hx71x_adc {
     struct gpio_in dout; // pin used to receive data from the hx71x
     struct gpio_out sclk; // pin used to generate clock for the hx71x
     struct sensor_bulk sb;
+    struct load_cell_probe *lcp;
 };
 
 enum {
@@ -34,7 +36,7 @@ enum {
 #define SAMPLE_ERROR_DESYNC 1L << 31
 #define SAMPLE_ERROR_READ_TOO_LONG 1L << 30
 
-static struct task_wake wake_hx71x;
+DECL_TASK_WAKE(wake_hx71x);
 
 
 /****************************************************************
@@ -175,6 +177,14 @@ hx71x_read_adc(struct hx71x_adc *hx71x, uint8_t oid)
         counts = hx71x->last_error;
     }
 
+    // Notify the load cell probe (if any)
+    if (CONFIG_WANT_LOAD_CELL_PROBE && hx71x->lcp) {
+        if (hx71x->last_error)
+            load_cell_probe_report_error(hx71x->lcp);
+        else
+            load_cell_probe_report_sample(hx71x->lcp, counts);
+    }
+
     // Add measurement to buffer
     add_sample(hx71x, oid, counts, false);
 }
@@ -198,6 +208,18 @@ command_config_hx71x(uint32_t *args)
 DECL_COMMAND(command_config_hx71x, "config_hx71x oid=%c gain_channel=%c"
              " dout_pin=%u sclk_pin=%u");
 
+#if CONFIG_WANT_LOAD_CELL_PROBE
+// Forward samples to a load cell probe
+void
+command_hx71x_attach_load_cell_probe(uint32_t *args)
+{
+    struct hx71x_adc *hx71x = oid_lookup(args[0], command_config_hx71x);
+    hx71x->lcp = load_cell_probe_oid_lookup(args[1]);
+}
+DECL_COMMAND(command_hx71x_attach_load_cell_probe,
+             "hx71x_attach_load_cell_probe oid=%c load_cell_probe_oid=%c");
+#endif
+
 // start/stop capturing ADC data
 void
 command_query_hx71x(uint32_t *args)
@@ -250,4 +272,4 @@ hx71x_capture_task(void)
             hx71x_read_adc(hx71x, oid);
     }
 }
-DECL_TASK(hx71x_capture_task);
+DECL_WAKE_TASK(hx71x_capture_task, wake_hx71x);
@@ -1,7 +1,7 @@
 // Support for eddy current sensor data from ldc1612 chip
 //
 // Copyright (C) 2023 Alan.Ma <tech@biqu3d.com>
-// Copyright (C) 2024  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2024-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -12,19 +12,31 @@
 #include "command.h" // DECL_COMMAND
 #include "i2ccmds.h" // i2cdev_oid_lookup
 #include "sched.h" // DECL_TASK
-#include "sensor_bulk.h" // sensor_bulk_report
+#include "sensor_bulk.h" // sensor_bulk_add_data
 #include "trsync.h" // trsync_do_trigger
 
 enum {
-    LDC_PENDING = 1<<0, LDC_HAVE_INTB = 1<<1,
-    LH_AWAIT_HOMING = 1<<1, LH_CAN_TRIGGER = 1<<2
+    LDC_PENDING = 1<<0, LDC_HAVE_INTB = 1<<1, LDC_BUSY = 1<<2,
+    LH_AWAIT_HOMING = 1<<1, LH_CAN_TRIGGER = 1<<2, LH_USE_HEIGHT = 1<<3,
+    LH_ARMED = 1<<4,
 };
 
+#define BYTES_PER_SAMPLE 4
+
+// Frequency to height table and moving average filter for homing
+#define HEIGHT_TABLE_SIZE 8
+DECL_CONSTANT("LDC1612_HEIGHT_TABLE_SIZE", HEIGHT_TABLE_SIZE);
+#define FILTER_MAX_SAMPLES 8
+DECL_CONSTANT("LDC1612_FILTER_MAX_SAMPLES", FILTER_MAX_SAMPLES);
+
 struct ldc1612 {
     struct timer timer;
     uint32_t rest_ticks;
     struct i2cdev_s *i2c;
-    uint8_t flags;
+    struct i2c_xfer xfer;
+    uint8_t oid, flags;
+    uint8_t reg, status[2];
+    uint8_t sample[BYTES_PER_SAMPLE];
     struct sensor_bulk sb;
     struct gpio_in intb_pin;
     // homing
@@ -33,9 +45,15 @@ struct ldc1612 {
     uint8_t trigger_reason, error_reason;
     uint32_t trigger_threshold;
     uint32_t homing_clock;
+    // height based homing (heights are in nanometers)
+    uint8_t table_count, filter_len, filter_count, filter_pos;
+    uint32_t table_freqs[HEIGHT_TABLE_SIZE];
+    int32_t table_heights[HEIGHT_TABLE_SIZE];
+    uint32_t filter_samples[FILTER_MAX_SAMPLES], filter_sum;
+    int32_t trigger_height, arm_height;
 };
 
-static struct task_wake ldc1612_wake;
+DECL_TASK_WAKE(ldc1612_wake);
 
 // Check if the intb line is "asserted"
 static int
@@ -66,6 +84,7 @@ command_config_ldc1612(uint32_t *args)
                                    , sizeof(*ld));
     ld->timer.func = ldc1612_event;
     ld->i2c = i2cdev_oid_lookup(args[1]);
+    ld->oid = args[0];
 }
 DECL_COMMAND(command_config_ldc1612, "config_ldc1612 oid=%c i2c_oid=%c");
 
@@ -101,6 +120,51 @@ DECL_COMMAND(command_ldc1612_setup_home,
              "ldc1612_setup_home oid=%c clock=%u threshold=%u"
              " trsync_oid=%c trigger_reason=%c error_reason=%c");
 
+// Set an entry of the frequency to height table (frequencies must be
+// sent in ascending order starting with index zero)
+void
+command_ldc1612_set_height_entry(uint32_t *args)
+{
+    struct ldc1612 *ld = oid_lookup(args[0], command_config_ldc1612);
+    uint8_t index = args[1];
+    if (index >= HEIGHT_TABLE_SIZE || index > ld->table_count)
+        shutdown("Invalid ldc1612 height table index");
+    ld->homing_flags = 0;
+    ld->table_freqs[index] = args[2];
+    ld->table_heights[index] = args[3];
+    ld->table_count = index + 1;
+}
+DECL_COMMAND(command_ldc1612_set_height_entry,
+             "ldc1612_set_height_entry oid=%c index=%c freq=%u height=%i");
+
+// Start a homing operation that triggers on the filtered sensor height
+void
+command_ldc1612_setup_home_height(uint32_t *args)
+{
+    struct ldc1612 *ld = oid_lookup(args[0], command_config_ldc1612);
+    uint8_t filter_len = args[4];
+    if (ld->table_count < 2 || !filter_len || filter_len > FILTER_MAX_SAMPLES)
+        shutdown("Invalid ldc1612 height homing parameters");
+    ld->homing_flags = 0;
+    ld->homing_clock = args[1];
+    ld->trigger_height = args[2];
+    ld->arm_height = args[2] + args[3];
+    ld->filter_len = filter_len;
+    ld->filter_count = ld->filter_pos = 0;
+    ld->filter_sum = 0;
+    ld->ts = trsync_oid_lookup(args[5]);
+    ld->trigger_reason = args[6];
+    ld->error_reason = args[7];
+    uint8_t flags = LH_AWAIT_HOMING | LH_CAN_TRIGGER | LH_USE_HEIGHT;
+    if (!args[3])
+        flags |= LH_ARMED;
+    ld->homing_flags = flags;
+}
+DECL_COMMAND(command_ldc1612_setup_home_height,
+             "ldc1612_setup_home_height oid=%c clock=%u trigger_height=%i"
+             " hysteresis=%u filter_samples=%c"
+             " trsync_oid=%c trigger_reason=%c error_reason=%c");
+
 void
 command_query_ldc1612_home_state(uint32_t *args)
 {
@@ -111,6 +175,65 @@ command_query_ldc1612_home_state(uint32_t *args)
 DECL_COMMAND(command_query_ldc1612_home_state,
              "query_ldc1612_home_state oid=%c");
 
+// Interpolate the height of a frequency using the height table
+static int32_t
+lookup_height(struct ldc1612 *ld, uint32_t freq)
+{
+    uint_fast8_t i, count = ld->table_count;
+    if (freq <= ld->table_freqs[0])
+        return ld->table_heights[0];
+    for (i=1; i<count; i++)
+        if (freq < ld->table_freqs[i])
+            break;
+    if (i >= count)
+        return ld->table_heights[count - 1];
+    uint32_t f0 = ld->table_freqs[i-1], f1 = ld->table_freqs[i];
+    int32_t h0 = ld->table_heights[i-1], h1 = ld->table_heights[i];
+    return h0 + (int32_t)((int64_t)(h1 - h0) * (freq - f0) / (f1 - f0));
+}
+
+// Add a sample to the moving average filter - returns 1 if the
+// filtered height is available
+static int
+filter_height(struct ldc1612 *ld, uint32_t data, int32_t *height)
+{
+    uint_fast8_t pos = ld->filter_pos, len = ld->filter_len;
+    ld->filter_sum += data - ld->filter_samples[pos];
+    ld->filter_samples[pos] = data;
+    ld->filter_pos = pos + 1 >= len ? 0 : pos + 1;
+    if (ld->filter_count < len) {
+        ld->filter_count++;
+        if (ld->filter_count < len)
+            return 0;
+    }
+    *height = lookup_height(ld, ld->filter_sum / len);
+    return 1;
+}
+
+// Check if a sample should trigger a height based homing event
+// (returns the trsync reason or zero)
+static uint8_t
+check_home_height(struct ldc1612 *ld, uint32_t data, uint8_t *homing_flags)
+{
+    int32_t height;
+    if (!filter_height(ld, data, &height))
+        return 0;
+    if (*homing_flags & LH_AWAIT_HOMING)
+        return 0;
+    if (!(*homing_flags & LH_ARMED)) {
+        // Sensor must be above the hysteresis band before triggering
+        if (height >= ld->arm_height)
+            *homing_flags |= LH_ARMED;
+        else if (height <= ld->trigger_height)
+            // Sensor started too close to the target - cancel homing
+            return ld->error_reason;
+        return 0;
+    }
+    if (height <= ld->trigger_height)
+        return ld->trigger_reason;
+    return 0;
+}
+
 // Check if a sample should trigger a homing event
 static void
 check_home(struct ldc1612 *ld, uint32_t data)
@@ -126,13 +249,18 @@ check_home(struct ldc1612 *ld, uint32_t data)
     }
     uint32_t time = timer_read_time();
     if ((homing_flags & LH_AWAIT_HOMING)
-        && timer_is_before(time, ld->homing_clock))
-        return;
-    homing_flags &= ~LH_AWAIT_HOMING;
-    if (data > ld->trigger_threshold) {
+        && !timer_is_before(time, ld->homing_clock))
+        homing_flags &= ~LH_AWAIT_HOMING;
+    uint8_t reason = 0;
+    if (homing_flags & LH_USE_HEIGHT)
+        reason = check_home_height(ld, data, &homing_flags);
+    else if (!(homing_flags & LH_AWAIT_HOMING)
+             && data > ld->trigger_threshold)
+        reason = ld->trigger_reason;
+    if (reason) {
         homing_flags = 0;
         ld->homing_clock = time;
-        trsync_do_trigger(ld->ts, ld->trigger_reason);
+        trsync_do_trigger(ld->ts, reason);
     }
     ld->homing_flags = homing_flags;
 }
@@ -159,25 +287,34 @@ read_reg_status(struct ldc1612 *ld)
     return (data_status[0] << 8) | data_status[1];
 }
 
-#define BYTES_PER_SAMPLE 4
+// Start an asynchronous read of a register on the ldc1612
+static void
+read_reg_async(struct ldc1612 *ld, uint8_t reg, uint8_t *res
+               , void (*callback)(struct i2c_xfer *x, int ret))
+{
+    ld->reg = reg;
+    ld->xfer.callback = callback;
+    i2c_dev_read_async(ld->i2c, &ld->xfer, sizeof(ld->reg), &ld->reg, 2, res);
+}
 
-// Query ldc1612 data
+// Note the end of a query (and check if another query is pending)
 static void
-ldc1612_query(struct ldc1612 *ld, uint8_t oid)
+ldc1612_query_end(struct ldc1612 *ld)
 {
-    // Check if data available (and clear INTB line)
-    uint16_t status = read_reg_status(ld);
     irq_disable();
-    ld->flags &= ~LDC_PENDING;
+    uint_fast8_t flags = ld->flags & ~LDC_BUSY;
+    ld->flags = flags;
     irq_enable();
-    if (!(status & 0x08))
-        return;
+    if (flags & LDC_PENDING)
+        sched_wake_task(&ldc1612_wake);
+}
 
-    // Read coil0 frequency
-    uint8_t *d = &ld->sb.data[ld->sb.data_count];
-    read_reg(ld, REG_DATA0_MSB, &d[0]);
-    read_reg(ld, REG_DATA0_LSB, &d[2]);
-    ld->sb.data_count += BYTES_PER_SAMPLE;
+static void
+ldc1612_data_lsb_done(struct i2c_xfer *x, int ret)
+{
+    i2c_shutdown_on_err(ret);
+    struct ldc1612 *ld = container_of(x, struct ldc1612, xfer);
+    uint8_t *d = ld->sample;
 
     // Check for endstop trigger
     uint32_t data =   ((uint32_t)d[0] << 24)
@@ -186,9 +323,45 @@ ldc1612_query(struct ldc1612 *ld, uint8_t oid)
                     | ((uint32_t)d[3]);
     check_home(ld, data);
 
-    // Flush local buffer if needed
-    if (ld->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ld->sb.data))
-        sensor_bulk_report(&ld->sb, oid);
+    sensor_bulk_add_data(&ld->sb, ld->oid, d, BYTES_PER_SAMPLE);
+    ldc1612_query_end(ld);
+}
+
+static void
+ldc1612_data_msb_done(struct i2c_xfer *x, int ret)
+{
+    i2c_shutdown_on_err(ret);
+    struct ldc1612 *ld = container_of(x, struct ldc1612, xfer);
+    read_reg_async(ld, REG_DATA0_LSB, &ld->sample[2], ldc1612_data_lsb_done);
+}
+
+static void
+ldc1612_status_done(struct i2c_xfer *x, int ret)
+{
+    i2c_shutdown_on_err(ret);
+    struct ldc1612 *ld = container_of(x, struct ldc1612, xfer);
+    irq_disable();
+    ld->flags &= ~LDC_PENDING;
+    irq_enable();
+    uint16_t status = (ld->status[0] << 8) | ld->status[1];
+    if (!(status & 0x08)) {
+        ldc1612_query_end(ld);
+        return;
+    }
+
+    // Read coil0 frequency
+    read_reg_async(ld, REG_DATA0_MSB, &ld->sample[0], ldc1612_data_msb_done);
+}
+
+// Query ldc1612 data
+static void
+ldc1612_query(struct ldc1612 *ld)
+{
+    // Check if data available (and clear INTB line)
+    irq_disable();
+    ld->flags |= LDC_BUSY;
+    irq_enable();
+    read_reg_async(ld, REG_STATUS, ld->status, ldc1612_status_done);
 }
 
 void
@@ -197,7 +370,8 @@ command_query_ldc1612(uint32_t *args)
     struct ldc1612 *ld = oid_lookup(args[0], command_config_ldc1612);
 
     sched_del_timer(&ld->timer);
-    ld->flags &= ~LDC_PENDING;
+    i2c_async_cancel(&ld->xfer);
+    ld->flags &= ~(LDC_PENDING | LDC_BUSY);
     if (!args[1])
         // End measurements
         return;
@@ -246,9 +420,9 @@ ldc1612_task(void)
     struct ldc1612 *ld;
     foreach_oid(oid, ld, command_config_ldc1612) {
         uint_fast8_t flags = ld->flags;
-        if (!(flags & LDC_PENDING))
+        if ((flags & (LDC_PENDING | LDC_BUSY)) != LDC_PENDING)
             continue;
-        ldc1612_query(ld, oid);
+        ldc1612_query(ld);
     }
 }
-DECL_TASK(ldc1612_task);
+DECL_WAKE_TASK(ldc1612_task, ldc1612_wake);
@@ -1,7 +1,7 @@
 // Support for gathering acceleration data from LIS2DW chip
 //
 // Copyright (C) 2023  Zhou.XianMing <zhouxm@biqu3d.com>
-// Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2020-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -12,8 +12,10 @@
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
+#include "endstop.h" // endstop_hw_setup
 #include "sched.h" // DECL_TASK
 #include "sensor_bulk.h" // sensor_bulk_report
+#include "sensor_spectrum.h" // sensor_spectrum_add_sample
 #include "spicmds.h" // spidev_transfer
 #include "i2ccmds.h" // i2cdev_s
 
@@ -25,6 +27,15 @@
 
 #define BYTES_PER_SAMPLE 6
 
+// Size of the spi data read (the fifo status read is padded to this
+// size when both are issued in a single batch)
+#define MSG_SIZE 7
+#define MSG_COUNT (CONFIG_HAVE_GPIO_SPI_BATCH ? 2 : 1)
+
+// Number of fifo entries that assert the threshold interrupt (the fth
+// field of the fifo_ctrl register set by the host)
+#define INT_THRESHOLD 16
+
 struct lis2dw {
     struct timer timer;
     uint32_t rest_ticks;
@@ -32,14 +43,19 @@ struct lis2dw {
         struct spidev_s *spi;
         struct i2cdev_s *i2c;
     };
+    struct spi_xfer xfer;
     uint8_t bus_type;
-    uint8_t flags;
-    uint8_t model;
+    uint8_t oid, flags;
+    uint8_t model, drain_count;
+    uint8_t msg[MSG_SIZE * MSG_COUNT], fifo[2];
     struct sensor_bulk sb;
+    struct sensor_spectrum *ss;
+    struct gpio_in int_pin;
+    struct endstop_irq irq;
 };
 
 enum {
-    LIS_PENDING = 1<<0,
+    LIS_PENDING = 1<<0, LIS_HAVE_INT = 1<<1, LIS_HAVE_IRQ = 1<<2,
 };
 
 enum {
@@ -56,24 +72,46 @@ enum {
 DECL_ENUMERATION("lis_chip_type", "LIS2DW", LIS2DW);
 DECL_ENUMERATION("lis_chip_type", "LIS3DH", LIS3DH);
 
-static struct task_wake lis2dw_wake;
+DECL_TASK_WAKE(lis2dw_wake);
 
 // Event handler that wakes lis2dw_task() periodically
 static uint_fast8_t
 lis2dw_event(struct timer *timer)
 {
     struct lis2dw *ax = container_of(timer, struct lis2dw, timer);
+    if (ax->flags & LIS_HAVE_INT) {
+        if (!gpio_in_read(ax->int_pin)) {
+            // Fifo threshold not reached - check the int pin again later
+            ax->timer.waketime += ax->rest_ticks;
+            return SF_RESCHEDULE;
+        }
+        if (CONFIG_ENDSTOP_IRQ && ax->flags & LIS_HAVE_IRQ)
+            endstop_hw_disable(&ax->irq);
+        ax->drain_count = INT_THRESHOLD;
+    }
     ax->flags |= LIS_PENDING;
     sched_wake_task(&lis2dw_wake);
     return SF_DONE;
 }
 
+// Pin change irq callback for the fifo threshold interrupt
+static void
+lis2dw_irq_edge(struct endstop_irq *ei, uint32_t time)
+{
+    struct lis2dw *ax = container_of(ei, struct lis2dw, irq);
+    sched_del_timer(&ax->timer);
+    ax->drain_count = INT_THRESHOLD;
+    ax->flags |= LIS_PENDING;
+    sched_wake_task(&lis2dw_wake);
+}
+
 void
 command_config_lis2dw(uint32_t *args)
 {
     struct lis2dw *ax = oid_alloc(args[0], command_config_lis2dw
                                    , sizeof(*ax));
     ax->timer.func = lis2dw_event;
+    ax->oid = args[0];
 
     switch (args[2]) {
         case SPI_SERIAL:
@@ -104,9 +142,28 @@ command_config_lis2dw(uint32_t *args)
         default:
             shutdown("model type invalid");
     }
+
+    if (args[4])
+        sensor_bulk_set_compress(&ax->sb, 3, BYTES_PER_SAMPLE);
 }
 DECL_COMMAND(command_config_lis2dw, "config_lis2dw oid=%c"
-                " bus_oid=%c bus_oid_type=%c lis_chip_type=%c");
+                " bus_oid=%c bus_oid_type=%c lis_chip_type=%c compress=%c");
+
+// Use the chip's fifo threshold interrupt to detect when to read data
+void
+command_config_lis2dw_with_int(uint32_t *args)
+{
+    command_config_lis2dw(args);
+    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
+    ax->int_pin = gpio_in_setup(args[5], 0);
+    ax->irq.func = lis2dw_irq_edge;
+    ax->flags = LIS_HAVE_INT;
+    if (CONFIG_ENDSTOP_IRQ && !endstop_hw_setup(&ax->irq, args[5]))
+        ax->flags |= LIS_HAVE_IRQ;
+}
+DECL_COMMAND(command_config_lis2dw_with_int, "config_lis2dw_with_int oid=%c"
+             " bus_oid=%c bus_oid_type=%c lis_chip_type=%c compress=%c"
+             " int_pin=%c");
 
 // Helper code to reschedule the lis2dw_event() timer
 static void
@@ -114,39 +171,126 @@ lis2dw_reschedule_timer(struct lis2dw *ax)
 {
     irq_disable();
     ax->timer.waketime = timer_read_time() + ax->rest_ticks;
+    if (CONFIG_ENDSTOP_IRQ && ax->flags & LIS_HAVE_IRQ)
+        // Wake on the next threshold edge (the timer still polls the
+        // pin in case the threshold was reached before the irq was armed)
+        endstop_hw_enable(&ax->irq, 1);
     sched_add_timer(&ax->timer);
     irq_enable();
 }
 
-// Query accelerometer data
+// Store a sample and check if more data is in the fifo
 static void
-lis2dw_query(struct lis2dw *ax, uint8_t oid)
+lis2dw_query_finish(struct lis2dw *ax, uint8_t *data, uint8_t fifo_empty
+                    , uint8_t fifo_ovrn)
 {
-    uint8_t fifo_empty = 0;
-    uint8_t fifo_ovrn = 0;
-    uint8_t *d = &ax->sb.data[ax->sb.data_count];
+    if ((CONFIG_WANT_SENSOR_SPECTRUM && ax->ss) || ax->sb.field_count) {
+        int16_t v[3];
+        for (uint32_t i = 0; i < ARRAY_SIZE(v); i++)
+            v[i] = (int16_t)(data[i*2] | (data[i*2 + 1] << 8));
+        if (CONFIG_WANT_SENSOR_SPECTRUM && ax->ss)
+            // Summary mode - add sample to the vibration summary
+            sensor_spectrum_add_sample(ax->ss, v);
+        else
+            sensor_bulk_add_sample(&ax->sb, ax->oid, v);
+    } else {
+        uint8_t *d = &ax->sb.data[ax->sb.data_count];
+        for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
+            d[i] = data[i];
+        ax->sb.data_count += BYTES_PER_SAMPLE;
+        if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
+            sensor_bulk_report(&ax->sb, ax->oid);
+    }
 
-    if (CONFIG_HAVE_GPIO_SPI && ax->bus_type == SPI_SERIAL) {
-        uint8_t msg[7] = {0};
-        uint8_t fifo[2] = {LIS_FIFO_SAMPLES | LIS_AM_READ , 0};
+    // Check fifo status
+    if (fifo_ovrn)
+        ax->sb.possible_overflows++;
 
-        msg[0] = LIS_AR_DATAX0 | LIS_AM_READ;
-        if (ax->model == LIS3DH)
-            msg[0] |= LIS_MS_SPI;
+    // check if we need to run the task again (more packets in fifo?)
+    uint_fast8_t more = !fifo_empty;
+    if (ax->flags & LIS_HAVE_INT)
+        // Read a full threshold of samples for each int pin assertion
+        more = --ax->drain_count > 0;
+    if (more) {
+        // More data in fifo - wake this task again
+        ax->flags |= LIS_PENDING;
+        sched_wake_task(&lis2dw_wake);
+    } else {
+        // Sleep until next check time
+        lis2dw_reschedule_timer(ax);
+    }
+}
 
-        spidev_transfer(ax->spi, 1, sizeof(msg), msg);
+static void lis2dw_spi_data_done(struct spi_xfer *x);
+static void lis2dw_spi_fifo_done(struct spi_xfer *x);
+static void lis2dw_spi_batch_done(struct spi_xfer *x);
 
-        spidev_transfer(ax->spi, 1, sizeof(fifo), fifo);
+// Start an asynchronous spi read of accelerometer data
+static void
+lis2dw_query_spi(struct lis2dw *ax)
+{
+    memset(ax->msg, 0, sizeof(ax->msg));
+    ax->msg[0] = LIS_AR_DATAX0 | LIS_AM_READ;
+    if (ax->model == LIS3DH)
+        ax->msg[0] |= LIS_MS_SPI;
+    if (CONFIG_HAVE_GPIO_SPI_BATCH) {
+        // Read the data and the fifo status in a single batch
+        ax->msg[MSG_SIZE] = LIS_FIFO_SAMPLES | LIS_AM_READ;
+        ax->xfer.callback = lis2dw_spi_batch_done;
+        spidev_transfer_async_batch(ax->spi, &ax->xfer, 1, MSG_COUNT
+                                    , MSG_SIZE, ax->msg);
+        return;
+    }
+    ax->xfer.callback = lis2dw_spi_data_done;
+    spidev_transfer_async(ax->spi, &ax->xfer, 1, MSG_SIZE, ax->msg);
+}
 
-        if (ax->model == LIS3DH)
-            fifo_empty = fifo[1] & 0x20;
-        else
-            fifo_empty = fifo[1] & 0x3F;
+static void
+lis2dw_spi_data_done(struct spi_xfer *x)
+{
+    struct lis2dw *ax = container_of(x, struct lis2dw, xfer);
+    ax->fifo[0] = LIS_FIFO_SAMPLES | LIS_AM_READ;
+    ax->fifo[1] = 0;
+    ax->xfer.callback = lis2dw_spi_fifo_done;
+    spidev_transfer_async(ax->spi, &ax->xfer, 1, sizeof(ax->fifo), ax->fifo);
+}
 
-        fifo_ovrn = fifo[1] & 0x40;
+// Process the spi fifo status response
+static void
+lis2dw_spi_finish(struct lis2dw *ax, uint8_t *fifo)
+{
+    uint8_t fifo_empty;
+    if (ax->model == LIS3DH)
+        fifo_empty = fifo[1] & 0x20;
+    else
+        fifo_empty = fifo[1] & 0x3F;
+    uint8_t fifo_ovrn = fifo[1] & 0x40;
+
+    lis2dw_query_finish(ax, &ax->msg[1], fifo_empty, fifo_ovrn);
+}
 
-        for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
-            d[i] = msg[i + 1];
+static void
+lis2dw_spi_fifo_done(struct spi_xfer *x)
+{
+    struct lis2dw *ax = container_of(x, struct lis2dw, xfer);
+    lis2dw_spi_finish(ax, ax->fifo);
+}
+
+static void
+lis2dw_spi_batch_done(struct spi_xfer *x)
+{
+    struct lis2dw *ax = container_of(x, struct lis2dw, xfer);
+    lis2dw_spi_finish(ax, &ax->msg[MSG_SIZE]);
+}
+
+// Query accelerometer data
+static void
+lis2dw_query(struct lis2dw *ax)
+{
+    ax->flags &= ~LIS_PENDING;
+
+    if (CONFIG_HAVE_GPIO_SPI && ax->bus_type == SPI_SERIAL) {
+        lis2dw_query_spi(ax);
     } else if (CONFIG_HAVE_GPIO_I2C && ax->bus_type == I2C_SERIAL) {
         uint8_t msg_reg[] = {LIS_AR_DATAX0};
         if (ax->model == LIS3DH)
@@ -164,54 +308,68 @@ lis2dw_query(struct lis2dw *ax, uint8_t oid)
                     , sizeof(fifo), fifo);
         i2c_shutdown_on_err(ret);
 
+        uint8_t fifo_empty;
         if (ax->model == LIS3DH)
             fifo_empty = fifo[0] & 0x20;
         else
             fifo_empty = fifo[0] & 0x3F;
 
-        fifo_ovrn = fifo[0] & 0x40;
+        uint8_t fifo_ovrn = fifo[0] & 0x40;
 
-        for (uint32_t i = 0; i < BYTES_PER_SAMPLE; i++)
-            d[i] = msg[i];
-    }
-
-    ax->sb.data_count += BYTES_PER_SAMPLE;
-    if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
-        sensor_bulk_report(&ax->sb, oid);
-
-    // Check fifo status
-    if (fifo_ovrn)
-        ax->sb.possible_overflows++;
-
-    // check if we need to run the task again (more packets in fifo?)
-    if (!fifo_empty) {
-        // More data in fifo - wake this task again
-        sched_wake_task(&lis2dw_wake);
-    } else {
-        // Sleep until next check time
-        ax->flags &= ~LIS_PENDING;
-        lis2dw_reschedule_timer(ax);
+        lis2dw_query_finish(ax, msg, fifo_empty, fifo_ovrn);
     }
 }
 
-void
-command_query_lis2dw(uint32_t *args)
+// Stop any active measurements and optionally start new measurements
+static void
+lis2dw_start(struct lis2dw *ax, uint32_t rest_ticks
+             , struct sensor_spectrum *ss)
 {
-    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
-
+    uint8_t int_flags = ax->flags & (LIS_HAVE_INT | LIS_HAVE_IRQ);
+    irq_disable();
     sched_del_timer(&ax->timer);
-    ax->flags = 0;
-    if (!args[1])
+    if (CONFIG_ENDSTOP_IRQ && int_flags & LIS_HAVE_IRQ)
+        endstop_hw_disable(&ax->irq);
+    irq_enable();
+    if (CONFIG_HAVE_GPIO_SPI && ax->bus_type == SPI_SERIAL)
+        spidev_async_cancel(&ax->xfer);
+    ax->flags = int_flags;
+    ax->ss = NULL;
+    if (!rest_ticks)
         // End measurements
         return;
 
     // Start new measurements query
-    ax->rest_ticks = args[1];
+    ax->rest_ticks = rest_ticks;
     sensor_bulk_reset(&ax->sb);
+    if (CONFIG_WANT_SENSOR_SPECTRUM && ss) {
+        sensor_spectrum_reset(ss);
+        ax->ss = ss;
+    }
     lis2dw_reschedule_timer(ax);
 }
+
+void
+command_query_lis2dw(uint32_t *args)
+{
+    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
+    lis2dw_start(ax, args[1], NULL);
+}
 DECL_COMMAND(command_query_lis2dw, "query_lis2dw oid=%c rest_ticks=%u");
 
+#if CONFIG_WANT_SENSOR_SPECTRUM
+// Start measurements that are reported as vibration summaries
+void
+command_query_lis2dw_spectrum(uint32_t *args)
+{
+    struct lis2dw *ax = oid_lookup(args[0], command_config_lis2dw);
+    struct sensor_spectrum *ss = sensor_spectrum_oid_lookup(args[2]);
+    lis2dw_start(ax, args[1], ss);
+}
+DECL_COMMAND(command_query_lis2dw_spectrum,
+             "query_lis2dw_spectrum oid=%c rest_ticks=%u spectrum_oid=%c");
+#endif
+
 void
 command_query_lis2dw_status(uint32_t *args)
 {
@@ -255,7 +413,7 @@ lis2dw_task(void)
     foreach_oid(oid, ax, command_config_lis2dw) {
         uint_fast8_t flags = ax->flags;
         if (flags & LIS_PENDING)
-            lis2dw_query(ax, oid);
+            lis2dw_query(ax);
     }
 }
-DECL_TASK(lis2dw_task);
+DECL_WAKE_TASK(lis2dw_task, lis2dw_wake);
@@ -23,14 +23,18 @@
 #define FIFO_OVERFLOW_INT 0x10
 
 #define BYTES_PER_FIFO_ENTRY 6
-#define BYTES_PER_BLOCK 48
+// The fifo is read into full sensor_bulk_data messages (samples may
+// span two messages - see sensor_bulk_add_data())
+#define BYTES_PER_BLOCK SENSOR_BULK_DATA_SIZE
 
 struct mpu9250 {
     struct timer timer;
     uint32_t rest_ticks;
     struct i2cdev_s *i2c;
+    struct i2c_xfer xfer;
     uint16_t fifo_max, fifo_pkts_bytes;
-    uint8_t flags;
+    uint8_t oid, flags;
+    uint8_t fifo_status[2];
     struct sensor_bulk sb;
 };
 
@@ -38,7 +42,7 @@ enum {
     AX_PENDING = 1<<0,
 };
 
-static struct task_wake mpu9250_wake;
+DECL_TASK_WAKE(mpu9250_wake);
 
 // Event handler that wakes mpu9250_task() periodically
 static uint_fast8_t
@@ -57,6 +61,7 @@ command_config_mpu9250(uint32_t *args)
                                    , sizeof(*mp));
     mp->timer.func = mpu9250_event;
     mp->i2c = i2cdev_oid_lookup(args[1]);
+    mp->oid = args[0];
 }
 DECL_COMMAND(command_config_mpu9250, "config_mpu9250 oid=%c i2c_oid=%c");
 
@@ -78,44 +83,76 @@ read_mpu(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
     i2c_shutdown_on_err(ret);
 }
 
-// Reads the fifo byte count from the device.
+static uint8_t fifo_count_reg[] = {AR_FIFO_COUNT_H};
+static uint8_t fifo_reg[] = {AR_FIFO};
+
+// Decode the fifo byte count read from the device
 static uint16_t
-get_fifo_status(struct mpu9250 *mp)
+decode_fifo_status(struct mpu9250 *mp, uint8_t *msg)
 {
-    uint8_t reg[] = {AR_FIFO_COUNT_H};
-    uint8_t msg[2];
-    read_mpu(mp->i2c, sizeof(reg), reg, sizeof(msg), msg);
     uint16_t fifo_bytes = ((msg[0] & 0x1f) << 8) | msg[1];
     if (fifo_bytes > mp->fifo_max)
         mp->fifo_max = fifo_bytes;
     return fifo_bytes;
 }
 
-// Query accelerometer data
+static void mp9250_fifo_read_done(struct i2c_xfer *x, int ret);
+static void mp9250_fifo_status_done(struct i2c_xfer *x, int ret);
+
+// Start an asynchronous read of a block of the MPU FIFO
 static void
-mp9250_query(struct mpu9250 *mp, uint8_t oid)
+mp9250_read_fifo(struct mpu9250 *mp)
 {
-    // If not enough bytes to fill report read MPU FIFO's fill
-    if (mp->fifo_pkts_bytes < BYTES_PER_BLOCK)
-        mp->fifo_pkts_bytes = get_fifo_status(mp);
-
-    // If we have enough bytes to fill the buffer do it and send report
-    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
-        uint8_t reg = AR_FIFO;
-        read_mpu(mp->i2c, sizeof(reg), &reg, BYTES_PER_BLOCK, &mp->sb.data[0]);
-        mp->sb.data_count = BYTES_PER_BLOCK;
-        mp->fifo_pkts_bytes -= BYTES_PER_BLOCK;
-        sensor_bulk_report(&mp->sb, oid);
-    }
+    mp->xfer.callback = mp9250_fifo_read_done;
+    i2c_dev_read_async(mp->i2c, &mp->xfer, sizeof(fifo_reg), fifo_reg
+                       , BYTES_PER_BLOCK, &mp->sb.data[0]);
+}
 
-    // If we have enough bytes remaining to fill another report wake again
-    //  otherwise schedule timed wakeup
-    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK) {
-        sched_wake_task(&mpu9250_wake);
-    } else {
-        mp->flags &= ~AX_PENDING;
+// Read more data if available, otherwise schedule timed wakeup
+static void
+mp9250_query_next(struct mpu9250 *mp)
+{
+    if (mp->fifo_pkts_bytes >= BYTES_PER_BLOCK)
+        mp9250_read_fifo(mp);
+    else
         mp9250_reschedule_timer(mp);
+}
+
+static void
+mp9250_fifo_read_done(struct i2c_xfer *x, int ret)
+{
+    i2c_shutdown_on_err(ret);
+    struct mpu9250 *mp = container_of(x, struct mpu9250, xfer);
+    mp->sb.data_count = BYTES_PER_BLOCK;
+    mp->fifo_pkts_bytes -= BYTES_PER_BLOCK;
+    sensor_bulk_report(&mp->sb, mp->oid);
+    mp9250_query_next(mp);
+}
+
+static void
+mp9250_fifo_status_done(struct i2c_xfer *x, int ret)
+{
+    i2c_shutdown_on_err(ret);
+    struct mpu9250 *mp = container_of(x, struct mpu9250, xfer);
+    mp->fifo_pkts_bytes = decode_fifo_status(mp, mp->fifo_status);
+    mp9250_query_next(mp);
+}
+
+// Query accelerometer data
+static void
+mp9250_query(struct mpu9250 *mp)
+{
+    mp->flags &= ~AX_PENDING;
+
+    // If not enough bytes to fill report read MPU FIFO's fill
+    if (mp->fifo_pkts_bytes < BYTES_PER_BLOCK) {
+        mp->xfer.callback = mp9250_fifo_status_done;
+        i2c_dev_read_async(mp->i2c, &mp->xfer, sizeof(fifo_count_reg)
+                           , fifo_count_reg, sizeof(mp->fifo_status)
+                           , mp->fifo_status);
+        return;
     }
+    mp9250_read_fifo(mp);
 }
 
 void
@@ -124,6 +161,7 @@ command_query_mpu9250(uint32_t *args)
     struct mpu9250 *mp = oid_lookup(args[0], command_config_mpu9250);
 
     sched_del_timer(&mp->timer);
+    i2c_async_cancel(&mp->xfer);
     mp->flags = 0;
     if (!args[1]) {
         // End measurements
@@ -155,10 +193,10 @@ command_query_mpu9250_status(uint32_t *args)
         mp->sb.possible_overflows++;
 
     // Read latest FIFO count (with precise timing)
-    uint8_t reg[] = {AR_FIFO_COUNT_H};
     uint8_t msg[2];
     uint32_t time1 = timer_read_time();
-    read_mpu(mp->i2c, sizeof(reg), reg, sizeof(msg), msg);
+    read_mpu(mp->i2c, sizeof(fifo_count_reg), fifo_count_reg
+             , sizeof(msg), msg);
     uint32_t time2 = timer_read_time();
     uint16_t fifo_bytes = ((msg[0] & 0x1f) << 8) | msg[1];
 
@@ -177,7 +215,7 @@ mpu9250_task(void)
     foreach_oid(oid, mp, command_config_mpu9250) {
         uint_fast8_t flags = mp->flags;
         if (flags & AX_PENDING)
-            mp9250_query(mp, oid);
+            mp9250_query(mp);
     }
 }
-DECL_TASK(mpu9250_task);
+DECL_WAKE_TASK(mpu9250_task, mpu9250_wake);
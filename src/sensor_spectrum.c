@@ -0,0 +1,155 @@
+// Vibration summaries (rms and band energies) of accelerometer samples
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each block of 'sample_count' samples is reduced to the variance of
+// the samples (summed over all axes) and the energy at a few host
+// selected frequencies.  The energies are computed with Goertzel
+// filters using fixed-point coefficients (2*cos(2*pi*freq/rate)).
+// The mean of each block (initially the first sample) is subtracted
+// from the samples of the next block so that gravity does not leak
+// into the band energies.
+
+#include <string.h> // memcpy
+#include "basecmd.h" // oid_alloc
+#include "board/misc.h" // timer_read_time
+#include "command.h" // sendf_bulk
+#include "sched.h" // shutdown
+#include "sensor_spectrum.h" // sensor_spectrum_add_sample
+
+#define COEFF_BITS 14
+#define MAX_SAMPLES 1024
+
+DECL_CONSTANT("SENSOR_SPECTRUM_MAX_BANDS", SENSOR_SPECTRUM_MAX_BANDS);
+DECL_CONSTANT("SENSOR_SPECTRUM_MAX_SAMPLES", MAX_SAMPLES);
+
+void
+command_config_sensor_spectrum(uint32_t *args)
+{
+    uint_fast16_t sample_count = args[1];
+    if (!sample_count || sample_count > MAX_SAMPLES)
+        shutdown("Invalid sensor spectrum sample_count");
+    struct sensor_spectrum *ss = oid_alloc(
+        args[0], command_config_sensor_spectrum, sizeof(*ss));
+    ss->oid = args[0];
+    ss->sample_count = sample_count;
+}
+DECL_COMMAND(command_config_sensor_spectrum,
+             "config_sensor_spectrum oid=%c sample_count=%hu");
+
+struct sensor_spectrum *
+sensor_spectrum_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_sensor_spectrum);
+}
+
+void
+command_sensor_spectrum_set_band(uint32_t *args)
+{
+    struct sensor_spectrum *ss = sensor_spectrum_oid_lookup(args[0]);
+    uint_fast8_t band = args[1];
+    if (band >= SENSOR_SPECTRUM_MAX_BANDS)
+        shutdown("Invalid sensor spectrum band");
+    ss->bands[band].coeff = args[2];
+    if (band >= ss->band_count)
+        ss->band_count = band + 1;
+}
+DECL_COMMAND(command_sensor_spectrum_set_band,
+             "sensor_spectrum_set_band oid=%c band=%c coeff=%hi");
+
+// Clear the state of the current block
+static void
+spectrum_clear_block(struct sensor_spectrum *ss)
+{
+    ss->count = 0;
+    memset(ss->sum, 0, sizeof(ss->sum));
+    memset(ss->sumsq, 0, sizeof(ss->sumsq));
+    uint_fast8_t i;
+    for (i=0; i<ss->band_count; i++) {
+        struct spectrum_band *b = &ss->bands[i];
+        memset(b->s1, 0, sizeof(b->s1));
+        memset(b->s2, 0, sizeof(b->s2));
+    }
+}
+
+// Reset the summary state (at the start of new measurements)
+void
+sensor_spectrum_reset(struct sensor_spectrum *ss)
+{
+    ss->sequence = 0;
+    memset(ss->offset, 0, sizeof(ss->offset));
+    spectrum_clear_block(ss);
+}
+
+static uint8_t *
+put_u32(uint8_t *p, uint64_t v)
+{
+    if (v > 0xffffffff)
+        v = 0xffffffff;
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+// Report the variance and band energies of a completed block
+static void
+spectrum_report(struct sensor_spectrum *ss)
+{
+    uint32_t count = ss->count;
+    uint8_t data[(1 + SENSOR_SPECTRUM_MAX_BANDS) * 4], *p = data;
+    uint64_t var = 0;
+    uint_fast8_t i, j;
+    for (i=0; i<SENSOR_SPECTRUM_AXES; i++) {
+        int64_t sum = ss->sum[i];
+        var += ss->sumsq[i] - (uint64_t)(sum * sum / count);
+        ss->offset[i] += sum / (int32_t)count;
+    }
+    p = put_u32(p, var / count);
+    // The energy of each band is reported as the mean square of the
+    // signal at that frequency (2 * |X|^2 / count^2)
+    for (i=0; i<ss->band_count; i++) {
+        struct spectrum_band *b = &ss->bands[i];
+        int64_t power = 0;
+        for (j=0; j<SENSOR_SPECTRUM_AXES; j++) {
+            int64_t s1 = b->s1[j], s2 = b->s2[j];
+            power += s1 * s1 + s2 * s2 - ((s1 * b->coeff) >> COEFF_BITS) * s2;
+        }
+        if (power < 0)
+            power = 0;
+        p = put_u32(p, (uint64_t)power * 2 / (count * count));
+    }
+    sendf_bulk("sensor_spectrum_data oid=%c sequence=%hu clock=%u"
+               " data=%*s", ss->oid, ss->sequence, timer_read_time()
+               , p - data, data);
+    ss->sequence++;
+    spectrum_clear_block(ss);
+}
+
+// Add a sample (one value per axis) to the current block
+void
+sensor_spectrum_add_sample(struct sensor_spectrum *ss, int16_t *values)
+{
+    uint_fast8_t i, j;
+    if (!ss->count && !ss->sequence)
+        // Use the first sample as an initial estimate of the mean
+        memcpy(ss->offset, values, sizeof(ss->offset));
+    for (i=0; i<SENSOR_SPECTRUM_AXES; i++) {
+        int32_t x = values[i] - ss->offset[i];
+        ss->sum[i] += x;
+        ss->sumsq[i] += (int64_t)x * x;
+        for (j=0; j<ss->band_count; j++) {
+            struct spectrum_band *b = &ss->bands[j];
+            int32_t s1 = b->s1[i];
+            int32_t s = (x + (int32_t)(((int64_t)s1 * b->coeff) >> COEFF_BITS)
+                         - b->s2[i]);
+            b->s2[i] = s1;
+            b->s1[i] = s;
+        }
+    }
+    if (++ss->count >= ss->sample_count)
+        spectrum_report(ss);
+}
@@ -0,0 +1,27 @@
+#ifndef __SENSOR_SPECTRUM_H
+#define __SENSOR_SPECTRUM_H
+
+#include <stdint.h> // uint8_t
+
+#define SENSOR_SPECTRUM_AXES 3
+#define SENSOR_SPECTRUM_MAX_BANDS 4
+
+struct spectrum_band {
+    int16_t coeff;
+    int32_t s1[SENSOR_SPECTRUM_AXES], s2[SENSOR_SPECTRUM_AXES];
+};
+
+struct sensor_spectrum {
+    uint16_t sample_count, count, sequence;
+    uint8_t oid, band_count;
+    int16_t offset[SENSOR_SPECTRUM_AXES];
+    int32_t sum[SENSOR_SPECTRUM_AXES];
+    uint64_t sumsq[SENSOR_SPECTRUM_AXES];
+    struct spectrum_band bands[SENSOR_SPECTRUM_MAX_BANDS];
+};
+
+struct sensor_spectrum *sensor_spectrum_oid_lookup(uint8_t oid);
+void sensor_spectrum_reset(struct sensor_spectrum *ss);
+void sensor_spectrum_add_sample(struct sensor_spectrum *ss, int16_t *values);
+
+#endif // sensor_spectrum.h
@@ -0,0 +1,220 @@
+// Periodic sampling of tmc stepper driver load (StallGuard) registers
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_WANT_GPIO_BITBANGING
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_report
+#include "spicmds.h" // spidev_transfer
+#include "tmcuart.h" // tmcuart_poll_send
+
+struct tmc_sample {
+    struct timer timer;
+    uint32_t rest_ticks;
+    struct sensor_bulk sb;
+    struct tmcuart_s *tu;
+    struct spidev_s *spi;
+    uint8_t flags, state, reg, request_len, value_pos;
+    uint8_t request[40];
+};
+
+enum { TS_PENDING = 1<<0 };
+enum { TSS_BUSY = 1<<0 };
+
+#define BYTES_PER_SAMPLE 4
+#define SAMPLE_ERROR 0xffffffff
+
+DECL_TASK_WAKE(tmc_sample_wake);
+
+// Timer that requests a new register read
+static uint_fast8_t
+tmc_sample_event(struct timer *timer)
+{
+    struct tmc_sample *ts = container_of(timer, struct tmc_sample, timer);
+    if (ts->flags & TS_PENDING) {
+        // The previous read has not completed
+        ts->sb.possible_overflows++;
+    } else {
+        ts->flags = TS_PENDING;
+        sched_wake_task(&tmc_sample_wake);
+    }
+    ts->timer.waketime += ts->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_tmc_sample(uint32_t *args)
+{
+    struct tmc_sample *ts = oid_alloc(args[0], command_config_tmc_sample
+                                      , sizeof(*ts));
+    ts->timer.func = tmc_sample_event;
+}
+DECL_COMMAND(command_config_tmc_sample, "config_tmc_sample oid=%c");
+
+static struct tmc_sample *
+tmc_sample_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_tmc_sample);
+}
+
+// Store the request message sent to the driver on each sample
+static void
+tmc_sample_set_request(struct tmc_sample *ts, uint8_t len, uint8_t *request)
+{
+    if (len > sizeof(ts->request))
+        shutdown("tmc sample request too large");
+    ts->request_len = len;
+    memcpy(ts->request, request, len);
+}
+
+#if CONFIG_WANT_GPIO_BITBANGING
+void
+command_tmc_sample_set_uart(uint32_t *args)
+{
+    struct tmc_sample *ts = tmc_sample_oid_lookup(args[0]);
+    ts->tu = tmcuart_oid_lookup(args[1]);
+    ts->reg = args[2];
+    tmc_sample_set_request(ts, args[3], command_decode_ptr(args[4]));
+}
+DECL_COMMAND(command_tmc_sample_set_uart,
+             "tmc_sample_set_uart oid=%c tmcuart_oid=%c reg=%c request=%*s");
+#endif
+
+#if CONFIG_HAVE_GPIO_SPI
+void
+command_tmc_sample_set_spi(uint32_t *args)
+{
+    struct tmc_sample *ts = tmc_sample_oid_lookup(args[0]);
+    ts->spi = spidev_oid_lookup(args[1]);
+    tmc_sample_set_request(ts, args[2], command_decode_ptr(args[3]));
+    ts->value_pos = args[4];
+    if (ts->value_pos + BYTES_PER_SAMPLE > ts->request_len)
+        shutdown("Invalid tmc sample value position");
+}
+DECL_COMMAND(command_tmc_sample_set_spi,
+             "tmc_sample_set_spi oid=%c spi_oid=%c request=%*s value_pos=%c");
+#endif
+
+// Start/stop sampling
+void
+command_query_tmc_sample(uint32_t *args)
+{
+    struct tmc_sample *ts = tmc_sample_oid_lookup(args[0]);
+    if (!ts->tu && !ts->spi)
+        shutdown("tmc sample bus not configured");
+    sched_del_timer(&ts->timer);
+    ts->flags = 0;
+    ts->rest_ticks = args[1];
+    if (!ts->rest_ticks)
+        // End measurements
+        return;
+    // Start new measurements
+    sensor_bulk_reset(&ts->sb);
+    irq_disable();
+    ts->timer.waketime = timer_read_time() + ts->rest_ticks;
+    sched_add_timer(&ts->timer);
+    irq_enable();
+}
+DECL_COMMAND(command_query_tmc_sample, "query_tmc_sample oid=%c rest_ticks=%u");
+
+void
+command_query_tmc_sample_status(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct tmc_sample *ts = tmc_sample_oid_lookup(oid);
+    irq_disable();
+    uint32_t time = timer_read_time();
+    uint8_t pending = ts->flags & TS_PENDING;
+    irq_enable();
+    sensor_bulk_status(&ts->sb, oid, time, 0, pending ? BYTES_PER_SAMPLE : 0);
+}
+DECL_COMMAND(command_query_tmc_sample_status, "query_tmc_sample_status oid=%c");
+
+// Add a register value (or an error indicator) to the report buffer
+static void
+tmc_sample_add(struct tmc_sample *ts, uint8_t oid, uint32_t value)
+{
+    irq_disable();
+    uint8_t flags = ts->flags;
+    ts->flags = 0;
+    irq_enable();
+    if (!(flags & TS_PENDING))
+        // Sampling was restarted while a read was in progress
+        return;
+    uint8_t *d = &ts->sb.data[ts->sb.data_count];
+    d[0] = value;
+    d[1] = value >> 8;
+    d[2] = value >> 16;
+    d[3] = value >> 24;
+    ts->sb.data_count += BYTES_PER_SAMPLE;
+    if (ts->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ts->sb.data))
+        sensor_bulk_report(&ts->sb, oid);
+}
+
+// Read the register over a tmcuart (the transfer runs in the background)
+static void
+tmc_sample_uart(struct tmc_sample *ts, uint8_t oid)
+{
+    if (ts->state & TSS_BUSY) {
+        uint8_t *data;
+        int ret = tmcuart_poll_check(ts->tu, &data);
+        if (!ret)
+            // Transfer still in progress
+            return;
+        ts->state &= ~TSS_BUSY;
+        uint32_t value;
+        if (ret < 0 || !data || tmcuart_decode_read(ts->reg, data, &value))
+            value = SAMPLE_ERROR;
+        tmc_sample_add(ts, oid, value);
+        return;
+    }
+    if (!(ts->flags & TS_PENDING))
+        return;
+    if (tmcuart_poll_send(ts->tu, ts->request_len, ts->request, 10
+                          , &tmc_sample_wake)) {
+        // Uart is in use by the host - report a missed sample
+        tmc_sample_add(ts, oid, SAMPLE_ERROR);
+        return;
+    }
+    ts->state |= TSS_BUSY;
+}
+
+// Read the register over spi (the value is in the second response)
+static void
+tmc_sample_spi(struct tmc_sample *ts, uint8_t oid)
+{
+    if (!(ts->flags & TS_PENDING))
+        return;
+    uint8_t msg[sizeof(ts->request)];
+    memcpy(msg, ts->request, ts->request_len);
+    spidev_transfer(ts->spi, 0, ts->request_len, msg);
+    memcpy(msg, ts->request, ts->request_len);
+    spidev_transfer(ts->spi, 1, ts->request_len, msg);
+    uint8_t *d = &msg[ts->value_pos];
+    uint32_t value = ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16)
+                     | (d[2] << 8) | d[3];
+    tmc_sample_add(ts, oid, value);
+}
+
+void
+tmc_sample_task(void)
+{
+    if (!sched_check_wake(&tmc_sample_wake))
+        return;
+    uint8_t oid;
+    struct tmc_sample *ts;
+    foreach_oid(oid, ts, command_config_tmc_sample) {
+        if (CONFIG_WANT_GPIO_BITBANGING && ts->tu)
+            tmc_sample_uart(ts, oid);
+        else if (CONFIG_HAVE_GPIO_SPI && ts->spi)
+            tmc_sample_spi(ts, oid);
+    }
+}
+DECL_WAKE_TASK(tmc_sample_task, tmc_sample_wake);
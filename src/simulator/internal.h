@@ -0,0 +1,14 @@
+#ifndef __SIMU_INTERNAL_H
+#define __SIMU_INTERNAL_H
+// Local definitions for the host simulator
+
+#include <stdint.h> // uint32_t
+
+// timer.c
+void timer_bench_setup(double scale);
+
+// serial.c
+int replay_setup(const char *filename, uint32_t start_clock);
+int replay_poll(void);
+
+#endif // internal.h
@@ -1,15 +1,50 @@
 // Main starting point for host simulator.
 //
-// Copyright (C) 2016-2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <stdio.h> // fprintf
+#include <stdlib.h> // strtoul
+#include <unistd.h> // getopt
+#include "internal.h" // replay_setup
 #include "sched.h" // sched_main
 
 // Main entry point for simulator.
 int
-main(void)
+main(int argc, char **argv)
 {
+    // Parse program args
+    int opt;
+    char *replay = NULL;
+    uint32_t start_clock = 0;
+    double scale = 1.;
+    while ((opt = getopt(argc, argv, "i:c:m:")) != -1) {
+        switch (opt) {
+        case 'i':
+            replay = optarg;
+            break;
+        case 'c':
+            start_clock = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            scale = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i replay_file [-c start_clock]"
+                    " [-m scale]]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // Run a benchmark from recorded host data
+    if (replay) {
+        int ret = replay_setup(replay, start_clock);
+        if (ret)
+            return ret;
+        timer_bench_setup(scale);
+    }
+
     sched_main();
     return 0;
 }
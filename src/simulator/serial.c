@@ -1,17 +1,190 @@
 // Example code for interacting with serial_irq.c
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <fcntl.h> // fcntl
+#include <stdio.h> // fprintf
+#include <stdlib.h> // exit
+#include <string.h> // memmove
 #include <unistd.h> // STDIN_FILENO
+#include "autoconf.h" // CONFIG_SCHED_PROFILE
+#include "basecmd.h" // move_free_slots
+#include "board/misc.h" // crc16_ccitt
 #include "board/serial_irq.h" // serial_get_tx_byte
+#include "command.h" // MESSAGE_MAX
+#include "internal.h" // replay_poll
 #include "sched.h" // DECL_INIT
 
+
+/****************************************************************
+ * Replay of recorded host data
+ ****************************************************************/
+
+// Free move queue slots required before delivering another block
+#define REPLAY_MOVE_RESERVE (MESSAGE_PAYLOAD_MAX / 4)
+// Time to keep running after the last move is released
+#define REPLAY_DRAIN_US 1000000
+
+static int replay_fd = -1;
+static uint8_t replay_buf[4096];
+static uint16_t replay_pos, replay_len;
+static uint8_t replay_started, replay_seq, replay_wait_ack, replay_eof;
+static uint8_t replay_draining;
+static uint32_t replay_start_time, replay_end_time;
+static uint8_t tx_frame[MESSAGE_MAX], tx_frame_pos;
+static uint8_t replay_out[64*1024];
+static uint32_t replay_out_len;
+
+// Replay the message blocks of a "klippy -o" output file (starting
+// when the clock, which starts at zero, reaches start_clock)
+int
+replay_setup(const char *filename, uint32_t start_clock)
+{
+    replay_start_time = start_clock;
+    replay_fd = open(filename, O_RDONLY);
+    if (replay_fd < 0) {
+        fprintf(stderr, "Unable to open replay file '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Write out buffered tx data (system calls are slow compared to
+// the emulated code)
+static void
+replay_flush(void)
+{
+    uint8_t *p = replay_out, *end = &replay_out[replay_out_len];
+    while (p < end) {
+        int ret = write(STDOUT_FILENO, p, end - p);
+        if (ret <= 0)
+            break;
+        p += ret;
+    }
+    replay_out_len = 0;
+}
+
+// Locate the next message block in the replay data (returns its length)
+static uint_fast8_t
+replay_next_block(void)
+{
+    for (;;) {
+        uint_fast16_t avail = replay_len - replay_pos;
+        if (avail < MESSAGE_MAX && !replay_eof) {
+            memmove(replay_buf, &replay_buf[replay_pos], avail);
+            replay_len = avail;
+            replay_pos = 0;
+            int ret = read(replay_fd, &replay_buf[avail]
+                           , sizeof(replay_buf) - avail);
+            if (ret <= 0)
+                replay_eof = 1;
+            else
+                replay_len += ret;
+            avail = replay_len;
+        }
+        if (!avail)
+            return 0;
+        uint8_t *buf = &replay_buf[replay_pos];
+        uint_fast8_t len = buf[MESSAGE_POS_LEN];
+        if (len >= MESSAGE_MIN && len <= MESSAGE_MAX && len <= avail
+            && buf[len - MESSAGE_TRAILER_SYNC] == MESSAGE_SYNC)
+            return len;
+        // Not the start of a message block - skip a byte
+        replay_pos++;
+    }
+}
+
+// Report the collected profile once all replayed moves are complete
+static void
+replay_check_done(void)
+{
+    uint16_t count, free = move_free_slots(&count);
+    if (free < count && !sched_is_shutdown()) {
+        replay_draining = 0;
+        return;
+    }
+    uint32_t now = timer_read_time();
+    if (!replay_draining) {
+        replay_draining = 1;
+        replay_end_time = now + timer_from_us(REPLAY_DRAIN_US);
+        return;
+    }
+    if (timer_is_before(now, replay_end_time))
+        return;
+    if (CONFIG_SCHED_PROFILE)
+        command_get_profile(NULL);
+    replay_flush();
+    exit(0);
+}
+
+// Deliver the next replayed message block - returns 1 if it was
+// delivered to the command parser
+int
+replay_poll(void)
+{
+    if (replay_fd < 0 || replay_wait_ack)
+        return 0;
+    if (!replay_started) {
+        if (timer_read_time() < replay_start_time)
+            return 0;
+        replay_started = 1;
+    }
+    uint_fast8_t len = replay_next_block();
+    if (!len) {
+        replay_check_done();
+        return 0;
+    }
+    uint16_t count, free = move_free_slots(&count);
+    if (count && free < REPLAY_MOVE_RESERVE && !sched_is_shutdown())
+        // Wait for the move queue to drain (as the host would)
+        return 0;
+
+    // The host output starts at an arbitrary sequence number
+    uint8_t *buf = &replay_buf[replay_pos];
+    buf[MESSAGE_POS_SEQ] = ((buf[MESSAGE_POS_SEQ] & ~MESSAGE_SEQ_MASK)
+                            | replay_seq);
+    uint16_t crc = crc16_ccitt(buf, len - MESSAGE_TRAILER_SIZE);
+    buf[len - MESSAGE_TRAILER_CRC] = crc >> 8;
+    buf[len - MESSAGE_TRAILER_CRC + 1] = crc;
+    uint_fast8_t i;
+    for (i=0; i<len; i++)
+        serial_rx_byte(buf[i]);
+    replay_pos += len;
+    replay_seq = (replay_seq + 1) & MESSAGE_SEQ_MASK;
+    replay_wait_ack = 1;
+    return 1;
+}
+
+// Buffer tx data and check it for the acknowledgment of a delivered block
+static void
+replay_tx(uint8_t data)
+{
+    if (replay_out_len >= sizeof(replay_out))
+        replay_flush();
+    replay_out[replay_out_len++] = data;
+    if (!tx_frame_pos && (data < MESSAGE_MIN || data > MESSAGE_MAX))
+        return;
+    tx_frame[tx_frame_pos++] = data;
+    if (tx_frame_pos < tx_frame[MESSAGE_POS_LEN])
+        return;
+    if ((tx_frame[MESSAGE_POS_SEQ] & MESSAGE_SEQ_MASK) == replay_seq)
+        replay_wait_ack = 0;
+    tx_frame_pos = 0;
+}
+
+
+/****************************************************************
+ * Serial port
+ ****************************************************************/
+
 void
 serial_init(void)
 {
+    if (replay_fd >= 0)
+        // Don't drop output data when replaying
+        return;
     // Make stdin/stdout non-blocking
     fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL, 0) | O_NONBLOCK);
     fcntl(STDOUT_FILENO, F_SETFL
@@ -33,6 +206,8 @@ do_uart(void)
         int ret = serial_get_tx_byte(&data);
         if (ret)
             break;
+        else if (replay_fd >= 0)
+            replay_tx(data);
         else
             write(STDOUT_FILENO, &data, sizeof(data));
 
@@ -1,6 +1,6 @@
 // Example code for running timers in a polling mode
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -11,6 +11,7 @@
 #include "board/misc.h" // timer_from_us
 #include "board/timer_irq.h" // timer_dispatch_many
 #include "command.h" // DECL_CONSTANT
+#include "internal.h" // replay_poll
 #include "sched.h" // DECL_INIT
 
 // Helper function that returns the system time as a 32bit counter
@@ -24,6 +25,65 @@ get_system_time(void)
 }
 
 
+/****************************************************************
+ * Benchmark clock
+ ****************************************************************/
+
+// In benchmark mode the clock only advances by the (scaled) cpu time
+// used by the firmware, and skips ahead to the next timer when idle.
+#define BENCH_CALIBRATE 10000
+// Host scheduling glitches can charge large delays to the process -
+// limit the cpu time counted between any two clock reads
+#define BENCH_MAX_NS 20000
+
+static uint8_t bench_mode;
+static uint32_t bench_time;
+static uint64_t bench_cpu_ns;
+static double bench_ticks_per_ns, bench_frac, bench_read_ns;
+
+static uint64_t
+get_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+bench_read_time(void)
+{
+    // Don't count the time spent reading the cpu clock itself
+    uint64_t ns = get_cpu_ns();
+    double used = (double)(ns - bench_cpu_ns) - bench_read_ns;
+    bench_cpu_ns = ns;
+    if (used <= 0.)
+        return bench_time;
+    if (used > BENCH_MAX_NS)
+        used = BENCH_MAX_NS;
+    double ticks = used * bench_ticks_per_ns + bench_frac;
+    uint32_t whole = ticks;
+    bench_frac = ticks - whole;
+    bench_time += whole;
+    return bench_time;
+}
+
+// Enable the benchmark clock - 'scale' is how many times slower the
+// emulated micro-controller runs code than the host
+void
+timer_bench_setup(double scale)
+{
+    bench_mode = 1;
+    bench_ticks_per_ns = CONFIG_CLOCK_FREQ * scale / 1000000000.;
+    // Calibrate the overhead of reading the cpu clock
+    int i;
+    uint64_t start = get_cpu_ns();
+    for (i=0; i<BENCH_CALIBRATE; i++)
+        get_cpu_ns();
+    bench_read_ns = (double)(get_cpu_ns() - start) / (BENCH_CALIBRATE + 1);
+    bench_cpu_ns = get_cpu_ns();
+}
+
+
 /****************************************************************
  * Timers
  ****************************************************************/
@@ -34,6 +94,8 @@ static uint32_t next_wake_time;
 uint32_t
 timer_read_time(void)
 {
+    if (bench_mode)
+        return bench_read_time();
     return get_system_time();
 }
 
@@ -92,8 +154,17 @@ irq_restore(irqstatus_t flag)
 void
 irq_wait(void)
 {
-    // XXX - sleep to prevent excessive cpu usage in simulator
-    usleep(1);
+    if (bench_mode) {
+        // Jump to the next timer unless there is new input to process
+        if (!replay_poll()) {
+            uint32_t now = bench_read_time();
+            if (timer_is_before(now, next_wake_time))
+                bench_time = next_wake_time;
+        }
+    } else {
+        // XXX - sleep to prevent excessive cpu usage in simulator
+        usleep(1);
+    }
 
     irq_poll();
 }
@@ -103,6 +174,8 @@ irq_wait(void)
 void
 irq_poll(void)
 {
+    if (bench_mode)
+        replay_poll();
     uint32_t now = timer_read_time();
     if (!timer_is_before(now, next_wake_time))
         do_timer_dispatch();
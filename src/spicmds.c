@@ -1,12 +1,13 @@
 // Commands for sending messages on an SPI bus
 //
-// Copyright (C) 2016-2019  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
 #include "autoconf.h" // CONFIG_WANT_SOFTWARE_SPI
 #include "board/gpio.h" // gpio_out_write
+#include "board/io.h" // readb
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_SHUTDOWN
@@ -83,10 +84,13 @@ spidev_get_cs_pin(struct spidev_s *spi)
     return spi->pin;
 }
 
+static void spidev_async_wait(void);
+
 void
 spidev_transfer(struct spidev_s *spi, uint8_t receive_data
                 , uint8_t data_len, uint8_t *data)
 {
+    spidev_async_wait();
     uint_fast8_t flags = spi->flags;
     if (!(flags & (SF_SOFTWARE|SF_HARDWARE)))
         // Not yet initialized
@@ -109,6 +113,28 @@ spidev_transfer(struct spidev_s *spi, uint8_t receive_data
         gpio_out_write(spi->pin, !(flags & SF_CS_ACTIVE_HIGH));
 }
 
+// Run 'count' transfers of 'data_len' bytes each (the chip select is
+// released between each transfer)
+void
+spidev_transfer_batch(struct spidev_s *spi, uint8_t receive_data
+                      , uint8_t count, uint8_t data_len, uint8_t *data)
+{
+    uint_fast8_t flags = spi->flags;
+    if (CONFIG_HAVE_GPIO_SPI_BATCH && count > 1
+        && (flags & (SF_HARDWARE|SF_HAVE_PIN)) == SF_HARDWARE) {
+        // The board can submit all the transfers at once
+        spidev_async_wait();
+        spi_prepare(spi->spi_config);
+        spi_transfer_batch(spi->spi_config, receive_data, count, data_len
+                           , data);
+        return;
+    }
+    while (count--) {
+        spidev_transfer(spi, receive_data, data_len, data);
+        data += data_len;
+    }
+}
+
 void
 command_spi_transfer(uint32_t *args)
 {
@@ -132,6 +158,160 @@ command_spi_send(uint32_t *args)
 DECL_COMMAND(command_spi_send, "spi_send oid=%c data=%*s");
 
 
+/****************************************************************
+ * Asynchronous transfers
+ ****************************************************************/
+
+// Asynchronous transfers are queued and run one at a time.  If the
+// board supports dma transfers (CONFIG_GPIO_SPI_ASYNC) then hardware
+// busses are started with spi_async_start() and spi_async_done() is
+// called (from irq context) on completion.  Otherwise the transfer
+// is run from spi_async_task().  A batch of several transfers (of
+// the same length) runs each transfer in turn.  The transfer's
+// callback is always invoked from task context.
+
+static struct spi_xfer *xfer_first, **xfer_lastp = &xfer_first;
+
+DECL_TASK_WAKE(spi_async_wake);
+
+// Queue a batch of 'count' transfers of 'data_len' bytes each -
+// x->callback is invoked once all the transfers complete
+void
+spidev_transfer_async_batch(struct spidev_s *spi, struct spi_xfer *x
+                            , uint8_t receive_data, uint8_t count
+                            , uint8_t data_len, uint8_t *data)
+{
+    if (x->flags & SXF_QUEUED)
+        shutdown("spi transfer already queued");
+    if (!count)
+        shutdown("Invalid spi transfer batch");
+    x->spi = spi;
+    x->data_len = data_len;
+    x->count = count;
+    x->data = data;
+    x->flags = (receive_data ? SXF_RECEIVE : 0) | SXF_QUEUED;
+    x->next = NULL;
+    *xfer_lastp = x;
+    xfer_lastp = &x->next;
+    sched_wake_task(&spi_async_wake);
+}
+
+// Queue a transfer - x->callback is invoked on completion
+void
+spidev_transfer_async(struct spidev_s *spi, struct spi_xfer *x
+                      , uint8_t receive_data, uint8_t data_len
+                      , uint8_t *data)
+{
+    spidev_transfer_async_batch(spi, x, receive_data, 1, data_len, data);
+}
+
+// Note completion of a transfer started with spi_async_start()
+void
+spi_async_done(struct spi_xfer *x)
+{
+    writeb(&x->flags, x->flags | SXF_DONE);
+    sched_wake_task(&spi_async_wake);
+}
+
+// Release the chip select of a completed dma transfer
+static void
+spidev_async_release(struct spi_xfer *x)
+{
+    struct spidev_s *spi = x->spi;
+    if (spi->flags & SF_HAVE_PIN)
+        gpio_out_write(spi->pin, !(spi->flags & SF_CS_ACTIVE_HIGH));
+}
+
+// Wait for an in progress dma transfer to complete
+static void
+spidev_async_wait(void)
+{
+    struct spi_xfer *x = xfer_first;
+    if (!CONFIG_GPIO_SPI_ASYNC || !x || !(x->flags & SXF_ACTIVE))
+        return;
+    // Poll the hardware as this may be called with irqs disabled
+    while (!(readb(&x->flags) & SXF_DONE))
+        spi_async_poll(x->spi->spi_config, x);
+    spidev_async_release(x);
+}
+
+// Remove a transfer from the queue (its callback will not be invoked)
+void
+spidev_async_cancel(struct spi_xfer *x)
+{
+    if (!(x->flags & SXF_QUEUED))
+        return;
+    spidev_async_wait();
+    struct spi_xfer **pprev = &xfer_first;
+    while (*pprev != x)
+        pprev = &(*pprev)->next;
+    *pprev = x->next;
+    if (xfer_lastp == &x->next)
+        xfer_lastp = pprev;
+    x->flags = 0;
+    sched_wake_task(&spi_async_wake);
+}
+
+// Try to start a dma transfer - returns 0 on success
+static int
+spidev_async_start(struct spi_xfer *x)
+{
+    struct spidev_s *spi = x->spi;
+    uint_fast8_t flags = spi->flags;
+    if (!CONFIG_GPIO_SPI_ASYNC || !(flags & SF_HARDWARE))
+        return -1;
+    spi_prepare(spi->spi_config);
+    if (flags & SF_HAVE_PIN)
+        gpio_out_write(spi->pin, !!(flags & SF_CS_ACTIVE_HIGH));
+    x->flags |= SXF_ACTIVE;
+    int ret = spi_async_start(spi->spi_config, x);
+    if (ret) {
+        x->flags &= ~SXF_ACTIVE;
+        spidev_async_release(x);
+    }
+    return ret;
+}
+
+void
+spi_async_task(void)
+{
+    if (!sched_check_wake(&spi_async_wake))
+        return;
+    struct spi_xfer *x = xfer_first;
+    if (!x)
+        return;
+    uint_fast8_t flags = readb(&x->flags);
+    if (flags & SXF_ACTIVE) {
+        if (!(flags & SXF_DONE))
+            // Dma transfer still in progress
+            return;
+        spidev_async_release(x);
+        if (--x->count) {
+            // Start next transfer of the batch
+            x->data += x->data_len;
+            x->flags = flags & ~(SXF_ACTIVE | SXF_DONE);
+            sched_wake_task(&spi_async_wake);
+            return;
+        }
+    } else if (!spidev_async_start(x)) {
+        return;
+    } else {
+        spidev_transfer_batch(x->spi, flags & SXF_RECEIVE, x->count
+                              , x->data_len, x->data);
+    }
+
+    // Transfer complete - remove from queue and invoke callback
+    xfer_first = x->next;
+    if (!xfer_first)
+        xfer_lastp = &xfer_first;
+    x->flags = 0;
+    x->callback(x);
+    if (xfer_first)
+        sched_wake_task(&spi_async_wake);
+}
+DECL_WAKE_TASK(spi_async_task, spi_async_wake);
+
+
 /****************************************************************
  * Shutdown handling
  ****************************************************************/
@@ -161,6 +341,12 @@ void
 spidev_shutdown(void)
 {
     // Cancel any transmissions that may be in progress
+    spidev_async_wait();
+    struct spi_xfer *x;
+    for (x = xfer_first; x; x = x->next)
+        x->flags = 0;
+    xfer_first = NULL;
+    xfer_lastp = &xfer_first;
     uint8_t oid;
     struct spidev_s *spi;
     foreach_oid(oid, spi, command_config_spi) {
@@ -2,6 +2,7 @@
 #define __SPICMDS_H
 
 #include <stdint.h> // uint8_t
+#include "board/gpio.h" // spi_config
 
 struct spidev_s *spidev_oid_lookup(uint8_t oid);
 struct spi_software;
@@ -10,5 +11,37 @@ int spidev_have_cs_pin(struct spidev_s *spi);
 struct gpio_out spidev_get_cs_pin(struct spidev_s *spi);
 void spidev_transfer(struct spidev_s *spi, uint8_t receive_data
                      , uint8_t data_len, uint8_t *data);
+void spidev_transfer_batch(struct spidev_s *spi, uint8_t receive_data
+                           , uint8_t count, uint8_t data_len, uint8_t *data);
+
+// Asynchronous spi transfer (see spidev_transfer_async())
+struct spi_xfer {
+    struct spi_xfer *next;
+    struct spidev_s *spi;
+    void (*callback)(struct spi_xfer *x);
+    uint8_t *data;
+    uint8_t data_len, count, flags;
+};
+
+enum {
+    SXF_RECEIVE = 1<<0, SXF_QUEUED = 1<<1, SXF_ACTIVE = 1<<2, SXF_DONE = 1<<3,
+};
+
+void spidev_transfer_async(struct spidev_s *spi, struct spi_xfer *x
+                           , uint8_t receive_data, uint8_t data_len
+                           , uint8_t *data);
+void spidev_transfer_async_batch(struct spidev_s *spi, struct spi_xfer *x
+                                 , uint8_t receive_data, uint8_t count
+                                 , uint8_t data_len, uint8_t *data);
+void spidev_async_cancel(struct spi_xfer *x);
+void spi_async_done(struct spi_xfer *x);
+
+// Board code (if CONFIG_GPIO_SPI_ASYNC)
+int spi_async_start(struct spi_config config, struct spi_xfer *x);
+void spi_async_poll(struct spi_config config, struct spi_xfer *x);
+
+// Board code (if CONFIG_HAVE_GPIO_SPI_BATCH)
+void spi_transfer_batch(struct spi_config config, uint8_t receive_data
+                        , uint8_t count, uint8_t len, uint8_t *data);
 
 #endif // spicmds.h
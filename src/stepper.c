@@ -1,6 +1,6 @@
 // Handling of stepper drivers.
 //
-// Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2016-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
@@ -29,26 +29,57 @@
  #define HAVE_AVR_OPTIMIZATION 0
 #endif
 
+#if CONFIG_WANT_STEPPER_ADD2
+ DECL_CONSTANT("STEPPER_ADD2", 1);
+#endif
+DECL_CONSTANT("STEPPER_STEP_DIR", 1);
+
 struct stepper_move {
     struct move_node node;
     uint32_t interval;
     int16_t add;
     uint16_t count;
     uint8_t flags;
+#if CONFIG_WANT_STEPPER_ADD2
+    int16_t add2;
+#endif
 };
 
 enum { MF_DIR=1<<0 };
 
+// Set the 'add2' term of a move (only stored with CONFIG_WANT_STEPPER_ADD2)
+static inline void
+stepper_move_set_add2(struct stepper_move *m, int16_t add2)
+{
+#if CONFIG_WANT_STEPPER_ADD2
+    m->add2 = add2;
+#endif
+}
+
+// Additional step and dir pins of a stepper group
+struct stepper_member {
+    struct stepper_member *next;
+    struct gpio_out step_pin, dir_pin;
+    uint8_t invert_step, invert_dir;
+};
+
 struct stepper {
     struct timer time;
     uint32_t interval;
     int16_t add;
+#if CONFIG_WANT_STEPPER_ADD2
+    int16_t add2;
+#endif
     uint32_t count;
     uint32_t next_step_time, step_pulse_ticks;
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
     struct move_queue_head mq;
     struct trsync_signal stop_signal;
+    struct stepper_member *members;
+#if CONFIG_STEPPER_TIMER
+    struct step_timer *hw;
+#endif
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
@@ -57,11 +88,36 @@ enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_NEED_RESET=1<<3,
-    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5
+    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5, SF_HW_TIMER=1<<6, SF_HW_ACTIVE=1<<7
 };
 
+uint_fast8_t stepper_event_full(struct timer *t);
+#if CONFIG_WANT_STEPPER_ADD2
+static uint_fast8_t stepper_event_add2(struct timer *t);
+#endif
+
+// Toggle the step pin of a stepper (and the other steppers in its group)
+static inline void
+stepper_toggle_step(struct stepper *s)
+{
+    gpio_out_toggle_noirq(s->step_pin);
+    struct stepper_member *m;
+    for (m = s->members; m; m = m->next)
+        gpio_out_toggle_noirq(m->step_pin);
+}
+
+// Toggle the dir pin of a stepper (and the other steppers in its group)
+static void
+stepper_toggle_dir(struct stepper *s)
+{
+    gpio_out_toggle_noirq(s->dir_pin);
+    struct stepper_member *m;
+    for (m = s->members; m; m = m->next)
+        gpio_out_toggle_noirq(m->dir_pin);
+}
+
 // Setup a stepper for the next move in its queue
-static uint_fast8_t
+static uint_fast8_t __hot_ram
 stepper_load_next(struct stepper *s)
 {
     if (move_queue_empty(&s->mq)) {
@@ -75,7 +131,24 @@ stepper_load_next(struct stepper *s)
     struct stepper_move *m = container_of(mn, struct stepper_move, node);
     s->add = m->add;
     s->interval = m->interval + m->add;
-    if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED) {
+#if CONFIG_WANT_STEPPER_ADD2
+    if (!(HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)) {
+        // Select the step function for this move (see stepper_event_add2)
+        s->add2 = m->add2;
+        if (m->add2) {
+            s->add += m->add2;
+            s->time.func = stepper_event_add2;
+        } else {
+            s->time.func = (CONFIG_INLINE_STEPPER_HACK && !HAVE_SINGLE_SCHEDULE
+                            ? NULL : stepper_event_full);
+        }
+    }
+#endif
+    if (CONFIG_STEPPER_TIMER && s->flags & SF_HW_TIMER) {
+        // Step times are generated by stepper_timer_fill()
+        s->next_step_time += m->interval;
+        s->count = m->count;
+    } else if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED) {
         s->time.waketime += m->interval;
         if (HAVE_AVR_OPTIMIZATION)
             s->flags = m->add ? s->flags|SF_HAVE_ADD : s->flags & ~SF_HAVE_ADD;
@@ -90,7 +163,7 @@ stepper_load_next(struct stepper *s)
     // Add all steps to s->position (stepper_get_position() can calc mid-move)
     if (m->flags & MF_DIR) {
         s->position = -s->position + m->count;
-        gpio_out_toggle_noirq(s->dir_pin);
+        stepper_toggle_dir(s);
     } else {
         s->position += m->count;
     }
@@ -100,11 +173,11 @@ stepper_load_next(struct stepper *s)
 }
 
 // Optimized step function to step on each step pin edge
-uint_fast8_t
+uint_fast8_t __hot_ram
 stepper_event_edge(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
-    gpio_out_toggle_noirq(s->step_pin);
+    stepper_toggle_step(s);
     uint32_t count = s->count - 1;
     if (likely(count)) {
         s->count = count;
@@ -122,27 +195,27 @@ static uint_fast8_t
 stepper_event_avr(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
-    gpio_out_toggle_noirq(s->step_pin);
+    stepper_toggle_step(s);
     uint16_t *pcount = (void*)&s->count, count = *pcount - 1;
     if (likely(count)) {
         *pcount = count;
         s->time.waketime += s->interval;
-        gpio_out_toggle_noirq(s->step_pin);
+        stepper_toggle_step(s);
         if (s->flags & SF_HAVE_ADD)
             s->interval += s->add;
         return SF_RESCHEDULE;
     }
     uint_fast8_t ret = stepper_load_next(s);
-    gpio_out_toggle_noirq(s->step_pin);
+    stepper_toggle_step(s);
     return ret;
 }
 
 // Regular "double scheduled" step function
-uint_fast8_t
-stepper_event_full(struct timer *t)
+static inline uint_fast8_t
+stepper_event_double(struct timer *t, int have_add2)
 {
     struct stepper *s = container_of(t, struct stepper, time);
-    gpio_out_toggle_noirq(s->step_pin);
+    stepper_toggle_step(s);
     uint32_t curtime = timer_read_time();
     uint32_t min_next_time = curtime + s->step_pulse_ticks;
     s->count--;
@@ -152,6 +225,10 @@ stepper_event_full(struct timer *t)
     if (likely(s->count)) {
         s->next_step_time += s->interval;
         s->interval += s->add;
+#if CONFIG_WANT_STEPPER_ADD2
+        if (have_add2)
+            s->add += s->add2;
+#endif
         if (unlikely(timer_is_before(s->next_step_time, min_next_time)))
             // The next step event is too close - push it back
             goto reschedule_min;
@@ -170,8 +247,24 @@ reschedule_min:
     return SF_RESCHEDULE;
 }
 
+uint_fast8_t __hot_ram
+stepper_event_full(struct timer *t)
+{
+    return stepper_event_double(t, 0);
+}
+
+#if CONFIG_WANT_STEPPER_ADD2
+// Step function for moves with a non-zero 'add2' (a separate function
+// so the common path is not slowed down)
+static uint_fast8_t __hot_ram
+stepper_event_add2(struct timer *t)
+{
+    return stepper_event_double(t, 1);
+}
+#endif
+
 // Optimized entry point for step function (may be inlined into sched.c code)
-uint_fast8_t
+uint_fast8_t __hot_ram
 stepper_event(struct timer *t)
 {
     if (HAVE_EDGE_OPTIMIZATION)
@@ -181,6 +274,54 @@ stepper_event(struct timer *t)
     return stepper_event_full(t);
 }
 
+#if CONFIG_STEPPER_TIMER
+
+// Generate the times of upcoming steps of a stepper using a hardware
+// timer.  Returns less than 'max' if the queue is empty or the next
+// move changes direction (the hardware must then be stopped and
+// stepper_timer_next() called after the last step).
+uint_fast8_t
+stepper_timer_fill(struct stepper *s, uint32_t *times, uint_fast8_t max)
+{
+    uint_fast8_t i;
+    for (i=0; i<max; i++) {
+        if (!s->count) {
+            if (move_queue_empty(&s->mq))
+                break;
+            struct move_node *mn = move_queue_first(&s->mq);
+            struct stepper_move *m = container_of(mn, struct stepper_move
+                                                  , node);
+            if (m->flags & MF_DIR)
+                break;
+            stepper_load_next(s);
+        }
+        times[i] = s->next_step_time;
+        if (likely(--s->count)) {
+            s->next_step_time += s->interval;
+            s->interval += s->add;
+#if CONFIG_WANT_STEPPER_ADD2
+            s->add += s->add2;
+#endif
+        }
+    }
+    return i;
+}
+
+// Load the next move after a run of hardware timer steps completes.
+// Returns non-zero if there are further steps to generate.
+uint_fast8_t
+stepper_timer_next(struct stepper *s)
+{
+    if (move_queue_empty(&s->mq)) {
+        s->flags &= ~SF_HW_ACTIVE;
+        return 0;
+    }
+    stepper_load_next(s);
+    return 1;
+}
+
+#endif
+
 void
 command_config_stepper(uint32_t *args)
 {
@@ -191,7 +332,7 @@ command_config_stepper(uint32_t *args)
     s->dir_pin = gpio_out_setup(args[2], 0);
     s->position = -POSITION_BIAS;
     s->step_pulse_ticks = args[4];
-    move_queue_setup(&s->mq, sizeof(struct stepper_move));
+    move_queue_setup(&s->mq, sizeof(struct stepper_move), args[0]);
     if (HAVE_EDGE_OPTIMIZATION) {
         if (!s->step_pulse_ticks && invert_step < 0)
             s->flags |= SF_SINGLE_SCHED;
@@ -210,23 +351,56 @@ DECL_COMMAND(command_config_stepper, "config_stepper oid=%c step_pin=%c"
              " dir_pin=%c invert_step=%c step_pulse_ticks=%u");
 
 // Return the 'struct stepper' for a given stepper oid
-static struct stepper *
+struct stepper *
 stepper_oid_lookup(uint8_t oid)
 {
     return oid_lookup(oid, command_config_stepper);
 }
 
-// Schedule a set of steps with a given timing
+#if CONFIG_STEPPER_TIMER
+// Generate the step pulses of a stepper using a hardware timer
 void
-command_queue_step(uint32_t *args)
+command_config_stepper_timer(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
+    if (s->members)
+        shutdown("Step timer not supported on a stepper group");
+    if (s->flags & SF_SINGLE_SCHED || !s->step_pulse_ticks)
+        shutdown("Step timer requires a step pulse duration");
+    s->hw = step_timer_setup(args[1], s->flags & SF_INVERT_STEP
+                             , s->step_pulse_ticks, s);
+    s->flags |= SF_HW_TIMER;
+}
+DECL_COMMAND(command_config_stepper_timer
+             , "config_stepper_timer oid=%c step_pin=%c");
+#endif
+
+// Add the step and dir pins of another stepper that shares the steps
+// (and move queue) of a stepper
+void
+command_config_stepper_group_member(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    if (CONFIG_STEPPER_TIMER && s->flags & SF_HW_TIMER)
+        shutdown("Step timer not supported on a stepper group");
+    struct stepper_member *m = alloc_chunk(sizeof(*m));
+    m->invert_step = args[3];
+    m->invert_dir = args[4];
+    m->step_pin = gpio_out_setup(args[1], m->invert_step);
+    m->dir_pin = gpio_out_setup(args[2], m->invert_dir);
+    m->next = s->members;
+    s->members = m;
+}
+DECL_COMMAND(command_config_stepper_group_member,
+             "config_stepper_group_member oid=%c step_pin=%c dir_pin=%c"
+             " invert_step=%c invert_dir=%c");
+
+// Add a move to the stepper's queue (and start the stepper if idle)
+static void
+stepper_queue_move(struct stepper *s, struct stepper_move *m)
+{
     if (!m->count)
         shutdown("Invalid count parameter");
-    m->add = args[3];
     m->flags = 0;
 
     irq_disable();
@@ -235,7 +409,7 @@ command_queue_step(uint32_t *args)
         flags ^= SF_LAST_DIR;
         m->flags |= MF_DIR;
     }
-    if (s->count) {
+    if (s->count || (CONFIG_STEPPER_TIMER && flags & SF_HW_ACTIVE)) {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
     } else if (flags & SF_NEED_RESET) {
@@ -244,23 +418,113 @@ command_queue_step(uint32_t *args)
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
         stepper_load_next(s);
+        if (CONFIG_MOVE_QUEUE_STATS)
+            move_queue_note_lead(&s->mq
+                                 , (CONFIG_STEPPER_TIMER && flags & SF_HW_TIMER
+                                    ? s->next_step_time : s->time.waketime));
+#if CONFIG_STEPPER_TIMER
+        if (flags & SF_HW_TIMER) {
+            s->flags |= SF_HW_ACTIVE;
+            step_timer_start(s->hw);
+            irq_enable();
+            return;
+        }
+#endif
         sched_add_timer(&s->time);
     }
     irq_enable();
 }
+
+// Schedule a set of steps with a given timing
+void
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    m->add = args[3];
+    stepper_move_set_add2(m, 0);
+    stepper_queue_move(s, m);
+}
 DECL_COMMAND(command_queue_step,
              "queue_step oid=%c interval=%u count=%hu add=%hi");
 
 // Set the direction of the next queued step
-void
-command_set_next_step_dir(uint32_t *args)
+static void
+stepper_set_next_dir(struct stepper *s, uint8_t dir)
 {
-    struct stepper *s = stepper_oid_lookup(args[0]);
-    uint8_t nextdir = args[1] ? SF_NEXT_DIR : 0;
+    uint8_t nextdir = dir ? SF_NEXT_DIR : 0;
     irq_disable();
     s->flags = (s->flags & ~SF_NEXT_DIR) | nextdir;
     irq_enable();
 }
+
+// Schedule a set of steps in the given direction
+void
+command_queue_step_dir(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    m->add = args[3];
+    stepper_move_set_add2(m, 0);
+    stepper_set_next_dir(s, args[4]);
+    stepper_queue_move(s, m);
+}
+DECL_COMMAND(command_queue_step_dir,
+             "queue_step_dir oid=%c interval=%u count=%hu add=%hi dir=%c");
+
+#if CONFIG_WANT_STEPPER_ADD2
+// Schedule a set of steps with a second order ('add2') timing
+void
+command_queue_step2(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)
+        shutdown("queue_step2 not supported on this stepper");
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    m->add = args[3];
+    m->add2 = args[4];
+    stepper_queue_move(s, m);
+}
+DECL_COMMAND(command_queue_step2,
+             "queue_step2 oid=%c interval=%u count=%hu add=%hi add2=%hi");
+#endif
+
+#if CONFIG_WANT_STEPPER_BATCH
+// Schedule several consecutive sets of steps.  The interval of each
+// set is relative to the interval that follows the previous set.
+void
+command_queue_step_batch(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    uint8_t len = args[1], *p = command_decode_ptr(args[2]), *end = &p[len];
+    uint32_t interval = 0;
+    while (p < end) {
+        struct stepper_move *m = move_alloc();
+        interval += command_parse_int(&p);
+        m->interval = interval;
+        m->count = command_parse_int(&p);
+        m->add = command_parse_int(&p);
+        stepper_move_set_add2(m, 0);
+        interval += (int32_t)m->add * m->count;
+        stepper_queue_move(s, m);
+    }
+}
+DECL_COMMAND(command_queue_step_batch, "queue_step_batch oid=%c moves=%*s");
+#endif
+
+// Set the direction of the next queued step
+void
+command_set_next_step_dir(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_set_next_dir(s, args[1]);
+}
 DECL_COMMAND(command_set_next_step_dir, "set_next_step_dir oid=%c dir=%c");
 
 // Set an absolute time that the next step will be relative to
@@ -270,7 +534,7 @@ command_reset_step_clock(uint32_t *args)
     struct stepper *s = stepper_oid_lookup(args[0]);
     uint32_t waketime = args[1];
     irq_disable();
-    if (s->count)
+    if (s->count || (CONFIG_STEPPER_TIMER && s->flags & SF_HW_ACTIVE))
         shutdown("Can't reset time when stepper active");
     s->next_step_time = s->time.waketime = waketime;
     s->flags &= ~SF_NEED_RESET;
@@ -286,6 +550,10 @@ stepper_get_position(struct stepper *s)
     // If stepper is mid-move, subtract out steps not yet taken
     if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)
         position -= s->count;
+#if CONFIG_STEPPER_TIMER
+    else if (s->flags & SF_HW_TIMER)
+        position -= s->count + step_timer_pending(s->hw);
+#endif
     else
         position -= s->count / 2;
     // The top bit of s->position is an optimized reverse direction flag
@@ -294,18 +562,143 @@ stepper_get_position(struct stepper *s)
     return position;
 }
 
+// Return the current stepper position (as reported to the host)
+int32_t
+stepper_read_position(struct stepper *s)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t position = stepper_get_position(s);
+    irq_restore(flag);
+    return position - POSITION_BIAS;
+}
+
 // Report the current position of the stepper
 void
 command_stepper_get_position(uint32_t *args)
 {
     uint8_t oid = args[0];
     struct stepper *s = stepper_oid_lookup(oid);
+    sendf("stepper_position oid=%c pos=%i", oid, stepper_read_position(s));
+}
+DECL_COMMAND(command_stepper_get_position, "stepper_get_position oid=%c");
+
+#if CONFIG_WANT_STEPPER_BENCHMARK
+// Run the steps of a move on an idle stepper by directly invoking its
+// step function (the timer is not scheduled).  Returns the total
+// ticks spent in the step function.
+static uint32_t
+stepper_benchmark_move(struct stepper *s, uint_fast16_t count
+                       , uint32_t *pmax_ticks)
+{
+    struct stepper_move *m = move_alloc();
+    m->interval = timer_from_us(10);
+    m->count = count;
+    m->add = 0;
+    stepper_move_set_add2(m, 0);
+    m->flags = MF_DIR;
     irq_disable();
-    uint32_t position = stepper_get_position(s);
+    // Use a base time in the future so all step times are valid
+    uint32_t start_time = timer_read_time() + timer_from_us(100000);
+    s->next_step_time = s->time.waketime = start_time;
+    move_queue_push(&m->node, &s->mq);
+    stepper_load_next(s);
     irq_enable();
-    sendf("stepper_position oid=%c pos=%i", oid, position - POSITION_BIAS);
+    uint32_t ticks = 0, max_ticks = *pmax_ticks;
+    for (;;) {
+        irq_disable();
+        uint32_t start = timer_read_time();
+        uint_fast8_t ret = (s->time.func ? s->time.func(&s->time)
+                            : stepper_event(&s->time));
+        uint32_t diff = timer_read_time() - start;
+        irq_enable();
+        ticks += diff;
+        if (diff > max_ticks)
+            max_ticks = diff;
+        if (ret == SF_DONE)
+            break;
+    }
+    *pmax_ticks = max_ticks;
+    return ticks;
 }
-DECL_COMMAND(command_stepper_get_position, "stepper_get_position oid=%c");
+
+// Measure the time needed by the step function of an idle stepper.
+// The stepper is moved 'count' steps in the opposite direction and
+// then back again, so the position and the pins are unchanged.  The
+// step pulses are not delayed - the host should only use this command
+// on steppers with disabled drivers.
+void
+command_stepper_benchmark(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct stepper *s = stepper_oid_lookup(oid);
+    uint_fast16_t count = args[1];
+    uint32_t steps = 0, ticks = 0, max_ticks = 0;
+    irq_disable();
+    uint_fast8_t is_idle = (!s->count && move_queue_empty(&s->mq)
+                            && !(CONFIG_STEPPER_TIMER
+                                 && s->flags & SF_HW_TIMER));
+    irq_enable();
+    if (is_idle && count) {
+        struct timer time = s->time;
+        uint32_t next_step_time = s->next_step_time;
+        ticks += stepper_benchmark_move(s, count, &max_ticks);
+        ticks += stepper_benchmark_move(s, count, &max_ticks);
+        steps = count * 2;
+        irq_disable();
+        s->time = time;
+        s->next_step_time = next_step_time;
+        irq_enable();
+    }
+    sendf("stepper_benchmark_result oid=%c steps=%u ticks=%u max_ticks=%u"
+          , oid, steps, ticks, max_ticks);
+}
+DECL_COMMAND(command_stepper_benchmark, "stepper_benchmark oid=%c count=%hu");
+#endif
+
+#if CONFIG_WANT_STEPPER_VIBRATE
+// Return the ticks that the step pin must be held before calling
+// stepper_direct_unstep(), or a negative value if a step is one edge
+int32_t
+stepper_direct_pulse_ticks(struct stepper *s)
+{
+    if (HAVE_EDGE_OPTIMIZATION && s->flags & SF_SINGLE_SCHED)
+        return -1;
+    return s->step_pulse_ticks;
+}
+
+// Step an idle stepper outside of its move queue (used to generate
+// vibrations on the mcu).  If 'dir' differs from the current direction
+// then only the direction pin is changed.  Returns a negative value if
+// the stepper has queued moves (or was stopped), zero if only the
+// direction changed, and one if a step was taken.  Caller must disable
+// irqs.
+int_fast8_t
+stepper_direct_step(struct stepper *s, uint8_t dir)
+{
+    uint8_t flags = s->flags;
+    if (s->count || !move_queue_empty(&s->mq)
+        || flags & (SF_NEED_RESET | SF_HW_TIMER))
+        return -1;
+    if (!!(flags & SF_LAST_DIR) != !!dir) {
+        // The next queued move restores the requested direction
+        s->flags = flags ^ SF_LAST_DIR;
+        s->position = -s->position;
+        stepper_toggle_dir(s);
+        return 0;
+    }
+    s->position++;
+    stepper_toggle_step(s);
+    return 1;
+}
+
+// Complete a step pulse started by stepper_direct_step()
+void
+stepper_direct_unstep(struct stepper *s)
+{
+    if (!(s->flags & SF_NEED_RESET))
+        stepper_toggle_step(s);
+}
+#endif
 
 // Stop all moves for a given stepper (caller must disable IRQs)
 static void
@@ -313,13 +706,25 @@ stepper_stop(struct trsync_signal *tss, uint8_t reason)
 {
     struct stepper *s = container_of(tss, struct stepper, stop_signal);
     sched_del_timer(&s->time);
+#if CONFIG_STEPPER_TIMER
+    if (s->flags & SF_HW_TIMER)
+        s->count += step_timer_stop(s->hw);
+#endif
     s->next_step_time = s->time.waketime = 0;
     s->position = -stepper_get_position(s);
     s->count = 0;
-    s->flags = (s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED)) | SF_NEED_RESET;
+    s->flags = ((s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED|SF_HW_TIMER))
+                | SF_NEED_RESET);
     gpio_out_write(s->dir_pin, 0);
-    if (!(HAVE_EDGE_OPTIMIZATION && s->flags & SF_SINGLE_SCHED))
+    int reset_step = !(HAVE_EDGE_OPTIMIZATION && s->flags & SF_SINGLE_SCHED);
+    if (reset_step)
         gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
+    struct stepper_member *m;
+    for (m = s->members; m; m = m->next) {
+        gpio_out_write(m->dir_pin, m->invert_dir);
+        if (reset_step)
+            gpio_out_write(m->step_pin, m->invert_step);
+    }
     while (!move_queue_empty(&s->mq)) {
         struct move_node *mn = move_queue_pop(&s->mq);
         struct stepper_move *m = container_of(mn, struct stepper_move, node);
@@ -4,5 +4,14 @@
 #include <stdint.h> // uint8_t
 
 uint_fast8_t stepper_event(struct timer *t);
+struct stepper;
+struct stepper *stepper_oid_lookup(uint8_t oid);
+int32_t stepper_read_position(struct stepper *s);
+uint_fast8_t stepper_timer_fill(struct stepper *s, uint32_t *times
+                                , uint_fast8_t max);
+uint_fast8_t stepper_timer_next(struct stepper *s);
+int32_t stepper_direct_pulse_ticks(struct stepper *s);
+int_fast8_t stepper_direct_step(struct stepper *s, uint8_t dir);
+void stepper_direct_unstep(struct stepper *s);
 
 #endif // stepper.h
@@ -0,0 +1,162 @@
+// Periodic sampling of stepper positions
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_add_sample
+#include "stepper.h" // stepper_read_position
+
+#define MAX_STEPPERS SENSOR_BULK_MAX_FIELDS
+#define RING_SIZE 4
+
+struct stepper_sample {
+    struct timer timer;
+    uint32_t rest_ticks;
+    struct stepper *steppers[MAX_STEPPERS];
+    // Samples taken by the timer (not yet added to the sensor_bulk buffer)
+    int16_t ring[RING_SIZE][MAX_STEPPERS];
+    uint8_t ring_repeat[RING_SIZE];
+    uint8_t stepper_count, ring_head, ring_tail;
+    struct sensor_bulk sb;
+};
+
+#define BYTES_PER_STEPPER 2
+
+DECL_TASK_WAKE(stepper_sample_wake);
+
+// Timer that reads the position of each stepper
+static uint_fast8_t
+stepper_sample_event(struct timer *timer)
+{
+    struct stepper_sample *ss = container_of(
+        timer, struct stepper_sample, timer);
+    uint_fast8_t head = ss->ring_head, next = (head + 1) % RING_SIZE;
+    if (next == ss->ring_tail) {
+        // Task has not kept up - repeat the last sample to retain timing
+        uint_fast8_t last = (head + RING_SIZE - 1) % RING_SIZE;
+        if (ss->ring_repeat[last] < UINT8_MAX)
+            ss->ring_repeat[last]++;
+    } else {
+        uint_fast8_t i;
+        for (i=0; i<ss->stepper_count; i++)
+            ss->ring[head][i] = stepper_read_position(ss->steppers[i]);
+        ss->ring_repeat[head] = 0;
+        ss->ring_head = next;
+    }
+    sched_wake_task(&stepper_sample_wake);
+    ss->timer.waketime += ss->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_stepper_sample(uint32_t *args)
+{
+    uint8_t stepper_count = args[1];
+    if (!stepper_count || stepper_count > MAX_STEPPERS)
+        shutdown("Invalid stepper_sample stepper count");
+    struct stepper_sample *ss = oid_alloc(
+        args[0], command_config_stepper_sample, sizeof(*ss));
+    ss->timer.func = stepper_sample_event;
+    ss->stepper_count = stepper_count;
+}
+DECL_COMMAND(command_config_stepper_sample,
+             "config_stepper_sample oid=%c stepper_count=%c");
+
+void
+command_stepper_sample_set_stepper(uint32_t *args)
+{
+    struct stepper_sample *ss = oid_lookup(
+        args[0], command_config_stepper_sample);
+    uint8_t pos = args[1];
+    if (pos >= ss->stepper_count)
+        shutdown("Set stepper_sample stepper past maximum count");
+    ss->steppers[pos] = stepper_oid_lookup(args[2]);
+}
+DECL_COMMAND(command_stepper_sample_set_stepper,
+             "stepper_sample_set_stepper oid=%c pos=%c stepper_oid=%c");
+
+void
+command_query_stepper_sample(uint32_t *args)
+{
+    struct stepper_sample *ss = oid_lookup(
+        args[0], command_config_stepper_sample);
+    sched_del_timer(&ss->timer);
+    ss->ring_head = ss->ring_tail = 0;
+    if (!args[2])
+        // End measurements
+        return;
+    uint_fast8_t i;
+    for (i=0; i<ss->stepper_count; i++)
+        if (!ss->steppers[i])
+            shutdown("stepper_sample stepper not set");
+
+    // Start new measurements query
+    ss->timer.waketime = args[1];
+    ss->rest_ticks = args[2];
+    sensor_bulk_set_compress(&ss->sb, ss->stepper_count
+                             , ss->stepper_count * BYTES_PER_STEPPER);
+    sched_add_timer(&ss->timer);
+}
+DECL_COMMAND(command_query_stepper_sample,
+             "query_stepper_sample oid=%c clock=%u rest_ticks=%u");
+
+void
+command_query_stepper_sample_status(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct stepper_sample *ss = oid_lookup(oid, command_config_stepper_sample);
+    irq_disable();
+    uint32_t time1 = timer_read_time();
+    uint_fast8_t i, pending = 0;
+    for (i=ss->ring_tail; i!=ss->ring_head; i=(i + 1) % RING_SIZE)
+        pending += 1 + ss->ring_repeat[i];
+    irq_enable();
+    uint32_t time2 = timer_read_time();
+    sensor_bulk_status(&ss->sb, oid, time1, time2 - time1
+                       , pending * ss->stepper_count * BYTES_PER_STEPPER);
+}
+DECL_COMMAND(command_query_stepper_sample_status,
+             "query_stepper_sample_status oid=%c");
+
+// Add the samples taken by the timer to the sensor_bulk buffer
+static void
+stepper_sample_flush(struct stepper_sample *ss, uint8_t oid)
+{
+    for (;;) {
+        int16_t values[MAX_STEPPERS];
+        irq_disable();
+        uint_fast8_t tail = ss->ring_tail;
+        if (tail == ss->ring_head) {
+            irq_enable();
+            return;
+        }
+        memcpy(values, ss->ring[tail], sizeof(values));
+        uint_fast8_t repeat = ss->ring_repeat[tail];
+        ss->ring_tail = (tail + 1) % RING_SIZE;
+        irq_enable();
+        sensor_bulk_add_sample(&ss->sb, oid, values);
+        ss->sb.possible_overflows += repeat;
+        while (repeat--)
+            sensor_bulk_add_sample(&ss->sb, oid, values);
+    }
+}
+
+void
+stepper_sample_task(void)
+{
+    if (!sched_check_wake(&stepper_sample_wake))
+        return;
+    uint8_t oid;
+    struct stepper_sample *ss;
+    foreach_oid(oid, ss, command_config_stepper_sample) {
+        stepper_sample_flush(ss, oid);
+    }
+}
+DECL_WAKE_TASK(stepper_sample_task, stepper_sample_wake);
@@ -0,0 +1,278 @@
+// Generation of stepper vibrations on the mcu (for resonance testing)
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // struct timer
+#include "stepper.h" // stepper_direct_step
+
+#define MAX_STEPPERS 4
+
+// The vibration is a sine wave that is evaluated at a fixed tick rate
+// using a phase accumulator (with a full period being 2^32).  Each
+// segment of the wave linearly changes the frequency and the
+// amplitude, so a frequency sweep needs only a few host commands.
+struct vibrate_segment {
+    struct move_node node;
+    uint32_t count, phase_add, amplitude;
+    int32_t phase_add2, amplitude_add;
+};
+
+struct vibrate_stepper {
+    struct stepper *stepper;
+    int32_t scale, position, pulse_ticks;
+    uint8_t flags;
+};
+
+struct stepper_vibrate {
+    struct timer timer;
+    uint32_t rest_ticks, next_tick, count;
+    uint32_t phase, phase_add, amplitude;
+    int32_t phase_add2, amplitude_add;
+    struct move_queue_head mq;
+    struct vibrate_stepper steppers[MAX_STEPPERS];
+    uint8_t flags;
+};
+
+enum { SV_ACTIVE=1<<0, SV_UNSTEP=1<<1, SV_FINISH=1<<2 };
+enum { VS_UNSTEP=1<<0 };
+
+// Quarter period of a sine wave (scaled to 32767)
+static const int16_t sine_table[65] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+    6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767,
+};
+
+// Return the sine of a phase (interpolated from the table)
+static int32_t
+vibrate_sine(uint32_t phase)
+{
+    uint32_t pos = phase & 0x3fffffff;
+    if (phase & 0x40000000)
+        pos = 0x40000000 - pos;
+    uint32_t idx = pos >> 24, frac = (pos >> 8) & 0xffff;
+    int32_t v = sine_table[idx];
+    if (idx < 64)
+        v += ((sine_table[idx + 1] - v) * (int32_t)frac) >> 16;
+    return phase & 0x80000000 ? -v : v;
+}
+
+// Release any queued segments and mark the vibration as idle
+static void
+vibrate_clear(struct stepper_vibrate *sv)
+{
+    while (!move_queue_empty(&sv->mq)) {
+        struct move_node *mn = move_queue_pop(&sv->mq);
+        move_free(container_of(mn, struct vibrate_segment, node));
+    }
+    sv->flags = 0;
+}
+
+// Load the parameters of the next segment
+static void
+vibrate_load_next(struct stepper_vibrate *sv)
+{
+    if (move_queue_empty(&sv->mq)) {
+        // No more segments - return the steppers to their start position
+        sv->flags |= SV_FINISH;
+        return;
+    }
+    struct move_node *mn = move_queue_pop(&sv->mq);
+    struct vibrate_segment *vseg = container_of(mn, struct vibrate_segment
+                                                , node);
+    sv->count = vseg->count;
+    sv->phase_add = vseg->phase_add;
+    sv->phase_add2 = vseg->phase_add2;
+    sv->amplitude = vseg->amplitude;
+    sv->amplitude_add = vseg->amplitude_add;
+    move_free(vseg);
+}
+
+// Timer that steps the steppers towards the current wave position
+static uint_fast8_t
+stepper_vibrate_event(struct timer *timer)
+{
+    struct stepper_vibrate *sv = container_of(
+        timer, struct stepper_vibrate, timer);
+    uint_fast8_t i;
+    if (sv->flags & SV_UNSTEP) {
+        // Complete the step pulses started at the last tick
+        for (i=0; i<MAX_STEPPERS; i++) {
+            struct vibrate_stepper *vs = &sv->steppers[i];
+            if (vs->flags & VS_UNSTEP) {
+                vs->flags &= ~VS_UNSTEP;
+                stepper_direct_unstep(vs->stepper);
+            }
+        }
+        sv->flags &= ~SV_UNSTEP;
+        sv->timer.waketime = sv->next_tick;
+        return SF_RESCHEDULE;
+    }
+
+    // Advance the wave (amplitude is in 1/2^28 units of the host)
+    if (!sv->count && !(sv->flags & SV_FINISH))
+        vibrate_load_next(sv);
+    int32_t wave = 0;
+    if (!(sv->flags & SV_FINISH)) {
+        wave = ((int64_t)sv->amplitude * vibrate_sine(sv->phase)) >> 27;
+        sv->phase += sv->phase_add;
+        sv->phase_add += sv->phase_add2;
+        sv->amplitude += sv->amplitude_add;
+        sv->count--;
+    }
+
+    // Step each stepper at most once per tick (a change of direction
+    // delays the step to the next tick)
+    uint_fast8_t is_moving = 0;
+    int32_t pulse_ticks = 0;
+    for (i=0; i<MAX_STEPPERS; i++) {
+        struct vibrate_stepper *vs = &sv->steppers[i];
+        int32_t target = ((int64_t)wave * vs->scale) >> 32;
+        if (target == vs->position)
+            continue;
+        is_moving = 1;
+        uint8_t dir = target > vs->position;
+        int_fast8_t ret = stepper_direct_step(vs->stepper, dir);
+        if (ret < 0) {
+            // Stepper was stopped (eg, by a trsync trigger)
+            vibrate_clear(sv);
+            return SF_DONE;
+        }
+        if (!ret)
+            continue;
+        vs->position += dir ? 1 : -1;
+        if (vs->pulse_ticks >= 0) {
+            vs->flags |= VS_UNSTEP;
+            sv->flags |= SV_UNSTEP;
+            if (vs->pulse_ticks > pulse_ticks)
+                pulse_ticks = vs->pulse_ticks;
+        }
+    }
+    if (sv->flags & SV_FINISH && !is_moving && !(sv->flags & SV_UNSTEP)) {
+        vibrate_clear(sv);
+        return SF_DONE;
+    }
+    sv->next_tick = sv->timer.waketime + sv->rest_ticks;
+    if (sv->flags & SV_UNSTEP)
+        sv->timer.waketime += pulse_ticks;
+    else
+        sv->timer.waketime = sv->next_tick;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_stepper_vibrate(uint32_t *args)
+{
+    struct stepper_vibrate *sv = oid_alloc(
+        args[0], command_config_stepper_vibrate, sizeof(*sv));
+    sv->timer.func = stepper_vibrate_event;
+    sv->rest_ticks = args[1];
+    move_queue_setup(&sv->mq, sizeof(struct vibrate_segment), args[0]);
+}
+DECL_COMMAND(command_config_stepper_vibrate,
+             "config_stepper_vibrate oid=%c rest_ticks=%u");
+
+static struct stepper_vibrate *
+stepper_vibrate_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_stepper_vibrate);
+}
+
+// Set the steps per wave unit (in 1/2^16 steps) of a vibrated stepper
+void
+command_stepper_vibrate_set_stepper(uint32_t *args)
+{
+    struct stepper_vibrate *sv = stepper_vibrate_oid_lookup(args[0]);
+    uint8_t index = args[1];
+    if (index >= MAX_STEPPERS)
+        shutdown("Invalid stepper_vibrate index");
+    struct stepper *s = stepper_oid_lookup(args[2]);
+    int32_t pulse_ticks = stepper_direct_pulse_ticks(s);
+    if (pulse_ticks >= (int32_t)sv->rest_ticks)
+        shutdown("stepper_vibrate rate too high for step pulse");
+    irq_disable();
+    if (sv->flags & SV_ACTIVE)
+        shutdown("Can't set stepper_vibrate stepper while active");
+    struct vibrate_stepper *vs = &sv->steppers[index];
+    vs->stepper = s;
+    vs->scale = args[3];
+    vs->pulse_ticks = pulse_ticks;
+    irq_enable();
+}
+DECL_COMMAND(command_stepper_vibrate_set_stepper,
+             "stepper_vibrate_set_stepper oid=%c index=%c stepper_oid=%c"
+             " scale=%i");
+
+// Queue a segment of the wave (the first segment starts at 'clock')
+void
+command_stepper_vibrate_segment(uint32_t *args)
+{
+    struct stepper_vibrate *sv = stepper_vibrate_oid_lookup(args[0]);
+    uint32_t clock = args[1];
+    struct vibrate_segment *vseg = move_alloc();
+    vseg->count = args[2];
+    vseg->phase_add = args[3];
+    vseg->phase_add2 = args[4];
+    vseg->amplitude = args[5];
+    vseg->amplitude_add = args[6];
+    if (!vseg->count)
+        shutdown("Invalid stepper_vibrate count");
+    irq_disable();
+    if (sv->flags & SV_FINISH)
+        shutdown("stepper_vibrate segment after end of vibration");
+    move_queue_push(&vseg->node, &sv->mq);
+    if (!(sv->flags & SV_ACTIVE)) {
+        uint_fast8_t i;
+        for (i=0; i<MAX_STEPPERS; i++) {
+            struct vibrate_stepper *vs = &sv->steppers[i];
+            if (vs->scale && !vs->stepper)
+                shutdown("stepper_vibrate stepper not set");
+            vs->position = 0;
+            vs->flags = 0;
+        }
+        sv->flags = SV_ACTIVE;
+        sv->phase = sv->count = 0;
+        sv->timer.waketime = clock;
+        sched_add_timer(&sv->timer);
+    }
+    irq_enable();
+}
+DECL_COMMAND(command_stepper_vibrate_segment,
+             "stepper_vibrate_segment oid=%c clock=%u count=%u phase_add=%u"
+             " phase_add2=%i amplitude=%u amplitude_add=%i");
+
+// Report if a vibration is in progress
+void
+command_query_stepper_vibrate(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    struct stepper_vibrate *sv = stepper_vibrate_oid_lookup(oid);
+    irq_disable();
+    uint8_t active = sv->flags & SV_ACTIVE;
+    irq_enable();
+    sendf("stepper_vibrate_state oid=%c active=%c", oid, active);
+}
+DECL_COMMAND(command_query_stepper_vibrate, "query_stepper_vibrate oid=%c");
+
+void
+stepper_vibrate_shutdown(void)
+{
+    uint8_t i;
+    struct stepper_vibrate *sv;
+    foreach_oid(i, sv, command_config_stepper_vibrate) {
+        move_queue_clear(&sv->mq);
+        sv->flags = 0;
+    }
+}
+DECL_SHUTDOWN(stepper_vibrate_shutdown);
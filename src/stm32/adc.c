@@ -4,6 +4,8 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_ADC_CONTINUOUS
+#include "board/io.h" // readw
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // timer_from_us
 #include "command.h" // shutdown
@@ -52,6 +54,122 @@ static const uint8_t adc_pins[] = {
 // stm32f407: ADC clock=21Mhz, Tconv=12, Tsamp=84, total=4.571us
 // stm32f446: ADC clock=22.5Mhz, Tconv=12, Tsamp=84, total=4.267us
 
+#if CONFIG_ADC_CONTINUOUS
+
+// In continuous mode each adc block repeatedly scans all of its
+// configured channels and dma stores the results in a circular
+// buffer holding the last ADC_OVERSAMPLE samples of each channel.
+#define ADC_OVERSAMPLE 8
+#define ADC_SCAN_MAX 16
+
+struct adc_scan {
+    ADC_TypeDef *adc;
+    DMA_Stream_TypeDef *stream;
+    uint8_t stream_num, chsel, count;
+    uint8_t chans[ADC_SCAN_MAX];
+    uint16_t buf[ADC_SCAN_MAX * ADC_OVERSAMPLE];
+};
+
+// Dma2 streams 0, 2, 3, and 7 may be used by the spi and serial code
+static struct adc_scan adc_scans[] = {
+    { .adc = ADC1, .stream = DMA2_Stream4, .stream_num = 4, .chsel = 0 },
+#if CONFIG_MACH_STM32F4x5 || CONFIG_MACH_STM32F446
+    { .adc = ADC3, .stream = DMA2_Stream1, .stream_num = 1, .chsel = 2 },
+#endif
+};
+
+static struct adc_scan *
+adc_scan_lookup(ADC_TypeDef *adc)
+{
+    struct adc_scan *s = adc_scans;
+    while (s->adc != adc)
+        s++;
+    return s;
+}
+
+#define DMA_TCIF 0x20
+
+// Read the interrupt flags of a dma2 stream
+static uint32_t
+dma_get_flags(uint32_t num)
+{
+    uint32_t shift = (num & 2 ? 16 : 0) + (num & 1 ? 6 : 0);
+    return (num < 4 ? DMA2->LISR : DMA2->HISR) >> shift;
+}
+
+// Clear the interrupt flags of a dma2 stream
+static void
+dma_clear_flags(uint32_t num)
+{
+    uint32_t flags = 0x3d << ((num & 2 ? 16 : 0) + (num & 1 ? 6 : 0));
+    if (num < 4)
+        DMA2->LIFCR = flags;
+    else
+        DMA2->HIFCR = flags;
+}
+
+// (Re)start the continuous scan of an adc block
+static void
+adc_scan_start(struct adc_scan *s)
+{
+    ADC_TypeDef *adc = s->adc;
+    DMA_Stream_TypeDef *stream = s->stream;
+    if (!is_enabled_pclock(DMA2_BASE))
+        enable_pclock(DMA2_BASE);
+
+    // Stop any active scan
+    adc->CR2 = CR2_FLAGS;
+    stream->CR = 0;
+    while (stream->CR & DMA_SxCR_EN)
+        ;
+
+    // Program the channel sequence
+    uint32_t sqr[3] = { 0, 0, (s->count - 1) << ADC_SQR1_L_Pos };
+    uint_fast8_t i;
+    for (i=0; i<s->count; i++)
+        sqr[i / 6] |= s->chans[i] << ((i % 6) * 5);
+    adc->SQR3 = sqr[0];
+    adc->SQR2 = sqr[1];
+    adc->SQR1 = sqr[2];
+    adc->CR1 = ADC_CR1_SCAN;
+    adc->SR = 0;
+
+    // Store the results in a circular buffer
+    dma_clear_flags(s->stream_num);
+    stream->PAR = (uint32_t)&adc->DR;
+    stream->M0AR = (uint32_t)s->buf;
+    stream->NDTR = s->count * ADC_OVERSAMPLE;
+    stream->CR = ((s->chsel << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MSIZE_0
+                  | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC | DMA_SxCR_CIRC
+                  | DMA_SxCR_EN);
+    uint32_t cr2 = CR2_FLAGS | ADC_CR2_CONT | ADC_CR2_DMA | ADC_CR2_DDS;
+    adc->CR2 = cr2;
+    adc->CR2 = cr2 | ADC_CR2_SWSTART;
+
+    // Wait for the buffer to be filled
+    uint32_t end = timer_read_time() + timer_from_us(10000);
+    while (!(dma_get_flags(s->stream_num) & DMA_TCIF))
+        if (timer_is_before(end, timer_read_time()))
+            shutdown("Timeout on adc dma");
+}
+
+// Add a channel to the continuous scan of an adc block
+static void
+adc_scan_add(ADC_TypeDef *adc, uint32_t chan)
+{
+    struct adc_scan *s = adc_scan_lookup(adc);
+    uint_fast8_t i;
+    for (i=0; i<s->count; i++)
+        if (s->chans[i] == chan)
+            return;
+    if (s->count >= ADC_SCAN_MAX)
+        shutdown("Too many adc pins");
+    s->chans[s->count++] = chan;
+    adc_scan_start(s);
+}
+
+#endif // CONFIG_ADC_CONTINUOUS
+
 // Perform calibration on stm32f103
 static void
 adc_calibrate(ADC_TypeDef *adc)
@@ -117,9 +235,44 @@ gpio_adc_setup(uint32_t pin)
         gpio_peripheral(pin, GPIO_ANALOG, 0);
     }
 
+#if CONFIG_ADC_CONTINUOUS
+    adc_scan_add(adc, chan);
+#endif
+
     return (struct gpio_adc){ .adc = adc, .chan = chan };
 }
 
+#if CONFIG_ADC_CONTINUOUS
+
+// Try to sample a value - always ready when scanning continuously
+uint32_t
+gpio_adc_sample(struct gpio_adc g)
+{
+    return 0;
+}
+
+// Return the average of the most recent samples of a channel
+uint16_t
+gpio_adc_read(struct gpio_adc g)
+{
+    struct adc_scan *s = adc_scan_lookup(g.adc);
+    uint_fast8_t count = s->count, slot = 0, i;
+    while (s->chans[slot] != g.chan)
+        slot++;
+    uint32_t sum = 0;
+    for (i=0; i<ADC_OVERSAMPLE; i++)
+        sum += readw(&s->buf[i * count + slot]);
+    return sum / ADC_OVERSAMPLE;
+}
+
+// Cancel a sample that may have been started with gpio_adc_sample()
+void
+gpio_adc_cancel_sample(struct gpio_adc g)
+{
+}
+
+#else // !CONFIG_ADC_CONTINUOUS
+
 // Try to sample a value. Returns zero if sample ready, otherwise
 // returns the number of clock ticks the caller should wait before
 // retrying this function.
@@ -162,3 +315,5 @@ gpio_adc_cancel_sample(struct gpio_adc g)
         gpio_adc_read(g);
     irq_restore(flag);
 }
+
+#endif // !CONFIG_ADC_CONTINUOUS
@@ -0,0 +1,43 @@
+// Message block crc using the stm32 crc calculation unit
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/misc.h" // crc16_ccitt
+#include "internal.h" // CRC
+#include "sched.h" // DECL_INIT
+
+// The crc "ccitt" variant used by the message protocol is polynomial
+// 0x1021 with an initial value of 0xffff and reflected input and
+// output bits
+#define CRC_CR_CCITT (CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT)
+
+// Implement the standard crc "ccitt" algorithm on the given buffer
+uint16_t
+crc16_ccitt(uint8_t *buf, uint_fast8_t len)
+{
+    CRC->CR = CRC_CR_CCITT | CRC_CR_RESET;
+    while (len--)
+        *(volatile uint8_t *)&CRC->DR = *buf++;
+    return CRC->DR;
+}
+
+void
+crc_init(void)
+{
+#if CONFIG_MACH_STM32H7
+    RCC->AHB4ENR |= RCC_AHB4ENR_CRCEN;
+    RCC->AHB4ENR;
+#elif CONFIG_MACH_STM32F0 || CONFIG_MACH_STM32G0
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+    RCC->AHBENR;
+#else
+    RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+    RCC->AHB1ENR;
+#endif
+    CRC->POL = 0x1021;
+    CRC->INIT = 0xffff;
+    CRC->CR = CRC_CR_CCITT;
+}
+DECL_INIT(crc_init);
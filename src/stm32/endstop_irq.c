@@ -0,0 +1,147 @@
+// Pin change (exti) interrupts for endstop triggering on stm32
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "endstop.h" // endstop_hw_setup
+#include "internal.h" // enable_pclock
+
+// Endstop (if any) using each exti line
+static struct endstop_irq *endstop_irq_active[16];
+
+// Handle an exti irq for the given group of lines
+static void
+endstop_irq_handle(uint32_t lines)
+{
+    uint32_t time = timer_read_time();
+    uint32_t pending = EXTI->PR & EXTI->IMR & lines;
+    while (pending) {
+        uint32_t line = __builtin_ctz(pending), bit = 1 << line;
+        pending &= ~bit;
+        // Only report the first edge - the endstop code re-arms as needed
+        EXTI->IMR &= ~bit;
+        EXTI->RTSR &= ~bit;
+        EXTI->FTSR &= ~bit;
+        EXTI->PR = bit;
+        struct endstop_irq *ei = endstop_irq_active[line];
+        ei->func(ei, time);
+    }
+}
+
+void
+EndstopEXTI0_IRQHandler(void)
+{
+    endstop_irq_handle(1 << 0);
+}
+void
+EndstopEXTI1_IRQHandler(void)
+{
+    endstop_irq_handle(1 << 1);
+}
+void
+EndstopEXTI2_IRQHandler(void)
+{
+    endstop_irq_handle(1 << 2);
+}
+void
+EndstopEXTI3_IRQHandler(void)
+{
+    endstop_irq_handle(1 << 3);
+}
+void
+EndstopEXTI4_IRQHandler(void)
+{
+    endstop_irq_handle(1 << 4);
+}
+void
+EndstopEXTI9_5_IRQHandler(void)
+{
+    endstop_irq_handle(0x03e0);
+}
+void
+EndstopEXTI15_10_IRQHandler(void)
+{
+    endstop_irq_handle(0xfc00);
+}
+
+static void
+endstop_irq_enable_nvic(uint32_t line)
+{
+    switch (line) {
+    case 0:
+        armcm_enable_irq(EndstopEXTI0_IRQHandler, EXTI0_IRQn, TIMER_PRIO);
+        break;
+    case 1:
+        armcm_enable_irq(EndstopEXTI1_IRQHandler, EXTI1_IRQn, TIMER_PRIO);
+        break;
+    case 2:
+        armcm_enable_irq(EndstopEXTI2_IRQHandler, EXTI2_IRQn, TIMER_PRIO);
+        break;
+    case 3:
+        armcm_enable_irq(EndstopEXTI3_IRQHandler, EXTI3_IRQn, TIMER_PRIO);
+        break;
+    case 4:
+        armcm_enable_irq(EndstopEXTI4_IRQHandler, EXTI4_IRQn, TIMER_PRIO);
+        break;
+    case 5 ... 9:
+        armcm_enable_irq(EndstopEXTI9_5_IRQHandler, EXTI9_5_IRQn, TIMER_PRIO);
+        break;
+    default:
+        armcm_enable_irq(EndstopEXTI15_10_IRQHandler, EXTI15_10_IRQn
+                         , TIMER_PRIO);
+        break;
+    }
+}
+
+// Route a pin to its exti line - returns non-zero if the line is
+// already in use (the caller should then poll the pin)
+int
+endstop_hw_setup(struct endstop_irq *ei, uint32_t pin)
+{
+    uint32_t line = pin % 16, port = pin / 16;
+    if (endstop_irq_active[line])
+        return -1;
+    if (!is_enabled_pclock(SYSCFG_BASE))
+        enable_pclock(SYSCFG_BASE);
+    irqstatus_t flag = irq_save();
+    uint32_t shift = (line % 4) * 4;
+    uint32_t cr = SYSCFG->EXTICR[line / 4] & ~(0x0f << shift);
+    SYSCFG->EXTICR[line / 4] = cr | (port << shift);
+    endstop_irq_active[line] = ei;
+    ei->line = line;
+    irq_restore(flag);
+    endstop_irq_enable_nvic(line);
+    return 0;
+}
+
+// Arm the irq for the next rising (or falling) edge
+void
+endstop_hw_enable(struct endstop_irq *ei, uint8_t rising)
+{
+    uint32_t bit = 1 << ei->line;
+    irqstatus_t flag = irq_save();
+    EXTI->PR = bit;
+    if (rising)
+        EXTI->RTSR |= bit;
+    else
+        EXTI->FTSR |= bit;
+    EXTI->IMR |= bit;
+    irq_restore(flag);
+}
+
+// Disarm the irq (and discard any pending edge)
+void
+endstop_hw_disable(struct endstop_irq *ei)
+{
+    uint32_t bit = 1 << ei->line;
+    irqstatus_t flag = irq_save();
+    EXTI->IMR &= ~bit;
+    EXTI->RTSR &= ~bit;
+    EXTI->FTSR &= ~bit;
+    EXTI->PR = bit;
+    irq_restore(flag);
+}
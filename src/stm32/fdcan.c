@@ -93,6 +93,8 @@ struct fdcan_fifo {
 
 #define FDCAN_XTD (1<<30)
 #define FDCAN_RTR (1<<29)
+#define FDCAN_FDF (1<<21)
+#define FDCAN_BRS (1<<20)
 
 struct fdcan_msg_ram {
     uint32_t FLS[28]; // Filter list standard
@@ -133,9 +135,16 @@ canhw_send(struct canbus_msg *msg)
         ids = (msg->id & 0x7ff) << 18;
     ids |= msg->id & CANMSG_ID_RTR ? FDCAN_RTR : 0;
     txfifo->id_section = ids;
-    txfifo->dlc_section = (msg->dlc & 0x0f) << 16;
+    uint32_t dlcs = (msg->dlc & 0x0f) << 16;
     txfifo->data[0] = msg->data32[0];
     txfifo->data[1] = msg->data32[1];
+    if (CONFIG_CANBUS_FD && msg->id & CANMSG_ID_FDF) {
+        dlcs |= FDCAN_FDF | FDCAN_BRS;
+        uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(msg), 4);
+        for (i=2; i<words; i++)
+            txfifo->data[i] = msg->data32[i];
+    }
+    txfifo->dlc_section = dlcs;
     barrier();
     SOC_CAN->TXBAR = ((uint32_t)1 << w_index);
     return CANMSG_DATA_LEN(msg);
@@ -205,9 +214,16 @@ CAN_IRQHandler(void)
             else
                 msg.id = (ids >> 18) & 0x7ff;
             msg.id |= ids & FDCAN_RTR ? CANMSG_ID_RTR : 0;
-            msg.dlc = (rxf0->dlc_section >> 16) & 0x0f;
+            uint32_t dlcs = rxf0->dlc_section;
+            msg.dlc = (dlcs >> 16) & 0x0f;
             msg.data32[0] = rxf0->data[0];
             msg.data32[1] = rxf0->data[1];
+            if (CONFIG_CANBUS_FD && dlcs & FDCAN_FDF) {
+                msg.id |= CANMSG_ID_FDF;
+                uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(&msg), 4);
+                for (i=2; i<words; i++)
+                    msg.data32[i] = rxf0->data[i];
+            }
             barrier();
             SOC_CAN->RXF0A = idx;
 
@@ -268,6 +284,49 @@ compute_btr(uint32_t pclock, uint32_t bitrate)
     return make_btr(sjw, time_seg1, time_seg2, brp);
 }
 
+// Compute the data phase bit timing register for CAN FD
+static inline const uint32_t
+compute_dbtp(uint32_t pclock, uint32_t bitrate)
+{
+    uint32_t bit_clocks = pclock / bitrate; // clock ticks per bit
+
+    // Find number of time quantas that gives us the exact wanted bit time
+    uint32_t qs;
+    for (qs = 25; qs > 8; qs--) {
+        uint32_t brp_rem = bit_clocks % qs;
+        if (brp_rem == 0)
+            break;
+    }
+    uint32_t brp       = bit_clocks / qs;
+    uint32_t time_seg2 = qs / 4; // sample at ~75%
+    uint32_t time_seg1 = qs - (1 + time_seg2);
+    uint32_t sjw       = time_seg2;
+
+    return (((uint32_t)(sjw-1)) << FDCAN_DBTP_DSJW_Pos
+            | ((uint32_t)(time_seg1-1)) << FDCAN_DBTP_DTSEG1_Pos
+            | ((uint32_t)(time_seg2-1)) << FDCAN_DBTP_DTSEG2_Pos
+            | ((uint32_t)(brp - 1)) << FDCAN_DBTP_DBRP_Pos);
+}
+
+// Setup CAN FD mode (with bit rate switching)
+static void
+can_fd_init(uint32_t pclock)
+{
+    uint32_t dbtp = compute_dbtp(pclock, CONFIG_CANBUS_FD_FREQUENCY);
+    if (CONFIG_CANBUS_FD_FREQUENCY > 1000000) {
+        // Enable transmitter delay compensation at the sample point
+        uint32_t brp = ((dbtp & FDCAN_DBTP_DBRP_Msk)
+                        >> FDCAN_DBTP_DBRP_Pos) + 1;
+        uint32_t seg1 = ((dbtp & FDCAN_DBTP_DTSEG1_Msk)
+                         >> FDCAN_DBTP_DTSEG1_Pos) + 1;
+        uint32_t tdco = brp * (seg1 + 1);
+        SOC_CAN->TDCR = (tdco > 127 ? 127 : tdco) << FDCAN_TDCR_TDCO_Pos;
+        dbtp |= FDCAN_DBTP_TDC;
+    }
+    SOC_CAN->DBTP = dbtp;
+    SOC_CAN->CCCR |= FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE;
+}
+
 void
 can_init(void)
 {
@@ -300,6 +359,9 @@ can_init(void)
 
     SOC_CAN->NBTP = btr;
 
+    if (CONFIG_CANBUS_FD)
+        can_fd_init(pclock);
+
 #if CONFIG_MACH_STM32H7
     /* Setup message RAM addresses */
     uint32_t f0sa = (uint32_t)MSG_RAM.RXF0 - SRAMCAN_BASE;
@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include "autoconf.h" // CONFIG_MACH_STM32F1
+#include "board/armcm_boot.h" // armcm_enable_irq
 #include "board/misc.h" // timer_is_before
 #include "command.h" // shutdown
 #include "gpio.h" // i2c_setup
@@ -62,6 +63,8 @@ i2c_busy_errata(uint8_t scl_pin, uint8_t sda_pin)
     gpio_peripheral(sda_pin, GPIO_OUTPUT | GPIO_OPEN_DRAIN, 1);
 }
 
+static void i2c_async_enable_irq(I2C_TypeDef *i2c);
+
 struct i2c_config
 i2c_setup(uint32_t bus, uint32_t rate, uint8_t addr)
 {
@@ -86,6 +89,8 @@ i2c_setup(uint32_t bus, uint32_t rate, uint8_t addr)
         i2c->CCR = pclk / 100000 / 2;
         i2c->TRISE = (pclk / 1000000) + 1;
         i2c->CR1 = I2C_CR1_PE;
+
+        i2c_async_enable_irq(i2c);
     }
 
     return (struct i2c_config){ .i2c=i2c, .addr=addr<<1 };
@@ -188,3 +193,208 @@ i2c_read(struct i2c_config config, uint8_t reg_len, uint8_t *reg
 
     return I2C_BUS_SUCCESS;
 }
+
+
+/****************************************************************
+ * Interrupt driven transfers
+ ****************************************************************/
+
+#if CONFIG_GPIO_I2C_ASYNC
+
+// The generic i2ccmds.c code only runs one transfer at a time
+static struct {
+    I2C_TypeDef *i2c;
+    struct i2c_xfer *x;
+    struct timer timeout;
+    uint8_t addr, state, pos;
+} i2c_async;
+
+enum { IS_ADDR_W, IS_WRITE, IS_ADDR_R, IS_READ };
+
+#define I2C_CR2_IRQS (I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_ITERREN)
+
+// Stop interrupt processing and report the result of the transfer
+static void
+i2c_async_finish(int ret)
+{
+    I2C_TypeDef *i2c = i2c_async.i2c;
+    i2c->CR2 &= ~I2C_CR2_IRQS;
+    struct i2c_xfer *x = i2c_async.x;
+    i2c_async.x = NULL;
+    i2c_async_done(x, ret);
+}
+
+static void
+i2c_async_complete(int ret)
+{
+    sched_del_timer(&i2c_async.timeout);
+    i2c_async_finish(ret);
+}
+
+// Handle i2c event interrupts
+void __visible
+I2Cx_EV_IRQHandler(void)
+{
+    I2C_TypeDef *i2c = i2c_async.i2c;
+    struct i2c_xfer *x = i2c_async.x;
+    if (!x) {
+        i2c->CR2 &= ~I2C_CR2_IRQS;
+        return;
+    }
+    uint32_t sr1 = i2c->SR1;
+    uint_fast8_t state = i2c_async.state;
+    if (sr1 & I2C_SR1_SB) {
+        // Start condition sent - send address
+        if (state == IS_ADDR_R) {
+            i2c->DR = i2c_async.addr | 0x01;
+            i2c->CR1 |= I2C_CR1_ACK;
+        } else {
+            i2c->DR = i2c_async.addr;
+        }
+    } else if (sr1 & I2C_SR1_ADDR) {
+        // Address acknowledged
+        irqstatus_t flag = irq_save();
+        uint32_t sr2 = i2c->SR2;
+        if (state == IS_ADDR_R && x->data_len == 1)
+            i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+        irq_restore(flag);
+        if (!(sr2 & I2C_SR2_MSL)) {
+            i2c_async_complete(state == IS_ADDR_R ? I2C_BUS_START_READ_NACK
+                               : I2C_BUS_START_NACK);
+            return;
+        }
+        i2c_async.state = state == IS_ADDR_R ? IS_READ : IS_WRITE;
+        i2c_async.pos = 0;
+        i2c->CR2 |= I2C_CR2_ITBUFEN;
+    } else if (state == IS_READ && sr1 & I2C_SR1_RXNE) {
+        // Byte received
+        uint_fast8_t pos = i2c_async.pos;
+        irqstatus_t flag = irq_save();
+        uint8_t b = i2c->DR;
+        if (x->data_len - pos == 2)
+            i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+        irq_restore(flag);
+        x->data[pos++] = b;
+        i2c_async.pos = pos;
+        if (pos >= x->data_len)
+            i2c_async_complete(I2C_BUS_SUCCESS);
+    } else if (state == IS_WRITE && sr1 & I2C_SR1_TXE) {
+        // Transmit buffer empty - send next byte
+        uint_fast8_t is_read = x->flags & IXF_READ;
+        uint_fast8_t len = is_read ? x->reg_len : x->data_len;
+        uint8_t *buf = is_read ? x->reg : x->data;
+        uint_fast8_t pos = i2c_async.pos;
+        if (pos < len) {
+            i2c->DR = buf[pos];
+            i2c_async.pos = pos + 1;
+            return;
+        }
+        i2c->CR2 &= ~I2C_CR2_ITBUFEN;
+        if (is_read) {
+            // Register sent - send re-start to read data
+            i2c_async.state = IS_ADDR_R;
+            i2c->CR1 = I2C_CR1_START | I2C_CR1_PE;
+            return;
+        }
+        i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+        i2c_async_complete(I2C_BUS_SUCCESS);
+    }
+}
+
+// Handle i2c error interrupts
+void __visible
+I2Cx_ER_IRQHandler(void)
+{
+    I2C_TypeDef *i2c = i2c_async.i2c;
+    uint32_t sr1 = i2c->SR1;
+    uint32_t errors = sr1 & (I2C_SR1_AF | I2C_SR1_ARLO | I2C_SR1_BERR
+                             | I2C_SR1_OVR);
+    i2c->SR1 = ~errors & 0xffff;
+    if (!i2c_async.x) {
+        i2c->CR2 &= ~I2C_CR2_IRQS;
+        return;
+    }
+    i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+    uint_fast8_t state = i2c_async.state;
+    int ret = I2C_BUS_NACK;
+    if (state == IS_ADDR_W)
+        ret = I2C_BUS_START_NACK;
+    else if (state == IS_ADDR_R)
+        ret = I2C_BUS_START_READ_NACK;
+    i2c_async_complete(ret);
+}
+
+// Abort a transfer that did not complete in time
+static uint_fast8_t
+i2c_async_timeout(struct timer *t)
+{
+    if (i2c_async.x) {
+        i2c_async.i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+        i2c_async_finish(I2C_BUS_TIMEOUT);
+    }
+    return SF_DONE;
+}
+
+static void
+i2c_async_enable_irq(I2C_TypeDef *i2c)
+{
+    if (i2c == I2C1) {
+        armcm_enable_irq(I2Cx_EV_IRQHandler, I2C1_EV_IRQn, TIMER_PRIO);
+        armcm_enable_irq(I2Cx_ER_IRQHandler, I2C1_ER_IRQn, TIMER_PRIO);
+    } else if (i2c == I2C2) {
+        armcm_enable_irq(I2Cx_EV_IRQHandler, I2C2_EV_IRQn, TIMER_PRIO);
+        armcm_enable_irq(I2Cx_ER_IRQHandler, I2C2_ER_IRQn, TIMER_PRIO);
+#if CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4
+    } else if (i2c == I2C3) {
+        armcm_enable_irq(I2Cx_EV_IRQHandler, I2C3_EV_IRQn, TIMER_PRIO);
+        armcm_enable_irq(I2Cx_ER_IRQHandler, I2C3_ER_IRQn, TIMER_PRIO);
+#endif
+    }
+}
+
+// Start an interrupt driven transfer
+void
+i2c_async_start(struct i2c_config config, struct i2c_xfer *x)
+{
+    I2C_TypeDef *i2c = config.i2c;
+    uint32_t timeout = timer_read_time() + timer_from_us(5000);
+
+    // Wait for any prior stop condition to complete
+    while (i2c->CR1 & I2C_CR1_STOP)
+        if (!timer_is_before(timer_read_time(), timeout))
+            shutdown("i2c timeout");
+
+    irq_disable();
+    i2c_async.i2c = i2c;
+    i2c_async.x = x;
+    i2c_async.addr = config.addr;
+    i2c_async.state = (x->flags & IXF_READ && !x->reg_len
+                       ? IS_ADDR_R : IS_ADDR_W);
+    i2c_async.timeout.func = i2c_async_timeout;
+    i2c_async.timeout.waketime = timeout;
+    sched_add_timer(&i2c_async.timeout);
+    i2c->CR2 = (i2c->CR2 & ~I2C_CR2_IRQS) | I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+    i2c->CR1 = I2C_CR1_START | I2C_CR1_PE;
+    irq_enable();
+}
+
+// Abort any active transfer on a shutdown
+void
+i2c_hw_shutdown(void)
+{
+    if (!i2c_async.x)
+        return;
+    i2c_async.i2c->CR2 &= ~I2C_CR2_IRQS;
+    i2c_async.i2c->CR1 = I2C_CR1_STOP | I2C_CR1_PE;
+    i2c_async.x = NULL;
+}
+DECL_SHUTDOWN(i2c_hw_shutdown);
+
+#else
+
+static void
+i2c_async_enable_irq(I2C_TypeDef *i2c)
+{
+}
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/serial_irq.h" // serial_rx_byte
 #include "command.h" // DECL_CONSTANT_STR
 #include "internal.h" // enable_pclock
@@ -50,6 +51,128 @@
   #define USARTx_IRQn USART3_IRQn
 #endif
 
+#if CONFIG_SERIAL_DMA
+
+// Select the dma streams (on channel 4) of the configured serial port
+#if CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+  #define DMAx DMA2
+  #define DMAx_EN RCC_AHB1ENR_DMA2EN
+  #define RX_DMA DMA2_Stream2
+  #define RX_DMA_NUM 2
+  #define RX_DMA_IRQn DMA2_Stream2_IRQn
+  #define TX_DMA DMA2_Stream7
+  #define TX_DMA_NUM 7
+#elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+  #define DMAx DMA1
+  #define DMAx_EN RCC_AHB1ENR_DMA1EN
+  #define RX_DMA DMA1_Stream5
+  #define RX_DMA_NUM 5
+  #define RX_DMA_IRQn DMA1_Stream5_IRQn
+  #define TX_DMA DMA1_Stream6
+  #define TX_DMA_NUM 6
+#else
+  #define DMAx DMA1
+  #define DMAx_EN RCC_AHB1ENR_DMA1EN
+  #define RX_DMA DMA1_Stream1
+  #define RX_DMA_NUM 1
+  #define RX_DMA_IRQn DMA1_Stream1_IRQn
+  #define TX_DMA DMA1_Stream3
+  #define TX_DMA_NUM 3
+#endif
+
+#define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
+                   | USART_CR1_IDLEIE)
+#define DMA_CHSEL (4 << DMA_SxCR_CHSEL_Pos)
+
+static uint8_t rx_dma_buf[64];
+
+// Clear the interrupt flags of a dma stream
+static void
+dma_clear_flags(uint32_t num)
+{
+    uint32_t flags = 0x3d << ((num & 2 ? 16 : 0) + (num & 1 ? 6 : 0));
+    if (num < 4)
+        DMAx->LIFCR = flags;
+    else
+        DMAx->HIFCR = flags;
+}
+
+// Pass any data written by the rx dma stream to the generic code
+static void
+rx_dma_flush(void)
+{
+    serial_rx_dma(rx_dma_buf, sizeof(rx_dma_buf)
+                  , sizeof(rx_dma_buf) - RX_DMA->NDTR);
+}
+
+// Start a dma transfer of pending transmit data
+static void
+tx_dma_start(void)
+{
+    uint8_t *data;
+    uint_fast8_t len = serial_get_tx_data(&data);
+    if (!len)
+        return;
+    dma_clear_flags(TX_DMA_NUM);
+    TX_DMA->M0AR = (uint32_t)data;
+    TX_DMA->NDTR = len;
+    USARTx->SR = ~USART_SR_TC;
+    TX_DMA->CR = DMA_CHSEL | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_EN;
+    USARTx->CR1 = CR1_FLAGS | USART_CR1_TCIE;
+}
+
+// Rx dma half and full transfer interrupt
+void
+USARTx_DMA_IRQHandler(void)
+{
+    dma_clear_flags(RX_DMA_NUM);
+    rx_dma_flush();
+}
+
+void
+USARTx_IRQHandler(void)
+{
+    uint32_t sr = USARTx->SR;
+    if (sr & (USART_SR_IDLE | USART_SR_ORE)) {
+        // The IDLE and ORE flags are automatically cleared by reading
+        // SR, followed by reading DR.
+        USARTx->DR;
+        rx_dma_flush();
+    }
+    if (sr & USART_SR_TC && USARTx->CR1 & USART_CR1_TCIE) {
+        USARTx->CR1 = CR1_FLAGS;
+        serial_tx_data_done();
+        tx_dma_start();
+    }
+}
+
+void
+serial_enable_tx_irq(void)
+{
+    irqstatus_t flag = irq_save();
+    if (!(USARTx->CR1 & USART_CR1_TCIE))
+        tx_dma_start();
+    irq_restore(flag);
+}
+
+static void
+serial_dma_init(void)
+{
+    RCC->AHB1ENR |= DMAx_EN;
+    RCC->AHB1ENR;
+    RX_DMA->PAR = (uint32_t)&USARTx->DR;
+    RX_DMA->M0AR = (uint32_t)rx_dma_buf;
+    RX_DMA->NDTR = sizeof(rx_dma_buf);
+    dma_clear_flags(RX_DMA_NUM);
+    RX_DMA->CR = (DMA_CHSEL | DMA_SxCR_MINC | DMA_SxCR_CIRC
+                  | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN);
+    TX_DMA->PAR = (uint32_t)&USARTx->DR;
+    USARTx->CR3 = USART_CR3_DMAR | USART_CR3_DMAT;
+    armcm_enable_irq(USARTx_DMA_IRQHandler, RX_DMA_IRQn, 0);
+}
+
+#else // !CONFIG_SERIAL_DMA
+
 #define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
                    | USART_CR1_RXNEIE)
 
@@ -78,6 +201,8 @@ serial_enable_tx_irq(void)
     USARTx->CR1 = CR1_FLAGS | USART_CR1_TXEIE;
 }
 
+#endif
+
 void
 serial_init(void)
 {
@@ -87,6 +212,9 @@ serial_init(void)
     uint32_t div = DIV_ROUND_CLOSEST(pclk, CONFIG_SERIAL_BAUD);
     USARTx->BRR = (((div / 16) << USART_BRR_DIV_Mantissa_Pos)
                    | ((div % 16) << USART_BRR_DIV_Fraction_Pos));
+#if CONFIG_SERIAL_DMA
+    serial_dma_init();
+#endif
     USARTx->CR1 = CR1_FLAGS;
     armcm_enable_irq(USARTx_IRQHandler, USARTx_IRQn, 0);
 
@@ -4,11 +4,15 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_GPIO_SPI_ASYNC
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/io.h" // readb, writeb
 #include "command.h" // shutdown
 #include "gpio.h" // spi_setup
 #include "internal.h" // gpio_peripheral
 #include "sched.h" // sched_shutdown
+#include "spicmds.h" // spi_async_done
 
 struct spi_info {
     SPI_TypeDef *spi;
@@ -148,3 +152,165 @@ spi_transfer(struct spi_config config, uint8_t receive_data,
     while ((spi->SR & (SPI_SR_TXE|SPI_SR_BSY)) != SPI_SR_TXE)
         ;
 }
+
+
+/****************************************************************
+ * DMA transfers
+ ****************************************************************/
+
+#if CONFIG_GPIO_SPI_ASYNC
+
+struct spi_dma_info {
+    SPI_TypeDef *spi;
+    DMA_TypeDef *dma;
+    DMA_Stream_TypeDef *rx_stream, *tx_stream;
+    uint8_t rx_num, tx_num, chsel;
+};
+
+#define SPI2_DMA_CONFLICT (CONFIG_SERIAL_DMA                           \
+    && (CONFIG_STM32_SERIAL_USART3 || CONFIG_STM32_SERIAL_USART3_ALT_PD9_PD8 \
+        || CONFIG_STM32_SERIAL_USART3_ALT_PC11_PC10))
+
+// The hardware step timers use the same dma streams as spi3
+#define SPI3_DMA_CONFLICT CONFIG_STEPPER_TIMER
+
+// The dma streams of each spi (streams used by the serial dma code
+// are avoided)
+static const struct spi_dma_info spi_dma[] = {
+    { SPI1, DMA2, DMA2_Stream0, DMA2_Stream3, 0, 3, 3 },
+#if !SPI2_DMA_CONFLICT
+    { SPI2, DMA1, DMA1_Stream3, DMA1_Stream4, 3, 4, 0 },
+#endif
+#if defined(SPI3) && !SPI3_DMA_CONFLICT
+    { SPI3, DMA1, DMA1_Stream0, DMA1_Stream7, 0, 7, 0 },
+#endif
+};
+
+static const struct spi_dma_info *spi_dma_active;
+static struct spi_xfer *spi_dma_xfer;
+static uint8_t spi_dma_dummy;
+
+#define DMA_TCIF 0x20
+#define DMA_TEIF 0x08
+
+static uint32_t
+dma_flag_shift(uint32_t num)
+{
+    return (num & 2 ? 16 : 0) + (num & 1 ? 6 : 0);
+}
+
+// Read the interrupt flags of a dma stream
+static uint32_t
+dma_get_flags(DMA_TypeDef *dma, uint32_t num)
+{
+    return (num < 4 ? dma->LISR : dma->HISR) >> dma_flag_shift(num);
+}
+
+// Clear the interrupt flags of a dma stream
+static void
+dma_clear_flags(DMA_TypeDef *dma, uint32_t num)
+{
+    uint32_t flags = 0x3d << dma_flag_shift(num);
+    if (num < 4)
+        dma->LIFCR = flags;
+    else
+        dma->HIFCR = flags;
+}
+
+// Complete the active transfer if its rx dma stream has finished
+static void
+spi_dma_check(void)
+{
+    const struct spi_dma_info *d = spi_dma_active;
+    if (!d || !(dma_get_flags(d->dma, d->rx_num) & (DMA_TCIF | DMA_TEIF)))
+        return;
+    SPI_TypeDef *spi = d->spi;
+    while (spi->SR & SPI_SR_BSY)
+        ;
+    spi->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+    d->rx_stream->CR = 0;
+    d->tx_stream->CR = 0;
+    dma_clear_flags(d->dma, d->rx_num);
+    dma_clear_flags(d->dma, d->tx_num);
+    struct spi_xfer *x = spi_dma_xfer;
+    spi_dma_active = NULL;
+    spi_dma_xfer = NULL;
+    spi_async_done(x);
+}
+
+void
+SPIx_DMA_IRQHandler(void)
+{
+    spi_dma_check();
+}
+
+void
+spi_dma_init(void)
+{
+    armcm_enable_irq(SPIx_DMA_IRQHandler, DMA2_Stream0_IRQn, 2);
+#if !SPI2_DMA_CONFLICT
+    armcm_enable_irq(SPIx_DMA_IRQHandler, DMA1_Stream3_IRQn, 2);
+#endif
+#if defined(SPI3) && !SPI3_DMA_CONFLICT
+    armcm_enable_irq(SPIx_DMA_IRQHandler, DMA1_Stream0_IRQn, 2);
+#endif
+}
+DECL_INIT(spi_dma_init);
+
+// Start a dma transfer (returns non-zero if dma is not available)
+int
+spi_async_start(struct spi_config config, struct spi_xfer *x)
+{
+    const struct spi_dma_info *d = spi_dma;
+    for (;;) {
+        if (d >= &spi_dma[ARRAY_SIZE(spi_dma)])
+            return -1;
+        if (d->spi == config.spi)
+            break;
+        d++;
+    }
+    // The dma controller can not access the ccm ram
+    if (!x->data_len || (uint32_t)x->data < SRAM1_BASE)
+        return -1;
+    if (!is_enabled_pclock((uint32_t)d->dma))
+        enable_pclock((uint32_t)d->dma);
+
+    SPI_TypeDef *spi = d->spi;
+    while (spi->SR & SPI_SR_RXNE)
+        spi->DR;
+    uint32_t chsel = d->chsel << DMA_SxCR_CHSEL_Pos, rx_minc = 0;
+    dma_clear_flags(d->dma, d->rx_num);
+    dma_clear_flags(d->dma, d->tx_num);
+    DMA_Stream_TypeDef *rx = d->rx_stream, *tx = d->tx_stream;
+    rx->PAR = (uint32_t)&spi->DR;
+    rx->NDTR = x->data_len;
+    if (x->flags & SXF_RECEIVE) {
+        rx->M0AR = (uint32_t)x->data;
+        rx_minc = DMA_SxCR_MINC;
+    } else {
+        rx->M0AR = (uint32_t)&spi_dma_dummy;
+    }
+    tx->PAR = (uint32_t)&spi->DR;
+    tx->M0AR = (uint32_t)x->data;
+    tx->NDTR = x->data_len;
+
+    irqstatus_t flag = irq_save();
+    spi_dma_active = d;
+    spi_dma_xfer = x;
+    rx->CR = chsel | rx_minc | DMA_SxCR_TCIE | DMA_SxCR_TEIE | DMA_SxCR_EN;
+    tx->CR = chsel | DMA_SxCR_MINC | DMA_SxCR_DIR_0 | DMA_SxCR_EN;
+    spi->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+    irq_restore(flag);
+    return 0;
+}
+
+// Check for completion of a dma transfer (may be called with irqs off)
+void
+spi_async_poll(struct spi_config config, struct spi_xfer *x)
+{
+    irqstatus_t flag = irq_save();
+    spi_dma_check();
+    irq_restore(flag);
+}
+
+#endif // CONFIG_GPIO_SPI_ASYNC
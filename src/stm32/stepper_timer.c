@@ -0,0 +1,364 @@
+// Hardware timer step pulse generation on stm32f4
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// A stepper using this code has its step pin driven by a 32bit timer
+// channel in pwm mode.  Each timer update event produces one step
+// pulse and the dma controller loads the period until the following
+// step from a ring of precalculated periods.  The ring is refilled
+// (from the stepper's move queue) on the half and full transfer
+// interrupts, so the cpu is only interrupted once every 16 steps.  A
+// "run" of steps ends when the move queue is empty or the direction
+// changes - the stepper code is then notified from a regular timer.
+
+#include "autoconf.h" // CONFIG_CLOCK_FREQ
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "board/misc.h" // timer_read_time
+#include "command.h" // shutdown
+#include "gpio.h" // step_timer_setup
+#include "internal.h" // GPIO
+#include "sched.h" // sched_add_timer
+#include "stepper.h" // stepper_timer_fill
+
+DECL_CONSTANT_STR("STEPPER_TIMER_PINS"
+                  , "PA0,PA1,PA2,PA3,PA5,PA15,PB3,PB10,PB11");
+
+#define RING_SIZE 32
+#define IDLE_PERIOD 0xffffffff
+#define START_TICKS (CONFIG_CLOCK_FREQ / 500000)
+#define DMA_CHSEL(c) ((c) << DMA_SxCR_CHSEL_Pos)
+#define DMA_SHIFT(n) (((n) & 2 ? 16 : 0) + ((n) & 1 ? 6 : 0))
+#define DMA_FLAG_HT(n) (0x10 << DMA_SHIFT(n))
+#define DMA_FLAG_TC(n) (0x20 << DMA_SHIFT(n))
+#define DMA_FLAG_ALL(n) (0x3d << DMA_SHIFT(n))
+
+struct step_timer_info {
+    TIM_TypeDef *timer;
+    DMA_Stream_TypeDef *dma;
+    uint8_t dma_num, dma_channel;
+    IRQn_Type dma_irqn;
+};
+
+// The dma streams are selected to not conflict with serial dma
+static const struct step_timer_info step_timers[] = {
+    {TIM2, DMA1_Stream7, 7, 3, DMA1_Stream7_IRQn},
+    {TIM5, DMA1_Stream0, 0, 6, DMA1_Stream0_IRQn},
+};
+
+struct step_timer_pin {
+    uint8_t pin, timer, channel, function;
+};
+
+static const struct step_timer_pin step_timer_pins[] = {
+    {GPIO('A', 0), 1, 1, GPIO_FUNCTION(2)},
+    {GPIO('A', 1), 1, 2, GPIO_FUNCTION(2)},
+    {GPIO('A', 2), 1, 3, GPIO_FUNCTION(2)},
+    {GPIO('A', 3), 1, 4, GPIO_FUNCTION(2)},
+    {GPIO('A', 5), 0, 1, GPIO_FUNCTION(1)},
+    {GPIO('A', 15), 0, 1, GPIO_FUNCTION(1)},
+    {GPIO('B', 3), 0, 2, GPIO_FUNCTION(1)},
+    {GPIO('B', 10), 0, 3, GPIO_FUNCTION(1)},
+    {GPIO('B', 11), 0, 4, GPIO_FUNCTION(1)},
+};
+
+struct step_timer {
+    struct timer done_timer;
+    const struct step_timer_info *info;
+    struct stepper *stepper;
+    volatile uint32_t *ccmr;
+    uint32_t ocm_shift, min_period, pulse_ticks;
+    // Run state
+    uint32_t last_time, gen_count, tc_count;
+    uint8_t frac, active, ending;
+    uint32_t ring[RING_SIZE];
+};
+
+static struct step_timer step_timer_data[ARRAY_SIZE(step_timers)];
+
+// Set the output compare mode of the step channel
+static void
+channel_set_mode(struct step_timer *st, uint32_t mode)
+{
+    uint32_t mask = TIM_CCMR1_OC1M << st->ocm_shift;
+    *st->ccmr = (*st->ccmr & ~mask) | (mode << st->ocm_shift);
+}
+
+#define OCM_FORCE_INACTIVE TIM_CCMR1_OC1M_2
+#define OCM_PWM1 (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1)
+
+// Convert the time of the next step to a timer period.  The timer
+// counts at half the mcu clock - the low bit is carried to the next
+// period so that step times do not drift.
+static uint32_t
+step_period(struct step_timer *st, uint32_t time)
+{
+    uint32_t ticks = time - st->last_time + st->frac;
+    st->last_time = time;
+    st->frac = ticks & 1;
+    uint32_t period = (ticks >> 1) - 1;
+    if (period < st->min_period)
+        // Step closer than the pulse duration - push it back
+        period = st->min_period;
+    return period;
+}
+
+// Fill 'count' entries of 'periods' with upcoming step periods
+static void
+step_timer_fill(struct step_timer *st, uint32_t *periods, uint_fast8_t count)
+{
+    if (!st->ending) {
+        uint_fast8_t i, n = stepper_timer_fill(st->stepper, periods, count);
+        for (i=0; i<n; i++)
+            periods[i] = step_period(st, periods[i]);
+        st->gen_count += n;
+        periods += n;
+        count -= n;
+        if (!count)
+            return;
+        // End of this run - notify stepper code after the last pulse
+        st->ending = 1;
+        st->done_timer.waketime = (st->last_time + st->pulse_ticks
+                                   + START_TICKS);
+    }
+    while (count--)
+        *periods++ = IDLE_PERIOD;
+}
+
+// Return the dma interrupt status flags of the step timer
+static uint32_t
+step_timer_dma_flags(struct step_timer *st)
+{
+    return st->info->dma_num < 4 ? DMA1->LISR : DMA1->HISR;
+}
+
+// Clear dma interrupt status flags of the step timer
+static void
+step_timer_dma_clear(struct step_timer *st, uint32_t flags)
+{
+    if (st->info->dma_num < 4)
+        DMA1->LIFCR = flags;
+    else
+        DMA1->HIFCR = flags;
+}
+
+// Stop the timer and disable the pulse output
+static void
+step_timer_halt(struct step_timer *st)
+{
+    const struct step_timer_info *ti = st->info;
+    ti->timer->CR1 = TIM_CR1_ARPE;
+    ti->timer->DIER = 0;
+    channel_set_mode(st, OCM_FORCE_INACTIVE);
+}
+
+// Disable the dma stream (after the timer has been halted)
+static void
+step_timer_dma_disable(struct step_timer *st)
+{
+    const struct step_timer_info *ti = st->info;
+    ti->dma->CR = 0;
+    while (ti->dma->CR & DMA_SxCR_EN)
+        ;
+    step_timer_dma_clear(st, DMA_FLAG_ALL(ti->dma_num));
+    st->active = 0;
+}
+
+// Start a run of steps (caller must disable irqs).  Returns non-zero
+// if the run is already fully generated (done_timer must be scheduled).
+static uint_fast8_t
+step_timer_run(struct step_timer *st)
+{
+    const struct step_timer_info *ti = st->info;
+    TIM_TypeDef *tim = ti->timer;
+    uint32_t first;
+    stepper_timer_fill(st->stepper, &first, 1);
+    uint32_t now = timer_read_time(), min_time = now + START_TICKS;
+    if (timer_is_before(first, min_time)) {
+        if ((int32_t)(first - min_time) < (int32_t)-timer_from_us(1000))
+            shutdown("Stepper too far in past");
+        first = min_time;
+    }
+    st->last_time = first;
+    st->frac = st->ending = 0;
+    st->gen_count = 1;
+    st->tc_count = 0;
+    st->active = 1;
+
+    // Load the period following the first step and fill the dma ring
+    uint32_t preload;
+    step_timer_fill(st, &preload, 1);
+    step_timer_fill(st, st->ring, RING_SIZE);
+    tim->CR1 = TIM_CR1_ARPE;
+    tim->ARR = IDLE_PERIOD;
+    tim->EGR = TIM_EGR_UG;
+    tim->ARR = preload;
+    tim->SR = 0;
+
+    // Setup the dma ring for the timer's auto-reload register
+    ti->dma->PAR = (uint32_t)&tim->ARR;
+    ti->dma->M0AR = (uint32_t)st->ring;
+    ti->dma->NDTR = RING_SIZE;
+    ti->dma->CR = (DMA_CHSEL(ti->dma_channel) | DMA_SxCR_MSIZE_1
+                   | DMA_SxCR_PSIZE_1 | DMA_SxCR_MINC | DMA_SxCR_CIRC
+                   | DMA_SxCR_DIR_0 | DMA_SxCR_HTIE | DMA_SxCR_TCIE
+                   | DMA_SxCR_EN);
+    tim->DIER = TIM_DIER_UDE;
+    channel_set_mode(st, OCM_PWM1);
+
+    // Start counting so that the first update event occurs at 'first'
+    now = timer_read_time();
+    tim->CNT = -((first - now) >> 1);
+    tim->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+    return st->ending;
+}
+
+// Start stepping (caller must disable irqs)
+void
+step_timer_start(struct step_timer *st)
+{
+    if (step_timer_run(st))
+        sched_add_timer(&st->done_timer);
+}
+
+// Report the number of generated steps not yet taken (caller must
+// disable irqs)
+uint32_t
+step_timer_pending(struct step_timer *st)
+{
+    if (!st->active)
+        return 0;
+    DMA_Stream_TypeDef *dma = st->info->dma;
+    uint32_t tc_flag = DMA_FLAG_TC(st->info->dma_num), ndtr, tc;
+    for (;;) {
+        ndtr = dma->NDTR;
+        tc = step_timer_dma_flags(st) & tc_flag ? 1 : 0;
+        if (ndtr == dma->NDTR)
+            break;
+    }
+    uint32_t done = (st->tc_count + tc) * RING_SIZE + RING_SIZE - ndtr;
+    if (done > st->gen_count)
+        return 0;
+    return st->gen_count - done;
+}
+
+// Stop stepping and return the number of steps not taken (caller
+// must disable irqs)
+uint32_t
+step_timer_stop(struct step_timer *st)
+{
+    sched_del_timer(&st->done_timer);
+    step_timer_halt(st);
+    uint32_t pending = step_timer_pending(st);
+    step_timer_dma_disable(st);
+    return pending;
+}
+
+// Timer event after the last step of a run
+static uint_fast8_t
+step_timer_event(struct timer *t)
+{
+    struct step_timer *st = container_of(t, struct step_timer, done_timer);
+    step_timer_halt(st);
+    step_timer_dma_disable(st);
+    if (!stepper_timer_next(st->stepper) || !step_timer_run(st))
+        return SF_DONE;
+    return SF_RESCHEDULE;
+}
+
+// Refill the half of the dma ring that was just transferred
+static void
+step_timer_dma_irq(struct step_timer *st)
+{
+    irqstatus_t flag = irq_save();
+    uint32_t num = st->info->dma_num;
+    uint32_t isr = step_timer_dma_flags(st);
+    step_timer_dma_clear(st, isr & (DMA_FLAG_HT(num) | DMA_FLAG_TC(num)));
+    if (st->active) {
+        uint_fast8_t was_ending = st->ending;
+        if (isr & DMA_FLAG_HT(num))
+            step_timer_fill(st, st->ring, RING_SIZE / 2);
+        if (isr & DMA_FLAG_TC(num)) {
+            st->tc_count++;
+            step_timer_fill(st, &st->ring[RING_SIZE / 2], RING_SIZE / 2);
+        }
+        if (st->ending && !was_ending)
+            sched_add_timer(&st->done_timer);
+    }
+    irq_restore(flag);
+}
+
+void
+step_timer0_irq(void)
+{
+    step_timer_dma_irq(&step_timer_data[0]);
+}
+
+void
+step_timer1_irq(void)
+{
+    step_timer_dma_irq(&step_timer_data[1]);
+}
+
+// Configure a step pin for hardware timer step generation
+struct step_timer *
+step_timer_setup(uint8_t pin, uint8_t invert, uint32_t pulse_ticks
+                 , struct stepper *s)
+{
+    // Find pin in step_timer_pins table
+    const struct step_timer_pin *p = step_timer_pins;
+    for (;; p++) {
+        if (p >= &step_timer_pins[ARRAY_SIZE(step_timer_pins)])
+            shutdown("Not a valid step timer pin");
+        if (p->pin == pin)
+            break;
+    }
+    struct step_timer *st = &step_timer_data[p->timer];
+    const struct step_timer_info *ti = &step_timers[p->timer];
+    TIM_TypeDef *tim = ti->timer;
+    if (st->stepper || (is_enabled_pclock((uint32_t)tim)
+                        && tim->CR1 & TIM_CR1_CEN))
+        shutdown("Step timer already in use");
+
+    // The timer runs at half the mcu clock
+    enable_pclock((uint32_t)tim);
+    uint32_t pclk = get_pclock_frequency((uint32_t)tim);
+    uint32_t tclk = pclk < CONFIG_CLOCK_FREQ ? pclk * 2 : pclk;
+    if (tclk == CONFIG_CLOCK_FREQ)
+        tim->PSC = 1;
+    else if (tclk * 2 == CONFIG_CLOCK_FREQ)
+        tim->PSC = 0;
+    else
+        shutdown("Unsupported step timer clock");
+    tim->CR1 = TIM_CR1_ARPE;
+    tim->ARR = IDLE_PERIOD;
+    tim->EGR = TIM_EGR_UG;
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+    RCC->AHB1ENR;
+
+    // Setup the output channel (active while counter is below CCR)
+    uint32_t ch = p->channel - 1, ccr = (pulse_ticks + 1) / 2;
+    if (!ccr)
+        ccr = 1;
+    st->ccmr = ch < 2 ? &tim->CCMR1 : &tim->CCMR2;
+    st->ocm_shift = ch & 1 ? 8 : 0;
+    st->min_period = ccr;
+    st->pulse_ticks = pulse_ticks;
+    (&tim->CCR1)[ch] = ccr;
+    channel_set_mode(st, OCM_FORCE_INACTIVE);
+    uint32_t ccer = TIM_CCER_CC1E | (invert ? TIM_CCER_CC1P : 0);
+    tim->CCER = (tim->CCER & ~((TIM_CCER_CC1E | TIM_CCER_CC1P) << (ch * 4)))
+                | (ccer << (ch * 4));
+    gpio_peripheral(p->pin, p->function, 0);
+
+    st->info = ti;
+    st->stepper = s;
+    st->done_timer.func = step_timer_event;
+    if (p->timer)
+        armcm_enable_irq(step_timer1_irq, ti->dma_irqn, 0);
+    else
+        armcm_enable_irq(step_timer0_irq, ti->dma_irqn, 0);
+    return st;
+}
@@ -6,6 +6,7 @@
 
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
 #include "board/serial_irq.h" // serial_rx_byte
 #include "command.h" // DECL_CONSTANT_STR
 #include "internal.h" // enable_pclock
@@ -132,6 +133,109 @@
   #define USART_ISR_TXE USART_ISR_TXE_TXFNF
 #endif
 
+#if CONFIG_SERIAL_DMA
+
+// Select the dmamux requests of the configured serial port
+#if CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+  #define RX_DMA_REQ 50
+  #define TX_DMA_REQ 51
+#elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+  #define RX_DMA_REQ 52
+  #define TX_DMA_REQ 53
+#else
+  #define RX_DMA_REQ 54
+  #define TX_DMA_REQ 55
+#endif
+
+// Dma channel 1 is used for rx and dma channel 2 for tx
+#define RX_DMA DMA1_Channel1
+#define RX_DMAMUX DMAMUX1_Channel0
+#define RX_DMA_IRQn DMA1_Channel1_IRQn
+#define TX_DMA DMA1_Channel2
+#define TX_DMAMUX DMAMUX1_Channel1
+
+#define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
+                   | USART_CR1_IDLEIE)
+
+static uint8_t rx_dma_buf[64];
+
+// Pass any data written by the rx dma channel to the generic code
+static void
+rx_dma_flush(void)
+{
+    serial_rx_dma(rx_dma_buf, sizeof(rx_dma_buf)
+                  , sizeof(rx_dma_buf) - RX_DMA->CNDTR);
+}
+
+// Start a dma transfer of pending transmit data
+static void
+tx_dma_start(void)
+{
+    uint8_t *data;
+    uint_fast8_t len = serial_get_tx_data(&data);
+    if (!len)
+        return;
+    TX_DMA->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    TX_DMA->CMAR = (uint32_t)data;
+    TX_DMA->CNDTR = len;
+    USARTx->ICR = USART_ICR_TCCF;
+    TX_DMA->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+    USARTx->CR1 = CR1_FLAGS | USART_CR1_TCIE;
+}
+
+// Rx dma half and full transfer interrupt
+void
+USARTx_DMA_IRQHandler(void)
+{
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    rx_dma_flush();
+}
+
+void
+USARTx_IRQHandler(void)
+{
+    uint32_t sr = USARTx->ISR;
+    if (sr & USART_ISR_IDLE) {
+        USARTx->ICR = USART_ICR_IDLECF;
+        rx_dma_flush();
+    }
+    if (sr & USART_ISR_TC && USARTx->CR1 & USART_CR1_TCIE) {
+        USARTx->CR1 = CR1_FLAGS;
+        serial_tx_data_done();
+        tx_dma_start();
+    }
+}
+
+void
+serial_enable_tx_irq(void)
+{
+    irqstatus_t flag = irq_save();
+    if (!(USARTx->CR1 & USART_CR1_TCIE))
+        tx_dma_start();
+    irq_restore(flag);
+}
+
+static void
+serial_dma_init(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    RCC->AHBENR;
+    RX_DMAMUX->CCR = RX_DMA_REQ;
+    TX_DMAMUX->CCR = TX_DMA_REQ;
+    RX_DMA->CPAR = (uint32_t)&USARTx->RDR;
+    RX_DMA->CMAR = (uint32_t)rx_dma_buf;
+    RX_DMA->CNDTR = sizeof(rx_dma_buf);
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    RX_DMA->CCR = (DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE
+                   | DMA_CCR_TCIE | DMA_CCR_EN);
+    TX_DMA->CPAR = (uint32_t)&USARTx->TDR;
+    USARTx->CR3 = USART_CR3_OVRDIS | USART_CR3_DMAR | USART_CR3_DMAT;
+    armcm_enable_irq(USARTx_DMA_IRQHandler, RX_DMA_IRQn, 0);
+}
+
+#else // !CONFIG_SERIAL_DMA
+
 #define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
                    | USART_CR1_RXNEIE)
 
@@ -157,6 +261,8 @@ serial_enable_tx_irq(void)
     USARTx->CR1 = CR1_FLAGS | USART_CR1_TXEIE;
 }
 
+#endif
+
 void
 serial_init(void)
 {
@@ -167,6 +273,9 @@ serial_init(void)
     USARTx->BRR = (((div / 16) << USART_BRR_DIV_MANTISSA_Pos)
                    | ((div % 16) << USART_BRR_DIV_FRACTION_Pos));
     USARTx->CR3 = USART_CR3_OVRDIS; // disable the ORE ISR
+#if CONFIG_SERIAL_DMA
+    serial_dma_init();
+#endif
     USARTx->CR1 = CR1_FLAGS;
     armcm_enable_irq(USARTx_IRQHandler, USARTx_IRQn, 0);
 
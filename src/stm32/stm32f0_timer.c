@@ -120,7 +120,7 @@ timer_init(void)
     TIMx->CNT = 0;
     TIMx->DIER = TIM_DIER_CC1IE;
     TIMx->CCER = TIM_CCER_CC1E;
-    armcm_enable_irq(TIMx_IRQHandler, TIMx_IRQn, 2);
+    armcm_enable_irq(TIMx_IRQHandler, TIMx_IRQn, TIMER_PRIO);
     timer_kick();
     timer_reset();
     TIMx->CR1 = TIM_CR1_CEN;
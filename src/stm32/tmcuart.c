@@ -0,0 +1,247 @@
+// Half-duplex usart support for tmcuart on stm32
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_MACH_STM32F401
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_save
+#include "command.h" // shutdown
+#include "internal.h" // GPIO
+#include "sched.h" // sched_shutdown
+#include "tmcuart.h" // tmcuart_hw_setup
+
+struct tmcuart_bus {
+    USART_TypeDef *usart;
+    uint8_t tx_pin, function, index;
+};
+
+#define TB_USART1 0
+#define TB_USART2 1
+#define TB_USART6 2
+#define TB_USART3 3
+#define TB_UART4 4
+#define TB_UART5 5
+
+DECL_ENUMERATION("uart_bus", "usart1_PA9", 0);
+DECL_CONSTANT_STR("BUS_PINS_usart1_PA9", "PA9");
+DECL_ENUMERATION("uart_bus", "usart1_PB6", 1);
+DECL_CONSTANT_STR("BUS_PINS_usart1_PB6", "PB6");
+DECL_ENUMERATION("uart_bus", "usart2_PA2", 2);
+DECL_CONSTANT_STR("BUS_PINS_usart2_PA2", "PA2");
+DECL_ENUMERATION("uart_bus", "usart2_PD5", 3);
+DECL_CONSTANT_STR("BUS_PINS_usart2_PD5", "PD5");
+DECL_ENUMERATION("uart_bus", "usart6_PC6", 4);
+DECL_CONSTANT_STR("BUS_PINS_usart6_PC6", "PC6");
+#if !CONFIG_MACH_STM32F401
+DECL_ENUMERATION("uart_bus", "usart3_PB10", 5);
+DECL_CONSTANT_STR("BUS_PINS_usart3_PB10", "PB10");
+DECL_ENUMERATION("uart_bus", "usart3_PC10", 6);
+DECL_CONSTANT_STR("BUS_PINS_usart3_PC10", "PC10");
+DECL_ENUMERATION("uart_bus", "usart3_PD8", 7);
+DECL_CONSTANT_STR("BUS_PINS_usart3_PD8", "PD8");
+DECL_ENUMERATION("uart_bus", "uart4_PA0", 8);
+DECL_CONSTANT_STR("BUS_PINS_uart4_PA0", "PA0");
+DECL_ENUMERATION("uart_bus", "uart4_PC10", 9);
+DECL_CONSTANT_STR("BUS_PINS_uart4_PC10", "PC10");
+DECL_ENUMERATION("uart_bus", "uart5_PC12", 10);
+DECL_CONSTANT_STR("BUS_PINS_uart5_PC12", "PC12");
+#endif
+
+static const struct tmcuart_bus tmcuart_bus[] = {
+    { USART1, GPIO('A', 9), 7, TB_USART1 },
+    { USART1, GPIO('B', 6), 7, TB_USART1 },
+    { USART2, GPIO('A', 2), 7, TB_USART2 },
+    { USART2, GPIO('D', 5), 7, TB_USART2 },
+    { USART6, GPIO('C', 6), 8, TB_USART6 },
+#if !CONFIG_MACH_STM32F401
+    { USART3, GPIO('B', 10), 7, TB_USART3 },
+    { USART3, GPIO('C', 10), 7, TB_USART3 },
+    { USART3, GPIO('D', 8), 7, TB_USART3 },
+    { UART4, GPIO('A', 0), 8, TB_UART4 },
+    { UART4, GPIO('C', 10), 8, TB_UART4 },
+    { UART5, GPIO('C', 12), 8, TB_UART5 },
+#endif
+};
+
+// The usart (if any) used by the serial console
+#if CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+  #define TB_SERIAL TB_USART1
+#elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PA15_PA14 \
+      || CONFIG_STM32_SERIAL_USART2_ALT_PB4_PB3 \
+      || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+  #define TB_SERIAL TB_USART2
+#elif CONFIG_STM32_SERIAL_USART3 || CONFIG_STM32_SERIAL_USART3_ALT_PD9_PD8
+  #define TB_SERIAL TB_USART3
+#else
+  #define TB_SERIAL -1
+#endif
+
+// Currently active transfer on each usart
+static struct tmcuart_xfer *tmcuart_active[TB_UART5 + 1];
+
+#define CR1_IDLE (USART_CR1_UE | USART_CR1_TE)
+
+// Complete the transfer on a usart
+static void
+tmcuart_finish(const struct tmcuart_bus *b, struct tmcuart_xfer *x)
+{
+    b->usart->CR1 = CR1_IDLE;
+    tmcuart_active[b->index] = NULL;
+    tmcuart_hw_done(x);
+}
+
+// Handle a usart irq
+static void
+tmcuart_irq(uint32_t index)
+{
+    struct tmcuart_xfer *x = tmcuart_active[index];
+    if (!x)
+        return;
+    const struct tmcuart_bus *b = x->bus;
+    USART_TypeDef *usart = b->usart;
+    uint32_t sr = usart->SR, cr1 = usart->CR1;
+    if (cr1 & USART_CR1_TXEIE) {
+        if (!(sr & USART_SR_TXE))
+            return;
+        if (x->pos < x->write_len) {
+            usart->DR = x->data[x->pos++];
+            return;
+        }
+        // Wait for the last byte to be fully transmitted
+        usart->CR1 = CR1_IDLE | USART_CR1_TCIE;
+    } else if (cr1 & USART_CR1_TCIE) {
+        if (!(sr & USART_SR_TC))
+            return;
+        if (!x->read_len) {
+            tmcuart_finish(b, x);
+            return;
+        }
+        // Enable receiver (it is disabled during transmit to avoid
+        // reading back the echo of the transmitted bytes)
+        x->pos = 0;
+        usart->DR;
+        usart->CR1 = CR1_IDLE | USART_CR1_RE | USART_CR1_RXNEIE;
+    } else if (sr & (USART_SR_RXNE | USART_SR_ORE)) {
+        x->data[x->pos++] = usart->DR;
+        if (x->pos >= x->read_len)
+            tmcuart_finish(b, x);
+    }
+}
+
+#if TB_SERIAL != TB_USART1
+void
+TMCUART1_IRQHandler(void)
+{
+    tmcuart_irq(TB_USART1);
+}
+#endif
+#if TB_SERIAL != TB_USART2
+void
+TMCUART2_IRQHandler(void)
+{
+    tmcuart_irq(TB_USART2);
+}
+#endif
+void
+TMCUART6_IRQHandler(void)
+{
+    tmcuart_irq(TB_USART6);
+}
+#if !CONFIG_MACH_STM32F401
+#if TB_SERIAL != TB_USART3
+void
+TMCUART3_IRQHandler(void)
+{
+    tmcuart_irq(TB_USART3);
+}
+#endif
+void
+TMCUART4_IRQHandler(void)
+{
+    tmcuart_irq(TB_UART4);
+}
+void
+TMCUART5_IRQHandler(void)
+{
+    tmcuart_irq(TB_UART5);
+}
+#endif
+
+static void
+tmcuart_enable_irq(uint32_t index)
+{
+    switch (index) {
+#if TB_SERIAL != TB_USART1
+    case TB_USART1:
+        armcm_enable_irq(TMCUART1_IRQHandler, USART1_IRQn, TIMER_PRIO);
+        break;
+#endif
+#if TB_SERIAL != TB_USART2
+    case TB_USART2:
+        armcm_enable_irq(TMCUART2_IRQHandler, USART2_IRQn, TIMER_PRIO);
+        break;
+#endif
+    case TB_USART6:
+        armcm_enable_irq(TMCUART6_IRQHandler, USART6_IRQn, TIMER_PRIO);
+        break;
+#if !CONFIG_MACH_STM32F401
+#if TB_SERIAL != TB_USART3
+    case TB_USART3:
+        armcm_enable_irq(TMCUART3_IRQHandler, USART3_IRQn, TIMER_PRIO);
+        break;
+#endif
+    case TB_UART4:
+        armcm_enable_irq(TMCUART4_IRQHandler, UART4_IRQn, TIMER_PRIO);
+        break;
+    case TB_UART5:
+        armcm_enable_irq(TMCUART5_IRQHandler, UART5_IRQn, TIMER_PRIO);
+        break;
+#endif
+    }
+}
+
+void
+tmcuart_hw_setup(struct tmcuart_xfer *x, uint32_t bus, uint32_t baud)
+{
+    if (bus >= ARRAY_SIZE(tmcuart_bus))
+        shutdown("Unsupported uart bus");
+    const struct tmcuart_bus *b = &tmcuart_bus[bus];
+    if (b->index == TB_SERIAL)
+        shutdown("Uart bus is in use by serial port");
+    if (is_enabled_pclock((uint32_t)b->usart))
+        shutdown("Uart bus already configured");
+    USART_TypeDef *usart = b->usart;
+    enable_pclock((uint32_t)usart);
+    uint32_t pclk = get_pclock_frequency((uint32_t)usart);
+    usart->BRR = DIV_ROUND_CLOSEST(pclk, baud);
+    usart->CR3 = USART_CR3_HDSEL;
+    usart->CR1 = CR1_IDLE;
+    uint32_t mode = GPIO_FUNCTION(b->function) | GPIO_OPEN_DRAIN;
+    gpio_peripheral(b->tx_pin, mode, 1);
+    tmcuart_enable_irq(b->index);
+    x->bus = b;
+}
+
+// Start a transfer (called with irqs disabled)
+void
+tmcuart_hw_start(struct tmcuart_xfer *x)
+{
+    const struct tmcuart_bus *b = x->bus;
+    x->pos = 0;
+    tmcuart_active[b->index] = x;
+    b->usart->CR1 = CR1_IDLE | USART_CR1_TXEIE;
+}
+
+void
+tmcuart_hw_cancel(struct tmcuart_xfer *x)
+{
+    const struct tmcuart_bus *b = x->bus;
+    irqstatus_t flag = irq_save();
+    if (tmcuart_active[b->index] == x) {
+        b->usart->CR1 = CR1_IDLE;
+        tmcuart_active[b->index] = NULL;
+    }
+    irq_restore(flag);
+}
@@ -144,6 +144,10 @@ fifo_read_packet(uint8_t *dest, uint_fast8_t max_len)
     return xfer;
 }
 
+// Number of packets the bulk out endpoint may receive before the
+// controller must be rearmed (the rx fifo has space for them)
+#define BULK_OUT_PKTCNT 2
+
 // Reenable packet reception if it got disabled by controller
 static void
 enable_rx_endpoint(uint32_t ep)
@@ -151,7 +155,9 @@ enable_rx_endpoint(uint32_t ep)
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(ep);
     uint32_t ctl = epo->DOEPCTL;
     if (!(ctl & USB_OTG_DOEPCTL_EPENA) || ctl & USB_OTG_DOEPCTL_NAKSTS) {
-        epo->DOEPTSIZ = 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+        uint32_t pktcnt = ep == USB_CDC_EP_BULK_OUT ? BULK_OUT_PKTCNT : 1;
+        epo->DOEPTSIZ = ((pktcnt * 64)
+                         | (pktcnt << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
         epo->DOEPCTL = ctl | USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
     }
 }
@@ -208,6 +214,11 @@ usb_read_bulk_out(void *data, uint_fast8_t max_len)
     return ret;
 }
 
+// A second bulk in packet that is sent from the irq handler as soon
+// as the controller completes the transmit of the current packet
+static uint8_t bulk_in_next_buf[USB_CDC_EP_BULK_IN_SIZE];
+static uint8_t bulk_in_next_len, bulk_in_next_pending;
+
 int_fast8_t
 usb_send_bulk_in(void *data, uint_fast8_t len)
 {
@@ -219,10 +230,18 @@ usb_send_bulk_in(void *data, uint_fast8_t len)
         return len;
     }
     if (ctl & USB_OTG_DIEPCTL_EPENA) {
-        // Wait for space to transmit
         OTGD->DAINTMSK |= 1 << USB_CDC_EP_BULK_IN;
+        if (bulk_in_next_pending) {
+            // Wait for space to transmit
+            usb_irq_enable();
+            return -1;
+        }
+        // Queue packet for transmit from irq handler
+        memcpy(bulk_in_next_buf, data, len);
+        bulk_in_next_len = len;
+        bulk_in_next_pending = 1;
         usb_irq_enable();
-        return -1;
+        return len;
     }
     int_fast8_t ret = fifo_write_packet(USB_CDC_EP_BULK_IN, data, len);
     usb_irq_enable();
@@ -352,7 +371,8 @@ usb_set_configure(void)
 
     // Configure and enable USB_CDC_EP_BULK_OUT
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(USB_CDC_EP_BULK_OUT);
-    epo->DOEPTSIZ = 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+    epo->DOEPTSIZ = ((BULK_OUT_PKTCNT * 64)
+                     | (BULK_OUT_PKTCNT << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
     epo->DOEPCTL = (
         USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_USBAEP | USB_OTG_DOEPCTL_EPENA
         | (0x02 << USB_OTG_DOEPCTL_EPTYP_Pos) | USB_OTG_DOEPCTL_SD0PID_SEVNFRM
@@ -373,6 +393,7 @@ usb_set_configure(void)
                     | USB_OTG_GRSTCTL_TXFFLSH);
     while (OTG->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH)
         ;
+    bulk_in_next_pending = 0;
     usb_irq_enable();
 }
 
@@ -401,8 +422,16 @@ OTG_FS_IRQHandler(void)
         OTGD->DAINTMSK = msk & ~daint;
         if (pend & (1 << 0))
             usb_notify_ep0();
-        if (pend & (1 << USB_CDC_EP_BULK_IN))
+        if (pend & (1 << USB_CDC_EP_BULK_IN)) {
+            uint32_t ctl = EPIN(USB_CDC_EP_BULK_IN)->DIEPCTL;
+            if (bulk_in_next_pending && !(ctl & USB_OTG_DIEPCTL_EPENA)) {
+                // Transmit queued packet
+                fifo_write_packet(USB_CDC_EP_BULK_IN, bulk_in_next_buf
+                                  , bulk_in_next_len);
+                bulk_in_next_pending = 0;
+            }
             usb_notify_bulk_in();
+        }
     }
 }
 
@@ -36,7 +36,7 @@ enum {
     TS_PENDING = 1,
 };
 
-static struct task_wake thermocouple_wake;
+DECL_TASK_WAKE(thermocouple_wake);
 
 static uint_fast8_t thermocouple_event(struct timer *timer) {
     struct thermocouple_spi *spi = container_of(
@@ -194,4 +194,4 @@ thermocouple_task(void)
         }
     }
 }
-DECL_TASK(thermocouple_task);
+DECL_WAKE_TASK(thermocouple_task, thermocouple_wake);
@@ -1,16 +1,18 @@
 // Commands for sending messages to a TMC2208 via its single wire UART
 //
-// Copyright (C) 2018  Kevin O'Connor <kevin@koconnor.net>
+// Copyright (C) 2018-2026  Kevin O'Connor <kevin@koconnor.net>
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_TMCUART_HARDWARE
 #include "board/gpio.h" // gpio_out_write
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_SHUTDOWN
+#include "tmcuart.h" // tmcuart_hw_start
 
 struct tmcuart_s {
     struct timer timer;
@@ -20,24 +22,34 @@ struct tmcuart_s {
     uint8_t pos, read_count, write_count;
     uint32_t cfg_bit_time, bit_time;
     uint8_t data[10];
+    struct task_wake *poll_wake;
+#if CONFIG_TMCUART_HARDWARE
+    struct tmcuart_xfer xfer;
+#endif
 };
 
 enum {
     TU_LINE_HIGH = 1<<0, TU_ACTIVE = 1<<1, TU_READ_SYNC = 1<<2,
-    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5
+    TU_REPORT = 1<<3, TU_PULLUP = 1<<4, TU_SINGLE_WIRE = 1<<5,
+    TU_HARDWARE = 1<<6, TU_POLL = 1<<7
 };
 
-static struct task_wake tmcuart_wake;
+DECL_TASK_WAKE(tmcuart_wake);
 
 // Restore uart line to normal "idle" mode
 static void
 tmcuart_reset_line(struct tmcuart_s *t)
 {
-    if (t->flags & TU_SINGLE_WIRE)
+    if (t->flags & TU_HARDWARE) {
+        // Line is managed by the uart hardware
+    } else if (t->flags & TU_SINGLE_WIRE) {
         gpio_out_reset(t->tx_pin, 1);
-    else
+    } else {
         gpio_out_write(t->tx_pin, 1);
-    t->flags = (t->flags & (TU_PULLUP | TU_SINGLE_WIRE)) | TU_LINE_HIGH;
+    }
+    t->flags = ((t->flags & (TU_PULLUP | TU_SINGLE_WIRE | TU_HARDWARE
+                             | TU_POLL))
+                | TU_LINE_HIGH);
 }
 
 // Helper function to end a transmission and schedule a response
@@ -46,7 +58,10 @@ tmcuart_finalize(struct tmcuart_s *t)
 {
     tmcuart_reset_line(t);
     t->flags |= TU_REPORT;
-    sched_wake_task(&tmcuart_wake);
+    if (t->flags & TU_POLL)
+        sched_wake_task(t->poll_wake);
+    else
+        sched_wake_task(&tmcuart_wake);
     return SF_DONE;
 }
 
@@ -186,24 +201,103 @@ DECL_COMMAND(command_config_tmcuart,
              "config_tmcuart oid=%c rx_pin=%u pull_up=%c"
              " tx_pin=%u bit_time=%u");
 
-// Parse and schedule a TMC UART transmission request
+#if CONFIG_TMCUART_HARDWARE
+
+// Event handler for a hardware uart transmission that did not complete
+static uint_fast8_t
+tmcuart_hw_timeout_event(struct timer *timer)
+{
+    struct tmcuart_s *t = container_of(timer, struct tmcuart_s, timer);
+    tmcuart_hw_cancel(&t->xfer);
+    t->read_count = 0;
+    return tmcuart_finalize(t);
+}
+
+// Start a transmission on a hardware uart
+static void
+tmcuart_hw_send(struct tmcuart_s *t)
+{
+    // Extract the uart bytes from the request (which has start/stop bits)
+    struct tmcuart_xfer *x = &t->xfer;
+    x->write_len = t->write_count / 10;
+    x->read_len = t->read_count / 10;
+    uint_fast8_t i, j;
+    for (i=0; i<x->write_len; i++) {
+        uint8_t v = 0;
+        for (j=0; j<8; j++) {
+            uint_fast8_t pos = i*10 + 1 + j;
+            v |= ((t->data[pos >> 3] >> (pos & 0x07)) & 0x01) << j;
+        }
+        x->data[i] = v;
+    }
+    // Schedule a timeout and start the transfer
+    uint32_t bits = (x->write_len + x->read_len) * 10 + 64;
+    irq_disable();
+    t->timer.func = tmcuart_hw_timeout_event;
+    t->timer.waketime = (timer_read_time() + timer_from_us(200)
+                         + bits * t->cfg_bit_time);
+    sched_add_timer(&t->timer);
+    tmcuart_hw_start(x);
+    irq_enable();
+}
+
+// Called by board code (from irq context) when a transfer completes
 void
-command_tmcuart_send(uint32_t *args)
+tmcuart_hw_done(struct tmcuart_xfer *x)
 {
-    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
-    if (t->flags & TU_ACTIVE)
-        // Uart is busy - silently drop this request (host should retransmit)
+    struct tmcuart_s *t = container_of(x, struct tmcuart_s, xfer);
+    if (!(t->flags & TU_ACTIVE))
         return;
-    uint8_t write_len = args[1];
-    uint8_t *write = command_decode_ptr(args[2]);
-    uint8_t read_len = args[3];
+    sched_del_timer(&t->timer);
+    // Add start and stop bits to the response
+    memset(t->data, 0, sizeof(t->data));
+    uint_fast8_t i, j;
+    for (i=0; i<x->read_len; i++) {
+        uint16_t v = (x->data[i] << 1) | 0x200;
+        for (j=0; j<10; j++) {
+            uint_fast8_t pos = i*10 + j;
+            t->data[pos >> 3] |= ((v >> j) & 0x01) << (pos & 0x07);
+        }
+    }
+    tmcuart_finalize(t);
+}
+
+void
+command_config_tmcuart_bus(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_alloc(args[0], command_config_tmcuart
+                                    , sizeof(*t));
+    uint32_t baud = args[2];
+    if (!baud)
+        shutdown("Invalid tmcuart baud");
+    tmcuart_hw_setup(&t->xfer, args[1], baud);
+    t->cfg_bit_time = timer_from_us(DIV_ROUND_UP(1000000, baud));
+    t->flags = TU_LINE_HIGH | TU_HARDWARE;
+}
+DECL_COMMAND(command_config_tmcuart_bus,
+             "config_tmcuart_bus oid=%c uart_bus=%u baud=%u");
+
+#endif
+
+// Schedule a TMC UART transmission
+static void
+tmcuart_start(struct tmcuart_s *t, uint8_t write_len, uint8_t *write
+              , uint8_t read_len, uint8_t flags)
+{
     if (write_len > sizeof(t->data) || read_len > sizeof(t->data))
         shutdown("tmcuart data too large");
     memcpy(t->data, write, write_len);
     t->pos = 0;
-    t->flags = (t->flags & (TU_LINE_HIGH|TU_PULLUP|TU_SINGLE_WIRE)) | TU_ACTIVE;
+    t->flags = ((t->flags & (TU_LINE_HIGH|TU_PULLUP|TU_SINGLE_WIRE|TU_HARDWARE))
+                | TU_ACTIVE | flags);
     t->write_count = write_len * 8;
     t->read_count = read_len * 8;
+#if CONFIG_TMCUART_HARDWARE
+    if (t->flags & TU_HARDWARE) {
+        tmcuart_hw_send(t);
+        return;
+    }
+#endif
     if (write_len >= 1 && (t->data[0] & 0x3f) == 0x2a) {
         t->timer.func = tmcuart_send_sync_event;
     } else {
@@ -215,8 +309,97 @@ command_tmcuart_send(uint32_t *args)
     sched_add_timer(&t->timer);
     irq_enable();
 }
+
+// Parse and schedule a TMC UART transmission request
+void
+command_tmcuart_send(uint32_t *args)
+{
+    struct tmcuart_s *t = oid_lookup(args[0], command_config_tmcuart);
+    if (t->flags & TU_ACTIVE)
+        // Uart is busy - silently drop this request (host should retransmit)
+        return;
+    uint8_t write_len = args[1];
+    uint8_t *write = command_decode_ptr(args[2]);
+    uint8_t read_len = args[3];
+    tmcuart_start(t, write_len, write, read_len, 0);
+}
 DECL_COMMAND(command_tmcuart_send, "tmcuart_send oid=%c write=%*s read=%c");
 
+struct tmcuart_s *
+tmcuart_oid_lookup(uint8_t oid)
+{
+    return oid_lookup(oid, command_config_tmcuart);
+}
+
+// Start a transmission on behalf of other mcu code (the host does not
+// receive the response).  Returns -1 if the uart is busy.
+int
+tmcuart_poll_send(struct tmcuart_s *t, uint8_t write_len, uint8_t *write
+                  , uint8_t read_len, struct task_wake *wake)
+{
+    if (t->flags & (TU_ACTIVE | TU_REPORT))
+        return -1;
+    t->poll_wake = wake;
+    tmcuart_start(t, write_len, write, read_len, TU_POLL);
+    return 0;
+}
+
+// Check the status of a transmission started with tmcuart_poll_send().
+// Returns 0 if still in progress, 1 if complete (with data set to NULL
+// if the read failed), or -1 if the transmission was replaced by a host
+// request.
+int
+tmcuart_poll_check(struct tmcuart_s *t, uint8_t **data)
+{
+    irq_disable();
+    uint8_t flags = t->flags;
+    if ((flags & (TU_POLL | TU_REPORT)) == (TU_POLL | TU_REPORT))
+        t->flags = flags & ~(TU_POLL | TU_REPORT);
+    irq_enable();
+    if (!(flags & TU_POLL))
+        return -1;
+    if (!(flags & TU_REPORT))
+        return 0;
+    *data = t->read_count ? t->data : NULL;
+    return 1;
+}
+
+// Extract the register value from a uart read response
+int
+tmcuart_decode_read(uint8_t reg, uint8_t *data, uint32_t *value)
+{
+    // Remove start and stop bits
+    uint8_t msg[8];
+    uint_fast8_t i, j;
+    for (i=0; i<sizeof(msg); i++) {
+        uint16_t v = 0;
+        for (j=0; j<10; j++) {
+            uint_fast8_t pos = i*10 + j;
+            v |= ((data[pos >> 3] >> (pos & 0x07)) & 0x01) << j;
+        }
+        if ((v & 0x201) != 0x200)
+            return -1;
+        msg[i] = v >> 1;
+    }
+    // Verify header and crc (CRC8-ATM)
+    uint8_t crc = 0;
+    for (i=0; i<sizeof(msg)-1; i++) {
+        uint8_t b = msg[i];
+        for (j=0; j<8; j++) {
+            if ((crc >> 7) ^ (b & 0x01))
+                crc = (crc << 1) ^ 0x07;
+            else
+                crc = crc << 1;
+            b >>= 1;
+        }
+    }
+    if (msg[0] != 0x05 || msg[1] != 0xff || msg[2] != reg || msg[7] != crc)
+        return -1;
+    *value = ((uint32_t)msg[3] << 24) | ((uint32_t)msg[4] << 16)
+              | (msg[5] << 8) | msg[6];
+    return 0;
+}
+
 // Report completed response message back to host
 void
 tmcuart_task(void)
@@ -226,7 +409,7 @@ tmcuart_task(void)
     uint8_t oid;
     struct tmcuart_s *t;
     foreach_oid(oid, t, command_config_tmcuart) {
-        if (!(t->flags & TU_REPORT))
+        if ((t->flags & (TU_REPORT | TU_POLL)) != TU_REPORT)
             continue;
         irq_disable();
         t->flags &= ~TU_REPORT;
@@ -235,7 +418,7 @@ tmcuart_task(void)
               , oid, t->read_count / 8, t->data);
     }
 }
-DECL_TASK(tmcuart_task);
+DECL_WAKE_TASK(tmcuart_task, tmcuart_wake);
 
 void
 tmcuart_shutdown(void)
@@ -243,6 +426,10 @@ tmcuart_shutdown(void)
     uint8_t i;
     struct tmcuart_s *t;
     foreach_oid(i, t, command_config_tmcuart) {
+#if CONFIG_TMCUART_HARDWARE
+        if (t->flags & TU_HARDWARE)
+            tmcuart_hw_cancel(&t->xfer);
+#endif
         tmcuart_reset_line(t);
     }
 }
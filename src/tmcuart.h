@@ -0,0 +1,27 @@
+#ifndef __TMCUART_H
+#define __TMCUART_H
+
+#include <stdint.h> // uint8_t
+
+// Transfer on a hardware (half-duplex) uart (see tmcuart_hw_start())
+struct tmcuart_xfer {
+    const void *bus;
+    uint8_t write_len, read_len, pos;
+    uint8_t data[8];
+};
+
+// tmcuart.c
+void tmcuart_hw_done(struct tmcuart_xfer *x);
+struct tmcuart_s *tmcuart_oid_lookup(uint8_t oid);
+struct task_wake;
+int tmcuart_poll_send(struct tmcuart_s *t, uint8_t write_len, uint8_t *write
+                      , uint8_t read_len, struct task_wake *wake);
+int tmcuart_poll_check(struct tmcuart_s *t, uint8_t **data);
+int tmcuart_decode_read(uint8_t reg, uint8_t *data, uint32_t *value);
+
+// Board code (if CONFIG_TMCUART_HARDWARE)
+void tmcuart_hw_setup(struct tmcuart_xfer *x, uint32_t bus, uint32_t baud);
+void tmcuart_hw_start(struct tmcuart_xfer *x);
+void tmcuart_hw_cancel(struct tmcuart_xfer *x);
+
+#endif // tmcuart.h
@@ -0,0 +1,205 @@
+// Periodic polling of tmc stepper driver registers over tmcuart
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // struct timer
+#include "tmcuart.h" // tmcuart_poll_send
+
+struct tmcuart_poll_reg {
+    struct tmcuart_s *tu;
+    uint32_t mask, err_mask, last;
+    uint8_t reg, flags, request_len, request[5];
+};
+
+struct tmcuart_poll {
+    struct timer timer;
+    uint32_t rest_ticks;
+    uint8_t flags, reg_count, cur, report_count;
+    uint8_t reports[8 * 6];
+    struct tmcuart_poll_reg regs[0];
+};
+
+enum { TP_PENDING = 1<<0, TP_RUNNING = 1<<1 };
+enum { TPR_ENABLED = 1<<0, TPR_VALID = 1<<1, TPR_BUSY = 1<<2 };
+enum { TPS_OK = 0, TPS_READ_ERROR = 1 };
+
+DECL_TASK_WAKE(tmcuart_poll_wake);
+
+static uint_fast8_t
+tmcuart_poll_event(struct timer *timer)
+{
+    struct tmcuart_poll *tp = container_of(timer, struct tmcuart_poll, timer);
+    tp->flags |= TP_PENDING;
+    sched_wake_task(&tmcuart_poll_wake);
+    tp->timer.waketime += tp->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_tmcuart_poll(uint32_t *args)
+{
+    uint8_t reg_count = args[1];
+    struct tmcuart_poll *tp = oid_alloc(
+        args[0], command_config_tmcuart_poll
+        , sizeof(*tp) + sizeof(tp->regs[0]) * reg_count);
+    tp->reg_count = reg_count;
+    tp->timer.func = tmcuart_poll_event;
+}
+DECL_COMMAND(command_config_tmcuart_poll,
+             "config_tmcuart_poll oid=%c reg_count=%c");
+
+void
+command_tmcuart_poll_set_reg(uint32_t *args)
+{
+    struct tmcuart_poll *tp = oid_lookup(args[0], command_config_tmcuart_poll);
+    uint8_t pos = args[1];
+    if (pos >= tp->reg_count)
+        shutdown("Set tmcuart poll register past maximum count");
+    struct tmcuart_poll_reg *r = &tp->regs[pos];
+    uint8_t request_len = args[4];
+    if (request_len > sizeof(r->request))
+        shutdown("tmcuart poll request too large");
+    r->tu = tmcuart_oid_lookup(args[2]);
+    r->reg = args[3];
+    r->request_len = request_len;
+    memcpy(r->request, command_decode_ptr(args[5]), request_len);
+    r->mask = args[6];
+    r->err_mask = args[7];
+}
+DECL_COMMAND(command_tmcuart_poll_set_reg,
+             "tmcuart_poll_set_reg oid=%c pos=%c tmcuart_oid=%c reg=%c"
+             " request=%*s mask=%u err_mask=%u");
+
+void
+command_tmcuart_poll_query(uint32_t *args)
+{
+    struct tmcuart_poll *tp = oid_lookup(args[0], command_config_tmcuart_poll);
+    sched_del_timer(&tp->timer);
+    tp->timer.waketime = args[1];
+    tp->rest_ticks = args[2];
+    if (!tp->rest_ticks)
+        return;
+    sched_add_timer(&tp->timer);
+}
+DECL_COMMAND(command_tmcuart_poll_query,
+             "tmcuart_poll_query oid=%c clock=%u rest_ticks=%u");
+
+void
+command_tmcuart_poll_enable(uint32_t *args)
+{
+    struct tmcuart_poll *tp = oid_lookup(args[0], command_config_tmcuart_poll);
+    uint8_t pos = args[1];
+    if (pos >= tp->reg_count || !tp->regs[pos].tu)
+        shutdown("Invalid tmcuart poll register");
+    struct tmcuart_poll_reg *r = &tp->regs[pos];
+    // Always report the first value read after a change of state
+    r->flags &= ~(TPR_ENABLED | TPR_VALID);
+    if (args[2])
+        r->flags |= TPR_ENABLED;
+}
+DECL_COMMAND(command_tmcuart_poll_enable,
+             "tmcuart_poll_enable oid=%c pos=%c enable=%c");
+
+static void
+tmcuart_poll_flush(uint8_t oid, struct tmcuart_poll *tp)
+{
+    if (!tp->report_count)
+        return;
+    sendf("tmcuart_poll_result oid=%c data=%*s"
+          , oid, tp->report_count, tp->reports);
+    tp->report_count = 0;
+}
+
+static void
+tmcuart_poll_report(uint8_t oid, struct tmcuart_poll *tp, uint8_t pos
+                    , uint8_t status, uint32_t value)
+{
+    if (tp->report_count >= sizeof(tp->reports))
+        tmcuart_poll_flush(oid, tp);
+    uint8_t *p = &tp->reports[tp->report_count];
+    p[0] = pos;
+    p[1] = status;
+    p[2] = value;
+    p[3] = value >> 8;
+    p[4] = value >> 16;
+    p[5] = value >> 24;
+    tp->report_count += 6;
+}
+
+// Process the response of a completed register read
+static void
+tmcuart_poll_result(uint8_t oid, struct tmcuart_poll *tp, uint8_t pos
+                    , int ret, uint8_t *data)
+{
+    struct tmcuart_poll_reg *r = &tp->regs[pos];
+    if (!(r->flags & TPR_ENABLED) || ret < 0)
+        // Disabled or transfer taken over by a host request
+        return;
+    uint32_t value;
+    if (!data || tmcuart_decode_read(r->reg, data, &value)) {
+        tmcuart_poll_report(oid, tp, pos, TPS_READ_ERROR, 0);
+        return;
+    }
+    // Only report changes and error conditions
+    if (!(r->flags & TPR_VALID) || ((value ^ r->last) & r->mask)
+        || (value & r->err_mask))
+        tmcuart_poll_report(oid, tp, pos, TPS_OK, value);
+    r->last = value;
+    r->flags |= TPR_VALID;
+}
+
+// Read the registers of a poll cycle (one transfer at a time)
+static void
+tmcuart_poll_run(uint8_t oid, struct tmcuart_poll *tp)
+{
+    if (!(tp->flags & TP_RUNNING)) {
+        if (!(tp->flags & TP_PENDING))
+            return;
+        irq_disable();
+        tp->flags = (tp->flags & ~TP_PENDING) | TP_RUNNING;
+        irq_enable();
+        tp->cur = 0;
+    }
+    while (tp->cur < tp->reg_count) {
+        struct tmcuart_poll_reg *r = &tp->regs[tp->cur];
+        if (r->flags & TPR_BUSY) {
+            uint8_t *data;
+            int ret = tmcuart_poll_check(r->tu, &data);
+            if (!ret)
+                // Transfer still in progress
+                return;
+            r->flags &= ~TPR_BUSY;
+            tmcuart_poll_result(oid, tp, tp->cur, ret, data);
+        } else if ((r->flags & TPR_ENABLED)
+                   && !tmcuart_poll_send(r->tu, r->request_len, r->request
+                                         , 10, &tmcuart_poll_wake)) {
+            r->flags |= TPR_BUSY;
+            return;
+        }
+        // Reads of a uart in use by the host are skipped this cycle
+        tp->cur++;
+    }
+    irq_disable();
+    tp->flags &= ~TP_RUNNING;
+    irq_enable();
+    tmcuart_poll_flush(oid, tp);
+}
+
+void
+tmcuart_poll_task(void)
+{
+    if (!sched_check_wake(&tmcuart_poll_wake))
+        return;
+    uint8_t oid;
+    struct tmcuart_poll *tp;
+    foreach_oid(oid, tp, command_config_tmcuart_poll) {
+        tmcuart_poll_run(oid, tp);
+    }
+}
+DECL_WAKE_TASK(tmcuart_poll_task, tmcuart_poll_wake);
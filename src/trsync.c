@@ -21,7 +21,7 @@ struct trsync {
 
 enum { TSF_CAN_TRIGGER=1<<0, TSF_REPORT=1<<2 };
 
-static struct task_wake trsync_wake;
+DECL_TASK_WAKE(trsync_wake);
 
 // Activate a trigger
 void
@@ -189,7 +189,7 @@ trsync_task(void)
         trsync_report(oid, flags, trigger_reason, time);
     }
 }
-DECL_TASK(trsync_task);
+DECL_WAKE_TASK(trsync_task, trsync_wake);
 
 void
 trsync_shutdown(void)
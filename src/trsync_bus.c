@@ -0,0 +1,172 @@
+// Wired trigger line shared between micro-controllers
+//
+// Copyright (C) 2026  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_ENDSTOP_IRQ
+#include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // gpio_in_read
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "endstop.h" // endstop_hw_setup
+#include "sched.h" // struct timer
+#include "trsync.h" // trsync_add_signal
+
+// The line is open-drain - a trsync that triggers locally pulls it low
+// for pulse_ticks, and any mcu watching the line then triggers its
+// own trsync.
+
+struct trsync_bus {
+    struct timer time;
+    struct trsync_signal tss;
+    struct endstop_irq irq;
+    struct trsync *ts;
+    struct gpio_in in;
+    struct gpio_out out;
+    uint32_t pulse_ticks, poll_ticks;
+    uint8_t flags, pull_up, trigger_reason;
+};
+
+enum { TBF_IRQ=1<<0, TBF_WATCH=1<<1, TBF_DRIVE=1<<2 };
+
+// Release the line
+static void
+trsync_bus_release(struct trsync_bus *tb)
+{
+    if (tb->flags & TBF_DRIVE) {
+        tb->flags &= ~TBF_DRIVE;
+        gpio_in_reset(tb->in, tb->pull_up);
+    }
+}
+
+// Stop watching the line (caller must disable irqs)
+static void
+trsync_bus_unwatch(struct trsync_bus *tb)
+{
+    if (!(tb->flags & TBF_WATCH))
+        return;
+    tb->flags &= ~TBF_WATCH;
+    sched_del_timer(&tb->time);
+    if (CONFIG_ENDSTOP_IRQ && tb->flags & TBF_IRQ)
+        endstop_hw_disable(&tb->irq);
+}
+
+// The line was pulled low by another mcu
+static void
+trsync_bus_line_low(struct trsync_bus *tb)
+{
+    tb->flags &= ~TBF_WATCH;
+    trsync_do_trigger(tb->ts, tb->trigger_reason);
+}
+
+// Pin change irq callback
+static void
+trsync_bus_edge(struct endstop_irq *ei, uint32_t time)
+{
+    struct trsync_bus *tb = container_of(ei, struct trsync_bus, irq);
+    if (tb->flags & TBF_WATCH)
+        trsync_bus_line_low(tb);
+}
+
+// Timer callback that checks the line level
+static uint_fast8_t
+trsync_bus_watch_event(struct timer *t)
+{
+    struct trsync_bus *tb = container_of(t, struct trsync_bus, time);
+    uint8_t use_irq = CONFIG_ENDSTOP_IRQ && tb->flags & TBF_IRQ;
+    if (use_irq)
+        endstop_hw_enable(&tb->irq, 0);
+    if (!gpio_in_read(tb->in)) {
+        if (use_irq)
+            endstop_hw_disable(&tb->irq);
+        trsync_bus_line_low(tb);
+        return SF_DONE;
+    }
+    if (use_irq)
+        // Wait for trsync_bus_edge()
+        return SF_DONE;
+    tb->time.waketime += tb->poll_ticks;
+    return SF_RESCHEDULE;
+}
+
+// Timer callback at the end of a pulse
+static uint_fast8_t
+trsync_bus_pulse_end_event(struct timer *t)
+{
+    struct trsync_bus *tb = container_of(t, struct trsync_bus, time);
+    trsync_bus_release(tb);
+    return SF_DONE;
+}
+
+// Trsync signal callback
+static void
+trsync_bus_signal(struct trsync_signal *tss, uint8_t reason)
+{
+    struct trsync_bus *tb = container_of(tss, struct trsync_bus, tss);
+    trsync_bus_unwatch(tb);
+    if (reason == tb->trigger_reason)
+        // Trigger came from the line (or the host) - don't forward it
+        return;
+    gpio_out_reset(tb->out, 0);
+    tb->flags |= TBF_DRIVE;
+    tb->time.func = trsync_bus_pulse_end_event;
+    tb->time.waketime = timer_read_time() + tb->pulse_ticks;
+    sched_add_timer(&tb->time);
+}
+
+void
+command_config_trsync_bus(uint32_t *args)
+{
+    struct trsync_bus *tb = oid_alloc(
+        args[0], command_config_trsync_bus, sizeof(*tb));
+    tb->pull_up = args[2];
+    tb->in = gpio_in_setup(args[1], tb->pull_up);
+    tb->out = gpio_out_setup(args[1], 1);
+    gpio_in_reset(tb->in, tb->pull_up);
+    tb->pulse_ticks = args[3];
+    tb->poll_ticks = args[4];
+    tb->irq.func = trsync_bus_edge;
+    if (CONFIG_ENDSTOP_IRQ && !endstop_hw_setup(&tb->irq, args[1]))
+        tb->flags = TBF_IRQ;
+}
+DECL_COMMAND(command_config_trsync_bus,
+             "config_trsync_bus oid=%c pin=%u pull_up=%c pulse_ticks=%u"
+             " poll_ticks=%u");
+
+// Attach the line to a trsync (must be sent after trsync_start)
+void
+command_trsync_bus_start(uint32_t *args)
+{
+    struct trsync_bus *tb = oid_lookup(args[0], command_config_trsync_bus);
+    struct trsync *ts = trsync_oid_lookup(args[1]);
+    irq_disable();
+    trsync_bus_unwatch(tb);
+    sched_del_timer(&tb->time);
+    trsync_bus_release(tb);
+    tb->ts = ts;
+    tb->trigger_reason = args[2];
+    tb->time.func = trsync_bus_watch_event;
+    tb->time.waketime = args[3];
+    tb->flags |= TBF_WATCH;
+    sched_add_timer(&tb->time);
+    trsync_add_signal(ts, &tb->tss, trsync_bus_signal);
+    irq_enable();
+}
+DECL_COMMAND(command_trsync_bus_start,
+             "trsync_bus_start oid=%c trsync_oid=%c trigger_reason=%c"
+             " clock=%u");
+
+void
+trsync_bus_shutdown(void)
+{
+    uint8_t i;
+    struct trsync_bus *tb;
+    foreach_oid(i, tb, command_config_trsync_bus) {
+        trsync_bus_unwatch(tb);
+        tb->flags &= ~TBF_DRIVE;
+        gpio_in_reset(tb->in, tb->pull_up);
+    }
+}
+DECL_SHUTDOWN(trsync_bus_shutdown);